@@ -29,6 +29,12 @@
 #define MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL               -0x002A  /**< Output buffer too small. */
 #define MBEDTLS_ERR_BASE64_INVALID_CHARACTER              -0x002C  /**< Invalid character in input. */
 
+/**
+ * Size of an output buffer large enough to decode slen bytes of base64 data,
+ * whatever they hold.
+ */
+#define MBEDTLS_BASE64_DECODE_MAX_LEN( slen )   ( ( slen ) / 4 * 3 + 3 )
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -71,6 +77,11 @@ int mbedtls_base64_encode( unsigned char *dst, size_t dlen, size_t *olen,
  *
  * \note           Call this function with *dst = NULL or dlen = 0 to obtain
  *                 the required buffer size in *olen
+ *
+ * \note           If dlen is at least MBEDTLS_BASE64_DECODE_MAX_LEN( slen ),
+ *                 the data is checked and decoded in a single pass. The
+ *                 destination buffer may then have been written to when
+ *                 MBEDTLS_ERR_BASE64_INVALID_CHARACTER is returned.
  */
 int mbedtls_base64_decode( unsigned char *dst, size_t dlen, size_t *olen,
                    const unsigned char *src, size_t slen );
@@ -70,6 +70,10 @@
 #error "MBEDTLS_AESNI_C defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_BASE64_SIMD) && !defined(MBEDTLS_HAVE_ASM)
+#error "MBEDTLS_BASE64_SIMD defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_CTR_DRBG_C) && !defined(MBEDTLS_AES_C)
 #error "MBEDTLS_CTR_DRBG_C defined, but not all prerequisites"
 #endif
@@ -191,6 +195,10 @@
 #error "MBEDTLS_HAVEGE_C defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_HKDF_C) && !defined(MBEDTLS_MD_C)
+#error "MBEDTLS_HKDF_C defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_HMAC_DRBG_C) && !defined(MBEDTLS_MD_C)
 #error "MBEDTLS_HMAC_DRBG_C defined, but not all prerequisites"
 #endif
@@ -255,6 +263,10 @@
 #error "MBEDTLS_MEMORY_BUFFER_ALLOC_C defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_NET_MUX_C) && !defined(MBEDTLS_NET_C)
+#error "MBEDTLS_NET_MUX_C defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_PADLOCK_C) && !defined(MBEDTLS_HAVE_ASM)
 #error "MBEDTLS_PADLOCK_C defined, but not all prerequisites"
 #endif
@@ -512,6 +524,14 @@
 #error "MBEDTLS_SSL_PROTO_TLS1_2 defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) &&                                     \
+    ( !defined(MBEDTLS_SSL_PROTO_TLS1_2) || !defined(MBEDTLS_HKDF_C) ||       \
+      !defined(MBEDTLS_ECDH_C) || !defined(MBEDTLS_SHA256_C) ||               \
+      !defined(MBEDTLS_X509_CRT_PARSE_C) ||                                   \
+      ( !defined(MBEDTLS_GCM_C) && !defined(MBEDTLS_CCM_C) ) )
+#error "MBEDTLS_SSL_PROTO_TLS1_3 defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)     && \
     !defined(MBEDTLS_SSL_PROTO_TLS1_1)  && \
     !defined(MBEDTLS_SSL_PROTO_TLS1_2)
@@ -572,6 +592,11 @@
 #error "MBEDTLS_SSL_DTLS_BADMAC_LIMIT  defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID) &&                             \
+    ( !defined(MBEDTLS_SSL_TLS_C) || !defined(MBEDTLS_SSL_PROTO_DTLS) )
+#error "MBEDTLS_SSL_DTLS_CONNECTION_ID  defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC) &&   \
     !defined(MBEDTLS_SSL_PROTO_TLS1)   &&      \
     !defined(MBEDTLS_SSL_PROTO_TLS1_1) &&      \
@@ -590,11 +615,50 @@
 #error "MBEDTLS_SSL_TICKET_C defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING) && !defined(MBEDTLS_X509_OCSP_PARSE_C)
+#error "MBEDTLS_SSL_OCSP_STAPLING defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_SSL_OCSP_C) &&                                        \
+    ( !defined(MBEDTLS_SSL_SRV_C) || !defined(MBEDTLS_SSL_OCSP_STAPLING) )
+#error "MBEDTLS_SSL_OCSP_C defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_SSL_SNI_C) &&                                         \
+    ( !defined(MBEDTLS_SSL_SRV_C) ||                                      \
+      !defined(MBEDTLS_SSL_SERVER_NAME_INDICATION) ||                     \
+      !defined(MBEDTLS_X509_CRT_PARSE_C) || !defined(MBEDTLS_PK_PARSE_C) )
+#error "MBEDTLS_SSL_SNI_C defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_SSL_CBC_RECORD_SPLITTING) && \
     !defined(MBEDTLS_SSL_PROTO_SSL3) && !defined(MBEDTLS_SSL_PROTO_TLS1)
 #error "MBEDTLS_SSL_CBC_RECORD_SPLITTING defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH) && \
+    ( !defined(MBEDTLS_SSL_TLS_C) || defined(MBEDTLS_ZLIB_SUPPORT) )
+#error "MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA) && !defined(MBEDTLS_SSL_TLS_C)
+#error "MBEDTLS_SSL_HANDSHAKE_ARENA defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_SSL_PEER_CHAIN_IN_PLACE) && !defined(MBEDTLS_X509_CRT_PARSE_C)
+#error "MBEDTLS_SSL_PEER_CHAIN_IN_PLACE defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_SSL_SEND_FILE) && !defined(MBEDTLS_SSL_TLS_C)
+#error "MBEDTLS_SSL_SEND_FILE defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_SSL_KTLS) &&                                           \
+    ( !defined(MBEDTLS_SSL_EXPORT_KEYS) || !defined(MBEDTLS_SSL_PROTO_TLS1_2) || \
+      !defined(MBEDTLS_GCM_C) )
+#error "MBEDTLS_SSL_KTLS defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION) && \
         !defined(MBEDTLS_X509_CRT_PARSE_C)
 #error "MBEDTLS_SSL_SERVER_NAME_INDICATION defined, but not all prerequisites"
@@ -643,6 +707,39 @@
 #error "MBEDTLS_X509_CRL_PARSE_C defined, but not all prerequisites"
 #endif
 
+#if defined(MBEDTLS_X509_OCSP_PARSE_C) && ( !defined(MBEDTLS_X509_CRT_PARSE_C) )
+#error "MBEDTLS_X509_OCSP_PARSE_C defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_CA_INDEX_C) && ( !defined(MBEDTLS_X509_CRT_PARSE_C) )
+#error "MBEDTLS_X509_CA_INDEX_C defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING) && ( !defined(MBEDTLS_X509_CRT_PARSE_C) )
+#error "MBEDTLS_X509_ON_DEMAND_PARSING defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_CRT_COMPACT) && ( !defined(MBEDTLS_X509_CRT_PARSE_C) )
+#error "MBEDTLS_X509_CRT_COMPACT defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_CRL_INDEX) && ( !defined(MBEDTLS_X509_CRL_PARSE_C) )
+#error "MBEDTLS_X509_CRL_INDEX defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C) &&                               \
+    ( !defined(MBEDTLS_X509_CRT_PARSE_C) || !defined(MBEDTLS_SHA256_C) )
+#error "MBEDTLS_X509_VERIFY_CACHE_C defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_SNAPSHOT_C) && ( !defined(MBEDTLS_X509_CRT_PARSE_C) )
+#error "MBEDTLS_X509_SNAPSHOT_C defined, but not all prerequisites"
+#endif
+
+#if defined(MBEDTLS_X509_CRT_PARALLEL_C) && ( !defined(MBEDTLS_X509_CRT_PARSE_C) )
+#error "MBEDTLS_X509_CRT_PARALLEL_C defined, but not all prerequisites"
+#endif
+
 #if defined(MBEDTLS_X509_CSR_PARSE_C) && ( !defined(MBEDTLS_X509_USE_C) )
 #error "MBEDTLS_X509_CSR_PARSE_C defined, but not all prerequisites"
 #endif
@@ -455,6 +455,25 @@
  */
 //#define MBEDTLS_CAMELLIA_SMALL_MEMORY
 
+/**
+ * \def MBEDTLS_BASE64_SIMD
+ *
+ * Use SSSE3 and AVX2 instructions to encode and decode base64 data, when the
+ * processor supports them.
+ *
+ * Only used on x86-64 with GCC 4.9 or Clang, where support for the
+ * instructions is detected at runtime; other platforms keep the portable
+ * code. The results are the same, including the detection of invalid
+ * characters.
+ *
+ * Module:  library/base64.c
+ *
+ * Requires: MBEDTLS_HAVE_ASM
+ *
+ * Comment this macro to disable the use of SIMD instructions for base64.
+ */
+#define MBEDTLS_BASE64_SIMD
+
 /**
  * \def MBEDTLS_CIPHER_MODE_CBC
  *
@@ -1184,6 +1203,21 @@
  */
 #define MBEDTLS_SSL_CBC_RECORD_SPLITTING
 
+/**
+ * \def MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+ *
+ * Enable support for dynamic record sizing with TLS.
+ *
+ * When configured with mbedtls_ssl_conf_dynamic_record_sizing(), records
+ * carrying application data are kept small (about one TCP segment) at the
+ * start of a connection and after it has been idle, so that the peer can
+ * decrypt the first bytes without waiting for a full 16 KB record, and
+ * grow to full size once enough data has been sent.
+ *
+ * Comment this macro to disable support for dynamic record sizing.
+ */
+#define MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+
 /**
  * \def MBEDTLS_SSL_RENEGOTIATION
  *
@@ -1283,6 +1317,25 @@
  */
 #define MBEDTLS_SSL_PROTO_TLS1_2
 
+/**
+ * \def MBEDTLS_SSL_PROTO_TLS1_3
+ *
+ * Enable support for the TLS 1.3 1-RTT handshake (RFC 8446), with (EC)DHE
+ * key exchange, certificate or PSK resumption authentication, and the
+ * TLS1-3-AES-*-GCM and TLS1-3-AES-*-CCM ciphersuites.
+ *
+ * TLS 1.3 is only negotiated when the maximum version is set to
+ * MBEDTLS_SSL_MINOR_VERSION_4 with mbedtls_ssl_conf_max_version(). It is not
+ * available over DTLS. 0-RTT data is not supported.
+ *
+ * Requires: MBEDTLS_SSL_PROTO_TLS1_2, MBEDTLS_HKDF_C, MBEDTLS_ECDH_C,
+ *           MBEDTLS_SHA256_C, MBEDTLS_X509_CRT_PARSE_C,
+ *           MBEDTLS_GCM_C or MBEDTLS_CCM_C
+ *
+ * Comment this macro to disable support for TLS 1.3
+ */
+#define MBEDTLS_SSL_PROTO_TLS1_3
+
 /**
  * \def MBEDTLS_SSL_PROTO_DTLS
  *
@@ -1367,6 +1420,24 @@
  */
 #define MBEDTLS_SSL_DTLS_BADMAC_LIMIT
 
+/**
+ * \def MBEDTLS_SSL_DTLS_CONNECTION_ID
+ *
+ * Enable support for the DTLS Connection ID extension (RFC 9146), which
+ * lets a connection continue when the address of the peer changes, for
+ * example after a NAT rebinding, instead of requiring a new handshake.
+ *
+ * The use of a connection ID still has to be requested for each connection
+ * with mbedtls_ssl_set_cid(). A server that serves many clients from one
+ * socket also needs to route incoming datagrams by connection ID, see
+ * mbedtls_ssl_get_datagram_cid().
+ *
+ * Requires: MBEDTLS_SSL_PROTO_DTLS
+ *
+ * Comment this to disable support for connection IDs.
+ */
+#define MBEDTLS_SSL_DTLS_CONNECTION_ID
+
 /**
  * \def MBEDTLS_SSL_SESSION_TICKETS
  *
@@ -1381,6 +1452,22 @@
  */
 #define MBEDTLS_SSL_SESSION_TICKETS
 
+/**
+ * \def MBEDTLS_SSL_OCSP_STAPLING
+ *
+ * Enable support for OCSP stapling, the status_request extension of
+ * RFC 6066.
+ * Client-side, the certificate status sent by the server is checked along
+ * with the certificate. Server-side, you also need to provide a callback
+ * that returns the OCSP response for the server certificate. An example
+ * callback is provided by MBEDTLS_SSL_OCSP_C.
+ *
+ * Requires: MBEDTLS_X509_OCSP_PARSE_C
+ *
+ * Comment this macro to disable support for OCSP stapling
+ */
+#define MBEDTLS_SSL_OCSP_STAPLING
+
 /**
  * \def MBEDTLS_SSL_EXPORT_KEYS
  *
@@ -1391,6 +1478,29 @@
  */
 #define MBEDTLS_SSL_EXPORT_KEYS
 
+/**
+ * \def MBEDTLS_SSL_KTLS
+ *
+ * Enable support for handing the record layer of an established TLS 1.2
+ * connection using an AES-GCM ciphersuite over to the operating system's
+ * kernel TLS implementation (Linux kTLS, TLS_TX / TLS_RX socket options).
+ *
+ * When enabled, the traffic keys are kept in the transform after key
+ * derivation so that they can be exported with mbedtls_ssl_get_ktls_info().
+ * mbedtls_net_ktls_offload() then programs the kernel and switches the SSL
+ * context to pass-through mode, where mbedtls_ssl_read() and
+ * mbedtls_ssl_write() directly use the socket, and data can be sent with
+ * sendfile() or splice().
+ *
+ * On systems without kernel TLS support, mbedtls_net_ktls_offload() fails
+ * with MBEDTLS_ERR_NET_KTLS_UNAVAILABLE and leaves the connection untouched.
+ *
+ * Requires: MBEDTLS_SSL_EXPORT_KEYS, MBEDTLS_SSL_PROTO_TLS1_2, MBEDTLS_GCM_C
+ *
+ * Uncomment this macro to enable kernel TLS offload
+ */
+//#define MBEDTLS_SSL_KTLS
+
 /**
  * \def MBEDTLS_SSL_SERVER_NAME_INDICATION
  *
@@ -1435,6 +1545,90 @@
  */
 //#define MBEDTLS_SSL_TRUNCATED_HMAC_COMPAT
 
+/**
+ * \def MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+ *
+ * Let the input and output buffers of an SSL context be resized at run time.
+ *
+ * Buffers are allocated at their full size (see MBEDTLS_SSL_MAX_CONTENT_LEN)
+ * for the handshake, shrunk to MBEDTLS_SSL_IDLE_CONTENT_LEN bytes of payload
+ * once it completes, and grown back only when a larger record is received
+ * or written. An idle connection can also release its buffers explicitly
+ * with mbedtls_ssl_shrink_buffers(). This greatly reduces memory usage for
+ * servers holding many mostly idle connections, at the cost of extra
+ * allocations when traffic resumes.
+ *
+ * Only applies to TLS: DTLS always uses full-size buffers, as datagrams
+ * must be read in one go. Connections with renegotiation enabled keep
+ * full-size buffers too.
+ *
+ * Requires: MBEDTLS_SSL_TLS_C
+ *           !MBEDTLS_ZLIB_SUPPORT
+ *
+ * Uncomment this to enable resizable I/O buffers.
+ */
+//#define MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+
+/**
+ * \def MBEDTLS_SSL_HANDSHAKE_ARENA
+ *
+ * Let the memory used only during a handshake be served from one block per
+ * SSL context, see mbedtls_ssl_conf_handshake_arena().
+ *
+ * The handshake parameters and the buffers they own (DTLS flights and
+ * reassembly buffers, cookies, PSK, SNI and EC J-PAKE data) are carved out
+ * of the block with a simple bump allocator, and the whole block is
+ * released in one step when the handshake completes. This replaces many
+ * small allocations, which fragment the heap of a busy server, with a
+ * single one. Requests that do not fit in the block fall back to
+ * mbedtls_calloc().
+ *
+ * Requires: MBEDTLS_SSL_TLS_C
+ *
+ * Uncomment this to enable the handshake arena.
+ */
+//#define MBEDTLS_SSL_HANDSHAKE_ARENA
+
+/**
+ * \def MBEDTLS_SSL_PEER_CHAIN_IN_PLACE
+ *
+ * Parse the intermediate certificates sent by the peer where they were
+ * received instead of copying them, and free them once the chain has been
+ * verified.
+ *
+ * Only the peer's own certificate is copied, as it is part of the session.
+ * This saves an allocation of the size of every intermediate certificate
+ * and their parsed form for the rest of the connection. However,
+ * mbedtls_ssl_get_peer_cert() then returns the peer's certificate only,
+ * without the rest of the chain, and the verification callback must not
+ * keep pointers to the certificates it is passed.
+ *
+ * A client that gets a stapled OCSP response (MBEDTLS_SSL_OCSP_STAPLING)
+ * still copies the chain, as the issuer of the response is looked up in it,
+ * and frees it once the response has been checked.
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * Uncomment this to parse the peer's chain in place.
+ */
+//#define MBEDTLS_SSL_PEER_CHAIN_IN_PLACE
+
+/**
+ * \def MBEDTLS_SSL_SEND_FILE
+ *
+ * Enable mbedtls_ssl_send_file(), which sends a region of a file as
+ * application data. The file is mapped into memory with mmap(), saving the
+ * read() into an intermediate buffer. Records of GCM and CCM ciphersuites
+ * are encrypted straight from the mapping; other records are copied to the
+ * output buffer first.
+ *
+ * Requires: MBEDTLS_SSL_TLS_C
+ *           A POSIX platform providing mmap() and fstat()
+ *
+ * Uncomment this to enable sending files with mbedtls_ssl_send_file().
+ */
+//#define MBEDTLS_SSL_SEND_FILE
+
 /**
  * \def MBEDTLS_THREADING_ALT
  *
@@ -1519,6 +1713,67 @@
  */
 #define MBEDTLS_X509_CHECK_EXTENDED_KEY_USAGE
 
+/**
+ * \def MBEDTLS_X509_ON_DEMAND_PARSING
+ *
+ * Only check the issuer and subject names, the Subject Alternative Names
+ * and the extended key usage of certificates when parsing them, and decode
+ * them when they are first used. Certificates are rejected for the same
+ * errors as before, but loading a large list of trusted CAs allocates and
+ * writes much less memory, as verification compares names in DER.
+ *
+ * With this option, the issuer, subject, subject_alt_names and
+ * ext_key_usage fields of mbedtls_x509_crt are empty after parsing: use
+ * mbedtls_x509_crt_get_issuer() and the like to read them.
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * Uncomment to decode these fields of certificates on demand.
+ */
+//#define MBEDTLS_X509_ON_DEMAND_PARSING
+
+/**
+ * \def MBEDTLS_X509_CRT_COMPACT
+ *
+ * Give each parsed certificate a single allocation, sized once the parser
+ * has checked it. It holds the DER of the certificate, unless it was parsed
+ * with mbedtls_x509_crt_parse_der_nocopy(), the entries of the issuer and
+ * subject names and of the subject_alt_names and ext_key_usage lists in
+ * arrays, and the structure itself for all certificates of a chain but the
+ * first one. This saves several small allocations per certificate, and
+ * keeps the data used when walking a chain together.
+ *
+ * The fields of mbedtls_x509_crt are unchanged: the entries of the arrays
+ * are linked in order. Only the public key keeps allocations of its own.
+ *
+ * With MBEDTLS_X509_ON_DEMAND_PARSING, the lists are still decoded on first
+ * use, outside of the single allocation.
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * Uncomment to give each certificate a single allocation.
+ */
+//#define MBEDTLS_X509_CRT_COMPACT
+
+/**
+ * \def MBEDTLS_X509_CRL_INDEX
+ *
+ * Keep the revoked certificates of a CRL in an array sorted by serial
+ * number, which points into the DER of the CRL, rather than in a list of
+ * decoded entries. A CRL with many entries then takes a single allocation
+ * of 16 bytes per entry, and checking whether a certificate is revoked
+ * takes a binary search. It also enables the merging of delta CRLs, see
+ * mbedtls_x509_crl_merge_delta().
+ *
+ * With this option, the entry field of mbedtls_x509_crl is empty after
+ * parsing: use mbedtls_x509_crl_is_revoked() or mbedtls_x509_crl_info().
+ *
+ * Requires: MBEDTLS_X509_CRL_PARSE_C
+ *
+ * Uncomment to index the entries of CRLs.
+ */
+//#define MBEDTLS_X509_CRL_INDEX
+
 /**
  * \def MBEDTLS_X509_RSASSA_PSS_SUPPORT
  *
@@ -2053,6 +2308,21 @@
  */
 //#define MBEDTLS_HAVEGE_C
 
+/**
+ * \def MBEDTLS_HKDF_C
+ *
+ * Enable the HKDF algorithm (RFC 5869).
+ *
+ * Module:  library/hkdf.c
+ * Caller:  library/ssl_tls13.c
+ *
+ * Requires: MBEDTLS_MD_C
+ *
+ * This module adds support for the Hashed Message Authentication Code
+ * (HMAC)-based key derivation function (HKDF).
+ */
+#define MBEDTLS_HKDF_C
+
 /**
  * \def MBEDTLS_HMAC_DRBG_C
  *
@@ -2170,6 +2440,24 @@
  */
 #define MBEDTLS_NET_C
 
+/**
+ * \def MBEDTLS_NET_MUX_C
+ *
+ * Enable the datagram multiplexer, which serves all the clients of a DTLS
+ * server from one UDP socket, reading and writing datagrams in batches
+ * (with recvmmsg() and sendmmsg() on Linux) and routing them to each
+ * client's SSL context by address or connection ID.
+ *
+ * \note This module only works on POSIX/Unix.
+ *
+ * Module:  library/net_mux.c
+ *
+ * Requires: MBEDTLS_NET_C
+ *
+ * Uncomment to enable the datagram multiplexer.
+ */
+//#define MBEDTLS_NET_MUX_C
+
 /**
  * \def MBEDTLS_OID_C
  *
@@ -2456,6 +2744,33 @@
  */
 #define MBEDTLS_SSL_COOKIE_C
 
+/**
+ * \def MBEDTLS_SSL_OCSP_C
+ *
+ * Enable a store of OCSP responses for the certificates of a server, to be
+ * used as OCSP stapling callback.
+ *
+ * Module:  library/ssl_ocsp.c
+ * Caller:
+ *
+ * Requires: MBEDTLS_SSL_SRV_C, MBEDTLS_SSL_OCSP_STAPLING
+ */
+#define MBEDTLS_SSL_OCSP_C
+
+/**
+ * \def MBEDTLS_SSL_SNI_C
+ *
+ * Enable a server certificate store indexed by the names the certificates
+ * are valid for, to be used as SNI callback.
+ *
+ * Module:  library/ssl_sni.c
+ * Caller:
+ *
+ * Requires: MBEDTLS_SSL_SRV_C, MBEDTLS_SSL_SERVER_NAME_INDICATION,
+ *           MBEDTLS_X509_CRT_PARSE_C, MBEDTLS_PK_PARSE_C
+ */
+#define MBEDTLS_SSL_SNI_C
+
 /**
  * \def MBEDTLS_SSL_TICKET_C
  *
@@ -2615,6 +2930,82 @@
  */
 #define MBEDTLS_X509_CRL_PARSE_C
 
+/**
+ * \def MBEDTLS_X509_OCSP_PARSE_C
+ *
+ * Enable parsing and verification of OCSP responses.
+ *
+ * Module:  library/x509_ocsp.c
+ * Caller:  library/ssl_cli.c
+ *          library/ssl_ocsp.c
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * This module is required for OCSP stapling.
+ */
+#define MBEDTLS_X509_OCSP_PARSE_C
+
+/**
+ * \def MBEDTLS_X509_CA_INDEX_C
+ *
+ * Enable the index of trusted CA lists by subject and key identifier.
+ *
+ * Module:  library/x509_ca_index.c
+ * Caller:  library/x509_crt.c
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * This module lets certificate verification find the issuer of a
+ * certificate among many trusted CAs without walking the whole list.
+ */
+#define MBEDTLS_X509_CA_INDEX_C
+
+/**
+ * \def MBEDTLS_X509_VERIFY_CACHE_C
+ *
+ * Enable the cache of the results of certificate chain verification.
+ *
+ * Module:  library/x509_verify_cache.c
+ * Caller:  library/ssl_tls.c
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C, MBEDTLS_SHA256_C
+ *
+ * This module lets a server skip the signature checks when the same
+ * client certificate chain comes back, see mbedtls_ssl_conf_verify_cache().
+ */
+#define MBEDTLS_X509_VERIFY_CACHE_C
+
+/**
+ * \def MBEDTLS_X509_SNAPSHOT_C
+ *
+ * Enable binary snapshots of lists of trusted CA certificates.
+ *
+ * Module:  library/x509_snapshot.c
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * This module writes the DER of a list of certificates to a file that
+ * loads without PEM decoding or copies, mapped read-only where possible,
+ * see programs/x509/ca_snapshot.
+ */
+#define MBEDTLS_X509_SNAPSHOT_C
+
+/**
+ * \def MBEDTLS_X509_CRT_PARALLEL_C
+ *
+ * Enable the loading of certificate directories and bundles by several
+ * threads.
+ *
+ * Module:  library/x509_crt_parallel.c
+ *
+ * Requires: MBEDTLS_X509_CRT_PARSE_C
+ *
+ * Threads are only started with MBEDTLS_THREADING_PTHREAD, otherwise the
+ * loading functions run in the calling thread. They report the outcome of
+ * each file or PEM block, see mbedtls_x509_crt_parse_path_parallel().
+ */
+#define MBEDTLS_X509_CRT_PARALLEL_C
+
 /**
  * \def MBEDTLS_X509_CSR_PARSE_C
  *
@@ -2759,9 +3150,16 @@
 //#define MBEDTLS_SSL_CACHE_DEFAULT_TIMEOUT       86400 /**< 1 day  */
 //#define MBEDTLS_SSL_CACHE_DEFAULT_MAX_ENTRIES      50 /**< Maximum entries in cache */
 
+/* SSL SNI store options */
+//#define MBEDTLS_SSL_SNI_MIN_BUCKETS                64 /**< Initial size of the name index, must be a power of 2 */
+
 /* SSL options */
 //#define MBEDTLS_SSL_MAX_CONTENT_LEN             16384 /**< Maxium fragment length in bytes, determines the size of each of the two internal I/O buffers */
+//#define MBEDTLS_SSL_IDLE_CONTENT_LEN              512 /**< Payload capacity of each I/O buffer of an idle connection with MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+//#define MBEDTLS_SSL_SEND_FILE_WINDOW          1048576 /**< Largest part of a file mapped at once by mbedtls_ssl_send_file() */
 //#define MBEDTLS_SSL_DEFAULT_TICKET_LIFETIME     86400 /**< Lifetime of session tickets (if enabled) */
+//#define MBEDTLS_SSL_CID_IN_LEN_MAX                 32 /**< Maximum length of the connection ID we ask the peer to use, with MBEDTLS_SSL_DTLS_CONNECTION_ID */
+//#define MBEDTLS_SSL_CID_OUT_LEN_MAX                32 /**< Maximum length of the connection ID the peer may ask us to use, with MBEDTLS_SSL_DTLS_CONNECTION_ID */
 //#define MBEDTLS_PSK_MAX_LEN               32 /**< Max size of TLS pre-shared keys, in bytes (default 256 bits) */
 //#define MBEDTLS_SSL_COOKIE_TIMEOUT        60 /**< Default expiration delay of DTLS cookies, in seconds if HAVE_TIME, or in number of cookies issued */
 
@@ -2781,8 +3179,15 @@
 
 /* X509 options */
 //#define MBEDTLS_X509_MAX_INTERMEDIATE_CA   8   /**< Maximum number of intermediate CAs in a verification chain. */
+
+/* X509 verification cache options */
+//#define MBEDTLS_X509_VERIFY_CACHE_DEFAULT_TIMEOUT       3600 /**< 1 hour */
+//#define MBEDTLS_X509_VERIFY_CACHE_DEFAULT_MAX_ENTRIES   1024 /**< Maximum entries in cache */
 //#define MBEDTLS_X509_MAX_FILE_PATH_LEN     512 /**< Maximum length of a path/filename string in bytes including the null terminator character ('\0'). */
 
+/* X509 parallel loading options */
+//#define MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS   16 /**< Maximum number of threads of a load */
+
 /**
  * Allow SHA-1 in the default TLS configuration for certificate signing.
  * Without this build-time option, SHA-1 support must be activated explicitly
@@ -0,0 +1,302 @@
+/**
+ * \file net_mux.h
+ *
+ * \brief Datagram multiplexer for DTLS servers: many clients on one socket
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_NET_MUX_H
+#define MBEDTLS_NET_MUX_H
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#include "net_sockets.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MBEDTLS_NET_MUX_ADDR_MAX_LEN    32  /**< Room for a struct sockaddr_in6 */
+#define MBEDTLS_NET_MUX_CID_MAX_LEN     32  /**< Longest connection ID routed  */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mbedtls_net_mux mbedtls_net_mux;
+typedef struct mbedtls_net_mux_peer mbedtls_net_mux_peer;
+
+/**
+ * \brief          Callback type: extract the connection ID from a datagram
+ *
+ * \param p_cid    Opaque context for the callback
+ * \param buf      Datagram as received
+ * \param len      Length of the datagram
+ * \param cid      Buffer of MBEDTLS_NET_MUX_CID_MAX_LEN bytes for the ID
+ * \param cid_len  On success, length of the ID
+ *
+ * \return         0 if the datagram carries a connection ID, or non-zero
+ *                 to route it by the address of its sender
+ */
+typedef int mbedtls_net_mux_cid_t( void *p_cid,
+                                   const unsigned char *buf, size_t len,
+                                   unsigned char *cid, size_t *cid_len );
+
+/**
+ * \brief          One client of the multiplexer
+ *
+ * \note           The address of the client, as a struct sockaddr, is
+ *                 suitable for \c mbedtls_ssl_set_client_transport_id().
+ */
+struct mbedtls_net_mux_peer
+{
+    mbedtls_net_mux *mux;               /*!< multiplexer of the peer        */
+    void *user;                         /*!< application data, NULL when
+                                             the peer is new                */
+
+    unsigned char addr[MBEDTLS_NET_MUX_ADDR_MAX_LEN]; /*!< peer address     */
+    size_t addr_len;                    /*!< length of addr                 */
+    unsigned char cid[MBEDTLS_NET_MUX_CID_MAX_LEN];   /*!< connection ID    */
+    size_t cid_len;                     /*!< length of cid, 0 if none       */
+    unsigned char src[MBEDTLS_NET_MUX_ADDR_MAX_LEN];  /*!< sender of the last
+                                                           datagram read    */
+    size_t src_len;                     /*!< length of src                  */
+
+    uint32_t addr_hash;                 /*!< hash of addr                   */
+    uint32_t cid_hash;                  /*!< hash of cid                    */
+    mbedtls_net_mux_peer *addr_next;    /*!< next peer in the addr bucket   */
+    mbedtls_net_mux_peer *cid_next;     /*!< next peer in the cid bucket    */
+
+    size_t rx_head;                     /*!< first queued datagram          */
+    size_t rx_tail;                     /*!< last queued datagram           */
+    size_t rx_count;                    /*!< number of queued datagrams     */
+    int ready;                          /*!< in the ready list              */
+    mbedtls_net_mux_peer *ready_next;   /*!< next peer in the ready list    */
+};
+
+/**
+ * \brief          Datagram multiplexer
+ */
+struct mbedtls_net_mux
+{
+    int fd;                             /*!< bound UDP socket               */
+
+    size_t batch;                       /*!< datagrams per system call      */
+    size_t dgram_len;                   /*!< largest datagram               */
+
+    mbedtls_net_mux_peer **addr_table;  /*!< peers by address               */
+    mbedtls_net_mux_peer **cid_table;   /*!< peers by connection ID         */
+    size_t table_size;                  /*!< buckets, a power of two        */
+    size_t peers;                       /*!< current number of peers        */
+    size_t max_peers;                   /*!< limit on the number of peers   */
+
+    mbedtls_net_mux_cid_t *f_cid;       /*!< connection ID extraction       */
+    void *p_cid;                        /*!< context for f_cid              */
+
+    unsigned char *rx_buf;              /*!< receive slots                  */
+    size_t *rx_len;                     /*!< datagram length per slot       */
+    size_t *rx_next;                    /*!< slot chaining                  */
+    unsigned char *rx_addr;             /*!< sender per slot                */
+    size_t *rx_addr_len;                /*!< length of the sender           */
+    size_t rx_free;                     /*!< first free slot                */
+
+    unsigned char *tx_buf;              /*!< send slots                     */
+    size_t *tx_len;                     /*!< datagram length per slot       */
+    unsigned char *tx_addr;             /*!< destination per slot           */
+    size_t *tx_addr_len;                /*!< length of the destination      */
+    size_t tx_count;                    /*!< datagrams waiting to be sent   */
+
+    void *sys;                          /*!< system call vectors            */
+
+    mbedtls_net_mux_peer *ready_head;   /*!< peers with queued datagrams    */
+    mbedtls_net_mux_peer *ready_tail;   /*!< last peer in the ready list    */
+    mbedtls_net_mux_peer *current;      /*!< peer last returned as ready    */
+
+    size_t dropped;                     /*!< datagrams dropped on receipt   */
+};
+
+/**
+ * \brief          Initialize a multiplexer
+ *
+ * \param mux      Multiplexer to initialize
+ */
+void mbedtls_net_mux_init( mbedtls_net_mux *mux );
+
+/**
+ * \brief          Set up a multiplexer on a bound UDP socket
+ *
+ * \param mux      Multiplexer
+ * \param bind_ctx Socket bound with \c mbedtls_net_bind() and
+ *                 MBEDTLS_NET_PROTO_UDP. It is made non-blocking and must
+ *                 outlive the multiplexer.
+ * \param max_peers Maximum number of clients; datagrams from further new
+ *                 addresses are dropped
+ * \param batch    Number of datagrams read or written with one system call,
+ *                 which is also the number of datagrams that can be queued
+ *                 for the peers and for sending
+ * \param dgram_len Size of the largest datagram
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_NET_ALLOC_FAILED,
+ *                 MBEDTLS_ERR_NET_INVALID_CONTEXT or
+ *                 MBEDTLS_ERR_NET_SOCKET_FAILED
+ */
+int mbedtls_net_mux_setup( mbedtls_net_mux *mux,
+                           mbedtls_net_context *bind_ctx,
+                           size_t max_peers, size_t batch, size_t dgram_len );
+
+/**
+ * \brief          Route datagrams by connection ID in addition to the
+ *                 address of their sender.
+ *
+ *                 A datagram whose connection ID is registered with
+ *                 \c mbedtls_net_mux_set_peer_cid() goes to that peer even
+ *                 if it comes from a new address. Replies still go to the
+ *                 known address of the peer until the application calls
+ *                 \c mbedtls_net_mux_update_peer_addr().
+ *
+ * \param mux      Multiplexer
+ * \param f_cid    Connection ID extraction callback
+ * \param p_cid    Context for the callback
+ */
+void mbedtls_net_mux_set_cid_cb( mbedtls_net_mux *mux,
+                                 mbedtls_net_mux_cid_t *f_cid,
+                                 void *p_cid );
+
+/**
+ * \brief          Register the connection ID of a peer
+ *
+ * \param peer     Peer
+ * \param cid      Connection ID, or NULL to remove it
+ * \param cid_len  Length of the connection ID, at most
+ *                 MBEDTLS_NET_MUX_CID_MAX_LEN
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_NET_BUFFER_TOO_SMALL
+ */
+int mbedtls_net_mux_set_peer_cid( mbedtls_net_mux_peer *peer,
+                                  const unsigned char *cid, size_t cid_len );
+
+/**
+ * \brief          Move a peer to the address the last datagram it read
+ *                 came from.
+ *
+ * \param peer     Peer
+ *
+ * \warning        Only call this once that datagram is authenticated, for
+ *                 example when \c mbedtls_ssl_read() returned data from it:
+ *                 the sender address of a datagram is easily forged.
+ */
+void mbedtls_net_mux_update_peer_addr( mbedtls_net_mux_peer *peer );
+
+/**
+ * \brief          Receive a batch of datagrams and queue them for their
+ *                 peers, creating a peer for each new client
+ *
+ * \param mux      Multiplexer
+ * \param timeout  Maximum time to wait for the first datagram, in
+ *                 milliseconds, 0 meaning forever
+ *
+ * \return         the number of datagrams received (some of which may have
+ *                 been dropped), MBEDTLS_ERR_SSL_TIMEOUT if none arrived in
+ *                 time, MBEDTLS_ERR_SSL_WANT_READ if interrupted by a
+ *                 signal, or MBEDTLS_ERR_NET_RECV_FAILED
+ *
+ * \note           Nothing is received while all the receive slots hold
+ *                 datagrams that were not read by their peers yet.
+ */
+int mbedtls_net_mux_recv_batch( mbedtls_net_mux *mux, uint32_t timeout );
+
+/**
+ * \brief          Get the next peer with datagrams to read
+ *
+ *                 New peers have a NULL \c user field: the application
+ *                 sets up an SSL context for them, with
+ *                 \c mbedtls_net_mux_send() and \c mbedtls_net_mux_recv()
+ *                 as the BIO and the peer as their context, or closes them.
+ *
+ * \param mux      Multiplexer
+ *
+ * \return         A peer with queued datagrams, or NULL if there is none.
+ *                 A peer whose datagrams are not all read before the next
+ *                 call is returned again later.
+ */
+mbedtls_net_mux_peer *mbedtls_net_mux_next_ready( mbedtls_net_mux *mux );
+
+/**
+ * \brief          Send the queued datagrams
+ *
+ * \param mux      Multiplexer
+ *
+ * \return         0 if all the datagrams were handed to the system,
+ *                 MBEDTLS_ERR_SSL_WANT_WRITE if some are still queued,
+ *                 or MBEDTLS_ERR_NET_SEND_FAILED
+ */
+int mbedtls_net_mux_flush( mbedtls_net_mux *mux );
+
+/**
+ * \brief          Remove a peer and drop its queued datagrams.
+ *                 The application data of the peer is left alone.
+ *
+ * \param peer     Peer to remove, freed by this call
+ */
+void mbedtls_net_mux_close_peer( mbedtls_net_mux_peer *peer );
+
+/**
+ * \brief          Queue a datagram for a peer, sent at the latest by the
+ *                 next call to \c mbedtls_net_mux_flush()
+ *                 (Used as \c mbedtls_ssl_send_t callback.)
+ *
+ * \param ctx      Peer
+ * \param buf      The datagram
+ * \param len      Length of the datagram
+ *
+ * \return         len if successful, MBEDTLS_ERR_SSL_WANT_WRITE if the send
+ *                 queue is full, or MBEDTLS_ERR_NET_BUFFER_TOO_SMALL
+ */
+int mbedtls_net_mux_send( void *ctx, const unsigned char *buf, size_t len );
+
+/**
+ * \brief          Read the next datagram queued for a peer
+ *                 (Used as \c mbedtls_ssl_recv_t callback.)
+ *
+ * \param ctx      Peer
+ * \param buf      The buffer to write to
+ * \param len      Size of the buffer, the datagram being truncated if
+ *                 it is larger
+ *
+ * \return         the length of the datagram, or
+ *                 MBEDTLS_ERR_SSL_WANT_READ if none is queued
+ */
+int mbedtls_net_mux_recv( void *ctx, unsigned char *buf, size_t len );
+
+/**
+ * \brief          Free a multiplexer and all its peers.
+ *                 The socket is left open.
+ *
+ * \param mux      Multiplexer to free
+ */
+void mbedtls_net_mux_free( mbedtls_net_mux *mux );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* net_mux.h */
@@ -46,6 +46,8 @@
 #define MBEDTLS_ERR_NET_UNKNOWN_HOST                      -0x0052  /**< Failed to get an IP address for the given hostname. */
 #define MBEDTLS_ERR_NET_BUFFER_TOO_SMALL                  -0x0043  /**< Buffer is too small to hold the data. */
 #define MBEDTLS_ERR_NET_INVALID_CONTEXT                   -0x0045  /**< The context is invalid, eg because it was free()ed. */
+#define MBEDTLS_ERR_NET_KTLS_UNAVAILABLE                  -0x0047  /**< Kernel TLS offload is not available for this socket. */
+#define MBEDTLS_ERR_NET_ALLOC_FAILED                      -0x0049  /**< Memory allocation failed. */
 
 #define MBEDTLS_NET_LISTEN_BACKLOG         10 /**< The backlog that listen() should use. */
 
@@ -212,6 +214,68 @@ int mbedtls_net_send( void *ctx, const unsigned char *buf, size_t len );
 int mbedtls_net_recv_timeout( void *ctx, unsigned char *buf, size_t len,
                       uint32_t timeout );
 
+#if defined(MBEDTLS_SSL_KTLS)
+/**
+ * \brief          Hand record protection of an established TLS connection
+ *                 over to the kernel (Linux kTLS).
+ *
+ *                 The sending direction is always offloaded on success. The
+ *                 receiving direction is offloaded too if the kernel
+ *                 supports it and no data has been read ahead from the
+ *                 socket. From then on, \c mbedtls_ssl_write() and
+ *                 \c mbedtls_ssl_read() pass data straight through to the
+ *                 socket, and plain socket calls such as sendfile() may be
+ *                 used to send application data on \c ctx->fd.
+ *
+ * \note           Must be called after the handshake completed and before
+ *                 any application data is exchanged, with the context that
+ *                 was passed to \c mbedtls_ssl_set_bio().
+ *
+ * \param ctx      Socket the SSL context is using
+ * \param ssl      SSL context (TLS 1.2 with an AES-GCM ciphersuite)
+ *
+ * \return         MBEDTLS_SSL_KTLS_TX, possibly combined with
+ *                 MBEDTLS_SSL_KTLS_RX, if successful, or
+ *                 MBEDTLS_ERR_NET_KTLS_UNAVAILABLE if the kernel doesn't
+ *                 support TLS offload (in which case the connection can
+ *                 still be used normally), or another negative error code
+ *                 from \c mbedtls_ssl_get_ktls_info().
+ */
+int mbedtls_net_ktls_offload( mbedtls_net_context *ctx,
+                              mbedtls_ssl_context *ssl );
+
+/**
+ * \brief          Send a single record of the given content type on a
+ *                 socket with kernel TLS transmission enabled.
+ *                 (Used as \c mbedtls_ssl_send_record_t callback.)
+ *
+ * \param ctx      Socket
+ * \param type     Record content type
+ * \param buf      The record contents
+ * \param len      The length of the record contents
+ *
+ * \return         the number of bytes sent, or a non-zero error code
+ */
+int mbedtls_net_ktls_send_record( void *ctx, unsigned char type,
+                                  const unsigned char *buf, size_t len );
+
+/**
+ * \brief          Read at most 'len' characters of application data from
+ *                 a socket with kernel TLS reception enabled.
+ *
+ * \param ctx      Socket
+ * \param buf      The buffer to write to
+ * \param len      Maximum length of the buffer
+ *
+ * \return         the number of bytes received, or a non-zero error code:
+ *                 MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY if the peer closed the
+ *                 connection, MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE if it sent
+ *                 a fatal alert, MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE for any
+ *                 other non-application data record.
+ */
+int mbedtls_net_ktls_recv( void *ctx, unsigned char *buf, size_t len );
+#endif /* MBEDTLS_SSL_KTLS */
+
 /**
  * \brief          Gracefully shutdown the connection and free associated data
  *
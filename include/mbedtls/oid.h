@@ -167,6 +167,8 @@
  */
 #define MBEDTLS_OID_PRIVATE_KEY_USAGE_PERIOD    MBEDTLS_OID_ID_CE "\x10"
 #define MBEDTLS_OID_CRL_NUMBER                  MBEDTLS_OID_ID_CE "\x14" /**< id-ce-cRLNumber OBJECT IDENTIFIER ::= { id-ce 20 } */
+#define MBEDTLS_OID_CRL_REASON_CODE             MBEDTLS_OID_ID_CE "\x15" /**< id-ce-cRLReasons OBJECT IDENTIFIER ::= { id-ce 21 } */
+#define MBEDTLS_OID_DELTA_CRL_INDICATOR         MBEDTLS_OID_ID_CE "\x1B" /**< id-ce-deltaCRLIndicator OBJECT IDENTIFIER ::= { id-ce 27 } */
 
 /*
  * X.509 v3 Extended key usage OIDs
@@ -181,6 +183,13 @@
 #define MBEDTLS_OID_TIME_STAMPING               MBEDTLS_OID_KP "\x08" /**< id-kp-timeStamping OBJECT IDENTIFIER ::= { id-kp 8 } */
 #define MBEDTLS_OID_OCSP_SIGNING                MBEDTLS_OID_KP "\x09" /**< id-kp-OCSPSigning OBJECT IDENTIFIER ::= { id-kp 9 } */
 
+/*
+ * OCSP OIDs
+ */
+#define MBEDTLS_OID_AD                          MBEDTLS_OID_PKIX "\x30" /**< id-ad OBJECT IDENTIFIER ::= { id-pkix 48 } */
+#define MBEDTLS_OID_OCSP                        MBEDTLS_OID_AD "\x01" /**< id-pkix-ocsp OBJECT IDENTIFIER ::= { id-ad 1 } */
+#define MBEDTLS_OID_OCSP_BASIC                  MBEDTLS_OID_OCSP "\x01" /**< id-pkix-ocsp-basic OBJECT IDENTIFIER ::= { id-pkix-ocsp 1 } */
+
 /*
  * PKCS definition OIDs
  */
@@ -38,6 +38,9 @@
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
 #include "x509_crt.h"
 #include "x509_crl.h"
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+#include "x509_verify_cache.h"
+#endif
 #endif
 
 #if defined(MBEDTLS_DHM_C)
@@ -56,6 +59,10 @@
 #include "mbedtls/platform_time.h"
 #endif
 
+#if defined(MBEDTLS_SSL_SEND_FILE)
+#include <sys/types.h>
+#endif
+
 /*
  * SSL Error codes
  */
@@ -110,6 +117,7 @@
 #define MBEDTLS_ERR_SSL_UNEXPECTED_RECORD                 -0x6700  /**< Record header looks valid but is not expected. */
 #define MBEDTLS_ERR_SSL_NON_FATAL                         -0x6680  /**< The alert message received indicates a non-fatal error. */
 #define MBEDTLS_ERR_SSL_INVALID_VERIFY_HASH               -0x6600  /**< Couldn't set the hash for verifying CertificateVerify */
+#define MBEDTLS_ERR_SSL_FILE_IO_ERROR                     -0x6580  /**< Mapping the file to be sent failed. */
 
 /*
  * Various constants
@@ -119,6 +127,7 @@
 #define MBEDTLS_SSL_MINOR_VERSION_1             1   /*!< TLS v1.0 */
 #define MBEDTLS_SSL_MINOR_VERSION_2             2   /*!< TLS v1.1 */
 #define MBEDTLS_SSL_MINOR_VERSION_3             3   /*!< TLS v1.2 */
+#define MBEDTLS_SSL_MINOR_VERSION_4             4   /*!< TLS v1.3 */
 
 #define MBEDTLS_SSL_TRANSPORT_STREAM            0   /*!< TLS      */
 #define MBEDTLS_SSL_TRANSPORT_DATAGRAM          1   /*!< DTLS     */
@@ -163,6 +172,9 @@
 #define MBEDTLS_SSL_ANTI_REPLAY_DISABLED        0
 #define MBEDTLS_SSL_ANTI_REPLAY_ENABLED         1
 
+#define MBEDTLS_SSL_CID_DISABLED                0
+#define MBEDTLS_SSL_CID_ENABLED                 1
+
 #define MBEDTLS_SSL_RENEGOTIATION_NOT_ENFORCED  -1
 #define MBEDTLS_SSL_RENEGO_MAX_RECORDS_DEFAULT  16
 
@@ -177,9 +189,18 @@
 #define MBEDTLS_SSL_SESSION_TICKETS_DISABLED     0
 #define MBEDTLS_SSL_SESSION_TICKETS_ENABLED      1
 
+#define MBEDTLS_SSL_OCSP_STAPLING_DISABLED      0
+#define MBEDTLS_SSL_OCSP_STAPLING_ENABLED       1
+
 #define MBEDTLS_SSL_CBC_RECORD_SPLITTING_DISABLED    0
 #define MBEDTLS_SSL_CBC_RECORD_SPLITTING_ENABLED     1
 
+#define MBEDTLS_SSL_READ_AHEAD_DISABLED         0
+#define MBEDTLS_SSL_READ_AHEAD_ENABLED          1
+
+#define MBEDTLS_SSL_KTLS_TX                     1
+#define MBEDTLS_SSL_KTLS_RX                     2
+
 #define MBEDTLS_SSL_ARC4_ENABLED                0
 #define MBEDTLS_SSL_ARC4_DISABLED               1
 
@@ -223,6 +244,33 @@
 #define MBEDTLS_SSL_MAX_CONTENT_LEN         16384   /**< Size of the input / output buffer */
 #endif
 
+/*
+ * Payload capacity of each of the two internal I/O buffers while a
+ * connection is idle, see MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH.
+ */
+#if !defined(MBEDTLS_SSL_IDLE_CONTENT_LEN)
+#define MBEDTLS_SSL_IDLE_CONTENT_LEN        512     /**< Size of the idle input / output buffer */
+#endif
+
+/*
+ * Largest part of a file that mbedtls_ssl_send_file() maps at once.
+ */
+#if !defined(MBEDTLS_SSL_SEND_FILE_WINDOW)
+#define MBEDTLS_SSL_SEND_FILE_WINDOW        1048576 /**< Size of the file mapping window */
+#endif
+
+/*
+ * Maximum length of the connection IDs of each direction, with
+ * MBEDTLS_SSL_DTLS_CONNECTION_ID: they take room in the record header.
+ */
+#if !defined(MBEDTLS_SSL_CID_IN_LEN_MAX)
+#define MBEDTLS_SSL_CID_IN_LEN_MAX          32      /**< Longest connection ID we ask the peer to use */
+#endif
+
+#if !defined(MBEDTLS_SSL_CID_OUT_LEN_MAX)
+#define MBEDTLS_SSL_CID_OUT_LEN_MAX         32      /**< Longest connection ID the peer may ask us to use */
+#endif
+
 /* \} name SECTION: Module settings */
 
 /*
@@ -270,6 +318,7 @@
 #define MBEDTLS_SSL_MSG_ALERT                  21
 #define MBEDTLS_SSL_MSG_HANDSHAKE              22
 #define MBEDTLS_SSL_MSG_APPLICATION_DATA       23
+#define MBEDTLS_SSL_MSG_CID                    25   /* tls12_cid, RFC 9146 */
 
 #define MBEDTLS_SSL_ALERT_LEVEL_WARNING         1
 #define MBEDTLS_SSL_ALERT_LEVEL_FATAL           2
@@ -299,9 +348,12 @@
 #define MBEDTLS_SSL_ALERT_MSG_INAPROPRIATE_FALLBACK 86  /* 0x56 */
 #define MBEDTLS_SSL_ALERT_MSG_USER_CANCELED         90  /* 0x5A */
 #define MBEDTLS_SSL_ALERT_MSG_NO_RENEGOTIATION     100  /* 0x64 */
+#define MBEDTLS_SSL_ALERT_MSG_MISSING_EXTENSION    109  /* 0x6D */
 #define MBEDTLS_SSL_ALERT_MSG_UNSUPPORTED_EXT      110  /* 0x6E */
 #define MBEDTLS_SSL_ALERT_MSG_UNRECOGNIZED_NAME    112  /* 0x70 */
+#define MBEDTLS_SSL_ALERT_MSG_BAD_CERT_STATUS_RESPONSE 113 /* 0x71 */
 #define MBEDTLS_SSL_ALERT_MSG_UNKNOWN_PSK_IDENTITY 115  /* 0x73 */
+#define MBEDTLS_SSL_ALERT_MSG_CERT_REQUIRED        116  /* 0x74 */
 #define MBEDTLS_SSL_ALERT_MSG_NO_APPLICATION_PROTOCOL 120 /* 0x78 */
 
 #define MBEDTLS_SSL_HS_HELLO_REQUEST            0
@@ -309,6 +361,7 @@
 #define MBEDTLS_SSL_HS_SERVER_HELLO             2
 #define MBEDTLS_SSL_HS_HELLO_VERIFY_REQUEST     3
 #define MBEDTLS_SSL_HS_NEW_SESSION_TICKET       4
+#define MBEDTLS_SSL_HS_ENCRYPTED_EXTENSIONS     8
 #define MBEDTLS_SSL_HS_CERTIFICATE             11
 #define MBEDTLS_SSL_HS_SERVER_KEY_EXCHANGE     12
 #define MBEDTLS_SSL_HS_CERTIFICATE_REQUEST     13
@@ -316,6 +369,9 @@
 #define MBEDTLS_SSL_HS_CERTIFICATE_VERIFY      15
 #define MBEDTLS_SSL_HS_CLIENT_KEY_EXCHANGE     16
 #define MBEDTLS_SSL_HS_FINISHED                20
+#define MBEDTLS_SSL_HS_CERTIFICATE_STATUS      22
+#define MBEDTLS_SSL_HS_KEY_UPDATE              24
+#define MBEDTLS_SSL_HS_MESSAGE_HASH           254
 
 /*
  * TLS extensions
@@ -327,6 +383,9 @@
 
 #define MBEDTLS_TLS_EXT_TRUNCATED_HMAC               4
 
+#define MBEDTLS_TLS_EXT_STATUS_REQUEST               5
+#define MBEDTLS_TLS_EXT_STATUS_REQUEST_OCSP          1
+
 #define MBEDTLS_TLS_EXT_SUPPORTED_ELLIPTIC_CURVES   10
 #define MBEDTLS_TLS_EXT_SUPPORTED_POINT_FORMATS     11
 
@@ -339,6 +398,14 @@
 
 #define MBEDTLS_TLS_EXT_SESSION_TICKET              35
 
+#define MBEDTLS_TLS_EXT_PRE_SHARED_KEY              41
+#define MBEDTLS_TLS_EXT_SUPPORTED_VERSIONS          43
+#define MBEDTLS_TLS_EXT_COOKIE                      44
+#define MBEDTLS_TLS_EXT_PSK_KEY_EXCHANGE_MODES      45
+#define MBEDTLS_TLS_EXT_KEY_SHARE                   51
+
+#define MBEDTLS_TLS_EXT_CID                         54 /* RFC 9146 */
+
 #define MBEDTLS_TLS_EXT_ECJPAKE_KKPP               256 /* experimental */
 
 #define MBEDTLS_TLS_EXT_RENEGOTIATION_INFO      0xFF01
@@ -414,6 +481,10 @@ typedef enum
     MBEDTLS_SSL_HANDSHAKE_OVER,
     MBEDTLS_SSL_SERVER_NEW_SESSION_TICKET,
     MBEDTLS_SSL_SERVER_HELLO_VERIFY_REQUEST_SENT,
+    MBEDTLS_SSL_SERVER_CERTIFICATE_STATUS,
+    MBEDTLS_SSL_ENCRYPTED_EXTENSIONS,
+    MBEDTLS_SSL_SERVER_CERTIFICATE_VERIFY,
+    MBEDTLS_SSL_HELLO_RETRY_REQUEST,
 }
 mbedtls_ssl_states;
 
@@ -487,6 +558,26 @@ typedef int mbedtls_ssl_recv_timeout_t( void *ctx,
                                         unsigned char *buf,
                                         size_t len,
                                         uint32_t timeout );
+
+#if defined(MBEDTLS_SSL_KTLS)
+/**
+ * \brief          Callback type: send a complete record of the given type
+ *                 through a transport that performs record protection
+ *                 itself (e.g. a socket with kernel TLS enabled).
+ *
+ * \param ctx      Context for the callback (same as for the send callback)
+ * \param type     Record content type (MBEDTLS_SSL_MSG_XXX)
+ * \param buf      Record contents
+ * \param len      Length of the record contents
+ *
+ * \return         The callback must return the number of bytes sent, which
+ *                 must be \c len, or a non-zero error code.
+ */
+typedef int mbedtls_ssl_send_record_t( void *ctx,
+                                       unsigned char type,
+                                       const unsigned char *buf,
+                                       size_t len );
+#endif /* MBEDTLS_SSL_KTLS */
 /**
  * \brief          Callback type: set a pair of timers/delays to watch
  *
@@ -566,6 +657,9 @@ struct mbedtls_ssl_session
     unsigned char *ticket;      /*!< RFC 5077 session ticket */
     size_t ticket_len;          /*!< session ticket length   */
     uint32_t ticket_lifetime;   /*!< ticket lifetime hint    */
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    uint32_t ticket_age_add;    /*!< TLS 1.3 ticket age obfuscation */
+#endif
 #endif /* MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_CLI_C */
 
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
@@ -592,7 +686,9 @@ struct mbedtls_ssl_config
      * Pointers
      */
 
-    const int *ciphersuite_list[4]; /*!< allowed ciphersuites per version   */
+    const int *ciphersuite_list[5]; /*!< allowed ciphersuites per version   */
+    uint32_t ciphersuite_set[5][MBEDTLS_SSL_CIPHERSUITE_SLOTS / 32];
+                                    /*!< ciphersuite_list as a bitset       */
 
     /** Callback for printing debug output                                  */
     void (*f_dbg)(void *, int, const char *, int, const char *);
@@ -636,6 +732,13 @@ struct mbedtls_ssl_config
     void *p_cookie;                 /*!< context for the cookie callbacks   */
 #endif
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING) && defined(MBEDTLS_SSL_SRV_C)
+    /** Callback to write the OCSP response for the server certificate      */
+    int (*f_ocsp)( void *, const mbedtls_x509_crt *,
+                   unsigned char *, size_t, size_t * );
+    void *p_ocsp;                   /*!< context for the OCSP callback      */
+#endif
+
 #if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_SRV_C)
     /** Callback to create & write a session ticket                         */
     int (*f_ticket_write)( void *, const mbedtls_ssl_session *,
@@ -657,14 +760,19 @@ struct mbedtls_ssl_config
     mbedtls_ssl_key_cert *key_cert; /*!< own certificate/key pair(s)        */
     mbedtls_x509_crt *ca_chain;     /*!< trusted CAs                        */
     mbedtls_x509_crl *ca_crl;       /*!< trusted CAs CRLs                   */
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    mbedtls_x509_verify_cache *verify_cache; /*!< peer chain results cache  */
+#endif
 #endif /* MBEDTLS_X509_CRT_PARSE_C */
 
 #if defined(MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED)
     const int *sig_hashes;          /*!< allowed signature hashes           */
+    uint32_t sig_hash_set;          /*!< sig_hashes as a bitset             */
 #endif
 
 #if defined(MBEDTLS_ECP_C)
     const mbedtls_ecp_group_id *curve_list; /*!< allowed curves             */
+    uint32_t curve_set;             /*!< curve_list as a bitset             */
 #endif
 
 #if defined(MBEDTLS_DHM_C)
@@ -706,10 +814,24 @@ struct mbedtls_ssl_config
     unsigned int badmac_limit;      /*!< limit of records with a bad MAC    */
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    size_t cid_len;                 /*!< length of our connection IDs       */
+#endif
+
 #if defined(MBEDTLS_DHM_C) && defined(MBEDTLS_SSL_CLI_C)
     unsigned int dhm_min_bitlen;    /*!< min. bit length of the DHM prime   */
 #endif
 
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    size_t drs_small_len;           /*!< payload of small records (0: off)  */
+    size_t drs_ramp_bytes;          /*!< data sent before full records      */
+    uint32_t drs_idle_timeout;      /*!< idle seconds before going small    */
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    size_t hs_arena_len;            /*!< size of the handshake arena (0: off) */
+#endif
+
     unsigned char max_major_ver;    /*!< max. major version used            */
     unsigned char max_minor_ver;    /*!< max. minor version used            */
     unsigned char min_major_ver;    /*!< min. major version used            */
@@ -751,6 +873,9 @@ struct mbedtls_ssl_config
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
     unsigned int session_tickets : 1;   /*!< use session tickets?           */
 #endif
+#if defined(MBEDTLS_SSL_OCSP_STAPLING) && defined(MBEDTLS_SSL_CLI_C)
+    unsigned int ocsp_stapling : 1; /*!< request the certificate status?    */
+#endif
 #if defined(MBEDTLS_SSL_FALLBACK_SCSV) && defined(MBEDTLS_SSL_CLI_C)
     unsigned int fallback : 1;      /*!< is this a fallback?                */
 #endif
@@ -758,6 +883,7 @@ struct mbedtls_ssl_config
     unsigned int cert_req_ca_list : 1;  /*!< enable sending CA list in
                                           Certificate Request messages?     */
 #endif
+    unsigned int read_ahead : 1;    /*!< buffer records read in advance?    */
 };
 
 
@@ -788,6 +914,14 @@ struct mbedtls_ssl_context
     mbedtls_ssl_recv_timeout_t *f_recv_timeout;
                                 /*!< Callback for network receive with timeout */
 
+#if defined(MBEDTLS_SSL_KTLS)
+    int ktls;                   /*!< directions offloaded (KTLS_TX/RX) */
+    mbedtls_ssl_send_record_t *f_ktls_send_record;
+                                /*!< Callback for non-data records     */
+    mbedtls_ssl_recv_t *f_ktls_recv;
+                                /*!< Callback for offloaded receive    */
+#endif
+
     void *p_bio;                /*!< context for I/O operations   */
 
     /*
@@ -830,13 +964,18 @@ struct mbedtls_ssl_context
     unsigned char *in_msg;      /*!< message contents (in_iv+ivlen)   */
     unsigned char *in_offt;     /*!< read offset in application data  */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    size_t in_buf_len;          /*!< current size of in_buf           */
+#endif
+
     int in_msgtype;             /*!< record header: message type      */
     size_t in_msglen;           /*!< record header: message length    */
     size_t in_left;             /*!< amount of data read so far       */
+    size_t next_record_offset;  /*!< offset of the next record in datagram
+                                     or read-ahead data (equal to
+                                     in_left if none)                 */
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     uint16_t in_epoch;          /*!< DTLS epoch for incoming records  */
-    size_t next_record_offset;  /*!< offset of the next record in datagram
-                                     (equal to in_left if none)       */
 #endif
 #if defined(MBEDTLS_SSL_DTLS_ANTI_REPLAY)
     uint64_t in_window_top;     /*!< last validated record seq_num    */
@@ -860,9 +999,23 @@ struct mbedtls_ssl_context
     unsigned char *out_iv;      /*!< ivlen-byte IV                    */
     unsigned char *out_msg;     /*!< message contents (out_iv+ivlen)  */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    size_t out_buf_len;         /*!< current size of out_buf          */
+#endif
+
     int out_msgtype;            /*!< record header: message type      */
     size_t out_msglen;          /*!< record header: message length    */
     size_t out_left;            /*!< amount of data not yet written   */
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    uint16_t mtu;               /*!< largest datagram, 0 if unlimited */
+    int disable_datagram_packing;   /*!< one record per datagram?     */
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    int negotiate_cid;          /*!< offer or accept a connection ID? */
+    unsigned char own_cid[MBEDTLS_SSL_CID_IN_LEN_MAX];
+                                /*!< connection ID asked of the peer  */
+    uint8_t own_cid_len;        /*!< length of own_cid                */
+#endif
 
 #if defined(MBEDTLS_ZLIB_SUPPORT)
     unsigned char *compress_buf;        /*!<  zlib data buffer        */
@@ -870,6 +1023,29 @@ struct mbedtls_ssl_context
 #if defined(MBEDTLS_SSL_CBC_RECORD_SPLITTING)
     signed char split_done;     /*!< current record already splitted? */
 #endif
+#if defined(MBEDTLS_SSL_SEND_FILE)
+    size_t send_file_done;      /*!< bytes of the current file sent   */
+    const unsigned char *out_src; /*!< plaintext of the current record
+                                       if not in out_msg              */
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    int key_update_pending;     /*!< KeyUpdate answer to write or
+                                     being sent                       */
+#endif
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    size_t drs_bytes_sent;      /*!< data sent since start or idle    */
+#if defined(MBEDTLS_HAVE_TIME)
+    mbedtls_time_t drs_last_write;  /*!< time of the last record sent */
+#endif
+#endif
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    unsigned char *hs_arena;    /*!< block holding the handshake data */
+    size_t hs_arena_len;        /*!< size of hs_arena                 */
+    size_t hs_arena_used;       /*!< bytes handed out from hs_arena   */
+    size_t hs_arena_last;       /*!< offset of the last allocation    */
+    size_t hs_arena_need;       /*!< bytes requested this handshake   */
+    size_t hs_arena_peak;       /*!< largest hs_arena_need so far     */
+#endif
 
     /*
      * PKI layer
@@ -1134,6 +1310,44 @@ void mbedtls_ssl_set_bio( mbedtls_ssl_context *ssl,
                           mbedtls_ssl_recv_t *f_recv,
                           mbedtls_ssl_recv_timeout_t *f_recv_timeout );
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+/**
+ * \brief          Set the Maximum Transmission Unit (MTU) for DTLS:
+ *                 the size of the largest datagram payload the path to the
+ *                 peer carries without IP fragmentation.
+ *                 (Default: 0, no limit other than the record buffer.)
+ *
+ * \param ssl      SSL context
+ * \param mtu      Largest datagram to send, in bytes, 0 for no limit
+ *
+ * \note           Records are packed into datagrams up to this size, and
+ *                 handshake messages that don't fit, such as a long
+ *                 Certificate chain, are sent in several fragments. This
+ *                 applies to the handshake only: application data records
+ *                 are still sent as given to \c mbedtls_ssl_write().
+ *
+ * \note           The MTU should leave room for the IP and UDP headers,
+ *                 for example 1472 bytes for UDP over IPv4 on Ethernet.
+ */
+void mbedtls_ssl_set_mtu( mbedtls_ssl_context *ssl, uint16_t mtu );
+
+/**
+ * \brief          Allow or disallow packing several records into the same
+ *                 datagram when sending a handshake flight.
+ *                 (Default: allowed.)
+ *
+ * \param ssl      SSL context
+ * \param allow_packing 1 to pack records, 0 to send each in its own
+ *                 datagram, as some middleboxes or old peers expect
+ *
+ * \note           Packing reduces the number of datagrams of a handshake,
+ *                 hence the chances that the flight is hit by a loss and
+ *                 has to be retransmitted as a whole.
+ */
+void mbedtls_ssl_set_datagram_packing( mbedtls_ssl_context *ssl,
+                                       unsigned allow_packing );
+#endif /* MBEDTLS_SSL_PROTO_DTLS */
+
 /**
  * \brief          Set the timeout period for mbedtls_ssl_read()
  *                 (Default: no timeout.)
@@ -1281,6 +1495,52 @@ void mbedtls_ssl_conf_session_tickets_cb( mbedtls_ssl_config *conf,
         void *p_ticket );
 #endif /* MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_SRV_C */
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING) && defined(MBEDTLS_SSL_SRV_C)
+/**
+ * \brief           Callback type: write the OCSP response for a certificate
+ *
+ * \note            This describes what a callback implementation should do.
+ *                  This callback should copy a current DER-encoded
+ *                  OCSPResponse for the given server certificate to the
+ *                  buffer. It is called while the handshake is in progress,
+ *                  so it should not block.
+ *
+ * \param p_ocsp    Context for the callback
+ * \param crt       Server certificate chosen for the handshake
+ * \param buf       Start of the output buffer
+ * \param buf_len   Size of the output buffer
+ * \param olen      On exit, holds the length of the response, or 0 if no
+ *                  response is available for the certificate
+ *
+ * \return          0 if successful, or
+ *                  a specific MBEDTLS_ERR_XXX code to abort the handshake.
+ */
+typedef int mbedtls_ssl_ocsp_get_t( void *p_ocsp,
+                                    const mbedtls_x509_crt *crt,
+                                    unsigned char *buf,
+                                    size_t buf_len,
+                                    size_t *olen );
+
+/**
+ * \brief           Configure the OCSP stapling callback (server only).
+ *                  (Default: none.)
+ *
+ * \note            On server, OCSP stapling is enabled by providing a
+ *                  non-NULL callback. When the client asks for the status
+ *                  of the certificate, the server sends the response
+ *                  returned by the callback in a CertificateStatus message.
+ *
+ * \note            On client, use \c mbedtls_ssl_conf_ocsp_stapling().
+ *
+ * \param conf      SSL configuration context
+ * \param f_ocsp    Callback for writing an OCSP response
+ * \param p_ocsp    Context for the callback
+ */
+void mbedtls_ssl_conf_ocsp_stapling_cb( mbedtls_ssl_config *conf,
+                                        mbedtls_ssl_ocsp_get_t *f_ocsp,
+                                        void *p_ocsp );
+#endif /* MBEDTLS_SSL_OCSP_STAPLING && MBEDTLS_SSL_SRV_C */
+
 #if defined(MBEDTLS_SSL_EXPORT_KEYS)
 /**
  * \brief           Configure key export callback.
@@ -1437,6 +1697,100 @@ void mbedtls_ssl_conf_dtls_anti_replay( mbedtls_ssl_config *conf, char mode );
 void mbedtls_ssl_conf_dtls_badmac_limit( mbedtls_ssl_config *conf, unsigned limit );
 #endif /* MBEDTLS_SSL_DTLS_BADMAC_LIMIT */
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+/**
+ * \brief          Set the length of the connection IDs that the peers
+ *                 are asked to put in the records they send us.
+ *                 (DTLS only, no effect on TLS.)
+ *                 Default: 0.
+ *
+ * \param conf     SSL configuration
+ * \param len      Length of the connection IDs, at most
+ *                 MBEDTLS_SSL_CID_IN_LEN_MAX
+ *
+ * \note           All the connections of a configuration use connection
+ *                 IDs of the same length, so that the connection ID of a
+ *                 datagram can be found before knowing which connection it
+ *                 belongs to, see \c mbedtls_ssl_get_datagram_cid().
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_SSL_BAD_INPUT_DATA
+ */
+int mbedtls_ssl_conf_cid( mbedtls_ssl_config *conf, size_t len );
+
+/**
+ * \brief          Offer (client) or accept (server) the use of connection
+ *                 IDs in the next handshake. (DTLS only.)
+ *                 Default: disabled.
+ *
+ *                 With connection IDs, records carry an identifier chosen by
+ *                 their receiver and the connection is no longer tied to
+ *                 the address of the peer: it survives a NAT rebinding
+ *                 without a new handshake, provided the datagrams are
+ *                 routed by connection ID to this context.
+ *
+ * \param ssl      SSL context
+ * \param enable   MBEDTLS_SSL_CID_ENABLED or MBEDTLS_SSL_CID_DISABLED
+ * \param own_cid  Connection ID the peer is to put in the records it sends
+ *                 us, unique among the connections sharing our address
+ * \param own_cid_len Length of own_cid, which must be the length set with
+ *                 \c mbedtls_ssl_conf_cid(). It can be 0, for a client that
+ *                 doesn't need connection IDs itself but lets the server
+ *                 use one.
+ *
+ * \note           The connection ID is only used if the peer supports it
+ *                 too, see \c mbedtls_ssl_get_peer_cid().
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_SSL_BAD_INPUT_DATA
+ */
+int mbedtls_ssl_set_cid( mbedtls_ssl_context *ssl, int enable,
+                         const unsigned char *own_cid, size_t own_cid_len );
+
+/**
+ * \brief          Get the connection ID the peer asked us to use.
+ *                 (DTLS only, once the handshake is over.)
+ *
+ * \param ssl      SSL context
+ * \param enabled  Set to MBEDTLS_SSL_CID_ENABLED if connection IDs are in
+ *                 use in at least one direction, else to
+ *                 MBEDTLS_SSL_CID_DISABLED
+ * \param peer_cid Buffer of MBEDTLS_SSL_CID_OUT_LEN_MAX bytes for the
+ *                 connection ID of the peer, or NULL
+ * \param peer_cid_len Length of the connection ID of the peer, or NULL
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_SSL_BAD_INPUT_DATA if
+ *                 the handshake isn't over
+ */
+int mbedtls_ssl_get_peer_cid( const mbedtls_ssl_context *ssl, int *enabled,
+                              unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX],
+                              size_t *peer_cid_len );
+
+/**
+ * \brief          Find the connection ID of a datagram, to route it to
+ *                 its connection. (Server side, DTLS only.)
+ *                 The signature matches \c mbedtls_net_mux_cid_t.
+ *
+ * \param p_conf   SSL configuration (const mbedtls_ssl_config *), which
+ *                 gives the length of the connection IDs
+ * \param buf      Datagram as received
+ * \param len      Length of the datagram
+ * \param cid      Buffer for the connection ID, of at least the length set
+ *                 with \c mbedtls_ssl_conf_cid() (so, with the datagram
+ *                 multiplexer, that length is at most
+ *                 MBEDTLS_NET_MUX_CID_MAX_LEN)
+ * \param cid_len  On success, length of the connection ID
+ *
+ * \return         0 if the first record of the datagram carries a
+ *                 connection ID, or MBEDTLS_ERR_SSL_UNEXPECTED_RECORD
+ *
+ * \note           The connection ID is not authenticated at this point:
+ *                 only move a connection to the address of a datagram once
+ *                 \c mbedtls_ssl_read() returned data from it.
+ */
+int mbedtls_ssl_get_datagram_cid( void *p_conf,
+                                  const unsigned char *buf, size_t len,
+                                  unsigned char *cid, size_t *cid_len );
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
 /**
  * \brief          Set retransmit timeout values for the DTLS handshake.
@@ -1541,6 +1895,8 @@ int mbedtls_ssl_set_session( mbedtls_ssl_context *ssl, const mbedtls_ssl_session
  *
  *                      The ciphersuites array is not copied, and must remain
  *                      valid for the lifetime of the ssl_config.
+ *                      Membership is indexed when this function is called,
+ *                      so the contents of the array must not change later.
  *
  *                      Note: The server uses its own preferences
  *                      over the preference of the client unless
@@ -1559,6 +1915,8 @@ void mbedtls_ssl_conf_ciphersuites( mbedtls_ssl_config *conf,
  *
  *                      The ciphersuites array is not copied, and must remain
  *                      valid for the lifetime of the ssl_config.
+ *                      Membership is indexed when this function is called,
+ *                      so the contents of the array must not change later.
  *
  * \param conf          SSL configuration
  * \param ciphersuites  0-terminated list of allowed ciphersuites
@@ -1566,7 +1924,8 @@ void mbedtls_ssl_conf_ciphersuites( mbedtls_ssl_config *conf,
  *                      supported)
  * \param minor         Minor version number (MBEDTLS_SSL_MINOR_VERSION_0,
  *                      MBEDTLS_SSL_MINOR_VERSION_1 and MBEDTLS_SSL_MINOR_VERSION_2,
- *                      MBEDTLS_SSL_MINOR_VERSION_3 supported)
+ *                      MBEDTLS_SSL_MINOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_4
+ *                      supported)
  *
  * \note                With DTLS, use MBEDTLS_SSL_MINOR_VERSION_2 for DTLS 1.0
  *                      and MBEDTLS_SSL_MINOR_VERSION_3 for DTLS 1.2
@@ -1592,6 +1951,10 @@ void mbedtls_ssl_conf_cert_profile( mbedtls_ssl_config *conf,
 /**
  * \brief          Set the data required to verify peer certificate
  *
+ * \note           With many trusted CAs, index ca_chain with
+ *                 mbedtls_x509_ca_index_build() (MBEDTLS_X509_CA_INDEX_C)
+ *                 so that verification doesn't walk the whole list.
+ *
  * \param conf     SSL configuration
  * \param ca_chain trusted CA chain (meaning all fully trusted top-level CAs)
  * \param ca_crl   trusted CA CRLs
@@ -1600,6 +1963,27 @@ void mbedtls_ssl_conf_ca_chain( mbedtls_ssl_config *conf,
                                mbedtls_x509_crt *ca_chain,
                                mbedtls_x509_crl *ca_crl );
 
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+/**
+ * \brief          Set the cache of the results of peer certificate
+ *                 verification (Default: none)
+ *
+ *                 Peers that come back with the same certificate chain,
+ *                 typically clients authenticating with a certificate,
+ *                 then skip the verification of the signatures of the
+ *                 chain. The cache can be shared between configurations.
+ *
+ * \note           The verification callback set with
+ *                 mbedtls_ssl_conf_verify() is not called for chains
+ *                 found in the cache.
+ *
+ * \param conf     SSL configuration
+ * \param cache    verification cache, or NULL to verify every chain
+ */
+void mbedtls_ssl_conf_verify_cache( mbedtls_ssl_config *conf,
+                                    mbedtls_x509_verify_cache *cache );
+#endif /* MBEDTLS_X509_VERIFY_CACHE_C */
+
 /**
  * \brief          Set own certificate chain and private key
  *
@@ -1799,6 +2183,10 @@ void mbedtls_ssl_conf_dhm_min_bitlen( mbedtls_ssl_config *conf,
  * \note           This list should be ordered by decreasing preference
  *                 (preferred curve first).
  *
+ * \note           The list is not copied and is indexed when this function
+ *                 is called: it must remain valid and unchanged for the
+ *                 lifetime of the configuration.
+ *
  * \param conf     SSL configuration
  * \param curves   Ordered list of allowed curves,
  *                 terminated by MBEDTLS_ECP_DP_NONE.
@@ -1822,6 +2210,10 @@ void mbedtls_ssl_conf_curves( mbedtls_ssl_config *conf,
  * \note           This list should be ordered by decreasing preference
  *                 (preferred hash first).
  *
+ * \note           The list is not copied and is indexed when this function
+ *                 is called: it must remain valid and unchanged for the
+ *                 lifetime of the configuration.
+ *
  * \param conf     SSL configuration
  * \param hashes   Ordered list of allowed signature hashes,
  *                 terminated by \c MBEDTLS_MD_NONE.
@@ -1986,11 +2378,16 @@ const char *mbedtls_ssl_get_alpn_protocol( const mbedtls_ssl_context *ssl );
  * \note           With DTLS, use MBEDTLS_SSL_MINOR_VERSION_2 for DTLS 1.0 and
  *                 MBEDTLS_SSL_MINOR_VERSION_3 for DTLS 1.2
  *
+ * \note           TLS 1.3 (MBEDTLS_SSL_MINOR_VERSION_4) is never enabled by
+ *                 default. It is offered and accepted only over TLS, and only
+ *                 when it is set explicitly here.
+ *
  * \param conf     SSL configuration
  * \param major    Major version number (only MBEDTLS_SSL_MAJOR_VERSION_3 supported)
  * \param minor    Minor version number (MBEDTLS_SSL_MINOR_VERSION_0,
  *                 MBEDTLS_SSL_MINOR_VERSION_1 and MBEDTLS_SSL_MINOR_VERSION_2,
- *                 MBEDTLS_SSL_MINOR_VERSION_3 supported)
+ *                 MBEDTLS_SSL_MINOR_VERSION_3, MBEDTLS_SSL_MINOR_VERSION_4
+ *                 supported)
  */
 void mbedtls_ssl_conf_max_version( mbedtls_ssl_config *conf, int major, int minor );
 
@@ -2146,6 +2543,105 @@ void mbedtls_ssl_conf_truncated_hmac( mbedtls_ssl_config *conf, int truncate );
 void mbedtls_ssl_conf_cbc_record_splitting( mbedtls_ssl_config *conf, char split );
 #endif /* MBEDTLS_SSL_CBC_RECORD_SPLITTING */
 
+/**
+ * \brief          Enable / Disable read-ahead on stream transports
+ *                 (Default: MBEDTLS_SSL_READ_AHEAD_DISABLED)
+ *
+ * \note           When enabled, each call to the receive callback asks for
+ *                 as many bytes as fit into the input buffer instead of
+ *                 exactly the bytes missing from the current record.
+ *                 Surplus data is kept and the following records are
+ *                 parsed from memory, saving (at least) two calls to the
+ *                 receive callback per record.
+ *
+ * \note           Since records may then be buffered inside the SSL
+ *                 context, event-driven applications must not rely only on
+ *                 the readability of the underlying socket: use
+ *                 \c mbedtls_ssl_check_pending() before waiting for more
+ *                 data.
+ *
+ * \note           Has no effect with DTLS, where whole datagrams are
+ *                 always read at once, and is ignored when
+ *                 MBEDTLS_ZLIB_SUPPORT is defined, as decompression
+ *                 expands records in place.
+ *
+ * \param conf     SSL configuration
+ * \param read_ahead MBEDTLS_SSL_READ_AHEAD_ENABLED or
+ *                 MBEDTLS_SSL_READ_AHEAD_DISABLED
+ */
+void mbedtls_ssl_conf_read_ahead( mbedtls_ssl_config *conf, int read_ahead );
+
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+/**
+ * \brief          Configure dynamic record sizing for TLS.
+ *                 (Default: disabled, all records are filled up to the
+ *                 maximum fragment length.)
+ *
+ *                 Application data records carry at most \c small_len bytes
+ *                 until \c ramp_bytes bytes have been written, then use the
+ *                 maximum size. If nothing has been written for
+ *                 \c idle_timeout seconds, records start small again, as
+ *                 the congestion window of the connection is likely to have
+ *                 been reset.
+ *
+ * \note           A good value for \c small_len is one TCP segment minus
+ *                 the record and IP/TCP overhead, e.g. 1300 bytes, with
+ *                 \c ramp_bytes around 1 MB and \c idle_timeout of 1 second.
+ *
+ * \note           Has no effect with DTLS, where the application chooses
+ *                 the size of each record. The idle timeout is only
+ *                 available with MBEDTLS_HAVE_TIME.
+ *
+ * \param conf     SSL configuration
+ * \param small_len Maximum payload of small records, or 0 to disable
+ * \param ramp_bytes Amount of data to write before switching to full-size
+ *                 records
+ * \param idle_timeout Idle period in seconds after which records start
+ *                 small again, or 0 to never go back to small records
+ */
+void mbedtls_ssl_conf_dynamic_record_sizing( mbedtls_ssl_config *conf,
+                                             size_t small_len,
+                                             size_t ramp_bytes,
+                                             uint32_t idle_timeout );
+#endif /* MBEDTLS_SSL_DYNAMIC_RECORD_SIZING */
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+/**
+ * \brief          Serve the memory used only during the handshake from a
+ *                 single block of \c len bytes per SSL context.
+ *                 (Default: 0, every item is allocated separately.)
+ *
+ *                 The block is allocated when a handshake starts and freed
+ *                 as a whole when it completes. Items that do not fit fall
+ *                 back to \c mbedtls_calloc(), so a small arena only costs
+ *                 performance, never correctness. Use
+ *                 \c mbedtls_ssl_get_handshake_arena_peak() to find a size
+ *                 that holds a whole handshake.
+ *
+ * \note           Bignum limbs of the key exchange contexts and the peer
+ *                 certificate, which outlives the handshake in the session,
+ *                 are still allocated separately.
+ *
+ * \param conf     SSL configuration
+ * \param len      Size of the arena in bytes, or 0 to disable it
+ */
+void mbedtls_ssl_conf_handshake_arena( mbedtls_ssl_config *conf, size_t len );
+
+/**
+ * \brief          Return the largest amount of handshake memory used by a
+ *                 handshake on this context so far, including the memory
+ *                 that did not fit in the arena.
+ *
+ * \param ssl      SSL context
+ *
+ * \return         Arena size (in bytes) that would have served all the
+ *                 handshakes of this context without falling back to
+ *                 \c mbedtls_calloc(). This is tracked even when the arena
+ *                 is disabled.
+ */
+size_t mbedtls_ssl_get_handshake_arena_peak( const mbedtls_ssl_context *ssl );
+#endif /* MBEDTLS_SSL_HANDSHAKE_ARENA */
+
 #if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_CLI_C)
 /**
  * \brief          Enable / Disable session tickets (client only).
@@ -2160,6 +2656,28 @@ void mbedtls_ssl_conf_cbc_record_splitting( mbedtls_ssl_config *conf, char split
 void mbedtls_ssl_conf_session_tickets( mbedtls_ssl_config *conf, int use_tickets );
 #endif /* MBEDTLS_SSL_SESSION_TICKETS && MBEDTLS_SSL_CLI_C */
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING) && defined(MBEDTLS_SSL_CLI_C)
+/**
+ * \brief          Enable / Disable OCSP stapling requests (client only).
+ *                 (Default: MBEDTLS_SSL_OCSP_STAPLING_DISABLED.)
+ *
+ *                 When enabled, the client asks the server for the OCSP
+ *                 status of its certificate. A stapled response is checked
+ *                 against the trusted CAs and merged into the verification
+ *                 result: MBEDTLS_X509_BADCERT_REVOKED if the certificate is
+ *                 revoked, MBEDTLS_X509_BADOCSP_XXX if the response is not
+ *                 valid. With MBEDTLS_SSL_VERIFY_REQUIRED, either aborts the
+ *                 handshake. A server may not staple any response.
+ *
+ * \note           On server, use \c mbedtls_ssl_conf_ocsp_stapling_cb().
+ *
+ * \param conf     SSL configuration
+ * \param stapling Enable or disable (MBEDTLS_SSL_OCSP_STAPLING_ENABLED or
+ *                                    MBEDTLS_SSL_OCSP_STAPLING_DISABLED)
+ */
+void mbedtls_ssl_conf_ocsp_stapling( mbedtls_ssl_config *conf, int stapling );
+#endif /* MBEDTLS_SSL_OCSP_STAPLING && MBEDTLS_SSL_CLI_C */
+
 #if defined(MBEDTLS_SSL_RENEGOTIATION)
 /**
  * \brief          Enable / Disable renegotiation support for connection when
@@ -2288,6 +2806,137 @@ void mbedtls_ssl_conf_renegotiation_period( mbedtls_ssl_config *conf,
  */
 size_t mbedtls_ssl_get_bytes_avail( const mbedtls_ssl_context *ssl );
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+/**
+ * \brief          Shrink the input and output buffers of an idle connection
+ *                 to MBEDTLS_SSL_IDLE_CONTENT_LEN bytes of payload each.
+ *
+ *                 Buffers are shrunk automatically when a handshake
+ *                 completes, and grown back as needed by
+ *                 \c mbedtls_ssl_read() and \c mbedtls_ssl_write(). Call
+ *                 this when a connection goes idle (for example while
+ *                 waiting for the next request on a keep-alive connection)
+ *                 to release the memory used by a previous large record.
+ *
+ * \note           Buffers are kept at their full size while renegotiation
+ *                 is enabled (see \c mbedtls_ssl_conf_renegotiation()), so
+ *                 that a renegotiation does not have to grow them back on
+ *                 a heap fragmented by the handshake.
+ *
+ * \note           The memory is returned with \c mbedtls_free(), so it
+ *                 goes back to whichever allocator or pool has been set up
+ *                 with the platform layer.
+ *
+ * \param ssl      SSL context
+ *
+ * \return         0 if the buffers are (now) small,
+ *                 MBEDTLS_ERR_SSL_BAD_INPUT_DATA if the connection is not
+ *                 idle (a handshake is in progress, data is pending in the
+ *                 input buffer or waiting to be sent, or the transport is
+ *                 DTLS) or if renegotiation is enabled, or
+ *                 MBEDTLS_ERR_SSL_ALLOC_FAILED.
+ */
+int mbedtls_ssl_shrink_buffers( mbedtls_ssl_context *ssl );
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
+/**
+ * \brief          Check if there is data already read from the underlying
+ *                 transport but not yet processed.
+ *
+ * \param ssl      SSL context
+ *
+ * \return         0 if nothing's pending, 1 otherwise.
+ *
+ * \note           This is different from \c mbedtls_ssl_get_bytes_avail()
+ *                 in that it also considers records that have been read
+ *                 (with DTLS or with read-ahead enabled) but not yet
+ *                 decrypted. If this function returns 1, calling
+ *                 \c mbedtls_ssl_read() will make progress without
+ *                 calling the receive callback, so applications must not
+ *                 wait for the underlying transport to become readable.
+ */
+int mbedtls_ssl_check_pending( const mbedtls_ssl_context *ssl );
+
+#if defined(MBEDTLS_SSL_KTLS)
+/**
+ * \brief          Traffic secrets and state of one direction of an
+ *                 established connection, in the form expected by kernel
+ *                 TLS implementations.
+ */
+typedef struct
+{
+    mbedtls_cipher_type_t cipher;   /*!< MBEDTLS_CIPHER_AES_xxx_GCM        */
+    int minor_ver;                  /*!< MBEDTLS_SSL_MINOR_VERSION_3       */
+    unsigned char key[32];          /*!< traffic key                       */
+    size_t key_len;                 /*!< traffic key length in bytes       */
+    unsigned char salt[4];          /*!< implicit part of the nonce        */
+    unsigned char iv[8];            /*!< next explicit part of the nonce   */
+    unsigned char rec_seq[8];       /*!< next record sequence number       */
+}
+mbedtls_ssl_ktls_info;
+
+/**
+ * \brief          Export the traffic keys and record sequence number of one
+ *                 direction of an established connection, in order to hand
+ *                 record protection over to the kernel.
+ *
+ * \note           Only TLS 1.2 connections over a stream transport using an
+ *                 AES-GCM ciphersuite are supported.
+ *
+ * \note           The exported state is only valid until the next record
+ *                 is sent or received in that direction by this context.
+ *                 Most applications should use \c mbedtls_net_ktls_offload()
+ *                 rather than calling this function directly.
+ *
+ * \param ssl      SSL context
+ * \param direction MBEDTLS_SSL_KTLS_TX or MBEDTLS_SSL_KTLS_RX
+ * \param info     Structure to fill (must be wiped after use)
+ *
+ * \return         0 if successful,
+ *                 MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE if the negotiated
+ *                 parameters can't be offloaded,
+ *                 MBEDTLS_ERR_SSL_BAD_INPUT_DATA if the handshake is not
+ *                 over or, for the receiving direction, if data has
+ *                 already been read from the transport but not returned
+ *                 to the application yet (for the sending direction: if
+ *                 data is still waiting to be sent).
+ */
+int mbedtls_ssl_get_ktls_info( const mbedtls_ssl_context *ssl, int direction,
+                               mbedtls_ssl_ktls_info *info );
+
+/**
+ * \brief          Switch the given directions of the connection to
+ *                 pass-through mode, after the keys obtained with
+ *                 \c mbedtls_ssl_get_ktls_info() have been installed in the
+ *                 transport.
+ *
+ *                 In the sending direction, \c mbedtls_ssl_write() then
+ *                 passes application data directly to the send callback set
+ *                 with \c mbedtls_ssl_set_bio(), and alerts (including
+ *                 close_notify) are sent with \c f_send_record. In the
+ *                 receiving direction, \c mbedtls_ssl_read() returns
+ *                 whatever \c f_recv returns.
+ *
+ * \note           Renegotiation is refused once any direction is offloaded.
+ *                 The read timeout is not applied to offloaded reads.
+ *
+ * \param ssl      SSL context
+ * \param directions Combination of MBEDTLS_SSL_KTLS_TX and
+ *                 MBEDTLS_SSL_KTLS_RX
+ * \param f_send_record Callback for sending non-application data records
+ *                 (required if MBEDTLS_SSL_KTLS_TX is set)
+ * \param f_recv   Callback for receiving application data, which must
+ *                 report alerts as MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY or
+ *                 MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE (required if
+ *                 MBEDTLS_SSL_KTLS_RX is set)
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_SSL_BAD_INPUT_DATA.
+ */
+int mbedtls_ssl_set_ktls( mbedtls_ssl_context *ssl, int directions,
+                          mbedtls_ssl_send_record_t *f_send_record,
+                          mbedtls_ssl_recv_t *f_recv );
+#endif /* MBEDTLS_SSL_KTLS */
+
 /**
  * \brief          Return the result of the certificate verification
  *
@@ -2528,6 +3177,44 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
  */
 int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len );
 
+#if defined(MBEDTLS_SSL_SEND_FILE)
+/**
+ * \brief          Write 'len' bytes of the file 'fd', starting at 'offset',
+ *                 as application data.
+ *
+ *                 The file is mapped into memory in windows of at most
+ *                 MBEDTLS_SSL_SEND_FILE_WINDOW bytes, without reading the
+ *                 file into an intermediate buffer. With GCM and CCM
+ *                 ciphersuites, records are encrypted directly from the
+ *                 mapping into the output buffer. Other ciphersuites, and
+ *                 records that are compressed or carry an inner content
+ *                 type, copy the plaintext into the output buffer first,
+ *                 as \c mbedtls_ssl_write() does.
+ *
+ * \param ssl      SSL context
+ * \param fd       File descriptor of a regular file, open for reading
+ * \param offset   Offset of the first byte to send
+ * \param len      Number of bytes to send
+ *
+ * \return         0 once all 'len' bytes have been written,
+ *                 or MBEDTLS_ERR_SSL_WANT_WRITE or MBEDTLS_ERR_SSL_WANT_READ,
+ *                 MBEDTLS_ERR_SSL_BAD_INPUT_DATA if the region extends past
+ *                 the end of the file,
+ *                 MBEDTLS_ERR_SSL_FILE_IO_ERROR if the file can't be mapped,
+ *                 or another negative error code from \c mbedtls_ssl_write().
+ *
+ * \note           When this function returns MBEDTLS_ERR_SSL_WANT_WRITE/READ,
+ *                 it must be called later with the *same* arguments; it
+ *                 resumes after the last byte that was written.
+ *
+ * \note           The file must not be truncated while it is being sent, as
+ *                 accessing a mapped page past the end of the file raises
+ *                 SIGBUS.
+ */
+int mbedtls_ssl_send_file( mbedtls_ssl_context *ssl, int fd,
+                           off_t offset, size_t len );
+#endif /* MBEDTLS_SSL_SEND_FILE */
+
 /**
  * \brief           Send an alert message
  *
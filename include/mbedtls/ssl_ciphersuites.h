@@ -232,6 +232,12 @@ extern "C" {
 
 #define MBEDTLS_TLS_ECJPAKE_WITH_AES_128_CCM_8          0xC0FF  /**< experimental */
 
+/* RFC 8446: the key exchange and authentication are negotiated separately */
+#define MBEDTLS_TLS1_3_AES_128_GCM_SHA256               0x1301  /**< TLS 1.3 */
+#define MBEDTLS_TLS1_3_AES_256_GCM_SHA384               0x1302  /**< TLS 1.3 */
+#define MBEDTLS_TLS1_3_AES_128_CCM_SHA256               0x1304  /**< TLS 1.3 */
+#define MBEDTLS_TLS1_3_AES_128_CCM_8_SHA256             0x1305  /**< TLS 1.3 */
+
 /* Reminder: update mbedtls_ssl_premaster_secret when adding a new key exchange.
  * Reminder: update MBEDTLS_KEY_EXCHANGE__xxx below
  */
@@ -330,6 +336,12 @@ typedef struct mbedtls_ssl_ciphersuite_t mbedtls_ssl_ciphersuite_t;
                                                      eg for CCM_8 */
 #define MBEDTLS_CIPHERSUITE_NODTLS     0x04    /**< Can't be used with DTLS */
 
+/*
+ * All ciphersuites we know of have an ID of the form 0x00XX, 0xC0XX or 0x13XX,
+ * which gives a small direct index, see mbedtls_ssl_ciphersuite_slot()
+ */
+#define MBEDTLS_SSL_CIPHERSUITE_SLOTS  768
+
 /**
  * \brief   This structure is used for storing ciphersuite information
  */
@@ -415,6 +427,14 @@ static inline int mbedtls_ssl_ciphersuite_uses_ecdh( const mbedtls_ssl_ciphersui
 }
 #endif /* MBEDTLS_KEY_EXCHANGE__SOME__ECDH_ENABLED */
 
+/*
+ * TLS 1.3 ciphersuites only name the AEAD and the hash of the key schedule
+ */
+static inline int mbedtls_ssl_ciphersuite_is_tls13( const mbedtls_ssl_ciphersuite_t *info )
+{
+    return( info->min_minor_ver >= 4 /* MBEDTLS_SSL_MINOR_VERSION_4 */ );
+}
+
 static inline int mbedtls_ssl_ciphersuite_cert_req_allowed( const mbedtls_ssl_ciphersuite_t *info )
 {
     switch( info->key_exchange )
@@ -463,6 +483,28 @@ static inline int mbedtls_ssl_ciphersuite_uses_ecdhe( const mbedtls_ssl_ciphersu
 }
 #endif /* MBEDTLS_KEY_EXCHANGE__SOME__ECDHE_ENABLED) */
 
+/*
+ * Internal: position of a ciphersuite ID in the direct index, or -1 if it is
+ * outside of the ranges used by known ciphersuites
+ */
+static inline int mbedtls_ssl_ciphersuite_slot( int ciphersuite_id )
+{
+    switch( ciphersuite_id >> 8 )
+    {
+        case 0x00:
+            return( ciphersuite_id & 0xFF );
+
+        case 0xC0:
+            return( 0x100 | ( ciphersuite_id & 0xFF ) );
+
+        case 0x13:
+            return( 0x200 | ( ciphersuite_id & 0xFF ) );
+
+        default:
+            return( -1 );
+    }
+}
+
 #if defined(MBEDTLS_KEY_EXCHANGE__WITH_SERVER_SIGNATURE__ENABLED)
 static inline int mbedtls_ssl_ciphersuite_uses_server_signature( const mbedtls_ssl_ciphersuite_t *info )
 {
@@ -111,6 +111,13 @@
 #define MBEDTLS_SSL_RETRANS_WAITING         2
 #define MBEDTLS_SSL_RETRANS_FINISHED        3
 
+/*
+ * TLS 1.3 KeyUpdate answer states: not written yet (the output holds a
+ * record of the application), or written and still being sent.
+ */
+#define MBEDTLS_SSL_KEY_UPDATE_TO_WRITE     1
+#define MBEDTLS_SSL_KEY_UPDATE_SENDING      2
+
 /*
  * Allow extra bytes for record, authentication and encryption overhead:
  * counter (8) + header (5) + IV(16) + MAC (16-48) + padding (0-256)
@@ -137,17 +144,31 @@
 #define MBEDTLS_SSL_MAC_ADD                 16
 #endif
 
-#if defined(MBEDTLS_CIPHER_MODE_CBC)
+#if defined(MBEDTLS_CIPHER_MODE_CBC) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+/* CBC padding, or TLS 1.3 inner plaintext padding */
 #define MBEDTLS_SSL_PADDING_ADD            256
 #else
 #define MBEDTLS_SSL_PADDING_ADD              0
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+/* Connection ID in the record header, and real content type at the end of
+ * the protected payload */
+#if MBEDTLS_SSL_CID_IN_LEN_MAX > MBEDTLS_SSL_CID_OUT_LEN_MAX
+#define MBEDTLS_SSL_CID_ADD     ( MBEDTLS_SSL_CID_IN_LEN_MAX + 1 )
+#else
+#define MBEDTLS_SSL_CID_ADD     ( MBEDTLS_SSL_CID_OUT_LEN_MAX + 1 )
+#endif
+#else
+#define MBEDTLS_SSL_CID_ADD                  0
+#endif
+
 #define MBEDTLS_SSL_PAYLOAD_LEN ( MBEDTLS_SSL_MAX_CONTENT_LEN    \
                         + MBEDTLS_SSL_COMPRESSION_ADD            \
                         + MBEDTLS_MAX_IV_LENGTH                  \
                         + MBEDTLS_SSL_MAC_ADD                    \
                         + MBEDTLS_SSL_PADDING_ADD                \
+                        + MBEDTLS_SSL_CID_ADD                    \
                         )
 
 /*
@@ -162,6 +183,11 @@
 #error Bad configuration - protected record payload too large.
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID) &&          \
+    ( MBEDTLS_SSL_CID_IN_LEN_MAX > 255 || MBEDTLS_SSL_CID_OUT_LEN_MAX > 255 )
+#error Bad configuration - connection IDs too long.
+#endif
+
 /* Note: Even though the TLS record header is only 5 bytes
    long, we're internally using 8 bytes to store the
    implicit sequence number. */
@@ -170,6 +196,17 @@
 #define MBEDTLS_SSL_BUFFER_LEN  \
     ( ( MBEDTLS_SSL_HEADER_LEN ) + ( MBEDTLS_SSL_PAYLOAD_LEN ) )
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+/* Size of a buffer holding MBEDTLS_SSL_IDLE_CONTENT_LEN bytes of payload */
+#define MBEDTLS_SSL_IDLE_BUFFER_LEN  \
+    ( MBEDTLS_SSL_BUFFER_LEN - MBEDTLS_SSL_MAX_CONTENT_LEN + \
+      MBEDTLS_SSL_IDLE_CONTENT_LEN )
+
+#if MBEDTLS_SSL_IDLE_CONTENT_LEN > MBEDTLS_SSL_MAX_CONTENT_LEN
+#error Bad configuration - idle content length larger than record content.
+#endif
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
 /*
  * TLS extension flags (for extensions with outgoing ServerHello content
  * that need it (e.g. for RENEGOTIATION_INFO the server already knows because
@@ -178,6 +215,30 @@
 #define MBEDTLS_TLS_EXT_SUPPORTED_POINT_FORMATS_PRESENT (1 << 0)
 #define MBEDTLS_TLS_EXT_ECJPAKE_KKPP_OK                 (1 << 1)
 
+/*
+ * Handshake transcript digests (bits of mbedtls_ssl_handshake_params's
+ * checksums field): only the digests still needed are kept up to date
+ */
+#define MBEDTLS_SSL_CHECKSUM_MD5SHA1                    (1 << 0)
+#define MBEDTLS_SSL_CHECKSUM_SHA256                     (1 << 1)
+#define MBEDTLS_SSL_CHECKSUM_SHA384                     (1 << 2)
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+/*
+ * TLS 1.3 SignatureScheme values (RFC 8446 4.2.3) that we implement
+ */
+#define MBEDTLS_TLS13_SIG_ECDSA_SECP256R1_SHA256        0x0403
+#define MBEDTLS_TLS13_SIG_ECDSA_SECP384R1_SHA384        0x0503
+#define MBEDTLS_TLS13_SIG_ECDSA_SECP521R1_SHA512        0x0603
+#define MBEDTLS_TLS13_SIG_RSA_PSS_RSAE_SHA256           0x0804
+#define MBEDTLS_TLS13_SIG_RSA_PSS_RSAE_SHA384           0x0805
+#define MBEDTLS_TLS13_SIG_RSA_PSS_RSAE_SHA512           0x0806
+
+/* psk_key_exchange_modes values (RFC 8446 4.2.9) */
+#define MBEDTLS_TLS13_PSK_KE                            0
+#define MBEDTLS_TLS13_PSK_DHE_KE                        1
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -241,6 +302,9 @@ struct mbedtls_ssl_handshake_params
     mbedtls_ssl_key_cert *sni_key_cert; /*!< key/cert list from SNI         */
     mbedtls_x509_crt *sni_ca_chain;     /*!< trusted CAs from SNI callback  */
     mbedtls_x509_crl *sni_ca_crl;       /*!< trusted CAs CRLs from SNI      */
+#if defined(MBEDTLS_SSL_SNI_C)
+    struct mbedtls_ssl_sni_table *sni_table; /*!< SNI store table in use */
+#endif
 #endif /* MBEDTLS_SSL_SERVER_NAME_INDICATION */
 #endif /* MBEDTLS_X509_CRT_PARSE_C */
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
@@ -258,6 +322,8 @@ struct mbedtls_ssl_handshake_params
     unsigned char retransmit_state;     /*!<  Retransmission state           */
     mbedtls_ssl_flight_item *flight;            /*!<  Current outgoing flight        */
     mbedtls_ssl_flight_item *cur_msg;           /*!<  Current message in flight      */
+    size_t cur_frag_off;                /*!<  Offset of the next fragment of
+                                              cur_msg to send                */
     unsigned int in_flight_start_seq;   /*!<  Minimum message sequence in the
                                               flight being received          */
     mbedtls_ssl_transform *alt_transform_out;   /*!<  Alternative transform for
@@ -282,6 +348,7 @@ struct mbedtls_ssl_handshake_params
     mbedtls_sha512_context fin_sha512;
 #endif
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
+    int checksums;                      /*!<  live checksum contexts  */
 
     void (*update_checksum)(mbedtls_ssl_context *, const unsigned char *, size_t);
     void (*calc_verify)(mbedtls_ssl_context *, unsigned char *);
@@ -307,6 +374,40 @@ struct mbedtls_ssl_handshake_params
 #if defined(MBEDTLS_SSL_EXTENDED_MASTER_SECRET)
     int extended_ms;                    /*!< use Extended Master Secret? */
 #endif
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+    int ocsp_status;                    /*!< status_request negotiated? */
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    int cid_in_use;                     /*!< connection_id negotiated?  */
+    unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX];
+                                        /*!< connection ID of the peer  */
+    uint8_t peer_cid_len;               /*!< length of peer_cid         */
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /*
+     * TLS 1.3 key schedule and negotiation state
+     */
+    unsigned char tls13_secret[MBEDTLS_MD_MAX_SIZE];
+                                        /*!< current stage of the key
+                                             schedule: early, handshake
+                                             or master secret          */
+    unsigned char client_hs_secret[MBEDTLS_MD_MAX_SIZE];
+                                        /*!< client handshake traffic  */
+    unsigned char server_hs_secret[MBEDTLS_MD_MAX_SIZE];
+                                        /*!< server handshake traffic  */
+    mbedtls_ssl_transform *transform_application;
+                                        /*!< application traffic keys,
+                                             installed after Finished  */
+    int hello_retry;                    /*!< HelloRetryRequest seen?   */
+    mbedtls_ecp_group_id tls13_group;   /*!< group of the key share    */
+    uint32_t tls13_sig_schemes;         /*!< peer's signature schemes,
+                                             see mbedtls_ssl_tls13_
+                                             sig_scheme_bit()          */
+    int tls13_psk_dhe_ke;               /*!< Srv: psk_dhe_ke offered,
+                                             Cli: ticket PSK offered   */
+    unsigned char *tls13_cookie;        /*!< Cli: cookie from the HRR  */
+    size_t tls13_cookie_len;            /*!< Cli: length of the cookie */
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
 };
 
 /*
@@ -329,6 +430,36 @@ struct mbedtls_ssl_transform
     unsigned char iv_enc[16];           /*!<  IV (encryption)         */
     unsigned char iv_dec[16];           /*!<  IV (decryption)         */
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /* Records carry a connection ID in the directions where it's not empty */
+    uint8_t in_cid_len;                 /*!<  length of in_cid        */
+    uint8_t out_cid_len;                /*!<  length of out_cid       */
+    unsigned char in_cid[MBEDTLS_SSL_CID_IN_LEN_MAX];   /*!< ours     */
+    unsigned char out_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX]; /*!< peer's   */
+#endif
+
+#if defined(MBEDTLS_GCM_C) || defined(MBEDTLS_CCM_C)
+    /* AEAD record protection state, set up once with the keys */
+    mbedtls_cipher_mode_t aead_mode;    /*!<  GCM, CCM or NONE        */
+    unsigned char taglen;               /*!<  AEAD tag length         */
+    unsigned char add_enc[13];          /*!<  AAD template (enc)      */
+    unsigned char add_dec[13];          /*!<  AAD template (dec)      */
+#endif
+
+#if defined(MBEDTLS_SSL_KTLS)
+    /* Kept for handing AEAD record protection over to the kernel */
+    unsigned char key_enc[32];          /*!<  key (encryption)        */
+    unsigned char key_dec[32];          /*!<  key (decryption)        */
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* Traffic secrets the keys were expanded from, for KeyUpdate */
+    unsigned char traffic_secret_enc[MBEDTLS_MD_MAX_SIZE];
+    unsigned char traffic_secret_dec[MBEDTLS_MD_MAX_SIZE];
+    unsigned char resumption_master[MBEDTLS_MD_MAX_SIZE];
+                                        /*!<  for NewSessionTicket    */
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_SSL3)
     /* Needed only for SSL v3.0 secret */
     unsigned char mac_enc[20];          /*!<  SSL v3.0 secret (enc)   */
@@ -398,6 +529,13 @@ static inline void mbedtls_ssl_sig_hash_set_init( mbedtls_ssl_sig_hash_set_t *se
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2) &&
           MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED */
 
+/**
+ * \brief           Initialize an SSL transform context
+ *
+ * \param transform SSL transform context
+ */
+void mbedtls_ssl_transform_init( mbedtls_ssl_transform *transform );
+
 /**
  * \brief           Free referenced items in an SSL transform context and clear
  *                  memory
@@ -407,12 +545,25 @@ static inline void mbedtls_ssl_sig_hash_set_init( mbedtls_ssl_sig_hash_set_t *se
 void mbedtls_ssl_transform_free( mbedtls_ssl_transform *transform );
 
 /**
- * \brief           Free referenced items in an SSL handshake context and clear
- *                  memory
+ * \brief           Free referenced items in the SSL handshake context of ssl
+ *                  and clear memory
  *
- * \param handshake SSL handshake context
+ * \param ssl       SSL context
  */
-void mbedtls_ssl_handshake_free( mbedtls_ssl_handshake_params *handshake );
+void mbedtls_ssl_handshake_free( mbedtls_ssl_context *ssl );
+
+/*
+ * Allocate and free memory that lives no longer than the current handshake
+ */
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+void *mbedtls_ssl_hs_calloc( mbedtls_ssl_context *ssl, size_t n, size_t size );
+void mbedtls_ssl_hs_free( mbedtls_ssl_context *ssl, void *p );
+#else
+#define mbedtls_ssl_hs_calloc( ssl, n, size ) \
+    ( (void) (ssl), mbedtls_calloc( n, size ) )
+#define mbedtls_ssl_hs_free( ssl, p ) \
+    ( (void) (ssl), mbedtls_free( p ) )
+#endif
 
 int mbedtls_ssl_handshake_client_step( mbedtls_ssl_context *ssl );
 int mbedtls_ssl_handshake_server_step( mbedtls_ssl_context *ssl );
@@ -542,6 +693,22 @@ int mbedtls_ssl_check_sig_hash( const mbedtls_ssl_context *ssl,
                                 mbedtls_md_type_t md );
 #endif
 
+/*
+ * Check if a ciphersuite is in our list for the negotiated version.
+ * Return 0 if we're willing to use it, -1 otherwise.
+ */
+static inline int mbedtls_ssl_check_ciphersuite( const mbedtls_ssl_context *ssl,
+                                                 int ciphersuite )
+{
+    const uint32_t *set = ssl->conf->ciphersuite_set[ssl->minor_ver];
+    int slot = mbedtls_ssl_ciphersuite_slot( ciphersuite );
+
+    if( slot < 0 || ( set[slot >> 5] & ( (uint32_t) 1 << ( slot & 31 ) ) ) == 0 )
+        return( -1 );
+
+    return( 0 );
+}
+
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
 static inline mbedtls_pk_context *mbedtls_ssl_own_key( mbedtls_ssl_context *ssl )
 {
@@ -582,6 +749,78 @@ int mbedtls_ssl_check_cert_usage( const mbedtls_x509_crt *cert,
                           uint32_t *flags );
 #endif /* MBEDTLS_X509_CRT_PARSE_C */
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+/*
+ * TLS 1.3 (ssl_tls13.c)
+ */
+
+/* HKDF-Expand-Label and Derive-Secret, RFC 8446 7.1 */
+int mbedtls_ssl_tls13_expand_label( mbedtls_md_type_t md_alg,
+                                    const unsigned char *secret,
+                                    const char *label,
+                                    const unsigned char *ctx, size_t ctx_len,
+                                    unsigned char *out, size_t out_len );
+int mbedtls_ssl_tls13_derive_secret( mbedtls_md_type_t md_alg,
+                                     const unsigned char *secret,
+                                     const char *label,
+                                     const unsigned char *transcript,
+                                     unsigned char *out );
+
+/* Hash of the handshake transcript so far, optionally followed by data */
+int mbedtls_ssl_tls13_transcript_hash( mbedtls_ssl_context *ssl,
+                                       mbedtls_md_type_t md_alg,
+                                       const unsigned char *data, size_t len,
+                                       unsigned char *hash );
+/* Replace ClientHello1 with its message_hash after a HelloRetryRequest */
+int mbedtls_ssl_tls13_reset_transcript_for_hrr( mbedtls_ssl_context *ssl );
+/* mbedtls_ssl_read_record() without the transcript update */
+int mbedtls_ssl_tls13_read_record_unhashed( mbedtls_ssl_context *ssl );
+
+/* Key schedule */
+int mbedtls_ssl_tls13_compute_binder( mbedtls_md_type_t md_alg,
+                                      const unsigned char *psk, size_t psk_len,
+                                      const unsigned char *transcript,
+                                      unsigned char *binder );
+int mbedtls_ssl_tls13_key_schedule_handshake( mbedtls_ssl_context *ssl );
+int mbedtls_ssl_tls13_key_schedule_application( mbedtls_ssl_context *ssl );
+int mbedtls_ssl_tls13_key_schedule_resumption( mbedtls_ssl_context *ssl );
+void mbedtls_ssl_tls13_activate_application_keys( mbedtls_ssl_context *ssl,
+                                                  int inbound );
+void mbedtls_ssl_tls13_handshake_wrapup( mbedtls_ssl_context *ssl );
+int mbedtls_ssl_tls13_write_key_update( mbedtls_ssl_context *ssl );
+
+/* (EC)DHE key shares */
+int mbedtls_ssl_tls13_group_supported( mbedtls_ecp_group_id grp_id );
+int mbedtls_ssl_tls13_write_key_share( mbedtls_ssl_context *ssl,
+                                       mbedtls_ecp_group_id grp_id,
+                                       unsigned char *buf, const unsigned char *end,
+                                       size_t *olen );
+int mbedtls_ssl_tls13_read_key_share( mbedtls_ssl_context *ssl,
+                                      const unsigned char *buf, size_t len );
+int mbedtls_ssl_tls13_ecdhe_shared_secret( mbedtls_ssl_context *ssl );
+
+/* Signature schemes */
+uint32_t mbedtls_ssl_tls13_sig_scheme_bit( uint16_t scheme );
+int mbedtls_ssl_tls13_write_sig_algs( mbedtls_ssl_context *ssl,
+                                      unsigned char *buf, const unsigned char *end,
+                                      size_t *olen );
+int mbedtls_ssl_tls13_parse_sig_algs( mbedtls_ssl_context *ssl,
+                                      const unsigned char *buf, size_t len );
+uint16_t mbedtls_ssl_tls13_pick_sig_scheme( const mbedtls_ssl_context *ssl,
+                                            const mbedtls_pk_context *pk );
+
+/* Handshake messages common to both sides */
+int mbedtls_ssl_tls13_write_certificate( mbedtls_ssl_context *ssl, int next );
+int mbedtls_ssl_tls13_parse_certificate( mbedtls_ssl_context *ssl, int next );
+int mbedtls_ssl_tls13_write_certificate_verify( mbedtls_ssl_context *ssl, int next );
+int mbedtls_ssl_tls13_parse_certificate_verify( mbedtls_ssl_context *ssl, int next );
+int mbedtls_ssl_tls13_write_finished( mbedtls_ssl_context *ssl, int next );
+int mbedtls_ssl_tls13_parse_finished( mbedtls_ssl_context *ssl, int next );
+
+/* NewSessionTicket and KeyUpdate received after the handshake */
+int mbedtls_ssl_tls13_process_post_handshake( mbedtls_ssl_context *ssl );
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
 void mbedtls_ssl_write_version( int major, int minor, int transport,
                         unsigned char ver[2] );
 void mbedtls_ssl_read_version( int *major, int *minor, int transport,
@@ -598,6 +837,20 @@ static inline size_t mbedtls_ssl_hdr_len( const mbedtls_ssl_context *ssl )
     return( 5 );
 }
 
+/*
+ * Length of the header of the current incoming and outgoing records, which
+ * with DTLS includes the connection ID if any
+ */
+static inline size_t mbedtls_ssl_in_hdr_len( const mbedtls_ssl_context *ssl )
+{
+    return( (size_t) ( ssl->in_iv - ssl->in_hdr ) );
+}
+
+static inline size_t mbedtls_ssl_out_hdr_len( const mbedtls_ssl_context *ssl )
+{
+    return( (size_t) ( ssl->out_iv - ssl->out_hdr ) );
+}
+
 static inline size_t mbedtls_ssl_hs_hdr_len( const mbedtls_ssl_context *ssl )
 {
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
@@ -609,10 +862,56 @@ static inline size_t mbedtls_ssl_hs_hdr_len( const mbedtls_ssl_context *ssl )
     return( 4 );
 }
 
+/*
+ * Current capacity of the input and output buffers
+ */
+static inline size_t mbedtls_ssl_in_buf_len( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    return( ssl->in_buf_len );
+#else
+    ((void) ssl);
+    return( MBEDTLS_SSL_BUFFER_LEN );
+#endif
+}
+
+static inline size_t mbedtls_ssl_out_buf_len( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    return( ssl->out_buf_len );
+#else
+    ((void) ssl);
+    return( MBEDTLS_SSL_BUFFER_LEN );
+#endif
+}
+
+/*
+ * Can in_buf hold data past the end of the current record?
+ * Always true with DTLS (whole datagrams are read at once), and with TLS
+ * when read-ahead is enabled. When true, the caller must set
+ * ssl->next_record_offset instead of resetting ssl->in_left once it is
+ * done with a record.
+ */
+static inline int mbedtls_ssl_in_buf_holds_next_record( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+        return( 1 );
+#endif
+#if defined(MBEDTLS_ZLIB_SUPPORT)
+    /* Decompression expands the record in place, clobbering what follows */
+    ((void) ssl);
+    return( 0 );
+#else
+    return( ssl->conf->read_ahead == MBEDTLS_SSL_READ_AHEAD_ENABLED );
+#endif
+}
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
 void mbedtls_ssl_send_flight_completed( mbedtls_ssl_context *ssl );
 void mbedtls_ssl_recv_flight_completed( mbedtls_ssl_context *ssl );
 int mbedtls_ssl_resend( mbedtls_ssl_context *ssl );
+int mbedtls_ssl_flight_transmit( mbedtls_ssl_context *ssl );
 #endif
 
 /* Visible for testing purposes only */
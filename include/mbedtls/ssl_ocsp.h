@@ -0,0 +1,150 @@
+/**
+ * \file ssl_ocsp.h
+ *
+ * \brief SSL server store of OCSP responses for OCSP stapling
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_SSL_OCSP_H
+#define MBEDTLS_SSL_OCSP_H
+
+#include "ssl.h"
+#include "x509_crt.h"
+
+#if defined(MBEDTLS_THREADING_C)
+#include "threading.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mbedtls_ssl_ocsp_entry mbedtls_ssl_ocsp_entry;
+
+/**
+ * \brief   Current OCSP response of one server certificate
+ */
+struct mbedtls_ssl_ocsp_entry
+{
+    const mbedtls_x509_crt *crt;        /*!< server certificate     */
+    unsigned char *der;                 /*!< OCSPResponse (DER)     */
+    size_t len;                         /*!< length of der          */
+    mbedtls_x509_time next_update;      /*!< expiry, zero if none   */
+    mbedtls_ssl_ocsp_entry *next;       /*!< chain pointer          */
+};
+
+/**
+ * \brief   OCSP response store
+ */
+typedef struct
+{
+    mbedtls_ssl_ocsp_entry *chain;      /*!< start of the chain     */
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_threading_mutex_t mutex;    /*!< protects the entries   */
+#endif
+}
+mbedtls_ssl_ocsp_store;
+
+/**
+ * \brief          Initialize an OCSP response store
+ *
+ * \param store    OCSP response store
+ */
+void mbedtls_ssl_ocsp_init( mbedtls_ssl_ocsp_store *store );
+
+/**
+ * \brief          Set or replace the OCSP response of a server certificate.
+ *                 (Thread-safe if MBEDTLS_THREADING_C is enabled)
+ *
+ *                 The response is parsed and verified before it replaces
+ *                 the current one, so a response fetched from a responder
+ *                 can be installed while the server is running: handshakes
+ *                 get either the previous or the new response. An invalid
+ *                 response leaves the current one in place. A valid
+ *                 response that the certificate is revoked is accepted.
+ *
+ * \param store    OCSP response store
+ * \param crt      Server certificate, followed by its chain, as given to
+ *                 \c mbedtls_ssl_conf_own_cert(). It must outlive the store.
+ * \param ca_chain Trusted CAs to look the issuer up in, or NULL if the
+ *                 issuer is in the chain of crt
+ * \param der      DER-encoded OCSPResponse
+ * \param len      Length of der
+ *
+ * \return         0 if successful,
+ *                 MBEDTLS_ERR_X509_CERT_VERIFY_FAILED if the response is
+ *                 not trusted or not current,
+ *                 or another X509, ASN1 or SSL error code
+ */
+int mbedtls_ssl_ocsp_set_response( mbedtls_ssl_ocsp_store *store,
+                                   const mbedtls_x509_crt *crt,
+                                   const mbedtls_x509_crt *ca_chain,
+                                   const unsigned char *der, size_t len );
+
+#if defined(MBEDTLS_FS_IO)
+/**
+ * \brief          Same as \c mbedtls_ssl_ocsp_set_response(), reading the
+ *                 response from a file.
+ *
+ * \param store    OCSP response store
+ * \param crt      Server certificate, followed by its chain
+ * \param ca_chain Trusted CAs to look the issuer up in, or NULL
+ * \param path     Path of the DER-encoded OCSPResponse
+ *
+ * \return         0 if successful, or an error code as above
+ */
+int mbedtls_ssl_ocsp_load_file( mbedtls_ssl_ocsp_store *store,
+                                const mbedtls_x509_crt *crt,
+                                const mbedtls_x509_crt *ca_chain,
+                                const char *path );
+#endif /* MBEDTLS_FS_IO */
+
+/**
+ * \brief          OCSP stapling callback implementation
+ *                 (Thread-safe if MBEDTLS_THREADING_C is enabled)
+ *
+ *                 Use with \c mbedtls_ssl_conf_ocsp_stapling_cb(), with the
+ *                 store as parameter. No response is stapled for a
+ *                 certificate without a response, or whose response is past
+ *                 its nextUpdate time.
+ *
+ * \param p_store  OCSP response store
+ * \param crt      Server certificate chosen for the handshake
+ * \param buf      Start of the output buffer
+ * \param buf_len  Size of the output buffer
+ * \param olen     On exit, holds the length of the response, or 0
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_THREADING_MUTEX_ERROR
+ */
+int mbedtls_ssl_ocsp_get( void *p_store, const mbedtls_x509_crt *crt,
+                          unsigned char *buf, size_t buf_len, size_t *olen );
+
+/**
+ * \brief          Free referenced items in an OCSP response store and
+ *                 clear memory
+ *
+ * \param store    OCSP response store
+ */
+void mbedtls_ssl_ocsp_free( mbedtls_ssl_ocsp_store *store );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ssl_ocsp.h */
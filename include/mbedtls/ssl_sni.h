@@ -0,0 +1,239 @@
+/**
+ * \file ssl_sni.h
+ *
+ * \brief SSL server certificate store indexed by server name (SNI)
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_SSL_SNI_H
+#define MBEDTLS_SSL_SNI_H
+
+#include "ssl.h"
+#include "x509_crt.h"
+#include "pk.h"
+
+#if defined(MBEDTLS_THREADING_C)
+#include "threading.h"
+#endif
+
+/**
+ * \name SECTION: Module settings
+ *
+ * The configuration options you can set for this module are in this section.
+ * Either change them in config.h or define them on the compiler command line.
+ * \{
+ */
+
+#if !defined(MBEDTLS_SSL_SNI_MIN_BUCKETS)
+#define MBEDTLS_SSL_SNI_MIN_BUCKETS     64  /*!< Initial size of the name index, must be a power of 2 */
+#endif
+
+/* \} name SECTION: Module settings */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mbedtls_ssl_sni_cert mbedtls_ssl_sni_cert;
+typedef struct mbedtls_ssl_sni_name mbedtls_ssl_sni_name;
+typedef struct mbedtls_ssl_sni_table mbedtls_ssl_sni_table;
+
+/**
+ * \brief   Certificate chain and private key owned by a table
+ */
+struct mbedtls_ssl_sni_cert
+{
+    mbedtls_x509_crt crt;               /*!< certificate chain      */
+    mbedtls_pk_context key;             /*!< private key            */
+    mbedtls_ssl_sni_cert *next;         /*!< chain pointer          */
+};
+
+/**
+ * \brief   Entry of the name index: one name of one certificate
+ */
+struct mbedtls_ssl_sni_name
+{
+    uint32_t hash;                      /*!< hash of the name       */
+    int wildcard;                       /*!< name is "*." + name    */
+    size_t len;                         /*!< length of the name     */
+    unsigned char *name;                /*!< lowercase name         */
+    mbedtls_ssl_sni_cert *cert;         /*!< certificate and key    */
+    mbedtls_ssl_sni_name *next;         /*!< bucket chain pointer   */
+};
+
+/**
+ * \brief   Set of certificates indexed by name
+ *
+ *          A table is filled before it is published to a store, and is
+ *          read-only afterwards. It is freed when it has been replaced in
+ *          the store and the last handshake that uses it is over.
+ */
+struct mbedtls_ssl_sni_table
+{
+    mbedtls_ssl_sni_name **buckets;     /*!< name index             */
+    size_t bucket_count;                /*!< size of the index      */
+    size_t name_count;                  /*!< number of names        */
+    mbedtls_ssl_sni_cert *certs;        /*!< owned certificates     */
+    unsigned int refs;                  /*!< store and handshakes   */
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_threading_mutex_t mutex;    /*!< protects refs          */
+#endif
+};
+
+/**
+ * \brief   SNI certificate store
+ */
+typedef struct
+{
+    mbedtls_ssl_sni_table *table;       /*!< current table          */
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_threading_mutex_t mutex;    /*!< protects table         */
+#endif
+}
+mbedtls_ssl_sni_store;
+
+/**
+ * \brief          Allocate a new, empty table
+ *
+ * \param table    Set to the new table
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_SSL_ALLOC_FAILED
+ */
+int mbedtls_ssl_sni_table_new( mbedtls_ssl_sni_table **table );
+
+/**
+ * \brief          Parse a certificate chain and its private key into a table,
+ *                 and index the certificate under each DNS name of its
+ *                 subjectAltName extension, or under its CN if it has none.
+ *                 Names of the form "*.example.com" match any host name
+ *                 with exactly one more label, such as "www.example.com".
+ *
+ * \note           When several certificates share a name, they are all
+ *                 offered to the handshake, in the order they were added, so
+ *                 that the ciphersuite can select a suitable one.
+ *
+ * \param table    Table that has not been published yet
+ * \param crt_buf  Certificate chain, PEM or DER, end-entity first
+ * \param crt_len  Length of crt_buf, including the terminating null byte
+ *                 for PEM data
+ * \param key_buf  Private key, PEM or DER
+ * \param key_len  Length of key_buf, including the terminating null byte
+ *                 for PEM data
+ * \param pwd      Password for an encrypted key, or NULL
+ * \param pwd_len  Length of pwd
+ *
+ * \return         0 if successful, MBEDTLS_ERR_SSL_BAD_INPUT_DATA if the
+ *                 certificate has no name, or an X509, PK or SSL error code
+ */
+int mbedtls_ssl_sni_table_add( mbedtls_ssl_sni_table *table,
+                               const unsigned char *crt_buf, size_t crt_len,
+                               const unsigned char *key_buf, size_t key_len,
+                               const unsigned char *pwd, size_t pwd_len );
+
+#if defined(MBEDTLS_FS_IO)
+/**
+ * \brief          Same as \c mbedtls_ssl_sni_table_add(), reading the
+ *                 certificate chain and the key from files.
+ *
+ * \param table    Table that has not been published yet
+ * \param crt_path Path of the certificate chain
+ * \param key_path Path of the private key
+ * \param pwd      Password for an encrypted key, or NULL
+ *
+ * \return         0 if successful, or an X509, PK or SSL error code
+ */
+int mbedtls_ssl_sni_table_add_file( mbedtls_ssl_sni_table *table,
+                                    const char *crt_path,
+                                    const char *key_path,
+                                    const char *pwd );
+#endif /* MBEDTLS_FS_IO */
+
+/**
+ * \brief          Free a table that has not been published
+ *
+ * \param table    Table to free, or NULL
+ */
+void mbedtls_ssl_sni_table_free( mbedtls_ssl_sni_table *table );
+
+/**
+ * \brief          Release a reference to a published table.
+ *                 (Internal use: handshakes take a reference in
+ *                 \c mbedtls_ssl_sni_get() and release it when they end.)
+ *
+ * \param table    Table to release
+ */
+void mbedtls_ssl_sni_table_release( mbedtls_ssl_sni_table *table );
+
+/**
+ * \brief          Initialize an SNI store
+ *
+ * \param store    SNI store
+ */
+void mbedtls_ssl_sni_init( mbedtls_ssl_sni_store *store );
+
+/**
+ * \brief          Replace the table of a store, atomically for the
+ *                 handshakes that look names up in it.
+ *                 (Thread-safe if MBEDTLS_THREADING_C is enabled)
+ *
+ *                 The store takes ownership of the new table. Handshakes in
+ *                 progress keep using the previous table, which is freed
+ *                 when the last of them is over.
+ *
+ * \param store    SNI store
+ * \param table    Filled table, or NULL to empty the store
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_THREADING_MUTEX_ERROR
+ */
+int mbedtls_ssl_sni_publish( mbedtls_ssl_sni_store *store,
+                             mbedtls_ssl_sni_table *table );
+
+/**
+ * \brief          SNI callback implementation
+ *                 (Thread-safe if MBEDTLS_THREADING_C is enabled)
+ *
+ *                 Use with \c mbedtls_ssl_conf_sni(), with the store as
+ *                 parameter. The certificates indexed under the name sent
+ *                 by the client are used for the handshake. If there are
+ *                 none, the handshake uses the certificates of the
+ *                 configuration, see \c mbedtls_ssl_conf_own_cert().
+ *
+ * \param p_store  SNI store
+ * \param ssl      SSL context
+ * \param name     Server name sent by the client
+ * \param name_len Length of name
+ *
+ * \return         0 if successful, or an SSL error code
+ */
+int mbedtls_ssl_sni_get( void *p_store, mbedtls_ssl_context *ssl,
+                         const unsigned char *name, size_t name_len );
+
+/**
+ * \brief          Free the current table of a store (once no handshake
+ *                 uses it anymore) and clear the store
+ *
+ * \param store    SNI store
+ */
+void mbedtls_ssl_sni_free( mbedtls_ssl_sni_store *store );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ssl_sni.h */
@@ -105,6 +105,9 @@
 #define MBEDTLS_X509_BADCRL_BAD_MD           0x020000  /**< The CRL is signed with an unacceptable hash. */
 #define MBEDTLS_X509_BADCRL_BAD_PK           0x040000  /**< The CRL is signed with an unacceptable PK alg (eg RSA vs ECDSA). */
 #define MBEDTLS_X509_BADCRL_BAD_KEY          0x080000  /**< The CRL is signed with an unacceptable key (eg bad curve, RSA too short). */
+#define MBEDTLS_X509_BADOCSP_NOT_TRUSTED     0x100000  /**< The OCSP response is not correctly signed, or has no status for the certificate. */
+#define MBEDTLS_X509_BADOCSP_EXPIRED         0x200000  /**< The OCSP response is expired. */
+#define MBEDTLS_X509_BADOCSP_FUTURE          0x400000  /**< The OCSP response is from the future. */
 
 /* \} name */
 /* \} addtogroup x509_module */
@@ -282,6 +285,9 @@ int mbedtls_x509_self_test( int verbose );
  */
 int mbedtls_x509_get_name( unsigned char **p, const unsigned char *end,
                    mbedtls_x509_name *cur );
+int mbedtls_x509_get_name_attr( unsigned char **p, const unsigned char *end,
+                                const unsigned char **end_set,
+                                mbedtls_x509_name *cur );
 int mbedtls_x509_get_alg_null( unsigned char **p, const unsigned char *end,
                        mbedtls_x509_buf *alg );
 int mbedtls_x509_get_alg( unsigned char **p, const unsigned char *end,
@@ -301,6 +307,10 @@ int mbedtls_x509_get_serial( unsigned char **p, const unsigned char *end,
                      mbedtls_x509_buf *serial );
 int mbedtls_x509_get_ext( unsigned char **p, const unsigned char *end,
                   mbedtls_x509_buf *ext, int tag );
+#if defined(MBEDTLS_X509_CRT_PARSE_C)
+int mbedtls_x509_name_cmp( const mbedtls_x509_name *a, const mbedtls_x509_name *b );
+int mbedtls_x509_name_cmp_raw( const mbedtls_x509_buf *a, const mbedtls_x509_buf *b );
+#endif
 int mbedtls_x509_sig_alg_gets( char *buf, size_t size, const mbedtls_x509_buf *sig_oid,
                        mbedtls_pk_type_t pk_alg, mbedtls_md_type_t md_alg,
                        const void *sig_opts );
@@ -0,0 +1,166 @@
+/**
+ * \file x509_ca_index.h
+ *
+ * \brief Index of a list of trusted CA certificates by subject and key
+ *        identifier
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_X509_CA_INDEX_H
+#define MBEDTLS_X509_CA_INDEX_H
+
+#include "x509_crt.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mbedtls_x509_ca_index_entry mbedtls_x509_ca_index_entry;
+
+/**
+ * \brief   Entry of the index: one certificate of the indexed list
+ */
+struct mbedtls_x509_ca_index_entry
+{
+    mbedtls_x509_crt *crt;              /*!< the CA certificate             */
+    size_t pos;                         /*!< its position in the list       */
+    uint32_t subject_hash;              /*!< hash of its normalized subject */
+    uint32_t key_id_hash;               /*!< hash of its key identifier     */
+    mbedtls_x509_buf key_id;            /*!< its subjectKeyIdentifier, or
+                                             empty                          */
+    mbedtls_x509_ca_index_entry *next_subject;  /*!< subject bucket chain   */
+    mbedtls_x509_ca_index_entry *next_key_id;   /*!< key id bucket chain    */
+};
+
+/**
+ * \brief   Index of a list of trusted CA certificates
+ *
+ * \note    Once built, the index is attached to the first certificate
+ *          of the list, and certificate verification with that list
+ *          as trust_ca looks up the issuers of certificates in the
+ *          index instead of walking the list: the cost of finding the
+ *          issuer no longer depends on the number of trusted CAs.
+ *
+ * \note    Certificates added to the list after the index was built are
+ *          not indexed. Verification notices and walks the list again
+ *          until the index is rebuilt.
+ */
+typedef struct mbedtls_x509_ca_index
+{
+    mbedtls_x509_crt *chain;            /*!< the indexed list               */
+    mbedtls_x509_crt *last;             /*!< its last certificate           */
+    mbedtls_x509_ca_index_entry *entries;   /*!< one per certificate        */
+    size_t count;                       /*!< number of entries              */
+    mbedtls_x509_ca_index_entry **by_subject;   /*!< subject buckets        */
+    mbedtls_x509_ca_index_entry **by_key_id;    /*!< key id buckets         */
+    size_t bucket_count;                /*!< power of 2                     */
+}
+mbedtls_x509_ca_index;
+
+/**
+ * \brief          Initialize an index
+ *
+ * \param index    index to initialize
+ */
+void mbedtls_x509_ca_index_init( mbedtls_x509_ca_index *index );
+
+/**
+ * \brief          Index a list of trusted CA certificates, and attach the
+ *                 index to it
+ *
+ * \param index    index, initialized or built before (then it is rebuilt)
+ * \param chain    list to index, usually the trust_ca list of
+ *                 mbedtls_x509_crt_verify() or mbedtls_ssl_conf_ca_chain()
+ *
+ * \note           The list must outlive the index, and must not be shared
+ *                 with another index.
+ *
+ * \return         0 if successful, or MBEDTLS_ERR_X509_ALLOC_FAILED
+ */
+int mbedtls_x509_ca_index_build( mbedtls_x509_ca_index *index,
+                                 mbedtls_x509_crt *chain );
+
+/**
+ * \brief          Detach an index from its list and free it
+ *
+ * \param index    index to free
+ *
+ * \note           Call it before freeing the list.
+ */
+void mbedtls_x509_ca_index_free( mbedtls_x509_ca_index *index );
+
+/**
+ * \brief          Find the certificates of the index with a given subject
+ *
+ * \param index    index
+ * \param subject  subject to look for in DER, e.g. the issuer_raw of a
+ *                 certificate
+ * \param prev     NULL for the first one, or the one found before
+ *
+ * \return         the next entry with this subject, in the order of the
+ *                 list, or NULL if there is none
+ */
+const mbedtls_x509_ca_index_entry *mbedtls_x509_ca_index_find_subject(
+                                    const mbedtls_x509_ca_index *index,
+                                    const mbedtls_x509_buf *subject,
+                                    const mbedtls_x509_ca_index_entry *prev );
+
+/**
+ * \brief          Find the certificates of the index with a given
+ *                 subjectKeyIdentifier
+ *
+ * \param index    index
+ * \param key_id   key identifier to look for, e.g. from the
+ *                 authorityKeyIdentifier of a certificate
+ * \param len      length of key_id
+ * \param prev     NULL for the first one, or the one found before
+ *
+ * \return         the next entry with this key identifier, in the order
+ *                 of the list, or NULL if there is none
+ */
+const mbedtls_x509_ca_index_entry *mbedtls_x509_ca_index_find_key_id(
+                                    const mbedtls_x509_ca_index *index,
+                                    const unsigned char *key_id, size_t len,
+                                    const mbedtls_x509_ca_index_entry *prev );
+
+/**
+ * \brief          Find the certificates of the index that may have issued
+ *                 a certificate
+ *
+ *                 Those are the ones whose subject is the issuer of
+ *                 the certificate. If the certificate has an
+ *                 authorityKeyIdentifier, the ones with a matching
+ *                 subjectKeyIdentifier come first.
+ *
+ * \param index    index
+ * \param child    certificate to find the issuer of
+ * \param prev     NULL for the first one, or the one found before
+ *
+ * \return         the next candidate issuer, or NULL if there is none
+ */
+const mbedtls_x509_ca_index_entry *mbedtls_x509_ca_index_find_issuer(
+                                    const mbedtls_x509_ca_index *index,
+                                    const mbedtls_x509_crt *child,
+                                    const mbedtls_x509_ca_index_entry *prev );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* x509_ca_index.h */
@@ -63,6 +63,23 @@ typedef struct mbedtls_x509_crl_entry
 }
 mbedtls_x509_crl_entry;
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+#define MBEDTLS_X509_CRL_INDEX_REMOVE   0x01    /**< The entry of a delta CRL takes the certificate off the base CRL (reason removeFromCRL). */
+
+/**
+ * Revoked certificate in the index of a CRL. It points to the entry in the
+ * DER of the CRL, or of a delta CRL merged into it.
+ */
+typedef struct
+{
+    const unsigned char *serial;    /**< The serial number (content octets). */
+    uint16_t serial_len;            /**< Its length. */
+    uint16_t flags;                 /**< MBEDTLS_X509_CRL_INDEX_xxx flags. */
+    uint32_t rest_len;              /**< Length of the rest of the entry: revocation date and extensions. */
+}
+mbedtls_x509_crl_index_entry;
+#endif /* MBEDTLS_X509_CRL_INDEX */
+
 /**
  * Certificate revocation list structure.
  * Every CRL may have multiple entries.
@@ -71,6 +88,7 @@ typedef struct mbedtls_x509_crl
 {
     mbedtls_x509_buf raw;           /**< The raw certificate data (DER). */
     mbedtls_x509_buf tbs;           /**< The raw certificate body (DER). The part that is To Be Signed. */
+    int own_buffer;                 /**< Indicates if \c raw is owned by the structure or not. */
 
     int version;            /**< CRL version (1=v1, 2=v2) */
     mbedtls_x509_buf sig_oid;       /**< CRL signature type identifier */
@@ -82,7 +100,14 @@ typedef struct mbedtls_x509_crl
     mbedtls_x509_time this_update;
     mbedtls_x509_time next_update;
 
-    mbedtls_x509_crl_entry entry;   /**< The CRL entries containing the certificate revocation times for this CA. */
+    mbedtls_x509_crl_entry entry;   /**< The CRL entries containing the certificate revocation times for this CA. Empty with MBEDTLS_X509_CRL_INDEX. */
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    mbedtls_x509_crl_index_entry *index;    /**< The revoked certificates, sorted by serial number. */
+    size_t index_len;                       /**< Number of entries in the index. */
+    mbedtls_x509_buf crl_number;            /**< The cRLNumber extension (content octets), if present. */
+    mbedtls_x509_buf base_crl_number;       /**< The deltaCRLIndicator extension: number of the base CRL of a delta CRL. */
+    struct mbedtls_x509_crl *deltas;        /**< Delta CRLs merged into this one, the most recent first. */
+#endif
 
     mbedtls_x509_buf crl_ext;
 
@@ -108,6 +133,25 @@ mbedtls_x509_crl;
  */
 int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
                         const unsigned char *buf, size_t buflen );
+
+/**
+ * \brief          Parse a DER-encoded CRL and append it to the chained list,
+ *                 without copying it
+ *
+ *                 The buffer can be, for example, a file mapped read-only.
+ *
+ * \warning        The buffer must stay valid and unmodified until the list
+ *                 is freed with mbedtls_x509_crl_free().
+ *
+ * \param chain    points to the start of the chain
+ * \param buf      buffer holding the CRL data in DER format
+ * \param buflen   size of the buffer
+ *
+ * \return         0 if successful, or a specific X509 error code
+ */
+int mbedtls_x509_crl_parse_der_nocopy( mbedtls_x509_crl *chain,
+                                       const unsigned char *buf,
+                                       size_t buflen );
 /**
  * \brief          Parse one or more CRLs and append them to the chained list
  *
@@ -136,6 +180,46 @@ int mbedtls_x509_crl_parse( mbedtls_x509_crl *chain, const unsigned char *buf, s
 int mbedtls_x509_crl_parse_file( mbedtls_x509_crl *chain, const char *path );
 #endif /* MBEDTLS_FS_IO */
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+/**
+ * \brief          Look up a serial number in the index of a CRL
+ *
+ * \param crl      CRL to search, with the delta CRLs merged into it
+ * \param serial   serial number of a certificate issued by the issuer of
+ *                 the CRL
+ *
+ * \return         1 if the CRL lists the serial number with a revocation
+ *                 date in the past, or 0 otherwise
+ */
+int mbedtls_x509_crl_is_revoked( const mbedtls_x509_crl *crl,
+                                 const mbedtls_x509_buf *serial );
+
+/**
+ * \brief          Merge a delta CRL into the CRL it is based on
+ *
+ *                 The entries of the delta CRL replace the entries with
+ *                 the same serial numbers, or are added to the index, and
+ *                 those with reason removeFromCRL are taken off it. The
+ *                 delta CRL is then owned by \p crl, and its signature and
+ *                 dates are checked with those of \p crl when verifying
+ *                 certificates.
+ *
+ * \note           Delta CRLs must be merged in order: each one must have a
+ *                 CRL number above the previous one.
+ *
+ * \param crl      complete CRL, with a CRL number
+ * \param delta    delta CRL from the same issuer, based on a CRL number
+ *                 that is not above the one of \p crl. It is emptied, as
+ *                 if initialized, when the merge succeeds.
+ *
+ * \return         0 if successful, MBEDTLS_ERR_X509_BAD_INPUT_DATA if
+ *                 \p delta is not a delta CRL that applies to \p crl, or
+ *                 MBEDTLS_ERR_X509_ALLOC_FAILED
+ */
+int mbedtls_x509_crl_merge_delta( mbedtls_x509_crl *crl,
+                                  mbedtls_x509_crl *delta );
+#endif /* MBEDTLS_X509_CRL_INDEX */
+
 /**
  * \brief          Returns an informational string about the CRL.
  *
@@ -52,6 +52,7 @@ extern "C" {
  */
 typedef struct mbedtls_x509_crt
 {
+    int own_buffer;                     /**< Indicates if \c raw is owned by the structure or not. */
     mbedtls_x509_buf raw;               /**< The raw certificate data (DER). */
     mbedtls_x509_buf tbs;               /**< The raw certificate body (DER). The part that is To Be Signed. */
 
@@ -91,6 +92,21 @@ typedef struct mbedtls_x509_crt
     void *sig_opts;             /**< Signature options to be passed to mbedtls_pk_verify_ext(), e.g. for RSASSA-PSS */
 
     struct mbedtls_x509_crt *next;     /**< Next certificate in the CA-chain. */
+
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+    struct mbedtls_x509_ca_index *ca_index; /**< Index of the chain, on its first certificate, see x509_ca_index.h */
+#endif
+
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING) || defined(MBEDTLS_X509_CRT_COMPACT)
+    mbedtls_x509_buf subject_alt_names_raw; /**< The raw Subject Alternative Names extension value (DER). */
+    mbedtls_x509_buf ext_key_usage_raw; /**< The raw extended key usage extension value (DER). */
+    int pending;                /**< Fields not decoded yet, see mbedtls_x509_crt_get_issuer() */
+#endif
+
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+    unsigned char *block;       /**< Single allocation holding the entries of the lists after their first one, \c raw if it is copied, and this structure if it is not the first of the chain. */
+    size_t block_len;           /**< Length of \c block. */
+#endif
 }
 mbedtls_x509_crt;
 
@@ -174,6 +190,28 @@ extern const mbedtls_x509_crt_profile mbedtls_x509_crt_profile_suiteb;
 int mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *buf,
                         size_t buflen );
 
+/**
+ * \brief          Parse a single DER formatted certificate and add it
+ *                 to the chained list, without copying the DER data.
+ *
+ *                 The certificate references buf instead of a copy of
+ *                 it, which saves an allocation of the size of the
+ *                 certificate. Use it for buffers that outlive the
+ *                 certificate anyway, e.g. static arrays or mapped files.
+ *
+ * \warning        The buffer must stay valid and unmodified until the
+ *                 certificate is freed with mbedtls_x509_crt_free().
+ *
+ * \param chain    points to the start of the chain
+ * \param buf      buffer holding the certificate DER data
+ * \param buflen   size of the buffer
+ *
+ * \return         0 if successful, or a specific X509 or PEM error code
+ */
+int mbedtls_x509_crt_parse_der_nocopy( mbedtls_x509_crt *chain,
+                                       const unsigned char *buf,
+                                       size_t buflen );
+
 /**
  * \brief          Parse one or more certificates and add them
  *                 to the chained list. Parses permissively. If some
@@ -238,6 +276,70 @@ int mbedtls_x509_crt_parse_path( mbedtls_x509_crt *chain, const char *path );
 int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
                    const mbedtls_x509_crt *crt );
 
+/**
+ * \brief          Get the issuer name of a certificate.
+ *
+ *                 If MBEDTLS_X509_ON_DEMAND_PARSING is enabled, the
+ *                 parser only checks the issuer and subject names, the
+ *                 Subject Alternative Names and the extended key usage,
+ *                 and leaves the corresponding fields of the structure
+ *                 empty: they are decoded by the first call of the
+ *                 matching accessor. Otherwise the accessors simply return
+ *                 the fields.
+ *
+ * \note           Decoding updates the certificate: the first call for a
+ *                 field must not be concurrent with other uses of the same
+ *                 certificate. Verification and mbedtls_x509_crt_info()
+ *                 don't update certificates.
+ *
+ * \param crt      The certificate
+ * \param issuer   Set to the issuer name
+ *
+ * \return         0 if successful, or a specific X509 or ASN1 error code
+ *                 (the name was checked by the parser, so only
+ *                 MBEDTLS_ERR_X509_ALLOC_FAILED is expected)
+ */
+int mbedtls_x509_crt_get_issuer( mbedtls_x509_crt *crt,
+                                 const mbedtls_x509_name **issuer );
+
+/**
+ * \brief          Get the subject name of a certificate.
+ *                 See mbedtls_x509_crt_get_issuer().
+ *
+ * \param crt      The certificate
+ * \param subject  Set to the subject name
+ *
+ * \return         0 if successful, or a specific X509 or ASN1 error code
+ */
+int mbedtls_x509_crt_get_subject( mbedtls_x509_crt *crt,
+                                  const mbedtls_x509_name **subject );
+
+/**
+ * \brief          Get the Subject Alternative Names of a certificate
+ *                 (only dNSName), empty if it has none.
+ *                 See mbedtls_x509_crt_get_issuer().
+ *
+ * \param crt      The certificate
+ * \param subject_alt_names Set to the list of names
+ *
+ * \return         0 if successful, or a specific X509 or ASN1 error code
+ */
+int mbedtls_x509_crt_get_subject_alt_names( mbedtls_x509_crt *crt,
+                                    const mbedtls_x509_sequence **subject_alt_names );
+
+/**
+ * \brief          Get the extended key usage OIDs of a certificate, empty
+ *                 if it has none.
+ *                 See mbedtls_x509_crt_get_issuer().
+ *
+ * \param crt      The certificate
+ * \param ext_key_usage Set to the list of OIDs
+ *
+ * \return         0 if successful, or a specific X509 or ASN1 error code
+ */
+int mbedtls_x509_crt_get_ext_key_usage( mbedtls_x509_crt *crt,
+                                    const mbedtls_x509_sequence **ext_key_usage );
+
 /**
  * \brief          Returns an informational string about the
  *                 verification status of a certificate.
@@ -0,0 +1,136 @@
+/**
+ * \file x509_crt_parallel.h
+ *
+ * \brief Parallel loading of certificate directories and bundles
+ *
+ * The files of a directory, or the PEM blocks of a bundle, are parsed by
+ * several threads into separate lists, which are then appended to the
+ * target list in a fixed order. A file or block that fails to parse is
+ * reported and skipped, and does not stop the others from loading.
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_X509_CRT_PARALLEL_H
+#define MBEDTLS_X509_CRT_PARALLEL_H
+
+#include "x509_crt.h"
+
+/**
+ * \name SECTION: Module settings
+ *
+ * The configuration options you can set for this module are in this section.
+ * Either change them in config.h or define them on the compiler command line.
+ * \{
+ */
+
+#if !defined(MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS)
+#define MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS   16  /**< Maximum number of threads of a load */
+#endif
+
+/* \} name SECTION: Module settings */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief          Callback reporting the outcome of a file or PEM block
+ *
+ * \param p_report context given to the loading function
+ * \param path     file name, or NULL for a block of a bundle
+ * \param index    position of the file in the directory, in the order
+ *                 of their names, or of the block in the bundle
+ * \param ret      0 if everything in it was added, a positive number of
+ *                 certificates that failed to parse in a file, or a
+ *                 specific X509 or PEM error code
+ */
+typedef void mbedtls_x509_crt_parallel_report_t( void *p_report,
+                                                 const char *path,
+                                                 size_t index, int ret );
+
+/**
+ * \brief          Parse one DER certificate or a bundle of PEM certificates
+ *                 with several threads and add them to a list.
+ *
+ *                 Like mbedtls_x509_crt_parse(), but the PEM blocks are
+ *                 shared between the threads. The certificates are added
+ *                 in the order of the bundle.
+ *
+ * \note           Threads are only started when MBEDTLS_THREADING_PTHREAD
+ *                 is defined. Otherwise the calling thread parses
+ *                 everything, and the results are the same.
+ *
+ * \param chain    points to the start of the chain
+ * \param buf      buffer holding the certificate data in PEM or DER format,
+ *                 including the terminating null byte for PEM
+ * \param buflen   size of the buffer
+ * \param threads  number of threads parsing, the calling one included,
+ *                 at most MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS
+ * \param f_report called for each PEM block from the calling thread, in
+ *                 order, once they are all parsed, or NULL
+ * \param p_report context for f_report
+ *
+ * \return         0 if all certificates parsed successfully, a positive
+ *                 number of certificates that couldn't be parsed, or a
+ *                 specific X509 or PEM error code, see
+ *                 mbedtls_x509_crt_parse()
+ */
+int mbedtls_x509_crt_parse_parallel( mbedtls_x509_crt *chain,
+                                     const unsigned char *buf, size_t buflen,
+                                     int threads,
+                                     mbedtls_x509_crt_parallel_report_t *f_report,
+                                     void *p_report );
+
+#if defined(MBEDTLS_FS_IO)
+/**
+ * \brief          Load the certificates of the files of a directory with
+ *                 several threads and add them to a list.
+ *
+ *                 Like mbedtls_x509_crt_parse_path(), but the files are
+ *                 shared between the threads, and their certificates are
+ *                 added in the order of the file names rather than the
+ *                 order of the directory.
+ *
+ * \note           Threads are only started when MBEDTLS_THREADING_PTHREAD
+ *                 is defined. Otherwise the calling thread parses
+ *                 everything, and the results are the same.
+ *
+ * \param chain    points to the start of the chain
+ * \param path     directory to read the X509 certificates from
+ * \param threads  number of threads parsing, the calling one included,
+ *                 at most MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS
+ * \param f_report called for each file from the calling thread, in order,
+ *                 once they are all parsed, or NULL
+ * \param p_report context for f_report
+ *
+ * \return         0 if all certificates parsed successfully, a positive
+ *                 number of certificates that couldn't be parsed, or a
+ *                 specific X509 error code if the directory can't be read
+ */
+int mbedtls_x509_crt_parse_path_parallel( mbedtls_x509_crt *chain,
+                                          const char *path, int threads,
+                                          mbedtls_x509_crt_parallel_report_t *f_report,
+                                          void *p_report );
+#endif /* MBEDTLS_FS_IO */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* x509_crt_parallel.h */
@@ -0,0 +1,189 @@
+/**
+ * \file x509_ocsp.h
+ *
+ * \brief OCSP response parsing and verification (RFC 6960)
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_X509_OCSP_H
+#define MBEDTLS_X509_OCSP_H
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#include "x509.h"
+#include "x509_crt.h"
+
+/*
+ * OCSPResponseStatus values
+ */
+#define MBEDTLS_X509_OCSP_SUCCESSFUL            0
+#define MBEDTLS_X509_OCSP_MALFORMED_REQUEST     1
+#define MBEDTLS_X509_OCSP_INTERNAL_ERROR        2
+#define MBEDTLS_X509_OCSP_TRY_LATER             3
+#define MBEDTLS_X509_OCSP_SIG_REQUIRED          5
+#define MBEDTLS_X509_OCSP_UNAUTHORIZED          6
+
+/*
+ * CertStatus values
+ */
+#define MBEDTLS_X509_OCSP_CERT_GOOD             0
+#define MBEDTLS_X509_OCSP_CERT_REVOKED          1
+#define MBEDTLS_X509_OCSP_CERT_UNKNOWN          2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \addtogroup x509_module
+ * \{ */
+
+/**
+ * \name Structures and functions for parsing OCSP responses
+ * \{
+ */
+
+/**
+ * Status of one certificate in an OCSP response.
+ */
+typedef struct mbedtls_x509_ocsp_single
+{
+    mbedtls_md_type_t md_alg;           /**< Hash of the CertID fields */
+    mbedtls_x509_buf issuer_name_hash;  /**< Hash of the issuer's DN */
+    mbedtls_x509_buf issuer_key_hash;   /**< Hash of the issuer's public key */
+    mbedtls_x509_buf serial;            /**< Serial number of the certificate */
+
+    int cert_status;                    /**< MBEDTLS_X509_OCSP_CERT_XXX */
+    mbedtls_x509_time revocation_time;  /**< Set if the certificate is revoked */
+
+    mbedtls_x509_time this_update;
+    mbedtls_x509_time next_update;      /**< All zeros if absent */
+
+    struct mbedtls_x509_ocsp_single *next;
+}
+mbedtls_x509_ocsp_single;
+
+/**
+ * Basic OCSP response.
+ */
+typedef struct mbedtls_x509_ocsp_response
+{
+    mbedtls_x509_buf raw;               /**< The raw response data (DER). */
+    mbedtls_x509_buf tbs;               /**< The signed part, ResponseData (DER). */
+
+    int status;                         /**< OCSPResponseStatus, MBEDTLS_X509_OCSP_XXX */
+
+    mbedtls_x509_time produced_at;
+
+    mbedtls_x509_ocsp_single single;    /**< Status of each certificate in the response */
+
+    mbedtls_x509_buf sig_oid;
+    mbedtls_x509_buf sig;
+    mbedtls_md_type_t sig_md;           /**< Internal representation of the MD algorithm of the signature algorithm, e.g. MBEDTLS_MD_SHA256 */
+    mbedtls_pk_type_t sig_pk;           /**< Internal representation of the Public Key algorithm of the signature algorithm, e.g. MBEDTLS_PK_RSA */
+    void *sig_opts;                     /**< Signature options to be passed to mbedtls_pk_verify_ext(), e.g. for RSASSA-PSS */
+
+    mbedtls_x509_crt certs;             /**< Certificates sent by the responder, if any */
+}
+mbedtls_x509_ocsp_response;
+
+/**
+ * \brief          Initialize an OCSP response
+ *
+ * \param resp     OCSP response to initialize
+ */
+void mbedtls_x509_ocsp_response_init( mbedtls_x509_ocsp_response *resp );
+
+/**
+ * \brief          Parse a DER-encoded OCSPResponse
+ *
+ * \note           Only the basic response type (id-pkix-ocsp-basic) is
+ *                 supported. A response whose status is not successful has
+ *                 no response data and is parsed with only its status set.
+ *
+ * \param resp     Initialized OCSP response
+ * \param buf      Buffer holding the response in DER format
+ * \param buflen   Size of the buffer
+ *
+ * \return         0 if successful, or a specific X509 or ASN1 error code
+ */
+int mbedtls_x509_ocsp_response_parse( mbedtls_x509_ocsp_response *resp,
+                                      const unsigned char *buf, size_t buflen );
+
+#if defined(MBEDTLS_FS_IO)
+/**
+ * \brief          Load and parse a DER-encoded OCSPResponse
+ *
+ * \param resp     Initialized OCSP response
+ * \param path     Filename to read the response from
+ *
+ * \return         0 if successful, or a specific X509 or ASN1 error code
+ */
+int mbedtls_x509_ocsp_response_parse_file( mbedtls_x509_ocsp_response *resp,
+                                           const char *path );
+#endif /* MBEDTLS_FS_IO */
+
+/**
+ * \brief          Check the status of a certificate in an OCSP response.
+ *
+ *                 The issuer of the certificate is looked up in the chain
+ *                 the certificate belongs to, then in trust_ca: it is the
+ *                 first certificate with a matching name whose key verifies
+ *                 the signature of the certificate. The response must be
+ *                 signed by the issuer, or by a certificate of the response
+ *                 that the issuer delegated OCSP signing to with the
+ *                 id-kp-OCSPSigning extended key usage, and must be current.
+ *
+ *                 The flags use the same values as
+ *                 \c mbedtls_x509_crt_verify(): MBEDTLS_X509_BADCERT_REVOKED
+ *                 if the certificate is revoked, and MBEDTLS_X509_BADOCSP_XXX
+ *                 if the response does not establish that it is good.
+ *
+ * \param resp     Parsed OCSP response
+ * \param crt      Certificate to check, followed by its chain if any
+ * \param trust_ca Trusted CAs to look the issuer up in, or NULL
+ * \param flags    Result of the check, 0 if the certificate is good
+ *
+ * \return         0 if the certificate is good, or
+ *                 MBEDTLS_ERR_X509_CERT_VERIFY_FAILED with flags set
+ */
+int mbedtls_x509_ocsp_response_verify( const mbedtls_x509_ocsp_response *resp,
+                                       const mbedtls_x509_crt *crt,
+                                       const mbedtls_x509_crt *trust_ca,
+                                       uint32_t *flags );
+
+/**
+ * \brief          Unallocate all OCSP response data
+ *
+ * \param resp     OCSP response to free
+ */
+void mbedtls_x509_ocsp_response_free( mbedtls_x509_ocsp_response *resp );
+
+/* \} name */
+/* \} addtogroup x509_module */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* mbedtls_x509_ocsp.h */
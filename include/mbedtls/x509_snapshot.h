@@ -0,0 +1,158 @@
+/**
+ * \file x509_snapshot.h
+ *
+ * \brief Binary snapshots of lists of trusted CA certificates
+ *
+ * A snapshot holds the DER of the certificates of a list, behind a table
+ * of their offsets, so that loading it takes neither file system walks,
+ * nor PEM decoding, nor copies of the certificates: they are parsed where
+ * they are, for instance in a file mapped read-only and shared by all the
+ * processes that load it.
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_X509_SNAPSHOT_H
+#define MBEDTLS_X509_SNAPSHOT_H
+
+#include "x509_crt.h"
+
+/*
+ * Layout, all integers are 32 bits big endian:
+ *
+ *  0   magic "X509SNAP"
+ *  8   version (MBEDTLS_X509_SNAPSHOT_VERSION)
+ *  12  number of certificates n
+ *  16  total length of the snapshot
+ *  20  n records: offset of the DER of a certificate, its length
+ *      followed by the DER of the certificates, in the order of the list
+ */
+#define MBEDTLS_X509_SNAPSHOT_MAGIC         "X509SNAP"
+#define MBEDTLS_X509_SNAPSHOT_VERSION       1
+#define MBEDTLS_X509_SNAPSHOT_HEADER_LEN    20
+#define MBEDTLS_X509_SNAPSHOT_RECORD_LEN    8
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * \brief   Certificates loaded from a snapshot file
+ */
+typedef struct
+{
+    mbedtls_x509_crt chain;             /*!< the certificates, ready to be
+                                             used as a trusted CA list      */
+    unsigned char *buf;                 /*!< the snapshot they reference    */
+    size_t len;                         /*!< its length                     */
+    int mapped;                         /*!< 1 if buf is a mapping of the
+                                             file, 0 if it is a copy        */
+}
+mbedtls_x509_snapshot;
+
+/**
+ * \brief          Write a snapshot of a list of certificates
+ *
+ * \param chain    list to write, e.g. loaded with
+ *                 mbedtls_x509_crt_parse_path()
+ * \param buf      buffer to write to, can be NULL if size is 0
+ * \param size     size of the buffer
+ * \param olen     set to the length of the snapshot, also when the
+ *                 buffer is too small
+ *
+ * \return         0 if successful, MBEDTLS_ERR_X509_BUFFER_TOO_SMALL if
+ *                 buf can't hold the snapshot, or
+ *                 MBEDTLS_ERR_X509_BAD_INPUT_DATA if the list is too large
+ *                 for the format
+ */
+int mbedtls_x509_snapshot_write( const mbedtls_x509_crt *chain,
+                                 unsigned char *buf, size_t size,
+                                 size_t *olen );
+
+/**
+ * \brief          Parse the certificates of a snapshot and add them to a
+ *                 list, without copying them
+ *
+ * \warning        Like with mbedtls_x509_crt_parse_der_nocopy(), the
+ *                 buffer must stay valid and unmodified until the list is
+ *                 freed with mbedtls_x509_crt_free().
+ *
+ * \param chain    points to the start of the list
+ * \param buf      buffer holding the snapshot
+ * \param buflen   length of the snapshot
+ *
+ * \return         0 if successful, MBEDTLS_ERR_X509_INVALID_FORMAT if the
+ *                 snapshot is malformed, or a specific X509 or PEM error
+ *                 code if a certificate doesn't parse
+ */
+int mbedtls_x509_snapshot_parse( mbedtls_x509_crt *chain,
+                                 const unsigned char *buf, size_t buflen );
+
+#if defined(MBEDTLS_FS_IO)
+/**
+ * \brief          Initialize a snapshot context
+ *
+ * \param snap     snapshot context
+ */
+void mbedtls_x509_snapshot_init( mbedtls_x509_snapshot *snap );
+
+/**
+ * \brief          Write a snapshot of a list of certificates to a file
+ *
+ * \param chain    list to write
+ * \param path     file to write
+ *
+ * \return         0 if successful, or a specific X509 error code
+ */
+int mbedtls_x509_snapshot_write_file( const mbedtls_x509_crt *chain,
+                                      const char *path );
+
+/**
+ * \brief          Load the certificates of a snapshot file into
+ *                 snap->chain
+ *
+ *                 On Unix-like systems the file is mapped read-only, so
+ *                 processes loading the same file share its pages.
+ *                 Elsewhere, it is read into memory.
+ *
+ * \param snap     snapshot context, initialized
+ * \param path     snapshot file, written by
+ *                 mbedtls_x509_snapshot_write_file() or
+ *                 programs/x509/ca_snapshot
+ *
+ * \note           The file must not be modified while it is loaded: write
+ *                 a new snapshot to another file and rename it instead.
+ *
+ * \return         0 if successful, or a specific X509 or PEM error code
+ */
+int mbedtls_x509_snapshot_load_file( mbedtls_x509_snapshot *snap,
+                                     const char *path );
+
+/**
+ * \brief          Free the certificates of a snapshot and unmap it
+ *
+ * \param snap     snapshot context
+ */
+void mbedtls_x509_snapshot_free( mbedtls_x509_snapshot *snap );
+#endif /* MBEDTLS_FS_IO */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* x509_snapshot.h */
@@ -0,0 +1,185 @@
+/**
+ * \file x509_verify_cache.h
+ *
+ * \brief Cache of the results of X.509 certificate chain verification
+ */
+/*
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+#ifndef MBEDTLS_X509_VERIFY_CACHE_H
+#define MBEDTLS_X509_VERIFY_CACHE_H
+
+#include "x509_crt.h"
+
+#if defined(MBEDTLS_HAVE_TIME)
+#include "platform_time.h"
+#endif
+
+#if defined(MBEDTLS_THREADING_C)
+#include "threading.h"
+#endif
+
+/**
+ * \name SECTION: Module settings
+ *
+ * The configuration options you can set for this module are in this section.
+ * Either change them in config.h or define them on the compiler command line.
+ * \{
+ */
+
+#if !defined(MBEDTLS_X509_VERIFY_CACHE_DEFAULT_TIMEOUT)
+#define MBEDTLS_X509_VERIFY_CACHE_DEFAULT_TIMEOUT       3600   /*!< 1 hour */
+#endif
+
+#if !defined(MBEDTLS_X509_VERIFY_CACHE_DEFAULT_MAX_ENTRIES)
+#define MBEDTLS_X509_VERIFY_CACHE_DEFAULT_MAX_ENTRIES   1024   /*!< Maximum entries in cache */
+#endif
+
+/* \} name SECTION: Module settings */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mbedtls_x509_verify_cache_entry mbedtls_x509_verify_cache_entry;
+
+/**
+ * \brief   Result of the verification of one chain
+ */
+struct mbedtls_x509_verify_cache_entry
+{
+    unsigned char key[32];              /*!< digest of the chain and of
+                                             what it was verified against */
+    uint32_t flags;                     /*!< verification flags         */
+    mbedtls_x509_time not_after;        /*!< end of validity of the
+                                             result: certificates, CRLs */
+#if defined(MBEDTLS_HAVE_TIME)
+    mbedtls_time_t timestamp;           /*!< entry timestamp            */
+#endif
+    mbedtls_x509_verify_cache_entry *next;  /*!< bucket chain pointer   */
+};
+
+/**
+ * \brief   Verification cache
+ */
+typedef struct
+{
+    mbedtls_x509_verify_cache_entry *entries;   /*!< max_entries entries    */
+    mbedtls_x509_verify_cache_entry **buckets;  /*!< index of the entries   */
+    size_t count;                       /*!< entries in use                 */
+    size_t victim;                      /*!< next entry to replace once
+                                             the cache is full              */
+    int timeout;                        /*!< cache entry timeout            */
+    int max_entries;                    /*!< maximum entries                */
+    uint32_t generation;                /*!< bumped by
+                                             mbedtls_x509_verify_cache_flush() */
+    unsigned long hits;                 /*!< lookups that found a result    */
+    unsigned long misses;               /*!< lookups that didn't            */
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_threading_mutex_t mutex;    /*!< mutex                          */
+#endif
+}
+mbedtls_x509_verify_cache;
+
+/**
+ * \brief          Initialize a verification cache
+ *
+ * \param cache    verification cache
+ */
+void mbedtls_x509_verify_cache_init( mbedtls_x509_verify_cache *cache );
+
+#if defined(MBEDTLS_HAVE_TIME)
+/**
+ * \brief          Set the cache timeout
+ *                 (Default: MBEDTLS_X509_VERIFY_CACHE_DEFAULT_TIMEOUT (1 hour))
+ *
+ *                 A timeout of 0 indicates no timeout: results are kept
+ *                 until a certificate of the chain or a CRL expires.
+ *
+ * \param cache    verification cache
+ * \param timeout  cache entry timeout in seconds
+ */
+void mbedtls_x509_verify_cache_set_timeout( mbedtls_x509_verify_cache *cache,
+                                            int timeout );
+#endif /* MBEDTLS_HAVE_TIME */
+
+/**
+ * \brief          Set the maximum number of cache entries, and empty the
+ *                 cache
+ *                 (Default: MBEDTLS_X509_VERIFY_CACHE_DEFAULT_MAX_ENTRIES (1024))
+ *
+ * \param cache    verification cache
+ * \param max      cache entry maximum
+ */
+void mbedtls_x509_verify_cache_set_max_entries( mbedtls_x509_verify_cache *cache,
+                                                int max );
+
+/**
+ * \brief          Forget the results stored so far
+ *                 (Thread-safe if MBEDTLS_THREADING_C is enabled)
+ *
+ * \note           Call it after changing trusted CA lists, CRLs or
+ *                 profiles in place: results are only found again for the
+ *                 same lists, CRLs and profile (by address and content
+ *                 respectively), not for what they contain.
+ *
+ * \param cache    verification cache
+ */
+void mbedtls_x509_verify_cache_flush( mbedtls_x509_verify_cache *cache );
+
+/**
+ * \brief          Free referenced items in a cache context and clear memory
+ *
+ * \param cache    verification cache
+ */
+void mbedtls_x509_verify_cache_free( mbedtls_x509_verify_cache *cache );
+
+/**
+ * \brief          Verify a certificate chain like
+ *                 mbedtls_x509_crt_verify_with_profile(), or find the result
+ *                 of an earlier verification of the same chain in the cache
+ *                 (Thread-safe if MBEDTLS_THREADING_C is enabled)
+ *
+ *                 Results are found again for the same certificates,
+ *                 trusted CA list and CRLs (by content, including delta CRLs
+ *                 merged since), profile, expected name and verification
+ *                 callback, until the earliest end of validity
+ *                 of the certificates of the chain or the next update of a
+ *                 CRL, and at most for the timeout of the cache.
+ *
+ * \note           When the result is found in the cache, f_vrfy is not
+ *                 called: the flags are the ones it left last time.
+ *
+ * \param cache    verification cache, or NULL to just verify the chain
+ *
+ * \return         see mbedtls_x509_crt_verify_with_profile()
+ */
+int mbedtls_x509_crt_verify_with_cache( mbedtls_x509_verify_cache *cache,
+                     mbedtls_x509_crt *crt,
+                     mbedtls_x509_crt *trust_ca,
+                     mbedtls_x509_crl *ca_crl,
+                     const mbedtls_x509_crt_profile *profile,
+                     const char *cn, uint32_t *flags,
+                     int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *),
+                     void *p_vrfy );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* x509_verify_cache.h */
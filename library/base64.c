@@ -30,9 +30,17 @@
 #include "mbedtls/base64.h"
 
 #include <stdint.h>
+#include <string.h>
+
+#if defined(MBEDTLS_BASE64_SIMD) && defined(MBEDTLS_HAVE_ASM) &&             \
+    defined(__GNUC__) && ( defined(__amd64__) || defined(__x86_64__) ) &&  \
+    ( defined(__clang__) || __GNUC__ > 4 ||                                \
+      ( __GNUC__ == 4 && __GNUC_MINOR__ >= 9 ) )
+#define BASE64_SIMD_X86_64
+#include <immintrin.h>
+#endif
 
 #if defined(MBEDTLS_SELF_TEST)
-#include <string.h>
 #if defined(MBEDTLS_PLATFORM_C)
 #include "mbedtls/platform.h"
 #else
@@ -71,6 +79,287 @@ static const unsigned char base64_dec_map[128] =
 
 #define BASE64_SIZE_T_MAX   ( (size_t) -1 ) /* SIZE_T_MAX is not standard */
 
+#if defined(BASE64_SIMD_X86_64)
+
+#ifndef asm
+#define asm __asm
+#endif
+
+#define BASE64_SIMD_SSSE3   1
+#define BASE64_SIMD_AVX2    2
+
+#define BASE64_TARGET_SSSE3 __attribute__((target("ssse3")))
+#define BASE64_TARGET_AVX2  __attribute__((target("avx2")))
+
+/*
+ * SSSE3 and AVX2 support detection routine
+ */
+static unsigned int base64_simd_support( void )
+{
+    static int done = 0;
+    static unsigned int support = 0;
+    unsigned int a, b, c, d, what = 0;
+
+    if( ! done )
+    {
+        asm( "cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (1), "c" (0) );
+
+        if( ( c & 0x00000200u ) != 0 )
+            what |= BASE64_SIMD_SSSE3;
+
+        /* AVX2 also needs the OS to save the YMM registers (OSXSAVE, AVX) */
+        if( ( c & 0x18000000u ) == 0x18000000u )
+        {
+            /* xgetbv, emitted as bytecode for old versions of gas */
+            asm( ".byte 0x0F,0x01,0xD0" : "=a" (a), "=d" (d) : "c" (0) );
+
+            if( ( a & 6 ) == 6 )
+            {
+                asm( "cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "a" (7), "c" (0) );
+
+                if( ( b & 0x00000020u ) != 0 )
+                    what |= BASE64_SIMD_AVX2;
+            }
+        }
+
+        support = what;
+        done = 1;
+    }
+
+    return( support );
+}
+
+/*
+ * Encode 12 bytes from each 16-byte lane into 16 characters
+ * (W. Mula and D. Lemire, "Faster Base64 Encoding and Decoding Using AVX2
+ * Instructions")
+ */
+#define BASE64_ENC_SHUFFLE   1,  0,  2,  1,  4,  3,  5,  4,                \
+                             7,  6,  8,  7, 10,  9, 11, 10
+#define BASE64_ENC_OFFSETS  'a' - 26, '0' - 52, '0' - 52, '0' - 52,         \
+                            '0' - 52, '0' - 52, '0' - 52, '0' - 52,         \
+                            '0' - 52, '0' - 52, '0' - 52, '+' - 62,         \
+                            '/' - 63, 'A', 0, 0
+
+/*
+ * Decode 16 characters of each 16-byte lane into 12 bytes. A character is
+ * valid if no bit is set in both the entry of its low nibble in the first
+ * table and the entry of its high nibble in the second; '=' is not.
+ */
+#define BASE64_DEC_LO       0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, \
+                            0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A
+#define BASE64_DEC_HI       0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, \
+                            0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10
+#define BASE64_DEC_ROLL     0, 16, 19, 4, -65, -65, -71, -71,               \
+                            0,  0,  0, 0,   0,   0,   0,   0
+#define BASE64_DEC_PACK      2,  1,  0,  6,  5,  4, 10,  9,                 \
+                             8, 14, 13, 12, -1, -1, -1, -1
+
+BASE64_TARGET_SSSE3
+static size_t base64_encode_ssse3( unsigned char *dst,
+                                   const unsigned char *src, size_t slen )
+{
+    size_t i;
+    __m128i in, t0, t1, idx, res;
+    const __m128i shuf = _mm_setr_epi8( BASE64_ENC_SHUFFLE );
+    const __m128i offsets = _mm_setr_epi8( BASE64_ENC_OFFSETS );
+
+    for( i = 0; slen - i >= 16; i += 12, dst += 16 )
+    {
+        in = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)( src + i ) ),
+                               shuf );
+
+        t0 = _mm_mulhi_epu16( _mm_and_si128( in, _mm_set1_epi32( 0x0FC0FC00 ) ),
+                              _mm_set1_epi32( 0x04000040 ) );
+        t1 = _mm_mullo_epi16( _mm_and_si128( in, _mm_set1_epi32( 0x003F03F0 ) ),
+                              _mm_set1_epi32( 0x01000010 ) );
+        idx = _mm_or_si128( t0, t1 );
+
+        res = _mm_subs_epu8( idx, _mm_set1_epi8( 51 ) );
+        res = _mm_or_si128( res, _mm_and_si128(
+                  _mm_cmpgt_epi8( _mm_set1_epi8( 26 ), idx ), _mm_set1_epi8( 13 ) ) );
+        res = _mm_add_epi8( _mm_shuffle_epi8( offsets, res ), idx );
+
+        _mm_storeu_si128( (__m128i *) dst, res );
+    }
+
+    return( i );
+}
+
+BASE64_TARGET_AVX2
+static size_t base64_encode_avx2( unsigned char *dst,
+                                  const unsigned char *src, size_t slen )
+{
+    size_t i;
+    __m256i in, t0, t1, idx, res;
+    const __m256i shuf = _mm256_broadcastsi128_si256(
+                             _mm_setr_epi8( BASE64_ENC_SHUFFLE ) );
+    const __m256i offsets = _mm256_broadcastsi128_si256(
+                                _mm_setr_epi8( BASE64_ENC_OFFSETS ) );
+
+    /* Each lane reads 16 bytes, the second one from the 12th */
+    for( i = 0; slen - i >= 28; i += 24, dst += 32 )
+    {
+        in = _mm256_inserti128_si256( _mm256_castsi128_si256(
+                 _mm_loadu_si128( (const __m128i *)( src + i ) ) ),
+                 _mm_loadu_si128( (const __m128i *)( src + i + 12 ) ), 1 );
+        in = _mm256_shuffle_epi8( in, shuf );
+
+        t0 = _mm256_mulhi_epu16( _mm256_and_si256( in, _mm256_set1_epi32( 0x0FC0FC00 ) ),
+                                 _mm256_set1_epi32( 0x04000040 ) );
+        t1 = _mm256_mullo_epi16( _mm256_and_si256( in, _mm256_set1_epi32( 0x003F03F0 ) ),
+                                 _mm256_set1_epi32( 0x01000010 ) );
+        idx = _mm256_or_si256( t0, t1 );
+
+        res = _mm256_subs_epu8( idx, _mm256_set1_epi8( 51 ) );
+        res = _mm256_or_si256( res, _mm256_and_si256(
+                  _mm256_cmpgt_epi8( _mm256_set1_epi8( 26 ), idx ),
+                  _mm256_set1_epi8( 13 ) ) );
+        res = _mm256_add_epi8( _mm256_shuffle_epi8( offsets, res ), idx );
+
+        _mm256_storeu_si256( (__m256i *) dst, res );
+    }
+
+    return( i );
+}
+
+/*
+ * Decode the leading blocks of 16 characters, or validate them only if dst
+ * is NULL, up to the first block holding anything else than the 64 digits
+ */
+BASE64_TARGET_SSSE3
+static size_t base64_decode_ssse3( unsigned char *dst,
+                                   const unsigned char *src, size_t slen )
+{
+    size_t i;
+    uint32_t last;
+    __m128i in, hi, roll, out;
+    const __m128i lut_lo = _mm_setr_epi8( BASE64_DEC_LO );
+    const __m128i lut_hi = _mm_setr_epi8( BASE64_DEC_HI );
+    const __m128i lut_roll = _mm_setr_epi8( BASE64_DEC_ROLL );
+    const __m128i nibble = _mm_set1_epi8( 0x0F );
+
+    for( i = 0; slen - i >= 16; i += 16 )
+    {
+        in = _mm_loadu_si128( (const __m128i *)( src + i ) );
+        hi = _mm_and_si128( _mm_srli_epi32( in, 4 ), nibble );
+
+        if( _mm_movemask_epi8( _mm_cmpeq_epi8( _mm_and_si128(
+                _mm_shuffle_epi8( lut_lo, _mm_and_si128( in, nibble ) ),
+                _mm_shuffle_epi8( lut_hi, hi ) ), _mm_setzero_si128() ) ) != 0xFFFF )
+            break;
+
+        if( dst == NULL )
+            continue;
+
+        roll = _mm_shuffle_epi8( lut_roll, _mm_add_epi8(
+                   _mm_cmpeq_epi8( in, _mm_set1_epi8( '/' ) ), hi ) );
+        out = _mm_add_epi8( in, roll );
+
+        out = _mm_maddubs_epi16( out, _mm_set1_epi32( 0x01400140 ) );
+        out = _mm_madd_epi16( out, _mm_set1_epi32( 0x00011000 ) );
+        out = _mm_shuffle_epi8( out, _mm_setr_epi8( BASE64_DEC_PACK ) );
+
+        _mm_storel_epi64( (__m128i *) dst, out );
+        last = (uint32_t) _mm_cvtsi128_si32( _mm_srli_si128( out, 8 ) );
+        memcpy( dst + 8, &last, 4 );
+        dst += 12;
+    }
+
+    return( i );
+}
+
+BASE64_TARGET_AVX2
+static size_t base64_decode_avx2( unsigned char *dst,
+                                  const unsigned char *src, size_t slen )
+{
+    size_t i;
+    __m256i in, hi, roll, out;
+    const __m256i lut_lo = _mm256_broadcastsi128_si256(
+                               _mm_setr_epi8( BASE64_DEC_LO ) );
+    const __m256i lut_hi = _mm256_broadcastsi128_si256(
+                               _mm_setr_epi8( BASE64_DEC_HI ) );
+    const __m256i lut_roll = _mm256_broadcastsi128_si256(
+                                 _mm_setr_epi8( BASE64_DEC_ROLL ) );
+    const __m256i pack = _mm256_broadcastsi128_si256(
+                             _mm_setr_epi8( BASE64_DEC_PACK ) );
+    const __m256i nibble = _mm256_set1_epi8( 0x0F );
+
+    for( i = 0; slen - i >= 32; i += 32 )
+    {
+        in = _mm256_loadu_si256( (const __m256i *)( src + i ) );
+        hi = _mm256_and_si256( _mm256_srli_epi32( in, 4 ), nibble );
+
+        if( ! _mm256_testz_si256(
+                _mm256_shuffle_epi8( lut_lo, _mm256_and_si256( in, nibble ) ),
+                _mm256_shuffle_epi8( lut_hi, hi ) ) )
+            break;
+
+        if( dst == NULL )
+            continue;
+
+        roll = _mm256_shuffle_epi8( lut_roll, _mm256_add_epi8(
+                   _mm256_cmpeq_epi8( in, _mm256_set1_epi8( '/' ) ), hi ) );
+        out = _mm256_add_epi8( in, roll );
+
+        out = _mm256_maddubs_epi16( out, _mm256_set1_epi32( 0x01400140 ) );
+        out = _mm256_madd_epi16( out, _mm256_set1_epi32( 0x00011000 ) );
+        out = _mm256_shuffle_epi8( out, pack );
+        out = _mm256_permutevar8x32_epi32( out,
+                  _mm256_setr_epi32( 0, 1, 2, 4, 5, 6, 7, 7 ) );
+
+        _mm_storeu_si128( (__m128i *) dst, _mm256_castsi256_si128( out ) );
+        _mm_storel_epi64( (__m128i *)( dst + 16 ),
+                          _mm256_extracti128_si256( out, 1 ) );
+        dst += 24;
+    }
+
+    return( i );
+}
+
+/*
+ * Encode the leading multiples of 12 bytes the vector units can handle,
+ * and return the number of bytes encoded
+ */
+static size_t base64_encode_simd( unsigned char *dst,
+                                  const unsigned char *src, size_t slen )
+{
+    size_t i = 0;
+    unsigned int support = base64_simd_support();
+
+    if( support & BASE64_SIMD_AVX2 )
+        i = base64_encode_avx2( dst, src, slen );
+
+    if( support & BASE64_SIMD_SSSE3 )
+        i += base64_encode_ssse3( dst + i / 3 * 4, src + i, slen - i );
+
+    return( i );
+}
+
+/*
+ * Decode the leading multiples of 16 digits the vector units can handle,
+ * and return the number of characters consumed
+ */
+static size_t base64_decode_simd( unsigned char *dst,
+                                  const unsigned char *src, size_t slen )
+{
+    size_t i = 0;
+    unsigned int support = base64_simd_support();
+
+    if( slen < 16 )
+        return( 0 );
+
+    if( support & BASE64_SIMD_AVX2 )
+        i = base64_decode_avx2( dst, src, slen );
+
+    if( support & BASE64_SIMD_SSSE3 )
+        i += base64_decode_ssse3( dst == NULL ? NULL : dst + i / 4 * 3,
+                                  src + i, slen - i );
+
+    return( i );
+}
+#endif /* BASE64_SIMD_X86_64 */
+
 /*
  * Encode a buffer into base64 format
  */
@@ -104,8 +393,14 @@ int mbedtls_base64_encode( unsigned char *dst, size_t dlen, size_t *olen,
     }
 
     n = ( slen / 3 ) * 3;
+    i = 0;
+
+#if defined(BASE64_SIMD_X86_64)
+    i = base64_encode_simd( dst, src, n );
+    src += i;
+#endif
 
-    for( i = 0, p = dst; i < n; i += 3 )
+    for( p = dst + i / 3 * 4; i < n; i += 3 )
     {
         C1 = *src++;
         C2 = *src++;
@@ -139,24 +434,40 @@ int mbedtls_base64_encode( unsigned char *dst, size_t dlen, size_t *olen,
 }
 
 /*
- * Decode a base64-formatted buffer
+ * Check base64 data and count its digits and padding characters in *n and
+ * *pad, or decode it if dst is not NULL
  */
-int mbedtls_base64_decode( unsigned char *dst, size_t dlen, size_t *olen,
-                   const unsigned char *src, size_t slen )
+static int base64_decode_pass( unsigned char *dst, size_t *olen,
+                               size_t *n, size_t *pad,
+                               const unsigned char *src, size_t slen )
 {
-    size_t i, n;
-    uint32_t j, x;
-    unsigned char *p;
+    size_t i;
+    uint32_t j, x, g, spaces;
+    unsigned char *p = dst;
 
-    /* First pass: check for validity and get output length */
-    for( i = n = j = 0; i < slen; i++ )
+    for( i = *n = 0, j = x = g = 0; i < slen; i++ )
     {
+#if defined(BASE64_SIMD_X86_64)
+        /* Whole groups of digits, outside of padding */
+        if( g == 0 && j == 0 )
+        {
+            size_t k = base64_decode_simd( p, src + i, slen - i );
+            *n += k;
+
+            if( p != NULL )
+                p += k / 4 * 3;
+
+            if( ( i += k ) == slen )
+                break;
+        }
+#endif
+
         /* Skip spaces before checking for EOL */
-        x = 0;
+        spaces = 0;
         while( i < slen && src[i] == ' ' )
         {
             ++i;
-            ++x;
+            ++spaces;
         }
 
         /* Spaces at end of buffer are OK */
@@ -171,7 +482,7 @@ int mbedtls_base64_decode( unsigned char *dst, size_t dlen, size_t *olen,
             continue;
 
         /* Space inside a line is an error */
-        if( x != 0 )
+        if( spaces != 0 )
             return( MBEDTLS_ERR_BASE64_INVALID_CHARACTER );
 
         if( src[i] == '=' && ++j > 2 )
@@ -183,9 +494,44 @@ int mbedtls_base64_decode( unsigned char *dst, size_t dlen, size_t *olen,
         if( base64_dec_map[src[i]] < 64 && j != 0 )
             return( MBEDTLS_ERR_BASE64_INVALID_CHARACTER );
 
-        n++;
+        ++*n;
+        x = ( x << 6 ) | ( base64_dec_map[src[i]] & 0x3F );
+
+        if( ++g == 4 && p != NULL )
+        {
+            if( j < 3 ) *p++ = (unsigned char)( x >> 16 );
+            if( j < 2 ) *p++ = (unsigned char)( x >>  8 );
+            if( j < 1 ) *p++ = (unsigned char)( x       );
+        }
+
+        g &= 3;
     }
 
+    *pad = j;
+
+    if( p != NULL )
+        *olen = p - dst;
+
+    return( 0 );
+}
+
+/*
+ * Decode a base64-formatted buffer
+ */
+int mbedtls_base64_decode( unsigned char *dst, size_t dlen, size_t *olen,
+                   const unsigned char *src, size_t slen )
+{
+    int ret;
+    size_t n, j;
+
+    /* Single pass if the output fits whatever the input holds */
+    if( dst != NULL && dlen >= MBEDTLS_BASE64_DECODE_MAX_LEN( slen ) )
+        return( base64_decode_pass( dst, olen, &n, &j, src, slen ) );
+
+    /* First pass: check for validity and get output length */
+    if( ( ret = base64_decode_pass( NULL, NULL, &n, &j, src, slen ) ) != 0 )
+        return( ret );
+
     if( n == 0 )
     {
         *olen = 0;
@@ -205,26 +551,7 @@ int mbedtls_base64_decode( unsigned char *dst, size_t dlen, size_t *olen,
         return( MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL );
     }
 
-   for( j = 3, n = x = 0, p = dst; i > 0; i--, src++ )
-   {
-        if( *src == '\r' || *src == '\n' || *src == ' ' )
-            continue;
-
-        j -= ( base64_dec_map[*src] == 64 );
-        x  = ( x << 6 ) | ( base64_dec_map[*src] & 0x3F );
-
-        if( ++n == 4 )
-        {
-            n = 0;
-            if( j > 0 ) *p++ = (unsigned char)( x >> 16 );
-            if( j > 1 ) *p++ = (unsigned char)( x >>  8 );
-            if( j > 2 ) *p++ = (unsigned char)( x       );
-        }
-    }
-
-    *olen = p - dst;
-
-    return( 0 );
+    return( base64_decode_pass( dst, olen, &n, &j, src, slen ) );
 }
 
 #if defined(MBEDTLS_SELF_TEST)
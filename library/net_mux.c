@@ -0,0 +1,860 @@
+/*
+ *  Datagram multiplexer for DTLS servers
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ *  All the clients of a DTLS server share one UDP socket. Datagrams are read
+ *  and written a batch at a time, with recvmmsg() and sendmmsg() on Linux,
+ *  and handed to each client's SSL context through a small per-peer queue,
+ *  the peers being looked up in a hash table by address (or connection ID).
+ */
+
+/* Enables recvmmsg() & sendmmsg(), must come before any system header */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_NET_MUX_C)
+
+#if !defined(unix) && !defined(__unix__) && !defined(__unix) && \
+    !defined(__APPLE__)
+#error "This module only works on Unix, see MBEDTLS_NET_MUX_C in config.h"
+#endif
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free       free
+#endif
+
+#include "mbedtls/net_mux.h"
+
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#if defined(__linux__)
+#define NET_MUX_HAVE_MMSG
+#endif
+
+#define NET_MUX_NONE            ( (size_t) -1 )
+#define NET_MUX_MAX_TABLE       ( (size_t) 1 << 20 )
+
+/*
+ * Vectors for the system calls, one entry per datagram of a batch
+ */
+typedef struct
+{
+#if defined(NET_MUX_HAVE_MMSG)
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+#endif
+    struct sockaddr_storage *addrs;
+    size_t *slots;
+}
+net_mux_sys;
+
+/*
+ * 32-bit FNV-1a
+ */
+static uint32_t net_mux_hash( const unsigned char *buf, size_t len )
+{
+    uint32_t h = 2166136261u;
+
+    while( len-- > 0 )
+    {
+        h ^= *buf++;
+        h *= 16777619u;
+    }
+
+    return( h );
+}
+
+static int net_mux_would_block( void )
+{
+    switch( errno )
+    {
+#if defined EAGAIN
+        case EAGAIN:
+#endif
+#if defined EWOULDBLOCK && EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return( 1 );
+    }
+    return( 0 );
+}
+
+/*
+ * Peer tables
+ */
+static mbedtls_net_mux_peer *net_mux_find_addr( const mbedtls_net_mux *mux,
+                                                const unsigned char *addr,
+                                                size_t addr_len,
+                                                uint32_t hash )
+{
+    mbedtls_net_mux_peer *peer;
+
+    for( peer = mux->addr_table[hash & ( mux->table_size - 1 )];
+         peer != NULL; peer = peer->addr_next )
+    {
+        if( peer->addr_hash == hash && peer->addr_len == addr_len &&
+            memcmp( peer->addr, addr, addr_len ) == 0 )
+            return( peer );
+    }
+
+    return( NULL );
+}
+
+static mbedtls_net_mux_peer *net_mux_find_cid( const mbedtls_net_mux *mux,
+                                               const unsigned char *cid,
+                                               size_t cid_len,
+                                               uint32_t hash )
+{
+    mbedtls_net_mux_peer *peer;
+
+    for( peer = mux->cid_table[hash & ( mux->table_size - 1 )];
+         peer != NULL; peer = peer->cid_next )
+    {
+        if( peer->cid_hash == hash && peer->cid_len == cid_len &&
+            memcmp( peer->cid, cid, cid_len ) == 0 )
+            return( peer );
+    }
+
+    return( NULL );
+}
+
+static void net_mux_link_addr( mbedtls_net_mux *mux,
+                               mbedtls_net_mux_peer *peer )
+{
+    mbedtls_net_mux_peer **bucket;
+
+    peer->addr_hash = net_mux_hash( peer->addr, peer->addr_len );
+    bucket = &mux->addr_table[peer->addr_hash & ( mux->table_size - 1 )];
+    peer->addr_next = *bucket;
+    *bucket = peer;
+}
+
+static void net_mux_unlink_addr( mbedtls_net_mux *mux,
+                                 mbedtls_net_mux_peer *peer )
+{
+    mbedtls_net_mux_peer **p;
+
+    for( p = &mux->addr_table[peer->addr_hash & ( mux->table_size - 1 )];
+         *p != NULL; p = &(*p)->addr_next )
+    {
+        if( *p == peer )
+        {
+            *p = peer->addr_next;
+            break;
+        }
+    }
+    peer->addr_next = NULL;
+}
+
+static void net_mux_unlink_cid( mbedtls_net_mux *mux,
+                                mbedtls_net_mux_peer *peer )
+{
+    mbedtls_net_mux_peer **p;
+
+    for( p = &mux->cid_table[peer->cid_hash & ( mux->table_size - 1 )];
+         *p != NULL; p = &(*p)->cid_next )
+    {
+        if( *p == peer )
+        {
+            *p = peer->cid_next;
+            break;
+        }
+    }
+    peer->cid_next = NULL;
+}
+
+static mbedtls_net_mux_peer *net_mux_new_peer( mbedtls_net_mux *mux,
+                                               const unsigned char *addr,
+                                               size_t addr_len )
+{
+    mbedtls_net_mux_peer *peer;
+
+    if( mux->peers >= mux->max_peers )
+        return( NULL );
+
+    peer = mbedtls_calloc( 1, sizeof( mbedtls_net_mux_peer ) );
+    if( peer == NULL )
+        return( NULL );
+
+    peer->mux = mux;
+    memcpy( peer->addr, addr, addr_len );
+    peer->addr_len = addr_len;
+    net_mux_link_addr( mux, peer );
+
+    mux->peers++;
+
+    return( peer );
+}
+
+/*
+ * Receive slots and per-peer queues
+ */
+static void net_mux_free_slot( mbedtls_net_mux *mux, size_t slot )
+{
+    mux->rx_next[slot] = mux->rx_free;
+    mux->rx_free = slot;
+}
+
+static void net_mux_set_ready( mbedtls_net_mux *mux,
+                               mbedtls_net_mux_peer *peer )
+{
+    peer->ready = 1;
+    peer->ready_next = NULL;
+
+    if( mux->ready_tail == NULL )
+        mux->ready_head = peer;
+    else
+        mux->ready_tail->ready_next = peer;
+
+    mux->ready_tail = peer;
+}
+
+static void net_mux_dispatch( mbedtls_net_mux *mux, size_t slot )
+{
+    mbedtls_net_mux_peer *peer = NULL;
+    const unsigned char *dgram = mux->rx_buf + slot * mux->dgram_len;
+    const unsigned char *addr = mux->rx_addr +
+                                slot * MBEDTLS_NET_MUX_ADDR_MAX_LEN;
+    size_t addr_len = mux->rx_addr_len[slot];
+    unsigned char cid[MBEDTLS_NET_MUX_CID_MAX_LEN];
+    size_t cid_len = 0;
+
+    /* Truncated datagram, or sender we cannot remember */
+    if( mux->rx_len[slot] == 0 || addr_len == 0 )
+        goto drop;
+
+    if( mux->f_cid != NULL &&
+        mux->f_cid( mux->p_cid, dgram, mux->rx_len[slot],
+                    cid, &cid_len ) == 0 &&
+        cid_len > 0 && cid_len <= MBEDTLS_NET_MUX_CID_MAX_LEN )
+    {
+        peer = net_mux_find_cid( mux, cid, cid_len,
+                                 net_mux_hash( cid, cid_len ) );
+    }
+
+    if( peer == NULL )
+    {
+        peer = net_mux_find_addr( mux, addr, addr_len,
+                                  net_mux_hash( addr, addr_len ) );
+    }
+
+    if( peer == NULL &&
+        ( peer = net_mux_new_peer( mux, addr, addr_len ) ) == NULL )
+        goto drop;
+
+    mux->rx_next[slot] = NET_MUX_NONE;
+    if( peer->rx_count == 0 )
+        peer->rx_head = slot;
+    else
+        mux->rx_next[peer->rx_tail] = slot;
+    peer->rx_tail = slot;
+    peer->rx_count++;
+
+    if( peer->ready == 0 && peer != mux->current )
+        net_mux_set_ready( mux, peer );
+
+    return;
+
+drop:
+    mux->dropped++;
+    net_mux_free_slot( mux, slot );
+}
+
+/*
+ * Remember the sender of the datagram in a slot, if it fits
+ */
+static void net_mux_set_sender( mbedtls_net_mux *mux, size_t slot,
+                                const struct sockaddr_storage *addr,
+                                socklen_t addr_len )
+{
+    if( addr_len == 0 || (size_t) addr_len > MBEDTLS_NET_MUX_ADDR_MAX_LEN )
+    {
+        mux->rx_addr_len[slot] = 0;
+        return;
+    }
+
+    memcpy( mux->rx_addr + slot * MBEDTLS_NET_MUX_ADDR_MAX_LEN,
+            addr, addr_len );
+    mux->rx_addr_len[slot] = addr_len;
+}
+
+/*
+ * Read up to n datagrams into the slots listed in sys->slots
+ */
+static int net_mux_recv_sys( mbedtls_net_mux *mux, size_t n )
+{
+    net_mux_sys *sys = mux->sys;
+    size_t i, slot;
+    int ret;
+#if defined(NET_MUX_HAVE_MMSG)
+
+    for( i = 0; i < n; i++ )
+    {
+        slot = sys->slots[i];
+
+        sys->iov[i].iov_base = mux->rx_buf + slot * mux->dgram_len;
+        sys->iov[i].iov_len = mux->dgram_len;
+
+        memset( &sys->msgs[i], 0, sizeof( sys->msgs[i] ) );
+        sys->msgs[i].msg_hdr.msg_name = &sys->addrs[i];
+        sys->msgs[i].msg_hdr.msg_namelen = sizeof( sys->addrs[i] );
+        sys->msgs[i].msg_hdr.msg_iov = &sys->iov[i];
+        sys->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do
+        ret = recvmmsg( mux->fd, sys->msgs, (unsigned int) n, 0, NULL );
+    while( ret < 0 && errno == EINTR );
+
+    if( ret < 0 )
+    {
+        if( net_mux_would_block() != 0 )
+            return( MBEDTLS_ERR_SSL_WANT_READ );
+
+        return( MBEDTLS_ERR_NET_RECV_FAILED );
+    }
+
+    for( i = 0; i < (size_t) ret; i++ )
+    {
+        slot = sys->slots[i];
+
+        if( sys->msgs[i].msg_hdr.msg_flags & MSG_TRUNC )
+            mux->rx_len[slot] = 0;
+        else
+            mux->rx_len[slot] = sys->msgs[i].msg_len;
+
+        net_mux_set_sender( mux, slot, &sys->addrs[i],
+                            sys->msgs[i].msg_hdr.msg_namelen );
+    }
+
+    return( ret );
+#else
+    socklen_t addr_len;
+
+    for( i = 0; i < n; i++ )
+    {
+        slot = sys->slots[i];
+        addr_len = sizeof( sys->addrs[i] );
+
+        ret = (int) recvfrom( mux->fd, mux->rx_buf + slot * mux->dgram_len,
+                              mux->dgram_len, 0,
+                              (struct sockaddr *) &sys->addrs[i], &addr_len );
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+            {
+                i--;
+                continue;
+            }
+
+            if( i > 0 )
+                break;
+
+            if( net_mux_would_block() != 0 )
+                return( MBEDTLS_ERR_SSL_WANT_READ );
+
+            return( MBEDTLS_ERR_NET_RECV_FAILED );
+        }
+
+        mux->rx_len[slot] = ret;
+        net_mux_set_sender( mux, slot, &sys->addrs[i], addr_len );
+    }
+
+    return( (int) i );
+#endif /* NET_MUX_HAVE_MMSG */
+}
+
+/*
+ * Wait for the socket to become readable
+ */
+static int net_mux_wait( int fd, uint32_t timeout )
+{
+    int ret;
+    struct timeval tv;
+    fd_set read_fds;
+
+    FD_ZERO( &read_fds );
+    FD_SET( fd, &read_fds );
+
+    tv.tv_sec  = timeout / 1000;
+    tv.tv_usec = ( timeout % 1000 ) * 1000;
+
+    ret = select( fd + 1, &read_fds, NULL, NULL, timeout == 0 ? NULL : &tv );
+
+    /* Zero fds ready means we timed out */
+    if( ret == 0 )
+        return( MBEDTLS_ERR_SSL_TIMEOUT );
+
+    if( ret < 0 )
+    {
+        if( errno == EINTR )
+            return( MBEDTLS_ERR_SSL_WANT_READ );
+
+        return( MBEDTLS_ERR_NET_RECV_FAILED );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Drop the first datagrams of the send queue
+ */
+static void net_mux_tx_shift( mbedtls_net_mux *mux, size_t sent )
+{
+    size_t i;
+
+    for( i = sent; i < mux->tx_count; i++ )
+    {
+        memcpy( mux->tx_buf + ( i - sent ) * mux->dgram_len,
+                mux->tx_buf + i * mux->dgram_len, mux->tx_len[i] );
+        memcpy( mux->tx_addr + ( i - sent ) * MBEDTLS_NET_MUX_ADDR_MAX_LEN,
+                mux->tx_addr + i * MBEDTLS_NET_MUX_ADDR_MAX_LEN,
+                mux->tx_addr_len[i] );
+        mux->tx_len[i - sent] = mux->tx_len[i];
+        mux->tx_addr_len[i - sent] = mux->tx_addr_len[i];
+    }
+
+    mux->tx_count -= sent;
+}
+
+void mbedtls_net_mux_init( mbedtls_net_mux *mux )
+{
+    memset( mux, 0, sizeof( mbedtls_net_mux ) );
+    mux->fd = -1;
+}
+
+int mbedtls_net_mux_setup( mbedtls_net_mux *mux,
+                           mbedtls_net_context *bind_ctx,
+                           size_t max_peers, size_t batch, size_t dgram_len )
+{
+    net_mux_sys *sys;
+    size_t i;
+
+    if( bind_ctx == NULL || bind_ctx->fd < 0 || mux->fd >= 0 ||
+        max_peers == 0 || batch == 0 || dgram_len == 0 ||
+        batch > (size_t) -1 / dgram_len || batch > 0xFFFFFFFF )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    if( mbedtls_net_set_nonblock( bind_ctx ) != 0 )
+        return( MBEDTLS_ERR_NET_SOCKET_FAILED );
+
+    mux->batch = batch;
+    mux->dgram_len = dgram_len;
+    mux->max_peers = max_peers;
+
+    for( mux->table_size = 16;
+         mux->table_size < max_peers && mux->table_size < NET_MUX_MAX_TABLE;
+         mux->table_size <<= 1 );
+
+    mux->addr_table = mbedtls_calloc( mux->table_size,
+                                      sizeof( mbedtls_net_mux_peer * ) );
+    mux->cid_table = mbedtls_calloc( mux->table_size,
+                                     sizeof( mbedtls_net_mux_peer * ) );
+
+    mux->rx_buf = mbedtls_calloc( batch, dgram_len );
+    mux->rx_len = mbedtls_calloc( batch, sizeof( size_t ) );
+    mux->rx_next = mbedtls_calloc( batch, sizeof( size_t ) );
+    mux->rx_addr = mbedtls_calloc( batch, MBEDTLS_NET_MUX_ADDR_MAX_LEN );
+    mux->rx_addr_len = mbedtls_calloc( batch, sizeof( size_t ) );
+
+    mux->tx_buf = mbedtls_calloc( batch, dgram_len );
+    mux->tx_len = mbedtls_calloc( batch, sizeof( size_t ) );
+    mux->tx_addr = mbedtls_calloc( batch, MBEDTLS_NET_MUX_ADDR_MAX_LEN );
+    mux->tx_addr_len = mbedtls_calloc( batch, sizeof( size_t ) );
+
+    mux->sys = sys = mbedtls_calloc( 1, sizeof( net_mux_sys ) );
+    if( sys != NULL )
+    {
+#if defined(NET_MUX_HAVE_MMSG)
+        sys->msgs = mbedtls_calloc( batch, sizeof( struct mmsghdr ) );
+        sys->iov = mbedtls_calloc( batch, sizeof( struct iovec ) );
+#endif
+        sys->addrs = mbedtls_calloc( batch, sizeof( struct sockaddr_storage ) );
+        sys->slots = mbedtls_calloc( batch, sizeof( size_t ) );
+    }
+
+    if( mux->addr_table == NULL || mux->cid_table == NULL ||
+        mux->rx_buf == NULL || mux->rx_len == NULL || mux->rx_next == NULL ||
+        mux->rx_addr == NULL || mux->rx_addr_len == NULL ||
+        mux->tx_buf == NULL || mux->tx_len == NULL ||
+        mux->tx_addr == NULL || mux->tx_addr_len == NULL ||
+        sys == NULL ||
+#if defined(NET_MUX_HAVE_MMSG)
+        sys->msgs == NULL || sys->iov == NULL ||
+#endif
+        sys->addrs == NULL || sys->slots == NULL )
+    {
+        mbedtls_net_mux_free( mux );
+        return( MBEDTLS_ERR_NET_ALLOC_FAILED );
+    }
+
+    for( i = 0; i < batch; i++ )
+        mux->rx_next[i] = i + 1 < batch ? i + 1 : NET_MUX_NONE;
+    mux->rx_free = 0;
+
+    mux->fd = bind_ctx->fd;
+
+    return( 0 );
+}
+
+void mbedtls_net_mux_set_cid_cb( mbedtls_net_mux *mux,
+                                 mbedtls_net_mux_cid_t *f_cid,
+                                 void *p_cid )
+{
+    mux->f_cid = f_cid;
+    mux->p_cid = p_cid;
+}
+
+int mbedtls_net_mux_set_peer_cid( mbedtls_net_mux_peer *peer,
+                                  const unsigned char *cid, size_t cid_len )
+{
+    mbedtls_net_mux *mux = peer->mux;
+    mbedtls_net_mux_peer **bucket;
+
+    if( cid_len > MBEDTLS_NET_MUX_CID_MAX_LEN )
+        return( MBEDTLS_ERR_NET_BUFFER_TOO_SMALL );
+
+    if( peer->cid_len != 0 )
+    {
+        net_mux_unlink_cid( mux, peer );
+        peer->cid_len = 0;
+    }
+
+    if( cid == NULL || cid_len == 0 )
+        return( 0 );
+
+    memcpy( peer->cid, cid, cid_len );
+    peer->cid_len = cid_len;
+    peer->cid_hash = net_mux_hash( cid, cid_len );
+
+    bucket = &mux->cid_table[peer->cid_hash & ( mux->table_size - 1 )];
+    peer->cid_next = *bucket;
+    *bucket = peer;
+
+    return( 0 );
+}
+
+void mbedtls_net_mux_update_peer_addr( mbedtls_net_mux_peer *peer )
+{
+    if( peer->src_len == 0 ||
+        ( peer->src_len == peer->addr_len &&
+          memcmp( peer->src, peer->addr, peer->addr_len ) == 0 ) )
+        return;
+
+    net_mux_unlink_addr( peer->mux, peer );
+    memcpy( peer->addr, peer->src, peer->src_len );
+    peer->addr_len = peer->src_len;
+    net_mux_link_addr( peer->mux, peer );
+}
+
+int mbedtls_net_mux_recv_batch( mbedtls_net_mux *mux, uint32_t timeout )
+{
+    net_mux_sys *sys = mux->sys;
+    size_t n, i, slot;
+    int ret;
+
+    if( mux->fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    /* Hand the free slots to the system, first ones first */
+    for( n = 0, slot = mux->rx_free; n < mux->batch && slot != NET_MUX_NONE;
+         n++, slot = mux->rx_next[slot] )
+        sys->slots[n] = slot;
+
+    if( n == 0 )
+        return( 0 );
+
+    /* Under load there is always something to read: don't wait for it */
+    ret = net_mux_recv_sys( mux, n );
+    if( ret == MBEDTLS_ERR_SSL_WANT_READ )
+    {
+        if( ( ret = net_mux_wait( mux->fd, timeout ) ) != 0 )
+            return( ret );
+
+        ret = net_mux_recv_sys( mux, n );
+        if( ret == MBEDTLS_ERR_SSL_WANT_READ )
+            return( 0 );
+    }
+
+    if( ret <= 0 )
+        return( ret );
+
+    mux->rx_free = mux->rx_next[sys->slots[ret - 1]];
+
+    for( i = 0; i < (size_t) ret; i++ )
+        net_mux_dispatch( mux, sys->slots[i] );
+
+    return( ret );
+}
+
+mbedtls_net_mux_peer *mbedtls_net_mux_next_ready( mbedtls_net_mux *mux )
+{
+    mbedtls_net_mux_peer *peer = mux->current;
+
+    /* The previous peer did not read everything: give it another turn */
+    if( peer != NULL && peer->rx_count > 0 )
+        net_mux_set_ready( mux, peer );
+
+    if( ( peer = mux->ready_head ) == NULL )
+    {
+        mux->current = NULL;
+        return( NULL );
+    }
+
+    mux->ready_head = peer->ready_next;
+    if( mux->ready_head == NULL )
+        mux->ready_tail = NULL;
+
+    peer->ready = 0;
+    peer->ready_next = NULL;
+    mux->current = peer;
+
+    return( peer );
+}
+
+int mbedtls_net_mux_flush( mbedtls_net_mux *mux )
+{
+    size_t sent = 0;
+    int ret, err = 0;
+#if defined(NET_MUX_HAVE_MMSG)
+    net_mux_sys *sys = mux->sys;
+    size_t i;
+#endif
+
+    if( mux->fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    if( mux->tx_count == 0 )
+        return( 0 );
+
+#if defined(NET_MUX_HAVE_MMSG)
+    for( i = 0; i < mux->tx_count; i++ )
+    {
+        sys->iov[i].iov_base = mux->tx_buf + i * mux->dgram_len;
+        sys->iov[i].iov_len = mux->tx_len[i];
+
+        memset( &sys->msgs[i], 0, sizeof( sys->msgs[i] ) );
+        sys->msgs[i].msg_hdr.msg_name =
+            mux->tx_addr + i * MBEDTLS_NET_MUX_ADDR_MAX_LEN;
+        sys->msgs[i].msg_hdr.msg_namelen = (socklen_t) mux->tx_addr_len[i];
+        sys->msgs[i].msg_hdr.msg_iov = &sys->iov[i];
+        sys->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+#endif
+
+    while( sent < mux->tx_count )
+    {
+#if defined(NET_MUX_HAVE_MMSG)
+        ret = sendmmsg( mux->fd, sys->msgs + sent,
+                        (unsigned int) ( mux->tx_count - sent ), 0 );
+#else
+        ret = (int) sendto( mux->fd, mux->tx_buf + sent * mux->dgram_len,
+                            mux->tx_len[sent], 0,
+                            (const struct sockaddr *) ( mux->tx_addr +
+                                sent * MBEDTLS_NET_MUX_ADDR_MAX_LEN ),
+                            (socklen_t) mux->tx_addr_len[sent] );
+        if( ret >= 0 )
+            ret = 1;
+#endif
+        if( ret < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+
+            if( net_mux_would_block() != 0 )
+                break;
+
+            /* Give up on the datagram the system refused, not the others */
+            err = MBEDTLS_ERR_NET_SEND_FAILED;
+            ret = 1;
+        }
+
+        sent += ret;
+    }
+
+    net_mux_tx_shift( mux, sent );
+
+    if( mux->tx_count > 0 )
+        return( MBEDTLS_ERR_SSL_WANT_WRITE );
+
+    return( err );
+}
+
+void mbedtls_net_mux_close_peer( mbedtls_net_mux_peer *peer )
+{
+    mbedtls_net_mux *mux = peer->mux;
+    mbedtls_net_mux_peer *prev;
+    size_t slot;
+
+    while( peer->rx_count > 0 )
+    {
+        slot = peer->rx_head;
+        peer->rx_head = mux->rx_next[slot];
+        peer->rx_count--;
+        net_mux_free_slot( mux, slot );
+    }
+
+    if( peer->ready != 0 )
+    {
+        if( mux->ready_head == peer )
+            prev = NULL;
+        else
+            for( prev = mux->ready_head; prev->ready_next != peer;
+                 prev = prev->ready_next );
+
+        if( prev == NULL )
+            mux->ready_head = peer->ready_next;
+        else
+            prev->ready_next = peer->ready_next;
+
+        if( mux->ready_tail == peer )
+            mux->ready_tail = prev;
+    }
+
+    if( mux->current == peer )
+        mux->current = NULL;
+
+    net_mux_unlink_addr( mux, peer );
+    if( peer->cid_len != 0 )
+        net_mux_unlink_cid( mux, peer );
+
+    mux->peers--;
+    mbedtls_free( peer );
+}
+
+int mbedtls_net_mux_send( void *ctx, const unsigned char *buf, size_t len )
+{
+    mbedtls_net_mux_peer *peer = (mbedtls_net_mux_peer *) ctx;
+    mbedtls_net_mux *mux = peer->mux;
+    size_t i;
+    int ret;
+
+    if( mux == NULL || mux->fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    if( len > mux->dgram_len )
+        return( MBEDTLS_ERR_NET_BUFFER_TOO_SMALL );
+
+    if( mux->tx_count == mux->batch &&
+        ( ret = mbedtls_net_mux_flush( mux ) ) != 0 &&
+        mux->tx_count == mux->batch )
+        return( ret );
+
+    i = mux->tx_count++;
+    memcpy( mux->tx_buf + i * mux->dgram_len, buf, len );
+    mux->tx_len[i] = len;
+    memcpy( mux->tx_addr + i * MBEDTLS_NET_MUX_ADDR_MAX_LEN,
+            peer->addr, peer->addr_len );
+    mux->tx_addr_len[i] = peer->addr_len;
+
+    return( (int) len );
+}
+
+int mbedtls_net_mux_recv( void *ctx, unsigned char *buf, size_t len )
+{
+    mbedtls_net_mux_peer *peer = (mbedtls_net_mux_peer *) ctx;
+    mbedtls_net_mux *mux = peer->mux;
+    size_t slot;
+
+    if( mux == NULL || mux->fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    if( peer->rx_count == 0 )
+        return( MBEDTLS_ERR_SSL_WANT_READ );
+
+    slot = peer->rx_head;
+    if( len > mux->rx_len[slot] )
+        len = mux->rx_len[slot];
+
+    memcpy( buf, mux->rx_buf + slot * mux->dgram_len, len );
+    memcpy( peer->src, mux->rx_addr + slot * MBEDTLS_NET_MUX_ADDR_MAX_LEN,
+            mux->rx_addr_len[slot] );
+    peer->src_len = mux->rx_addr_len[slot];
+
+    peer->rx_head = mux->rx_next[slot];
+    peer->rx_count--;
+    net_mux_free_slot( mux, slot );
+
+    return( (int) len );
+}
+
+void mbedtls_net_mux_free( mbedtls_net_mux *mux )
+{
+    net_mux_sys *sys = mux->sys;
+    mbedtls_net_mux_peer *peer, *next;
+    size_t i;
+
+    if( mux->addr_table != NULL )
+    {
+        for( i = 0; i < mux->table_size; i++ )
+        {
+            for( peer = mux->addr_table[i]; peer != NULL; peer = next )
+            {
+                next = peer->addr_next;
+                mbedtls_free( peer );
+            }
+        }
+    }
+
+    if( sys != NULL )
+    {
+#if defined(NET_MUX_HAVE_MMSG)
+        mbedtls_free( sys->msgs );
+        mbedtls_free( sys->iov );
+#endif
+        mbedtls_free( sys->addrs );
+        mbedtls_free( sys->slots );
+        mbedtls_free( sys );
+    }
+
+    mbedtls_free( mux->addr_table );
+    mbedtls_free( mux->cid_table );
+    mbedtls_free( mux->rx_buf );
+    mbedtls_free( mux->rx_len );
+    mbedtls_free( mux->rx_next );
+    mbedtls_free( mux->rx_addr );
+    mbedtls_free( mux->rx_addr_len );
+    mbedtls_free( mux->tx_buf );
+    mbedtls_free( mux->tx_len );
+    mbedtls_free( mux->tx_addr );
+    mbedtls_free( mux->tx_addr_len );
+
+    mbedtls_net_mux_init( mux );
+}
+
+#endif /* MBEDTLS_NET_MUX_C */
@@ -98,6 +98,23 @@ static int wsa_init_done = 0;
 
 #include <stdint.h>
 
+#if defined(MBEDTLS_SSL_KTLS) && defined(__linux__)
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#if !defined(SOL_TLS)
+#define SOL_TLS         282
+#endif
+#if !defined(TCP_ULP)
+#define TCP_ULP         31
+#endif
+
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+#endif /* MBEDTLS_SSL_KTLS && __linux__ */
+
 /*
  * Prepare for using the sockets interface
  */
@@ -574,6 +591,257 @@ int mbedtls_net_send( void *ctx, const unsigned char *buf, size_t len )
     return( ret );
 }
 
+#if defined(MBEDTLS_SSL_KTLS)
+#if defined(__linux__)
+/*
+ * Program the kernel with the state of one direction of the connection
+ */
+static int net_ktls_set_crypto( int fd, int optname,
+                                const mbedtls_ssl_ktls_info *info )
+{
+    int ret;
+    socklen_t len;
+    union
+    {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+#if defined(TLS_CIPHER_AES_GCM_256)
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+#endif
+    } crypto;
+
+    memset( &crypto, 0, sizeof( crypto ) );
+
+    if( info->cipher == MBEDTLS_CIPHER_AES_128_GCM &&
+        info->key_len == TLS_CIPHER_AES_GCM_128_KEY_SIZE )
+    {
+        crypto.gcm128.info.version = TLS_1_2_VERSION;
+        crypto.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy( crypto.gcm128.key, info->key, TLS_CIPHER_AES_GCM_128_KEY_SIZE );
+        memcpy( crypto.gcm128.salt, info->salt, TLS_CIPHER_AES_GCM_128_SALT_SIZE );
+        memcpy( crypto.gcm128.iv, info->iv, TLS_CIPHER_AES_GCM_128_IV_SIZE );
+        memcpy( crypto.gcm128.rec_seq, info->rec_seq,
+                TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE );
+        len = sizeof( crypto.gcm128 );
+    }
+#if defined(TLS_CIPHER_AES_GCM_256)
+    else if( info->cipher == MBEDTLS_CIPHER_AES_256_GCM &&
+             info->key_len == TLS_CIPHER_AES_GCM_256_KEY_SIZE )
+    {
+        crypto.gcm256.info.version = TLS_1_2_VERSION;
+        crypto.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy( crypto.gcm256.key, info->key, TLS_CIPHER_AES_GCM_256_KEY_SIZE );
+        memcpy( crypto.gcm256.salt, info->salt, TLS_CIPHER_AES_GCM_256_SALT_SIZE );
+        memcpy( crypto.gcm256.iv, info->iv, TLS_CIPHER_AES_GCM_256_IV_SIZE );
+        memcpy( crypto.gcm256.rec_seq, info->rec_seq,
+                TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE );
+        len = sizeof( crypto.gcm256 );
+    }
+#endif
+    else
+        return( MBEDTLS_ERR_NET_KTLS_UNAVAILABLE );
+
+    ret = setsockopt( fd, SOL_TLS, optname, &crypto, len );
+
+    mbedtls_zeroize( &crypto, sizeof( crypto ) );
+
+    return( ret == 0 ? 0 : MBEDTLS_ERR_NET_KTLS_UNAVAILABLE );
+}
+
+/*
+ * Offload the record layer of an established connection to the kernel
+ */
+int mbedtls_net_ktls_offload( mbedtls_net_context *ctx,
+                              mbedtls_ssl_context *ssl )
+{
+    int ret;
+    int directions = MBEDTLS_SSL_KTLS_TX;
+    mbedtls_ssl_ktls_info info;
+
+    if( ctx->fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    /* Check the connection can be offloaded before touching the socket */
+    if( ( ret = mbedtls_ssl_get_ktls_info( ssl, MBEDTLS_SSL_KTLS_TX,
+                                           &info ) ) != 0 )
+    {
+        goto exit;
+    }
+
+    /*
+     * Fails if the tls module is not available. Until keys are set, the
+     * socket keeps behaving as a plain TCP socket, so both failures leave
+     * the connection usable by the user-space record layer.
+     */
+    if( setsockopt( ctx->fd, SOL_TCP, TCP_ULP, "tls", sizeof( "tls" ) ) != 0 ||
+        net_ktls_set_crypto( ctx->fd, TLS_TX, &info ) != 0 )
+    {
+        ret = MBEDTLS_ERR_NET_KTLS_UNAVAILABLE;
+        goto exit;
+    }
+
+    /* Receive offload needs Linux 4.17+ and nothing read ahead */
+    if( mbedtls_ssl_get_ktls_info( ssl, MBEDTLS_SSL_KTLS_RX, &info ) == 0 &&
+        net_ktls_set_crypto( ctx->fd, TLS_RX, &info ) == 0 )
+    {
+        directions |= MBEDTLS_SSL_KTLS_RX;
+    }
+
+    ret = mbedtls_ssl_set_ktls( ssl, directions, mbedtls_net_ktls_send_record,
+                                mbedtls_net_ktls_recv );
+
+exit:
+    mbedtls_zeroize( &info, sizeof( info ) );
+
+    return( ret == 0 ? directions : ret );
+}
+
+/*
+ * Send a record of the given type: the record type is passed to the kernel
+ * as ancillary data
+ */
+int mbedtls_net_ktls_send_record( void *ctx, unsigned char type,
+                                  const unsigned char *buf, size_t len )
+{
+    int ret;
+    int fd = ((mbedtls_net_context *) ctx)->fd;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        struct cmsghdr align;
+        unsigned char buf[CMSG_SPACE( sizeof( unsigned char ) )];
+    } cbuf;
+
+    if( fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    memset( &msg, 0, sizeof( msg ) );
+    memset( &cbuf, 0, sizeof( cbuf ) );
+
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof( cbuf.buf );
+
+    cmsg = CMSG_FIRSTHDR( &msg );
+    cmsg->cmsg_level = SOL_TLS;
+    cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg->cmsg_len = CMSG_LEN( sizeof( unsigned char ) );
+    *CMSG_DATA( cmsg ) = type;
+
+    ret = (int) sendmsg( fd, &msg, 0 );
+
+    if( ret < 0 )
+    {
+        if( net_would_block( ctx ) != 0 || errno == EINTR )
+            return( MBEDTLS_ERR_SSL_WANT_WRITE );
+
+        if( errno == EPIPE || errno == ECONNRESET )
+            return( MBEDTLS_ERR_NET_CONN_RESET );
+
+        return( MBEDTLS_ERR_NET_SEND_FAILED );
+    }
+
+    return( ret );
+}
+
+/*
+ * Read application data, reporting records of other types as errors
+ */
+int mbedtls_net_ktls_recv( void *ctx, unsigned char *buf, size_t len )
+{
+    int ret;
+    int fd = ((mbedtls_net_context *) ctx)->fd;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    unsigned char type;
+    union
+    {
+        struct cmsghdr align;
+        unsigned char buf[CMSG_SPACE( sizeof( unsigned char ) )];
+    } cbuf;
+
+    if( fd < 0 )
+        return( MBEDTLS_ERR_NET_INVALID_CONTEXT );
+
+    memset( &msg, 0, sizeof( msg ) );
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf.buf;
+    msg.msg_controllen = sizeof( cbuf.buf );
+
+    ret = (int) recvmsg( fd, &msg, 0 );
+
+    if( ret < 0 )
+    {
+        if( net_would_block( ctx ) != 0 || errno == EINTR )
+            return( MBEDTLS_ERR_SSL_WANT_READ );
+
+        if( errno == EPIPE || errno == ECONNRESET )
+            return( MBEDTLS_ERR_NET_CONN_RESET );
+
+        return( MBEDTLS_ERR_NET_RECV_FAILED );
+    }
+
+    cmsg = CMSG_FIRSTHDR( &msg );
+    if( cmsg == NULL || cmsg->cmsg_level != SOL_TLS ||
+        cmsg->cmsg_type != TLS_GET_RECORD_TYPE )
+    {
+        return( ret );
+    }
+
+    type = *CMSG_DATA( cmsg );
+    if( type == MBEDTLS_SSL_MSG_APPLICATION_DATA )
+        return( ret );
+
+    if( type != MBEDTLS_SSL_MSG_ALERT )
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+
+    if( ret == 2 && buf[1] == MBEDTLS_SSL_ALERT_MSG_CLOSE_NOTIFY )
+        return( MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY );
+
+    /* Ignore warnings, as the user-space record layer does */
+    if( ret == 2 && buf[0] == MBEDTLS_SSL_ALERT_LEVEL_WARNING )
+        return( MBEDTLS_ERR_SSL_WANT_READ );
+
+    return( MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE );
+}
+#else /* __linux__ */
+int mbedtls_net_ktls_offload( mbedtls_net_context *ctx,
+                              mbedtls_ssl_context *ssl )
+{
+    ((void) ctx);
+    ((void) ssl);
+    return( MBEDTLS_ERR_NET_KTLS_UNAVAILABLE );
+}
+
+int mbedtls_net_ktls_send_record( void *ctx, unsigned char type,
+                                  const unsigned char *buf, size_t len )
+{
+    ((void) ctx);
+    ((void) type);
+    ((void) buf);
+    ((void) len);
+    return( MBEDTLS_ERR_NET_KTLS_UNAVAILABLE );
+}
+
+int mbedtls_net_ktls_recv( void *ctx, unsigned char *buf, size_t len )
+{
+    ((void) ctx);
+    ((void) buf);
+    ((void) len);
+    return( MBEDTLS_ERR_NET_KTLS_UNAVAILABLE );
+}
+#endif /* __linux__ */
+#endif /* MBEDTLS_SSL_KTLS */
+
 /*
  * Gracefully close the connection
  */
@@ -231,12 +231,37 @@ exit:
 #endif /* MBEDTLS_MD5_C && MBEDTLS_CIPHER_MODE_CBC &&
           ( MBEDTLS_AES_C || MBEDTLS_DES_C ) */
 
+/*
+ * Find the first header or footer line in nul-terminated data. These lines
+ * start with a dash, which base64 does not use, so the search jumps from one
+ * dash to the next rather than trying every position of the data.
+ */
+static const unsigned char *pem_find_boundary( const unsigned char *data,
+                                               const char *boundary )
+{
+    const char *p = (const char *) data;
+    size_t len = strlen( boundary );
+
+    if( len == 0 )
+        return( data );
+
+    while( ( p = strchr( p, boundary[0] ) ) != NULL )
+    {
+        if( strncmp( p, boundary, len ) == 0 )
+            return( (const unsigned char *) p );
+
+        p++;
+    }
+
+    return( NULL );
+}
+
 int mbedtls_pem_read_buffer( mbedtls_pem_context *ctx, const char *header, const char *footer,
                      const unsigned char *data, const unsigned char *pwd,
                      size_t pwdlen, size_t *use_len )
 {
     int ret, enc;
-    size_t len;
+    size_t len, buflen;
     unsigned char *buf;
     const unsigned char *s1, *s2, *end;
 #if defined(MBEDTLS_MD5_C) && defined(MBEDTLS_CIPHER_MODE_CBC) &&         \
@@ -252,12 +277,12 @@ int mbedtls_pem_read_buffer( mbedtls_pem_context *ctx, const char *header, const
     if( ctx == NULL )
         return( MBEDTLS_ERR_PEM_BAD_INPUT_DATA );
 
-    s1 = (unsigned char *) strstr( (const char *) data, header );
+    s1 = pem_find_boundary( data, header );
 
     if( s1 == NULL )
         return( MBEDTLS_ERR_PEM_NO_HEADER_FOOTER_PRESENT );
 
-    s2 = (unsigned char *) strstr( (const char *) data, footer );
+    s2 = pem_find_boundary( data, footer );
 
     if( s2 == NULL || s2 <= s1 )
         return( MBEDTLS_ERR_PEM_NO_HEADER_FOOTER_PRESENT );
@@ -349,17 +374,15 @@ int mbedtls_pem_read_buffer( mbedtls_pem_context *ctx, const char *header, const
     if( s1 >= s2 )
         return( MBEDTLS_ERR_PEM_INVALID_DATA );
 
-    ret = mbedtls_base64_decode( NULL, 0, &len, s1, s2 - s1 );
+    /* Large enough to check and decode the data in a single pass */
+    buflen = MBEDTLS_BASE64_DECODE_MAX_LEN( (size_t)( s2 - s1 ) );
 
-    if( ret == MBEDTLS_ERR_BASE64_INVALID_CHARACTER )
-        return( MBEDTLS_ERR_PEM_INVALID_DATA + ret );
-
-    if( ( buf = mbedtls_calloc( 1, len ) ) == NULL )
+    if( ( buf = mbedtls_calloc( 1, buflen ) ) == NULL )
         return( MBEDTLS_ERR_PEM_ALLOC_FAILED );
 
-    if( ( ret = mbedtls_base64_decode( buf, len, &len, s1, s2 - s1 ) ) != 0 )
+    if( ( ret = mbedtls_base64_decode( buf, buflen, &len, s1, s2 - s1 ) ) != 0 )
     {
-        mbedtls_zeroize( buf, len );
+        mbedtls_zeroize( buf, buflen );
         mbedtls_free( buf );
         return( MBEDTLS_ERR_PEM_INVALID_DATA + ret );
     }
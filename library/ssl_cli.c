@@ -47,6 +47,10 @@
 #include "mbedtls/platform_time.h"
 #endif
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+#include "mbedtls/x509_ocsp.h"
+#endif
+
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
 /* Implementation that should never be optimized out by the compiler */
 static void mbedtls_zeroize( void *v, size_t n ) {
@@ -183,7 +187,7 @@ static void ssl_write_signature_algorithms_ext( mbedtls_ssl_context *ssl,
 
     *olen = 0;
 
-    if( ssl->conf->max_minor_ver != MBEDTLS_SSL_MINOR_VERSION_3 )
+    if( ssl->conf->max_minor_ver < MBEDTLS_SSL_MINOR_VERSION_3 )
         return;
 
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding signature_algorithms extension" ) );
@@ -195,6 +199,10 @@ static void ssl_write_signature_algorithms_ext( mbedtls_ssl_context *ssl,
 #endif
 #if defined(MBEDTLS_RSA_C)
         sig_alg_len += 2;
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && defined(MBEDTLS_RSA_C) && \
+    defined(MBEDTLS_PKCS1_V21)
+        sig_alg_len += 2;
 #endif
     }
 
@@ -218,6 +226,17 @@ static void ssl_write_signature_algorithms_ext( mbedtls_ssl_context *ssl,
 #if defined(MBEDTLS_RSA_C)
         sig_alg_list[sig_alg_len++] = mbedtls_ssl_hash_from_md_alg( *md );
         sig_alg_list[sig_alg_len++] = MBEDTLS_SSL_SIG_RSA;
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && defined(MBEDTLS_RSA_C) && \
+    defined(MBEDTLS_PKCS1_V21)
+        /* TLS 1.3 CertificateVerify is RSA-PSS only: rsa_pss_rsae_* */
+        if( ssl->conf->max_minor_ver >= MBEDTLS_SSL_MINOR_VERSION_4 &&
+            ( *md == MBEDTLS_MD_SHA256 || *md == MBEDTLS_MD_SHA384 ||
+              *md == MBEDTLS_MD_SHA512 ) )
+        {
+            sig_alg_list[sig_alg_len++] = 0x08;
+            sig_alg_list[sig_alg_len++] = mbedtls_ssl_hash_from_md_alg( *md );
+        }
 #endif
     }
 
@@ -404,7 +423,7 @@ static void ssl_write_ecjpake_kkpp_ext( mbedtls_ssl_context *ssl,
             return;
         }
 
-        ssl->handshake->ecjpake_cache = mbedtls_calloc( 1, kkpp_len );
+        ssl->handshake->ecjpake_cache = mbedtls_ssl_hs_calloc( ssl, 1, kkpp_len );
         if( ssl->handshake->ecjpake_cache == NULL )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "allocation failed" ) );
@@ -585,6 +604,17 @@ static void ssl_write_session_ticket_ext( mbedtls_ssl_context *ssl,
         return;
     }
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* TLS 1.3 tickets go in the pre_shared_key extension */
+    {
+        const mbedtls_ssl_ciphersuite_t *suite =
+            mbedtls_ssl_ciphersuite_from_id( ssl->session_negotiate->ciphersuite );
+
+        if( suite != NULL && mbedtls_ssl_ciphersuite_is_tls13( suite ) )
+            tlen = 0;
+    }
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding session ticket extension" ) );
 
     if( end < p || (size_t)( end - p ) < 4 + tlen )
@@ -614,6 +644,100 @@ static void ssl_write_session_ticket_ext( mbedtls_ssl_context *ssl,
 }
 #endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+static void ssl_write_status_request_ext( mbedtls_ssl_context *ssl,
+                                          unsigned char *buf, size_t *olen )
+{
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+
+    *olen = 0;
+
+    if( ssl->conf->ocsp_stapling == MBEDTLS_SSL_OCSP_STAPLING_DISABLED )
+    {
+        return;
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding status_request extension" ) );
+
+    if( end < p || (size_t)( end - p ) < 9 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return;
+    }
+
+    /*
+     * struct {
+     *     CertificateStatusType status_type;
+     *     select (status_type) {
+     *         case ocsp: OCSPStatusRequest;
+     *     } request;
+     * } CertificateStatusRequest;
+     *
+     * struct {
+     *     ResponderID responder_id_list<0..2^16-1>;
+     *     Extensions  request_extensions;
+     * } OCSPStatusRequest;
+     *
+     * Both lists are empty: the responder is known to the server.
+     */
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_STATUS_REQUEST >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_STATUS_REQUEST      ) & 0xFF );
+
+    *p++ = 0x00;
+    *p++ = 0x05;
+
+    *p++ = MBEDTLS_TLS_EXT_STATUS_REQUEST_OCSP;
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = 0x00;
+    *p++ = 0x00;
+
+    *olen = 9;
+}
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+static void ssl_write_cid_ext( mbedtls_ssl_context *ssl,
+                               unsigned char *buf, size_t *olen )
+{
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+
+    *olen = 0;
+
+    if( ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_DATAGRAM ||
+        ssl->negotiate_cid == MBEDTLS_SSL_CID_DISABLED )
+    {
+        return;
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding connection_id extension" ) );
+
+    if( end < p || (size_t)( end - p ) < 5 + (size_t) ssl->own_cid_len )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return;
+    }
+
+    /*
+     * struct {
+     *     opaque cid<0..2^8-1>;
+     * } ConnectionId;
+     */
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_CID >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_CID      ) & 0xFF );
+
+    *p++ = 0x00;
+    *p++ = (unsigned char)( ssl->own_cid_len + 1 );
+
+    *p++ = ssl->own_cid_len;
+    memcpy( p, ssl->own_cid, ssl->own_cid_len );
+
+    *olen = 5 + ssl->own_cid_len;
+}
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 #if defined(MBEDTLS_SSL_ALPN)
 static void ssl_write_alpn_ext( mbedtls_ssl_context *ssl,
                                 unsigned char *buf, size_t *olen )
@@ -674,165 +798,536 @@ static void ssl_write_alpn_ext( mbedtls_ssl_context *ssl,
 }
 #endif /* MBEDTLS_SSL_ALPN */
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
 /*
- * Generate random bytes for ClientHello
+ * Do we offer TLS 1.3? Not over DTLS, nor when renegotiating a TLS 1.2
+ * session.
  */
-static int ssl_generate_random( mbedtls_ssl_context *ssl )
+static int ssl_tls13_offered( const mbedtls_ssl_context *ssl )
 {
-    int ret;
-    unsigned char *p = ssl->handshake->randbytes;
-#if defined(MBEDTLS_HAVE_TIME)
-    mbedtls_time_t t;
-#endif
-
-    /*
-     * When responding to a verify request, MUST reuse random (RFC 6347 4.2.1)
-     */
-#if defined(MBEDTLS_SSL_PROTO_DTLS)
-    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
-        ssl->handshake->verify_cookie != NULL )
+    if( ssl->conf->max_minor_ver < MBEDTLS_SSL_MINOR_VERSION_4 ||
+        ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_STREAM )
     {
         return( 0 );
     }
+
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+    if( ssl->renego_status != MBEDTLS_SSL_INITIAL_HANDSHAKE )
+        return( 0 );
 #endif
 
-#if defined(MBEDTLS_HAVE_TIME)
-    t = mbedtls_time( NULL );
-    *p++ = (unsigned char)( t >> 24 );
-    *p++ = (unsigned char)( t >> 16 );
-    *p++ = (unsigned char)( t >>  8 );
-    *p++ = (unsigned char)( t       );
+    return( 1 );
+}
 
-    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, current time: %lu", t ) );
-#else
-    if( ( ret = ssl->conf->f_rng( ssl->conf->p_rng, p, 4 ) ) != 0 )
-        return( ret );
+static void ssl_write_supported_versions_ext( mbedtls_ssl_context *ssl,
+                                              unsigned char *buf,
+                                              size_t *olen )
+{
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+    size_t list_len;
+    int minor;
 
-    p += 4;
-#endif /* MBEDTLS_HAVE_TIME */
+    *olen = 0;
 
-    if( ( ret = ssl->conf->f_rng( ssl->conf->p_rng, p, 28 ) ) != 0 )
-        return( ret );
+    if( ! ssl_tls13_offered( ssl ) )
+        return;
 
-    return( 0 );
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding supported_versions extension" ) );
+
+    list_len = 2 * ( ssl->conf->max_minor_ver - ssl->conf->min_minor_ver + 1 );
+
+    if( end < p || (size_t)( end - p ) < 5 + list_len )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return;
+    }
+
+    /*
+     * struct {
+     *     ProtocolVersion versions<2..254>;
+     * } SupportedVersions;
+     */
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_SUPPORTED_VERSIONS >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_SUPPORTED_VERSIONS      ) & 0xFF );
+
+    *p++ = 0x00;
+    *p++ = (unsigned char)( list_len + 1 );
+    *p++ = (unsigned char)( list_len );
+
+    /* Not mbedtls_ssl_write_version(), which says TLS 1.2 for TLS 1.3 */
+    for( minor = ssl->conf->max_minor_ver;
+         minor >= ssl->conf->min_minor_ver; minor-- )
+    {
+        *p++ = (unsigned char) ssl->conf->max_major_ver;
+        *p++ = (unsigned char) minor;
+    }
+
+    *olen = 5 + list_len;
 }
 
-static int ssl_write_client_hello( mbedtls_ssl_context *ssl )
+static int ssl_write_key_share_ext( mbedtls_ssl_context *ssl,
+                                    unsigned char *buf,
+                                    size_t *olen )
 {
     int ret;
-    size_t i, n, olen, ext_len = 0;
-    unsigned char *buf;
-    unsigned char *p, *q;
-    unsigned char offer_compress;
-    const int *ciphersuites;
-    const mbedtls_ssl_ciphersuite_t *ciphersuite_info;
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+    mbedtls_ecp_group_id grp_id = MBEDTLS_ECP_DP_NONE;
+    const mbedtls_ecp_group_id *gid;
+    size_t len;
 
-    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> write client hello" ) );
+    *olen = 0;
 
-    if( ssl->conf->f_rng == NULL )
+    if( ! ssl_tls13_offered( ssl ) )
+        return( 0 );
+
+    /* Our favourite group, or the one the server asked for */
+    if( ssl->handshake->hello_retry )
+        grp_id = ssl->handshake->tls13_group;
+    else
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "no RNG provided") );
-        return( MBEDTLS_ERR_SSL_NO_RNG );
+        for( gid = ssl->conf->curve_list; *gid != MBEDTLS_ECP_DP_NONE; gid++ )
+        {
+            if( mbedtls_ssl_tls13_group_supported( *gid ) )
+            {
+                grp_id = *gid;
+                break;
+            }
+        }
     }
 
-#if defined(MBEDTLS_SSL_RENEGOTIATION)
-    if( ssl->renego_status == MBEDTLS_SSL_INITIAL_HANDSHAKE )
-#endif
+    if( grp_id == MBEDTLS_ECP_DP_NONE )
     {
-        ssl->major_ver = ssl->conf->min_major_ver;
-        ssl->minor_ver = ssl->conf->min_minor_ver;
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "no group for a TLS 1.3 key share" ) );
+        return( 0 );
     }
 
-    if( ssl->conf->max_major_ver == 0 )
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding key_share extension" ) );
+
+    if( end < p || end - p < 6 )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "configured max major version is invalid, "
-                            "consider using mbedtls_ssl_config_defaults()" ) );
-        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return( MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL );
     }
 
     /*
-     *     0  .   0   handshake type
-     *     1  .   3   handshake length
-     *     4  .   5   highest version supported
-     *     6  .   9   current UNIX time
-     *    10  .  37   random bytes
+     * struct {
+     *     KeyShareEntry client_shares<0..2^16-1>;
+     * } KeyShareClientHello;
      */
-    buf = ssl->out_msg;
-    p = buf + 4;
-
-    mbedtls_ssl_write_version( ssl->conf->max_major_ver, ssl->conf->max_minor_ver,
-                       ssl->conf->transport, p );
-    p += 2;
-
-    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, max version: [%d:%d]",
-                   buf[4], buf[5] ) );
-
-    if( ( ret = ssl_generate_random( ssl ) ) != 0 )
+    if( ( ret = mbedtls_ssl_tls13_write_key_share( ssl, grp_id, p + 6, end,
+                                                   &len ) ) != 0 )
     {
-        MBEDTLS_SSL_DEBUG_RET( 1, "ssl_generate_random", ret );
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_write_key_share", ret );
         return( ret );
     }
 
-    memcpy( p, ssl->handshake->randbytes, 32 );
-    MBEDTLS_SSL_DEBUG_BUF( 3, "client hello, random bytes", p, 32 );
-    p += 32;
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_KEY_SHARE >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_KEY_SHARE      ) & 0xFF );
 
-    /*
-     *    38  .  38   session id length
-     *    39  . 39+n  session id
-     *   39+n . 39+n  DTLS only: cookie length (1 byte)
-     *   40+n .  ..   DTSL only: cookie
-     *   ..   . ..    ciphersuitelist length (2 bytes)
-     *   ..   . ..    ciphersuitelist
-     *   ..   . ..    compression methods length (1 byte)
-     *   ..   . ..    compression methods
-     *   ..   . ..    extensions length (2 bytes)
-     *   ..   . ..    extensions
-     */
-    n = ssl->session_negotiate->id_len;
+    *p++ = (unsigned char)( ( ( len + 2 ) >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( ( len + 2 )      ) & 0xFF );
 
-    if( n < 16 || n > 32 ||
-#if defined(MBEDTLS_SSL_RENEGOTIATION)
-        ssl->renego_status != MBEDTLS_SSL_INITIAL_HANDSHAKE ||
-#endif
-        ssl->handshake->resume == 0 )
-    {
-        n = 0;
-    }
+    *p++ = (unsigned char)( ( len >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( len      ) & 0xFF );
+
+    *olen = 6 + len;
+
+    return( 0 );
+}
 
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
-    /*
-     * RFC 5077 section 3.4: "When presenting a ticket, the client MAY
-     * generate and include a Session ID in the TLS ClientHello."
-     */
-#if defined(MBEDTLS_SSL_RENEGOTIATION)
-    if( ssl->renego_status == MBEDTLS_SSL_INITIAL_HANDSHAKE )
-#endif
+/*
+ * Tickets can only be used with psk_dhe_ke: we always do (EC)DHE
+ */
+static void ssl_write_psk_key_exchange_modes_ext( mbedtls_ssl_context *ssl,
+                                                  unsigned char *buf,
+                                                  size_t *olen )
+{
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+
+    *olen = 0;
+
+    if( ! ssl_tls13_offered( ssl ) ||
+        ssl->conf->session_tickets == MBEDTLS_SSL_SESSION_TICKETS_DISABLED )
     {
-        if( ssl->session_negotiate->ticket != NULL &&
-                ssl->session_negotiate->ticket_len != 0 )
-        {
-            ret = ssl->conf->f_rng( ssl->conf->p_rng, ssl->session_negotiate->id, 32 );
+        return;
+    }
 
-            if( ret != 0 )
-                return( ret );
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding psk_key_exchange_modes extension" ) );
 
-            ssl->session_negotiate->id_len = n = 32;
-        }
+    if( end < p || end - p < 6 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return;
     }
+
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_PSK_KEY_EXCHANGE_MODES >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_PSK_KEY_EXCHANGE_MODES      ) & 0xFF );
+
+    *p++ = 0x00;
+    *p++ = 0x02;
+
+    *p++ = 0x01;
+    *p++ = MBEDTLS_TLS13_PSK_DHE_KE;
+
+    *olen = 6;
+}
 #endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
-    *p++ = (unsigned char) n;
+/*
+ * Echo the cookie of a HelloRetryRequest
+ */
+static void ssl_write_cookie_ext( mbedtls_ssl_context *ssl,
+                                  unsigned char *buf,
+                                  size_t *olen )
+{
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+    size_t cookie_len = ssl->handshake->tls13_cookie_len;
 
-    for( i = 0; i < n; i++ )
-        *p++ = ssl->session_negotiate->id[i];
+    *olen = 0;
 
-    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, session id len.: %d", n ) );
-    MBEDTLS_SSL_DEBUG_BUF( 3,   "client hello, session id", buf + 39, n );
+    if( ssl->handshake->tls13_cookie == NULL )
+        return;
 
-    /*
-     * DTLS cookie
-     */
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding cookie extension" ) );
+
+    if( end < p || (size_t)( end - p ) < 6 + cookie_len )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return;
+    }
+
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_COOKIE >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_COOKIE      ) & 0xFF );
+
+    *p++ = (unsigned char)( ( ( cookie_len + 2 ) >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( ( cookie_len + 2 )      ) & 0xFF );
+
+    *p++ = (unsigned char)( ( cookie_len >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( cookie_len      ) & 0xFF );
+
+    memcpy( p, ssl->handshake->tls13_cookie, cookie_len );
+
+    *olen = 6 + cookie_len;
+}
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+/*
+ * Offer the ticket of a TLS 1.3 session as PSK. This must be the last
+ * extension: the binder, written by ssl_write_psk_binder() once the whole
+ * message is known, covers everything before the binders list.
+ */
+static void ssl_write_pre_shared_key_ext( mbedtls_ssl_context *ssl,
+                                          unsigned char *buf,
+                                          size_t *olen )
+{
+    unsigned char *p = buf;
+    const unsigned char *end = ssl->out_msg + MBEDTLS_SSL_MAX_CONTENT_LEN;
+    mbedtls_ssl_session *session = ssl->session_negotiate;
+    const mbedtls_ssl_ciphersuite_t *suite;
+    size_t tlen = session->ticket_len, hlen;
+    uint32_t age = 0;
+
+    *olen = 0;
+    ssl->handshake->tls13_psk_dhe_ke = 0;
+
+    if( ! ssl_tls13_offered( ssl ) ||
+        ssl->conf->session_tickets == MBEDTLS_SSL_SESSION_TICKETS_DISABLED ||
+        ssl->handshake->resume == 0 ||
+        session->ticket == NULL || tlen == 0 ||
+        ( suite = mbedtls_ssl_ciphersuite_from_id( session->ciphersuite ) ) == NULL ||
+        ! mbedtls_ssl_ciphersuite_is_tls13( suite ) )
+    {
+        return;
+    }
+
+    /* After a HelloRetryRequest, the PSK must suit the chosen hash */
+    if( ssl->handshake->hello_retry &&
+        ssl->transform_negotiate->ciphersuite_info->mac != suite->mac )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "ticket hash doesn't match, not offering it" ) );
+        return;
+    }
+
+#if defined(MBEDTLS_HAVE_TIME)
+    {
+        mbedtls_time_t now = mbedtls_time( NULL );
+
+        if( now < session->start ||
+            (uint32_t)( now - session->start ) > session->ticket_lifetime )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "ticket expired, not offering it" ) );
+            return;
+        }
+
+        age = (uint32_t)( now - session->start ) * 1000;
+    }
+#endif
+
+    hlen = mbedtls_md_get_size( mbedtls_md_info_from_type( suite->mac ) );
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, adding pre_shared_key extension" ) );
+
+    if( end < p || (size_t)( end - p ) < 4 + 2 + 2 + tlen + 4 + 2 + 1 + hlen )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "buffer too small" ) );
+        return;
+    }
+
+    /*
+     * struct {
+     *     opaque identity<1..2^16-1>;
+     *     uint32 obfuscated_ticket_age;
+     * } PskIdentity;
+     *
+     * struct {
+     *     PskIdentity identities<7..2^16-1>;
+     *     PskBinderEntry binders<33..2^16-1>;
+     * } OfferedPsks;
+     */
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_PRE_SHARED_KEY >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( MBEDTLS_TLS_EXT_PRE_SHARED_KEY      ) & 0xFF );
+
+    *p++ = (unsigned char)( ( ( 2 + 2 + tlen + 4 + 2 + 1 + hlen ) >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( ( 2 + 2 + tlen + 4 + 2 + 1 + hlen )      ) & 0xFF );
+
+    *p++ = (unsigned char)( ( ( 2 + tlen + 4 ) >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( ( 2 + tlen + 4 )      ) & 0xFF );
+
+    *p++ = (unsigned char)( ( tlen >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( tlen      ) & 0xFF );
+    memcpy( p, session->ticket, tlen );
+    p += tlen;
+
+    age += session->ticket_age_add;
+    *p++ = (unsigned char)( ( age >> 24 ) & 0xFF );
+    *p++ = (unsigned char)( ( age >> 16 ) & 0xFF );
+    *p++ = (unsigned char)( ( age >>  8 ) & 0xFF );
+    *p++ = (unsigned char)( ( age       ) & 0xFF );
+
+    /* Binder placeholder */
+    *p++ = (unsigned char)( ( ( 1 + hlen ) >> 8 ) & 0xFF );
+    *p++ = (unsigned char)( ( ( 1 + hlen )      ) & 0xFF );
+    *p++ = (unsigned char) hlen;
+    memset( p, 0, hlen );
+
+    ssl->handshake->tls13_psk_dhe_ke = 1;
+    *olen = 4 + 2 + 2 + tlen + 4 + 2 + 1 + hlen;
+}
+
+/*
+ * Fill in the binder at the very end of the ClientHello in out_msg
+ */
+static int ssl_write_psk_binder( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    mbedtls_md_type_t md_alg = mbedtls_ssl_ciphersuite_from_id(
+                                    ssl->session_negotiate->ciphersuite )->mac;
+    size_t hlen = mbedtls_md_get_size( mbedtls_md_info_from_type( md_alg ) );
+    size_t truncated_len = ssl->out_msglen - 2 - 1 - hlen;
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+
+    ssl->out_msg[1] = (unsigned char)( ( ssl->out_msglen - 4 ) >> 16 );
+    ssl->out_msg[2] = (unsigned char)( ( ssl->out_msglen - 4 ) >>  8 );
+    ssl->out_msg[3] = (unsigned char)( ( ssl->out_msglen - 4 )       );
+
+    if( ( ret = mbedtls_ssl_tls13_transcript_hash( ssl, md_alg, ssl->out_msg,
+                                                   truncated_len,
+                                                   transcript ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_compute_binder( md_alg,
+                    ssl->session_negotiate->master, hlen, transcript,
+                    ssl->out_msg + ssl->out_msglen - hlen ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_compute_binder", ret );
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_BUF( 3, "client hello, psk binder",
+                           ssl->out_msg + ssl->out_msglen - hlen, hlen );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_SESSION_TICKETS */
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
+/*
+ * Generate random bytes for ClientHello
+ */
+static int ssl_generate_random( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    unsigned char *p = ssl->handshake->randbytes;
+#if defined(MBEDTLS_HAVE_TIME)
+    mbedtls_time_t t;
+#endif
+
+    /*
+     * When responding to a verify request, MUST reuse random (RFC 6347 4.2.1)
+     */
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        ssl->handshake->verify_cookie != NULL )
+    {
+        return( 0 );
+    }
+#endif
+
+    /* Likewise when responding to a HelloRetryRequest (RFC 8446 4.1.2) */
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->handshake->hello_retry )
+        return( 0 );
+#endif
+
+#if defined(MBEDTLS_HAVE_TIME)
+    t = mbedtls_time( NULL );
+    *p++ = (unsigned char)( t >> 24 );
+    *p++ = (unsigned char)( t >> 16 );
+    *p++ = (unsigned char)( t >>  8 );
+    *p++ = (unsigned char)( t       );
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, current time: %lu", t ) );
+#else
+    if( ( ret = ssl->conf->f_rng( ssl->conf->p_rng, p, 4 ) ) != 0 )
+        return( ret );
+
+    p += 4;
+#endif /* MBEDTLS_HAVE_TIME */
+
+    if( ( ret = ssl->conf->f_rng( ssl->conf->p_rng, p, 28 ) ) != 0 )
+        return( ret );
+
+    return( 0 );
+}
+
+static int ssl_write_client_hello( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    size_t i, n, olen, ext_len = 0;
+    unsigned char *buf;
+    unsigned char *p, *q;
+    unsigned char offer_compress;
+    const int *ciphersuites;
+    const mbedtls_ssl_ciphersuite_t *ciphersuite_info;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> write client hello" ) );
+
+    if( ssl->conf->f_rng == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "no RNG provided") );
+        return( MBEDTLS_ERR_SSL_NO_RNG );
+    }
+
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+    if( ssl->renego_status == MBEDTLS_SSL_INITIAL_HANDSHAKE )
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* After a HelloRetryRequest, we know we're doing TLS 1.3 */
+    if( ssl->handshake->hello_retry == 0 )
+#endif
+    {
+        ssl->major_ver = ssl->conf->min_major_ver;
+        ssl->minor_ver = ssl->conf->min_minor_ver;
+    }
+
+    if( ssl->conf->max_major_ver == 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "configured max major version is invalid, "
+                            "consider using mbedtls_ssl_config_defaults()" ) );
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    /*
+     *     0  .   0   handshake type
+     *     1  .   3   handshake length
+     *     4  .   5   highest version supported
+     *     6  .   9   current UNIX time
+     *    10  .  37   random bytes
+     */
+    buf = ssl->out_msg;
+    p = buf + 4;
+
+    mbedtls_ssl_write_version( ssl->conf->max_major_ver, ssl->conf->max_minor_ver,
+                       ssl->conf->transport, p );
+    p += 2;
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, max version: [%d:%d]",
+                   buf[4], buf[5] ) );
+
+    if( ( ret = ssl_generate_random( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "ssl_generate_random", ret );
+        return( ret );
+    }
+
+    memcpy( p, ssl->handshake->randbytes, 32 );
+    MBEDTLS_SSL_DEBUG_BUF( 3, "client hello, random bytes", p, 32 );
+    p += 32;
+
+    /*
+     *    38  .  38   session id length
+     *    39  . 39+n  session id
+     *   39+n . 39+n  DTLS only: cookie length (1 byte)
+     *   40+n .  ..   DTSL only: cookie
+     *   ..   . ..    ciphersuitelist length (2 bytes)
+     *   ..   . ..    ciphersuitelist
+     *   ..   . ..    compression methods length (1 byte)
+     *   ..   . ..    compression methods
+     *   ..   . ..    extensions length (2 bytes)
+     *   ..   . ..    extensions
+     */
+    n = ssl->session_negotiate->id_len;
+
+    if( n < 16 || n > 32 ||
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+        ssl->renego_status != MBEDTLS_SSL_INITIAL_HANDSHAKE ||
+#endif
+        ssl->handshake->resume == 0 )
+    {
+        n = 0;
+    }
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    /*
+     * RFC 5077 section 3.4: "When presenting a ticket, the client MAY
+     * generate and include a Session ID in the TLS ClientHello."
+     */
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+    if( ssl->renego_status == MBEDTLS_SSL_INITIAL_HANDSHAKE )
+#endif
+    {
+        if( ssl->session_negotiate->ticket != NULL &&
+                ssl->session_negotiate->ticket_len != 0
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            /* The second ClientHello repeats the first one's */
+            && ! ssl->handshake->hello_retry
+#endif
+          )
+        {
+            ret = ssl->conf->f_rng( ssl->conf->p_rng, ssl->session_negotiate->id, 32 );
+
+            if( ret != 0 )
+                return( ret );
+
+            ssl->session_negotiate->id_len = n = 32;
+        }
+    }
+#endif /* MBEDTLS_SSL_SESSION_TICKETS */
+
+    *p++ = (unsigned char) n;
+
+    for( i = 0; i < n; i++ )
+        *p++ = ssl->session_negotiate->id[i];
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "client hello, session id len.: %d", n ) );
+    MBEDTLS_SSL_DEBUG_BUF( 3,   "client hello, session id", buf + 39, n );
+
+    /*
+     * DTLS cookie
+     */
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
     {
@@ -876,6 +1371,12 @@ static int ssl_write_client_hello( mbedtls_ssl_context *ssl )
             ciphersuite_info->max_minor_ver < ssl->conf->min_minor_ver )
             continue;
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        if( mbedtls_ssl_ciphersuite_is_tls13( ciphersuite_info ) &&
+            ! ssl_tls13_offered( ssl ) )
+            continue;
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
         if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
             ( ciphersuite_info->flags & MBEDTLS_CIPHERSUITE_NODTLS ) )
@@ -1032,6 +1533,37 @@ static int ssl_write_client_hello( mbedtls_ssl_context *ssl )
     ext_len += olen;
 #endif
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+    ssl_write_status_request_ext( ssl, p + 2 + ext_len, &olen );
+    ext_len += olen;
+#endif
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    ssl_write_cid_ext( ssl, p + 2 + ext_len, &olen );
+    ext_len += olen;
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    ssl_write_supported_versions_ext( ssl, p + 2 + ext_len, &olen );
+    ext_len += olen;
+
+    if( ( ret = ssl_write_key_share_ext( ssl, p + 2 + ext_len, &olen ) ) != 0 )
+        return( ret );
+    ext_len += olen;
+
+    ssl_write_cookie_ext( ssl, p + 2 + ext_len, &olen );
+    ext_len += olen;
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    ssl_write_psk_key_exchange_modes_ext( ssl, p + 2 + ext_len, &olen );
+    ext_len += olen;
+
+    /* Must be last */
+    ssl_write_pre_shared_key_ext( ssl, p + 2 + ext_len, &olen );
+    ext_len += olen;
+#endif
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
     /* olen unused if all extensions are disabled */
     ((void) olen);
 
@@ -1049,7 +1581,15 @@ static int ssl_write_client_hello( mbedtls_ssl_context *ssl )
     ssl->out_msgtype = MBEDTLS_SSL_MSG_HANDSHAKE;
     ssl->out_msg[0]  = MBEDTLS_SSL_HS_CLIENT_HELLO;
 
-    ssl->state++;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && defined(MBEDTLS_SSL_SESSION_TICKETS)
+    if( ssl->handshake->tls13_psk_dhe_ke &&
+        ( ret = ssl_write_psk_binder( ssl ) ) != 0 )
+    {
+        return( ret );
+    }
+#endif
+
+    ssl->state++;
 
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
@@ -1062,6 +1602,15 @@ static int ssl_write_client_hello( mbedtls_ssl_context *ssl )
         return( ret );
     }
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        ( ret = mbedtls_ssl_flight_transmit( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_flight_transmit", ret );
+        return( ret );
+    }
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write client hello" ) );
 
     return( 0 );
@@ -1218,6 +1767,71 @@ static int ssl_parse_session_ticket_ext( mbedtls_ssl_context *ssl,
 }
 #endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+static int ssl_parse_status_request_ext( mbedtls_ssl_context *ssl,
+                                         const unsigned char *buf,
+                                         size_t len )
+{
+    if( ssl->conf->ocsp_stapling == MBEDTLS_SSL_OCSP_STAPLING_DISABLED ||
+        len != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "non-matching status_request extension" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    ((void) buf);
+
+    ssl->handshake->ocsp_status = 1;
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+static int ssl_parse_cid_ext( mbedtls_ssl_context *ssl,
+                              const unsigned char *buf,
+                              size_t len )
+{
+    size_t peer_cid_len;
+
+    /* We must have offered it */
+    if( ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_DATAGRAM ||
+        ssl->negotiate_cid == MBEDTLS_SSL_CID_DISABLED )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "non-matching connection_id extension" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNSUPPORTED_EXT );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    if( len < 1 || ( peer_cid_len = buf[0] ) != len - 1 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad server hello message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    if( peer_cid_len > MBEDTLS_SSL_CID_OUT_LEN_MAX )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "peer connection ID too long" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    ssl->handshake->cid_in_use = 1;
+    ssl->handshake->peer_cid_len = (uint8_t) peer_cid_len;
+    memcpy( ssl->handshake->peer_cid, buf + 1, peer_cid_len );
+
+    MBEDTLS_SSL_DEBUG_BUF( 3, "server CID", buf + 1, peer_cid_len );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 #if defined(MBEDTLS_ECDH_C) || defined(MBEDTLS_ECDSA_C) || \
     defined(MBEDTLS_KEY_EXCHANGE_ECJPAKE_ENABLED)
 static int ssl_parse_supported_point_formats_ext( mbedtls_ssl_context *ssl,
@@ -1279,7 +1893,7 @@ static int ssl_parse_ecjpake_kkpp( mbedtls_ssl_context *ssl,
     }
 
     /* If we got here, we no longer need our cached extension */
-    mbedtls_free( ssl->handshake->ecjpake_cache );
+    mbedtls_ssl_hs_free( ssl, ssl->handshake->ecjpake_cache );
     ssl->handshake->ecjpake_cache = NULL;
     ssl->handshake->ecjpake_cache_len = 0;
 
@@ -1303,141 +1917,498 @@ static int ssl_parse_alpn_ext( mbedtls_ssl_context *ssl,
     size_t list_len, name_len;
     const char **p;
 
-    /* If we didn't send it, the server shouldn't send it */
-    if( ssl->conf->alpn_list == NULL )
-    {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "non-matching ALPN extension" ) );
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                        MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
-        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
-    }
+    /* If we didn't send it, the server shouldn't send it */
+    if( ssl->conf->alpn_list == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "non-matching ALPN extension" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    /*
+     * opaque ProtocolName<1..2^8-1>;
+     *
+     * struct {
+     *     ProtocolName protocol_name_list<2..2^16-1>
+     * } ProtocolNameList;
+     *
+     * the "ProtocolNameList" MUST contain exactly one "ProtocolName"
+     */
+
+    /* Min length is 2 (list_len) + 1 (name_len) + 1 (name) */
+    if( len < 4 )
+    {
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    list_len = ( buf[0] << 8 ) | buf[1];
+    if( list_len != len - 2 )
+    {
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    name_len = buf[2];
+    if( name_len != list_len - 1 )
+    {
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    /* Check that the server chosen protocol was in our list and save it */
+    for( p = ssl->conf->alpn_list; *p != NULL; p++ )
+    {
+        if( name_len == strlen( *p ) &&
+            memcmp( buf + 3, *p, name_len ) == 0 )
+        {
+            ssl->alpn_chosen = *p;
+            return( 0 );
+        }
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 1, ( "ALPN extension: no matching protocol" ) );
+    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                    MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
+    return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+}
+#endif /* MBEDTLS_SSL_ALPN */
+
+/*
+ * Parse HelloVerifyRequest.  Only called after verifying the HS type.
+ */
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+static int ssl_parse_hello_verify_request( mbedtls_ssl_context *ssl )
+{
+    const unsigned char *p = ssl->in_msg + mbedtls_ssl_hs_hdr_len( ssl );
+    int major_ver, minor_ver;
+    unsigned char cookie_len;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse hello verify request" ) );
+
+    /*
+     * struct {
+     *   ProtocolVersion server_version;
+     *   opaque cookie<0..2^8-1>;
+     * } HelloVerifyRequest;
+     */
+    MBEDTLS_SSL_DEBUG_BUF( 3, "server version", p, 2 );
+    mbedtls_ssl_read_version( &major_ver, &minor_ver, ssl->conf->transport, p );
+    p += 2;
+
+    /*
+     * Since the RFC is not clear on this point, accept DTLS 1.0 (TLS 1.1)
+     * even is lower than our min version.
+     */
+    if( major_ver < MBEDTLS_SSL_MAJOR_VERSION_3 ||
+        minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 ||
+        major_ver > ssl->conf->max_major_ver  ||
+        minor_ver > ssl->conf->max_minor_ver  )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad server version" ) );
+
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                     MBEDTLS_SSL_ALERT_MSG_PROTOCOL_VERSION );
+
+        return( MBEDTLS_ERR_SSL_BAD_HS_PROTOCOL_VERSION );
+    }
+
+    cookie_len = *p++;
+    MBEDTLS_SSL_DEBUG_BUF( 3, "cookie", p, cookie_len );
+
+    if( ( ssl->in_msg + ssl->in_msglen ) - p < cookie_len )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1,
+            ( "cookie length does not match incoming message size" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                    MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    mbedtls_ssl_hs_free( ssl, ssl->handshake->verify_cookie );
+
+    ssl->handshake->verify_cookie = mbedtls_ssl_hs_calloc( ssl, 1, cookie_len );
+    if( ssl->handshake->verify_cookie  == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc failed (%d bytes)", cookie_len ) );
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+
+    memcpy( ssl->handshake->verify_cookie, p, cookie_len );
+    ssl->handshake->verify_cookie_len = cookie_len;
+
+    /* Start over at ClientHello */
+    ssl->state = MBEDTLS_SSL_CLIENT_HELLO;
+    mbedtls_ssl_reset_checksum( ssl );
+
+    mbedtls_ssl_recv_flight_completed( ssl );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse hello verify request" ) );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_PROTO_DTLS */
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+/*
+ * Does this ServerHello body select TLS 1.3 in supported_versions?
+ * Malformed messages are left to the TLS 1.2 parser to reject.
+ */
+static int ssl_tls13_server_hello_selects_tls13( const unsigned char *buf,
+                                                 size_t len )
+{
+    size_t n, ext_len, ext_size;
+    const unsigned char *ext;
+    int tls13 = 0;
+
+    if( len < 38 || ( n = buf[34] ) > 32 || len < 40 + n )
+        return( 0 );
+
+    ext_len = ( buf[38 + n] << 8 ) | buf[39 + n];
+    if( len != 40 + n + ext_len )
+        return( 0 );
+
+    /* Check the framing of all extensions, the parser relies on it */
+    for( ext = buf + 40 + n; ext_len > 0; ext += 4 + ext_size )
+    {
+        if( ext_len < 4 )
+            return( 0 );
+
+        ext_size = ( ext[2] << 8 ) | ext[3];
+        if( ext_size + 4 > ext_len )
+            return( 0 );
+        ext_len -= 4 + ext_size;
+
+        if( ( ( ext[0] << 8 ) | ext[1] ) == MBEDTLS_TLS_EXT_SUPPORTED_VERSIONS )
+        {
+            tls13 = ( ext_size == 2 &&
+                      ext[4] == MBEDTLS_SSL_MAJOR_VERSION_3 &&
+                      ext[5] == MBEDTLS_SSL_MINOR_VERSION_4 );
+        }
+    }
+
+    return( tls13 );
+}
+
+/*
+ * TLS 1.3 ServerHello or HelloRetryRequest, RFC 8446 4.1.3 and 4.1.4.
+ * buf/len is the message body; the message has already been added to the
+ * transcript only after a HelloRetryRequest.
+ *
+ * struct {
+ *     ProtocolVersion legacy_version = 0x0303;
+ *     Random random;
+ *     opaque legacy_session_id_echo<0..32>;
+ *     CipherSuite cipher_suite;
+ *     uint8 legacy_compression_method = 0;
+ *     Extension extensions<6..2^16-1>;
+ * } ServerHello;
+ */
+static int ssl_tls13_parse_server_hello( mbedtls_ssl_context *ssl,
+                                         const unsigned char *buf,
+                                         size_t len )
+{
+    int ret;
+    static const unsigned char hrr_random[32] = {
+        0xCF, 0x21, 0xAD, 0x74, 0xE5, 0x9A, 0x61, 0x11,
+        0xBE, 0x1D, 0x8C, 0x02, 0x1E, 0x65, 0xB8, 0x91,
+        0xC2, 0xA2, 0x11, 0x16, 0x7A, 0xBB, 0x8C, 0x5E,
+        0x07, 0x9E, 0x09, 0xE2, 0xC8, 0xA8, 0x33, 0x9C };
+    mbedtls_ssl_handshake_params *hs = ssl->handshake;
+    const mbedtls_ssl_ciphersuite_t *suite;
+    const unsigned char *ext;
+    size_t n = buf[34], sent_id_len, ext_len, ext_size;
+    int is_hrr, suite_id, selected_group = 0, key_share_seen = 0;
+    int psk_selected = 0;
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    int psk_usable = 0;
+#endif
+    const unsigned char *cookie = NULL;
+    size_t cookie_len = 0;
+    uint8_t alert = MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER;
+
+    is_hrr = ( memcmp( buf + 2, hrr_random, 32 ) == 0 );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse tls13 %s",
+                is_hrr ? "hello retry request" : "server hello" ) );
+
+    /* At most one HelloRetryRequest */
+    if( is_hrr && hs->hello_retry )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "second hello retry request" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    if( buf[0] != MBEDTLS_SSL_MAJOR_VERSION_3 ||
+        buf[1] != MBEDTLS_SSL_MINOR_VERSION_3 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad legacy_version" ) );
+        goto fail;
+    }
+
+    /* We only ever send the session ID of a session we try to resume */
+    sent_id_len = ssl->session_negotiate->id_len;
+    if( sent_id_len < 16 || sent_id_len > 32 || hs->resume == 0 )
+        sent_id_len = 0;
+
+    if( n != sent_id_len ||
+        memcmp( buf + 35, ssl->session_negotiate->id, n ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad legacy_session_id_echo" ) );
+        goto fail;
+    }
+
+    suite_id = ( buf[35 + n] << 8 ) | buf[36 + n];
+    suite = mbedtls_ssl_ciphersuite_from_id( suite_id );
+    ssl->minor_ver = MBEDTLS_SSL_MINOR_VERSION_4;
+
+    if( suite == NULL || ! mbedtls_ssl_ciphersuite_is_tls13( suite ) ||
+        mbedtls_ssl_check_ciphersuite( ssl, suite_id ) != 0 ||
+        ( hs->hello_retry &&
+          ssl->transform_negotiate->ciphersuite_info != suite ) )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad cipher_suite: %04x", suite_id ) );
+        goto fail;
+    }
+
+    if( buf[37 + n] != MBEDTLS_SSL_COMPRESS_NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad legacy_compression_method" ) );
+        goto fail;
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "server hello, chosen ciphersuite: %s",
+                                suite->name ) );
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    /* Our binder was computed with the hash of the ticket's suite */
+    if( hs->tls13_psk_dhe_ke )
+    {
+        const mbedtls_ssl_ciphersuite_t *ticket_suite =
+            mbedtls_ssl_ciphersuite_from_id( ssl->session_negotiate->ciphersuite );
+
+        psk_usable = ( ticket_suite != NULL && ticket_suite->mac == suite->mac );
+    }
+#endif
+
+    ssl->transform_negotiate->ciphersuite_info = suite;
+    ssl->session_negotiate->ciphersuite = suite_id;
+    ssl->session_negotiate->compression = MBEDTLS_SSL_COMPRESS_NULL;
+
+    /*
+     * Bring the transcript up to date, now that we know its hash
+     */
+    if( hs->hello_retry == 0 )
+    {
+        mbedtls_ssl_optimize_checksum( ssl, suite );
+
+        if( is_hrr &&
+            ( ret = mbedtls_ssl_tls13_reset_transcript_for_hrr( ssl ) ) != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_reset_transcript_for_hrr", ret );
+            return( ret );
+        }
+
+        mbedtls_ssl_update_handshake_status( ssl );
+    }
+
+    /*
+     * Extensions: framing checked by ssl_tls13_server_hello_selects_tls13()
+     */
+    ext_len = len - 40 - n;
+
+    for( ext = buf + 40 + n; ext_len > 0; ext += 4 + ext_size )
+    {
+        unsigned int ext_id = ( ext[0] << 8 ) | ext[1];
+        ext_size = ( ext[2] << 8 ) | ext[3];
+        ext_len -= 4 + ext_size;
+
+        switch( ext_id )
+        {
+        case MBEDTLS_TLS_EXT_SUPPORTED_VERSIONS:
+            /* Checked already */
+            break;
+
+        case MBEDTLS_TLS_EXT_KEY_SHARE:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found key_share extension" ) );
+
+            /* HRR: NamedGroup selected_group; SH: KeyShareEntry server_share */
+            if( ext_size < 2 || ( is_hrr && ext_size != 2 ) ||
+                ( ! is_hrr && ( ext_size < 4 ||
+                      ext_size != 4 + (size_t)( ( ext[6] << 8 ) | ext[7] ) ) ) )
+            {
+                alert = MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR;
+                goto fail;
+            }
+
+            selected_group = ( ext[4] << 8 ) | ext[5];
+            key_share_seen = 1;
+
+            if( ! is_hrr )
+            {
+                const mbedtls_ecp_curve_info *info =
+                    mbedtls_ecp_curve_info_from_grp_id( hs->tls13_group );
+
+                if( info == NULL || info->tls_id != selected_group )
+                {
+                    MBEDTLS_SSL_DEBUG_MSG( 1, ( "key share for a group we didn't offer" ) );
+                    goto fail;
+                }
+
+                if( ( ret = mbedtls_ssl_tls13_read_key_share( ssl, ext + 8,
+                                                              ext_size - 4 ) ) != 0 )
+                {
+                    goto fail;
+                }
+            }
+            break;
+
+        case MBEDTLS_TLS_EXT_COOKIE:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found cookie extension" ) );
+
+            if( ! is_hrr || ext_size < 3 ||
+                ext_size != 2 + (size_t)( ( ext[4] << 8 ) | ext[5] ) )
+            {
+                alert = MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR;
+                goto fail;
+            }
+
+            cookie = ext + 6;
+            cookie_len = ext_size - 2;
+            break;
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+        case MBEDTLS_TLS_EXT_PRE_SHARED_KEY:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found pre_shared_key extension" ) );
 
-    /*
-     * opaque ProtocolName<1..2^8-1>;
-     *
-     * struct {
-     *     ProtocolName protocol_name_list<2..2^16-1>
-     * } ProtocolNameList;
-     *
-     * the "ProtocolNameList" MUST contain exactly one "ProtocolName"
-     */
+            /* We offer a single identity */
+            if( is_hrr || ext_size != 2 || ! psk_usable ||
+                ext[4] != 0 || ext[5] != 0 )
+            {
+                goto fail;
+            }
 
-    /* Min length is 2 (list_len) + 1 (name_len) + 1 (name) */
-    if( len < 4 )
-    {
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
-        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
-    }
+            psk_selected = 1;
+            break;
+#endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
-    list_len = ( buf[0] << 8 ) | buf[1];
-    if( list_len != len - 2 )
-    {
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
-        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+        default:
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "unexpected extension: %d", ext_id ) );
+            alert = MBEDTLS_SSL_ALERT_MSG_UNSUPPORTED_EXT;
+            goto fail;
+        }
     }
 
-    name_len = buf[2];
-    if( name_len != list_len - 1 )
+    if( is_hrr )
     {
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
-        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
-    }
+        mbedtls_ecp_group_id grp_id = MBEDTLS_ECP_DP_NONE;
+        const mbedtls_ecp_curve_info *info;
 
-    /* Check that the server chosen protocol was in our list and save it */
-    for( p = ssl->conf->alpn_list; *p != NULL; p++ )
-    {
-        if( name_len == strlen( *p ) &&
-            memcmp( buf + 3, *p, name_len ) == 0 )
+        if( key_share_seen )
         {
-            ssl->alpn_chosen = *p;
-            return( 0 );
+            info = mbedtls_ecp_curve_info_from_tls_id( (uint16_t) selected_group );
+            if( info != NULL )
+                grp_id = info->grp_id;
+
+            /* Must be one we support, but not the one we sent */
+            if( grp_id == hs->tls13_group ||
+                ! mbedtls_ssl_tls13_group_supported( grp_id ) ||
+                mbedtls_ssl_check_curve( ssl, grp_id ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad selected_group: %d", selected_group ) );
+                goto fail;
+            }
+
+            hs->tls13_group = grp_id;
+        }
+        else if( cookie == NULL )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "hello retry request changes nothing" ) );
+            goto fail;
         }
-    }
 
-    MBEDTLS_SSL_DEBUG_MSG( 1, ( "ALPN extension: no matching protocol" ) );
-    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                    MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
-    return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
-}
-#endif /* MBEDTLS_SSL_ALPN */
+        if( cookie != NULL )
+        {
+            hs->tls13_cookie = mbedtls_ssl_hs_calloc( ssl, 1, cookie_len );
+            if( hs->tls13_cookie == NULL )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc failed (%d bytes)", cookie_len ) );
+                return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+            }
 
-/*
- * Parse HelloVerifyRequest.  Only called after verifying the HS type.
- */
-#if defined(MBEDTLS_SSL_PROTO_DTLS)
-static int ssl_parse_hello_verify_request( mbedtls_ssl_context *ssl )
-{
-    const unsigned char *p = ssl->in_msg + mbedtls_ssl_hs_hdr_len( ssl );
-    int major_ver, minor_ver;
-    unsigned char cookie_len;
+            memcpy( hs->tls13_cookie, cookie, cookie_len );
+            hs->tls13_cookie_len = cookie_len;
+        }
 
-    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse hello verify request" ) );
+        /* Start over at ClientHello, with the same random */
+        hs->hello_retry = 1;
+        ssl->state = MBEDTLS_SSL_CLIENT_HELLO;
 
-    /*
-     * struct {
-     *   ProtocolVersion server_version;
-     *   opaque cookie<0..2^8-1>;
-     * } HelloVerifyRequest;
-     */
-    MBEDTLS_SSL_DEBUG_BUF( 3, "server version", p, 2 );
-    mbedtls_ssl_read_version( &major_ver, &minor_ver, ssl->conf->transport, p );
-    p += 2;
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse tls13 hello retry request" ) );
+
+        return( 0 );
+    }
+
+    if( ! key_share_seen )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "no key share in server hello" ) );
+        alert = MBEDTLS_SSL_ALERT_MSG_MISSING_EXTENSION;
+        goto fail;
+    }
 
     /*
-     * Since the RFC is not clear on this point, accept DTLS 1.0 (TLS 1.1)
-     * even is lower than our min version.
+     * Resumed with our ticket, or full handshake
      */
-    if( major_ver < MBEDTLS_SSL_MAJOR_VERSION_3 ||
-        minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 ||
-        major_ver > ssl->conf->max_major_ver  ||
-        minor_ver > ssl->conf->max_minor_ver  )
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    if( ! psk_selected && hs->tls13_psk_dhe_ke )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad server version" ) );
-
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                     MBEDTLS_SSL_ALERT_MSG_PROTOCOL_VERSION );
-
-        return( MBEDTLS_ERR_SSL_BAD_HS_PROTOCOL_VERSION );
+        mbedtls_free( ssl->session_negotiate->ticket );
+        ssl->session_negotiate->ticket = NULL;
+        ssl->session_negotiate->ticket_len = 0;
+        mbedtls_zeroize( ssl->session_negotiate->master,
+                         sizeof( ssl->session_negotiate->master ) );
     }
+#endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
-    cookie_len = *p++;
-    MBEDTLS_SSL_DEBUG_BUF( 3, "cookie", p, cookie_len );
+    hs->resume = psk_selected;
 
-    if( ( ssl->in_msg + ssl->in_msglen ) - p < cookie_len )
-    {
-        MBEDTLS_SSL_DEBUG_MSG( 1,
-            ( "cookie length does not match incoming message size" ) );
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                    MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
-        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
-    }
+#if defined(MBEDTLS_HAVE_TIME)
+    if( hs->resume == 0 )
+        ssl->session_negotiate->start = mbedtls_time( NULL );
+#endif
 
-    mbedtls_free( ssl->handshake->verify_cookie );
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "%s session has been resumed",
+                   hs->resume ? "a" : "no" ) );
 
-    ssl->handshake->verify_cookie = mbedtls_calloc( 1, cookie_len );
-    if( ssl->handshake->verify_cookie  == NULL )
+    memcpy( hs->randbytes + 32, buf + 2, 32 );
+    MBEDTLS_SSL_DEBUG_BUF( 3, "server hello, random bytes", buf + 2, 32 );
+
+    if( ( ret = mbedtls_ssl_tls13_ecdhe_shared_secret( ssl ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_key_schedule_handshake( ssl ) ) != 0 )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc failed (%d bytes)", cookie_len ) );
-        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_INTERNAL_ERROR );
+        return( ret );
     }
 
-    memcpy( ssl->handshake->verify_cookie, p, cookie_len );
-    ssl->handshake->verify_cookie_len = cookie_len;
-
-    /* Start over at ClientHello */
-    ssl->state = MBEDTLS_SSL_CLIENT_HELLO;
-    mbedtls_ssl_reset_checksum( ssl );
-
-    mbedtls_ssl_recv_flight_completed( ssl );
+    ssl->state = MBEDTLS_SSL_ENCRYPTED_EXTENSIONS;
 
-    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse hello verify request" ) );
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse tls13 server hello" ) );
 
     return( 0 );
+
+fail:
+    MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad server hello message" ) );
+    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL, alert );
+    return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
 }
-#endif /* MBEDTLS_SSL_PROTO_DTLS */
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
 
 static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
 {
@@ -1459,7 +2430,14 @@ static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
 
     buf = ssl->in_msg;
 
-    if( ( ret = mbedtls_ssl_read_record( ssl ) ) != 0 )
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl_tls13_offered( ssl ) && ssl->handshake->hello_retry == 0 )
+        ret = mbedtls_ssl_tls13_read_record_unhashed( ssl );
+    else
+#endif
+    ret = mbedtls_ssl_read_record( ssl );
+
+    if( ret != 0 )
     {
         /* No alert on a read error. */
         MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record", ret );
@@ -1506,7 +2484,7 @@ static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
         else
         {
             /* We made it through the verification process */
-            mbedtls_free( ssl->handshake->verify_cookie );
+            mbedtls_ssl_hs_free( ssl, ssl->handshake->verify_cookie );
             ssl->handshake->verify_cookie = NULL;
             ssl->handshake->verify_cookie_len = 0;
         }
@@ -1535,6 +2513,46 @@ static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
      */
     buf += mbedtls_ssl_hs_hdr_len( ssl );
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl_tls13_offered( ssl ) )
+    {
+        if( ssl_tls13_server_hello_selects_tls13( buf,
+                    ssl->in_hslen - mbedtls_ssl_hs_hdr_len( ssl ) ) )
+        {
+            return( ssl_tls13_parse_server_hello( ssl, buf,
+                        ssl->in_hslen - mbedtls_ssl_hs_hdr_len( ssl ) ) );
+        }
+
+        if( ssl->handshake->hello_retry )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "no TLS 1.3 after a hello retry request" ) );
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER );
+            return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+        }
+
+        /* Not a HelloRetryRequest: hash it as usual */
+        mbedtls_ssl_update_handshake_status( ssl );
+
+        /* Our key share is of no use for TLS 1.2 */
+        mbedtls_ecdh_free( &ssl->handshake->ecdh_ctx );
+        mbedtls_ecdh_init( &ssl->handshake->ecdh_ctx );
+
+        /*
+         * RFC 8446 4.1.3: a TLS 1.3 server negotiating a lower version says
+         * so in the last bytes of its random, catching downgrade attacks
+         */
+        if( memcmp( buf + 2 + 24, "DOWNGRD", 7 ) == 0 &&
+            ( buf[2 + 31] == 0x00 || buf[2 + 31] == 0x01 ) )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "downgrade to TLS 1.2 or below detected" ) );
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER );
+            return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+        }
+    }
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
     MBEDTLS_SSL_DEBUG_BUF( 3, "server hello, version", buf + 0, 2 );
     mbedtls_ssl_read_version( &ssl->major_ver, &ssl->minor_ver,
                       ssl->conf->transport, buf + 0 );
@@ -1706,22 +2724,12 @@ static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
 
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "server hello, chosen ciphersuite: %s", suite_info->name ) );
 
-    i = 0;
-    while( 1 )
+    if( mbedtls_ssl_check_ciphersuite( ssl, ssl->session_negotiate->ciphersuite ) != 0 )
     {
-        if( ssl->conf->ciphersuite_list[ssl->minor_ver][i] == 0 )
-        {
-            MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad server hello message" ) );
-            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                            MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER );
-            return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
-        }
-
-        if( ssl->conf->ciphersuite_list[ssl->minor_ver][i++] ==
-            ssl->session_negotiate->ciphersuite )
-        {
-            break;
-        }
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad server hello message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
     }
 
     if( comp != MBEDTLS_SSL_COMPRESS_NULL
@@ -1835,6 +2843,29 @@ static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
             break;
 #endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+        case MBEDTLS_TLS_EXT_STATUS_REQUEST:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found status_request extension" ) );
+
+            if( ( ret = ssl_parse_status_request_ext( ssl,
+                            ext + 4, ext_size ) ) != 0 )
+            {
+                return( ret );
+            }
+
+            break;
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        case MBEDTLS_TLS_EXT_CID:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found connection_id extension" ) );
+
+            if( ( ret = ssl_parse_cid_ext( ssl, ext + 4, ext_size ) ) != 0 )
+                return( ret );
+
+            break;
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 #if defined(MBEDTLS_ECDH_C) || defined(MBEDTLS_ECDSA_C) || \
     defined(MBEDTLS_KEY_EXCHANGE_ECJPAKE_ENABLED)
         case MBEDTLS_TLS_EXT_SUPPORTED_POINT_FORMATS:
@@ -1889,49 +2920,179 @@ static int ssl_parse_server_hello( mbedtls_ssl_context *ssl )
     }
 
     /*
-     * Renegotiation security checks
+     * Renegotiation security checks
+     */
+    if( ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
+        ssl->conf->allow_legacy_renegotiation == MBEDTLS_SSL_LEGACY_BREAK_HANDSHAKE )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "legacy renegotiation, breaking off handshake" ) );
+        handshake_failure = 1;
+    }
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+    else if( ssl->renego_status == MBEDTLS_SSL_RENEGOTIATION_IN_PROGRESS &&
+             ssl->secure_renegotiation == MBEDTLS_SSL_SECURE_RENEGOTIATION &&
+             renegotiation_info_seen == 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "renegotiation_info extension missing (secure)" ) );
+        handshake_failure = 1;
+    }
+    else if( ssl->renego_status == MBEDTLS_SSL_RENEGOTIATION_IN_PROGRESS &&
+             ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
+             ssl->conf->allow_legacy_renegotiation == MBEDTLS_SSL_LEGACY_NO_RENEGOTIATION )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "legacy renegotiation not allowed" ) );
+        handshake_failure = 1;
+    }
+    else if( ssl->renego_status == MBEDTLS_SSL_RENEGOTIATION_IN_PROGRESS &&
+             ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
+             renegotiation_info_seen == 1 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "renegotiation_info extension present (legacy)" ) );
+        handshake_failure = 1;
+    }
+#endif /* MBEDTLS_SSL_RENEGOTIATION */
+
+    if( handshake_failure == 1 )
+    {
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
+        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse server hello" ) );
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+static int ssl_parse_certificate_status( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    size_t hs_hdr_len = mbedtls_ssl_hs_hdr_len( ssl );
+    size_t resp_len;
+    uint32_t flags = 0;
+    mbedtls_x509_ocsp_response resp;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse certificate status" ) );
+
+    ssl->state = MBEDTLS_SSL_SERVER_KEY_EXCHANGE;
+
+    if( ( ret = mbedtls_ssl_read_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record", ret );
+        return( ret );
+    }
+
+    if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate status message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+    }
+
+    /*
+     * The server may skip CertificateStatus even if it sent the extension
+     * (RFC 6066 section 8): the peer certificate then keeps the result of
+     * its verification.
+     */
+    if( ssl->in_msg[0] != MBEDTLS_SSL_HS_CERTIFICATE_STATUS )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "no certificate status message" ) );
+        ssl->keep_current_message = 1;
+        goto exit;
+    }
+
+    /*
+     * struct {
+     *     CertificateStatusType status_type;
+     *     select (status_type) {
+     *         case ocsp: OCSPResponse response;
+     *     } response;
+     * } CertificateStatus;
+     *
+     * opaque OCSPResponse<1..2^24-1>;
      */
-    if( ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
-        ssl->conf->allow_legacy_renegotiation == MBEDTLS_SSL_LEGACY_BREAK_HANDSHAKE )
+    if( ssl->in_hslen < hs_hdr_len + 5 ||
+        ssl->in_msg[hs_hdr_len] != MBEDTLS_TLS_EXT_STATUS_REQUEST_OCSP )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "legacy renegotiation, breaking off handshake" ) );
-        handshake_failure = 1;
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate status message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE );
     }
-#if defined(MBEDTLS_SSL_RENEGOTIATION)
-    else if( ssl->renego_status == MBEDTLS_SSL_RENEGOTIATION_IN_PROGRESS &&
-             ssl->secure_renegotiation == MBEDTLS_SSL_SECURE_RENEGOTIATION &&
-             renegotiation_info_seen == 0 )
+
+    resp_len = ( ssl->in_msg[hs_hdr_len + 1] << 16 ) |
+               ( ssl->in_msg[hs_hdr_len + 2] <<  8 ) |
+               ( ssl->in_msg[hs_hdr_len + 3]       );
+
+    if( resp_len == 0 || ssl->in_hslen != hs_hdr_len + 4 + resp_len )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "renegotiation_info extension missing (secure)" ) );
-        handshake_failure = 1;
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate status message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE );
     }
-    else if( ssl->renego_status == MBEDTLS_SSL_RENEGOTIATION_IN_PROGRESS &&
-             ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
-             ssl->conf->allow_legacy_renegotiation == MBEDTLS_SSL_LEGACY_NO_RENEGOTIATION )
+
+    if( ssl->conf->authmode == MBEDTLS_SSL_VERIFY_NONE ||
+        ssl->session_negotiate->peer_cert == NULL )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "legacy renegotiation not allowed" ) );
-        handshake_failure = 1;
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "skip certificate status verification" ) );
+        goto exit;
     }
-    else if( ssl->renego_status == MBEDTLS_SSL_RENEGOTIATION_IN_PROGRESS &&
-             ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
-             renegotiation_info_seen == 1 )
+
+    mbedtls_x509_ocsp_response_init( &resp );
+
+    ret = mbedtls_x509_ocsp_response_parse( &resp,
+                                            ssl->in_msg + hs_hdr_len + 4,
+                                            resp_len );
+    if( ret != 0 )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "renegotiation_info extension present (legacy)" ) );
-        handshake_failure = 1;
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_x509_ocsp_response_parse", ret );
+        flags = MBEDTLS_X509_BADOCSP_NOT_TRUSTED;
+    }
+    else
+    {
+        ret = mbedtls_x509_ocsp_response_verify( &resp,
+                                                 ssl->session_negotiate->peer_cert,
+                                                 ssl->conf->ca_chain, &flags );
+        if( ret != 0 )
+            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_x509_ocsp_response_verify", ret );
     }
-#endif /* MBEDTLS_SSL_RENEGOTIATION */
 
-    if( handshake_failure == 1 )
+    mbedtls_x509_ocsp_response_free( &resp );
+
+    ssl->session_negotiate->verify_result |= flags;
+
+    if( flags != 0 && ssl->conf->authmode == MBEDTLS_SSL_VERIFY_REQUIRED )
     {
-        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
-                                        MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
-        return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+        if( flags & MBEDTLS_X509_BADCERT_REVOKED )
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_CERT_REVOKED );
+        else
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_BAD_CERT_STATUS_RESPONSE );
+
+        return( MBEDTLS_ERR_X509_CERT_VERIFY_FAILED );
     }
 
-    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse server hello" ) );
+exit:
+#if defined(MBEDTLS_SSL_PEER_CHAIN_IN_PLACE)
+    /* The rest of the chain was only kept to find the issuer of the response */
+    if( ssl->session_negotiate->peer_cert != NULL &&
+        ssl->session_negotiate->peer_cert->next != NULL )
+    {
+        mbedtls_x509_crt_free( ssl->session_negotiate->peer_cert->next );
+        mbedtls_free( ssl->session_negotiate->peer_cert->next );
+        ssl->session_negotiate->peer_cert->next = NULL;
+    }
+#endif
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse certificate status" ) );
 
     return( 0 );
 }
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
 
 #if defined(MBEDTLS_KEY_EXCHANGE_DHE_RSA_ENABLED) ||                       \
     defined(MBEDTLS_KEY_EXCHANGE_DHE_PSK_ENABLED)
@@ -3312,6 +4473,308 @@ static int ssl_parse_new_session_ticket( mbedtls_ssl_context *ssl )
 /*
  * SSL handshake -- client side -- single step
  */
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+/*
+ * EncryptedExtensions: the extensions of the ServerHello that don't
+ * concern the key exchange, RFC 8446 4.3.1
+ */
+static int ssl_tls13_parse_encrypted_extensions( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    const unsigned char *ext;
+    size_t ext_len, ext_size, hdr_len = mbedtls_ssl_hs_hdr_len( ssl );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse encrypted extensions" ) );
+
+    if( ( ret = mbedtls_ssl_read_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record", ret );
+        return( ret );
+    }
+
+    if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE ||
+        ssl->in_msg[0] != MBEDTLS_SSL_HS_ENCRYPTED_EXTENSIONS )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad encrypted extensions message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+    }
+
+    if( ssl->in_hslen < hdr_len + 2 ||
+        ssl->in_hslen != hdr_len + 2 + ( ( ssl->in_msg[hdr_len] << 8 ) |
+                                         ssl->in_msg[hdr_len + 1] ) )
+    {
+        goto decode_error;
+    }
+
+    ext = ssl->in_msg + hdr_len + 2;
+    ext_len = ssl->in_hslen - hdr_len - 2;
+
+    while( ext_len > 0 )
+    {
+        unsigned int ext_id;
+
+        if( ext_len < 4 )
+            goto decode_error;
+
+        ext_id   = ( ext[0] << 8 ) | ext[1];
+        ext_size = ( ext[2] << 8 ) | ext[3];
+
+        if( ext_size + 4 > ext_len )
+            goto decode_error;
+
+        switch( ext_id )
+        {
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        case MBEDTLS_TLS_EXT_MAX_FRAGMENT_LENGTH:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found max_fragment_length extension" ) );
+
+            if( ( ret = ssl_parse_max_fragment_length_ext( ssl,
+                            ext + 4, ext_size ) ) != 0 )
+            {
+                return( ret );
+            }
+
+            break;
+#endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+
+#if defined(MBEDTLS_SSL_ALPN)
+        case MBEDTLS_TLS_EXT_ALPN:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "found alpn extension" ) );
+
+            if( ( ret = ssl_parse_alpn_ext( ssl, ext + 4, ext_size ) ) != 0 )
+                return( ret );
+
+            break;
+#endif /* MBEDTLS_SSL_ALPN */
+
+        default:
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "unknown extension found: %d (ignoring)",
+                                        ext_id ) );
+        }
+
+        ext_len -= 4 + ext_size;
+        ext += 4 + ext_size;
+    }
+
+    /* A resumed session is authenticated by the PSK already */
+    if( ssl->handshake->resume )
+        ssl->state = MBEDTLS_SSL_SERVER_FINISHED;
+    else
+        ssl->state = MBEDTLS_SSL_CERTIFICATE_REQUEST;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse encrypted extensions" ) );
+
+    return( 0 );
+
+decode_error:
+    MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad encrypted extensions message" ) );
+    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                    MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+    return( MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO );
+}
+
+/*
+ * Optional CertificateRequest, RFC 8446 4.3.2
+ *
+ * struct {
+ *     opaque certificate_request_context<0..2^8-1>;
+ *     Extension extensions<2..2^16-1>;
+ * } CertificateRequest;
+ */
+static int ssl_tls13_parse_certificate_request( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    const unsigned char *ext;
+    size_t ext_len, ext_size, hdr_len = mbedtls_ssl_hs_hdr_len( ssl );
+    int sig_algs_seen = 0;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse certificate request" ) );
+
+    if( ( ret = mbedtls_ssl_read_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record", ret );
+        return( ret );
+    }
+
+    ssl->state = MBEDTLS_SSL_SERVER_CERTIFICATE;
+
+    if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE ||
+        ssl->in_msg[0] != MBEDTLS_SSL_HS_CERTIFICATE_REQUEST )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= skip parse certificate request" ) );
+        ssl->client_auth = 0;
+        ssl->keep_current_message = 1;
+        return( 0 );
+    }
+
+    /* The context is only used for post-handshake authentication */
+    if( ssl->in_hslen < hdr_len + 3 || ssl->in_msg[hdr_len] != 0 ||
+        ssl->in_hslen != hdr_len + 3 + ( ( ssl->in_msg[hdr_len + 1] << 8 ) |
+                                         ssl->in_msg[hdr_len + 2] ) )
+    {
+        goto decode_error;
+    }
+
+    ext = ssl->in_msg + hdr_len + 3;
+    ext_len = ssl->in_hslen - hdr_len - 3;
+
+    while( ext_len > 0 )
+    {
+        if( ext_len < 4 )
+            goto decode_error;
+
+        ext_size = ( ext[2] << 8 ) | ext[3];
+
+        if( ext_size + 4 > ext_len )
+            goto decode_error;
+
+        if( ( ( ext[0] << 8 ) | ext[1] ) == MBEDTLS_TLS_EXT_SIG_ALG )
+        {
+            if( mbedtls_ssl_tls13_parse_sig_algs( ssl, ext + 4, ext_size ) != 0 )
+                goto decode_error;
+
+            sig_algs_seen = 1;
+        }
+
+        ext_len -= 4 + ext_size;
+        ext += 4 + ext_size;
+    }
+
+    if( ! sig_algs_seen )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "no signature_algorithms in certificate request" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_MISSING_EXTENSION );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE_REQUEST );
+    }
+
+    ssl->client_auth = 1;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse certificate request" ) );
+
+    return( 0 );
+
+decode_error:
+    MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate request message" ) );
+    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                    MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+    return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE_REQUEST );
+}
+
+/*
+ * TLS 1.3 client state machine, once the ServerHello (or a
+ * HelloRetryRequest) has told us so
+ */
+static int ssl_tls13_handshake_client_step( mbedtls_ssl_context *ssl )
+{
+    int ret = 0;
+
+    switch( ssl->state )
+    {
+       /*
+        *  ==>   ClientHello (after a HelloRetryRequest)
+        */
+       case MBEDTLS_SSL_CLIENT_HELLO:
+           ret = ssl_write_client_hello( ssl );
+           break;
+
+       /*
+        *  <==   ServerHello
+        *        {EncryptedExtensions}
+        *        {CertificateRequest*}
+        *        {Certificate*}
+        *        {CertificateVerify*}
+        *        {Finished}
+        */
+       case MBEDTLS_SSL_SERVER_HELLO:
+           ret = ssl_parse_server_hello( ssl );
+           break;
+
+       case MBEDTLS_SSL_ENCRYPTED_EXTENSIONS:
+           ret = ssl_tls13_parse_encrypted_extensions( ssl );
+           break;
+
+       case MBEDTLS_SSL_CERTIFICATE_REQUEST:
+           ret = ssl_tls13_parse_certificate_request( ssl );
+           break;
+
+       case MBEDTLS_SSL_SERVER_CERTIFICATE:
+           ret = mbedtls_ssl_tls13_parse_certificate( ssl,
+                    MBEDTLS_SSL_SERVER_CERTIFICATE_VERIFY );
+           break;
+
+       case MBEDTLS_SSL_SERVER_CERTIFICATE_VERIFY:
+           ret = mbedtls_ssl_tls13_parse_certificate_verify( ssl,
+                    MBEDTLS_SSL_SERVER_FINISHED );
+           break;
+
+       case MBEDTLS_SSL_SERVER_FINISHED:
+           ret = mbedtls_ssl_tls13_parse_finished( ssl,
+                    ssl->client_auth ? MBEDTLS_SSL_CLIENT_CERTIFICATE
+                                     : MBEDTLS_SSL_CLIENT_FINISHED );
+           if( ret != 0 )
+               break;
+
+           if( ( ret = mbedtls_ssl_tls13_key_schedule_application( ssl ) ) != 0 )
+               break;
+
+           mbedtls_ssl_tls13_activate_application_keys( ssl, 1 );
+           break;
+
+       /*
+        *  ==>   {Certificate*}
+        *        {CertificateVerify*}
+        *        {Finished}
+        */
+       case MBEDTLS_SSL_CLIENT_CERTIFICATE:
+           ret = mbedtls_ssl_tls13_write_certificate( ssl,
+                    MBEDTLS_SSL_CERTIFICATE_VERIFY );
+           break;
+
+       case MBEDTLS_SSL_CERTIFICATE_VERIFY:
+           if( mbedtls_ssl_own_cert( ssl ) == NULL )
+           {
+               MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= skip write certificate verify" ) );
+               ssl->state = MBEDTLS_SSL_CLIENT_FINISHED;
+               break;
+           }
+
+           ret = mbedtls_ssl_tls13_write_certificate_verify( ssl,
+                    MBEDTLS_SSL_CLIENT_FINISHED );
+           break;
+
+       case MBEDTLS_SSL_CLIENT_FINISHED:
+           ret = mbedtls_ssl_tls13_write_finished( ssl,
+                    MBEDTLS_SSL_FLUSH_BUFFERS );
+           break;
+
+       case MBEDTLS_SSL_FLUSH_BUFFERS:
+           MBEDTLS_SSL_DEBUG_MSG( 2, ( "handshake: done" ) );
+
+           /* Our Finished went out under the handshake keys */
+           mbedtls_ssl_tls13_activate_application_keys( ssl, 0 );
+
+           if( ( ret = mbedtls_ssl_tls13_key_schedule_resumption( ssl ) ) != 0 )
+               break;
+
+           ssl->state = MBEDTLS_SSL_HANDSHAKE_WRAPUP;
+           break;
+
+       case MBEDTLS_SSL_HANDSHAKE_WRAPUP:
+           mbedtls_ssl_tls13_handshake_wrapup( ssl );
+           break;
+
+       default:
+           MBEDTLS_SSL_DEBUG_MSG( 1, ( "invalid state %d", ssl->state ) );
+           return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+   }
+
+    return( ret );
+}
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
 int mbedtls_ssl_handshake_client_step( mbedtls_ssl_context *ssl )
 {
     int ret = 0;
@@ -3333,6 +4796,14 @@ int mbedtls_ssl_handshake_client_step( mbedtls_ssl_context *ssl )
     }
 #endif
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 &&
+        ssl->state != MBEDTLS_SSL_HELLO_REQUEST )
+    {
+        return( ssl_tls13_handshake_client_step( ssl ) );
+    }
+#endif
+
     /* Change state now, so that it is right in mbedtls_ssl_read_record(), used
      * by DTLS for dropping out-of-sequence ChangeCipherSpec records */
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
@@ -3369,7 +4840,17 @@ int mbedtls_ssl_handshake_client_step( mbedtls_ssl_context *ssl )
 
        case MBEDTLS_SSL_SERVER_CERTIFICATE:
            ret = mbedtls_ssl_parse_certificate( ssl );
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+           if( ret == 0 && ssl->handshake->ocsp_status != 0 )
+               ssl->state = MBEDTLS_SSL_SERVER_CERTIFICATE_STATUS;
+#endif
+           break;
+
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+       case MBEDTLS_SSL_SERVER_CERTIFICATE_STATUS:
+           ret = ssl_parse_certificate_status( ssl );
            break;
+#endif
 
        case MBEDTLS_SSL_SERVER_KEY_EXCHANGE:
            ret = ssl_parse_server_key_exchange( ssl );
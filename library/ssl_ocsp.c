@@ -0,0 +1,281 @@
+/*
+ *  SSL server store of OCSP responses
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ * The responses are kept in a simple chained list, one entry per server
+ * certificate. A new response is parsed and verified before the lock is
+ * taken, so the handshakes only wait for a pointer swap or a copy.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_SSL_OCSP_C)
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#endif
+
+#include "mbedtls/ssl_ocsp.h"
+#include "mbedtls/x509_ocsp.h"
+
+#include <string.h>
+
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+
+void mbedtls_ssl_ocsp_init( mbedtls_ssl_ocsp_store *store )
+{
+    memset( store, 0, sizeof( mbedtls_ssl_ocsp_store ) );
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_init( &store->mutex );
+#endif
+}
+
+static int ssl_ocsp_time_cmp( const mbedtls_x509_time *a,
+                              const mbedtls_x509_time *b )
+{
+    if( a->year != b->year ) return( a->year - b->year );
+    if( a->mon  != b->mon  ) return( a->mon  - b->mon  );
+    if( a->day  != b->day  ) return( a->day  - b->day  );
+    if( a->hour != b->hour ) return( a->hour - b->hour );
+    if( a->min  != b->min  ) return( a->min  - b->min  );
+    return( a->sec - b->sec );
+}
+
+/*
+ * Earliest nextUpdate of the responses, all zeros if none has one
+ */
+static void ssl_ocsp_next_update( const mbedtls_x509_ocsp_response *resp,
+                                  mbedtls_x509_time *next_update )
+{
+    const mbedtls_x509_ocsp_single *cur;
+
+    memset( next_update, 0, sizeof( mbedtls_x509_time ) );
+
+    for( cur = &resp->single; cur != NULL; cur = cur->next )
+    {
+        if( cur->next_update.year == 0 )
+            continue;
+
+        if( next_update->year == 0 ||
+            ssl_ocsp_time_cmp( &cur->next_update, next_update ) < 0 )
+        {
+            *next_update = cur->next_update;
+        }
+    }
+}
+
+int mbedtls_ssl_ocsp_set_response( mbedtls_ssl_ocsp_store *store,
+                                   const mbedtls_x509_crt *crt,
+                                   const mbedtls_x509_crt *ca_chain,
+                                   const unsigned char *der, size_t len )
+{
+    int ret;
+    uint32_t flags;
+    unsigned char *old_der;
+    size_t old_len;
+    mbedtls_x509_time next_update;
+    mbedtls_x509_ocsp_response resp;
+    mbedtls_ssl_ocsp_entry *cur, *entry = NULL;
+    unsigned char *copy;
+
+    mbedtls_x509_ocsp_response_init( &resp );
+
+    if( ( ret = mbedtls_x509_ocsp_response_parse( &resp, der, len ) ) == 0 )
+        ret = mbedtls_x509_ocsp_response_verify( &resp, crt, ca_chain, &flags );
+
+    /* A revocation is news for the clients, not a bad response */
+    if( ret == MBEDTLS_ERR_X509_CERT_VERIFY_FAILED &&
+        flags == MBEDTLS_X509_BADCERT_REVOKED )
+    {
+        ret = 0;
+    }
+
+    if( ret == 0 )
+        ssl_ocsp_next_update( &resp, &next_update );
+
+    mbedtls_x509_ocsp_response_free( &resp );
+
+    if( ret != 0 )
+        return( ret );
+
+    if( ( copy = mbedtls_calloc( 1, len ) ) == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+
+    memcpy( copy, der, len );
+
+#if defined(MBEDTLS_THREADING_C)
+    if( ( ret = mbedtls_mutex_lock( &store->mutex ) ) != 0 )
+    {
+        mbedtls_free( copy );
+        return( ret );
+    }
+#endif
+
+    for( cur = store->chain; cur != NULL; cur = cur->next )
+    {
+        if( cur->crt == crt )
+            break;
+    }
+
+    if( cur == NULL )
+    {
+        if( ( entry = mbedtls_calloc( 1, sizeof( mbedtls_ssl_ocsp_entry ) ) ) == NULL )
+        {
+            ret = MBEDTLS_ERR_SSL_ALLOC_FAILED;
+            goto exit;
+        }
+
+        entry->crt = crt;
+        entry->next = store->chain;
+        store->chain = entry;
+        cur = entry;
+    }
+
+    old_der = cur->der;
+    old_len = cur->len;
+
+    cur->der = copy;
+    cur->len = len;
+    cur->next_update = next_update;
+
+    copy = old_der;
+    len = old_len;
+
+exit:
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &store->mutex ) != 0 )
+        ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+#endif
+
+    if( copy != NULL )
+    {
+        mbedtls_zeroize( copy, len );
+        mbedtls_free( copy );
+    }
+
+    return( ret );
+}
+
+#if defined(MBEDTLS_FS_IO)
+int mbedtls_ssl_ocsp_load_file( mbedtls_ssl_ocsp_store *store,
+                                const mbedtls_x509_crt *crt,
+                                const mbedtls_x509_crt *ca_chain,
+                                const char *path )
+{
+    int ret;
+    size_t n;
+    unsigned char *buf;
+
+    if( ( ret = mbedtls_pk_load_file( path, &buf, &n ) ) != 0 )
+        return( ret );
+
+    ret = mbedtls_ssl_ocsp_set_response( store, crt, ca_chain, buf, n );
+
+    mbedtls_zeroize( buf, n );
+    mbedtls_free( buf );
+
+    return( ret );
+}
+#endif /* MBEDTLS_FS_IO */
+
+int mbedtls_ssl_ocsp_get( void *p_store, const mbedtls_x509_crt *crt,
+                          unsigned char *buf, size_t buf_len, size_t *olen )
+{
+    int ret = 0;
+    mbedtls_ssl_ocsp_store *store = (mbedtls_ssl_ocsp_store *) p_store;
+    mbedtls_ssl_ocsp_entry *cur;
+
+    *olen = 0;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( ( ret = mbedtls_mutex_lock( &store->mutex ) ) != 0 )
+        return( ret );
+#endif
+
+    for( cur = store->chain; cur != NULL; cur = cur->next )
+    {
+        if( cur->crt == crt )
+            break;
+    }
+
+    /*
+     * A stale or oversized response is not an error: the handshake goes on
+     * without a response, as if none was available.
+     */
+    if( cur == NULL ||
+        ( cur->next_update.year != 0 &&
+          mbedtls_x509_time_is_past( &cur->next_update ) ) ||
+        cur->len > buf_len )
+    {
+        goto exit;
+    }
+
+    memcpy( buf, cur->der, cur->len );
+    *olen = cur->len;
+
+exit:
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &store->mutex ) != 0 )
+        ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+#endif
+
+    return( ret );
+}
+
+void mbedtls_ssl_ocsp_free( mbedtls_ssl_ocsp_store *store )
+{
+    mbedtls_ssl_ocsp_entry *cur, *next;
+
+    if( store == NULL )
+        return;
+
+    for( cur = store->chain; cur != NULL; cur = next )
+    {
+        next = cur->next;
+
+        if( cur->der != NULL )
+        {
+            mbedtls_zeroize( cur->der, cur->len );
+            mbedtls_free( cur->der );
+        }
+
+        mbedtls_free( cur );
+    }
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_free( &store->mutex );
+#endif
+
+    mbedtls_zeroize( store, sizeof( mbedtls_ssl_ocsp_store ) );
+}
+
+#endif /* MBEDTLS_SSL_OCSP_C */
@@ -0,0 +1,570 @@
+/*
+ *  SSL server certificate store indexed by server name (SNI)
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ * The store keeps certificates in a hash table keyed by the lowercase DNS
+ * names they are valid for. A wildcard name "*.example.com" is stored as
+ * "example.com" with a flag, so a ClientHello name costs at most two
+ * lookups: the full name, then the name without its first label.
+ *
+ * Tables are immutable once published. Each handshake holds a reference on
+ * the table it picked its certificates from, so a table can be replaced
+ * while handshakes are in flight.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_SSL_SNI_C)
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#endif
+
+#include "mbedtls/ssl_sni.h"
+#include "mbedtls/ssl_internal.h"
+#include "mbedtls/oid.h"
+
+#include <string.h>
+
+#if MBEDTLS_SSL_SNI_MIN_BUCKETS <= 0 || \
+    ( MBEDTLS_SSL_SNI_MIN_BUCKETS & ( MBEDTLS_SSL_SNI_MIN_BUCKETS - 1 ) ) != 0
+#error "MBEDTLS_SSL_SNI_MIN_BUCKETS must be a power of 2"
+#endif
+
+#if defined(MBEDTLS_FS_IO)
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+#endif
+
+/*
+ * FNV-1a over the lowercase name
+ */
+static uint32_t sni_hash( const unsigned char *name, size_t len )
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for( i = 0; i < len; i++ )
+    {
+        unsigned char c = name[i];
+
+        if( c >= 'A' && c <= 'Z' )
+            c += 'a' - 'A';
+
+        h ^= c;
+        h *= 16777619u;
+    }
+
+    return( h );
+}
+
+/*
+ * Compare a stored (lowercase) name with a name from the wire
+ */
+static int sni_name_eq( const unsigned char *stored,
+                        const unsigned char *name, size_t len )
+{
+    size_t i;
+
+    for( i = 0; i < len; i++ )
+    {
+        unsigned char c = name[i];
+
+        if( c >= 'A' && c <= 'Z' )
+            c += 'a' - 'A';
+
+        if( stored[i] != c )
+            return( 0 );
+    }
+
+    return( 1 );
+}
+
+static void sni_cert_free( mbedtls_ssl_sni_cert *cert )
+{
+    mbedtls_x509_crt_free( &cert->crt );
+    mbedtls_pk_free( &cert->key );
+    mbedtls_free( cert );
+}
+
+int mbedtls_ssl_sni_table_new( mbedtls_ssl_sni_table **table )
+{
+    mbedtls_ssl_sni_table *t;
+
+    *table = NULL;
+
+    t = mbedtls_calloc( 1, sizeof( mbedtls_ssl_sni_table ) );
+    if( t == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+
+    t->buckets = mbedtls_calloc( MBEDTLS_SSL_SNI_MIN_BUCKETS,
+                                 sizeof( mbedtls_ssl_sni_name * ) );
+    if( t->buckets == NULL )
+    {
+        mbedtls_free( t );
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+
+    t->bucket_count = MBEDTLS_SSL_SNI_MIN_BUCKETS;
+    t->refs = 1;
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_init( &t->mutex );
+#endif
+
+    *table = t;
+    return( 0 );
+}
+
+void mbedtls_ssl_sni_table_free( mbedtls_ssl_sni_table *table )
+{
+    mbedtls_ssl_sni_name *name, *next_name;
+    mbedtls_ssl_sni_cert *cert, *next_cert;
+    size_t i;
+
+    if( table == NULL )
+        return;
+
+    for( i = 0; i < table->bucket_count; i++ )
+    {
+        for( name = table->buckets[i]; name != NULL; name = next_name )
+        {
+            next_name = name->next;
+            mbedtls_free( name );
+        }
+    }
+    mbedtls_free( table->buckets );
+
+    for( cert = table->certs; cert != NULL; cert = next_cert )
+    {
+        next_cert = cert->next;
+        sni_cert_free( cert );
+    }
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_free( &table->mutex );
+#endif
+
+    mbedtls_free( table );
+}
+
+void mbedtls_ssl_sni_table_release( mbedtls_ssl_sni_table *table )
+{
+    unsigned int refs;
+
+    if( table == NULL )
+        return;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &table->mutex ) != 0 )
+        return;
+#endif
+
+    refs = --table->refs;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &table->mutex ) != 0 )
+        return;
+#endif
+
+    if( refs == 0 )
+        mbedtls_ssl_sni_table_free( table );
+}
+
+/*
+ * Double the number of buckets, keeping the index valid on failure
+ */
+static int sni_table_grow( mbedtls_ssl_sni_table *table )
+{
+    mbedtls_ssl_sni_name **buckets, *name, *next;
+    size_t count = table->bucket_count * 2;
+    size_t i;
+
+    buckets = mbedtls_calloc( count, sizeof( mbedtls_ssl_sni_name * ) );
+    if( buckets == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+
+    for( i = 0; i < table->bucket_count; i++ )
+    {
+        for( name = table->buckets[i]; name != NULL; name = next )
+        {
+            mbedtls_ssl_sni_name **tail = &buckets[name->hash & ( count - 1 )];
+
+            /* Keep insertion order within each bucket */
+            next = name->next;
+            while( *tail != NULL )
+                tail = &(*tail)->next;
+            name->next = NULL;
+            *tail = name;
+        }
+    }
+
+    mbedtls_free( table->buckets );
+    table->buckets = buckets;
+    table->bucket_count = count;
+
+    return( 0 );
+}
+
+/*
+ * Index a certificate under one name, from its SAN or CN
+ */
+static int sni_table_insert( mbedtls_ssl_sni_table *table,
+                             mbedtls_ssl_sni_cert *cert,
+                             const unsigned char *p, size_t len )
+{
+    mbedtls_ssl_sni_name *name, **tail;
+    int wildcard = 0;
+    size_t i;
+
+    if( len > 2 && p[0] == '*' && p[1] == '.' )
+    {
+        wildcard = 1;
+        p += 2;
+        len -= 2;
+    }
+
+    if( len == 0 || memchr( p, '*', len ) != NULL )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    if( table->name_count >= table->bucket_count &&
+        sni_table_grow( table ) != 0 )
+    {
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+
+    name = mbedtls_calloc( 1, sizeof( mbedtls_ssl_sni_name ) + len );
+    if( name == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+
+    name->name = (unsigned char *)( name + 1 );
+    for( i = 0; i < len; i++ )
+    {
+        name->name[i] = p[i];
+        if( p[i] >= 'A' && p[i] <= 'Z' )
+            name->name[i] += 'a' - 'A';
+    }
+
+    name->hash = sni_hash( p, len );
+    name->wildcard = wildcard;
+    name->len = len;
+    name->cert = cert;
+
+    tail = &table->buckets[name->hash & ( table->bucket_count - 1 )];
+    while( *tail != NULL )
+        tail = &(*tail)->next;
+    *tail = name;
+
+    table->name_count++;
+
+    return( 0 );
+}
+
+static int sni_table_index( mbedtls_ssl_sni_table *table,
+                            mbedtls_ssl_sni_cert *cert )
+{
+    int ret;
+    mbedtls_x509_crt *crt = &cert->crt;
+
+    if( crt->ext_types & MBEDTLS_X509_EXT_SUBJECT_ALT_NAME )
+    {
+        const mbedtls_x509_sequence *cur;
+
+        if( ( ret = mbedtls_x509_crt_get_subject_alt_names( crt, &cur ) ) != 0 )
+            return( ret );
+
+        for( ; cur != NULL; cur = cur->next )
+        {
+            if( ( ret = sni_table_insert( table, cert, cur->buf.p,
+                                          cur->buf.len ) ) != 0 )
+                return( ret );
+        }
+    }
+    else
+    {
+        const mbedtls_x509_name *cur;
+
+        if( ( ret = mbedtls_x509_crt_get_subject( crt, &cur ) ) != 0 )
+            return( ret );
+
+        for( ; cur != NULL; cur = cur->next )
+        {
+            if( MBEDTLS_OID_CMP( MBEDTLS_OID_AT_CN, &cur->oid ) == 0 )
+                return( sni_table_insert( table, cert, cur->val.p,
+                                          cur->val.len ) );
+        }
+
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Remove the names of the certificate added last, after a failure
+ */
+static void sni_table_unindex( mbedtls_ssl_sni_table *table,
+                               const mbedtls_ssl_sni_cert *cert )
+{
+    mbedtls_ssl_sni_name **cur, *name;
+    size_t i;
+
+    for( i = 0; i < table->bucket_count; i++ )
+    {
+        cur = &table->buckets[i];
+        while( *cur != NULL )
+        {
+            name = *cur;
+            if( name->cert == cert )
+            {
+                *cur = name->next;
+                mbedtls_free( name );
+                table->name_count--;
+            }
+            else
+                cur = &name->next;
+        }
+    }
+}
+
+int mbedtls_ssl_sni_table_add( mbedtls_ssl_sni_table *table,
+                               const unsigned char *crt_buf, size_t crt_len,
+                               const unsigned char *key_buf, size_t key_len,
+                               const unsigned char *pwd, size_t pwd_len )
+{
+    int ret;
+    mbedtls_ssl_sni_cert *cert, **tail;
+
+    cert = mbedtls_calloc( 1, sizeof( mbedtls_ssl_sni_cert ) );
+    if( cert == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+
+    mbedtls_x509_crt_init( &cert->crt );
+    mbedtls_pk_init( &cert->key );
+
+    if( ( ret = mbedtls_x509_crt_parse( &cert->crt, crt_buf, crt_len ) ) != 0 ||
+        ( ret = mbedtls_pk_parse_key( &cert->key, key_buf, key_len,
+                                      pwd, pwd_len ) ) != 0 )
+    {
+        sni_cert_free( cert );
+        return( ret );
+    }
+
+    if( ( ret = sni_table_index( table, cert ) ) != 0 )
+    {
+        sni_table_unindex( table, cert );
+        sni_cert_free( cert );
+        return( ret );
+    }
+
+    tail = &table->certs;
+    while( *tail != NULL )
+        tail = &(*tail)->next;
+    *tail = cert;
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_FS_IO)
+int mbedtls_ssl_sni_table_add_file( mbedtls_ssl_sni_table *table,
+                                    const char *crt_path,
+                                    const char *key_path,
+                                    const char *pwd )
+{
+    int ret;
+    size_t crt_len, key_len;
+    unsigned char *crt_buf, *key_buf;
+
+    if( ( ret = mbedtls_pk_load_file( crt_path, &crt_buf, &crt_len ) ) != 0 )
+        return( ret );
+
+    if( ( ret = mbedtls_pk_load_file( key_path, &key_buf, &key_len ) ) != 0 )
+    {
+        mbedtls_free( crt_buf );
+        return( ret );
+    }
+
+    ret = mbedtls_ssl_sni_table_add( table, crt_buf, crt_len, key_buf, key_len,
+                                     (const unsigned char *) pwd,
+                                     pwd == NULL ? 0 : strlen( pwd ) );
+
+    mbedtls_free( crt_buf );
+    mbedtls_zeroize( key_buf, key_len );
+    mbedtls_free( key_buf );
+
+    return( ret );
+}
+#endif /* MBEDTLS_FS_IO */
+
+void mbedtls_ssl_sni_init( mbedtls_ssl_sni_store *store )
+{
+    memset( store, 0, sizeof( mbedtls_ssl_sni_store ) );
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_init( &store->mutex );
+#endif
+}
+
+int mbedtls_ssl_sni_publish( mbedtls_ssl_sni_store *store,
+                             mbedtls_ssl_sni_table *table )
+{
+    mbedtls_ssl_sni_table *old;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &store->mutex ) != 0 )
+        return( MBEDTLS_ERR_THREADING_MUTEX_ERROR );
+#endif
+
+    old = store->table;
+    store->table = table;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &store->mutex ) != 0 )
+        return( MBEDTLS_ERR_THREADING_MUTEX_ERROR );
+#endif
+
+    /* Drop the reference of the store, handshakes may hold more */
+    mbedtls_ssl_sni_table_release( old );
+
+    return( 0 );
+}
+
+/*
+ * Add the certificates indexed under a name to the handshake
+ */
+static int sni_table_select( const mbedtls_ssl_sni_table *table,
+                             mbedtls_ssl_context *ssl,
+                             const unsigned char *name, size_t len,
+                             int wildcard, int *found )
+{
+    int ret;
+    uint32_t hash = sni_hash( name, len );
+    const mbedtls_ssl_sni_name *cur;
+
+    for( cur = table->buckets[hash & ( table->bucket_count - 1 )];
+         cur != NULL; cur = cur->next )
+    {
+        if( cur->hash != hash || cur->wildcard != wildcard ||
+            cur->len != len || ! sni_name_eq( cur->name, name, len ) )
+        {
+            continue;
+        }
+
+        if( ( ret = mbedtls_ssl_set_hs_own_cert( ssl, &cur->cert->crt,
+                                                 &cur->cert->key ) ) != 0 )
+            return( ret );
+
+        *found = 1;
+    }
+
+    return( 0 );
+}
+
+int mbedtls_ssl_sni_get( void *p_store, mbedtls_ssl_context *ssl,
+                         const unsigned char *name, size_t name_len )
+{
+    int ret = 0, found = 0;
+    mbedtls_ssl_sni_store *store = (mbedtls_ssl_sni_store *) p_store;
+    mbedtls_ssl_sni_table *table;
+    const unsigned char *dot;
+
+    if( ssl->handshake == NULL )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &store->mutex ) != 0 )
+        return( MBEDTLS_ERR_THREADING_MUTEX_ERROR );
+#endif
+
+    table = store->table;
+    if( table != NULL )
+    {
+#if defined(MBEDTLS_THREADING_C)
+        if( mbedtls_mutex_lock( &table->mutex ) != 0 )
+        {
+            table = NULL;
+            ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+        }
+        else
+        {
+            table->refs++;
+            if( mbedtls_mutex_unlock( &table->mutex ) != 0 )
+                ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+        }
+#else
+        table->refs++;
+#endif
+    }
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &store->mutex ) != 0 )
+        ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+#endif
+
+    if( table == NULL )
+        return( ret );
+
+    /* The handshake releases the table when it is freed */
+    mbedtls_ssl_sni_table_release( ssl->handshake->sni_table );
+    ssl->handshake->sni_table = table;
+
+    if( ret != 0 )
+        return( ret );
+
+    if( ( ret = sni_table_select( table, ssl, name, name_len,
+                                  0, &found ) ) != 0 || found )
+        return( ret );
+
+    dot = memchr( name, '.', name_len );
+    if( dot != NULL && dot != name && dot + 1 < name + name_len )
+    {
+        dot++;
+        ret = sni_table_select( table, ssl, dot, name_len - ( dot - name ),
+                                1, &found );
+    }
+
+    return( ret );
+}
+
+void mbedtls_ssl_sni_free( mbedtls_ssl_sni_store *store )
+{
+    if( store == NULL )
+        return;
+
+    mbedtls_ssl_sni_table_release( store->table );
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_free( &store->mutex );
+#endif
+
+    memset( store, 0, sizeof( mbedtls_ssl_sni_store ) );
+}
+
+#endif /* MBEDTLS_SSL_SNI_C */
@@ -53,6 +53,29 @@
 #include "mbedtls/oid.h"
 #endif
 
+#if defined(MBEDTLS_SSL_SNI_C)
+#include "mbedtls/ssl_sni.h"
+#endif
+
+#if defined(MBEDTLS_CIPHER_MODE_CBC)
+#include "mbedtls/cipher_internal.h"
+#endif
+
+#if defined(MBEDTLS_GCM_C)
+#include "mbedtls/gcm.h"
+#endif
+
+#if defined(MBEDTLS_CCM_C)
+#include "mbedtls/ccm.h"
+#endif
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 /* Implementation that should never be optimized out by the compiler */
 static void mbedtls_zeroize( void *v, size_t n ) {
     volatile unsigned char *p = v; while( n-- ) *p++ = 0;
@@ -528,6 +551,26 @@ int mbedtls_ssl_derive_keys( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /*
+     * Records we receive carry our connection ID, those we send the peer's
+     */
+    if( handshake->cid_in_use != 0 )
+    {
+        transform->in_cid_len = ssl->own_cid_len;
+        memcpy( transform->in_cid, ssl->own_cid, ssl->own_cid_len );
+
+        transform->out_cid_len = handshake->peer_cid_len;
+        memcpy( transform->out_cid, handshake->peer_cid,
+                handshake->peer_cid_len );
+
+        MBEDTLS_SSL_DEBUG_BUF( 3, "incoming CID", transform->in_cid,
+                               transform->in_cid_len );
+        MBEDTLS_SSL_DEBUG_BUF( 3, "outgoing CID", transform->out_cid,
+                               transform->out_cid_len );
+    }
+#endif
+
     /*
      * Set appropriate PRF function and other SSL / TLS / TLS1.2 functions
      */
@@ -698,6 +741,20 @@ int mbedtls_ssl_derive_keys( mbedtls_ssl_context *ssl )
         transform->ivlen = 12;
         transform->fixed_ivlen = 4;
 
+#if defined(MBEDTLS_GCM_C) || defined(MBEDTLS_CCM_C)
+        /*
+         * Everything the records need but the sequence number, type and
+         * length is known now: keep it in the transform
+         */
+        transform->aead_mode = cipher_info->mode;
+        transform->taglen = transform->ciphersuite_info->flags &
+                            MBEDTLS_CIPHERSUITE_SHORT_TAG ? 8 : 16;
+
+        mbedtls_ssl_write_version( ssl->major_ver, ssl->minor_ver,
+                                   ssl->conf->transport, transform->add_enc + 9 );
+        memcpy( transform->add_dec + 9, transform->add_enc + 9, 2 );
+#endif
+
         /* Minimum length is expicit IV + tag */
         transform->minlen = transform->ivlen - transform->fixed_ivlen
                             + ( transform->ciphersuite_info->flags &
@@ -892,7 +949,16 @@ int mbedtls_ssl_derive_keys( mbedtls_ssl_context *ssl )
                                   mac_key_len, transform->keylen,
                                   iv_copy_len );
     }
+
+#if defined(MBEDTLS_SSL_KTLS)
+    if( cipher_info->mode == MBEDTLS_MODE_GCM &&
+        transform->keylen <= sizeof( transform->key_enc ) )
+    {
+        memcpy( transform->key_enc, key1, transform->keylen );
+        memcpy( transform->key_dec, key2, transform->keylen );
+    }
 #endif
+#endif /* MBEDTLS_SSL_EXPORT_KEYS */
 
     if( ( ret = mbedtls_cipher_setup( &transform->cipher_ctx_enc,
                                  cipher_info ) ) != 0 )
@@ -1273,9 +1339,187 @@ static void ssl_mac( mbedtls_md_context_t *md_ctx,
 #define SSL_SOME_MODES_USE_MAC
 #endif
 
+#if defined(MBEDTLS_CIPHER_MODE_CBC) &&                                    \
+    ( defined(MBEDTLS_SSL_PROTO_TLS1) || defined(MBEDTLS_SSL_PROTO_TLS1_1) || \
+      defined(MBEDTLS_SSL_PROTO_TLS1_2) )
+#define SSL_CBC_STITCHED
+
+/* Amount of data hashed and ciphered in turn: one SHA-1/SHA-256 block */
+#define SSL_CBC_CHUNK_LEN   64
+
+/*
+ * With MAC-then-encrypt, the end of a record, which holds the MAC and up to
+ * 256 bytes of padding, is decrypted first to find the length of the data
+ * to MAC. The rest is then decrypted along with the MAC computation.
+ */
+#define SSL_CBC_TAIL_LEN    ( ( 256 + MBEDTLS_SSL_MAC_ADD + 15 ) & ~15 )
+
+/*
+ * CBC-encrypt or -decrypt len bytes of buf in place, updating the HMAC with
+ * the first mac_len bytes of either the input (mac_input != 0) or the output
+ * of the cipher. The two are interleaved one hash block at a time, so that
+ * the record is only brought into cache once and the independent cipher
+ * and hash computations can overlap in the CPU.
+ *
+ * The block cipher is called directly, with iv updated as by
+ * mbedtls_cipher_crypt(), but without the buffering of the cipher layer,
+ * which does not support partial updates in place.
+ */
+static int ssl_cbc_hmac( mbedtls_cipher_context_t *cipher_ctx,
+                         mbedtls_operation_t operation,
+                         unsigned char *iv,
+                         mbedtls_md_context_t *md_ctx, int mac_input,
+                         unsigned char *buf, size_t len, size_t mac_len )
+{
+    int ret;
+    size_t off, n, m;
+
+    for( off = 0; off < len; off += n )
+    {
+        n = len - off < SSL_CBC_CHUNK_LEN ? len - off : SSL_CBC_CHUNK_LEN;
+        m = off >= mac_len ? 0 : mac_len - off < n ? mac_len - off : n;
+
+        if( mac_input && m != 0 )
+            mbedtls_md_hmac_update( md_ctx, buf + off, m );
+
+        if( ( ret = cipher_ctx->cipher_info->base->cbc_func(
+                        cipher_ctx->cipher_ctx, operation, n, iv,
+                        buf + off, buf + off ) ) != 0 )
+        {
+            return( ret );
+        }
+
+        if( ! mac_input && m != 0 )
+            mbedtls_md_hmac_update( md_ctx, buf + off, m );
+    }
+
+    return( 0 );
+}
+#endif /* MBEDTLS_CIPHER_MODE_CBC && TLS */
+
 /*
  * Encryption/decryption functions
  */
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+#if MBEDTLS_SSL_CID_IN_LEN_MAX > MBEDTLS_SSL_CID_OUT_LEN_MAX
+#define SSL_ADD_DATA_MAX_LEN    ( 23 + MBEDTLS_SSL_CID_IN_LEN_MAX )
+#else
+#define SSL_ADD_DATA_MAX_LEN    ( 23 + MBEDTLS_SSL_CID_OUT_LEN_MAX )
+#endif
+#else
+#define SSL_ADD_DATA_MAX_LEN    13
+#endif
+
+/*
+ * Write the header data a record's MAC or AEAD tag covers, given the record
+ * counter, the record header (type, version, and with DTLS the connection ID
+ * before the length field at len_field) and the length to authenticate:
+ *   seq_num + type + version + length
+ * or for records with a connection ID (RFC 9146 section 5):
+ *   seq_num_placeholder + tls12_cid + cid_length + tls12_cid + version +
+ *   epoch + sequence_number + cid + length
+ * Returns the number of bytes written, at most SSL_ADD_DATA_MAX_LEN.
+ */
+static size_t ssl_build_add_data( unsigned char *add_data,
+                                  const unsigned char *ctr,
+                                  const unsigned char *hdr,
+                                  const unsigned char *len_field,
+                                  size_t len )
+{
+    size_t add_len;
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( hdr[0] == MBEDTLS_SSL_MSG_CID )
+    {
+        /* The connection ID sits between the counter and the length */
+        size_t cid_len = (size_t) ( len_field - ( hdr + 11 ) );
+
+        memset( add_data, 0xFF, 8 );
+        add_data[8]  = MBEDTLS_SSL_MSG_CID;
+        add_data[9]  = (unsigned char) cid_len;
+        add_data[10] = MBEDTLS_SSL_MSG_CID;
+        memcpy( add_data + 11, hdr + 1, 2 );
+        memcpy( add_data + 13, ctr, 8 );
+        memcpy( add_data + 21, hdr + 11, cid_len );
+        add_len = 21 + cid_len;
+    }
+    else
+#endif
+    {
+        ((void) len_field);
+
+        memcpy( add_data, ctr, 8 );
+        memcpy( add_data + 8, hdr, 3 );
+        add_len = 11;
+    }
+
+    add_data[add_len    ] = (unsigned char)( ( len >> 8 ) & 0xFF );
+    add_data[add_len + 1] = (unsigned char)( ( len      ) & 0xFF );
+
+    return( add_len + 2 );
+}
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+/*
+ * Does the outgoing record carry its real content type inside the
+ * protected payload?
+ */
+static inline int ssl_out_has_inner_type( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( ssl->out_hdr[0] == MBEDTLS_SSL_MSG_CID )
+        return( 1 );
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        return( 1 );
+#endif
+    ((void) ssl);
+    return( 0 );
+}
+
+static inline int ssl_in_has_inner_type( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( ssl->in_msgtype == MBEDTLS_SSL_MSG_CID )
+        return( 1 );
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        return( 1 );
+#endif
+    ((void) ssl);
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID || MBEDTLS_SSL_PROTO_TLS1_3 */
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3) && \
+    ( defined(MBEDTLS_GCM_C) || defined(MBEDTLS_CCM_C) )
+/*
+ * TLS 1.3 per-record nonce and additional data (RFC 8446 5.2, 5.3):
+ * the static IV xor the sequence number, and the record header with the
+ * length of the protected payload
+ */
+static void ssl_tls13_build_nonce_add( unsigned char nonce[12],
+                                       unsigned char add_data[5],
+                                       const unsigned char iv[12],
+                                       const unsigned char ctr[8],
+                                       size_t protected_len )
+{
+    size_t i;
+
+    memcpy( nonce, iv, 12 );
+    for( i = 0; i < 8; i++ )
+        nonce[4 + i] ^= ctr[i];
+
+    add_data[0] = MBEDTLS_SSL_MSG_APPLICATION_DATA;
+    add_data[1] = MBEDTLS_SSL_MAJOR_VERSION_3;
+    add_data[2] = MBEDTLS_SSL_MINOR_VERSION_3;
+    add_data[3] = (unsigned char)( protected_len >> 8 );
+    add_data[4] = (unsigned char)( protected_len      );
+}
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 && ( MBEDTLS_GCM_C || MBEDTLS_CCM_C ) */
+
 static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
 {
     mbedtls_cipher_mode_t mode;
@@ -1291,6 +1535,12 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
 
     mode = mbedtls_cipher_get_cipher_mode( &ssl->transform_out->cipher_ctx_enc );
 
+#if defined(MBEDTLS_SSL_SEND_FILE)
+    if( ssl->out_src != NULL )
+        MBEDTLS_SSL_DEBUG_BUF( 4, "before encrypt: output payload",
+                          ssl->out_src, ssl->out_msglen );
+    else
+#endif
     MBEDTLS_SSL_DEBUG_BUF( 4, "before encrypt: output payload",
                       ssl->out_msg, ssl->out_msglen );
 
@@ -1302,14 +1552,32 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
     }
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /*
+     * With a connection ID or with TLS 1.3, the real content type follows
+     * the content (DTLSInnerPlaintext / TLSInnerPlaintext, sent without
+     * zero padding)
+     */
+    if( ssl_out_has_inner_type( ssl ) )
+    {
+        ssl->out_msg[ssl->out_msglen++] = (unsigned char) ssl->out_msgtype;
+        ssl->out_len[0] = (unsigned char)( ssl->out_msglen >> 8 );
+        ssl->out_len[1] = (unsigned char)( ssl->out_msglen      );
+    }
+#endif
+
     /*
      * Add MAC before if needed
+     * (CBC in TLS: computed along with the encryption, see below)
      */
 #if defined(SSL_SOME_MODES_USE_MAC)
     if( mode == MBEDTLS_MODE_STREAM ||
         ( mode == MBEDTLS_MODE_CBC
 #if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
           && ssl->session_out->encrypt_then_mac == MBEDTLS_SSL_ETM_DISABLED
+#endif
+#if defined(SSL_CBC_STITCHED)
+          && ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_0
 #endif
         ) )
     {
@@ -1333,10 +1601,12 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
         if( ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_1 )
         {
             unsigned char mac[MBEDTLS_SSL_MAC_ADD];
+            unsigned char add_data[SSL_ADD_DATA_MAX_LEN];
+            size_t add_len = ssl_build_add_data( add_data, ssl->out_ctr,
+                                                 ssl->out_hdr, ssl->out_len,
+                                                 ssl->out_msglen );
 
-            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc, ssl->out_ctr, 8 );
-            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc, ssl->out_hdr, 3 );
-            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc, ssl->out_len, 2 );
+            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc, add_data, add_len );
             mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc,
                              ssl->out_msg, ssl->out_msglen );
             mbedtls_md_hmac_finish( &ssl->transform_out->md_ctx_enc, mac );
@@ -1396,72 +1666,124 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
         mode == MBEDTLS_MODE_CCM )
     {
         int ret;
-        size_t enc_msglen, olen;
+        size_t enc_msglen;
         unsigned char *enc_msg;
-        unsigned char add_data[13];
-        unsigned char taglen = ssl->transform_out->ciphersuite_info->flags &
-                               MBEDTLS_CIPHERSUITE_SHORT_TAG ? 8 : 16;
-
-        memcpy( add_data, ssl->out_ctr, 8 );
-        add_data[8]  = ssl->out_msgtype;
-        mbedtls_ssl_write_version( ssl->major_ver, ssl->minor_ver,
-                           ssl->conf->transport, add_data + 9 );
-        add_data[11] = ( ssl->out_msglen >> 8 ) & 0xFF;
-        add_data[12] = ssl->out_msglen & 0xFF;
+        const unsigned char *plain;
+        mbedtls_ssl_transform *transform = ssl->transform_out;
+        unsigned char *add_data = transform->add_enc;
+        size_t add_len = 13;
+        unsigned char taglen = transform->taglen;
+        unsigned char *iv = transform->iv_enc;
+        size_t explicit_ivlen = 8;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        unsigned char tls13_nonce[12];
+        unsigned char tls13_add_data[5];
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        unsigned char cid_add_data[SSL_ADD_DATA_MAX_LEN];
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        {
+            /* No explicit IV: the nonce comes from the sequence number */
+            ssl_tls13_build_nonce_add( tls13_nonce, tls13_add_data,
+                                       transform->iv_enc, ssl->out_ctr,
+                                       ssl->out_msglen + taglen );
+            iv = tls13_nonce;
+            explicit_ivlen = 0;
+            add_data = tls13_add_data;
+            add_len = 5;
+        }
+        else
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        if( ssl->out_hdr[0] == MBEDTLS_SSL_MSG_CID )
+        {
+            add_data = cid_add_data;
+            add_len = ssl_build_add_data( add_data, ssl->out_ctr, ssl->out_hdr,
+                                          ssl->out_len, ssl->out_msglen );
+        }
+        else
+#endif
+        {
+            /* Version bytes already in place, see ssl_derive_keys() */
+            memcpy( add_data, ssl->out_ctr, 8 );
+            add_data[8]  = ssl->out_msgtype;
+            add_data[11] = ( ssl->out_msglen >> 8 ) & 0xFF;
+            add_data[12] = ssl->out_msglen & 0xFF;
+        }
 
         MBEDTLS_SSL_DEBUG_BUF( 4, "additional data used for AEAD",
-                       add_data, 13 );
+                       add_data, add_len );
 
         /*
-         * Generate IV
+         * Generate IV (explicit part is always 8 bytes, see ssl_derive_keys())
          */
-        if( ssl->transform_out->ivlen - ssl->transform_out->fixed_ivlen != 8 )
+        if( explicit_ivlen != 0 )
         {
-            /* Reminder if we ever add an AEAD mode with a different size */
-            MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
-            return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+            memcpy( transform->iv_enc + transform->fixed_ivlen, ssl->out_ctr, 8 );
+            memcpy( ssl->out_iv, ssl->out_ctr, 8 );
         }
 
-        memcpy( ssl->transform_out->iv_enc + ssl->transform_out->fixed_ivlen,
-                             ssl->out_ctr, 8 );
-        memcpy( ssl->out_iv, ssl->out_ctr, 8 );
-
-        MBEDTLS_SSL_DEBUG_BUF( 4, "IV used", ssl->out_iv,
-                ssl->transform_out->ivlen - ssl->transform_out->fixed_ivlen );
+        MBEDTLS_SSL_DEBUG_BUF( 4, "IV used", iv, 12 );
 
         /*
          * Fix pointer positions and message length with added IV
          */
         enc_msg = ssl->out_msg;
         enc_msglen = ssl->out_msglen;
-        ssl->out_msglen += ssl->transform_out->ivlen -
-                           ssl->transform_out->fixed_ivlen;
+        ssl->out_msglen += explicit_ivlen;
+
+        /* The plaintext may still be in the caller's buffer */
+        plain = enc_msg;
+#if defined(MBEDTLS_SSL_SEND_FILE)
+        if( ssl->out_src != NULL )
+            plain = ssl->out_src;
+#endif
 
         MBEDTLS_SSL_DEBUG_MSG( 3, ( "before encrypt: msglen = %d, "
                             "including %d bytes of padding",
                        ssl->out_msglen, 0 ) );
 
         /*
-         * Encrypt and authenticate
+         * Encrypt and authenticate, calling the AEAD module directly
          */
-        if( ( ret = mbedtls_cipher_auth_encrypt( &ssl->transform_out->cipher_ctx_enc,
-                                         ssl->transform_out->iv_enc,
-                                         ssl->transform_out->ivlen,
-                                         add_data, 13,
-                                         enc_msg, enc_msglen,
-                                         enc_msg, &olen,
-                                         enc_msg + enc_msglen, taglen ) ) != 0 )
-        {
-            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_cipher_auth_encrypt", ret );
-            return( ret );
+#if defined(MBEDTLS_GCM_C)
+        if( transform->aead_mode == MBEDTLS_MODE_GCM )
+        {
+            ret = mbedtls_gcm_crypt_and_tag( transform->cipher_ctx_enc.cipher_ctx,
+                                             MBEDTLS_GCM_ENCRYPT, enc_msglen,
+                                             iv, 12,
+                                             add_data, add_len,
+                                             plain, enc_msg,
+                                             taglen, enc_msg + enc_msglen );
         }
-
-        if( olen != enc_msglen )
+        else
+#endif
+#if defined(MBEDTLS_CCM_C)
+        if( transform->aead_mode == MBEDTLS_MODE_CCM )
+        {
+            ret = mbedtls_ccm_encrypt_and_tag( transform->cipher_ctx_enc.cipher_ctx,
+                                               enc_msglen,
+                                               iv, 12,
+                                               add_data, add_len,
+                                               plain, enc_msg,
+                                               enc_msg + enc_msglen, taglen );
+        }
+        else
+#endif
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
             return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
         }
 
+        if( ret != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "aead encrypt", ret );
+            return( ret );
+        }
+
         ssl->out_msglen += taglen;
         auth_done++;
 
@@ -1476,6 +1798,31 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
         int ret;
         unsigned char *enc_msg;
         size_t enc_msglen, padlen, olen = 0, i;
+#if defined(SSL_CBC_STITCHED)
+        size_t mac_len = 0;
+        int stitched = ( ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_1 );
+
+        /*
+         * MAC-then-encrypt: leave room for the MAC of the plaintext
+         */
+        if( stitched
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+            && ssl->session_out->encrypt_then_mac == MBEDTLS_SSL_ETM_DISABLED
+#endif
+          )
+        {
+            unsigned char add_data[SSL_ADD_DATA_MAX_LEN];
+            size_t add_len;
+
+            mac_len = ssl->out_msglen;
+
+            add_len = ssl_build_add_data( add_data, ssl->out_ctr, ssl->out_hdr,
+                                          ssl->out_len, ssl->out_msglen );
+            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc, add_data, add_len );
+
+            ssl->out_msglen += ssl->transform_out->maclen;
+        }
+#endif /* SSL_CBC_STITCHED */
 
         padlen = ssl->transform_out->ivlen - ( ssl->out_msglen + 1 ) %
                  ssl->transform_out->ivlen;
@@ -1522,33 +1869,132 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
                             ssl->out_msglen, ssl->transform_out->ivlen,
                             padlen + 1 ) );
 
-        if( ( ret = mbedtls_cipher_crypt( &ssl->transform_out->cipher_ctx_enc,
-                                   ssl->transform_out->iv_enc,
-                                   ssl->transform_out->ivlen,
-                                   enc_msg, enc_msglen,
-                                   enc_msg, &olen ) ) != 0 )
+#if defined(SSL_CBC_STITCHED)
+        if( stitched )
         {
-            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_cipher_crypt", ret );
-            return( ret );
-        }
+            /* Full blocks of plaintext are MAC'd as they are encrypted */
+            size_t head_len = mac_len - mac_len % ssl->transform_out->ivlen;
+            unsigned char iv[MBEDTLS_MAX_IV_LENGTH];
 
-        if( enc_msglen != olen )
-        {
-            MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
-            return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+            memcpy( iv, ssl->transform_out->iv_enc, ssl->transform_out->ivlen );
+
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+            if( ssl->session_out->encrypt_then_mac == MBEDTLS_SSL_ETM_ENABLED )
+            {
+                /* See the MAC below, the ciphertext is MAC'd as it is produced */
+                unsigned char pseudo_hdr[SSL_ADD_DATA_MAX_LEN];
+                size_t pseudo_hdr_len;
+
+                MBEDTLS_SSL_DEBUG_MSG( 3, ( "using encrypt then mac" ) );
+
+                pseudo_hdr_len = ssl_build_add_data( pseudo_hdr, ssl->out_ctr,
+                                                     ssl->out_hdr, ssl->out_len,
+                                                     ssl->out_msglen );
+
+                MBEDTLS_SSL_DEBUG_BUF( 4, "MAC'd meta-data", pseudo_hdr, pseudo_hdr_len );
+
+                mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc,
+                                        pseudo_hdr, pseudo_hdr_len );
+                mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc,
+                                        ssl->out_iv, enc_msg - ssl->out_iv );
+            }
+#endif
+
+            if( ( ret = ssl_cbc_hmac( &ssl->transform_out->cipher_ctx_enc,
+                                      MBEDTLS_ENCRYPT, iv,
+                                      &ssl->transform_out->md_ctx_enc, 1,
+                                      enc_msg, head_len, head_len ) ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_RET( 1, "ssl_cbc_hmac", ret );
+                return( ret );
+            }
+
+            if( auth_done == 0
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+                && ssl->session_out->encrypt_then_mac == MBEDTLS_SSL_ETM_DISABLED
+#endif
+              )
+            {
+                unsigned char mac[MBEDTLS_SSL_MAC_ADD];
+
+                mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc,
+                                        enc_msg + head_len, mac_len - head_len );
+                mbedtls_md_hmac_finish( &ssl->transform_out->md_ctx_enc, mac );
+                mbedtls_md_hmac_reset( &ssl->transform_out->md_ctx_enc );
+
+                memcpy( enc_msg + mac_len, mac, ssl->transform_out->maclen );
+
+                MBEDTLS_SSL_DEBUG_BUF( 4, "computed mac",
+                                       enc_msg + mac_len,
+                                       ssl->transform_out->maclen );
+
+                auth_done++;
+            }
+
+            if( ( ret = ssl_cbc_hmac( &ssl->transform_out->cipher_ctx_enc,
+                                      MBEDTLS_ENCRYPT, iv,
+                                      &ssl->transform_out->md_ctx_enc, 0,
+                                      enc_msg + head_len, enc_msglen - head_len,
+                                      auth_done == 0 ? enc_msglen : 0 ) ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_RET( 1, "ssl_cbc_hmac", ret );
+                return( ret );
+            }
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1)
+            if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
+            {
+                /*
+                 * Save IV in TLS1
+                 */
+                memcpy( ssl->transform_out->iv_enc, iv,
+                        ssl->transform_out->ivlen );
+            }
+#endif
+
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+            if( auth_done == 0 )
+            {
+                mbedtls_md_hmac_finish( &ssl->transform_out->md_ctx_enc,
+                                        ssl->out_iv + ssl->out_msglen );
+                mbedtls_md_hmac_reset( &ssl->transform_out->md_ctx_enc );
+
+                ssl->out_msglen += ssl->transform_out->maclen;
+                auth_done++;
+            }
+#endif
         }
+        else
+#endif /* SSL_CBC_STITCHED */
+        {
+            if( ( ret = mbedtls_cipher_crypt( &ssl->transform_out->cipher_ctx_enc,
+                                       ssl->transform_out->iv_enc,
+                                       ssl->transform_out->ivlen,
+                                       enc_msg, enc_msglen,
+                                       enc_msg, &olen ) ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_cipher_crypt", ret );
+                return( ret );
+            }
+
+            if( enc_msglen != olen )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
+                return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+            }
 
 #if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1)
-        if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
-        {
-            /*
-             * Save IV in SSL3 and TLS1
-             */
-            memcpy( ssl->transform_out->iv_enc,
-                    ssl->transform_out->cipher_ctx_enc.iv,
-                    ssl->transform_out->ivlen );
-        }
+            if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
+            {
+                /*
+                 * Save IV in SSL3 and TLS1
+                 */
+                memcpy( ssl->transform_out->iv_enc,
+                        ssl->transform_out->cipher_ctx_enc.iv,
+                        ssl->transform_out->ivlen );
+            }
 #endif
+        }
 
 #if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
         if( auth_done == 0 )
@@ -1561,18 +2007,19 @@ static int ssl_encrypt_buf( mbedtls_ssl_context *ssl )
              *     IV + // except for TLS 1.0
              *     ENC(content + padding + padding_length));
              */
-            unsigned char pseudo_hdr[13];
+            unsigned char pseudo_hdr[SSL_ADD_DATA_MAX_LEN];
+            size_t pseudo_hdr_len;
 
             MBEDTLS_SSL_DEBUG_MSG( 3, ( "using encrypt then mac" ) );
 
-            memcpy( pseudo_hdr +  0, ssl->out_ctr, 8 );
-            memcpy( pseudo_hdr +  8, ssl->out_hdr, 3 );
-            pseudo_hdr[11] = (unsigned char)( ( ssl->out_msglen >> 8 ) & 0xFF );
-            pseudo_hdr[12] = (unsigned char)( ( ssl->out_msglen      ) & 0xFF );
+            pseudo_hdr_len = ssl_build_add_data( pseudo_hdr, ssl->out_ctr,
+                                                 ssl->out_hdr, ssl->out_len,
+                                                 ssl->out_msglen );
 
-            MBEDTLS_SSL_DEBUG_BUF( 4, "MAC'd meta-data", pseudo_hdr, 13 );
+            MBEDTLS_SSL_DEBUG_BUF( 4, "MAC'd meta-data", pseudo_hdr, pseudo_hdr_len );
 
-            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc, pseudo_hdr, 13 );
+            mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc,
+                                    pseudo_hdr, pseudo_hdr_len );
             mbedtls_md_hmac_update( &ssl->transform_out->md_ctx_enc,
                              ssl->out_iv, ssl->out_msglen );
             mbedtls_md_hmac_finish( &ssl->transform_out->md_ctx_enc,
@@ -1612,6 +2059,10 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
 #if defined(SSL_SOME_MODES_USE_MAC)
     size_t padlen = 0, correct = 1;
 #endif
+#if defined(SSL_CBC_STITCHED)
+    size_t cbc_head_len = 0;
+    unsigned char cbc_iv[MBEDTLS_MAX_IV_LENGTH];
+#endif
 
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> decrypt buf" ) );
 
@@ -1661,74 +2112,139 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
         mode == MBEDTLS_MODE_CCM )
     {
         int ret;
-        size_t dec_msglen, olen;
+        size_t dec_msglen;
         unsigned char *dec_msg;
-        unsigned char *dec_msg_result;
-        unsigned char add_data[13];
-        unsigned char taglen = ssl->transform_in->ciphersuite_info->flags &
-                               MBEDTLS_CIPHERSUITE_SHORT_TAG ? 8 : 16;
-        size_t explicit_iv_len = ssl->transform_in->ivlen -
-                                 ssl->transform_in->fixed_ivlen;
+        mbedtls_ssl_transform *transform = ssl->transform_in;
+        unsigned char *add_data = transform->add_dec;
+        size_t add_len = 13;
+        unsigned char taglen = transform->taglen;
+        unsigned char *iv = transform->iv_dec;
+        size_t explicit_ivlen = 8;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        unsigned char tls13_nonce[12];
+        unsigned char tls13_add_data[5];
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        unsigned char cid_add_data[SSL_ADD_DATA_MAX_LEN];
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+            explicit_ivlen = 0;
+#endif
 
-        if( ssl->in_msglen < explicit_iv_len + taglen )
+        if( ssl->in_msglen < explicit_ivlen + (size_t) taglen )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "msglen (%d) < explicit_iv_len (%d) "
                                 "+ taglen (%d)", ssl->in_msglen,
-                                explicit_iv_len, taglen ) );
+                                explicit_ivlen, taglen ) );
             return( MBEDTLS_ERR_SSL_INVALID_MAC );
         }
-        dec_msglen = ssl->in_msglen - explicit_iv_len - taglen;
+        dec_msglen = ssl->in_msglen - explicit_ivlen - taglen;
 
         dec_msg = ssl->in_msg;
-        dec_msg_result = ssl->in_msg;
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        {
+            /* Protected records all look like application data */
+            if( ssl->in_msgtype != MBEDTLS_SSL_MSG_APPLICATION_DATA )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad outer record type" ) );
+                return( MBEDTLS_ERR_SSL_INVALID_RECORD );
+            }
+
+            ssl_tls13_build_nonce_add( tls13_nonce, tls13_add_data,
+                                       transform->iv_dec, ssl->in_ctr,
+                                       ssl->in_msglen );
+            iv = tls13_nonce;
+            add_data = tls13_add_data;
+            add_len = 5;
+        }
+#endif
+
         ssl->in_msglen = dec_msglen;
 
-        memcpy( add_data, ssl->in_ctr, 8 );
-        add_data[8]  = ssl->in_msgtype;
-        mbedtls_ssl_write_version( ssl->major_ver, ssl->minor_ver,
-                           ssl->conf->transport, add_data + 9 );
-        add_data[11] = ( ssl->in_msglen >> 8 ) & 0xFF;
-        add_data[12] = ssl->in_msglen & 0xFF;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        {
+            ; /* Additional data built above */
+        }
+        else
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        if( ssl->in_msgtype == MBEDTLS_SSL_MSG_CID )
+        {
+            add_data = cid_add_data;
+            add_len = ssl_build_add_data( add_data, ssl->in_ctr, ssl->in_hdr,
+                                          ssl->in_len, ssl->in_msglen );
+        }
+        else
+#endif
+        {
+            /* Version bytes already in place, see ssl_derive_keys() */
+            memcpy( add_data, ssl->in_ctr, 8 );
+            add_data[8]  = ssl->in_msgtype;
+            add_data[11] = ( ssl->in_msglen >> 8 ) & 0xFF;
+            add_data[12] = ssl->in_msglen & 0xFF;
+        }
 
         MBEDTLS_SSL_DEBUG_BUF( 4, "additional data used for AEAD",
-                       add_data, 13 );
+                       add_data, add_len );
 
-        memcpy( ssl->transform_in->iv_dec + ssl->transform_in->fixed_ivlen,
-                ssl->in_iv,
-                ssl->transform_in->ivlen - ssl->transform_in->fixed_ivlen );
+        if( explicit_ivlen != 0 )
+            memcpy( transform->iv_dec + transform->fixed_ivlen, ssl->in_iv, 8 );
 
-        MBEDTLS_SSL_DEBUG_BUF( 4, "IV used", ssl->transform_in->iv_dec,
-                                     ssl->transform_in->ivlen );
+        MBEDTLS_SSL_DEBUG_BUF( 4, "IV used", iv, 12 );
         MBEDTLS_SSL_DEBUG_BUF( 4, "TAG used", dec_msg + dec_msglen, taglen );
 
         /*
-         * Decrypt and authenticate
+         * Decrypt and authenticate, calling the AEAD module directly
          */
-        if( ( ret = mbedtls_cipher_auth_decrypt( &ssl->transform_in->cipher_ctx_dec,
-                                         ssl->transform_in->iv_dec,
-                                         ssl->transform_in->ivlen,
-                                         add_data, 13,
-                                         dec_msg, dec_msglen,
-                                         dec_msg_result, &olen,
-                                         dec_msg + dec_msglen, taglen ) ) != 0 )
+#if defined(MBEDTLS_GCM_C)
+        if( transform->aead_mode == MBEDTLS_MODE_GCM )
         {
-            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_cipher_auth_decrypt", ret );
-
-            if( ret == MBEDTLS_ERR_CIPHER_AUTH_FAILED )
-                return( MBEDTLS_ERR_SSL_INVALID_MAC );
+            ret = mbedtls_gcm_auth_decrypt( transform->cipher_ctx_dec.cipher_ctx,
+                                            dec_msglen,
+                                            iv, 12,
+                                            add_data, add_len,
+                                            dec_msg + dec_msglen, taglen,
+                                            dec_msg, dec_msg );
 
-            return( ret );
+            if( ret == MBEDTLS_ERR_GCM_AUTH_FAILED )
+                ret = MBEDTLS_ERR_SSL_INVALID_MAC;
         }
-        auth_done++;
+        else
+#endif
+#if defined(MBEDTLS_CCM_C)
+        if( transform->aead_mode == MBEDTLS_MODE_CCM )
+        {
+            ret = mbedtls_ccm_auth_decrypt( transform->cipher_ctx_dec.cipher_ctx,
+                                            dec_msglen,
+                                            iv, 12,
+                                            add_data, add_len,
+                                            dec_msg, dec_msg,
+                                            dec_msg + dec_msglen, taglen );
 
-        if( olen != dec_msglen )
+            if( ret == MBEDTLS_ERR_CCM_AUTH_FAILED )
+                ret = MBEDTLS_ERR_SSL_INVALID_MAC;
+        }
+        else
+#endif
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
             return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
         }
-    }
-    else
-#endif /* MBEDTLS_GCM_C || MBEDTLS_CCM_C */
+
+        if( ret != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "aead decrypt", ret );
+            return( ret );
+        }
+        auth_done++;
+    }
+    else
+#endif /* MBEDTLS_GCM_C || MBEDTLS_CCM_C */
 #if defined(MBEDTLS_CIPHER_MODE_CBC) &&                                    \
     ( defined(MBEDTLS_AES_C) || defined(MBEDTLS_CAMELLIA_C) )
     if( mode == MBEDTLS_MODE_CBC )
@@ -1742,6 +2258,13 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
         size_t dec_msglen;
         size_t minlen = 0;
         size_t olen = 0;
+#if defined(SSL_CBC_STITCHED)
+        int stitched = ( ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_1 );
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+        unsigned char etm_hdr[SSL_ADD_DATA_MAX_LEN];
+        size_t etm_hdr_len = 0;
+#endif
+#endif
 
         /*
          * Check immediate ciphertext sanity
@@ -1767,26 +2290,50 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
 
         /*
          * Authenticate before decrypt if enabled
+         * (in TLS: along with the decryption, see below)
          */
 #if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+#if defined(SSL_CBC_STITCHED)
+        if( ssl->session_in->encrypt_then_mac == MBEDTLS_SSL_ETM_ENABLED &&
+            stitched )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "using encrypt then mac" ) );
+
+            dec_msglen -= ssl->transform_in->maclen;
+            ssl->in_msglen -= ssl->transform_in->maclen;
+
+            /*
+             * MAC'd along with the decryption below: the HMAC context must
+             * stay untouched until the length checks have passed, as DTLS
+             * goes on with the next record after an invalid one.
+             */
+            etm_hdr_len = ssl_build_add_data( etm_hdr, ssl->in_ctr,
+                                              ssl->in_hdr, ssl->in_len,
+                                              ssl->in_msglen );
+
+            MBEDTLS_SSL_DEBUG_BUF( 4, "MAC'd meta-data", etm_hdr, etm_hdr_len );
+        }
+        else
+#endif /* SSL_CBC_STITCHED */
         if( ssl->session_in->encrypt_then_mac == MBEDTLS_SSL_ETM_ENABLED )
         {
             unsigned char mac_expect[MBEDTLS_SSL_MAC_ADD];
-            unsigned char pseudo_hdr[13];
+            unsigned char pseudo_hdr[SSL_ADD_DATA_MAX_LEN];
+            size_t pseudo_hdr_len;
 
             MBEDTLS_SSL_DEBUG_MSG( 3, ( "using encrypt then mac" ) );
 
             dec_msglen -= ssl->transform_in->maclen;
             ssl->in_msglen -= ssl->transform_in->maclen;
 
-            memcpy( pseudo_hdr +  0, ssl->in_ctr, 8 );
-            memcpy( pseudo_hdr +  8, ssl->in_hdr, 3 );
-            pseudo_hdr[11] = (unsigned char)( ( ssl->in_msglen >> 8 ) & 0xFF );
-            pseudo_hdr[12] = (unsigned char)( ( ssl->in_msglen      ) & 0xFF );
+            pseudo_hdr_len = ssl_build_add_data( pseudo_hdr, ssl->in_ctr,
+                                                 ssl->in_hdr, ssl->in_len,
+                                                 ssl->in_msglen );
 
-            MBEDTLS_SSL_DEBUG_BUF( 4, "MAC'd meta-data", pseudo_hdr, 13 );
+            MBEDTLS_SSL_DEBUG_BUF( 4, "MAC'd meta-data", pseudo_hdr, pseudo_hdr_len );
 
-            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec, pseudo_hdr, 13 );
+            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec,
+                                    pseudo_hdr, pseudo_hdr_len );
             mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec,
                              ssl->in_iv, ssl->in_msglen );
             mbedtls_md_hmac_finish( &ssl->transform_in->md_ctx_dec, mac_expect );
@@ -1832,33 +2379,131 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
         }
 #endif /* MBEDTLS_SSL_PROTO_TLS1_1 || MBEDTLS_SSL_PROTO_TLS1_2 */
 
-        if( ( ret = mbedtls_cipher_crypt( &ssl->transform_in->cipher_ctx_dec,
-                                   ssl->transform_in->iv_dec,
-                                   ssl->transform_in->ivlen,
-                                   dec_msg, dec_msglen,
-                                   dec_msg_result, &olen ) ) != 0 )
+#if defined(SSL_CBC_STITCHED)
+#if defined(MBEDTLS_SSL_ENCRYPT_THEN_MAC)
+        if( auth_done == 0 && stitched &&
+            ssl->session_in->encrypt_then_mac == MBEDTLS_SSL_ETM_ENABLED )
         {
-            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_cipher_crypt", ret );
-            return( ret );
-        }
+            unsigned char mac_expect[MBEDTLS_SSL_MAC_ADD];
 
-        if( dec_msglen != olen )
-        {
-            MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
-            return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
-        }
+            memcpy( cbc_iv, ssl->transform_in->iv_dec, ssl->transform_in->ivlen );
 
-#if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1)
-        if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
+            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec,
+                                    etm_hdr, etm_hdr_len );
+            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec,
+                                    ssl->in_iv, dec_msg - ssl->in_iv );
+
+            if( ( ret = ssl_cbc_hmac( &ssl->transform_in->cipher_ctx_dec,
+                                      MBEDTLS_DECRYPT, cbc_iv,
+                                      &ssl->transform_in->md_ctx_dec, 1,
+                                      dec_msg, dec_msglen, dec_msglen ) ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_RET( 1, "ssl_cbc_hmac", ret );
+                mbedtls_md_hmac_reset( &ssl->transform_in->md_ctx_dec );
+                return( ret );
+            }
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1)
+            if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
+            {
+                /*
+                 * Save IV in TLS1
+                 */
+                memcpy( ssl->transform_in->iv_dec, cbc_iv,
+                        ssl->transform_in->ivlen );
+            }
+#endif
+
+            mbedtls_md_hmac_finish( &ssl->transform_in->md_ctx_dec, mac_expect );
+            mbedtls_md_hmac_reset( &ssl->transform_in->md_ctx_dec );
+
+            MBEDTLS_SSL_DEBUG_BUF( 4, "message  mac", dec_msg + dec_msglen,
+                                              ssl->transform_in->maclen );
+            MBEDTLS_SSL_DEBUG_BUF( 4, "expected mac", mac_expect,
+                                              ssl->transform_in->maclen );
+
+            if( mbedtls_ssl_safer_memcmp( dec_msg + dec_msglen, mac_expect,
+                                          ssl->transform_in->maclen ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "message mac does not match" ) );
+
+                return( MBEDTLS_ERR_SSL_INVALID_MAC );
+            }
+            auth_done++;
+        }
+        else
+#endif /* MBEDTLS_SSL_ENCRYPT_THEN_MAC */
+        if( stitched )
         {
             /*
-             * Save IV in SSL3 and TLS1
+             * MAC-then-encrypt: only decrypt the end of the record for now,
+             * the rest is decrypted along with the MAC computation below.
              */
-            memcpy( ssl->transform_in->iv_dec,
-                    ssl->transform_in->cipher_ctx_dec.iv,
-                    ssl->transform_in->ivlen );
+            size_t tail_off = dec_msglen > SSL_CBC_TAIL_LEN ?
+                              dec_msglen - SSL_CBC_TAIL_LEN : 0;
+            unsigned char tail_iv[MBEDTLS_MAX_IV_LENGTH];
+
+            memcpy( cbc_iv, ssl->transform_in->iv_dec, ssl->transform_in->ivlen );
+
+            if( tail_off != 0 )
+                memcpy( tail_iv, dec_msg + tail_off - ssl->transform_in->ivlen,
+                        ssl->transform_in->ivlen );
+            else
+                memcpy( tail_iv, cbc_iv, ssl->transform_in->ivlen );
+
+            if( ( ret = ssl->transform_in->cipher_ctx_dec.cipher_info->base->cbc_func(
+                            ssl->transform_in->cipher_ctx_dec.cipher_ctx,
+                            MBEDTLS_DECRYPT, dec_msglen - tail_off, tail_iv,
+                            dec_msg + tail_off, dec_msg + tail_off ) ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_RET( 1, "cbc_func", ret );
+                return( ret );
+            }
+
+            cbc_head_len = tail_off;
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1)
+            if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
+            {
+                /*
+                 * Save IV in TLS1
+                 */
+                memcpy( ssl->transform_in->iv_dec, tail_iv,
+                        ssl->transform_in->ivlen );
+            }
+#endif
         }
+        else
+#endif /* SSL_CBC_STITCHED */
+        {
+            if( ( ret = mbedtls_cipher_crypt( &ssl->transform_in->cipher_ctx_dec,
+                                       ssl->transform_in->iv_dec,
+                                       ssl->transform_in->ivlen,
+                                       dec_msg, dec_msglen,
+                                       dec_msg_result, &olen ) ) != 0 )
+            {
+                MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_cipher_crypt", ret );
+                return( ret );
+            }
+
+            if( dec_msglen != olen )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
+                return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+            }
+
+#if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1)
+            if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_2 )
+            {
+                /*
+                 * Save IV in SSL3 and TLS1
+                 */
+                memcpy( ssl->transform_in->iv_dec,
+                        ssl->transform_in->cipher_ctx_dec.iv,
+                        ssl->transform_in->ivlen );
+            }
 #endif
+        }
 
         padlen = 1 + ssl->in_msg[ssl->in_msglen - 1];
 
@@ -1948,6 +2593,9 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
     }
 
+#if defined(SSL_CBC_STITCHED)
+    if( cbc_head_len == 0 )
+#endif
     MBEDTLS_SSL_DEBUG_BUF( 4, "raw buffer after decryption",
                    ssl->in_msg, ssl->in_msglen );
 
@@ -1994,14 +2642,46 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
              * value for our calculations instead of -55)
              */
             size_t j, extra_run = 0;
-            extra_run = ( 13 + ssl->in_msglen + padlen + 8 ) / 64 -
-                        ( 13 + ssl->in_msglen          + 8 ) / 64;
+            unsigned char add_data[SSL_ADD_DATA_MAX_LEN];
+            size_t add_len = ssl_build_add_data( add_data, ssl->in_ctr,
+                                                 ssl->in_hdr, ssl->in_len,
+                                                 ssl->in_msglen );
+
+            extra_run = ( add_len + ssl->in_msglen + padlen + 8 ) / 64 -
+                        ( add_len + ssl->in_msglen          + 8 ) / 64;
 
             extra_run &= correct * 0xFF;
 
-            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec, ssl->in_ctr, 8 );
-            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec, ssl->in_hdr, 3 );
-            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec, ssl->in_len, 2 );
+            mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec, add_data, add_len );
+#if defined(SSL_CBC_STITCHED)
+            if( cbc_head_len != 0 )
+            {
+                /* The start of the record is decrypted as it is MAC'd */
+                size_t head_mac_len = ssl->in_msglen < cbc_head_len ?
+                                      ssl->in_msglen : cbc_head_len;
+                int ret;
+
+                if( ( ret = ssl_cbc_hmac( &ssl->transform_in->cipher_ctx_dec,
+                                          MBEDTLS_DECRYPT, cbc_iv,
+                                          &ssl->transform_in->md_ctx_dec, 0,
+                                          ssl->in_msg, cbc_head_len,
+                                          head_mac_len ) ) != 0 )
+                {
+                    MBEDTLS_SSL_DEBUG_RET( 1, "ssl_cbc_hmac", ret );
+                    mbedtls_md_hmac_reset( &ssl->transform_in->md_ctx_dec );
+                    return( ret );
+                }
+
+                mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec,
+                                        ssl->in_msg + head_mac_len,
+                                        ssl->in_msglen - head_mac_len );
+
+                MBEDTLS_SSL_DEBUG_BUF( 4, "raw buffer after decryption",
+                               ssl->in_msg, ssl->in_msglen +
+                                            ssl->transform_in->maclen );
+            }
+            else
+#endif /* SSL_CBC_STITCHED */
             mbedtls_md_hmac_update( &ssl->transform_in->md_ctx_dec, ssl->in_msg,
                              ssl->in_msglen );
             mbedtls_md_hmac_finish( &ssl->transform_in->md_ctx_dec, mac_expect );
@@ -2048,6 +2728,45 @@ static int ssl_decrypt_buf( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
     }
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID) || defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /*
+     * DTLSInnerPlaintext / TLSInnerPlaintext: the real content type is the
+     * last non-zero byte, followed by optional zero padding
+     */
+    if( ssl_in_has_inner_type( ssl ) )
+    {
+        while( ssl->in_msglen > 0 && ssl->in_msg[ssl->in_msglen - 1] == 0 )
+            ssl->in_msglen--;
+
+        if( ssl->in_msglen == 0 )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "no content type in record" ) );
+            return( MBEDTLS_ERR_SSL_INVALID_RECORD );
+        }
+
+        ssl->in_msgtype = ssl->in_msg[--ssl->in_msglen];
+
+        if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE &&
+            ssl->in_msgtype != MBEDTLS_SSL_MSG_ALERT &&
+            ssl->in_msgtype != MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC &&
+            ssl->in_msgtype != MBEDTLS_SSL_MSG_APPLICATION_DATA )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "unknown inner record type" ) );
+            return( MBEDTLS_ERR_SSL_INVALID_RECORD );
+        }
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        /* ChangeCipherSpec is only ever sent in the clear in TLS 1.3 */
+        if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 &&
+            ssl->in_msgtype == MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "protected ChangeCipherSpec" ) );
+            return( MBEDTLS_ERR_SSL_INVALID_RECORD );
+        }
+#endif
+    }
+#endif
+
     if( ssl->in_msglen == 0 )
     {
         ssl->nb_zero++;
@@ -2105,6 +2824,8 @@ static int ssl_compress_buf( mbedtls_ssl_context *ssl )
     unsigned char *msg_post = ssl->out_msg;
     size_t len_pre = ssl->out_msglen;
     unsigned char *msg_pre = ssl->compress_buf;
+    size_t len_max = mbedtls_ssl_out_buf_len( ssl ) -
+                     (size_t)( ssl->out_msg - ssl->out_buf );
 
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> compress buf" ) );
 
@@ -2122,7 +2843,7 @@ static int ssl_compress_buf( mbedtls_ssl_context *ssl )
     ssl->transform_out->ctx_deflate.next_in = msg_pre;
     ssl->transform_out->ctx_deflate.avail_in = len_pre;
     ssl->transform_out->ctx_deflate.next_out = msg_post;
-    ssl->transform_out->ctx_deflate.avail_out = MBEDTLS_SSL_BUFFER_LEN;
+    ssl->transform_out->ctx_deflate.avail_out = len_max;
 
     ret = deflate( &ssl->transform_out->ctx_deflate, Z_SYNC_FLUSH );
     if( ret != Z_OK )
@@ -2131,8 +2852,7 @@ static int ssl_compress_buf( mbedtls_ssl_context *ssl )
         return( MBEDTLS_ERR_SSL_COMPRESSION_FAILED );
     }
 
-    ssl->out_msglen = MBEDTLS_SSL_BUFFER_LEN -
-                      ssl->transform_out->ctx_deflate.avail_out;
+    ssl->out_msglen = len_max - ssl->transform_out->ctx_deflate.avail_out;
 
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "after compression: msglen = %d, ",
                    ssl->out_msglen ) );
@@ -2223,6 +2943,131 @@ static int ssl_resend_hello_request( mbedtls_ssl_context *ssl )
 #endif
 #endif /* MBEDTLS_SSL_SRV_C && MBEDTLS_SSL_RENEGOTIATION */
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+/*
+ * Reallocate a buffer, keeping as much of its contents as fits.
+ * On failure, the old buffer is left untouched.
+ */
+static int ssl_realloc_buffer( unsigned char **buf, size_t *buf_len,
+                               size_t new_len )
+{
+    unsigned char *new_buf;
+
+    if( ( new_buf = mbedtls_calloc( 1, new_len ) ) == NULL )
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+
+    memcpy( new_buf, *buf, *buf_len < new_len ? *buf_len : new_len );
+
+    mbedtls_zeroize( *buf, *buf_len );
+    mbedtls_free( *buf );
+
+    *buf = new_buf;
+    *buf_len = new_len;
+
+    return( 0 );
+}
+
+static int ssl_resize_in_buf( mbedtls_ssl_context *ssl, size_t len )
+{
+    int ret;
+    size_t ctr_off, hdr_off, len_off, iv_off, msg_off, offt_off;
+
+    if( ssl->in_buf_len == len )
+        return( 0 );
+
+    ctr_off = ssl->in_ctr - ssl->in_buf;
+    hdr_off = ssl->in_hdr - ssl->in_buf;
+    len_off = ssl->in_len - ssl->in_buf;
+    iv_off  = ssl->in_iv  - ssl->in_buf;
+    msg_off = ssl->in_msg - ssl->in_buf;
+    offt_off = ssl->in_offt == NULL ? 0 : ssl->in_offt - ssl->in_buf;
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "resizing input buffer: %d -> %d",
+                                ssl->in_buf_len, len ) );
+
+    if( ( ret = ssl_realloc_buffer( &ssl->in_buf, &ssl->in_buf_len,
+                                    len ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", len ) );
+        return( ret );
+    }
+
+    ssl->in_ctr = ssl->in_buf + ctr_off;
+    ssl->in_hdr = ssl->in_buf + hdr_off;
+    ssl->in_len = ssl->in_buf + len_off;
+    ssl->in_iv  = ssl->in_buf + iv_off;
+    ssl->in_msg = ssl->in_buf + msg_off;
+    if( ssl->in_offt != NULL )
+        ssl->in_offt = ssl->in_buf + offt_off;
+
+    return( 0 );
+}
+
+static int ssl_resize_out_buf( mbedtls_ssl_context *ssl, size_t len )
+{
+    int ret;
+    size_t ctr_off, hdr_off, len_off, iv_off, msg_off;
+
+    if( ssl->out_buf_len == len )
+        return( 0 );
+
+    ctr_off = ssl->out_ctr - ssl->out_buf;
+    hdr_off = ssl->out_hdr - ssl->out_buf;
+    len_off = ssl->out_len - ssl->out_buf;
+    iv_off  = ssl->out_iv  - ssl->out_buf;
+    msg_off = ssl->out_msg - ssl->out_buf;
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "resizing output buffer: %d -> %d",
+                                ssl->out_buf_len, len ) );
+
+    if( ( ret = ssl_realloc_buffer( &ssl->out_buf, &ssl->out_buf_len,
+                                    len ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed", len ) );
+        return( ret );
+    }
+
+    ssl->out_ctr = ssl->out_buf + ctr_off;
+    ssl->out_hdr = ssl->out_buf + hdr_off;
+    ssl->out_len = ssl->out_buf + len_off;
+    ssl->out_iv  = ssl->out_buf + iv_off;
+    ssl->out_msg = ssl->out_buf + msg_off;
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
+/*
+ * Discard the record we're done with (ssl->next_record_offset bytes) and
+ * move any data already read past it to the start of the record buffer.
+ */
+static int ssl_move_to_next_record( mbedtls_ssl_context *ssl )
+{
+    if( ssl->next_record_offset == 0 )
+        return( 0 );
+
+    if( ssl->in_left < ssl->next_record_offset )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
+        return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+    }
+
+    ssl->in_left -= ssl->next_record_offset;
+
+    if( ssl->in_left != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "next record already read, offset: %d",
+                                    ssl->next_record_offset ) );
+        memmove( ssl->in_hdr,
+                 ssl->in_hdr + ssl->next_record_offset,
+                 ssl->in_left );
+    }
+
+    ssl->next_record_offset = 0;
+
+    return( 0 );
+}
+
 /*
  * Fill the input message buffer by appending data to it.
  * The amount of data already fetched is in ssl->in_left.
@@ -2233,10 +3078,12 @@ static int ssl_resend_hello_request( mbedtls_ssl_context *ssl )
  *
  * With stream transport (TLS) on success ssl->in_left == nb_want, but
  * with datagram transport (DTLS) on success ssl->in_left >= nb_want,
- * since we always read a whole datagram at once.
+ * since we always read a whole datagram at once. The same holds for TLS
+ * with read-ahead enabled, where we read as much as fits in the buffer.
  *
- * For DTLS, it is up to the caller to set ssl->next_record_offset when
- * they're done reading a record.
+ * For DTLS and read-ahead, it is up to the caller to set
+ * ssl->next_record_offset when they're done reading a record, see
+ * mbedtls_ssl_in_buf_holds_next_record().
  */
 int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
 {
@@ -2281,27 +3128,8 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
         /*
          * Move to the next record in the already read datagram if applicable
          */
-        if( ssl->next_record_offset != 0 )
-        {
-            if( ssl->in_left < ssl->next_record_offset )
-            {
-                MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
-                return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
-            }
-
-            ssl->in_left -= ssl->next_record_offset;
-
-            if( ssl->in_left != 0 )
-            {
-                MBEDTLS_SSL_DEBUG_MSG( 2, ( "next record in same datagram, offset: %d",
-                                    ssl->next_record_offset ) );
-                memmove( ssl->in_hdr,
-                         ssl->in_hdr + ssl->next_record_offset,
-                         ssl->in_left );
-            }
-
-            ssl->next_record_offset = 0;
-        }
+        if( ( ret = ssl_move_to_next_record( ssl ) ) != 0 )
+            return( ret );
 
         MBEDTLS_SSL_DEBUG_MSG( 2, ( "in_left: %d, nb_want: %d",
                        ssl->in_left, nb_want ) );
@@ -2335,7 +3163,7 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
             ret = MBEDTLS_ERR_SSL_TIMEOUT;
         else
         {
-            len = MBEDTLS_SSL_BUFFER_LEN - ( ssl->in_hdr - ssl->in_buf );
+            len = mbedtls_ssl_in_buf_len( ssl ) - ( ssl->in_hdr - ssl->in_buf );
 
             if( ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER )
                 timeout = ssl->handshake->retransmit_timeout;
@@ -2400,12 +3228,31 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
     else
 #endif
     {
+        int read_ahead = mbedtls_ssl_in_buf_holds_next_record( ssl );
+
+        if( read_ahead && ( ret = ssl_move_to_next_record( ssl ) ) != 0 )
+            return( ret );
+
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+        /* Grow the buffer if the record doesn't fit */
+        if( nb_want > ssl->in_buf_len - (size_t)( ssl->in_hdr - ssl->in_buf ) &&
+            ( ret = ssl_resize_in_buf( ssl, MBEDTLS_SSL_BUFFER_LEN ) ) != 0 )
+        {
+            return( ret );
+        }
+#endif
+
         MBEDTLS_SSL_DEBUG_MSG( 2, ( "in_left: %d, nb_want: %d",
                        ssl->in_left, nb_want ) );
 
         while( ssl->in_left < nb_want )
         {
-            len = nb_want - ssl->in_left;
+            /* With read-ahead, ask for as much as fits in the buffer */
+            if( read_ahead )
+                len = mbedtls_ssl_in_buf_len( ssl )
+                      - (size_t)( ssl->in_hdr - ssl->in_buf ) - ssl->in_left;
+            else
+                len = nb_want - ssl->in_left;
 
             if( ssl_check_timer( ssl ) != 0 )
                 ret = MBEDTLS_ERR_SSL_TIMEOUT;
@@ -2443,6 +3290,49 @@ int mbedtls_ssl_fetch_input( mbedtls_ssl_context *ssl, size_t nb_want )
     return( 0 );
 }
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+/*
+ * Point out_ctr, out_len, out_iv and out_msg into the record starting at
+ * out_hdr, protected with the given transform
+ */
+static void ssl_update_out_pointers( mbedtls_ssl_context *ssl,
+                                     const mbedtls_ssl_transform *transform )
+{
+    ssl->out_ctr = ssl->out_hdr +  3;
+    ssl->out_len = ssl->out_hdr + 11;
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /* The connection ID of the peer goes before the length */
+    if( transform != NULL )
+        ssl->out_len += transform->out_cid_len;
+#endif
+    ssl->out_iv  = ssl->out_len +  2;
+
+    if( transform != NULL &&
+        ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_2 )
+    {
+        ssl->out_msg = ssl->out_iv + transform->ivlen - transform->fixed_ivlen;
+    }
+    else
+        ssl->out_msg = ssl->out_iv;
+}
+
+/*
+ * Move back to the start of the output buffer once a datagram is sent,
+ * carrying over the next record counter
+ */
+static void ssl_reset_out_pointers( mbedtls_ssl_context *ssl )
+{
+    unsigned char *ctr = ssl->out_ctr;
+
+    if( ssl->out_hdr == ssl->out_buf )
+        return;
+
+    ssl->out_hdr = ssl->out_buf;
+    ssl_update_out_pointers( ssl, ssl->transform_out );
+    memcpy( ssl->out_ctr, ctr, 8 );
+}
+#endif /* MBEDTLS_SSL_PROTO_DTLS */
+
 /*
  * Flush any data not yet written
  */
@@ -2470,9 +3360,15 @@ int mbedtls_ssl_flush_output( mbedtls_ssl_context *ssl )
     while( ssl->out_left > 0 )
     {
         MBEDTLS_SSL_DEBUG_MSG( 2, ( "message length: %d, out_left: %d",
-                       mbedtls_ssl_hdr_len( ssl ) + ssl->out_msglen, ssl->out_left ) );
+                       mbedtls_ssl_out_hdr_len( ssl ) + ssl->out_msglen, ssl->out_left ) );
 
-        buf = ssl->out_hdr + mbedtls_ssl_hdr_len( ssl ) +
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+        /* Datagrams are made of whole records, written before out_hdr */
+        if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+            buf = ssl->out_hdr - ssl->out_left;
+        else
+#endif
+        buf = ssl->out_hdr + mbedtls_ssl_out_hdr_len( ssl ) +
               ssl->out_msglen - ssl->out_left;
         ret = ssl->f_send( ssl->p_bio, buf, ssl->out_left );
 
@@ -2484,6 +3380,18 @@ int mbedtls_ssl_flush_output( mbedtls_ssl_context *ssl )
         ssl->out_left -= ret;
     }
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    /* The counter was incremented as each record was written */
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+    {
+        ssl_reset_out_pointers( ssl );
+
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= flush output" ) );
+
+        return( 0 );
+    }
+#endif
+
     for( i = 8; i > ssl_ep_len( ssl ); i-- )
         if( ++ssl->out_ctr[i - 1] != 0 )
             break;
@@ -2512,17 +3420,17 @@ static int ssl_flight_append( mbedtls_ssl_context *ssl )
     mbedtls_ssl_flight_item *msg;
 
     /* Allocate space for current message */
-    if( ( msg = mbedtls_calloc( 1, sizeof(  mbedtls_ssl_flight_item ) ) ) == NULL )
+    if( ( msg = mbedtls_ssl_hs_calloc( ssl, 1, sizeof(  mbedtls_ssl_flight_item ) ) ) == NULL )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc %d bytes failed",
                             sizeof( mbedtls_ssl_flight_item ) ) );
         return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
     }
 
-    if( ( msg->p = mbedtls_calloc( 1, ssl->out_msglen ) ) == NULL )
+    if( ( msg->p = mbedtls_ssl_hs_calloc( ssl, 1, ssl->out_msglen ) ) == NULL )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc %d bytes failed", ssl->out_msglen ) );
-        mbedtls_free( msg );
+        mbedtls_ssl_hs_free( ssl, msg );
         return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
     }
 
@@ -2549,7 +3457,8 @@ static int ssl_flight_append( mbedtls_ssl_context *ssl )
 /*
  * Free the current flight of handshake messages
  */
-static void ssl_flight_free( mbedtls_ssl_flight_item *flight )
+static void ssl_flight_free( mbedtls_ssl_context *ssl,
+                             mbedtls_ssl_flight_item *flight )
 {
     mbedtls_ssl_flight_item *cur = flight;
     mbedtls_ssl_flight_item *next;
@@ -2558,8 +3467,8 @@ static void ssl_flight_free( mbedtls_ssl_flight_item *flight )
     {
         next = cur->next;
 
-        mbedtls_free( cur->p );
-        mbedtls_free( cur );
+        mbedtls_ssl_hs_free( ssl, cur->p );
+        mbedtls_ssl_hs_free( ssl, cur );
 
         cur = next;
     }
@@ -2596,14 +3505,7 @@ static void ssl_swap_epochs( mbedtls_ssl_context *ssl )
     memcpy( ssl->handshake->alt_out_ctr, tmp_out_ctr,                 8 );
 
     /* Adjust to the newly activated transform */
-    if( ssl->transform_out != NULL &&
-        ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_2 )
-    {
-        ssl->out_msg = ssl->out_iv + ssl->transform_out->ivlen -
-                                     ssl->transform_out->fixed_ivlen;
-    }
-    else
-        ssl->out_msg = ssl->out_iv;
+    ssl_update_out_pointers( ssl, ssl->transform_out );
 
 #if defined(MBEDTLS_SSL_HW_RECORD_ACCEL)
     if( mbedtls_ssl_hw_record_activate != NULL )
@@ -2617,22 +3519,60 @@ static void ssl_swap_epochs( mbedtls_ssl_context *ssl )
 #endif
 }
 
+static int ssl_write_record( mbedtls_ssl_context *ssl, int force_flush );
+
 /*
- * Retransmit the current flight of messages.
+ * Room left for the payload of one more record in the current datagram
+ */
+static int ssl_get_remaining_payload_in_datagram( const mbedtls_ssl_context *ssl )
+{
+    size_t max_len = mbedtls_ssl_out_buf_len( ssl );
+    size_t expansion;
+    int ret;
+
+    if( ssl->mtu != 0 && ssl->mtu < max_len )
+        max_len = ssl->mtu;
+
+    /* With compression, assume the worst the buffer is sized for */
+    ret = mbedtls_ssl_get_record_expansion( ssl );
+    if( ret == MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE )
+        expansion = MBEDTLS_SSL_BUFFER_LEN - MBEDTLS_SSL_MAX_CONTENT_LEN;
+    else if( ret < 0 )
+        return( ret );
+    else
+        expansion = (size_t) ret;
+
+    if( max_len <= ssl->out_left + expansion )
+        return( 0 );
+
+    max_len -= ssl->out_left + expansion;
+    if( max_len > MBEDTLS_SSL_MAX_CONTENT_LEN )
+        max_len = MBEDTLS_SSL_MAX_CONTENT_LEN;
+
+    return( (int) max_len );
+}
+
+/*
+ * Transmit the current flight of messages, or what is left of it.
  *
- * Need to remember the current message in case flush_output returns
- * WANT_WRITE, causing us to exit this function and come back later.
+ * As many records as fit the MTU are packed into each datagram, and
+ * handshake messages that don't fit a datagram of their own are fragmented.
+ * Need to remember the current message and fragment in case flush_output
+ * returns WANT_WRITE, causing us to exit this function and come back later.
  * This function must be called until state is no longer SENDING.
  */
-int mbedtls_ssl_resend( mbedtls_ssl_context *ssl )
+int mbedtls_ssl_flight_transmit( mbedtls_ssl_context *ssl )
 {
-    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> mbedtls_ssl_resend" ) );
+    int ret;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> mbedtls_ssl_flight_transmit" ) );
 
     if( ssl->handshake->retransmit_state != MBEDTLS_SSL_RETRANS_SENDING )
     {
-        MBEDTLS_SSL_DEBUG_MSG( 2, ( "initialise resending" ) );
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "initialise flight transmission" ) );
 
         ssl->handshake->cur_msg = ssl->handshake->flight;
+        ssl->handshake->cur_frag_off = 0;
         ssl_swap_epochs( ssl );
 
         ssl->handshake->retransmit_state = MBEDTLS_SSL_RETRANS_SENDING;
@@ -2640,33 +3580,113 @@ int mbedtls_ssl_resend( mbedtls_ssl_context *ssl )
 
     while( ssl->handshake->cur_msg != NULL )
     {
-        int ret;
+        size_t max_frag_len, min_len, frag_len, hs_len;
         mbedtls_ssl_flight_item *cur = ssl->handshake->cur_msg;
+        const int is_finished = ( cur->type == MBEDTLS_SSL_MSG_HANDSHAKE &&
+                                  cur->p[0] == MBEDTLS_SSL_HS_FINISHED );
+        int force_flush = 0;
 
         /* Swap epochs before sending Finished: we can't do it after
          * sending ChangeCipherSpec, in case write returns WANT_READ.
          * Must be done before copying, may change out_msg pointer */
-        if( cur->type == MBEDTLS_SSL_MSG_HANDSHAKE &&
-            cur->p[0] == MBEDTLS_SSL_HS_FINISHED )
-        {
+        if( is_finished && ssl->handshake->cur_frag_off == 0 )
             ssl_swap_epochs( ssl );
+
+        if( ( ret = ssl_get_remaining_payload_in_datagram( ssl ) ) < 0 )
+            return( ret );
+        max_frag_len = (size_t) ret;
+
+        /* ChangeCipherSpec can't be fragmented, and each handshake
+         * fragment carries the 12-byte header and some of the body */
+        if( cur->type == MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC )
+            min_len = cur->len;
+        else
+            min_len = ( cur->len > 12 ) ? 13 : 12;
+
+        if( max_frag_len < min_len )
+        {
+            if( ssl->out_left == 0 )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "MTU too small for a record: %d",
+                                            ssl->mtu ) );
+                return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+            }
+
+            /* Start a new datagram, with the same epoch for Finished */
+            if( is_finished && ssl->handshake->cur_frag_off == 0 )
+                ssl_swap_epochs( ssl );
+
+            if( ( ret = mbedtls_ssl_flush_output( ssl ) ) != 0 )
+                return( ret );
+
+            continue;
+        }
+
+        if( cur->type == MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC )
+        {
+            memcpy( ssl->out_msg, cur->p, cur->len );
+            ssl->out_msglen = cur->len;
+            ssl->handshake->cur_frag_off = cur->len;
+        }
+        else
+        {
+            hs_len = cur->len - 12;
+            frag_len = hs_len - ssl->handshake->cur_frag_off;
+            if( frag_len > max_frag_len - 12 )
+                frag_len = max_frag_len - 12;
+
+            if( ssl->handshake->cur_frag_off == 0 && frag_len != hs_len )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 2, ( "fragmenting handshake message "
+                                            "(%u > %u)", (unsigned) hs_len,
+                                            (unsigned) frag_len ) );
+            }
+
+            /* Type, length and message_seq stay, fragment fields change */
+            memcpy( ssl->out_msg, cur->p, 6 );
+
+            ssl->out_msg[ 6] = (unsigned char)( ssl->handshake->cur_frag_off >> 16 );
+            ssl->out_msg[ 7] = (unsigned char)( ssl->handshake->cur_frag_off >>  8 );
+            ssl->out_msg[ 8] = (unsigned char)( ssl->handshake->cur_frag_off       );
+
+            ssl->out_msg[ 9] = (unsigned char)( frag_len >> 16 );
+            ssl->out_msg[10] = (unsigned char)( frag_len >>  8 );
+            ssl->out_msg[11] = (unsigned char)( frag_len       );
+
+            memcpy( ssl->out_msg + 12,
+                    cur->p + 12 + ssl->handshake->cur_frag_off, frag_len );
+
+            ssl->out_msglen = frag_len + 12;
+            ssl->handshake->cur_frag_off += frag_len;
+
+            MBEDTLS_SSL_DEBUG_BUF( 3, "handshake fragment header",
+                                   ssl->out_msg, 12 );
         }
 
-        memcpy( ssl->out_msg, cur->p, cur->len );
-        ssl->out_msglen = cur->len;
         ssl->out_msgtype = cur->type;
 
-        ssl->handshake->cur_msg = cur->next;
+        /* Move on once the whole message is out */
+        if( ssl->handshake->cur_frag_off + ( cur->type ==
+                MBEDTLS_SSL_MSG_HANDSHAKE ? 12 : 0 ) >= cur->len )
+        {
+            ssl->handshake->cur_msg = cur->next;
+            ssl->handshake->cur_frag_off = 0;
+            force_flush = ( cur->next == NULL );
+        }
 
-        MBEDTLS_SSL_DEBUG_BUF( 3, "resent handshake message header", ssl->out_msg, 12 );
+        if( ssl->disable_datagram_packing != 0 )
+            force_flush = 1;
 
-        if( ( ret = mbedtls_ssl_write_record( ssl ) ) != 0 )
+        if( ( ret = ssl_write_record( ssl, force_flush ) ) != 0 )
         {
-            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_write_record", ret );
+            MBEDTLS_SSL_DEBUG_RET( 1, "ssl_write_record", ret );
             return( ret );
         }
     }
 
+    if( ( ret = mbedtls_ssl_flush_output( ssl ) ) != 0 )
+        return( ret );
+
     if( ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER )
         ssl->handshake->retransmit_state = MBEDTLS_SSL_RETRANS_FINISHED;
     else
@@ -2675,18 +3695,34 @@ int mbedtls_ssl_resend( mbedtls_ssl_context *ssl )
         ssl_set_timer( ssl, ssl->handshake->retransmit_timeout );
     }
 
-    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= mbedtls_ssl_resend" ) );
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= mbedtls_ssl_flight_transmit" ) );
 
     return( 0 );
 }
 
+/*
+ * Retransmit the current flight of messages.
+ */
+int mbedtls_ssl_resend( mbedtls_ssl_context *ssl )
+{
+    int ret;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> mbedtls_ssl_resend" ) );
+
+    ret = mbedtls_ssl_flight_transmit( ssl );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= mbedtls_ssl_resend" ) );
+
+    return( ret );
+}
+
 /*
  * To be called when the last message of an incoming flight is received.
  */
 void mbedtls_ssl_recv_flight_completed( mbedtls_ssl_context *ssl )
 {
     /* We won't need to resend that one any more */
-    ssl_flight_free( ssl->handshake->flight );
+    ssl_flight_free( ssl, ssl->handshake->flight );
     ssl->handshake->flight = NULL;
     ssl->handshake->cur_msg = NULL;
 
@@ -2730,8 +3766,13 @@ void mbedtls_ssl_send_flight_completed( mbedtls_ssl_context *ssl )
 /*
  * Write current record.
  * Uses ssl->out_msgtype, ssl->out_msglen and bytes at ssl->out_msg.
+ *
+ * In DTLS, handshake and ChangeCipherSpec messages are only added to the
+ * current flight here, for mbedtls_ssl_flight_transmit() to send them once
+ * the flight is complete; and a record written with force_flush == 0 stays
+ * in the output buffer so that the next ones can join it in the datagram.
  */
-int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
+static int ssl_write_record( mbedtls_ssl_context *ssl, int force_flush )
 {
     int ret, done = 0, out_msg_type;
     size_t len = ssl->out_msglen;
@@ -2751,7 +3792,11 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
     {
         out_msg_type = ssl->out_msg[0];
 
+        /* HelloRequest and TLS 1.3 KeyUpdate are sent outside handshakes */
         if( out_msg_type != MBEDTLS_SSL_HS_HELLO_REQUEST &&
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            out_msg_type != MBEDTLS_SSL_HS_KEY_UPDATE &&
+#endif
             ssl->handshake == NULL )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
@@ -2805,8 +3850,11 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
         }
 #endif /* MBEDTLS_SSL_PROTO_DTLS */
 
-        if( out_msg_type != MBEDTLS_SSL_HS_HELLO_REQUEST )
+        if( out_msg_type != MBEDTLS_SSL_HS_HELLO_REQUEST &&
+            ssl->handshake != NULL )
+        {
             ssl->handshake->update_checksum( ssl, ssl->out_msg, len );
+        }
     }
 
     /* Save handshake and CCS messages for resending */
@@ -2822,6 +3870,14 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
             MBEDTLS_SSL_DEBUG_RET( 1, "ssl_flight_append", ret );
             return( ret );
         }
+
+        /* Sent with the rest of the flight */
+        if( ssl->out_msgtype == MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC ||
+            ssl->out_msg[0] != MBEDTLS_SSL_HS_HELLO_REQUEST )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write record (queued)" ) );
+            return( 0 );
+        }
     }
 #endif
 
@@ -2861,6 +3917,26 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
         mbedtls_ssl_write_version( ssl->major_ver, ssl->minor_ver,
                            ssl->conf->transport, ssl->out_hdr + 1 );
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        /* The real type is then protected along with the content */
+        if( ssl->transform_out != NULL &&
+            ssl->transform_out->out_cid_len != 0 )
+        {
+            ssl->out_hdr[0] = MBEDTLS_SSL_MSG_CID;
+            memcpy( ssl->out_hdr + 11, ssl->transform_out->out_cid,
+                    ssl->transform_out->out_cid_len );
+        }
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        /* Likewise, protected TLS 1.3 records all look like application data */
+        if( ssl->transform_out != NULL &&
+            ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        {
+            ssl->out_hdr[0] = MBEDTLS_SSL_MSG_APPLICATION_DATA;
+        }
+#endif
+
         ssl->out_len[0] = (unsigned char)( len >> 8 );
         ssl->out_len[1] = (unsigned char)( len      );
 
@@ -2877,7 +3953,7 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
             ssl->out_len[1] = (unsigned char)( len      );
         }
 
-        ssl->out_left = mbedtls_ssl_hdr_len( ssl ) + ssl->out_msglen;
+        len = mbedtls_ssl_out_hdr_len( ssl ) + ssl->out_msglen;
 
         MBEDTLS_SSL_DEBUG_MSG( 3, ( "output record: msgtype = %d, "
                             "version = [%d:%d], msglen = %d",
@@ -2885,10 +3961,37 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
                      ( ssl->out_len[0] << 8 ) | ssl->out_len[1] ) );
 
         MBEDTLS_SSL_DEBUG_BUF( 4, "output record sent to network",
-                       ssl->out_hdr, mbedtls_ssl_hdr_len( ssl ) + ssl->out_msglen );
+                       ssl->out_hdr, len );
+
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+        /* Leave the record where it is and start the next one after it */
+        if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+        {
+            unsigned char i;
+
+            ssl->out_left += len;
+            ssl->out_hdr  += len;
+            ssl_update_out_pointers( ssl, ssl->transform_out );
+            memcpy( ssl->out_ctr, ssl->out_ctr - len, 8 );
+
+            for( i = 8; i > ssl_ep_len( ssl ); i-- )
+                if( ++ssl->out_ctr[i - 1] != 0 )
+                    break;
+
+            /* The loop goes to its end iff the counter is wrapping */
+            if( i == ssl_ep_len( ssl ) )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "outgoing message counter would wrap" ) );
+                return( MBEDTLS_ERR_SSL_COUNTER_WRAPPING );
+            }
+        }
+        else
+#endif
+        ssl->out_left = len;
     }
 
-    if( ( ret = mbedtls_ssl_flush_output( ssl ) ) != 0 )
+    if( force_flush != 0 &&
+        ( ret = mbedtls_ssl_flush_output( ssl ) ) != 0 )
     {
         MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_flush_output", ret );
         return( ret );
@@ -2899,6 +4002,11 @@ int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
     return( 0 );
 }
 
+int mbedtls_ssl_write_record( mbedtls_ssl_context *ssl )
+{
+    return( ssl_write_record( ssl, 1 ) );
+}
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
 /*
  * Mark bits in bitmask (used for DTLS HS reassembly)
@@ -3000,7 +4108,7 @@ static int ssl_reassemble_dtls_handshake( mbedtls_ssl_context *ssl )
         /* The bitmask needs one bit per byte of message excluding header */
         alloc_len = 12 + msg_len + msg_len / 8 + ( msg_len % 8 != 0 );
 
-        ssl->handshake->hs_msg = mbedtls_calloc( 1, alloc_len );
+        ssl->handshake->hs_msg = mbedtls_ssl_hs_calloc( ssl, 1, alloc_len );
         if( ssl->handshake->hs_msg == NULL )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc failed (%d bytes)", alloc_len ) );
@@ -3095,7 +4203,7 @@ static int ssl_reassemble_dtls_handshake( mbedtls_ssl_context *ssl )
         ssl->next_record_offset = new_remain - ssl->in_hdr;
         ssl->in_left = ssl->next_record_offset + remain_len;
 
-        if( ssl->in_left > MBEDTLS_SSL_BUFFER_LEN -
+        if( ssl->in_left > mbedtls_ssl_in_buf_len( ssl ) -
                            (size_t)( ssl->in_hdr - ssl->in_buf ) )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "reassembled message too large for buffer" ) );
@@ -3107,7 +4215,7 @@ static int ssl_reassemble_dtls_handshake( mbedtls_ssl_context *ssl )
 
     memcpy( ssl->in_msg, ssl->handshake->hs_msg, ssl->in_hslen );
 
-    mbedtls_free( ssl->handshake->hs_msg );
+    mbedtls_ssl_hs_free( ssl, ssl->handshake->hs_msg );
     ssl->handshake->hs_msg = NULL;
 
     MBEDTLS_SSL_DEBUG_BUF( 3, "reassembled handshake message",
@@ -3518,11 +4626,51 @@ static int ssl_handle_possible_reconnect( mbedtls_ssl_context *ssl )
  * Point 2 is needed when the peer is resending, and we have already received
  * the first record from a datagram but are still waiting for the others.
  */
+/*
+ * TLS 1.3 peers may send a dummy ChangeCipherSpec in the clear at any time
+ * during the handshake (RFC 8446 D.4), even once records are protected
+ */
+static inline int ssl_is_tls13_ccs( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    return( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 &&
+            ssl->in_msgtype == MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC );
+#else
+    ((void) ssl);
+    return( 0 );
+#endif
+}
+
 static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
 {
     int major_ver, minor_ver;
 
-    MBEDTLS_SSL_DEBUG_BUF( 4, "input record header", ssl->in_hdr, mbedtls_ssl_hdr_len( ssl ) );
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /*
+     * In records with a connection ID, ours sits before the length field:
+     * place in_len, in_iv and in_msg for the current record
+     */
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+    {
+        size_t cid_len = 0;
+        size_t msg_off = (size_t) ( ssl->in_msg - ssl->in_iv );
+
+        if( ssl->in_hdr[0] == MBEDTLS_SSL_MSG_CID )
+            cid_len = ssl->own_cid_len;
+
+        if( ssl->in_left < 13 + cid_len )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "record header truncated" ) );
+            return( MBEDTLS_ERR_SSL_INVALID_RECORD );
+        }
+
+        ssl->in_len = ssl->in_hdr + 11 + cid_len;
+        ssl->in_iv  = ssl->in_len + 2;
+        ssl->in_msg = ssl->in_iv + msg_off;
+    }
+#endif
+
+    MBEDTLS_SSL_DEBUG_BUF( 4, "input record header", ssl->in_hdr, mbedtls_ssl_in_hdr_len( ssl ) );
 
     ssl->in_msgtype =  ssl->in_hdr[0];
     ssl->in_msglen = ( ssl->in_len[0] << 8 ) | ssl->in_len[1];
@@ -3537,7 +4685,12 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
     if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE &&
         ssl->in_msgtype != MBEDTLS_SSL_MSG_ALERT &&
         ssl->in_msgtype != MBEDTLS_SSL_MSG_CHANGE_CIPHER_SPEC &&
-        ssl->in_msgtype != MBEDTLS_SSL_MSG_APPLICATION_DATA )
+        ssl->in_msgtype != MBEDTLS_SSL_MSG_APPLICATION_DATA
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        && ! ( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+               ssl->in_msgtype == MBEDTLS_SSL_MSG_CID )
+#endif
+        )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "unknown record type" ) );
 
@@ -3574,7 +4727,17 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
     }
 
     /* Check length against bounds of the current transform and version */
-    if( ssl->transform_in == NULL )
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    /* Unless the record is from another epoch and is dropped below anyway:
+     * failing here would drop the rest of its datagram with it */
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        ( ( ssl->in_ctr[0] << 8 ) | ssl->in_ctr[1] ) != ssl->in_epoch )
+    {
+        ;
+    }
+    else
+#endif
+    if( ssl->transform_in == NULL || ssl_is_tls13_ccs( ssl ) )
     {
         if( ssl->in_msglen < 1 ||
             ssl->in_msglen > MBEDTLS_SSL_MAX_CONTENT_LEN )
@@ -3678,6 +4841,20 @@ static int ssl_parse_record_header( mbedtls_ssl_context *ssl )
                 return( MBEDTLS_ERR_SSL_UNEXPECTED_RECORD );
         }
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        /* Once we asked for a connection ID, records must carry it */
+        if( ssl->transform_in != NULL && ssl->transform_in->in_cid_len != 0 ?
+            ( ssl->in_msgtype != MBEDTLS_SSL_MSG_CID ||
+              ssl->transform_in->in_cid_len != ssl->own_cid_len ||
+              memcmp( ssl->in_hdr + 11, ssl->transform_in->in_cid,
+                      ssl->own_cid_len ) != 0 ) :
+            ssl->in_msgtype == MBEDTLS_SSL_MSG_CID )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "unexpected connection ID" ) );
+            return( MBEDTLS_ERR_SSL_UNEXPECTED_RECORD );
+        }
+#endif
+
 #if defined(MBEDTLS_SSL_DTLS_ANTI_REPLAY)
         /* Replay detection only works for the current epoch */
         if( rec_epoch == ssl->in_epoch &&
@@ -3701,7 +4878,7 @@ static int ssl_prepare_record_content( mbedtls_ssl_context *ssl )
     int ret, done = 0;
 
     MBEDTLS_SSL_DEBUG_BUF( 4, "input record from network",
-                   ssl->in_hdr, mbedtls_ssl_hdr_len( ssl ) + ssl->in_msglen );
+                   ssl->in_hdr, mbedtls_ssl_in_hdr_len( ssl ) + ssl->in_msglen );
 
 #if defined(MBEDTLS_SSL_HW_RECORD_ACCEL)
     if( mbedtls_ssl_hw_record_read != NULL )
@@ -3719,7 +4896,7 @@ static int ssl_prepare_record_content( mbedtls_ssl_context *ssl )
             done = 1;
     }
 #endif /* MBEDTLS_SSL_HW_RECORD_ACCEL */
-    if( !done && ssl->transform_in != NULL )
+    if( !done && ssl->transform_in != NULL && ! ssl_is_tls13_ccs( ssl ) )
     {
         if( ( ret = ssl_decrypt_buf( ssl ) ) != 0 )
         {
@@ -3940,7 +5117,7 @@ read_record_header:
             {
                 /* Skip unexpected record (but not whole datagram) */
                 ssl->next_record_offset = ssl->in_msglen
-                                        + mbedtls_ssl_hdr_len( ssl );
+                                        + mbedtls_ssl_in_hdr_len( ssl );
 
                 MBEDTLS_SSL_DEBUG_MSG( 1, ( "discarding unexpected record "
                                             "(header)" ) );
@@ -3966,18 +5143,16 @@ read_record_header:
      * Read and optionally decrypt the message contents
      */
     if( ( ret = mbedtls_ssl_fetch_input( ssl,
-                                 mbedtls_ssl_hdr_len( ssl ) + ssl->in_msglen ) ) != 0 )
+                                 mbedtls_ssl_in_hdr_len( ssl ) + ssl->in_msglen ) ) != 0 )
     {
         MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_fetch_input", ret );
         return( ret );
     }
 
     /* Done reading this record, get ready for the next one */
-#if defined(MBEDTLS_SSL_PROTO_DTLS)
-    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
-        ssl->next_record_offset = ssl->in_msglen + mbedtls_ssl_hdr_len( ssl );
+    if( mbedtls_ssl_in_buf_holds_next_record( ssl ) )
+        ssl->next_record_offset = ssl->in_msglen + mbedtls_ssl_in_hdr_len( ssl );
     else
-#endif
         ssl->in_left = 0;
 
     if( ( ret = ssl_prepare_record_content( ssl ) ) != 0 )
@@ -4097,9 +5272,27 @@ int mbedtls_ssl_handle_message_type( mbedtls_ssl_context *ssl )
     {
         if( ( ret = mbedtls_ssl_prepare_handshake_record( ssl ) ) != 0 )
         {
-            return( ret );
+            return( ret );
+        }
+    }
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl_is_tls13_ccs( ssl ) )
+    {
+        if( ssl->state == MBEDTLS_SSL_HANDSHAKE_OVER ||
+            ssl->in_msglen != 1 || ssl->in_msg[0] != 1 )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad change cipher spec message" ) );
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+            return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
         }
+
+        /* Middlebox compatibility only, fetch new message */
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "ignoring dummy change cipher spec" ) );
+        return( MBEDTLS_ERR_SSL_NON_FATAL );
     }
+#endif
 
     if( ssl->in_msgtype == MBEDTLS_SSL_MSG_ALERT )
     {
@@ -4178,6 +5371,33 @@ int mbedtls_ssl_send_alert_message( mbedtls_ssl_context *ssl,
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> send alert message" ) );
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "send alert level=%u message=%u", level, message ));
 
+#if defined(MBEDTLS_SSL_KTLS)
+    if( ( ssl->ktls & MBEDTLS_SSL_KTLS_TX ) != 0 )
+    {
+        unsigned char alert[2];
+
+        alert[0] = level;
+        alert[1] = message;
+
+        if( ( ret = ssl->f_ktls_send_record( ssl->p_bio, MBEDTLS_SSL_MSG_ALERT,
+                                             alert, sizeof( alert ) ) ) < 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "f_ktls_send_record", ret );
+            return( ret );
+        }
+
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= send alert message" ) );
+        return( 0 );
+    }
+#endif
+
+    /* Send what is pending first rather than writing over it */
+    if( ssl->out_left != 0 &&
+        ( ret = mbedtls_ssl_flush_output( ssl ) ) != 0 )
+    {
+        return( ret );
+    }
+
     ssl->out_msgtype = MBEDTLS_SSL_MSG_ALERT;
     ssl->out_msglen = 2;
     ssl->out_msg[0] = level;
@@ -4250,7 +5470,7 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
 int mbedtls_ssl_write_certificate( mbedtls_ssl_context *ssl )
 {
     int ret = MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
-    size_t i, n;
+    size_t i, n, list_off, ext_len = 0;
     const mbedtls_x509_crt *crt;
     const mbedtls_ssl_ciphersuite_t *ciphersuite_info = ssl->transform_negotiate->ciphersuite_info;
 
@@ -4316,14 +5536,25 @@ int mbedtls_ssl_write_certificate( mbedtls_ssl_context *ssl )
      *    10  . n-1   peer certificate
      *     n  . n+2   length of cert. 2
      *    n+3 . ...   upper level cert, etc.
+     *
+     * TLS 1.3 adds an (always empty here) certificate_request_context
+     * before the list, and (empty) extensions after each certificate.
      */
-    i = 7;
+    list_off = 4;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+    {
+        ssl->out_msg[list_off++] = 0;
+        ext_len = 2;
+    }
+#endif
+    i = list_off + 3;
     crt = mbedtls_ssl_own_cert( ssl );
 
     while( crt != NULL )
     {
         n = crt->raw.len;
-        if( n > MBEDTLS_SSL_MAX_CONTENT_LEN - 3 - i )
+        if( n > MBEDTLS_SSL_MAX_CONTENT_LEN - 3 - ext_len - i )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "certificate too large, %d > %d",
                            i + 3 + n, MBEDTLS_SSL_MAX_CONTENT_LEN ) );
@@ -4336,11 +5567,14 @@ int mbedtls_ssl_write_certificate( mbedtls_ssl_context *ssl )
 
         i += 3; memcpy( ssl->out_msg + i, crt->raw.p, n );
         i += n; crt = crt->next;
+
+        memset( ssl->out_msg + i, 0, ext_len );
+        i += ext_len;
     }
 
-    ssl->out_msg[4]  = (unsigned char)( ( i - 7 ) >> 16 );
-    ssl->out_msg[5]  = (unsigned char)( ( i - 7 ) >>  8 );
-    ssl->out_msg[6]  = (unsigned char)( ( i - 7 )       );
+    ssl->out_msg[list_off    ] = (unsigned char)( ( i - list_off - 3 ) >> 16 );
+    ssl->out_msg[list_off + 1] = (unsigned char)( ( i - list_off - 3 ) >>  8 );
+    ssl->out_msg[list_off + 2] = (unsigned char)( ( i - list_off - 3 )       );
 
     ssl->out_msglen  = i;
     ssl->out_msgtype = MBEDTLS_SSL_MSG_HANDSHAKE;
@@ -4363,6 +5597,25 @@ write_msg:
     return( ret );
 }
 
+#if defined(MBEDTLS_SSL_PEER_CHAIN_IN_PLACE)
+/*
+ * Whether the intermediate certificates of the peer must outlive its
+ * Certificate message: the issuer of a stapled OCSP response is looked up
+ * among them, and CertificateStatus overwrites in_msg. They are then copied,
+ * and freed once the response has been checked.
+ */
+static int ssl_peer_chain_kept( const mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_OCSP_STAPLING) && defined(MBEDTLS_SSL_CLI_C)
+    return( ssl->conf->endpoint == MBEDTLS_SSL_IS_CLIENT &&
+            ssl->handshake->ocsp_status != 0 );
+#else
+    ((void) ssl);
+    return( 0 );
+#endif
+}
+#endif /* MBEDTLS_SSL_PEER_CHAIN_IN_PLACE */
+
 int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
 {
     int ret = MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE;
@@ -4468,6 +5721,29 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
     }
 #endif /* MBEDTLS_SSL_PROTO_TLS1 || MBEDTLS_SSL_PROTO_TLS1_1 || \
           MBEDTLS_SSL_PROTO_TLS1_2 */
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->conf->endpoint  == MBEDTLS_SSL_IS_SERVER &&
+        ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+    {
+        /* Empty request context and empty certificate_list */
+        if( ssl->in_hslen   == 4 + mbedtls_ssl_hs_hdr_len( ssl ) &&
+            ssl->in_msgtype == MBEDTLS_SSL_MSG_HANDSHAKE    &&
+            ssl->in_msg[0]  == MBEDTLS_SSL_HS_CERTIFICATE   &&
+            memcmp( ssl->in_msg + mbedtls_ssl_hs_hdr_len( ssl ), "\0\0\0\0", 4 ) == 0 )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "TLSv1.3 client has no certificate" ) );
+
+            ssl->session_negotiate->verify_result = MBEDTLS_X509_BADCERT_MISSING;
+            if( authmode == MBEDTLS_SSL_VERIFY_OPTIONAL )
+                return( 0 );
+
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_CERT_REQUIRED );
+            return( MBEDTLS_ERR_SSL_NO_CLIENT_CERTIFICATE );
+        }
+    }
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
 #endif /* MBEDTLS_SSL_SRV_C */
 
     if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE )
@@ -4489,13 +5765,28 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
 
     i = mbedtls_ssl_hs_hdr_len( ssl );
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* We never send a certificate_request_context, so expect it empty */
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+    {
+        if( ssl->in_msg[i] != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate message" ) );
+            mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                            MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+            return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE );
+        }
+        i++;
+    }
+#endif
+
     /*
      * Same message structure as in mbedtls_ssl_write_certificate()
      */
     n = ( ssl->in_msg[i+1] << 8 ) | ssl->in_msg[i+2];
 
     if( ssl->in_msg[i] != 0 ||
-        ssl->in_hslen != n + 3 + mbedtls_ssl_hs_hdr_len( ssl ) )
+        ssl->in_hslen != n + 3 + i )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate message" ) );
         mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
@@ -4546,6 +5837,15 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
             return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE );
         }
 
+#if defined(MBEDTLS_SSL_PEER_CHAIN_IN_PLACE)
+        /* Only the peer's own certificate outlives this message */
+        if( ssl->session_negotiate->peer_cert->version != 0 &&
+            ! ssl_peer_chain_kept( ssl ) )
+            ret = mbedtls_x509_crt_parse_der_nocopy(
+                                  ssl->session_negotiate->peer_cert,
+                                  ssl->in_msg + i, n );
+        else
+#endif
         ret = mbedtls_x509_crt_parse_der( ssl->session_negotiate->peer_cert,
                                   ssl->in_msg + i, n );
         switch( ret )
@@ -4573,6 +5873,24 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
         }
 
         i += n;
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        /* Skip the per-certificate extensions, we request none */
+        if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        {
+            if( i + 2 > ssl->in_hslen ||
+                i + 2 + ( ( ssl->in_msg[i] << 8 ) | ssl->in_msg[i + 1] ) >
+                ssl->in_hslen )
+            {
+                MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate message" ) );
+                mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                                MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+                return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE );
+            }
+
+            i += 2 + ( ( ssl->in_msg[i] << 8 ) | ssl->in_msg[i + 1] );
+        }
+#endif
     }
 
     MBEDTLS_SSL_DEBUG_CRT( 3, "peer certificate", ssl->session_negotiate->peer_cert );
@@ -4628,6 +5946,16 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
         /*
          * Main check: verify certificate
          */
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+        ret = mbedtls_x509_crt_verify_with_cache(
+                                ssl->conf->verify_cache,
+                                ssl->session_negotiate->peer_cert,
+                                ca_chain, ca_crl,
+                                ssl->conf->cert_profile,
+                                ssl->hostname,
+                               &ssl->session_negotiate->verify_result,
+                                ssl->conf->f_vrfy, ssl->conf->p_vrfy );
+#else
         ret = mbedtls_x509_crt_verify_with_profile(
                                 ssl->session_negotiate->peer_cert,
                                 ca_chain, ca_crl,
@@ -4635,6 +5963,7 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
                                 ssl->hostname,
                                &ssl->session_negotiate->verify_result,
                                 ssl->conf->f_vrfy, ssl->conf->p_vrfy );
+#endif /* MBEDTLS_X509_VERIFY_CACHE_C */
 
         if( ret != 0 )
         {
@@ -4735,6 +6064,17 @@ int mbedtls_ssl_parse_certificate( mbedtls_ssl_context *ssl )
 #endif /* MBEDTLS_DEBUG_C */
     }
 
+#if defined(MBEDTLS_SSL_PEER_CHAIN_IN_PLACE)
+    /* The rest of the chain points into in_msg, which is about to change */
+    if( ssl->session_negotiate->peer_cert->next != NULL &&
+        ! ssl_peer_chain_kept( ssl ) )
+    {
+        mbedtls_x509_crt_free( ssl->session_negotiate->peer_cert->next );
+        mbedtls_free( ssl->session_negotiate->peer_cert->next );
+        ssl->session_negotiate->peer_cert->next = NULL;
+    }
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse certificate" ) );
 
     return( ret );
@@ -4857,33 +6197,198 @@ int mbedtls_ssl_parse_change_cipher_spec( mbedtls_ssl_context *ssl )
     return( 0 );
 }
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_2)
+/*
+ * Transcript digest needed by the PRF (and by our own CertificateVerify)
+ */
+static int ssl_prf_checksum( const mbedtls_ssl_ciphersuite_t *ciphersuite_info )
+{
+    if( ciphersuite_info->mac == MBEDTLS_MD_SHA384 )
+        return( MBEDTLS_SSL_CHECKSUM_SHA384 );
+
+    return( MBEDTLS_SSL_CHECKSUM_SHA256 );
+}
+
+#if defined(MBEDTLS_SSL_SRV_C) && \
+    defined(MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED)
+/*
+ * Transcript digests a server may need to check the client's
+ * CertificateVerify: those we can offer in CertificateRequest,
+ * see mbedtls_ssl_set_calc_verify_md()
+ */
+static int ssl_verify_checksums( const mbedtls_ssl_config *conf )
+{
+    const int *md;
+    int checksums = 0;
+
+    if( conf->endpoint != MBEDTLS_SSL_IS_SERVER )
+        return( 0 );
+
+    for( md = conf->sig_hashes; *md != MBEDTLS_MD_NONE; md++ )
+    {
+        switch( *md )
+        {
+#if defined(MBEDTLS_SSL_PROTO_TLS1) || defined(MBEDTLS_SSL_PROTO_TLS1_1)
+            case MBEDTLS_MD_SHA1:
+                checksums |= MBEDTLS_SSL_CHECKSUM_MD5SHA1;
+                break;
+#endif
+            case MBEDTLS_MD_SHA256:
+                checksums |= MBEDTLS_SSL_CHECKSUM_SHA256;
+                break;
+
+            case MBEDTLS_MD_SHA384:
+                checksums |= MBEDTLS_SSL_CHECKSUM_SHA384;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return( checksums );
+}
+#endif /* MBEDTLS_SSL_SRV_C && MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED */
+#endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
+
+/*
+ * Transcript digests that may be needed by a handshake with this
+ * configuration, before the version and ciphersuite are known.
+ */
+static int ssl_candidate_checksums( const mbedtls_ssl_config *conf )
+{
+    int checksums = 0;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_2)
+    const int *suite;
+    const mbedtls_ssl_ciphersuite_t *ciphersuite_info;
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1) || \
+    defined(MBEDTLS_SSL_PROTO_TLS1_1)
+    if( conf->min_minor_ver < MBEDTLS_SSL_MINOR_VERSION_3 )
+        checksums |= MBEDTLS_SSL_CHECKSUM_MD5SHA1;
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_2)
+    if( conf->max_minor_ver < MBEDTLS_SSL_MINOR_VERSION_3 )
+        return( checksums );
+
+    for( suite = conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_3];
+         *suite != 0; suite++ )
+    {
+        ciphersuite_info = mbedtls_ssl_ciphersuite_from_id( *suite );
+        if( ciphersuite_info != NULL )
+            checksums |= ssl_prf_checksum( ciphersuite_info );
+    }
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( conf->max_minor_ver >= MBEDTLS_SSL_MINOR_VERSION_4 )
+    {
+        for( suite = conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_4];
+             *suite != 0; suite++ )
+        {
+            ciphersuite_info = mbedtls_ssl_ciphersuite_from_id( *suite );
+            if( ciphersuite_info != NULL )
+                checksums |= ssl_prf_checksum( ciphersuite_info );
+        }
+    }
+#endif
+
+#if defined(MBEDTLS_SSL_SRV_C) && \
+    defined(MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED)
+    checksums |= ssl_verify_checksums( conf );
+#endif
+#endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
+
+    return( checksums );
+}
+
+/*
+ * Once the version and ciphersuite are known, narrow the transcript down to
+ * the digest used by the PRF. A server that may still receive a client
+ * CertificateVerify also keeps the digests it offers for it, until that
+ * message has been processed.
+ */
 void mbedtls_ssl_optimize_checksum( mbedtls_ssl_context *ssl,
                             const mbedtls_ssl_ciphersuite_t *ciphersuite_info )
 {
+    int checksums;
+
     ((void) ciphersuite_info);
 
 #if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1) || \
     defined(MBEDTLS_SSL_PROTO_TLS1_1)
     if( ssl->minor_ver < MBEDTLS_SSL_MINOR_VERSION_3 )
+        checksums = MBEDTLS_SSL_CHECKSUM_MD5SHA1;
+    else
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_2)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_3 )
+    {
+        checksums = ssl_prf_checksum( ciphersuite_info );
+
+#if defined(MBEDTLS_SSL_SRV_C) && \
+    defined(MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED)
+        if( ssl->conf->endpoint == MBEDTLS_SSL_IS_SERVER &&
+            ssl->state <= MBEDTLS_SSL_CERTIFICATE_VERIFY &&
+            mbedtls_ssl_ciphersuite_cert_req_allowed( ciphersuite_info ) )
+        {
+            int authmode = ssl->conf->authmode;
+
+#if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
+            if( ssl->handshake->sni_authmode != MBEDTLS_SSL_VERIFY_UNSET )
+                authmode = ssl->handshake->sni_authmode;
+#endif
+
+            if( authmode != MBEDTLS_SSL_VERIFY_NONE )
+                checksums |= ssl_verify_checksums( ssl->conf );
+        }
+#endif /* MBEDTLS_SSL_SRV_C && MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED */
+    }
+    else
+#endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* The key schedule and both CertificateVerify use the suite's hash */
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        checksums = ssl_prf_checksum( ciphersuite_info );
+    else
+#endif
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
+        return;
+    }
+
+    /* Never resurrect a digest that has not followed the whole transcript */
+    checksums &= ssl->handshake->checksums;
+    if( checksums == 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
+        return;
+    }
+
+    ssl->handshake->checksums = checksums;
+
+#if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1) || \
+    defined(MBEDTLS_SSL_PROTO_TLS1_1)
+    if( checksums == MBEDTLS_SSL_CHECKSUM_MD5SHA1 )
         ssl->handshake->update_checksum = ssl_update_checksum_md5sha1;
     else
 #endif
 #if defined(MBEDTLS_SSL_PROTO_TLS1_2)
 #if defined(MBEDTLS_SHA512_C)
-    if( ciphersuite_info->mac == MBEDTLS_MD_SHA384 )
+    if( checksums == MBEDTLS_SSL_CHECKSUM_SHA384 )
         ssl->handshake->update_checksum = ssl_update_checksum_sha384;
     else
 #endif
 #if defined(MBEDTLS_SHA256_C)
-    if( ciphersuite_info->mac != MBEDTLS_MD_SHA384 )
+    if( checksums == MBEDTLS_SSL_CHECKSUM_SHA256 )
         ssl->handshake->update_checksum = ssl_update_checksum_sha256;
     else
 #endif
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
-    {
-        MBEDTLS_SSL_DEBUG_MSG( 1, ( "should never happen" ) );
-        return;
-    }
+        ssl->handshake->update_checksum = ssl_update_checksum_start;
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "handshake checksums: 0x%02x", checksums ) );
 }
 
 void mbedtls_ssl_reset_checksum( mbedtls_ssl_context *ssl )
@@ -4903,20 +6408,32 @@ void mbedtls_ssl_reset_checksum( mbedtls_ssl_context *ssl )
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
 }
 
+/*
+ * Feed the live subset of the checksum contexts
+ */
 static void ssl_update_checksum_start( mbedtls_ssl_context *ssl,
                                        const unsigned char *buf, size_t len )
 {
+    const int checksums = ssl->handshake->checksums;
+
+    ((void) checksums);
+
 #if defined(MBEDTLS_SSL_PROTO_SSL3) || defined(MBEDTLS_SSL_PROTO_TLS1) || \
     defined(MBEDTLS_SSL_PROTO_TLS1_1)
-     mbedtls_md5_update_ret( &ssl->handshake->fin_md5 , buf, len );
-    mbedtls_sha1_update_ret( &ssl->handshake->fin_sha1, buf, len );
+    if( checksums & MBEDTLS_SSL_CHECKSUM_MD5SHA1 )
+    {
+         mbedtls_md5_update_ret( &ssl->handshake->fin_md5 , buf, len );
+        mbedtls_sha1_update_ret( &ssl->handshake->fin_sha1, buf, len );
+    }
 #endif
 #if defined(MBEDTLS_SSL_PROTO_TLS1_2)
 #if defined(MBEDTLS_SHA256_C)
-    mbedtls_sha256_update_ret( &ssl->handshake->fin_sha256, buf, len );
+    if( checksums & MBEDTLS_SSL_CHECKSUM_SHA256 )
+        mbedtls_sha256_update_ret( &ssl->handshake->fin_sha256, buf, len );
 #endif
 #if defined(MBEDTLS_SHA512_C)
-    mbedtls_sha512_update_ret( &ssl->handshake->fin_sha512, buf, len );
+    if( checksums & MBEDTLS_SSL_CHECKSUM_SHA384 )
+        mbedtls_sha512_update_ret( &ssl->handshake->fin_sha512, buf, len );
 #endif
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
 }
@@ -5193,6 +6710,133 @@ static void ssl_calc_finished_tls_sha384(
 #endif /* MBEDTLS_SHA512_C */
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
 
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+/*
+ * Handshake arena
+ *
+ * The handshake parameters come first in the block, followed by the items
+ * they own, handed out in order by bumping hs_arena_used. Freeing an item
+ * only gives its memory back if nothing was handed out after it (e.g. a
+ * reassembly buffer released right after use); the rest is reclaimed in
+ * one go when the handshake ends.
+ *
+ * hs_arena_need counts what the handshake asked for, in or out of the
+ * arena, so that the peak can be used to size the arena.
+ */
+#define SSL_HS_ARENA_ALIGN      ( 2 * sizeof( void * ) )
+#define SSL_HS_ARENA_ROUND( n ) \
+    ( ( (n) + SSL_HS_ARENA_ALIGN - 1 ) & ~( SSL_HS_ARENA_ALIGN - 1 ) )
+#define SSL_HS_ARENA_BASE       \
+    SSL_HS_ARENA_ROUND( sizeof( mbedtls_ssl_handshake_params ) )
+
+void *mbedtls_ssl_hs_calloc( mbedtls_ssl_context *ssl, size_t n, size_t size )
+{
+    unsigned char *p;
+    size_t len;
+
+    if( n == 0 || size == 0 ||
+        n > ( (size_t) -1 - SSL_HS_ARENA_ALIGN ) / size )
+    {
+        return( mbedtls_calloc( n, size ) );
+    }
+
+    len = SSL_HS_ARENA_ROUND( n * size );
+
+    ssl->hs_arena_need += len;
+    if( ssl->hs_arena_need > ssl->hs_arena_peak )
+        ssl->hs_arena_peak = ssl->hs_arena_need;
+
+    if( ssl->hs_arena == NULL ||
+        len > ssl->hs_arena_len - ssl->hs_arena_used )
+    {
+        return( mbedtls_calloc( n, size ) );
+    }
+
+    p = ssl->hs_arena + ssl->hs_arena_used;
+    memset( p, 0, n * size );
+
+    ssl->hs_arena_last = ssl->hs_arena_used;
+    ssl->hs_arena_used += len;
+
+    return( p );
+}
+
+void mbedtls_ssl_hs_free( mbedtls_ssl_context *ssl, void *p )
+{
+    unsigned char *q = p;
+
+    if( ssl->hs_arena == NULL ||
+        q < ssl->hs_arena || q >= ssl->hs_arena + ssl->hs_arena_len )
+    {
+        mbedtls_free( p );
+        return;
+    }
+
+    if( q == ssl->hs_arena + ssl->hs_arena_last )
+        ssl->hs_arena_used = ssl->hs_arena_last;
+}
+#endif /* MBEDTLS_SSL_HANDSHAKE_ARENA */
+
+/*
+ * Allocate the handshake parameters, at the start of a new arena if one is
+ * configured and large enough to hold them
+ */
+static mbedtls_ssl_handshake_params *ssl_handshake_params_alloc(
+                                                mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    ssl->hs_arena_need = SSL_HS_ARENA_BASE;
+    if( ssl->hs_arena_need > ssl->hs_arena_peak )
+        ssl->hs_arena_peak = ssl->hs_arena_need;
+
+    if( ssl->conf->hs_arena_len >= SSL_HS_ARENA_BASE &&
+        ( ssl->hs_arena = mbedtls_calloc( 1, ssl->conf->hs_arena_len ) ) != NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "handshake arena of %u bytes",
+                                    (unsigned) ssl->conf->hs_arena_len ) );
+
+        ssl->hs_arena_len = ssl->conf->hs_arena_len;
+        ssl->hs_arena_used = SSL_HS_ARENA_BASE;
+        ssl->hs_arena_last = SSL_HS_ARENA_BASE;
+
+        return( (mbedtls_ssl_handshake_params *) ssl->hs_arena );
+    }
+#else
+    ((void) ssl);
+#endif
+
+    return( mbedtls_calloc( 1, sizeof( mbedtls_ssl_handshake_params ) ) );
+}
+
+/*
+ * Release the memory of the handshake parameters, and of the arena holding
+ * them if any. The parameters must have been freed with
+ * mbedtls_ssl_handshake_free() first, unless they were never initialized.
+ */
+static void ssl_handshake_params_free( mbedtls_ssl_context *ssl )
+{
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    if( ssl->hs_arena != NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "releasing handshake arena of %u bytes "
+                                    "(peak need %u bytes)",
+                                    (unsigned) ssl->hs_arena_len,
+                                    (unsigned) ssl->hs_arena_peak ) );
+
+        mbedtls_free( ssl->hs_arena );
+        ssl->hs_arena = NULL;
+        ssl->hs_arena_len = 0;
+        ssl->hs_arena_used = 0;
+        ssl->hs_arena_last = 0;
+        ssl->handshake = NULL;
+        return;
+    }
+#endif
+
+    mbedtls_free( ssl->handshake );
+    ssl->handshake = NULL;
+}
+
 static void ssl_handshake_wrapup_free_hs_transform( mbedtls_ssl_context *ssl )
 {
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "=> handshake wrapup: final free" ) );
@@ -5200,9 +6844,8 @@ static void ssl_handshake_wrapup_free_hs_transform( mbedtls_ssl_context *ssl )
     /*
      * Free our handshake params
      */
-    mbedtls_ssl_handshake_free( ssl->handshake );
-    mbedtls_free( ssl->handshake );
-    ssl->handshake = NULL;
+    mbedtls_ssl_handshake_free( ssl );
+    ssl_handshake_params_free( ssl );
 
     /*
      * Free the previous transform and swith in the current one
@@ -5277,6 +6920,11 @@ void mbedtls_ssl_handshake_wrapup( mbedtls_ssl_context *ssl )
 
     ssl->state++;
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    /* Best effort: keep the large buffers if the connection isn't idle */
+    (void) mbedtls_ssl_shrink_buffers( ssl );
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 3, ( "<= handshake wrapup" ) );
 }
 
@@ -5289,6 +6937,11 @@ int mbedtls_ssl_write_finished( mbedtls_ssl_context *ssl )
     /*
      * Set the out_msg pointer to the correct location based on IV length
      */
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+        ssl_update_out_pointers( ssl, ssl->transform_negotiate );
+    else
+#endif
     if( ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_2 )
     {
         ssl->out_msg = ssl->out_iv + ssl->transform_negotiate->ivlen -
@@ -5393,6 +7046,15 @@ int mbedtls_ssl_write_finished( mbedtls_ssl_context *ssl )
         return( ret );
     }
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        ( ret = mbedtls_ssl_flight_transmit( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_flight_transmit", ret );
+        return( ret );
+    }
+#endif
+
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write finished" ) );
 
     return( 0 );
@@ -5531,7 +7193,7 @@ static void ssl_handshake_params_init( mbedtls_ssl_handshake_params *handshake )
 #endif
 }
 
-static void ssl_transform_init( mbedtls_ssl_transform *transform )
+void mbedtls_ssl_transform_init( mbedtls_ssl_transform *transform )
 {
     memset( transform, 0, sizeof(mbedtls_ssl_transform) );
 
@@ -5549,13 +7211,24 @@ void mbedtls_ssl_session_init( mbedtls_ssl_session *session )
 
 static int ssl_handshake_init( mbedtls_ssl_context *ssl )
 {
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    int ret;
+
+    /* Handshake messages are written in place, use full-size buffers */
+    if( ( ret = ssl_resize_in_buf( ssl, MBEDTLS_SSL_BUFFER_LEN ) ) != 0 ||
+        ( ret = ssl_resize_out_buf( ssl, MBEDTLS_SSL_BUFFER_LEN ) ) != 0 )
+    {
+        return( ret );
+    }
+#endif
+
     /* Clear old handshake information if present */
     if( ssl->transform_negotiate )
         mbedtls_ssl_transform_free( ssl->transform_negotiate );
     if( ssl->session_negotiate )
         mbedtls_ssl_session_free( ssl->session_negotiate );
     if( ssl->handshake )
-        mbedtls_ssl_handshake_free( ssl->handshake );
+        mbedtls_ssl_handshake_free( ssl );
 
     /*
      * Either the pointers are now NULL or cleared properly and can be freed.
@@ -5573,7 +7246,7 @@ static int ssl_handshake_init( mbedtls_ssl_context *ssl )
 
     if( ssl->handshake == NULL )
     {
-        ssl->handshake = mbedtls_calloc( 1, sizeof(mbedtls_ssl_handshake_params) );
+        ssl->handshake = ssl_handshake_params_alloc( ssl );
     }
 
     /* All pointers should exist and can be directly freed without issue */
@@ -5583,11 +7256,10 @@ static int ssl_handshake_init( mbedtls_ssl_context *ssl )
     {
         MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc() of ssl sub-contexts failed" ) );
 
-        mbedtls_free( ssl->handshake );
+        ssl_handshake_params_free( ssl );
         mbedtls_free( ssl->transform_negotiate );
         mbedtls_free( ssl->session_negotiate );
 
-        ssl->handshake = NULL;
         ssl->transform_negotiate = NULL;
         ssl->session_negotiate = NULL;
 
@@ -5596,8 +7268,9 @@ static int ssl_handshake_init( mbedtls_ssl_context *ssl )
 
     /* Initialize structures */
     mbedtls_ssl_session_init( ssl->session_negotiate );
-    ssl_transform_init( ssl->transform_negotiate );
+    mbedtls_ssl_transform_init( ssl->transform_negotiate );
     ssl_handshake_params_init( ssl->handshake );
+    ssl->handshake->checksums = ssl_candidate_checksums( ssl->conf );
 
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
@@ -5676,6 +7349,11 @@ int mbedtls_ssl_setup( mbedtls_ssl_context *ssl,
         return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
     }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    ssl->in_buf_len = len;
+    ssl->out_buf_len = len;
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
     {
@@ -5741,13 +7419,18 @@ static int ssl_session_reset_int( mbedtls_ssl_context *ssl, int partial )
 
     ssl->in_offt = NULL;
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /* Records with a connection ID may have moved these */
+    ssl->in_len = ssl->in_buf + 11;
+    ssl->in_iv  = ssl->in_buf + 13;
+#endif
     ssl->in_msg = ssl->in_buf + 13;
     ssl->in_msgtype = 0;
     ssl->in_msglen = 0;
     if( partial == 0 )
         ssl->in_left = 0;
-#if defined(MBEDTLS_SSL_PROTO_DTLS)
     ssl->next_record_offset = 0;
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
     ssl->in_epoch = 0;
 #endif
 #if defined(MBEDTLS_SSL_DTLS_ANTI_REPLAY)
@@ -5759,6 +7442,14 @@ static int ssl_session_reset_int( mbedtls_ssl_context *ssl, int partial )
 
     ssl->keep_current_message = 0;
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+    {
+        ssl->out_hdr = ssl->out_buf;
+        ssl_update_out_pointers( ssl, NULL );
+    }
+    else
+#endif
     ssl->out_msg = ssl->out_buf + 13;
     ssl->out_msgtype = 0;
     ssl->out_msglen = 0;
@@ -5768,12 +7459,30 @@ static int ssl_session_reset_int( mbedtls_ssl_context *ssl, int partial )
         ssl->split_done = 0;
 #endif
 
+#if defined(MBEDTLS_SSL_SEND_FILE)
+    ssl->send_file_done = 0;
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    ssl->key_update_pending = 0;
+#endif
+
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    ssl->drs_bytes_sent = 0;
+#endif
+
+#if defined(MBEDTLS_SSL_KTLS)
+    ssl->ktls = 0;
+    ssl->f_ktls_send_record = NULL;
+    ssl->f_ktls_recv = NULL;
+#endif
+
     ssl->transform_in = NULL;
     ssl->transform_out = NULL;
 
-    memset( ssl->out_buf, 0, MBEDTLS_SSL_BUFFER_LEN );
+    memset( ssl->out_buf, 0, mbedtls_ssl_out_buf_len( ssl ) );
     if( partial == 0 )
-        memset( ssl->in_buf, 0, MBEDTLS_SSL_BUFFER_LEN );
+        memset( ssl->in_buf, 0, mbedtls_ssl_in_buf_len( ssl ) );
 
 #if defined(MBEDTLS_SSL_HW_RECORD_ACCEL)
     if( mbedtls_ssl_hw_record_reset != NULL )
@@ -5856,6 +7565,18 @@ void mbedtls_ssl_conf_dtls_badmac_limit( mbedtls_ssl_config *conf, unsigned limi
 }
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+int mbedtls_ssl_conf_cid( mbedtls_ssl_config *conf, size_t len )
+{
+    if( len > MBEDTLS_SSL_CID_IN_LEN_MAX )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    conf->cid_len = len;
+
+    return( 0 );
+}
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
 void mbedtls_ssl_conf_handshake_timeout( mbedtls_ssl_config *conf, uint32_t min, uint32_t max )
 {
@@ -5907,6 +7628,102 @@ void mbedtls_ssl_set_bio( mbedtls_ssl_context *ssl,
     ssl->f_recv_timeout = f_recv_timeout;
 }
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+void mbedtls_ssl_set_mtu( mbedtls_ssl_context *ssl, uint16_t mtu )
+{
+    ssl->mtu = mtu;
+}
+
+void mbedtls_ssl_set_datagram_packing( mbedtls_ssl_context *ssl,
+                                       unsigned allow_packing )
+{
+    ssl->disable_datagram_packing = !allow_packing;
+}
+#endif /* MBEDTLS_SSL_PROTO_DTLS */
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+int mbedtls_ssl_set_cid( mbedtls_ssl_context *ssl, int enable,
+                         const unsigned char *own_cid, size_t own_cid_len )
+{
+    if( ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    if( enable == MBEDTLS_SSL_CID_DISABLED )
+    {
+        ssl->negotiate_cid = MBEDTLS_SSL_CID_DISABLED;
+        ssl->own_cid_len = 0;
+        return( 0 );
+    }
+
+    if( own_cid_len != ssl->conf->cid_len ||
+        ( own_cid == NULL && own_cid_len != 0 ) )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    ssl->negotiate_cid = MBEDTLS_SSL_CID_ENABLED;
+    if( own_cid_len != 0 )
+        memcpy( ssl->own_cid, own_cid, own_cid_len );
+    ssl->own_cid_len = (uint8_t) own_cid_len;
+
+    return( 0 );
+}
+
+int mbedtls_ssl_get_peer_cid( const mbedtls_ssl_context *ssl, int *enabled,
+                              unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX],
+                              size_t *peer_cid_len )
+{
+    /* The previous transform may be kept until the last flight is
+     * acknowledged, while transform_in is already the new one */
+    if( ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_DATAGRAM ||
+        ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER ||
+        ssl->transform_in == NULL )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    if( ssl->transform_in->in_cid_len == 0 &&
+        ssl->transform_in->out_cid_len == 0 )
+    {
+        *enabled = MBEDTLS_SSL_CID_DISABLED;
+        return( 0 );
+    }
+
+    *enabled = MBEDTLS_SSL_CID_ENABLED;
+
+    if( peer_cid != NULL )
+        memcpy( peer_cid, ssl->transform_in->out_cid,
+                ssl->transform_in->out_cid_len );
+    if( peer_cid_len != NULL )
+        *peer_cid_len = ssl->transform_in->out_cid_len;
+
+    return( 0 );
+}
+
+/*
+ * A record with a connection ID starts with:
+ *   type (1) = tls12_cid, version (2), epoch + sequence number (8), cid, ...
+ */
+int mbedtls_ssl_get_datagram_cid( void *p_conf,
+                                  const unsigned char *buf, size_t len,
+                                  unsigned char *cid, size_t *cid_len )
+{
+    const mbedtls_ssl_config *conf = (const mbedtls_ssl_config *) p_conf;
+
+    if( conf->cid_len == 0 ||
+        len < 13 + conf->cid_len ||
+        buf[0] != MBEDTLS_SSL_MSG_CID )
+    {
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_RECORD );
+    }
+
+    memcpy( cid, buf + 11, conf->cid_len );
+    *cid_len = conf->cid_len;
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 void mbedtls_ssl_conf_read_timeout( mbedtls_ssl_config *conf, uint32_t timeout )
 {
     conf->read_timeout   = timeout;
@@ -5959,13 +7776,34 @@ int mbedtls_ssl_set_session( mbedtls_ssl_context *ssl, const mbedtls_ssl_session
 }
 #endif /* MBEDTLS_SSL_CLI_C */
 
+/*
+ * Index a list of ciphersuites as a bitset for constant-time membership tests
+ */
+static void ssl_ciphersuite_set_init( uint32_t set[MBEDTLS_SSL_CIPHERSUITE_SLOTS / 32],
+                                      const int *ciphersuites )
+{
+    int slot;
+
+    memset( set, 0, MBEDTLS_SSL_CIPHERSUITE_SLOTS / 8 );
+
+    for( ; *ciphersuites != 0; ciphersuites++ )
+    {
+        if( ( slot = mbedtls_ssl_ciphersuite_slot( *ciphersuites ) ) >= 0 )
+            set[slot >> 5] |= (uint32_t) 1 << ( slot & 31 );
+    }
+}
+
 void mbedtls_ssl_conf_ciphersuites( mbedtls_ssl_config *conf,
                                    const int *ciphersuites )
 {
-    conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_0] = ciphersuites;
-    conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_1] = ciphersuites;
-    conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_2] = ciphersuites;
-    conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_3] = ciphersuites;
+    int minor;
+
+    for( minor = MBEDTLS_SSL_MINOR_VERSION_0;
+         minor <= MBEDTLS_SSL_MINOR_VERSION_4; minor++ )
+    {
+        conf->ciphersuite_list[minor] = ciphersuites;
+        ssl_ciphersuite_set_init( conf->ciphersuite_set[minor], ciphersuites );
+    }
 }
 
 void mbedtls_ssl_conf_ciphersuites_for_version( mbedtls_ssl_config *conf,
@@ -5975,10 +7813,11 @@ void mbedtls_ssl_conf_ciphersuites_for_version( mbedtls_ssl_config *conf,
     if( major != MBEDTLS_SSL_MAJOR_VERSION_3 )
         return;
 
-    if( minor < MBEDTLS_SSL_MINOR_VERSION_0 || minor > MBEDTLS_SSL_MINOR_VERSION_3 )
+    if( minor < MBEDTLS_SSL_MINOR_VERSION_0 || minor > MBEDTLS_SSL_MINOR_VERSION_4 )
         return;
 
     conf->ciphersuite_list[minor] = ciphersuites;
+    ssl_ciphersuite_set_init( conf->ciphersuite_set[minor], ciphersuites );
 }
 
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
@@ -5988,14 +7827,12 @@ void mbedtls_ssl_conf_cert_profile( mbedtls_ssl_config *conf,
     conf->cert_profile = profile;
 }
 
-/* Append a new keycert entry to a (possibly empty) list */
+/* Append a new (freshly allocated) keycert entry to a (possibly empty) list */
 static int ssl_append_key_cert( mbedtls_ssl_key_cert **head,
+                                mbedtls_ssl_key_cert *new,
                                 mbedtls_x509_crt *cert,
                                 mbedtls_pk_context *key )
 {
-    mbedtls_ssl_key_cert *new;
-
-    new = mbedtls_calloc( 1, sizeof( mbedtls_ssl_key_cert ) );
     if( new == NULL )
         return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
 
@@ -6023,7 +7860,9 @@ int mbedtls_ssl_conf_own_cert( mbedtls_ssl_config *conf,
                               mbedtls_x509_crt *own_cert,
                               mbedtls_pk_context *pk_key )
 {
-    return( ssl_append_key_cert( &conf->key_cert, own_cert, pk_key ) );
+    return( ssl_append_key_cert( &conf->key_cert,
+                mbedtls_calloc( 1, sizeof( mbedtls_ssl_key_cert ) ),
+                own_cert, pk_key ) );
 }
 
 void mbedtls_ssl_conf_ca_chain( mbedtls_ssl_config *conf,
@@ -6033,6 +7872,14 @@ void mbedtls_ssl_conf_ca_chain( mbedtls_ssl_config *conf,
     conf->ca_chain   = ca_chain;
     conf->ca_crl     = ca_crl;
 }
+
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+void mbedtls_ssl_conf_verify_cache( mbedtls_ssl_config *conf,
+                                    mbedtls_x509_verify_cache *cache )
+{
+    conf->verify_cache = cache;
+}
+#endif
 #endif /* MBEDTLS_X509_CRT_PARSE_C */
 
 #if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
@@ -6041,7 +7888,8 @@ int mbedtls_ssl_set_hs_own_cert( mbedtls_ssl_context *ssl,
                                  mbedtls_pk_context *pk_key )
 {
     return( ssl_append_key_cert( &ssl->handshake->sni_key_cert,
-                                 own_cert, pk_key ) );
+                mbedtls_ssl_hs_calloc( ssl, 1, sizeof( mbedtls_ssl_key_cert ) ),
+                own_cert, pk_key ) );
 }
 
 void mbedtls_ssl_set_hs_ca_chain( mbedtls_ssl_context *ssl,
@@ -6149,11 +7997,11 @@ int mbedtls_ssl_set_hs_psk( mbedtls_ssl_context *ssl,
     if( ssl->handshake->psk != NULL )
     {
         mbedtls_zeroize( ssl->handshake->psk, ssl->handshake->psk_len );
-        mbedtls_free( ssl->handshake->psk );
+        mbedtls_ssl_hs_free( ssl, ssl->handshake->psk );
         ssl->handshake->psk_len = 0;
     }
 
-    if( ( ssl->handshake->psk = mbedtls_calloc( 1, psk_len ) ) == NULL )
+    if( ( ssl->handshake->psk = mbedtls_ssl_hs_calloc( ssl, 1, psk_len ) ) == NULL )
         return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
 
     ssl->handshake->psk_len = psk_len;
@@ -6242,7 +8090,16 @@ void mbedtls_ssl_conf_dhm_min_bitlen( mbedtls_ssl_config *conf,
 void mbedtls_ssl_conf_sig_hashes( mbedtls_ssl_config *conf,
                                   const int *hashes )
 {
+    const int *md;
+
     conf->sig_hashes = hashes;
+
+    conf->sig_hash_set = 0;
+    for( md = hashes; *md != MBEDTLS_MD_NONE; md++ )
+    {
+        if( *md > 0 && *md < 32 )
+            conf->sig_hash_set |= (uint32_t) 1 << *md;
+    }
 }
 #endif /* MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED */
 
@@ -6253,7 +8110,16 @@ void mbedtls_ssl_conf_sig_hashes( mbedtls_ssl_config *conf,
 void mbedtls_ssl_conf_curves( mbedtls_ssl_config *conf,
                              const mbedtls_ecp_group_id *curve_list )
 {
+    const mbedtls_ecp_group_id *gid;
+
     conf->curve_list = curve_list;
+
+    conf->curve_set = 0;
+    for( gid = curve_list; *gid != MBEDTLS_ECP_DP_NONE; gid++ )
+    {
+        if( *gid < 32 )
+            conf->curve_set |= (uint32_t) 1 << *gid;
+    }
 }
 #endif /* MBEDTLS_ECP_C */
 
@@ -6423,6 +8289,35 @@ void mbedtls_ssl_conf_cbc_record_splitting( mbedtls_ssl_config *conf, char split
 }
 #endif
 
+void mbedtls_ssl_conf_read_ahead( mbedtls_ssl_config *conf, int read_ahead )
+{
+    conf->read_ahead = read_ahead;
+}
+
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+void mbedtls_ssl_conf_dynamic_record_sizing( mbedtls_ssl_config *conf,
+                                             size_t small_len,
+                                             size_t ramp_bytes,
+                                             uint32_t idle_timeout )
+{
+    conf->drs_small_len    = small_len;
+    conf->drs_ramp_bytes   = ramp_bytes;
+    conf->drs_idle_timeout = idle_timeout;
+}
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+void mbedtls_ssl_conf_handshake_arena( mbedtls_ssl_config *conf, size_t len )
+{
+    conf->hs_arena_len = len;
+}
+
+size_t mbedtls_ssl_get_handshake_arena_peak( const mbedtls_ssl_context *ssl )
+{
+    return( ssl->hs_arena_peak );
+}
+#endif
+
 void mbedtls_ssl_conf_legacy_renegotiation( mbedtls_ssl_config *conf, int allow_legacy )
 {
     conf->allow_legacy_renegotiation = allow_legacy;
@@ -6439,51 +8334,254 @@ void mbedtls_ssl_conf_renegotiation_enforced( mbedtls_ssl_config *conf, int max_
     conf->renego_max_records = max_records;
 }
 
-void mbedtls_ssl_conf_renegotiation_period( mbedtls_ssl_config *conf,
-                                   const unsigned char period[8] )
+void mbedtls_ssl_conf_renegotiation_period( mbedtls_ssl_config *conf,
+                                   const unsigned char period[8] )
+{
+    memcpy( conf->renego_period, period, 8 );
+}
+#endif /* MBEDTLS_SSL_RENEGOTIATION */
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+#if defined(MBEDTLS_SSL_CLI_C)
+void mbedtls_ssl_conf_session_tickets( mbedtls_ssl_config *conf, int use_tickets )
+{
+    conf->session_tickets = use_tickets;
+}
+#endif
+
+#if defined(MBEDTLS_SSL_SRV_C)
+void mbedtls_ssl_conf_session_tickets_cb( mbedtls_ssl_config *conf,
+        mbedtls_ssl_ticket_write_t *f_ticket_write,
+        mbedtls_ssl_ticket_parse_t *f_ticket_parse,
+        void *p_ticket )
+{
+    conf->f_ticket_write = f_ticket_write;
+    conf->f_ticket_parse = f_ticket_parse;
+    conf->p_ticket       = p_ticket;
+}
+#endif
+#endif /* MBEDTLS_SSL_SESSION_TICKETS */
+
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+#if defined(MBEDTLS_SSL_CLI_C)
+void mbedtls_ssl_conf_ocsp_stapling( mbedtls_ssl_config *conf, int stapling )
+{
+    conf->ocsp_stapling = stapling;
+}
+#endif
+
+#if defined(MBEDTLS_SSL_SRV_C)
+void mbedtls_ssl_conf_ocsp_stapling_cb( mbedtls_ssl_config *conf,
+                                        mbedtls_ssl_ocsp_get_t *f_ocsp,
+                                        void *p_ocsp )
+{
+    conf->f_ocsp = f_ocsp;
+    conf->p_ocsp = p_ocsp;
+}
+#endif
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
+
+#if defined(MBEDTLS_SSL_EXPORT_KEYS)
+void mbedtls_ssl_conf_export_keys_cb( mbedtls_ssl_config *conf,
+        mbedtls_ssl_export_keys_t *f_export_keys,
+        void *p_export_keys )
+{
+    conf->f_export_keys = f_export_keys;
+    conf->p_export_keys = p_export_keys;
+}
+#endif
+
+/*
+ * SSL get accessors
+ */
+size_t mbedtls_ssl_get_bytes_avail( const mbedtls_ssl_context *ssl )
+{
+    return( ssl->in_offt == NULL ? 0 : ssl->in_msglen );
+}
+
+int mbedtls_ssl_check_pending( const mbedtls_ssl_context *ssl )
+{
+    /* Application data left over from the current record? */
+    if( ssl->in_offt != NULL && ssl->in_msglen > 0 )
+        return( 1 );
+
+    /* Records read (datagram or read-ahead) but not yet processed? */
+    if( ssl->next_record_offset != 0 &&
+        ssl->in_left > ssl->next_record_offset )
+        return( 1 );
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_SSL_KTLS)
+int mbedtls_ssl_get_ktls_info( const mbedtls_ssl_context *ssl, int direction,
+                               mbedtls_ssl_ktls_info *info )
+{
+    const mbedtls_ssl_transform *transform;
+    const mbedtls_cipher_info_t *cipher_info;
+
+    if( ssl == NULL || ssl->conf == NULL || info == NULL ||
+        ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER || ssl->handshake != NULL ||
+        ( ssl->ktls & direction ) != 0 )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    if( ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_STREAM ||
+        ssl->minor_ver != MBEDTLS_SSL_MINOR_VERSION_3 )
+    {
+        return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
+    }
+
+    if( direction == MBEDTLS_SSL_KTLS_TX )
+    {
+        /* Everything written so far must have reached the transport */
+        if( ssl->out_left != 0 )
+            return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+        transform = ssl->transform_out;
+    }
+    else if( direction == MBEDTLS_SSL_KTLS_RX )
+    {
+        /*
+         * The transport must deliver the very next record to the kernel,
+         * so nothing may have been read past the current record, and the
+         * current record must have been consumed.
+         */
+        if( ssl->in_offt != NULL || ssl->in_msglen > ssl->in_hslen ||
+            ssl->in_left != ssl->next_record_offset )
+        {
+            return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+        }
+
+        transform = ssl->transform_in;
+    }
+    else
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    if( transform == NULL )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    cipher_info = transform->cipher_ctx_enc.cipher_info;
+    if( cipher_info == NULL || cipher_info->mode != MBEDTLS_MODE_GCM ||
+        transform->keylen > sizeof( info->key ) ||
+        transform->fixed_ivlen != sizeof( info->salt ) )
+    {
+        return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
+    }
+
+    memset( info, 0, sizeof( mbedtls_ssl_ktls_info ) );
+
+    info->cipher = cipher_info->type;
+    info->minor_ver = ssl->minor_ver;
+    info->key_len = transform->keylen;
+
+    /* Like ssl_encrypt_buf(), use the sequence number as explicit nonce */
+    if( direction == MBEDTLS_SSL_KTLS_TX )
+    {
+        memcpy( info->key, transform->key_enc, transform->keylen );
+        memcpy( info->salt, transform->iv_enc, sizeof( info->salt ) );
+        memcpy( info->iv, ssl->out_ctr, sizeof( info->iv ) );
+        memcpy( info->rec_seq, ssl->out_ctr, sizeof( info->rec_seq ) );
+    }
+    else
+    {
+        memcpy( info->key, transform->key_dec, transform->keylen );
+        memcpy( info->salt, transform->iv_dec, sizeof( info->salt ) );
+        memcpy( info->iv, ssl->in_ctr, sizeof( info->iv ) );
+        memcpy( info->rec_seq, ssl->in_ctr, sizeof( info->rec_seq ) );
+    }
+
+    return( 0 );
+}
+
+int mbedtls_ssl_set_ktls( mbedtls_ssl_context *ssl, int directions,
+                          mbedtls_ssl_send_record_t *f_send_record,
+                          mbedtls_ssl_recv_t *f_recv )
+{
+    if( ssl == NULL ||
+        ( directions & ~( MBEDTLS_SSL_KTLS_TX | MBEDTLS_SSL_KTLS_RX ) ) != 0 ||
+        ( ( directions & MBEDTLS_SSL_KTLS_TX ) != 0 && f_send_record == NULL ) ||
+        ( ( directions & MBEDTLS_SSL_KTLS_RX ) != 0 && f_recv == NULL ) )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    if( ( directions & MBEDTLS_SSL_KTLS_TX ) != 0 )
+        ssl->f_ktls_send_record = f_send_record;
+
+    if( ( directions & MBEDTLS_SSL_KTLS_RX ) != 0 )
+    {
+        ssl->f_ktls_recv = f_recv;
+
+        /* Forget about the (already processed) last handshake record */
+        ssl->in_left = 0;
+        ssl->next_record_offset = 0;
+        ssl->in_msglen = 0;
+        ssl->in_hslen = 0;
+    }
+
+    ssl->ktls |= directions;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "record layer offloaded, directions: %d",
+                                ssl->ktls ) );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_SSL_KTLS */
+
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+int mbedtls_ssl_shrink_buffers( mbedtls_ssl_context *ssl )
 {
-    memcpy( conf->renego_period, period, 8 );
-}
-#endif /* MBEDTLS_SSL_RENEGOTIATION */
+    int ret;
 
-#if defined(MBEDTLS_SSL_SESSION_TICKETS)
-#if defined(MBEDTLS_SSL_CLI_C)
-void mbedtls_ssl_conf_session_tickets( mbedtls_ssl_config *conf, int use_tickets )
-{
-    conf->session_tickets = use_tickets;
-}
-#endif
+    if( ssl == NULL || ssl->conf == NULL ||
+        ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_STREAM ||
+        ssl->state != MBEDTLS_SSL_HANDSHAKE_OVER || ssl->handshake != NULL )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
 
-#if defined(MBEDTLS_SSL_SRV_C)
-void mbedtls_ssl_conf_session_tickets_cb( mbedtls_ssl_config *conf,
-        mbedtls_ssl_ticket_write_t *f_ticket_write,
-        mbedtls_ssl_ticket_parse_t *f_ticket_parse,
-        void *p_ticket )
-{
-    conf->f_ticket_write = f_ticket_write;
-    conf->f_ticket_parse = f_ticket_parse;
-    conf->p_ticket       = p_ticket;
-}
+#if defined(MBEDTLS_SSL_RENEGOTIATION)
+    /*
+     * A renegotiation needs full-size buffers again, and growing them back
+     * while the handshake allocates its own memory can fail once the heap
+     * is fragmented: keep them as long as one can follow.
+     */
+    if( ssl->conf->disable_renegotiation == MBEDTLS_SSL_RENEGOTIATION_ENABLED )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
 #endif
-#endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
-#if defined(MBEDTLS_SSL_EXPORT_KEYS)
-void mbedtls_ssl_conf_export_keys_cb( mbedtls_ssl_config *conf,
-        mbedtls_ssl_export_keys_t *f_export_keys,
-        void *p_export_keys )
-{
-    conf->f_export_keys = f_export_keys;
-    conf->p_export_keys = p_export_keys;
-}
-#endif
+    /*
+     * Nothing may be left to process in the input buffer: no application
+     * data, no other handshake message in the current record, and no
+     * (partial or complete) record read after it.
+     */
+    if( ssl->in_offt != NULL || ssl->in_msglen > ssl->in_hslen ||
+        ssl->in_left != ssl->next_record_offset || ssl->out_left != 0 )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
 
-/*
- * SSL get accessors
- */
-size_t mbedtls_ssl_get_bytes_avail( const mbedtls_ssl_context *ssl )
-{
-    return( ssl->in_offt == NULL ? 0 : ssl->in_msglen );
+    /* Forget about already processed read-ahead data */
+    ssl->in_left = 0;
+    ssl->next_record_offset = 0;
+
+    if( ssl->in_buf_len > MBEDTLS_SSL_IDLE_BUFFER_LEN &&
+        ( ret = ssl_resize_in_buf( ssl, MBEDTLS_SSL_IDLE_BUFFER_LEN ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    if( ssl->out_buf_len > MBEDTLS_SSL_IDLE_BUFFER_LEN &&
+        ( ret = ssl_resize_out_buf( ssl, MBEDTLS_SSL_IDLE_BUFFER_LEN ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    return( 0 );
 }
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
 
 uint32_t mbedtls_ssl_get_verify_result( const mbedtls_ssl_context *ssl )
 {
@@ -6537,6 +8635,9 @@ const char *mbedtls_ssl_get_version( const mbedtls_ssl_context *ssl )
         case MBEDTLS_SSL_MINOR_VERSION_3:
             return( "TLSv1.2" );
 
+        case MBEDTLS_SSL_MINOR_VERSION_4:
+            return( "TLSv1.3" );
+
         default:
             return( "unknown" );
     }
@@ -6545,16 +8646,23 @@ const char *mbedtls_ssl_get_version( const mbedtls_ssl_context *ssl )
 int mbedtls_ssl_get_record_expansion( const mbedtls_ssl_context *ssl )
 {
     size_t transform_expansion;
+    size_t cid_expansion = 0;
     const mbedtls_ssl_transform *transform = ssl->transform_out;
 
+    if( transform == NULL )
+        return( (int) mbedtls_ssl_hdr_len( ssl ) );
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /* The connection ID, and the inner content type it comes with */
+    if( transform->out_cid_len != 0 )
+        cid_expansion = transform->out_cid_len + 1;
+#endif
+
 #if defined(MBEDTLS_ZLIB_SUPPORT)
     if( ssl->session_out->compression != MBEDTLS_SSL_COMPRESS_NULL )
         return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
 #endif
 
-    if( transform == NULL )
-        return( (int) mbedtls_ssl_hdr_len( ssl ) );
-
     switch( mbedtls_cipher_get_cipher_mode( &transform->cipher_ctx_enc ) )
     {
         case MBEDTLS_MODE_GCM:
@@ -6566,6 +8674,12 @@ int mbedtls_ssl_get_record_expansion( const mbedtls_ssl_context *ssl )
         case MBEDTLS_MODE_CBC:
             transform_expansion = transform->maclen
                       + mbedtls_cipher_get_block_size( &transform->cipher_ctx_enc );
+#if defined(MBEDTLS_SSL_PROTO_TLS1_1) || defined(MBEDTLS_SSL_PROTO_TLS1_2)
+            /* Explicit IV */
+            if( ssl->minor_ver >= MBEDTLS_SSL_MINOR_VERSION_2 )
+                transform_expansion +=
+                    mbedtls_cipher_get_block_size( &transform->cipher_ctx_enc );
+#endif
             break;
 
         default:
@@ -6573,7 +8687,8 @@ int mbedtls_ssl_get_record_expansion( const mbedtls_ssl_context *ssl )
             return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
     }
 
-    return( (int)( mbedtls_ssl_hdr_len( ssl ) + transform_expansion ) );
+    return( (int)( mbedtls_ssl_hdr_len( ssl ) + cid_expansion +
+                   transform_expansion ) );
 }
 
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
@@ -6754,6 +8869,17 @@ int mbedtls_ssl_renegotiate( mbedtls_ssl_context *ssl )
     if( ssl == NULL || ssl->conf == NULL )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
 
+#if defined(MBEDTLS_SSL_KTLS)
+    /* The record layer is no longer ours */
+    if( ssl->ktls != 0 )
+        return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        return( MBEDTLS_ERR_SSL_FEATURE_UNAVAILABLE );
+#endif
+
 #if defined(MBEDTLS_SSL_SRV_C)
     /* On server, just send the request */
     if( ssl->conf->endpoint == MBEDTLS_SSL_IS_SERVER )
@@ -6816,6 +8942,16 @@ static int ssl_check_ctr_renegotiate( mbedtls_ssl_context *ssl )
         return( 0 );
     }
 
+#if defined(MBEDTLS_SSL_KTLS)
+    if( ssl->ktls != 0 )
+        return( 0 );
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        return( 0 );
+#endif
+
     in_ctr_cmp = memcmp( ssl->in_ctr + ep_len,
                         ssl->conf->renego_period + ep_len, 8 - ep_len );
     out_ctr_cmp = memcmp( ssl->out_ctr + ep_len,
@@ -6844,6 +8980,18 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
 
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> read" ) );
 
+#if defined(MBEDTLS_SSL_KTLS)
+    /* Records are decrypted by the transport */
+    if( ( ssl->ktls & MBEDTLS_SSL_KTLS_RX ) != 0 )
+    {
+        ret = ssl->f_ktls_recv( ssl->p_bio, buf, len );
+
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= read" ) );
+
+        return( ret );
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( ssl->conf->transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
     {
@@ -6892,6 +9040,15 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
         }
     }
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* A KeyUpdate answer that the output blocked goes first */
+    if( ( ret = mbedtls_ssl_tls13_write_key_update( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_write_key_update", ret );
+        return( ret );
+    }
+#endif
+
     /*
      * TODO
      *
@@ -6965,6 +9122,20 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
         {
             MBEDTLS_SSL_DEBUG_MSG( 1, ( "received handshake message" ) );
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            /* No renegotiation in TLS 1.3, but post-handshake messages */
+            if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+            {
+                if( ( ret = mbedtls_ssl_tls13_process_post_handshake( ssl ) ) != 0 )
+                {
+                    MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_process_post_handshake", ret );
+                    return( ret );
+                }
+
+                return( MBEDTLS_ERR_SSL_WANT_READ );
+            }
+#endif
+
             /*
              * - For client-side, expect SERVER_HELLO_REQUEST.
              * - For server-side, expect CLIENT_HELLO.
@@ -7005,6 +9176,9 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
 #if defined(MBEDTLS_SSL_RENEGOTIATION)
             /* Determine whether renegotiation attempt should be accepted */
             if( ! ( ssl->conf->disable_renegotiation == MBEDTLS_SSL_RENEGOTIATION_DISABLED ||
+#if defined(MBEDTLS_SSL_KTLS)
+                    ssl->ktls != 0 ||
+#endif
                     ( ssl->secure_renegotiation == MBEDTLS_SSL_LEGACY_RENEGOTIATION &&
                       ssl->conf->allow_legacy_renegotiation ==
                                                    MBEDTLS_SSL_LEGACY_NO_RENEGOTIATION ) ) )
@@ -7147,12 +9321,92 @@ int mbedtls_ssl_read( mbedtls_ssl_context *ssl, unsigned char *buf, size_t len )
     return( (int) n );
 }
 
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+/*
+ * Largest payload for the next application data record: small records
+ * until drs_ramp_bytes have been sent since the start of the connection or
+ * since it last went idle.
+ *
+ * The state only changes when a new record is started (out_left == 0), so
+ * that a write resumed after WANT_WRITE gets the same limit again.
+ */
+static size_t ssl_dynamic_record_limit( mbedtls_ssl_context *ssl,
+                                        size_t max_len )
+{
+    if( ssl->conf->drs_small_len == 0 ||
+        ssl->conf->transport != MBEDTLS_SSL_TRANSPORT_STREAM )
+    {
+        return( max_len );
+    }
+
+#if defined(MBEDTLS_HAVE_TIME)
+    if( ssl->out_left == 0 && ssl->drs_bytes_sent != 0 &&
+        ssl->conf->drs_idle_timeout != 0 &&
+        mbedtls_time( NULL ) - ssl->drs_last_write >=
+            (mbedtls_time_t) ssl->conf->drs_idle_timeout )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "connection was idle, back to small records" ) );
+        ssl->drs_bytes_sent = 0;
+    }
+#endif
+
+    if( ssl->drs_bytes_sent >= ssl->conf->drs_ramp_bytes ||
+        ssl->conf->drs_small_len >= max_len )
+    {
+        return( max_len );
+    }
+
+    return( ssl->conf->drs_small_len );
+}
+#endif /* MBEDTLS_SSL_DYNAMIC_RECORD_SIZING */
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+/*
+ * Can the next record be encrypted straight from the caller's buffer into
+ * out_msg? Only AEAD records can, provided nothing changes their content
+ * before encryption.
+ */
+static int ssl_can_encrypt_from_src( const mbedtls_ssl_context *ssl )
+{
+    mbedtls_cipher_mode_t mode;
+
+    if( ssl->transform_out == NULL )
+        return( 0 );
+
+#if defined(MBEDTLS_ZLIB_SUPPORT)
+    if( ssl->session_out->compression == MBEDTLS_SSL_COMPRESS_DEFLATE )
+        return( 0 );
+#endif
+#if defined(MBEDTLS_SSL_HW_RECORD_ACCEL)
+    if( mbedtls_ssl_hw_record_write != NULL )
+        return( 0 );
+#endif
+    /* The real content type would be appended to the content */
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( ssl->transform_out->out_cid_len != 0 )
+        return( 0 );
+#endif
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    if( ssl->minor_ver == MBEDTLS_SSL_MINOR_VERSION_4 )
+        return( 0 );
+#endif
+
+    mode = mbedtls_cipher_get_cipher_mode( &ssl->transform_out->cipher_ctx_enc );
+
+    return( mode == MBEDTLS_MODE_GCM || mode == MBEDTLS_MODE_CCM );
+}
+#endif /* MBEDTLS_SSL_SEND_FILE */
+
 /*
  * Send application data to be encrypted by the SSL layer,
  * taking care of max fragment length and buffer size
+ *
+ * With from_src, AEAD records are encrypted from buf rather than copied to
+ * out_msg first; buf must then stay unchanged until the record is written.
  */
 static int ssl_write_real( mbedtls_ssl_context *ssl,
-                           const unsigned char *buf, size_t len )
+                           const unsigned char *buf, size_t len,
+                           int from_src )
 {
     int ret;
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
@@ -7160,6 +9414,11 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
 #else
     size_t max_len = MBEDTLS_SSL_MAX_CONTENT_LEN;
 #endif /* MBEDTLS_SSL_MAX_FRAGMENT_LENGTH */
+
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    max_len = ssl_dynamic_record_limit( ssl, max_len );
+#endif
+
     if( len > max_len )
     {
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
@@ -7185,17 +9444,51 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
     }
     else
     {
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+        /* Grow the buffer if the record and its expansion don't fit */
+        if( len > ssl->out_buf_len -
+                  ( MBEDTLS_SSL_BUFFER_LEN - MBEDTLS_SSL_MAX_CONTENT_LEN ) &&
+            ( ret = ssl_resize_out_buf( ssl, MBEDTLS_SSL_BUFFER_LEN ) ) != 0 )
+        {
+            return( ret );
+        }
+#endif
+
         ssl->out_msglen  = len;
         ssl->out_msgtype = MBEDTLS_SSL_MSG_APPLICATION_DATA;
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+        if( from_src && ssl_can_encrypt_from_src( ssl ) )
+        {
+            MBEDTLS_SSL_DEBUG_MSG( 3, ( "encrypt record from caller buffer" ) );
+            ssl->out_src = buf;
+        }
+        else
+#else
+        ((void) from_src);
+#endif
         memcpy( ssl->out_msg, buf, len );
 
-        if( ( ret = mbedtls_ssl_write_record( ssl ) ) != 0 )
+        ret = mbedtls_ssl_write_record( ssl );
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+        ssl->out_src = NULL;
+#endif
+
+        if( ret != 0 )
         {
             MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_write_record", ret );
             return( ret );
         }
     }
 
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    ssl->drs_bytes_sent += len;
+#if defined(MBEDTLS_HAVE_TIME)
+    ssl->drs_last_write = mbedtls_time( NULL );
+#endif
+#endif
+
     return( (int) len );
 }
 
@@ -7208,7 +9501,8 @@ static int ssl_write_real( mbedtls_ssl_context *ssl,
  */
 #if defined(MBEDTLS_SSL_CBC_RECORD_SPLITTING)
 static int ssl_write_split( mbedtls_ssl_context *ssl,
-                            const unsigned char *buf, size_t len )
+                            const unsigned char *buf, size_t len,
+                            int from_src )
 {
     int ret;
 
@@ -7219,17 +9513,17 @@ static int ssl_write_split( mbedtls_ssl_context *ssl,
         mbedtls_cipher_get_cipher_mode( &ssl->transform_out->cipher_ctx_enc )
                                 != MBEDTLS_MODE_CBC )
     {
-        return( ssl_write_real( ssl, buf, len ) );
+        return( ssl_write_real( ssl, buf, len, from_src ) );
     }
 
     if( ssl->split_done == 0 )
     {
-        if( ( ret = ssl_write_real( ssl, buf, 1 ) ) <= 0 )
+        if( ( ret = ssl_write_real( ssl, buf, 1, from_src ) ) <= 0 )
             return( ret );
         ssl->split_done = 1;
     }
 
-    if( ( ret = ssl_write_real( ssl, buf + 1, len - 1 ) ) <= 0 )
+    if( ( ret = ssl_write_real( ssl, buf + 1, len - 1, from_src ) ) <= 0 )
         return( ret );
     ssl->split_done = 0;
 
@@ -7238,9 +9532,12 @@ static int ssl_write_split( mbedtls_ssl_context *ssl,
 #endif /* MBEDTLS_SSL_CBC_RECORD_SPLITTING */
 
 /*
- * Write application data (public-facing wrapper)
+ * Write application data, from a buffer that stays unchanged until the
+ * data is written if from_src is set
  */
-int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len )
+static int ssl_write_app_data( mbedtls_ssl_context *ssl,
+                               const unsigned char *buf, size_t len,
+                               int from_src )
 {
     int ret;
 
@@ -7249,6 +9546,18 @@ int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_
     if( ssl == NULL || ssl->conf == NULL )
         return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
 
+#if defined(MBEDTLS_SSL_KTLS)
+    /* Records are protected by the transport */
+    if( ( ssl->ktls & MBEDTLS_SSL_KTLS_TX ) != 0 )
+    {
+        ret = ssl->f_send( ssl->p_bio, buf, len );
+
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write" ) );
+
+        return( ret );
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_RENEGOTIATION)
     if( ( ret = ssl_check_ctr_renegotiate( ssl ) ) != 0 )
     {
@@ -7266,10 +9575,19 @@ int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_
         }
     }
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* Answer a KeyUpdate first, the data goes under the new keys */
+    if( ( ret = mbedtls_ssl_tls13_write_key_update( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_write_key_update", ret );
+        return( ret );
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_CBC_RECORD_SPLITTING)
-    ret = ssl_write_split( ssl, buf, len );
+    ret = ssl_write_split( ssl, buf, len, from_src );
 #else
-    ret = ssl_write_real( ssl, buf, len );
+    ret = ssl_write_real( ssl, buf, len, from_src );
 #endif
 
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write" ) );
@@ -7277,6 +9595,107 @@ int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_
     return( ret );
 }
 
+/*
+ * Write application data (public-facing wrapper)
+ */
+int mbedtls_ssl_write( mbedtls_ssl_context *ssl, const unsigned char *buf, size_t len )
+{
+    return( ssl_write_app_data( ssl, buf, len, 0 ) );
+}
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+/*
+ * Write application data from a file, filling records from a mapping
+ *
+ * The arguments of each ssl_write_app_data() call only depend on how much
+ * has been sent so far, so that a call interrupted by WANT_WRITE/READ is
+ * repeated identically when we are called again.
+ */
+int mbedtls_ssl_send_file( mbedtls_ssl_context *ssl, int fd,
+                           off_t offset, size_t len )
+{
+    int ret = 0;
+    struct stat st;
+    long page_size;
+    unsigned char *map = NULL;
+    off_t map_off = 0, pos;
+    size_t map_len = 0, chunk, max_len;
+
+    if( ssl == NULL || ssl->conf == NULL || fd < 0 || offset < 0 )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> send file" ) );
+
+    if( fstat( fd, &st ) != 0 || ! S_ISREG( st.st_mode ) ||
+        ( page_size = sysconf( _SC_PAGESIZE ) ) <= 0 )
+    {
+        return( MBEDTLS_ERR_SSL_FILE_IO_ERROR );
+    }
+
+    /* Touching a mapped page past the end of the file would raise SIGBUS */
+    if( offset > st.st_size ||
+        (uintmax_t) len > (uintmax_t)( st.st_size - offset ) )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    while( ssl->send_file_done < len )
+    {
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        max_len = mbedtls_ssl_get_max_frag_len( ssl );
+#else
+        max_len = MBEDTLS_SSL_MAX_CONTENT_LEN;
+#endif
+        pos = offset + (off_t) ssl->send_file_done;
+        chunk = len - ssl->send_file_done;
+        if( chunk > max_len )
+            chunk = max_len;
+
+        if( map == NULL || pos + (off_t) chunk > map_off + (off_t) map_len )
+        {
+            if( map != NULL )
+                munmap( map, map_len );
+
+            /* Map from the page holding pos, at least the next chunk */
+            map_off = pos - pos % page_size;
+            map_len = len - ssl->send_file_done;
+            if( map_len > MBEDTLS_SSL_SEND_FILE_WINDOW )
+                map_len = MBEDTLS_SSL_SEND_FILE_WINDOW;
+            if( map_len < chunk )
+                map_len = chunk;
+            map_len += (size_t)( pos - map_off );
+
+            map = mmap( NULL, map_len, PROT_READ, MAP_SHARED, fd, map_off );
+            if( map == MAP_FAILED )
+            {
+                map = NULL;
+                ret = MBEDTLS_ERR_SSL_FILE_IO_ERROR;
+                break;
+            }
+        }
+
+        ret = ssl_write_app_data( ssl, map + ( pos - map_off ), chunk, 1 );
+        if( ret < 0 )
+            break;
+
+        ssl->send_file_done += ret;
+    }
+
+    if( map != NULL )
+        munmap( map, map_len );
+
+    if( ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE )
+        return( ret );
+
+    /* Done, or failed: the next call starts a new file */
+    ssl->send_file_done = 0;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= send file" ) );
+
+    return( ret < 0 ? ret : 0 );
+}
+#endif /* MBEDTLS_SSL_SEND_FILE */
+
 /*
  * Notify the peer that the connection is being closed
  */
@@ -7289,6 +9708,12 @@ int mbedtls_ssl_close_notify( mbedtls_ssl_context *ssl )
 
     MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> write close notify" ) );
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* The alert goes under the keys the peer expects */
+    if( ( ret = mbedtls_ssl_tls13_write_key_update( ssl ) ) != 0 )
+        return( ret );
+#endif
+
     if( ssl->out_left != 0 )
         return( mbedtls_ssl_flush_output( ssl ) );
 
@@ -7341,8 +9766,10 @@ static void ssl_key_cert_free( mbedtls_ssl_key_cert *key_cert )
 }
 #endif /* MBEDTLS_X509_CRT_PARSE_C */
 
-void mbedtls_ssl_handshake_free( mbedtls_ssl_handshake_params *handshake )
+void mbedtls_ssl_handshake_free( mbedtls_ssl_context *ssl )
 {
+    mbedtls_ssl_handshake_params *handshake = ssl->handshake;
+
     if( handshake == NULL )
         return;
 
@@ -7369,7 +9796,7 @@ void mbedtls_ssl_handshake_free( mbedtls_ssl_handshake_params *handshake )
 #if defined(MBEDTLS_KEY_EXCHANGE_ECJPAKE_ENABLED)
     mbedtls_ecjpake_free( &handshake->ecjpake_ctx );
 #if defined(MBEDTLS_SSL_CLI_C)
-    mbedtls_free( handshake->ecjpake_cache );
+    mbedtls_ssl_hs_free( ssl, handshake->ecjpake_cache );
     handshake->ecjpake_cache = NULL;
     handshake->ecjpake_cache_len = 0;
 #endif
@@ -7378,14 +9805,14 @@ void mbedtls_ssl_handshake_free( mbedtls_ssl_handshake_params *handshake )
 #if defined(MBEDTLS_ECDH_C) || defined(MBEDTLS_ECDSA_C) || \
     defined(MBEDTLS_KEY_EXCHANGE_ECJPAKE_ENABLED)
     /* explicit void pointer cast for buggy MS compiler */
-    mbedtls_free( (void *) handshake->curves );
+    mbedtls_ssl_hs_free( ssl, (void *) handshake->curves );
 #endif
 
 #if defined(MBEDTLS_KEY_EXCHANGE__SOME__PSK_ENABLED)
     if( handshake->psk != NULL )
     {
         mbedtls_zeroize( handshake->psk, handshake->psk_len );
-        mbedtls_free( handshake->psk );
+        mbedtls_ssl_hs_free( ssl, handshake->psk );
     }
 #endif
 
@@ -7402,19 +9829,43 @@ void mbedtls_ssl_handshake_free( mbedtls_ssl_handshake_params *handshake )
         while( cur != NULL )
         {
             next = cur->next;
-            mbedtls_free( cur );
+            mbedtls_ssl_hs_free( ssl, cur );
             cur = next;
         }
     }
+
+#if defined(MBEDTLS_SSL_SNI_C)
+    mbedtls_ssl_sni_table_release( handshake->sni_table );
+#endif
 #endif /* MBEDTLS_X509_CRT_PARSE_C && MBEDTLS_SSL_SERVER_NAME_INDICATION */
 
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
-    mbedtls_free( handshake->verify_cookie );
-    mbedtls_free( handshake->hs_msg );
-    ssl_flight_free( handshake->flight );
+    mbedtls_ssl_hs_free( ssl, handshake->verify_cookie );
+    mbedtls_ssl_hs_free( ssl, handshake->hs_msg );
+    ssl_flight_free( ssl, handshake->flight );
+#endif
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /* Only set if the handshake didn't complete */
+    if( handshake->transform_application != NULL )
+    {
+        mbedtls_ssl_transform_free( handshake->transform_application );
+        mbedtls_free( handshake->transform_application );
+    }
+    mbedtls_ssl_hs_free( ssl, handshake->tls13_cookie );
 #endif
 
     mbedtls_zeroize( handshake, sizeof( mbedtls_ssl_handshake_params ) );
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    /* Only the handshake parameters are left */
+    ssl->hs_arena_need = SSL_HS_ARENA_BASE;
+    if( ssl->hs_arena != NULL )
+    {
+        ssl->hs_arena_used = SSL_HS_ARENA_BASE;
+        ssl->hs_arena_last = SSL_HS_ARENA_BASE;
+    }
+#endif
 }
 
 void mbedtls_ssl_session_free( mbedtls_ssl_session *session )
@@ -7449,13 +9900,13 @@ void mbedtls_ssl_free( mbedtls_ssl_context *ssl )
 
     if( ssl->out_buf != NULL )
     {
-        mbedtls_zeroize( ssl->out_buf, MBEDTLS_SSL_BUFFER_LEN );
+        mbedtls_zeroize( ssl->out_buf, mbedtls_ssl_out_buf_len( ssl ) );
         mbedtls_free( ssl->out_buf );
     }
 
     if( ssl->in_buf != NULL )
     {
-        mbedtls_zeroize( ssl->in_buf, MBEDTLS_SSL_BUFFER_LEN );
+        mbedtls_zeroize( ssl->in_buf, mbedtls_ssl_in_buf_len( ssl ) );
         mbedtls_free( ssl->in_buf );
     }
 
@@ -7475,11 +9926,11 @@ void mbedtls_ssl_free( mbedtls_ssl_context *ssl )
 
     if( ssl->handshake )
     {
-        mbedtls_ssl_handshake_free( ssl->handshake );
+        mbedtls_ssl_handshake_free( ssl );
         mbedtls_ssl_transform_free( ssl->transform_negotiate );
         mbedtls_ssl_session_free( ssl->session_negotiate );
 
-        mbedtls_free( ssl->handshake );
+        ssl_handshake_params_free( ssl );
         mbedtls_free( ssl->transform_negotiate );
         mbedtls_free( ssl->session_negotiate );
     }
@@ -7662,22 +10113,18 @@ int mbedtls_ssl_config_defaults( mbedtls_ssl_config *conf,
             conf->max_major_ver = MBEDTLS_SSL_MAX_MAJOR_VERSION;
             conf->max_minor_ver = MBEDTLS_SSL_MAX_MINOR_VERSION;
 
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_0] =
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_1] =
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_2] =
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_3] =
-                                   ssl_preset_suiteb_ciphersuites;
+            mbedtls_ssl_conf_ciphersuites( conf, ssl_preset_suiteb_ciphersuites );
 
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
             conf->cert_profile = &mbedtls_x509_crt_profile_suiteb;
 #endif
 
 #if defined(MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED)
-            conf->sig_hashes = ssl_preset_suiteb_hashes;
+            mbedtls_ssl_conf_sig_hashes( conf, ssl_preset_suiteb_hashes );
 #endif
 
 #if defined(MBEDTLS_ECP_C)
-            conf->curve_list = ssl_preset_suiteb_curves;
+            mbedtls_ssl_conf_curves( conf, ssl_preset_suiteb_curves );
 #endif
             break;
 
@@ -7701,22 +10148,18 @@ int mbedtls_ssl_config_defaults( mbedtls_ssl_config *conf,
                 conf->min_minor_ver = MBEDTLS_SSL_MINOR_VERSION_2;
 #endif
 
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_0] =
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_1] =
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_2] =
-            conf->ciphersuite_list[MBEDTLS_SSL_MINOR_VERSION_3] =
-                                   mbedtls_ssl_list_ciphersuites();
+            mbedtls_ssl_conf_ciphersuites( conf, mbedtls_ssl_list_ciphersuites() );
 
 #if defined(MBEDTLS_X509_CRT_PARSE_C)
             conf->cert_profile = &mbedtls_x509_crt_profile_default;
 #endif
 
 #if defined(MBEDTLS_KEY_EXCHANGE__WITH_CERT__ENABLED)
-            conf->sig_hashes = ssl_preset_default_hashes;
+            mbedtls_ssl_conf_sig_hashes( conf, ssl_preset_default_hashes );
 #endif
 
 #if defined(MBEDTLS_ECP_C)
-            conf->curve_list = mbedtls_ecp_grp_id_list();
+            mbedtls_ssl_conf_curves( conf, mbedtls_ecp_grp_id_list() );
 #endif
 
 #if defined(MBEDTLS_DHM_C) && defined(MBEDTLS_SSL_CLI_C)
@@ -7927,14 +10370,12 @@ unsigned char mbedtls_ssl_hash_from_md_alg( int md )
  */
 int mbedtls_ssl_check_curve( const mbedtls_ssl_context *ssl, mbedtls_ecp_group_id grp_id )
 {
-    const mbedtls_ecp_group_id *gid;
-
-    if( ssl->conf->curve_list == NULL )
+    if( ssl->conf->curve_list == NULL ||
+        grp_id <= MBEDTLS_ECP_DP_NONE || grp_id >= 32 )
         return( -1 );
 
-    for( gid = ssl->conf->curve_list; *gid != MBEDTLS_ECP_DP_NONE; gid++ )
-        if( *gid == grp_id )
-            return( 0 );
+    if( ssl->conf->curve_set & ( (uint32_t) 1 << grp_id ) )
+        return( 0 );
 
     return( -1 );
 }
@@ -7948,14 +10389,12 @@ int mbedtls_ssl_check_curve( const mbedtls_ssl_context *ssl, mbedtls_ecp_group_i
 int mbedtls_ssl_check_sig_hash( const mbedtls_ssl_context *ssl,
                                 mbedtls_md_type_t md )
 {
-    const int *cur;
-
-    if( ssl->conf->sig_hashes == NULL )
+    if( ssl->conf->sig_hashes == NULL ||
+        md <= MBEDTLS_MD_NONE || md >= 32 )
         return( -1 );
 
-    for( cur = ssl->conf->sig_hashes; *cur != MBEDTLS_MD_NONE; cur++ )
-        if( *cur == (int) md )
-            return( 0 );
+    if( ssl->conf->sig_hash_set & ( (uint32_t) 1 << md ) )
+        return( 0 );
 
     return( -1 );
 }
@@ -8007,6 +10446,11 @@ int mbedtls_ssl_check_cert_usage( const mbedtls_x509_crt *cert,
 
             /* Don't use default: we want warnings when adding new values */
             case MBEDTLS_KEY_EXCHANGE_NONE:
+                /* With TLS 1.3 the server signs the handshake */
+                usage = mbedtls_ssl_ciphersuite_is_tls13( ciphersuite ) ?
+                        MBEDTLS_X509_KU_DIGITAL_SIGNATURE : 0;
+                break;
+
             case MBEDTLS_KEY_EXCHANGE_PSK:
             case MBEDTLS_KEY_EXCHANGE_DHE_PSK:
             case MBEDTLS_KEY_EXCHANGE_ECDHE_PSK:
@@ -8080,6 +10524,12 @@ void mbedtls_ssl_write_version( int major, int minor, int transport,
     {
         ver[0] = (unsigned char) major;
         ver[1] = (unsigned char) minor;
+
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+        /* TLS 1.3 says TLS 1.2 on the wire, see supported_versions */
+        if( minor > MBEDTLS_SSL_MINOR_VERSION_3 )
+            ver[1] = MBEDTLS_SSL_MINOR_VERSION_3;
+#endif
     }
 }
 
@@ -8120,17 +10570,23 @@ int mbedtls_ssl_set_calc_verify_md( mbedtls_ssl_context *ssl, int md )
 #endif
 #if defined(MBEDTLS_SHA1_C)
         case MBEDTLS_SSL_HASH_SHA1:
+            if( ( ssl->handshake->checksums & MBEDTLS_SSL_CHECKSUM_MD5SHA1 ) == 0 )
+                return MBEDTLS_ERR_SSL_INVALID_VERIFY_HASH;
             ssl->handshake->calc_verify = ssl_calc_verify_tls;
             break;
 #endif
 #endif /* MBEDTLS_SSL_PROTO_TLS1 || MBEDTLS_SSL_PROTO_TLS1_1 */
 #if defined(MBEDTLS_SHA512_C)
         case MBEDTLS_SSL_HASH_SHA384:
+            if( ( ssl->handshake->checksums & MBEDTLS_SSL_CHECKSUM_SHA384 ) == 0 )
+                return MBEDTLS_ERR_SSL_INVALID_VERIFY_HASH;
             ssl->handshake->calc_verify = ssl_calc_verify_tls_sha384;
             break;
 #endif
 #if defined(MBEDTLS_SHA256_C)
         case MBEDTLS_SSL_HASH_SHA256:
+            if( ( ssl->handshake->checksums & MBEDTLS_SSL_CHECKSUM_SHA256 ) == 0 )
+                return MBEDTLS_ERR_SSL_INVALID_VERIFY_HASH;
             ssl->handshake->calc_verify = ssl_calc_verify_tls_sha256;
             break;
 #endif
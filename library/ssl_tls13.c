@@ -0,0 +1,1573 @@
+/*
+ *  TLS 1.3 functions shared by the client and the server
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ *  The TLS 1.3 protocol is specified in RFC 8446. This file holds the key
+ *  schedule (section 7) and the handshake messages that are the same for
+ *  both endpoints; the client and server state machines live alongside the
+ *  TLS 1.2 ones in ssl_cli.c and ssl_srv.c.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_SSL_TLS_C) && defined(MBEDTLS_SSL_PROTO_TLS1_3)
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#endif
+
+#include "mbedtls/debug.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_internal.h"
+#include "mbedtls/hkdf.h"
+#include "mbedtls/ecdh.h"
+
+#include <string.h>
+
+#if defined(MBEDTLS_HAVE_TIME)
+#include "mbedtls/platform_time.h"
+#endif
+
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+
+/*
+ * Key schedule
+ */
+
+/*
+ * HKDF-Expand-Label( Secret, Label, Context, Length ) =
+ *      HKDF-Expand( Secret, HkdfLabel, Length )
+ *
+ * struct {
+ *     uint16 length = Length;
+ *     opaque label<7..255> = "tls13 " + Label;
+ *     opaque context<0..255> = Context;
+ * } HkdfLabel;
+ */
+int mbedtls_ssl_tls13_expand_label( mbedtls_md_type_t md_alg,
+                                    const unsigned char *secret,
+                                    const char *label,
+                                    const unsigned char *ctx, size_t ctx_len,
+                                    unsigned char *out, size_t out_len )
+{
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type( md_alg );
+    unsigned char info[2 + 1 + 255 + 1 + MBEDTLS_MD_MAX_SIZE];
+    unsigned char *p = info;
+    size_t label_len = strlen( label );
+
+    if( md_info == NULL || label_len > 255 - 6 ||
+        ctx_len > MBEDTLS_MD_MAX_SIZE || out_len > 0xFFFF )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    *p++ = (unsigned char)( out_len >> 8 );
+    *p++ = (unsigned char)( out_len      );
+    *p++ = (unsigned char)( 6 + label_len );
+    memcpy( p, "tls13 ", 6 );
+    p += 6;
+    memcpy( p, label, label_len );
+    p += label_len;
+    *p++ = (unsigned char) ctx_len;
+    if( ctx_len != 0 )
+        memcpy( p, ctx, ctx_len );
+    p += ctx_len;
+
+    return( mbedtls_hkdf_expand( md_info, secret, mbedtls_md_get_size( md_info ),
+                                 info, p - info, out, out_len ) );
+}
+
+/*
+ * Derive-Secret( Secret, Label, Messages ) =
+ *      HKDF-Expand-Label( Secret, Label, Transcript-Hash( Messages ), Hash.length )
+ *
+ * The caller passes the transcript hash, or NULL for the hash of nothing.
+ */
+int mbedtls_ssl_tls13_derive_secret( mbedtls_md_type_t md_alg,
+                                     const unsigned char *secret,
+                                     const char *label,
+                                     const unsigned char *transcript,
+                                     unsigned char *out )
+{
+    int ret;
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type( md_alg );
+    unsigned char empty[MBEDTLS_MD_MAX_SIZE];
+    size_t hlen;
+
+    if( md_info == NULL )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    hlen = mbedtls_md_get_size( md_info );
+
+    if( transcript == NULL )
+    {
+        if( ( ret = mbedtls_md( md_info, (const unsigned char *) "", 0,
+                                empty ) ) != 0 )
+        {
+            return( ret );
+        }
+        transcript = empty;
+    }
+
+    return( mbedtls_ssl_tls13_expand_label( md_alg, secret, label,
+                                            transcript, hlen, out, hlen ) );
+}
+
+/*
+ * Transcript-Hash of the handshake so far, followed by the given data.
+ * The running digest is left untouched.
+ */
+int mbedtls_ssl_tls13_transcript_hash( mbedtls_ssl_context *ssl,
+                                       mbedtls_md_type_t md_alg,
+                                       const unsigned char *data, size_t len,
+                                       unsigned char *hash )
+{
+    int ret = MBEDTLS_ERR_SSL_INTERNAL_ERROR;
+
+#if defined(MBEDTLS_SHA256_C)
+    if( md_alg == MBEDTLS_MD_SHA256 &&
+        ( ssl->handshake->checksums & MBEDTLS_SSL_CHECKSUM_SHA256 ) != 0 )
+    {
+        mbedtls_sha256_context sha256;
+
+        mbedtls_sha256_init( &sha256 );
+        mbedtls_sha256_clone( &sha256, &ssl->handshake->fin_sha256 );
+        if( ( ret = mbedtls_sha256_update_ret( &sha256, data, len ) ) == 0 )
+            ret = mbedtls_sha256_finish_ret( &sha256, hash );
+        mbedtls_sha256_free( &sha256 );
+    }
+#endif
+#if defined(MBEDTLS_SHA512_C)
+    if( md_alg == MBEDTLS_MD_SHA384 &&
+        ( ssl->handshake->checksums & MBEDTLS_SSL_CHECKSUM_SHA384 ) != 0 )
+    {
+        mbedtls_sha512_context sha512;
+
+        mbedtls_sha512_init( &sha512 );
+        mbedtls_sha512_clone( &sha512, &ssl->handshake->fin_sha512 );
+        if( ( ret = mbedtls_sha512_update_ret( &sha512, data, len ) ) == 0 )
+            ret = mbedtls_sha512_finish_ret( &sha512, hash );
+        mbedtls_sha512_free( &sha512 );
+    }
+#endif
+
+    if( ret == MBEDTLS_ERR_SSL_INTERNAL_ERROR )
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "transcript hash %d not available", md_alg ) );
+
+    return( ret );
+}
+
+/*
+ * RFC 8446 4.4.1: after a HelloRetryRequest, ClientHello1 is replaced in
+ * the transcript by a synthetic message_hash message carrying its hash.
+ * Called once the ciphersuite is known, before the HRR is hashed.
+ */
+int mbedtls_ssl_tls13_reset_transcript_for_hrr( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    mbedtls_md_type_t md_alg = ssl->transform_negotiate->ciphersuite_info->mac;
+    unsigned char msg[4 + MBEDTLS_MD_MAX_SIZE];
+    size_t hlen = mbedtls_md_get_size( mbedtls_md_info_from_type( md_alg ) );
+
+    if( ( ret = mbedtls_ssl_tls13_transcript_hash( ssl, md_alg, NULL, 0,
+                                                   msg + 4 ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    msg[0] = MBEDTLS_SSL_HS_MESSAGE_HASH;
+    msg[1] = 0;
+    msg[2] = 0;
+    msg[3] = (unsigned char) hlen;
+
+    mbedtls_ssl_reset_checksum( ssl );
+    ssl->handshake->update_checksum( ssl, msg, 4 + hlen );
+
+    return( 0 );
+}
+
+/*
+ * Read a handshake message without adding it to the transcript: the first
+ * ServerHello might be a HelloRetryRequest, after which ClientHello1 has to
+ * be replaced by its hash, and the binders of a ClientHello are computed
+ * over the transcript before it
+ */
+int mbedtls_ssl_tls13_read_record_unhashed( mbedtls_ssl_context *ssl )
+{
+    int ret;
+
+    do {
+
+        if( ( ret = mbedtls_ssl_read_record_layer( ssl ) ) != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record_layer", ret );
+            return( ret );
+        }
+
+        ret = mbedtls_ssl_handle_message_type( ssl );
+
+    } while( MBEDTLS_ERR_SSL_NON_FATAL == ret );
+
+    return( ret );
+}
+
+/*
+ * Early Secret = HKDF-Extract( 0, PSK ), with a string of zeros as PSK
+ * when not resuming
+ */
+static int ssl_tls13_early_secret( mbedtls_md_type_t md_alg,
+                                   const unsigned char *psk, size_t psk_len,
+                                   unsigned char *early )
+{
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type( md_alg );
+    unsigned char zeros[MBEDTLS_MD_MAX_SIZE];
+
+    if( psk == NULL )
+    {
+        memset( zeros, 0, sizeof( zeros ) );
+        psk = zeros;
+        psk_len = mbedtls_md_get_size( md_info );
+    }
+
+    return( mbedtls_hkdf_extract( md_info, NULL, 0, psk, psk_len, early ) );
+}
+
+/*
+ * Next stage: HKDF-Extract( Derive-Secret( Secret, "derived", "" ), IKM ),
+ * computed in place
+ */
+static int ssl_tls13_next_secret( mbedtls_md_type_t md_alg,
+                                  unsigned char *secret,
+                                  const unsigned char *ikm, size_t ikm_len )
+{
+    int ret;
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type( md_alg );
+    size_t hlen = mbedtls_md_get_size( md_info );
+    unsigned char derived[MBEDTLS_MD_MAX_SIZE];
+    unsigned char zeros[MBEDTLS_MD_MAX_SIZE];
+
+    if( ikm == NULL )
+    {
+        memset( zeros, 0, sizeof( zeros ) );
+        ikm = zeros;
+        ikm_len = hlen;
+    }
+
+    if( ( ret = mbedtls_ssl_tls13_derive_secret( md_alg, secret, "derived",
+                                                 NULL, derived ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    ret = mbedtls_hkdf_extract( md_info, derived, hlen, ikm, ikm_len, secret );
+
+    mbedtls_zeroize( derived, sizeof( derived ) );
+
+    return( ret );
+}
+
+/*
+ * binder = HMAC( finished_key( Derive-Secret( Early Secret, "res binder", "" ) ),
+ *                Transcript-Hash( Truncate( ClientHello ) ) )
+ */
+int mbedtls_ssl_tls13_compute_binder( mbedtls_md_type_t md_alg,
+                                      const unsigned char *psk, size_t psk_len,
+                                      const unsigned char *transcript,
+                                      unsigned char *binder )
+{
+    int ret;
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type( md_alg );
+    size_t hlen = mbedtls_md_get_size( md_info );
+    unsigned char secret[MBEDTLS_MD_MAX_SIZE];
+    unsigned char key[MBEDTLS_MD_MAX_SIZE];
+
+    if( ( ret = ssl_tls13_early_secret( md_alg, psk, psk_len, secret ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_derive_secret( md_alg, secret, "res binder",
+                                                 NULL, secret ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_expand_label( md_alg, secret, "finished",
+                                                NULL, 0, key, hlen ) ) != 0 )
+    {
+        goto exit;
+    }
+
+    ret = mbedtls_md_hmac( md_info, key, hlen, transcript, hlen, binder );
+
+exit:
+    mbedtls_zeroize( secret, sizeof( secret ) );
+    mbedtls_zeroize( key, sizeof( key ) );
+
+    return( ret );
+}
+
+/*
+ * Expand the key and IV of one direction of a transform from a traffic
+ * secret, and remember the secret for KeyUpdate
+ */
+static int ssl_tls13_set_traffic_key( mbedtls_ssl_transform *transform,
+                                      const unsigned char *secret,
+                                      int encrypt )
+{
+    int ret;
+    const mbedtls_ssl_ciphersuite_t *suite = transform->ciphersuite_info;
+    mbedtls_md_type_t md_alg = suite->mac;
+    size_t hlen = mbedtls_md_get_size( mbedtls_md_info_from_type( md_alg ) );
+    const mbedtls_cipher_info_t *cipher_info;
+    mbedtls_cipher_context_t *cipher_ctx;
+    unsigned char key[32];
+
+    if( ( cipher_info = mbedtls_cipher_info_from_type( suite->cipher ) ) == NULL ||
+        cipher_info->key_bitlen / 8 > sizeof( key ) )
+    {
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    /*
+     * Nonces are the IV XORed with the sequence number: no explicit part,
+     * see ssl_encrypt_buf()
+     */
+    transform->keylen = cipher_info->key_bitlen / 8;
+    transform->ivlen = 12;
+    transform->fixed_ivlen = 12;
+    transform->maclen = 0;
+    transform->aead_mode = cipher_info->mode;
+    transform->taglen = suite->flags & MBEDTLS_CIPHERSUITE_SHORT_TAG ? 8 : 16;
+    /* Tag and inner content type */
+    transform->minlen = transform->taglen + 1;
+
+    cipher_ctx = encrypt ? &transform->cipher_ctx_enc : &transform->cipher_ctx_dec;
+
+    if( ( ret = mbedtls_ssl_tls13_expand_label( md_alg, secret, "key", NULL, 0,
+                                                key, transform->keylen ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_expand_label( md_alg, secret, "iv", NULL, 0,
+                        encrypt ? transform->iv_enc : transform->iv_dec,
+                        transform->ivlen ) ) != 0 )
+    {
+        goto exit;
+    }
+
+    if( cipher_ctx->cipher_info == NULL &&
+        ( ret = mbedtls_cipher_setup( cipher_ctx, cipher_info ) ) != 0 )
+    {
+        goto exit;
+    }
+
+    if( ( ret = mbedtls_cipher_setkey( cipher_ctx, key, cipher_info->key_bitlen,
+                    encrypt ? MBEDTLS_ENCRYPT : MBEDTLS_DECRYPT ) ) != 0 )
+    {
+        goto exit;
+    }
+
+    memcpy( encrypt ? transform->traffic_secret_enc : transform->traffic_secret_dec,
+            secret, hlen );
+
+exit:
+    mbedtls_zeroize( key, sizeof( key ) );
+
+    return( ret );
+}
+
+static int ssl_tls13_set_traffic_keys( mbedtls_ssl_context *ssl,
+                                       mbedtls_ssl_transform *transform,
+                                       const unsigned char *client_secret,
+                                       const unsigned char *server_secret )
+{
+    int ret;
+    int is_client = ssl->conf->endpoint == MBEDTLS_SSL_IS_CLIENT;
+
+    transform->ciphersuite_info = ssl->transform_negotiate->ciphersuite_info;
+
+    if( ( ret = ssl_tls13_set_traffic_key( transform,
+                    is_client ? client_secret : server_secret, 1 ) ) != 0 ||
+        ( ret = ssl_tls13_set_traffic_key( transform,
+                    is_client ? server_secret : client_secret, 0 ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "ssl_tls13_set_traffic_key", ret );
+        return( ret );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Handshake Secret from the (EC)DHE shared secret, and the handshake
+ * traffic keys, installed in both directions: called once ServerHello has
+ * been added to the transcript.
+ */
+int mbedtls_ssl_tls13_key_schedule_handshake( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    mbedtls_ssl_handshake_params *hs = ssl->handshake;
+    mbedtls_md_type_t md_alg = ssl->transform_negotiate->ciphersuite_info->mac;
+    size_t psk_len = mbedtls_md_get_size( mbedtls_md_info_from_type( md_alg ) );
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> tls13 handshake key schedule" ) );
+
+    if( ( ret = ssl_tls13_early_secret( md_alg,
+                    hs->resume ? ssl->session_negotiate->master : NULL,
+                    psk_len, hs->tls13_secret ) ) != 0 ||
+        ( ret = ssl_tls13_next_secret( md_alg, hs->tls13_secret,
+                                       hs->premaster, hs->pmslen ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_transcript_hash( ssl, md_alg, NULL, 0,
+                                                   transcript ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_derive_secret( md_alg, hs->tls13_secret,
+                    "c hs traffic", transcript, hs->client_hs_secret ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_derive_secret( md_alg, hs->tls13_secret,
+                    "s hs traffic", transcript, hs->server_hs_secret ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "tls13 handshake secret", ret );
+        return( ret );
+    }
+
+    mbedtls_zeroize( hs->premaster, sizeof( hs->premaster ) );
+
+    if( ( ret = ssl_tls13_set_traffic_keys( ssl, ssl->transform_negotiate,
+                                            hs->client_hs_secret,
+                                            hs->server_hs_secret ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "switching to handshake traffic keys" ) );
+
+    ssl->transform_in  = ssl->transform_negotiate;
+    ssl->transform_out = ssl->transform_negotiate;
+    ssl->session_in  = ssl->session_negotiate;
+    ssl->session_out = ssl->session_negotiate;
+    memset( ssl->in_ctr, 0, 8 );
+    memset( ssl->out_ctr, 0, 8 );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= tls13 handshake key schedule" ) );
+
+    return( 0 );
+}
+
+/*
+ * Master Secret and the application traffic keys, once the server Finished
+ * has been added to the transcript. The keys are installed separately, see
+ * mbedtls_ssl_tls13_activate_application_keys().
+ */
+int mbedtls_ssl_tls13_key_schedule_application( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    mbedtls_ssl_handshake_params *hs = ssl->handshake;
+    mbedtls_md_type_t md_alg = ssl->transform_negotiate->ciphersuite_info->mac;
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+    unsigned char client_secret[MBEDTLS_MD_MAX_SIZE];
+    unsigned char server_secret[MBEDTLS_MD_MAX_SIZE];
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> tls13 application key schedule" ) );
+
+    if( hs->transform_application != NULL )
+        return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+
+    if( ( hs->transform_application =
+                mbedtls_calloc( 1, sizeof( mbedtls_ssl_transform ) ) ) == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "alloc(%d bytes) failed",
+                                    sizeof( mbedtls_ssl_transform ) ) );
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+
+    mbedtls_ssl_transform_init( hs->transform_application );
+
+    if( ( ret = ssl_tls13_next_secret( md_alg, hs->tls13_secret,
+                                       NULL, 0 ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_transcript_hash( ssl, md_alg, NULL, 0,
+                                                   transcript ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_derive_secret( md_alg, hs->tls13_secret,
+                    "c ap traffic", transcript, client_secret ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_derive_secret( md_alg, hs->tls13_secret,
+                    "s ap traffic", transcript, server_secret ) ) != 0 ||
+        ( ret = ssl_tls13_set_traffic_keys( ssl, hs->transform_application,
+                                            client_secret, server_secret ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "tls13 master secret", ret );
+        goto exit;
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= tls13 application key schedule" ) );
+
+exit:
+    mbedtls_zeroize( client_secret, sizeof( client_secret ) );
+    mbedtls_zeroize( server_secret, sizeof( server_secret ) );
+
+    return( ret );
+}
+
+/*
+ * resumption_master_secret, once the client Finished has been added to the
+ * transcript: the PSKs of the tickets sent after the handshake derive
+ * from it
+ */
+int mbedtls_ssl_tls13_key_schedule_resumption( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    mbedtls_md_type_t md_alg = ssl->transform_negotiate->ciphersuite_info->mac;
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+
+    if( ( ret = mbedtls_ssl_tls13_transcript_hash( ssl, md_alg, NULL, 0,
+                                                   transcript ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    return( mbedtls_ssl_tls13_derive_secret( md_alg, ssl->handshake->tls13_secret,
+                "res master", transcript,
+                ssl->handshake->transform_application->resumption_master ) );
+}
+
+void mbedtls_ssl_tls13_activate_application_keys( mbedtls_ssl_context *ssl,
+                                                  int inbound )
+{
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "switching to application traffic keys for %s data",
+                                inbound ? "inbound" : "outbound" ) );
+
+    if( inbound )
+    {
+        ssl->transform_in = ssl->handshake->transform_application;
+        memset( ssl->in_ctr, 0, 8 );
+    }
+    else
+    {
+        ssl->transform_out = ssl->handshake->transform_application;
+        memset( ssl->out_ctr, 0, 8 );
+    }
+}
+
+/*
+ * Only the application traffic keys outlive a TLS 1.3 handshake: they
+ * become the transform of the session before the generic wrapup.
+ */
+void mbedtls_ssl_tls13_handshake_wrapup( mbedtls_ssl_context *ssl )
+{
+    mbedtls_ssl_handshake_params *hs = ssl->handshake;
+
+    mbedtls_ssl_transform_free( ssl->transform_negotiate );
+    mbedtls_free( ssl->transform_negotiate );
+    ssl->transform_negotiate = hs->transform_application;
+    hs->transform_application = NULL;
+
+    mbedtls_zeroize( hs->tls13_secret, sizeof( hs->tls13_secret ) );
+    mbedtls_zeroize( hs->client_hs_secret, sizeof( hs->client_hs_secret ) );
+    mbedtls_zeroize( hs->server_hs_secret, sizeof( hs->server_hs_secret ) );
+
+    /* Sessions are resumed with tickets only, never from the cache */
+    ssl->session_negotiate->id_len = 0;
+
+    mbedtls_ssl_handshake_wrapup( ssl );
+}
+
+/*
+ * Key shares
+ */
+
+/* The groups we can do key shares with: those of mbedtls_ecdh */
+int mbedtls_ssl_tls13_group_supported( mbedtls_ecp_group_id grp_id )
+{
+    switch( grp_id )
+    {
+        case MBEDTLS_ECP_DP_SECP256R1:
+        case MBEDTLS_ECP_DP_SECP384R1:
+        case MBEDTLS_ECP_DP_SECP521R1:
+            return( mbedtls_ecp_curve_info_from_grp_id( grp_id ) != NULL );
+        default:
+            return( 0 );
+    }
+}
+
+/*
+ * Generate a fresh key pair in grp_id and write it as a KeyShareEntry
+ *
+ * struct {
+ *     NamedGroup group;
+ *     opaque key_exchange<1..2^16-1>;
+ * } KeyShareEntry;
+ */
+int mbedtls_ssl_tls13_write_key_share( mbedtls_ssl_context *ssl,
+                                       mbedtls_ecp_group_id grp_id,
+                                       unsigned char *buf, const unsigned char *end,
+                                       size_t *olen )
+{
+    int ret;
+    mbedtls_ecdh_context *ecdh = &ssl->handshake->ecdh_ctx;
+    const mbedtls_ecp_curve_info *info = mbedtls_ecp_curve_info_from_grp_id( grp_id );
+    size_t len;
+
+    *olen = 0;
+
+    if( info == NULL || end - buf < 4 )
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+
+    if( ecdh->grp.id != grp_id )
+    {
+        mbedtls_ecdh_free( ecdh );
+        mbedtls_ecdh_init( ecdh );
+
+        if( ( ret = mbedtls_ecp_group_load( &ecdh->grp, grp_id ) ) != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ecp_group_load", ret );
+            return( ret );
+        }
+    }
+
+    if( ( ret = mbedtls_ecdh_gen_public( &ecdh->grp, &ecdh->d, &ecdh->Q,
+                                         ssl->conf->f_rng, ssl->conf->p_rng ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ecdh_gen_public", ret );
+        return( ret );
+    }
+
+    if( ( ret = mbedtls_ecp_point_write_binary( &ecdh->grp, &ecdh->Q,
+                                                MBEDTLS_ECP_PF_UNCOMPRESSED,
+                                                &len, buf + 4,
+                                                end - buf - 4 ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ecp_point_write_binary", ret );
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_ECP( 3, "ECDHE: Q ", &ecdh->Q );
+
+    buf[0] = (unsigned char)( info->tls_id >> 8 );
+    buf[1] = (unsigned char)( info->tls_id      );
+    buf[2] = (unsigned char)( len >> 8 );
+    buf[3] = (unsigned char)( len      );
+
+    ssl->handshake->tls13_group = grp_id;
+    *olen = 4 + len;
+
+    return( 0 );
+}
+
+/*
+ * Read the peer's key_exchange for ssl->handshake->tls13_group
+ */
+int mbedtls_ssl_tls13_read_key_share( mbedtls_ssl_context *ssl,
+                                      const unsigned char *buf, size_t len )
+{
+    int ret;
+    mbedtls_ecdh_context *ecdh = &ssl->handshake->ecdh_ctx;
+
+    if( ecdh->grp.id != ssl->handshake->tls13_group )
+    {
+        mbedtls_ecdh_free( ecdh );
+        mbedtls_ecdh_init( ecdh );
+
+        if( ( ret = mbedtls_ecp_group_load( &ecdh->grp,
+                                            ssl->handshake->tls13_group ) ) != 0 )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ecp_group_load", ret );
+            return( ret );
+        }
+    }
+
+    /* Only the uncompressed format is allowed, RFC 8446 4.2.8.2 */
+    if( len == 0 || buf[0] != 0x04 ||
+        ( ret = mbedtls_ecp_point_read_binary( &ecdh->grp, &ecdh->Qp,
+                                               buf, len ) ) != 0 ||
+        ( ret = mbedtls_ecp_check_pubkey( &ecdh->grp, &ecdh->Qp ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad key share" ) );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CLIENT_KEY_EXCHANGE );
+    }
+
+    MBEDTLS_SSL_DEBUG_ECP( 3, "ECDHE: Qp ", &ecdh->Qp );
+
+    return( 0 );
+}
+
+/*
+ * Shared secret of our key share and the peer's, as IKM of the Handshake
+ * Secret
+ */
+int mbedtls_ssl_tls13_ecdhe_shared_secret( mbedtls_ssl_context *ssl )
+{
+    int ret;
+
+    if( ( ret = mbedtls_ecdh_calc_secret( &ssl->handshake->ecdh_ctx,
+                                          &ssl->handshake->pmslen,
+                                          ssl->handshake->premaster,
+                                          MBEDTLS_MPI_MAX_SIZE,
+                                          ssl->conf->f_rng, ssl->conf->p_rng ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ecdh_calc_secret", ret );
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_MPI( 3, "ECDHE: z", &ssl->handshake->ecdh_ctx.z );
+
+    return( 0 );
+}
+
+/*
+ * Signature schemes
+ */
+typedef struct
+{
+    uint16_t scheme;
+    mbedtls_md_type_t md;
+    mbedtls_pk_type_t pk;
+    mbedtls_ecp_group_id grp;           /* ECDSA schemes name their curve */
+}
+ssl_tls13_sig_scheme_t;
+
+/* In order of preference */
+static const ssl_tls13_sig_scheme_t ssl_tls13_sig_schemes[] =
+{
+#if defined(MBEDTLS_ECDSA_C)
+    { MBEDTLS_TLS13_SIG_ECDSA_SECP256R1_SHA256, MBEDTLS_MD_SHA256,
+      MBEDTLS_PK_ECDSA, MBEDTLS_ECP_DP_SECP256R1 },
+#if defined(MBEDTLS_SHA512_C)
+    { MBEDTLS_TLS13_SIG_ECDSA_SECP384R1_SHA384, MBEDTLS_MD_SHA384,
+      MBEDTLS_PK_ECDSA, MBEDTLS_ECP_DP_SECP384R1 },
+    { MBEDTLS_TLS13_SIG_ECDSA_SECP521R1_SHA512, MBEDTLS_MD_SHA512,
+      MBEDTLS_PK_ECDSA, MBEDTLS_ECP_DP_SECP521R1 },
+#endif
+#endif /* MBEDTLS_ECDSA_C */
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_PKCS1_V21)
+    { MBEDTLS_TLS13_SIG_RSA_PSS_RSAE_SHA256, MBEDTLS_MD_SHA256,
+      MBEDTLS_PK_RSASSA_PSS, MBEDTLS_ECP_DP_NONE },
+#if defined(MBEDTLS_SHA512_C)
+    { MBEDTLS_TLS13_SIG_RSA_PSS_RSAE_SHA384, MBEDTLS_MD_SHA384,
+      MBEDTLS_PK_RSASSA_PSS, MBEDTLS_ECP_DP_NONE },
+    { MBEDTLS_TLS13_SIG_RSA_PSS_RSAE_SHA512, MBEDTLS_MD_SHA512,
+      MBEDTLS_PK_RSASSA_PSS, MBEDTLS_ECP_DP_NONE },
+#endif
+#endif /* MBEDTLS_RSA_C && MBEDTLS_PKCS1_V21 */
+    { 0, MBEDTLS_MD_NONE, MBEDTLS_PK_NONE, MBEDTLS_ECP_DP_NONE }
+};
+
+static const ssl_tls13_sig_scheme_t *ssl_tls13_sig_scheme_from_id( uint16_t scheme )
+{
+    const ssl_tls13_sig_scheme_t *cur;
+
+    for( cur = ssl_tls13_sig_schemes; cur->scheme != 0; cur++ )
+        if( cur->scheme == scheme )
+            return( cur );
+
+    return( NULL );
+}
+
+/* Is the hash of this scheme one of our configured signature hashes? */
+static int ssl_tls13_sig_scheme_allowed( const mbedtls_ssl_context *ssl,
+                                         const ssl_tls13_sig_scheme_t *cur )
+{
+    const int *md;
+
+    for( md = ssl->conf->sig_hashes; *md != MBEDTLS_MD_NONE; md++ )
+        if( *md == (int) cur->md )
+            return( 1 );
+
+    return( 0 );
+}
+
+/* Can a key make or check signatures with this scheme? */
+static int ssl_tls13_sig_scheme_fits_key( const ssl_tls13_sig_scheme_t *cur,
+                                          const mbedtls_pk_context *pk )
+{
+#if defined(MBEDTLS_ECDSA_C)
+    if( cur->pk == MBEDTLS_PK_ECDSA )
+    {
+        return( mbedtls_pk_can_do( pk, MBEDTLS_PK_ECDSA ) &&
+                mbedtls_pk_ec( *pk )->grp.id == cur->grp );
+    }
+#endif
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_PKCS1_V21)
+    /* PSS padding needs direct access to the RSA context */
+    if( cur->pk == MBEDTLS_PK_RSASSA_PSS )
+        return( mbedtls_pk_get_type( pk ) == MBEDTLS_PK_RSA );
+#endif
+
+    ((void) pk);
+    return( 0 );
+}
+
+/* Bit of a scheme in the handshake's tls13_sig_schemes, 0 if unknown */
+uint32_t mbedtls_ssl_tls13_sig_scheme_bit( uint16_t scheme )
+{
+    const ssl_tls13_sig_scheme_t *cur;
+
+    for( cur = ssl_tls13_sig_schemes; cur->scheme != 0; cur++ )
+        if( cur->scheme == scheme )
+            return( (uint32_t) 1 << ( cur - ssl_tls13_sig_schemes ) );
+
+    return( 0 );
+}
+
+/*
+ * signature_algorithms extension of a CertificateRequest: the schemes we
+ * accept in the client's CertificateVerify
+ */
+int mbedtls_ssl_tls13_write_sig_algs( mbedtls_ssl_context *ssl,
+                                      unsigned char *buf, const unsigned char *end,
+                                      size_t *olen )
+{
+    const ssl_tls13_sig_scheme_t *cur;
+    unsigned char *p = buf + 6;
+    size_t len;
+
+    *olen = 0;
+
+    for( cur = ssl_tls13_sig_schemes; cur->scheme != 0; cur++ )
+    {
+        if( ! ssl_tls13_sig_scheme_allowed( ssl, cur ) )
+            continue;
+
+        if( end - p < 2 )
+            return( MBEDTLS_ERR_SSL_BUFFER_TOO_SMALL );
+
+        *p++ = (unsigned char)( cur->scheme >> 8 );
+        *p++ = (unsigned char)( cur->scheme      );
+    }
+
+    len = p - buf - 6;
+    if( len == 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "no TLS 1.3 signature scheme configured" ) );
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    buf[0] = (unsigned char)( MBEDTLS_TLS_EXT_SIG_ALG >> 8 );
+    buf[1] = (unsigned char)( MBEDTLS_TLS_EXT_SIG_ALG      );
+    buf[2] = (unsigned char)( ( len + 2 ) >> 8 );
+    buf[3] = (unsigned char)( ( len + 2 )      );
+    buf[4] = (unsigned char)( len >> 8 );
+    buf[5] = (unsigned char)( len      );
+
+    *olen = 6 + len;
+
+    return( 0 );
+}
+
+/*
+ * Remember which of the peer's signature schemes we'd accept as well
+ */
+int mbedtls_ssl_tls13_parse_sig_algs( mbedtls_ssl_context *ssl,
+                                      const unsigned char *buf, size_t len )
+{
+    const ssl_tls13_sig_scheme_t *cur;
+    size_t list_len, i;
+
+    if( len < 2 )
+        return( MBEDTLS_ERR_SSL_BAD_HS_CLIENT_HELLO );
+
+    list_len = ( buf[0] << 8 ) | buf[1];
+    if( list_len + 2 != len || list_len % 2 != 0 )
+        return( MBEDTLS_ERR_SSL_BAD_HS_CLIENT_HELLO );
+
+    ssl->handshake->tls13_sig_schemes = 0;
+
+    for( i = 2; i < len; i += 2 )
+    {
+        cur = ssl_tls13_sig_scheme_from_id( ( buf[i] << 8 ) | buf[i + 1] );
+        if( cur == NULL || ! ssl_tls13_sig_scheme_allowed( ssl, cur ) )
+            continue;
+
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "peer offers signature scheme %04x",
+                                    cur->scheme ) );
+
+        ssl->handshake->tls13_sig_schemes |=
+            mbedtls_ssl_tls13_sig_scheme_bit( cur->scheme );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Our preferred scheme among the peer's for this key, 0 if none
+ */
+uint16_t mbedtls_ssl_tls13_pick_sig_scheme( const mbedtls_ssl_context *ssl,
+                                            const mbedtls_pk_context *pk )
+{
+    const ssl_tls13_sig_scheme_t *cur;
+
+    for( cur = ssl_tls13_sig_schemes; cur->scheme != 0; cur++ )
+    {
+        if( ( ssl->handshake->tls13_sig_schemes &
+              mbedtls_ssl_tls13_sig_scheme_bit( cur->scheme ) ) != 0 &&
+            ssl_tls13_sig_scheme_fits_key( cur, pk ) )
+        {
+            return( cur->scheme );
+        }
+    }
+
+    return( 0 );
+}
+
+/*
+ * Certificate
+ */
+
+/*
+ * The generic certificate functions know the TLS 1.3 format; they only
+ * step to the wrong state afterwards. Like the other TLS 1.3 message
+ * functions below, the wrappers take the state that follows.
+ */
+int mbedtls_ssl_tls13_write_certificate( mbedtls_ssl_context *ssl, int next )
+{
+    int ret, state = ssl->state;
+
+    ret = mbedtls_ssl_write_certificate( ssl );
+
+    if( ssl->state != state )
+        ssl->state = next;
+
+    return( ret );
+}
+
+int mbedtls_ssl_tls13_parse_certificate( mbedtls_ssl_context *ssl, int next )
+{
+    int ret, state = ssl->state;
+
+    ret = mbedtls_ssl_parse_certificate( ssl );
+
+    if( ssl->state != state )
+        ssl->state = next;
+
+    return( ret );
+}
+
+/*
+ * CertificateVerify
+ *
+ * The signed content is 64 spaces, a context string, a zero byte and the
+ * transcript hash, RFC 8446 4.4.3
+ */
+static int ssl_tls13_certificate_verify_hash( mbedtls_ssl_context *ssl,
+                                              int from,
+                                              const unsigned char *transcript,
+                                              const ssl_tls13_sig_scheme_t *cur,
+                                              unsigned char *hash,
+                                              size_t *hash_len )
+{
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type(
+                                ssl->transform_negotiate->ciphersuite_info->mac );
+    const char *context = ( from == MBEDTLS_SSL_IS_CLIENT )
+                          ? "TLS 1.3, client CertificateVerify"
+                          : "TLS 1.3, server CertificateVerify";
+    unsigned char content[64 + 33 + 1 + MBEDTLS_MD_MAX_SIZE];
+    size_t hlen = mbedtls_md_get_size( md_info );
+
+    memset( content, 0x20, 64 );
+    memcpy( content + 64, context, 33 );
+    content[64 + 33] = 0;
+    memcpy( content + 64 + 33 + 1, transcript, hlen );
+
+    md_info = mbedtls_md_info_from_type( cur->md );
+    *hash_len = mbedtls_md_get_size( md_info );
+
+    return( mbedtls_md( md_info, content, 64 + 33 + 1 + hlen, hash ) );
+}
+
+int mbedtls_ssl_tls13_write_certificate_verify( mbedtls_ssl_context *ssl, int next )
+{
+    int ret;
+    mbedtls_pk_context *pk = mbedtls_ssl_own_key( ssl );
+    const ssl_tls13_sig_scheme_t *cur;
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+    unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+    size_t hash_len, sig_len;
+    unsigned char *p = ssl->out_msg + 4;
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_PKCS1_V21)
+    int padding = 0, hash_id = 0;
+#endif
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> write certificate verify" ) );
+
+    if( pk == NULL ||
+        ( cur = ssl_tls13_sig_scheme_from_id(
+                    mbedtls_ssl_tls13_pick_sig_scheme( ssl, pk ) ) ) == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "no signature scheme for our key" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_HANDSHAKE_FAILURE );
+        return( MBEDTLS_ERR_SSL_PRIVATE_KEY_REQUIRED );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "signature scheme: %04x", cur->scheme ) );
+
+    if( ( ret = mbedtls_ssl_tls13_transcript_hash( ssl,
+                    ssl->transform_negotiate->ciphersuite_info->mac,
+                    NULL, 0, transcript ) ) != 0 ||
+        ( ret = ssl_tls13_certificate_verify_hash( ssl, ssl->conf->endpoint,
+                    transcript, cur, hash, &hash_len ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    /*
+     * struct {
+     *     SignatureScheme algorithm;
+     *     opaque signature<0..2^16-1>;
+     * } CertificateVerify;
+     */
+    p[0] = (unsigned char)( cur->scheme >> 8 );
+    p[1] = (unsigned char)( cur->scheme      );
+
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_PKCS1_V21)
+    /* mbedtls_pk_sign() follows the padding mode of the RSA context */
+    if( cur->pk == MBEDTLS_PK_RSASSA_PSS )
+    {
+        padding = mbedtls_pk_rsa( *pk )->padding;
+        hash_id = mbedtls_pk_rsa( *pk )->hash_id;
+        mbedtls_rsa_set_padding( mbedtls_pk_rsa( *pk ), MBEDTLS_RSA_PKCS_V21,
+                                 cur->md );
+    }
+#endif
+
+    ret = mbedtls_pk_sign( pk, cur->md, hash, hash_len, p + 4, &sig_len,
+                           ssl->conf->f_rng, ssl->conf->p_rng );
+
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_PKCS1_V21)
+    if( cur->pk == MBEDTLS_PK_RSASSA_PSS )
+        mbedtls_rsa_set_padding( mbedtls_pk_rsa( *pk ), padding, hash_id );
+#endif
+
+    if( ret != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_pk_sign", ret );
+        return( ret );
+    }
+
+    p[2] = (unsigned char)( sig_len >> 8 );
+    p[3] = (unsigned char)( sig_len      );
+
+    ssl->out_msglen  = 4 + 4 + sig_len;
+    ssl->out_msgtype = MBEDTLS_SSL_MSG_HANDSHAKE;
+    ssl->out_msg[0]  = MBEDTLS_SSL_HS_CERTIFICATE_VERIFY;
+
+    ssl->state = next;
+
+    if( ( ret = mbedtls_ssl_write_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_write_record", ret );
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write certificate verify" ) );
+
+    return( 0 );
+}
+
+int mbedtls_ssl_tls13_parse_certificate_verify( mbedtls_ssl_context *ssl, int next )
+{
+    int ret;
+    const ssl_tls13_sig_scheme_t *cur;
+    mbedtls_pk_context *pk;
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+    unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+    size_t hash_len, sig_len;
+    const unsigned char *p;
+    uint16_t scheme;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse certificate verify" ) );
+
+    /* The signed transcript ends right before this message */
+    if( ( ret = mbedtls_ssl_tls13_transcript_hash( ssl,
+                    ssl->transform_negotiate->ciphersuite_info->mac,
+                    NULL, 0, transcript ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    if( ( ret = mbedtls_ssl_read_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record", ret );
+        return( ret );
+    }
+
+    if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE ||
+        ssl->in_msg[0] != MBEDTLS_SSL_HS_CERTIFICATE_VERIFY )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate verify message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+    }
+
+    p = ssl->in_msg + 4;
+
+    if( ssl->in_hslen < 4 + 4 ||
+        ( sig_len = ( p[2] << 8 ) | p[3] ) != ssl->in_hslen - 4 - 4 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad certificate verify message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE_VERIFY );
+    }
+
+    scheme = ( p[0] << 8 ) | p[1];
+    pk = &ssl->session_negotiate->peer_cert->pk;
+
+    /* Only schemes we offered, for the key of the certificate */
+    if( ( cur = ssl_tls13_sig_scheme_from_id( scheme ) ) == NULL ||
+        ! ssl_tls13_sig_scheme_allowed( ssl, cur ) ||
+        ! ssl_tls13_sig_scheme_fits_key( cur, pk ) )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad signature scheme %04x", scheme ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_ILLEGAL_PARAMETER );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE_VERIFY );
+    }
+
+    if( ( ret = ssl_tls13_certificate_verify_hash( ssl,
+                    ssl->conf->endpoint ^ 1, transcript, cur,
+                    hash, &hash_len ) ) != 0 )
+    {
+        return( ret );
+    }
+
+#if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_PKCS1_V21)
+    if( cur->pk == MBEDTLS_PK_RSASSA_PSS )
+    {
+        mbedtls_pk_rsassa_pss_options opts;
+
+        opts.mgf1_hash_id = cur->md;
+        opts.expected_salt_len = (int) hash_len;
+
+        ret = mbedtls_pk_verify_ext( MBEDTLS_PK_RSASSA_PSS, &opts, pk, cur->md,
+                                     hash, hash_len, p + 4, sig_len );
+    }
+    else
+#endif
+        ret = mbedtls_pk_verify( pk, cur->md, hash, hash_len, p + 4, sig_len );
+
+    if( ret != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_pk_verify", ret );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECRYPT_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_CERTIFICATE_VERIFY );
+    }
+
+    ssl->state = next;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse certificate verify" ) );
+
+    return( 0 );
+}
+
+/*
+ * Finished
+ *
+ * verify_data = HMAC( HKDF-Expand-Label( BaseKey, "finished", "", Hash.length ),
+ *                     Transcript-Hash( Handshake Context ) )
+ *
+ * with the handshake traffic secret of the sender as BaseKey
+ */
+static int ssl_tls13_calc_finished( mbedtls_ssl_context *ssl, int from,
+                                    unsigned char *out, size_t *out_len )
+{
+    int ret;
+    mbedtls_md_type_t md_alg = ssl->transform_negotiate->ciphersuite_info->mac;
+    const mbedtls_md_info_t *md_info = mbedtls_md_info_from_type( md_alg );
+    size_t hlen = mbedtls_md_get_size( md_info );
+    unsigned char key[MBEDTLS_MD_MAX_SIZE];
+    unsigned char transcript[MBEDTLS_MD_MAX_SIZE];
+
+    if( ( ret = mbedtls_ssl_tls13_expand_label( md_alg,
+                    from == MBEDTLS_SSL_IS_CLIENT ? ssl->handshake->client_hs_secret
+                                                  : ssl->handshake->server_hs_secret,
+                    "finished", NULL, 0, key, hlen ) ) != 0 ||
+        ( ret = mbedtls_ssl_tls13_transcript_hash( ssl, md_alg, NULL, 0,
+                                                   transcript ) ) != 0 )
+    {
+        goto exit;
+    }
+
+    ret = mbedtls_md_hmac( md_info, key, hlen, transcript, hlen, out );
+    *out_len = hlen;
+
+exit:
+    mbedtls_zeroize( key, sizeof( key ) );
+
+    return( ret );
+}
+
+int mbedtls_ssl_tls13_write_finished( mbedtls_ssl_context *ssl, int next )
+{
+    int ret;
+    size_t len;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> write finished" ) );
+
+    if( ( ret = ssl_tls13_calc_finished( ssl, ssl->conf->endpoint,
+                                         ssl->out_msg + 4, &len ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "ssl_tls13_calc_finished", ret );
+        return( ret );
+    }
+
+    ssl->out_msglen  = 4 + len;
+    ssl->out_msgtype = MBEDTLS_SSL_MSG_HANDSHAKE;
+    ssl->out_msg[0]  = MBEDTLS_SSL_HS_FINISHED;
+
+    ssl->state = next;
+
+    if( ( ret = mbedtls_ssl_write_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_write_record", ret );
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write finished" ) );
+
+    return( 0 );
+}
+
+int mbedtls_ssl_tls13_parse_finished( mbedtls_ssl_context *ssl, int next )
+{
+    int ret;
+    unsigned char expected[MBEDTLS_MD_MAX_SIZE];
+    size_t len;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse finished" ) );
+
+    /* Over the transcript up to, not including, this message */
+    if( ( ret = ssl_tls13_calc_finished( ssl, ssl->conf->endpoint ^ 1,
+                                         expected, &len ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "ssl_tls13_calc_finished", ret );
+        return( ret );
+    }
+
+    if( ( ret = mbedtls_ssl_read_record( ssl ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_read_record", ret );
+        return( ret );
+    }
+
+    if( ssl->in_msgtype != MBEDTLS_SSL_MSG_HANDSHAKE ||
+        ssl->in_msg[0] != MBEDTLS_SSL_HS_FINISHED )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad finished message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+    }
+
+    if( ssl->in_hslen != 4 + len )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad finished message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_FINISHED );
+    }
+
+    if( mbedtls_ssl_safer_memcmp( ssl->in_msg + 4, expected, len ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad finished message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECRYPT_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_HS_FINISHED );
+    }
+
+    /* Nothing may follow Finished under the same keys */
+    if( ssl->in_msglen != ssl->in_hslen )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "data after finished message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+    }
+
+    ssl->state = next;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse finished" ) );
+
+    return( 0 );
+}
+
+/*
+ * Post-handshake messages
+ */
+
+#if defined(MBEDTLS_SSL_CLI_C) && defined(MBEDTLS_SSL_SESSION_TICKETS)
+/*
+ * struct {
+ *     uint32 ticket_lifetime;
+ *     uint32 ticket_age_add;
+ *     opaque ticket_nonce<0..255>;
+ *     opaque ticket<1..2^16-1>;
+ *     Extension extensions<0..2^16-2>;
+ * } NewSessionTicket;
+ */
+static int ssl_tls13_parse_new_session_ticket( mbedtls_ssl_context *ssl )
+{
+    int ret;
+    const unsigned char *p = ssl->in_msg + 4;
+    const unsigned char *end = ssl->in_msg + ssl->in_hslen;
+    const unsigned char *nonce, *ticket;
+    size_t nonce_len, ticket_len, ext_len;
+    uint32_t lifetime, age_add;
+    unsigned char *copy;
+    mbedtls_ssl_session *session = ssl->session;
+    mbedtls_md_type_t md_alg = ssl->transform->ciphersuite_info->mac;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse new session ticket" ) );
+
+    if( end - p < 4 + 4 + 1 )
+        goto bad_msg;
+
+    lifetime = ( (uint32_t) p[0] << 24 ) | ( (uint32_t) p[1] << 16 ) |
+               ( (uint32_t) p[2] <<  8 ) | ( (uint32_t) p[3]       );
+    age_add  = ( (uint32_t) p[4] << 24 ) | ( (uint32_t) p[5] << 16 ) |
+               ( (uint32_t) p[6] <<  8 ) | ( (uint32_t) p[7]       );
+    nonce_len = p[8];
+    p += 9;
+
+    if( (size_t)( end - p ) < nonce_len + 2 )
+        goto bad_msg;
+    nonce = p;
+    p += nonce_len;
+
+    ticket_len = ( p[0] << 8 ) | p[1];
+    p += 2;
+    if( ticket_len == 0 || (size_t)( end - p ) < ticket_len + 2 )
+        goto bad_msg;
+    ticket = p;
+    p += ticket_len;
+
+    ext_len = ( p[0] << 8 ) | p[1];
+    p += 2;
+    if( (size_t)( end - p ) != ext_len )
+        goto bad_msg;
+
+    MBEDTLS_SSL_DEBUG_MSG( 3, ( "ticket lifetime: %u, length: %d",
+                                (unsigned) lifetime, ticket_len ) );
+
+    /* RFC 8446 4.6.1: at most seven days */
+    if( ssl->conf->session_tickets == MBEDTLS_SSL_SESSION_TICKETS_DISABLED ||
+        lifetime == 0 || lifetime > 604800 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 3, ( "ignoring ticket" ) );
+        return( 0 );
+    }
+
+    if( ( copy = mbedtls_calloc( 1, ticket_len ) ) == NULL )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "ticket alloc failed" ) );
+        return( MBEDTLS_ERR_SSL_ALLOC_FAILED );
+    }
+    memcpy( copy, ticket, ticket_len );
+
+    /* Replace the previous ticket, if any */
+    if( session->ticket != NULL )
+    {
+        mbedtls_zeroize( session->ticket, session->ticket_len );
+        mbedtls_free( session->ticket );
+    }
+
+    session->ticket = copy;
+    session->ticket_len = ticket_len;
+    session->ticket_lifetime = lifetime;
+    session->ticket_age_add = age_add;
+#if defined(MBEDTLS_HAVE_TIME)
+    session->start = mbedtls_time( NULL );
+#endif
+
+    /* PSK = HKDF-Expand-Label( resumption_master_secret, "resumption",
+     *                          ticket_nonce, Hash.length ) */
+    if( ( ret = mbedtls_ssl_tls13_expand_label( md_alg,
+                    ssl->transform->resumption_master, "resumption",
+                    nonce, nonce_len, session->master,
+                    mbedtls_md_get_size( mbedtls_md_info_from_type( md_alg ) ) ) ) != 0 )
+    {
+        MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_tls13_expand_label", ret );
+        return( ret );
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse new session ticket" ) );
+
+    return( 0 );
+
+bad_msg:
+    MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad new session ticket message" ) );
+    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                    MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+    return( MBEDTLS_ERR_SSL_BAD_HS_NEW_SESSION_TICKET );
+}
+#endif /* MBEDTLS_SSL_CLI_C && MBEDTLS_SSL_SESSION_TICKETS */
+
+/*
+ * application_traffic_secret_N+1 =
+ *     HKDF-Expand-Label( application_traffic_secret_N, "traffic upd", "", Hash.length )
+ */
+static int ssl_tls13_update_traffic_key( mbedtls_ssl_transform *transform,
+                                         int encrypt )
+{
+    int ret;
+    mbedtls_md_type_t md_alg = transform->ciphersuite_info->mac;
+    unsigned char *secret = encrypt ? transform->traffic_secret_enc
+                                    : transform->traffic_secret_dec;
+    unsigned char next[MBEDTLS_MD_MAX_SIZE];
+
+    if( ( ret = mbedtls_ssl_tls13_expand_label( md_alg, secret, "traffic upd",
+                    NULL, 0, next,
+                    mbedtls_md_get_size( mbedtls_md_info_from_type( md_alg ) ) ) ) == 0 )
+    {
+        ret = ssl_tls13_set_traffic_key( transform, next, encrypt );
+    }
+
+    mbedtls_zeroize( next, sizeof( next ) );
+
+    return( ret );
+}
+
+/*
+ * enum { update_not_requested(0), update_requested(1), (255) } KeyUpdateRequest;
+ */
+static int ssl_tls13_parse_key_update( mbedtls_ssl_context *ssl )
+{
+    int ret;
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> parse key update" ) );
+
+    if( ssl->in_hslen != 4 + 1 || ssl->in_msg[4] > 1 )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "bad key update message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_DECODE_ERROR );
+        return( MBEDTLS_ERR_SSL_BAD_INPUT_DATA );
+    }
+
+    /* The new keys apply from the next record on */
+    if( ssl->in_msglen != ssl->in_hslen )
+    {
+        MBEDTLS_SSL_DEBUG_MSG( 1, ( "data after key update message" ) );
+        mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                        MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+        return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+    }
+
+    if( ( ret = ssl_tls13_update_traffic_key( ssl->transform_in, 0 ) ) != 0 )
+        return( ret );
+
+    memset( ssl->in_ctr, 0, 8 );
+
+    MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= parse key update" ) );
+
+    if( ssl->in_msg[4] == 0 )
+        return( 0 );
+
+    /* Written now, or by the next mbedtls_ssl_read() or mbedtls_ssl_write()
+     * if the output is busy */
+    ssl->key_update_pending = MBEDTLS_SSL_KEY_UPDATE_TO_WRITE;
+
+    return( mbedtls_ssl_tls13_write_key_update( ssl ) );
+}
+
+/*
+ * Answer a KeyUpdate that requested it, under the current keys, then
+ * update ours
+ */
+int mbedtls_ssl_tls13_write_key_update( mbedtls_ssl_context *ssl )
+{
+    int ret;
+
+    if( ssl->key_update_pending == MBEDTLS_SSL_KEY_UPDATE_TO_WRITE )
+    {
+        /*
+         * A record of the application still being sent is flushed by the
+         * mbedtls_ssl_write() call that repeats it: wait for it.
+         */
+        if( ssl->out_left != 0 )
+            return( 0 );
+
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "=> write key update" ) );
+
+        ssl->out_msglen  = 4 + 1;
+        ssl->out_msgtype = MBEDTLS_SSL_MSG_HANDSHAKE;
+        ssl->out_msg[0]  = MBEDTLS_SSL_HS_KEY_UPDATE;
+        ssl->out_msg[4]  = 0;
+
+        /* WANT_WRITE only comes from sending the protected record */
+        ret = mbedtls_ssl_write_record( ssl );
+        if( ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE )
+        {
+            MBEDTLS_SSL_DEBUG_RET( 1, "mbedtls_ssl_write_record", ret );
+            return( ret );
+        }
+
+        ssl->key_update_pending = MBEDTLS_SSL_KEY_UPDATE_SENDING;
+    }
+
+    /*
+     * The output buffer must be free for the next mbedtls_ssl_write(), and
+     * mbedtls_ssl_flush_output() only steps the counter of the old keys once
+     * the record is entirely sent
+     */
+    if( ssl->key_update_pending == MBEDTLS_SSL_KEY_UPDATE_SENDING )
+    {
+        if( ( ret = mbedtls_ssl_flush_output( ssl ) ) != 0 )
+            return( ret );
+
+        /* The following records use the new keys */
+        if( ( ret = ssl_tls13_update_traffic_key( ssl->transform_out, 1 ) ) != 0 )
+            return( ret );
+
+        memset( ssl->out_ctr, 0, 8 );
+
+        ssl->key_update_pending = 0;
+
+        MBEDTLS_SSL_DEBUG_MSG( 2, ( "<= write key update" ) );
+    }
+
+    return( 0 );
+}
+
+int mbedtls_ssl_tls13_process_post_handshake( mbedtls_ssl_context *ssl )
+{
+    switch( ssl->in_msg[0] )
+    {
+#if defined(MBEDTLS_SSL_CLI_C) && defined(MBEDTLS_SSL_SESSION_TICKETS)
+        case MBEDTLS_SSL_HS_NEW_SESSION_TICKET:
+            if( ssl->conf->endpoint != MBEDTLS_SSL_IS_CLIENT )
+                break;
+            return( ssl_tls13_parse_new_session_ticket( ssl ) );
+#endif
+
+        case MBEDTLS_SSL_HS_KEY_UPDATE:
+            return( ssl_tls13_parse_key_update( ssl ) );
+
+        default:
+            break;
+    }
+
+    MBEDTLS_SSL_DEBUG_MSG( 1, ( "unexpected post-handshake message %d",
+                                ssl->in_msg[0] ) );
+    mbedtls_ssl_send_alert_message( ssl, MBEDTLS_SSL_ALERT_LEVEL_FATAL,
+                                    MBEDTLS_SSL_ALERT_MSG_UNEXPECTED_MESSAGE );
+    return( MBEDTLS_ERR_SSL_UNEXPECTED_MESSAGE );
+}
+
+#endif /* MBEDTLS_SSL_TLS_C && MBEDTLS_SSL_PROTO_TLS1_3 */
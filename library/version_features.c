@@ -240,6 +240,9 @@ static const char *features[] = {
 #if defined(MBEDTLS_CAMELLIA_SMALL_MEMORY)
     "MBEDTLS_CAMELLIA_SMALL_MEMORY",
 #endif /* MBEDTLS_CAMELLIA_SMALL_MEMORY */
+#if defined(MBEDTLS_BASE64_SIMD)
+    "MBEDTLS_BASE64_SIMD",
+#endif /* MBEDTLS_BASE64_SIMD */
 #if defined(MBEDTLS_CIPHER_MODE_CBC)
     "MBEDTLS_CIPHER_MODE_CBC",
 #endif /* MBEDTLS_CIPHER_MODE_CBC */
@@ -414,6 +417,9 @@ static const char *features[] = {
 #if defined(MBEDTLS_SSL_CBC_RECORD_SPLITTING)
     "MBEDTLS_SSL_CBC_RECORD_SPLITTING",
 #endif /* MBEDTLS_SSL_CBC_RECORD_SPLITTING */
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    "MBEDTLS_SSL_DYNAMIC_RECORD_SIZING",
+#endif /* MBEDTLS_SSL_DYNAMIC_RECORD_SIZING */
 #if defined(MBEDTLS_SSL_RENEGOTIATION)
     "MBEDTLS_SSL_RENEGOTIATION",
 #endif /* MBEDTLS_SSL_RENEGOTIATION */
@@ -438,6 +444,9 @@ static const char *features[] = {
 #if defined(MBEDTLS_SSL_PROTO_TLS1_2)
     "MBEDTLS_SSL_PROTO_TLS1_2",
 #endif /* MBEDTLS_SSL_PROTO_TLS1_2 */
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    "MBEDTLS_SSL_PROTO_TLS1_3",
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     "MBEDTLS_SSL_PROTO_DTLS",
 #endif /* MBEDTLS_SSL_PROTO_DTLS */
@@ -456,12 +465,21 @@ static const char *features[] = {
 #if defined(MBEDTLS_SSL_DTLS_BADMAC_LIMIT)
     "MBEDTLS_SSL_DTLS_BADMAC_LIMIT",
 #endif /* MBEDTLS_SSL_DTLS_BADMAC_LIMIT */
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    "MBEDTLS_SSL_DTLS_CONNECTION_ID",
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
     "MBEDTLS_SSL_SESSION_TICKETS",
 #endif /* MBEDTLS_SSL_SESSION_TICKETS */
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+    "MBEDTLS_SSL_OCSP_STAPLING",
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
 #if defined(MBEDTLS_SSL_EXPORT_KEYS)
     "MBEDTLS_SSL_EXPORT_KEYS",
 #endif /* MBEDTLS_SSL_EXPORT_KEYS */
+#if defined(MBEDTLS_SSL_KTLS)
+    "MBEDTLS_SSL_KTLS",
+#endif /* MBEDTLS_SSL_KTLS */
 #if defined(MBEDTLS_SSL_SERVER_NAME_INDICATION)
     "MBEDTLS_SSL_SERVER_NAME_INDICATION",
 #endif /* MBEDTLS_SSL_SERVER_NAME_INDICATION */
@@ -471,6 +489,18 @@ static const char *features[] = {
 #if defined(MBEDTLS_SSL_TRUNCATED_HMAC_COMPAT)
     "MBEDTLS_SSL_TRUNCATED_HMAC_COMPAT",
 #endif /* MBEDTLS_SSL_TRUNCATED_HMAC_COMPAT */
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    "MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH",
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    "MBEDTLS_SSL_HANDSHAKE_ARENA",
+#endif /* MBEDTLS_SSL_HANDSHAKE_ARENA */
+#if defined(MBEDTLS_SSL_PEER_CHAIN_IN_PLACE)
+    "MBEDTLS_SSL_PEER_CHAIN_IN_PLACE",
+#endif /* MBEDTLS_SSL_PEER_CHAIN_IN_PLACE */
+#if defined(MBEDTLS_SSL_SEND_FILE)
+    "MBEDTLS_SSL_SEND_FILE",
+#endif /* MBEDTLS_SSL_SEND_FILE */
 #if defined(MBEDTLS_THREADING_ALT)
     "MBEDTLS_THREADING_ALT",
 #endif /* MBEDTLS_THREADING_ALT */
@@ -492,6 +522,15 @@ static const char *features[] = {
 #if defined(MBEDTLS_X509_CHECK_EXTENDED_KEY_USAGE)
     "MBEDTLS_X509_CHECK_EXTENDED_KEY_USAGE",
 #endif /* MBEDTLS_X509_CHECK_EXTENDED_KEY_USAGE */
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    "MBEDTLS_X509_ON_DEMAND_PARSING",
+#endif /* MBEDTLS_X509_ON_DEMAND_PARSING */
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+    "MBEDTLS_X509_CRT_COMPACT",
+#endif /* MBEDTLS_X509_CRT_COMPACT */
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    "MBEDTLS_X509_CRL_INDEX",
+#endif /* MBEDTLS_X509_CRL_INDEX */
 #if defined(MBEDTLS_X509_RSASSA_PSS_SUPPORT)
     "MBEDTLS_X509_RSASSA_PSS_SUPPORT",
 #endif /* MBEDTLS_X509_RSASSA_PSS_SUPPORT */
@@ -573,6 +612,9 @@ static const char *features[] = {
 #if defined(MBEDTLS_HAVEGE_C)
     "MBEDTLS_HAVEGE_C",
 #endif /* MBEDTLS_HAVEGE_C */
+#if defined(MBEDTLS_HKDF_C)
+    "MBEDTLS_HKDF_C",
+#endif /* MBEDTLS_HKDF_C */
 #if defined(MBEDTLS_HMAC_DRBG_C)
     "MBEDTLS_HMAC_DRBG_C",
 #endif /* MBEDTLS_HMAC_DRBG_C */
@@ -594,6 +636,9 @@ static const char *features[] = {
 #if defined(MBEDTLS_NET_C)
     "MBEDTLS_NET_C",
 #endif /* MBEDTLS_NET_C */
+#if defined(MBEDTLS_NET_MUX_C)
+    "MBEDTLS_NET_MUX_C",
+#endif /* MBEDTLS_NET_MUX_C */
 #if defined(MBEDTLS_OID_C)
     "MBEDTLS_OID_C",
 #endif /* MBEDTLS_OID_C */
@@ -648,6 +693,12 @@ static const char *features[] = {
 #if defined(MBEDTLS_SSL_COOKIE_C)
     "MBEDTLS_SSL_COOKIE_C",
 #endif /* MBEDTLS_SSL_COOKIE_C */
+#if defined(MBEDTLS_SSL_OCSP_C)
+    "MBEDTLS_SSL_OCSP_C",
+#endif /* MBEDTLS_SSL_OCSP_C */
+#if defined(MBEDTLS_SSL_SNI_C)
+    "MBEDTLS_SSL_SNI_C",
+#endif /* MBEDTLS_SSL_SNI_C */
 #if defined(MBEDTLS_SSL_TICKET_C)
     "MBEDTLS_SSL_TICKET_C",
 #endif /* MBEDTLS_SSL_TICKET_C */
@@ -678,6 +729,21 @@ static const char *features[] = {
 #if defined(MBEDTLS_X509_CRL_PARSE_C)
     "MBEDTLS_X509_CRL_PARSE_C",
 #endif /* MBEDTLS_X509_CRL_PARSE_C */
+#if defined(MBEDTLS_X509_OCSP_PARSE_C)
+    "MBEDTLS_X509_OCSP_PARSE_C",
+#endif /* MBEDTLS_X509_OCSP_PARSE_C */
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+    "MBEDTLS_X509_CA_INDEX_C",
+#endif /* MBEDTLS_X509_CA_INDEX_C */
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    "MBEDTLS_X509_VERIFY_CACHE_C",
+#endif /* MBEDTLS_X509_VERIFY_CACHE_C */
+#if defined(MBEDTLS_X509_SNAPSHOT_C)
+    "MBEDTLS_X509_SNAPSHOT_C",
+#endif /* MBEDTLS_X509_SNAPSHOT_C */
+#if defined(MBEDTLS_X509_CRT_PARALLEL_C)
+    "MBEDTLS_X509_CRT_PARALLEL_C",
+#endif /* MBEDTLS_X509_CRT_PARALLEL_C */
 #if defined(MBEDTLS_X509_CSR_PARSE_C)
     "MBEDTLS_X509_CSR_PARSE_C",
 #endif /* MBEDTLS_X509_CSR_PARSE_C */
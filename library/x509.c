@@ -480,6 +480,36 @@ int mbedtls_x509_get_name( unsigned char **p, const unsigned char *end,
     }
 }
 
+/*
+ * Read the next attribute of a Name without building a list.
+ *
+ * *end_set is the end of the current RDN, NULL before the first one.
+ * cur->next_merged tells whether the next attribute is in the same RDN.
+ */
+int mbedtls_x509_get_name_attr( unsigned char **p, const unsigned char *end,
+                                const unsigned char **end_set,
+                                mbedtls_x509_name *cur )
+{
+    int ret;
+    size_t set_len;
+
+    if( *end_set == NULL || *p == *end_set )
+    {
+        if( ( ret = mbedtls_asn1_get_tag( p, end, &set_len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SET ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_NAME + ret );
+
+        *end_set = *p + set_len;
+    }
+
+    if( ( ret = x509_get_attr_type_value( p, *end_set, cur ) ) != 0 )
+        return( ret );
+
+    cur->next_merged = ( *p != *end_set );
+
+    return( 0 );
+}
+
 static int x509_parse_int( unsigned char **p, size_t n, int *res )
 {
     *res = 0;
@@ -0,0 +1,452 @@
+/*
+ *  Index of a list of trusted CA certificates by subject and key identifier
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ * Two hash tables over the same entries: one keyed by the subject name,
+ * normalized the way mbedtls_x509_name_cmp() compares names so that equal
+ * names always land in the same bucket, and one keyed by the
+ * subjectKeyIdentifier extension. Buckets keep the order of the list, so
+ * walking the candidates of a bucket visits them in the same order as
+ * walking the whole list would.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+
+#include "mbedtls/x509_ca_index.h"
+#include "mbedtls/oid.h"
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#endif
+
+#include <string.h>
+
+#define CA_INDEX_MIN_BUCKETS    16
+
+/*
+ * FNV-1a
+ */
+#define CA_INDEX_HASH_INIT      2166136261u
+
+static uint32_t ca_index_hash( uint32_t h, const unsigned char *p, size_t len,
+                               int fold_case )
+{
+    size_t i;
+
+    for( i = 0; i < len; i++ )
+    {
+        unsigned char c = p[i];
+
+        if( fold_case && c >= 'A' && c <= 'Z' )
+            c += 'a' - 'A';
+
+        h ^= c;
+        h *= 16777619u;
+    }
+
+    return( h );
+}
+
+static uint32_t ca_index_hash_len( uint32_t h, size_t len )
+{
+    unsigned char b[4];
+
+    b[0] = (unsigned char)( len >> 24 );
+    b[1] = (unsigned char)( len >> 16 );
+    b[2] = (unsigned char)( len >>  8 );
+    b[3] = (unsigned char)( len       );
+
+    return( ca_index_hash( h, b, 4, 0 ) );
+}
+
+/*
+ * Hash of a name, equal for all the names mbedtls_x509_name_cmp() finds
+ * equal: UTF8String and PrintableString values compare without case and
+ * regardless of which of the two types they are, other values compare as
+ * they are. The name is in DER, like crt->subject_raw, so that it needn't
+ * be decoded into a list. A name that doesn't parse never compares equal,
+ * so its hash doesn't matter.
+ */
+static uint32_t ca_index_name_hash( const mbedtls_x509_buf *raw )
+{
+    uint32_t h = CA_INDEX_HASH_INIT;
+    unsigned char tag[2];
+    unsigned char *p = raw->p;
+    const unsigned char *end = p + raw->len;
+    const unsigned char *end_set = NULL;
+    mbedtls_x509_name name;
+    size_t len;
+
+    if( mbedtls_asn1_get_tag( &p, end, &len,
+            MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 )
+        return( h );
+
+    end = p + len;
+
+    while( p < end &&
+           mbedtls_x509_get_name_attr( &p, end, &end_set, &name ) == 0 )
+    {
+        int fold_case = ( name.val.tag == MBEDTLS_ASN1_UTF8_STRING ||
+                          name.val.tag == MBEDTLS_ASN1_PRINTABLE_STRING );
+
+        h = ca_index_hash_len( h, name.oid.len );
+        h = ca_index_hash( h, name.oid.p, name.oid.len, 0 );
+
+        tag[0] = fold_case ? 0 : (unsigned char) name.val.tag;
+        tag[1] = name.next_merged ? 1 : 0;
+        h = ca_index_hash( h, tag, 2, 0 );
+
+        h = ca_index_hash_len( h, name.val.len );
+        h = ca_index_hash( h, name.val.p, name.val.len, fold_case );
+    }
+
+    return( h );
+}
+
+/*
+ * Find the value of an extension of a certificate.
+ * Return 0 and set p and end if found, -1 otherwise.
+ */
+static int ca_index_get_ext( const mbedtls_x509_crt *crt,
+                             const char *oid, size_t oid_len,
+                             unsigned char **p, unsigned char **end )
+{
+    unsigned char *q = crt->v3_ext.p;
+    unsigned char *ext_end = q + crt->v3_ext.len;
+    unsigned char *end_ext_data;
+    size_t len;
+    int ret, is_critical;
+
+    if( crt->version != 3 || crt->v3_ext.len == 0 ||
+        mbedtls_asn1_get_tag( &q, ext_end, &len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 )
+    {
+        return( -1 );
+    }
+
+    /* The parser of the certificate checked the extensions already */
+    while( q < ext_end )
+    {
+        if( mbedtls_asn1_get_tag( &q, ext_end, &len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 )
+            return( -1 );
+
+        end_ext_data = q + len;
+
+        if( mbedtls_asn1_get_tag( &q, end_ext_data, &len, MBEDTLS_ASN1_OID ) != 0 )
+            return( -1 );
+
+        if( len != oid_len || memcmp( q, oid, oid_len ) != 0 )
+        {
+            q = end_ext_data;
+            continue;
+        }
+
+        q += len;
+
+        if( ( ret = mbedtls_asn1_get_bool( &q, end_ext_data, &is_critical ) ) != 0 &&
+            ret != MBEDTLS_ERR_ASN1_UNEXPECTED_TAG )
+        {
+            return( -1 );
+        }
+
+        if( mbedtls_asn1_get_tag( &q, end_ext_data, &len,
+                                  MBEDTLS_ASN1_OCTET_STRING ) != 0 )
+            return( -1 );
+
+        *p = q;
+        *end = q + len;
+        return( 0 );
+    }
+
+    return( -1 );
+}
+
+/*
+ * SubjectKeyIdentifier ::= KeyIdentifier
+ * KeyIdentifier ::= OCTET STRING
+ */
+static void ca_index_get_subject_key_id( const mbedtls_x509_crt *crt,
+                                         mbedtls_x509_buf *key_id )
+{
+    unsigned char *p, *end;
+    size_t len;
+
+    memset( key_id, 0, sizeof( mbedtls_x509_buf ) );
+
+    if( ca_index_get_ext( crt, MBEDTLS_OID_SUBJECT_KEY_IDENTIFIER,
+                          MBEDTLS_OID_SIZE( MBEDTLS_OID_SUBJECT_KEY_IDENTIFIER ),
+                          &p, &end ) != 0 ||
+        mbedtls_asn1_get_tag( &p, end, &len, MBEDTLS_ASN1_OCTET_STRING ) != 0 ||
+        len == 0 )
+    {
+        return;
+    }
+
+    key_id->tag = MBEDTLS_ASN1_OCTET_STRING;
+    key_id->p = p;
+    key_id->len = len;
+}
+
+/*
+ * AuthorityKeyIdentifier ::= SEQUENCE {
+ *      keyIdentifier             [0] KeyIdentifier           OPTIONAL,
+ *      authorityCertIssuer       [1] GeneralNames            OPTIONAL,
+ *      authorityCertSerialNumber [2] CertificateSerialNumber OPTIONAL  }
+ */
+static void ca_index_get_authority_key_id( const mbedtls_x509_crt *crt,
+                                           mbedtls_x509_buf *key_id )
+{
+    unsigned char *p, *end;
+    size_t len;
+
+    memset( key_id, 0, sizeof( mbedtls_x509_buf ) );
+
+    if( ca_index_get_ext( crt, MBEDTLS_OID_AUTHORITY_KEY_IDENTIFIER,
+                          MBEDTLS_OID_SIZE( MBEDTLS_OID_AUTHORITY_KEY_IDENTIFIER ),
+                          &p, &end ) != 0 ||
+        mbedtls_asn1_get_tag( &p, end, &len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 ||
+        mbedtls_asn1_get_tag( &p, p + len, &len,
+                MBEDTLS_ASN1_CONTEXT_SPECIFIC | 0 ) != 0 ||
+        len == 0 )
+    {
+        return;
+    }
+
+    key_id->tag = MBEDTLS_ASN1_OCTET_STRING;
+    key_id->p = p;
+    key_id->len = len;
+}
+
+static int ca_index_key_id_eq( const mbedtls_x509_ca_index_entry *entry,
+                               const unsigned char *key_id, size_t len )
+{
+    return( entry->key_id.len == len &&
+            memcmp( entry->key_id.p, key_id, len ) == 0 );
+}
+
+void mbedtls_x509_ca_index_init( mbedtls_x509_ca_index *index )
+{
+    memset( index, 0, sizeof( mbedtls_x509_ca_index ) );
+}
+
+void mbedtls_x509_ca_index_free( mbedtls_x509_ca_index *index )
+{
+    if( index == NULL )
+        return;
+
+    if( index->chain != NULL && index->chain->ca_index == index )
+        index->chain->ca_index = NULL;
+
+    mbedtls_free( index->entries );
+    mbedtls_free( index->by_subject );
+    mbedtls_free( index->by_key_id );
+
+    mbedtls_x509_ca_index_init( index );
+}
+
+int mbedtls_x509_ca_index_build( mbedtls_x509_ca_index *index,
+                                 mbedtls_x509_crt *chain )
+{
+    mbedtls_x509_crt *crt;
+    mbedtls_x509_ca_index_entry *entry;
+    mbedtls_x509_ca_index_entry **tail;
+    size_t count = 0, bucket_count = CA_INDEX_MIN_BUCKETS;
+
+    mbedtls_x509_ca_index_free( index );
+
+    /* An empty list is a single certificate with version 0 */
+    for( crt = chain; crt != NULL && crt->version != 0; crt = crt->next )
+        count++;
+
+    while( bucket_count < count )
+        bucket_count <<= 1;
+
+    if( count > 0 &&
+        ( index->entries = mbedtls_calloc( count,
+                                sizeof( mbedtls_x509_ca_index_entry ) ) ) == NULL )
+    {
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+    }
+
+    index->by_subject = mbedtls_calloc( bucket_count,
+                                sizeof( mbedtls_x509_ca_index_entry * ) );
+    index->by_key_id = mbedtls_calloc( bucket_count,
+                                sizeof( mbedtls_x509_ca_index_entry * ) );
+
+    if( index->by_subject == NULL || index->by_key_id == NULL )
+    {
+        mbedtls_x509_ca_index_free( index );
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+    }
+
+    index->count = count;
+    index->bucket_count = bucket_count;
+
+    /* Fill the buckets from their tail to keep the order of the list */
+    for( crt = chain, entry = index->entries; count > 0;
+         crt = crt->next, entry++, count-- )
+    {
+        entry->crt = crt;
+        entry->pos = (size_t)( entry - index->entries );
+        entry->subject_hash = ca_index_name_hash( &crt->subject_raw );
+
+        tail = &index->by_subject[entry->subject_hash & ( bucket_count - 1 )];
+        while( *tail != NULL )
+            tail = &(*tail)->next_subject;
+        *tail = entry;
+
+        ca_index_get_subject_key_id( crt, &entry->key_id );
+        if( entry->key_id.len == 0 )
+            continue;
+
+        entry->key_id_hash = ca_index_hash( CA_INDEX_HASH_INIT,
+                                    entry->key_id.p, entry->key_id.len, 0 );
+
+        tail = &index->by_key_id[entry->key_id_hash & ( bucket_count - 1 )];
+        while( *tail != NULL )
+            tail = &(*tail)->next_key_id;
+        *tail = entry;
+    }
+
+    if( index->count > 0 )
+    {
+        index->last = index->entries[index->count - 1].crt;
+        index->chain = chain;
+        chain->ca_index = index;
+    }
+
+    return( 0 );
+}
+
+const mbedtls_x509_ca_index_entry *mbedtls_x509_ca_index_find_subject(
+                                    const mbedtls_x509_ca_index *index,
+                                    const mbedtls_x509_buf *subject,
+                                    const mbedtls_x509_ca_index_entry *prev )
+{
+    const mbedtls_x509_ca_index_entry *cur;
+    uint32_t hash;
+
+    if( index->count == 0 )
+        return( NULL );
+
+    if( prev != NULL )
+    {
+        hash = prev->subject_hash;
+        cur = prev->next_subject;
+    }
+    else
+    {
+        hash = ca_index_name_hash( subject );
+        cur = index->by_subject[hash & ( index->bucket_count - 1 )];
+    }
+
+    for( ; cur != NULL; cur = cur->next_subject )
+    {
+        if( cur->subject_hash == hash &&
+            mbedtls_x509_name_cmp_raw( subject, &cur->crt->subject_raw ) == 0 )
+        {
+            return( cur );
+        }
+    }
+
+    return( NULL );
+}
+
+const mbedtls_x509_ca_index_entry *mbedtls_x509_ca_index_find_key_id(
+                                    const mbedtls_x509_ca_index *index,
+                                    const unsigned char *key_id, size_t len,
+                                    const mbedtls_x509_ca_index_entry *prev )
+{
+    const mbedtls_x509_ca_index_entry *cur;
+    uint32_t hash;
+
+    if( index->count == 0 || len == 0 )
+        return( NULL );
+
+    hash = ca_index_hash( CA_INDEX_HASH_INIT, key_id, len, 0 );
+
+    if( prev != NULL )
+        cur = prev->next_key_id;
+    else
+        cur = index->by_key_id[hash & ( index->bucket_count - 1 )];
+
+    for( ; cur != NULL; cur = cur->next_key_id )
+    {
+        if( cur->key_id_hash == hash && ca_index_key_id_eq( cur, key_id, len ) )
+            return( cur );
+    }
+
+    return( NULL );
+}
+
+/*
+ * First the candidates with the right subject and key identifier, then
+ * the other ones with the right subject. The pass we are in follows from
+ * whether prev has the right key identifier.
+ */
+const mbedtls_x509_ca_index_entry *mbedtls_x509_ca_index_find_issuer(
+                                    const mbedtls_x509_ca_index *index,
+                                    const mbedtls_x509_crt *child,
+                                    const mbedtls_x509_ca_index_entry *prev )
+{
+    const mbedtls_x509_ca_index_entry *cur;
+    mbedtls_x509_buf aki;
+
+    ca_index_get_authority_key_id( child, &aki );
+
+    if( aki.len != 0 &&
+        ( prev == NULL || ca_index_key_id_eq( prev, aki.p, aki.len ) ) )
+    {
+        cur = prev;
+        while( ( cur = mbedtls_x509_ca_index_find_key_id( index, aki.p, aki.len,
+                                                          cur ) ) != NULL )
+        {
+            if( mbedtls_x509_name_cmp_raw( &child->issuer_raw,
+                                           &cur->crt->subject_raw ) == 0 )
+                return( cur );
+        }
+
+        prev = NULL;
+    }
+
+    cur = prev;
+    while( ( cur = mbedtls_x509_ca_index_find_subject( index, &child->issuer_raw,
+                                                       cur ) ) != NULL )
+    {
+        if( aki.len == 0 || ! ca_index_key_id_eq( cur, aki.p, aki.len ) )
+            return( cur );
+    }
+
+    return( NULL );
+}
+
+#endif /* MBEDTLS_X509_CA_INDEX_C */
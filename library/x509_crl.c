@@ -66,6 +66,15 @@
 #include <stdio.h>
 #endif
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+#include <stdlib.h>
+
+#define X509_CRL_ASN1_ENUMERATED            0x0A
+
+/* CRLReason ::= ENUMERATED, value of removeFromCRL */
+#define X509_CRL_REASON_REMOVE_FROM_CRL     8
+#endif
+
 /* Implementation that should never be optimized out by the compiler */
 static void mbedtls_zeroize( void *v, size_t n ) {
     volatile unsigned char *p = v; while( n-- ) *p++ = 0;
@@ -94,15 +103,92 @@ static int x509_crl_get_version( unsigned char **p,
     return( 0 );
 }
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+/*
+ * Extension  ::=  SEQUENCE  {
+ *      extnID      OBJECT IDENTIFIER,
+ *      critical    BOOLEAN DEFAULT FALSE,
+ *      extnValue   OCTET STRING  }
+ *
+ * Set value to the content of extnValue if extnID is oid, leave it
+ * empty otherwise.
+ */
+static int x509_crl_get_ext_value( unsigned char *p, const unsigned char *end,
+                                   const char *oid, size_t oid_len,
+                                   mbedtls_x509_buf *value )
+{
+    int ret;
+    int is_critical;
+    size_t len;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len, MBEDTLS_ASN1_OID ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+    if( len != oid_len || memcmp( p, oid, len ) != 0 )
+        return( 0 );
+
+    p += len;
+
+    if( ( ret = mbedtls_asn1_get_bool( &p, end, &is_critical ) ) != 0 &&
+        ret != MBEDTLS_ERR_ASN1_UNEXPECTED_TAG )
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &value->len,
+                                      MBEDTLS_ASN1_OCTET_STRING ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+    value->tag = MBEDTLS_ASN1_OCTET_STRING;
+    value->p = p;
+
+    return( 0 );
+}
+
+/*
+ * cRLNumber and deltaCRLIndicator: CRLNumber ::= INTEGER (0..MAX)
+ */
+static int x509_crl_get_number( unsigned char *p, const unsigned char *end,
+                                const char *oid, size_t oid_len,
+                                mbedtls_x509_buf *number )
+{
+    int ret;
+    mbedtls_x509_buf value;
+
+    memset( &value, 0, sizeof( value ) );
+
+    if( ( ret = x509_crl_get_ext_value( p, end, oid, oid_len, &value ) ) != 0 )
+        return( ret );
+
+    if( value.p == NULL )
+        return( 0 );
+
+    p = value.p;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, value.p + value.len, &number->len,
+                                      MBEDTLS_ASN1_INTEGER ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+    if( number->len == 0 || ( p[0] & 0x80 ) != 0 ||
+        p + number->len != value.p + value.len )
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS +
+                MBEDTLS_ERR_ASN1_INVALID_DATA );
+
+    number->tag = MBEDTLS_ASN1_INTEGER;
+    number->p = p;
+
+    return( 0 );
+}
+#endif /* MBEDTLS_X509_CRL_INDEX */
+
 /*
- * X.509 CRL v2 extensions (no extensions parsed yet.)
+ * X.509 CRL v2 extensions (only the CRL numbers are parsed, for delta CRLs)
  */
 static int x509_get_crl_ext( unsigned char **p,
                              const unsigned char *end,
-                             mbedtls_x509_buf *ext )
+                             mbedtls_x509_crl *crl )
 {
     int ret;
     size_t len = 0;
+    mbedtls_x509_buf *ext = &crl->crl_ext;
 
     /* Get explicit tag */
     if( ( ret = mbedtls_x509_get_ext( p, end, ext, 0) ) != 0 )
@@ -119,6 +205,18 @@ static int x509_get_crl_ext( unsigned char **p,
                 MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
             return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+        if( ( ret = x509_crl_get_number( *p, *p + len,
+                                MBEDTLS_OID_CRL_NUMBER,
+                                MBEDTLS_OID_SIZE( MBEDTLS_OID_CRL_NUMBER ),
+                                &crl->crl_number ) ) != 0 ||
+            ( ret = x509_crl_get_number( *p, *p + len,
+                                MBEDTLS_OID_DELTA_CRL_INDICATOR,
+                                MBEDTLS_OID_SIZE( MBEDTLS_OID_DELTA_CRL_INDICATOR ),
+                                &crl->base_crl_number ) ) != 0 )
+            return( ret );
+#endif
+
         *p += len;
     }
 
@@ -183,6 +281,7 @@ static int x509_get_crl_entry_ext( unsigned char **p,
     return( 0 );
 }
 
+#if !defined(MBEDTLS_X509_CRL_INDEX)
 /*
  * X.509 CRL Entries
  */
@@ -248,12 +347,168 @@ static int x509_get_entries( unsigned char **p,
 
     return( 0 );
 }
+#endif /* !MBEDTLS_X509_CRL_INDEX */
+
+#if defined(MBEDTLS_X509_CRL_INDEX)
+/*
+ * Return 1 if the entry extensions have reasonCode removeFromCRL
+ */
+static int x509_crl_entry_is_removal( const mbedtls_x509_buf *ext,
+                                      const unsigned char *end )
+{
+    size_t len;
+    unsigned char *p = ext->p;
+    const unsigned char *end_ext;
+    mbedtls_x509_buf value;
+
+    if( p == NULL ||
+        mbedtls_asn1_get_tag( &p, end, &len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 )
+        return( 0 );
+
+    end = p + len;
+
+    while( p < end )
+    {
+        if( mbedtls_asn1_get_tag( &p, end, &len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 )
+            return( 0 );
+
+        end_ext = p + len;
+        memset( &value, 0, sizeof( value ) );
+
+        if( x509_crl_get_ext_value( p, end_ext, MBEDTLS_OID_CRL_REASON_CODE,
+                        MBEDTLS_OID_SIZE( MBEDTLS_OID_CRL_REASON_CODE ),
+                        &value ) == 0 && value.p != NULL )
+        {
+            /* CRLReason ::= ENUMERATED */
+            return( value.len == 3 &&
+                    value.p[0] == X509_CRL_ASN1_ENUMERATED &&
+                    value.p[1] == 1 &&
+                    value.p[2] == X509_CRL_REASON_REMOVE_FROM_CRL );
+        }
+
+        p = (unsigned char *) end_ext;
+    }
+
+    return( 0 );
+}
+
+static int x509_crl_index_cmp( const void *a, const void *b )
+{
+    const mbedtls_x509_crl_index_entry *x = a;
+    const mbedtls_x509_crl_index_entry *y = b;
+
+    if( x->serial_len != y->serial_len )
+        return( x->serial_len < y->serial_len ? -1 : 1 );
+
+    return( memcmp( x->serial, y->serial, x->serial_len ) );
+}
+
+/*
+ * X.509 CRL Entries, into an array sorted by serial number rather than a
+ * list: they are counted first, so the array takes a single allocation.
+ * Each one is checked like x509_get_entries() does.
+ */
+static int x509_get_entries_index( unsigned char **p,
+                                   const unsigned char *end,
+                                   mbedtls_x509_crl *crl )
+{
+    int ret;
+    size_t entry_len, len2, count = 0;
+    unsigned char *start;
+    mbedtls_x509_crl_entry cur_entry;
+
+    if( *p == end )
+        return( 0 );
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &entry_len,
+            MBEDTLS_ASN1_SEQUENCE | MBEDTLS_ASN1_CONSTRUCTED ) ) != 0 )
+    {
+        if( ret == MBEDTLS_ERR_ASN1_UNEXPECTED_TAG )
+            return( 0 );
+
+        return( ret );
+    }
+
+    end = *p + entry_len;
+
+    for( start = *p; *p < end; count++ )
+    {
+        if( ( ret = mbedtls_asn1_get_tag( p, end, &len2,
+                MBEDTLS_ASN1_SEQUENCE | MBEDTLS_ASN1_CONSTRUCTED ) ) != 0 )
+        {
+            return( ret );
+        }
+
+        *p += len2;
+    }
+
+    *p = start;
+
+    if( count == 0 )
+        return( 0 );
+
+    crl->index = mbedtls_calloc( count, sizeof( mbedtls_x509_crl_index_entry ) );
+    if( crl->index == NULL )
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+    while( *p < end )
+    {
+        const unsigned char *end2;
+        mbedtls_x509_crl_index_entry *cur;
+
+        if( crl->index_len == count )
+            return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                    MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+        if( ( ret = mbedtls_asn1_get_tag( p, end, &len2,
+                MBEDTLS_ASN1_SEQUENCE | MBEDTLS_ASN1_CONSTRUCTED ) ) != 0 )
+        {
+            return( ret );
+        }
+
+        end2 = *p + len2;
+        memset( &cur_entry, 0, sizeof( cur_entry ) );
+
+        if( ( ret = mbedtls_x509_get_serial( p, end2, &cur_entry.serial ) ) != 0 )
+            return( ret );
+
+        if( ( ret = mbedtls_x509_get_time( p, end2,
+                                   &cur_entry.revocation_date ) ) != 0 )
+            return( ret );
+
+        if( ( ret = x509_get_crl_entry_ext( p, end2,
+                                            &cur_entry.entry_ext ) ) != 0 )
+            return( ret );
+
+        if( cur_entry.serial.len > 0xFFFF )
+            return( MBEDTLS_ERR_X509_INVALID_SERIAL +
+                    MBEDTLS_ERR_ASN1_INVALID_LENGTH );
+
+        cur = &crl->index[crl->index_len++];
+        cur->serial = cur_entry.serial.p;
+        cur->serial_len = (uint16_t) cur_entry.serial.len;
+        cur->rest_len = (uint32_t) ( end2 - cur_entry.serial.p -
+                                     cur_entry.serial.len );
+
+        if( x509_crl_entry_is_removal( &cur_entry.entry_ext, end2 ) )
+            cur->flags |= MBEDTLS_X509_CRL_INDEX_REMOVE;
+    }
+
+    qsort( crl->index, crl->index_len, sizeof( mbedtls_x509_crl_index_entry ),
+           x509_crl_index_cmp );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_X509_CRL_INDEX */
 
 /*
  * Parse one  CRLs in DER format and append it to the chained list
  */
-int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
-                        const unsigned char *buf, size_t buflen )
+static int x509_crl_parse_der_internal( mbedtls_x509_crl *chain,
+                                        const unsigned char *buf,
+                                        size_t buflen, int make_copy )
 {
     int ret;
     size_t len;
@@ -292,16 +547,22 @@ int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
     }
 
     /*
-     * Copy raw DER-encoded CRL
+     * Copy raw DER-encoded CRL, unless the caller keeps it
      */
     if( buflen == 0 )
         return( MBEDTLS_ERR_X509_INVALID_FORMAT );
 
-    p = mbedtls_calloc( 1, buflen );
-    if( p == NULL )
-        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+    if( make_copy != 0 )
+    {
+        p = mbedtls_calloc( 1, buflen );
+        if( p == NULL )
+            return( MBEDTLS_ERR_X509_ALLOC_FAILED );
 
-    memcpy( p, buf, buflen );
+        memcpy( p, buf, buflen );
+        crl->own_buffer = 1;
+    }
+    else
+        p = (unsigned char *) buf;
 
     crl->raw.p = p;
     crl->raw.len = buflen;
@@ -422,7 +683,11 @@ int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
      *                                   -- if present, MUST be v2
      *                        } OPTIONAL
      */
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    if( ( ret = x509_get_entries_index( &p, end, crl ) ) != 0 )
+#else
     if( ( ret = x509_get_entries( &p, end, &crl->entry ) ) != 0 )
+#endif
     {
         mbedtls_x509_crl_free( crl );
         return( ret );
@@ -434,7 +699,7 @@ int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
      */
     if( crl->version == 2 )
     {
-        ret = x509_get_crl_ext( &p, end, &crl->crl_ext );
+        ret = x509_get_crl_ext( &p, end, crl );
 
         if( ret != 0 )
         {
@@ -488,6 +753,32 @@ int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
     return( 0 );
 }
 
+int mbedtls_x509_crl_parse_der( mbedtls_x509_crl *chain,
+                        const unsigned char *buf, size_t buflen )
+{
+    return( x509_crl_parse_der_internal( chain, buf, buflen, 1 ) );
+}
+
+int mbedtls_x509_crl_parse_der_nocopy( mbedtls_x509_crl *chain,
+                                       const unsigned char *buf,
+                                       size_t buflen )
+{
+    return( x509_crl_parse_der_internal( chain, buf, buflen, 0 ) );
+}
+
+#if defined(MBEDTLS_PEM_PARSE_C) || defined(MBEDTLS_FS_IO)
+/*
+ * Give the buffer of the last CRL of the chain to it
+ */
+static void x509_crl_own_last( mbedtls_x509_crl *chain )
+{
+    while( chain->next != NULL )
+        chain = chain->next;
+
+    chain->own_buffer = 1;
+}
+#endif /* MBEDTLS_PEM_PARSE_C || MBEDTLS_FS_IO */
+
 /*
  * Parse one or more CRLs and add them to the chained list
  */
@@ -526,12 +817,17 @@ int mbedtls_x509_crl_parse( mbedtls_x509_crl *chain, const unsigned char *buf, s
             buflen -= use_len;
             buf += use_len;
 
-            if( ( ret = mbedtls_x509_crl_parse_der( chain,
-                                            pem.buf, pem.buflen ) ) != 0 )
+            /* The CRL takes over the decoded DER, no need to copy */
+            if( ( ret = x509_crl_parse_der_internal( chain,
+                                            pem.buf, pem.buflen, 0 ) ) != 0 )
             {
                 mbedtls_pem_free( &pem );
                 return( ret );
             }
+
+            x509_crl_own_last( chain );
+            pem.buf = NULL;
+            pem.buflen = 0;
         }
         else if( is_pem )
         {
@@ -565,7 +861,17 @@ int mbedtls_x509_crl_parse_file( mbedtls_x509_crl *chain, const char *path )
     if( ( ret = mbedtls_pk_load_file( path, &buf, &n ) ) != 0 )
         return( ret );
 
-    ret = mbedtls_x509_crl_parse( chain, buf, n );
+    /* A DER CRL takes over the buffer, large ones are not copied again */
+    if( n != 0 && buf[n - 1] != '\0' )
+    {
+        if( ( ret = x509_crl_parse_der_internal( chain, buf, n, 0 ) ) == 0 )
+        {
+            x509_crl_own_last( chain );
+            return( 0 );
+        }
+    }
+    else
+        ret = mbedtls_x509_crl_parse( chain, buf, n );
 
     mbedtls_zeroize( buf, n );
     mbedtls_free( buf );
@@ -574,6 +880,187 @@ int mbedtls_x509_crl_parse_file( mbedtls_x509_crl *chain, const char *path )
 }
 #endif /* MBEDTLS_FS_IO */
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+/*
+ * Decode the revocation date of an entry of the index
+ */
+static int x509_crl_index_get_time( const mbedtls_x509_crl_index_entry *entry,
+                                    mbedtls_x509_time *revocation_date )
+{
+    unsigned char *p = (unsigned char *) entry->serial + entry->serial_len;
+
+    return( mbedtls_x509_get_time( &p, p + entry->rest_len, revocation_date ) );
+}
+
+/*
+ * Return 1 if the serial number is revoked, or 0 otherwise
+ */
+int mbedtls_x509_crl_is_revoked( const mbedtls_x509_crl *crl,
+                                 const mbedtls_x509_buf *serial )
+{
+    size_t lo = 0, hi, mid;
+    mbedtls_x509_crl_index_entry key;
+    mbedtls_x509_time revocation_date;
+
+    if( serial->len > 0xFFFF )
+        return( 0 );
+
+    key.serial = serial->p;
+    key.serial_len = (uint16_t) serial->len;
+
+    /* First entry not below the serial number */
+    hi = crl->index_len;
+    while( lo < hi )
+    {
+        mid = lo + ( hi - lo ) / 2;
+
+        if( x509_crl_index_cmp( &crl->index[mid], &key ) < 0 )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for( ; lo < crl->index_len &&
+           x509_crl_index_cmp( &crl->index[lo], &key ) == 0; lo++ )
+    {
+        if( ( crl->index[lo].flags & MBEDTLS_X509_CRL_INDEX_REMOVE ) != 0 )
+            continue;
+
+        if( x509_crl_index_get_time( &crl->index[lo], &revocation_date ) == 0 &&
+            mbedtls_x509_time_is_past( &revocation_date ) )
+            return( 1 );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Compare two CRL numbers, which are non-negative INTEGERs
+ */
+static int x509_crl_number_cmp( const mbedtls_x509_buf *a,
+                                const mbedtls_x509_buf *b )
+{
+    const unsigned char *p = a->p, *q = b->p;
+    size_t n = a->len, m = b->len;
+
+    while( n > 0 && *p == 0 )
+    {
+        p++;
+        n--;
+    }
+
+    while( m > 0 && *q == 0 )
+    {
+        q++;
+        m--;
+    }
+
+    if( n != m )
+        return( n < m ? -1 : 1 );
+
+    return( n == 0 ? 0 : memcmp( p, q, n ) );
+}
+
+/*
+ * Merge the sorted indexes of a CRL and a delta CRL
+ */
+int mbedtls_x509_crl_merge_delta( mbedtls_x509_crl *crl,
+                                  mbedtls_x509_crl *delta )
+{
+    int cmp;
+    size_t i = 0, j = 0, n = 0;
+    mbedtls_x509_crl_index_entry *index;
+    mbedtls_x509_crl *owned;
+    const mbedtls_x509_buf *last_number;
+
+    if( crl == NULL || delta == NULL ||
+        crl->version == 0 || crl->base_crl_number.len != 0 ||
+        crl->crl_number.len == 0 ||
+        delta->version != 2 || delta->next != NULL ||
+        delta->base_crl_number.len == 0 || delta->crl_number.len == 0 )
+    {
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+    }
+
+    if( crl->issuer_raw.len != delta->issuer_raw.len ||
+        memcmp( crl->issuer_raw.p, delta->issuer_raw.p,
+                crl->issuer_raw.len ) != 0 )
+    {
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+    }
+
+    /* The delta applies to this CRL, and is newer than the last one merged */
+    last_number = crl->deltas != NULL ? &crl->deltas->crl_number
+                                      : &crl->crl_number;
+
+    if( x509_crl_number_cmp( &delta->base_crl_number, &crl->crl_number ) > 0 ||
+        x509_crl_number_cmp( &delta->crl_number, last_number ) <= 0 )
+    {
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+    }
+
+    if( crl->index_len + delta->index_len < crl->index_len )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    owned = mbedtls_calloc( 1, sizeof( mbedtls_x509_crl ) );
+    if( owned == NULL )
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+    index = mbedtls_calloc( crl->index_len + delta->index_len + 1,
+                            sizeof( mbedtls_x509_crl_index_entry ) );
+    if( index == NULL )
+    {
+        mbedtls_free( owned );
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+    }
+
+    /*
+     * An entry of the delta replaces the entry with the same serial number,
+     * or is added, unless it takes the certificate off the list
+     */
+    while( i < crl->index_len || j < delta->index_len )
+    {
+        if( i == crl->index_len )
+            cmp = 1;
+        else if( j == delta->index_len )
+            cmp = -1;
+        else
+            cmp = x509_crl_index_cmp( &crl->index[i], &delta->index[j] );
+
+        if( cmp < 0 )
+        {
+            index[n++] = crl->index[i++];
+            continue;
+        }
+
+        if( cmp == 0 )
+            i++;
+
+        if( ( delta->index[j].flags & MBEDTLS_X509_CRL_INDEX_REMOVE ) == 0 )
+            index[n++] = delta->index[j];
+
+        j++;
+    }
+
+    mbedtls_free( crl->index );
+    crl->index = index;
+    crl->index_len = n;
+
+    /* The entries point into the DER of the delta, keep it with the CRL */
+    mbedtls_free( delta->index );
+    delta->index = NULL;
+    delta->index_len = 0;
+
+    memcpy( owned, delta, sizeof( mbedtls_x509_crl ) );
+    owned->next = crl->deltas;
+    crl->deltas = owned;
+
+    mbedtls_x509_crl_init( delta );
+
+    return( 0 );
+}
+#endif /* MBEDTLS_X509_CRL_INDEX */
+
 /*
  * Return an informational string about the certificate.
  */
@@ -588,6 +1075,10 @@ int mbedtls_x509_crl_info( char *buf, size_t size, const char *prefix,
     int ret;
     size_t n;
     char *p;
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    size_t i;
+    mbedtls_x509_crl_entry index_entry;
+#endif
     const mbedtls_x509_crl_entry *entry;
 
     p = buf;
@@ -622,8 +1113,27 @@ int mbedtls_x509_crl_info( char *buf, size_t size, const char *prefix,
                                prefix );
     MBEDTLS_X509_SAFE_SNPRINTF;
 
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    /* Decode the entries of the index one at a time, in serial order */
+    memset( &index_entry, 0, sizeof( index_entry ) );
+    entry = &index_entry;
+
+    for( i = 0; i < crl->index_len; i++ )
+    {
+        if( ( crl->index[i].flags & MBEDTLS_X509_CRL_INDEX_REMOVE ) != 0 )
+            continue;
+
+        index_entry.serial.tag = MBEDTLS_ASN1_INTEGER;
+        index_entry.serial.p = (unsigned char *) crl->index[i].serial;
+        index_entry.serial.len = crl->index[i].serial_len;
+
+        if( ( ret = x509_crl_index_get_time( &crl->index[i],
+                                    &index_entry.revocation_date ) ) != 0 )
+            return( ret );
+#else
     while( entry != NULL && entry->raw.len != 0 )
     {
+#endif
         ret = mbedtls_snprintf( p, n, "\n%sserial number: ",
                                prefix );
         MBEDTLS_X509_SAFE_SNPRINTF;
@@ -638,7 +1148,9 @@ int mbedtls_x509_crl_info( char *buf, size_t size, const char *prefix,
                    entry->revocation_date.min,  entry->revocation_date.sec );
         MBEDTLS_X509_SAFE_SNPRINTF;
 
+#if !defined(MBEDTLS_X509_CRL_INDEX)
         entry = entry->next;
+#endif
     }
 
     ret = mbedtls_snprintf( p, n, "\n%ssigned using  : ", prefix );
@@ -701,7 +1213,17 @@ void mbedtls_x509_crl_free( mbedtls_x509_crl *crl )
             mbedtls_free( entry_prv );
         }
 
-        if( crl_cur->raw.p != NULL )
+#if defined(MBEDTLS_X509_CRL_INDEX)
+        mbedtls_free( crl_cur->index );
+
+        if( crl_cur->deltas != NULL )
+        {
+            mbedtls_x509_crl_free( crl_cur->deltas );
+            mbedtls_free( crl_cur->deltas );
+        }
+#endif
+
+        if( crl_cur->raw.p != NULL && crl_cur->own_buffer )
         {
             mbedtls_zeroize( crl_cur->raw.p, crl_cur->raw.len );
             mbedtls_free( crl_cur->raw.p );
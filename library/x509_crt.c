@@ -40,6 +40,10 @@
 #include "mbedtls/x509_crt.h"
 #include "mbedtls/oid.h"
 
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+#include "mbedtls/x509_ca_index.h"
+#endif
+
 #include <stdio.h>
 #include <string.h>
 
@@ -80,6 +84,41 @@ static void mbedtls_zeroize( void *v, size_t n ) {
     volatile unsigned char *p = v; while( n-- ) *p++ = 0;
 }
 
+/*
+ * Fields of mbedtls_x509_crt that are only decoded on first access, or once
+ * the certificate is parsed and the size of the lists is known
+ */
+#define X509_CRT_PENDING_ISSUER             0x01
+#define X509_CRT_PENDING_SUBJECT            0x02
+#define X509_CRT_PENDING_SUBJECT_ALT_NAMES  0x04
+#define X509_CRT_PENDING_EXT_KEY_USAGE      0x08
+
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING) || defined(MBEDTLS_X509_CRT_COMPACT)
+#define X509_CRT_DEFER_DECODING
+#endif
+
+#if defined(X509_CRT_DEFER_DECODING)
+/*
+ * Check a Name the way mbedtls_x509_get_name() parses it, without building
+ * the list
+ */
+static int x509_check_name( unsigned char **p, const unsigned char *end )
+{
+    int ret;
+    const unsigned char *end_set = NULL;
+    mbedtls_x509_name cur;
+
+    do
+    {
+        if( ( ret = mbedtls_x509_get_name_attr( p, end, &end_set, &cur ) ) != 0 )
+            return( ret );
+    }
+    while( *p != end );
+
+    return( 0 );
+}
+#endif /* X509_CRT_DEFER_DECODING */
+
 /*
  * Default profile
  */
@@ -405,6 +444,34 @@ static int x509_get_ext_key_usage( unsigned char **p,
                                mbedtls_x509_sequence *ext_key_usage)
 {
     int ret;
+    size_t len;
+
+    /* Only check the syntax, see mbedtls_asn1_get_sequence_of() */
+    if( ext_key_usage == NULL )
+    {
+        if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+        if( *p + len != end )
+            return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS +
+                    MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+        if( len == 0 )
+            return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS +
+                    MBEDTLS_ERR_ASN1_INVALID_LENGTH );
+
+        while( *p < end )
+        {
+            if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                                              MBEDTLS_ASN1_OID ) ) != 0 )
+                return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+            *p += len;
+        }
+
+        return( 0 );
+    }
 
     if( ( ret = mbedtls_asn1_get_sequence_of( p, end, ext_key_usage, MBEDTLS_ASN1_OID ) ) != 0 )
         return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
@@ -442,6 +509,8 @@ static int x509_get_ext_key_usage( unsigned char **p,
  *      partyName               [1]     DirectoryString }
  *
  * NOTE: we only parse and use dNSName at this point.
+ *
+ * With subject_alt_name NULL, only check the syntax.
  */
 static int x509_get_subject_alt_name( unsigned char **p,
                                       const unsigned char *end,
@@ -478,7 +547,8 @@ static int x509_get_subject_alt_name( unsigned char **p,
                     MBEDTLS_ERR_ASN1_UNEXPECTED_TAG );
 
         /* Skip everything but DNS name */
-        if( tag != ( MBEDTLS_ASN1_CONTEXT_SPECIFIC | 2 ) )
+        if( tag != ( MBEDTLS_ASN1_CONTEXT_SPECIFIC | 2 ) ||
+            subject_alt_name == NULL )
         {
             *p += tag_len;
             continue;
@@ -507,7 +577,8 @@ static int x509_get_subject_alt_name( unsigned char **p,
     }
 
     /* Set final sequence entry's next pointer to NULL */
-    cur->next = NULL;
+    if( cur != NULL )
+        cur->next = NULL;
 
     if( *p != end )
         return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS +
@@ -628,16 +699,36 @@ static int x509_get_crt_ext( unsigned char **p,
 
         case MBEDTLS_X509_EXT_EXTENDED_KEY_USAGE:
             /* Parse extended key usage */
+#if defined(X509_CRT_DEFER_DECODING)
+            crt->ext_key_usage_raw.p = *p;
+            crt->ext_key_usage_raw.len = end_ext_octet - *p;
+            crt->pending |= X509_CRT_PENDING_EXT_KEY_USAGE;
+
+            if( ( ret = x509_get_ext_key_usage( p, end_ext_octet,
+                    NULL ) ) != 0 )
+                return( ret );
+#else
             if( ( ret = x509_get_ext_key_usage( p, end_ext_octet,
                     &crt->ext_key_usage ) ) != 0 )
                 return( ret );
+#endif
             break;
 
         case MBEDTLS_X509_EXT_SUBJECT_ALT_NAME:
             /* Parse subject alt name */
+#if defined(X509_CRT_DEFER_DECODING)
+            crt->subject_alt_names_raw.p = *p;
+            crt->subject_alt_names_raw.len = end_ext_octet - *p;
+            crt->pending |= X509_CRT_PENDING_SUBJECT_ALT_NAMES;
+
+            if( ( ret = x509_get_subject_alt_name( p, end_ext_octet,
+                    NULL ) ) != 0 )
+                return( ret );
+#else
             if( ( ret = x509_get_subject_alt_name( p, end_ext_octet,
                     &crt->subject_alt_names ) ) != 0 )
                 return( ret );
+#endif
             break;
 
         case MBEDTLS_X509_EXT_NS_CERT_TYPE:
@@ -659,11 +750,238 @@ static int x509_get_crt_ext( unsigned char **p,
     return( 0 );
 }
 
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+/*
+ * Return 1 if p points into the single allocation of crt
+ */
+static int x509_crt_in_block( const mbedtls_x509_crt *crt, const void *p )
+{
+    const unsigned char *q = p;
+
+    return( crt->block != NULL && q >= crt->block &&
+            q < crt->block + crt->block_len );
+}
+#endif /* MBEDTLS_X509_CRT_COMPACT */
+
+static void x509_crt_free_name( mbedtls_x509_name *name )
+{
+    mbedtls_x509_name *cur = name->next, *prv;
+
+    while( cur != NULL )
+    {
+        prv = cur;
+        cur = cur->next;
+        mbedtls_zeroize( prv, sizeof( mbedtls_x509_name ) );
+        mbedtls_free( prv );
+    }
+
+    memset( name, 0, sizeof( mbedtls_x509_name ) );
+}
+
+static void x509_crt_free_sequence( mbedtls_x509_sequence *seq )
+{
+    mbedtls_x509_sequence *cur = seq->next, *prv;
+
+    while( cur != NULL )
+    {
+        prv = cur;
+        cur = cur->next;
+        mbedtls_zeroize( prv, sizeof( mbedtls_x509_sequence ) );
+        mbedtls_free( prv );
+    }
+
+    memset( seq, 0, sizeof( mbedtls_x509_sequence ) );
+}
+
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+/*
+ * Decode a Name the parser only checked
+ */
+static int x509_crt_decode_name( const mbedtls_x509_buf *raw,
+                                 mbedtls_x509_name *name )
+{
+    int ret;
+    size_t len;
+    unsigned char *p = raw->p;
+    const unsigned char *end = p + raw->len;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+            MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    if( len != 0 && ( ret = mbedtls_x509_get_name( &p, p + len, name ) ) != 0 )
+    {
+        x509_crt_free_name( name );
+        return( ret );
+    }
+
+    return( 0 );
+}
+
+/*
+ * Decode a field the parser only checked, into name or seq
+ */
+static int x509_crt_decode( const mbedtls_x509_crt *crt, int field,
+                            mbedtls_x509_name *name,
+                            mbedtls_x509_sequence *seq )
+{
+    int ret;
+    unsigned char *p;
+
+    switch( field )
+    {
+        case X509_CRT_PENDING_ISSUER:
+            return( x509_crt_decode_name( &crt->issuer_raw, name ) );
+
+        case X509_CRT_PENDING_SUBJECT:
+            return( x509_crt_decode_name( &crt->subject_raw, name ) );
+
+        case X509_CRT_PENDING_SUBJECT_ALT_NAMES:
+            p = crt->subject_alt_names_raw.p;
+            ret = x509_get_subject_alt_name( &p,
+                        p + crt->subject_alt_names_raw.len, seq );
+            break;
+
+        case X509_CRT_PENDING_EXT_KEY_USAGE:
+            p = crt->ext_key_usage_raw.p;
+            ret = x509_get_ext_key_usage( &p,
+                        p + crt->ext_key_usage_raw.len, seq );
+            break;
+
+        default:
+            return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+    }
+
+    if( ret != 0 )
+        x509_crt_free_sequence( seq );
+
+    return( ret );
+}
+#endif /* MBEDTLS_X509_ON_DEMAND_PARSING */
+
+/*
+ * Get a name of crt for reading, without updating crt: if it is still
+ * pending, decode it into tmp. Free tmp with x509_crt_free_name() after use.
+ */
+static int x509_crt_peek_name( const mbedtls_x509_crt *crt, int field,
+                               mbedtls_x509_name *tmp,
+                               const mbedtls_x509_name **name )
+{
+    memset( tmp, 0, sizeof( mbedtls_x509_name ) );
+
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    if( crt->pending & field )
+    {
+        *name = tmp;
+        return( x509_crt_decode( crt, field, tmp, NULL ) );
+    }
+#endif
+
+    *name = ( field == X509_CRT_PENDING_ISSUER ) ? &crt->issuer : &crt->subject;
+
+    return( 0 );
+}
+
+/*
+ * Same for a sequence
+ */
+static int x509_crt_peek_sequence( const mbedtls_x509_crt *crt, int field,
+                                   mbedtls_x509_sequence *tmp,
+                                   const mbedtls_x509_sequence **seq )
+{
+    memset( tmp, 0, sizeof( mbedtls_x509_sequence ) );
+
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    if( crt->pending & field )
+    {
+        *seq = tmp;
+        return( x509_crt_decode( crt, field, NULL, tmp ) );
+    }
+#endif
+
+    *seq = ( field == X509_CRT_PENDING_SUBJECT_ALT_NAMES ) ?
+           &crt->subject_alt_names : &crt->ext_key_usage;
+
+    return( 0 );
+}
+
+/*
+ * Decode a pending field of crt into crt itself
+ */
+static int x509_crt_get_field( mbedtls_x509_crt *crt, int field )
+{
+#if defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    int ret;
+
+    if( crt->pending & field )
+    {
+        if( field == X509_CRT_PENDING_ISSUER )
+            ret = x509_crt_decode( crt, field, &crt->issuer, NULL );
+        else if( field == X509_CRT_PENDING_SUBJECT )
+            ret = x509_crt_decode( crt, field, &crt->subject, NULL );
+        else if( field == X509_CRT_PENDING_SUBJECT_ALT_NAMES )
+            ret = x509_crt_decode( crt, field, NULL, &crt->subject_alt_names );
+        else
+            ret = x509_crt_decode( crt, field, NULL, &crt->ext_key_usage );
+
+        if( ret != 0 )
+            return( ret );
+
+        crt->pending &= ~field;
+    }
+#else
+    ((void) crt);
+    ((void) field);
+#endif
+
+    return( 0 );
+}
+
+int mbedtls_x509_crt_get_issuer( mbedtls_x509_crt *crt,
+                                 const mbedtls_x509_name **issuer )
+{
+    int ret = x509_crt_get_field( crt, X509_CRT_PENDING_ISSUER );
+
+    *issuer = &crt->issuer;
+
+    return( ret );
+}
+
+int mbedtls_x509_crt_get_subject( mbedtls_x509_crt *crt,
+                                  const mbedtls_x509_name **subject )
+{
+    int ret = x509_crt_get_field( crt, X509_CRT_PENDING_SUBJECT );
+
+    *subject = &crt->subject;
+
+    return( ret );
+}
+
+int mbedtls_x509_crt_get_subject_alt_names( mbedtls_x509_crt *crt,
+                                    const mbedtls_x509_sequence **subject_alt_names )
+{
+    int ret = x509_crt_get_field( crt, X509_CRT_PENDING_SUBJECT_ALT_NAMES );
+
+    *subject_alt_names = &crt->subject_alt_names;
+
+    return( ret );
+}
+
+int mbedtls_x509_crt_get_ext_key_usage( mbedtls_x509_crt *crt,
+                                    const mbedtls_x509_sequence **ext_key_usage )
+{
+    int ret = x509_crt_get_field( crt, X509_CRT_PENDING_EXT_KEY_USAGE );
+
+    *ext_key_usage = &crt->ext_key_usage;
+
+    return( ret );
+}
+
 /*
  * Parse and fill a single X.509 certificate in DER format
  */
 static int x509_crt_parse_der_core( mbedtls_x509_crt *crt, const unsigned char *buf,
-                                    size_t buflen )
+                                    size_t buflen, int make_copy )
 {
     int ret;
     size_t len;
@@ -706,17 +1024,30 @@ static int x509_crt_parse_der_core( mbedtls_x509_crt *crt, const unsigned char *
     }
     crt_end = p + len;
 
-    // Create and populate a new buffer for the raw field
     crt->raw.len = crt_end - buf;
-    crt->raw.p = p = mbedtls_calloc( 1, crt->raw.len );
-    if( p == NULL )
-        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
 
-    memcpy( p, buf, crt->raw.len );
+    if( make_copy != 0 )
+    {
+        // Create and populate a new buffer for the raw field
+        crt->raw.p = p = mbedtls_calloc( 1, crt->raw.len );
+        if( p == NULL )
+            return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+        memcpy( p, buf, crt->raw.len );
+        crt->own_buffer = 1;
+
+        // Direct pointers to the new buffer
+        p += crt->raw.len - len;
+        end = crt_end = p + len;
+    }
+    else
+    {
+        // Direct pointers to the caller's buffer
+        crt->raw.p = (unsigned char *) buf;
+        crt->own_buffer = 0;
 
-    // Direct pointers to the new buffer 
-    p += crt->raw.len - len;
-    end = crt_end = p + len;
+        end = crt_end;
+    }
 
     /*
      * TBSCertificate  ::=  SEQUENCE  {
@@ -777,7 +1108,13 @@ static int x509_crt_parse_der_core( mbedtls_x509_crt *crt, const unsigned char *
         return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
     }
 
-    if( ( ret = mbedtls_x509_get_name( &p, p + len, &crt->issuer ) ) != 0 )
+#if defined(X509_CRT_DEFER_DECODING)
+    ret = x509_check_name( &p, p + len );
+    crt->pending |= X509_CRT_PENDING_ISSUER;
+#else
+    ret = mbedtls_x509_get_name( &p, p + len, &crt->issuer );
+#endif
+    if( ret != 0 )
     {
         mbedtls_x509_crt_free( crt );
         return( ret );
@@ -810,12 +1147,21 @@ static int x509_crt_parse_der_core( mbedtls_x509_crt *crt, const unsigned char *
         return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
     }
 
+#if defined(X509_CRT_DEFER_DECODING)
+    if( len && ( ret = x509_check_name( &p, p + len ) ) != 0 )
+#else
     if( len && ( ret = mbedtls_x509_get_name( &p, p + len, &crt->subject ) ) != 0 )
+#endif
     {
         mbedtls_x509_crt_free( crt );
         return( ret );
     }
 
+#if defined(X509_CRT_DEFER_DECODING)
+    if( len != 0 )
+        crt->pending |= X509_CRT_PENDING_SUBJECT;
+#endif
+
     crt->subject_raw.len = p - crt->subject_raw.p;
 
     /*
@@ -867,63 +1213,347 @@ static int x509_crt_parse_der_core( mbedtls_x509_crt *crt, const unsigned char *
         }
     }
 
-    if( p != end )
+    if( p != end )
+    {
+        mbedtls_x509_crt_free( crt );
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+    }
+
+    end = crt_end;
+
+    /*
+     *  }
+     *  -- end of TBSCertificate
+     *
+     *  signatureAlgorithm   AlgorithmIdentifier,
+     *  signatureValue       BIT STRING
+     */
+    if( ( ret = mbedtls_x509_get_alg( &p, end, &sig_oid2, &sig_params2 ) ) != 0 )
+    {
+        mbedtls_x509_crt_free( crt );
+        return( ret );
+    }
+
+    if( crt->sig_oid.len != sig_oid2.len ||
+        memcmp( crt->sig_oid.p, sig_oid2.p, crt->sig_oid.len ) != 0 ||
+        sig_params1.len != sig_params2.len ||
+        ( sig_params1.len != 0 &&
+          memcmp( sig_params1.p, sig_params2.p, sig_params1.len ) != 0 ) )
+    {
+        mbedtls_x509_crt_free( crt );
+        return( MBEDTLS_ERR_X509_SIG_MISMATCH );
+    }
+
+    if( ( ret = mbedtls_x509_get_sig( &p, end, &crt->sig ) ) != 0 )
+    {
+        mbedtls_x509_crt_free( crt );
+        return( ret );
+    }
+
+    if( p != end )
+    {
+        mbedtls_x509_crt_free( crt );
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+    }
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+#if !defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+/*
+ * Count the attributes of a Name checked by the parser, or with first not
+ * NULL, also decode them into first followed by the array more
+ */
+static int x509_crt_flatten_name( const mbedtls_x509_buf *raw,
+                                  mbedtls_x509_name *first,
+                                  mbedtls_x509_name *more, size_t *count )
+{
+    int ret;
+    size_t len, n = 0;
+    unsigned char *p = raw->p;
+    const unsigned char *end, *end_set = NULL;
+    mbedtls_x509_name tmp, *cur, *prev = NULL;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, raw->p + raw->len, &len,
+            MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    end = p + len;
+
+    for( ; p < end; n++ )
+    {
+        if( first == NULL )
+            cur = &tmp;
+        else
+            cur = ( n == 0 ) ? first : &more[n - 1];
+
+        if( ( ret = mbedtls_x509_get_name_attr( &p, end, &end_set, cur ) ) != 0 )
+            return( ret );
+
+        if( first != NULL && prev != NULL )
+            prev->next = cur;
+
+        prev = cur;
+    }
+
+    *count = n;
+
+    return( 0 );
+}
+
+/*
+ * Same for the dNSName entries of a Subject Alternative Names extension, or
+ * the OIDs of an extended key usage extension
+ */
+static int x509_crt_flatten_sequence( const mbedtls_x509_buf *raw, int field,
+                                      mbedtls_x509_sequence *first,
+                                      mbedtls_x509_sequence *more,
+                                      size_t *count )
+{
+    int ret;
+    unsigned char tag;
+    size_t len, n = 0;
+    unsigned char *p = raw->p;
+    const unsigned char *end;
+    mbedtls_x509_sequence *cur, *prev = NULL;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, raw->p + raw->len, &len,
+            MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+    end = p + len;
+
+    while( p < end )
+    {
+        tag = *p++;
+
+        if( ( ret = mbedtls_asn1_get_len( &p, end, &len ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+
+        /* Only dNSName is kept, like x509_get_subject_alt_name() does */
+        if( field == X509_CRT_PENDING_SUBJECT_ALT_NAMES &&
+            tag != ( MBEDTLS_ASN1_CONTEXT_SPECIFIC | 2 ) )
+        {
+            p += len;
+            continue;
+        }
+
+        if( first != NULL )
+        {
+            cur = ( n == 0 ) ? first : &more[n - 1];
+            cur->buf.tag = tag;
+            cur->buf.p = p;
+            cur->buf.len = len;
+
+            if( prev != NULL )
+                prev->next = cur;
+
+            prev = cur;
+        }
+
+        p += len;
+        n++;
+    }
+
+    *count = n;
+
+    return( 0 );
+}
+
+/*
+ * Count the entries of the lists the parser only checked, but the first one
+ * of each, which is in the structure. With decode set, also decode them into
+ * the structure, followed by name_array and seq_array.
+ */
+static int x509_crt_flatten_lists( mbedtls_x509_crt *crt, int decode,
+                                   mbedtls_x509_name *name_array,
+                                   mbedtls_x509_sequence *seq_array,
+                                   size_t *names, size_t *seqs )
+{
+    int ret;
+    size_t n;
+
+    *names = 0;
+    *seqs = 0;
+
+    if( crt->pending & X509_CRT_PENDING_ISSUER )
+    {
+        if( ( ret = x509_crt_flatten_name( &crt->issuer_raw,
+                            decode ? &crt->issuer : NULL,
+                            name_array, &n ) ) != 0 )
+            return( ret );
+
+        if( n > 1 )
+        {
+            *names += n - 1;
+            name_array += decode ? n - 1 : 0;
+        }
+    }
+
+    if( crt->pending & X509_CRT_PENDING_SUBJECT )
+    {
+        if( ( ret = x509_crt_flatten_name( &crt->subject_raw,
+                            decode ? &crt->subject : NULL,
+                            name_array, &n ) ) != 0 )
+            return( ret );
+
+        if( n > 1 )
+            *names += n - 1;
+    }
+
+    if( crt->pending & X509_CRT_PENDING_SUBJECT_ALT_NAMES )
+    {
+        if( ( ret = x509_crt_flatten_sequence( &crt->subject_alt_names_raw,
+                            X509_CRT_PENDING_SUBJECT_ALT_NAMES,
+                            decode ? &crt->subject_alt_names : NULL,
+                            seq_array, &n ) ) != 0 )
+            return( ret );
+
+        if( n > 1 )
+        {
+            *seqs += n - 1;
+            seq_array += decode ? n - 1 : 0;
+        }
+    }
+
+    if( crt->pending & X509_CRT_PENDING_EXT_KEY_USAGE )
     {
-        mbedtls_x509_crt_free( crt );
-        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
-                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+        if( ( ret = x509_crt_flatten_sequence( &crt->ext_key_usage_raw,
+                            X509_CRT_PENDING_EXT_KEY_USAGE,
+                            decode ? &crt->ext_key_usage : NULL,
+                            seq_array, &n ) ) != 0 )
+            return( ret );
+
+        if( n > 1 )
+            *seqs += n - 1;
     }
 
-    end = crt_end;
+    if( decode )
+        crt->pending = 0;
 
-    /*
-     *  }
-     *  -- end of TBSCertificate
-     *
-     *  signatureAlgorithm   AlgorithmIdentifier,
-     *  signatureValue       BIT STRING
-     */
-    if( ( ret = mbedtls_x509_get_alg( &p, end, &sig_oid2, &sig_params2 ) ) != 0 )
+    return( 0 );
+}
+#endif /* !MBEDTLS_X509_ON_DEMAND_PARSING */
+
+/*
+ * Point buf to the same data in a copy of the DER of the certificate
+ */
+static void x509_crt_rebase( mbedtls_x509_buf *buf,
+                             const unsigned char *from, unsigned char *to )
+{
+    if( buf->p != NULL )
+        buf->p = to + ( buf->p - from );
+}
+
+/*
+ * Give a certificate checked by x509_crt_parse_der_core() a single
+ * allocation, now that the size of its lists is known. It holds, in order:
+ * the structure itself if moved is not NULL, the entries of the names after
+ * their first one, those of the sequences, and the DER if make_copy is set.
+ */
+static int x509_crt_compact( mbedtls_x509_crt *crt, int make_copy,
+                             mbedtls_x509_crt **moved )
+{
+#if !defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    int ret;
+#endif
+    size_t names = 0, seqs = 0, len;
+    unsigned char *entries = NULL, *p;
+
+#if !defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    /* First pass, to size the block */
+    if( ( ret = x509_crt_flatten_lists( crt, 0, NULL, NULL,
+                                        &names, &seqs ) ) != 0 )
     {
         mbedtls_x509_crt_free( crt );
         return( ret );
     }
+#endif
+
+    len = ( moved != NULL ? sizeof( mbedtls_x509_crt ) : 0 ) +
+          names * sizeof( mbedtls_x509_name ) +
+          seqs * sizeof( mbedtls_x509_sequence ) +
+          ( make_copy != 0 ? crt->raw.len : 0 );
+
+    if( len != 0 )
+    {
+        if( ( crt->block = mbedtls_calloc( 1, len ) ) == NULL )
+        {
+            mbedtls_x509_crt_free( crt );
+            return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+        }
+
+        crt->block_len = len;
+        entries = crt->block +
+                  ( moved != NULL ? sizeof( mbedtls_x509_crt ) : 0 );
+    }
 
-    if( crt->sig_oid.len != sig_oid2.len ||
-        memcmp( crt->sig_oid.p, sig_oid2.p, crt->sig_oid.len ) != 0 ||
-        sig_params1.len != sig_params2.len ||
-        ( sig_params1.len != 0 &&
-          memcmp( sig_params1.p, sig_params2.p, sig_params1.len ) != 0 ) )
+    if( make_copy != 0 )
     {
-        mbedtls_x509_crt_free( crt );
-        return( MBEDTLS_ERR_X509_SIG_MISMATCH );
+        const unsigned char *from = crt->raw.p;
+
+        p = crt->block + len - crt->raw.len;
+        memcpy( p, from, crt->raw.len );
+
+        x509_crt_rebase( &crt->raw, from, p );
+        x509_crt_rebase( &crt->tbs, from, p );
+        x509_crt_rebase( &crt->serial, from, p );
+        x509_crt_rebase( &crt->sig_oid, from, p );
+        x509_crt_rebase( &crt->issuer_raw, from, p );
+        x509_crt_rebase( &crt->subject_raw, from, p );
+        x509_crt_rebase( &crt->issuer_id, from, p );
+        x509_crt_rebase( &crt->subject_id, from, p );
+        x509_crt_rebase( &crt->v3_ext, from, p );
+        x509_crt_rebase( &crt->subject_alt_names_raw, from, p );
+        x509_crt_rebase( &crt->ext_key_usage_raw, from, p );
+        x509_crt_rebase( &crt->sig, from, p );
+
+        /* Freed with the block */
+        crt->own_buffer = 0;
     }
 
-    if( ( ret = mbedtls_x509_get_sig( &p, end, &crt->sig ) ) != 0 )
+#if !defined(MBEDTLS_X509_ON_DEMAND_PARSING)
+    /* Second pass, into the structure and the arrays */
+    if( ( ret = x509_crt_flatten_lists( crt, 1,
+                    names > 0 ? (mbedtls_x509_name *) entries : NULL,
+                    seqs > 0 ? (mbedtls_x509_sequence *)
+                        ( entries + names * sizeof( mbedtls_x509_name ) ) :
+                        NULL,
+                    &names, &seqs ) ) != 0 )
     {
         mbedtls_x509_crt_free( crt );
         return( ret );
     }
+#else
+    ((void) entries);
+#endif
 
-    if( p != end )
+    if( moved != NULL )
     {
-        mbedtls_x509_crt_free( crt );
-        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
-                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+        memcpy( crt->block, crt, sizeof( mbedtls_x509_crt ) );
+        *moved = (mbedtls_x509_crt *) crt->block;
     }
 
     return( 0 );
 }
+#endif /* MBEDTLS_X509_CRT_COMPACT */
 
 /*
  * Parse one X.509 certificate in DER format from a buffer and add them to a
  * chained list
  */
-int mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *buf,
-                        size_t buflen )
+static int x509_crt_parse_der_internal( mbedtls_x509_crt *chain,
+                                        const unsigned char *buf,
+                                        size_t buflen, int make_copy )
 {
     int ret;
     mbedtls_x509_crt *crt = chain, *prev = NULL;
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+    mbedtls_x509_crt tmp, *moved = NULL;
+#endif
 
     /*
      * Check for valid input
@@ -937,6 +1567,33 @@ int mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *bu
         crt = crt->next;
     }
 
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+    /*
+     * Parse in place, then move the certificate into its single allocation,
+     * together with its structure if it is added to the chain
+     */
+    ((void) prev);
+
+    if( crt->version != 0 )
+    {
+        mbedtls_x509_crt_init( &tmp );
+
+        if( ( ret = x509_crt_parse_der_core( &tmp, buf, buflen, 0 ) ) != 0 ||
+            ( ret = x509_crt_compact( &tmp, make_copy, &moved ) ) != 0 )
+        {
+            return( ret );
+        }
+
+        crt->next = moved;
+
+        return( 0 );
+    }
+
+    if( ( ret = x509_crt_parse_der_core( crt, buf, buflen, 0 ) ) != 0 )
+        return( ret );
+
+    return( x509_crt_compact( crt, make_copy, NULL ) );
+#else
     /*
      * Add new certificate on the end of the chain if needed.
      */
@@ -952,7 +1609,7 @@ int mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *bu
         crt = crt->next;
     }
 
-    if( ( ret = x509_crt_parse_der_core( crt, buf, buflen ) ) != 0 )
+    if( ( ret = x509_crt_parse_der_core( crt, buf, buflen, make_copy ) ) != 0 )
     {
         if( prev )
             prev->next = NULL;
@@ -964,6 +1621,20 @@ int mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *bu
     }
 
     return( 0 );
+#endif /* MBEDTLS_X509_CRT_COMPACT */
+}
+
+int mbedtls_x509_crt_parse_der( mbedtls_x509_crt *chain, const unsigned char *buf,
+                        size_t buflen )
+{
+    return( x509_crt_parse_der_internal( chain, buf, buflen, 1 ) );
+}
+
+int mbedtls_x509_crt_parse_der_nocopy( mbedtls_x509_crt *chain,
+                                       const unsigned char *buf,
+                                       size_t buflen )
+{
+    return( x509_crt_parse_der_internal( chain, buf, buflen, 0 ) );
 }
 
 /*
@@ -1049,7 +1720,25 @@ int mbedtls_x509_crt_parse( mbedtls_x509_crt *chain, const unsigned char *buf, s
             else
                 break;
 
-            ret = mbedtls_x509_crt_parse_der( chain, pem.buf, pem.buflen );
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+            /* The DER is copied into the single allocation of the certificate */
+            ret = x509_crt_parse_der_internal( chain, pem.buf, pem.buflen, 1 );
+#else
+            /* The certificate takes over the decoded DER, no need to copy */
+            ret = x509_crt_parse_der_internal( chain, pem.buf, pem.buflen, 0 );
+
+            if( ret == 0 )
+            {
+                mbedtls_x509_crt *crt = chain;
+
+                while( crt->next != NULL )
+                    crt = crt->next;
+
+                crt->own_buffer = 1;
+                pem.buf = NULL;
+                pem.buflen = 0;
+            }
+#endif /* MBEDTLS_X509_CRT_COMPACT */
 
             mbedtls_pem_free( &pem );
 
@@ -1360,8 +2049,12 @@ static int x509_info_ext_key_usage( char **buf, size_t *size,
  */
 #define BEFORE_COLON    18
 #define BC              "18"
-int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
-                   const mbedtls_x509_crt *crt )
+static int x509_crt_info( char *buf, size_t size, const char *prefix,
+                          const mbedtls_x509_crt *crt,
+                          const mbedtls_x509_name *issuer,
+                          const mbedtls_x509_name *subject,
+                          const mbedtls_x509_sequence *subject_alt_names,
+                          const mbedtls_x509_sequence *ext_key_usage )
 {
     int ret;
     size_t n;
@@ -1391,12 +2084,12 @@ int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
 
     ret = mbedtls_snprintf( p, n, "\n%sissuer name       : ", prefix );
     MBEDTLS_X509_SAFE_SNPRINTF;
-    ret = mbedtls_x509_dn_gets( p, n, &crt->issuer  );
+    ret = mbedtls_x509_dn_gets( p, n, issuer );
     MBEDTLS_X509_SAFE_SNPRINTF;
 
     ret = mbedtls_snprintf( p, n, "\n%ssubject name      : ", prefix );
     MBEDTLS_X509_SAFE_SNPRINTF;
-    ret = mbedtls_x509_dn_gets( p, n, &crt->subject );
+    ret = mbedtls_x509_dn_gets( p, n, subject );
     MBEDTLS_X509_SAFE_SNPRINTF;
 
     ret = mbedtls_snprintf( p, n, "\n%sissued  on        : " \
@@ -1454,7 +2147,7 @@ int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
         MBEDTLS_X509_SAFE_SNPRINTF;
 
         if( ( ret = x509_info_subject_alt_name( &p, &n,
-                                            &crt->subject_alt_names ) ) != 0 )
+                                            subject_alt_names ) ) != 0 )
             return( ret );
     }
 
@@ -1482,7 +2175,7 @@ int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
         MBEDTLS_X509_SAFE_SNPRINTF;
 
         if( ( ret = x509_info_ext_key_usage( &p, &n,
-                                             &crt->ext_key_usage ) ) != 0 )
+                                             ext_key_usage ) ) != 0 )
             return( ret );
     }
 
@@ -1492,6 +2185,47 @@ int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
     return( (int) ( size - n ) );
 }
 
+int mbedtls_x509_crt_info( char *buf, size_t size, const char *prefix,
+                   const mbedtls_x509_crt *crt )
+{
+    int ret;
+    const mbedtls_x509_name *issuer = NULL, *subject = NULL;
+    const mbedtls_x509_sequence *subject_alt_names = NULL, *ext_key_usage = NULL;
+    mbedtls_x509_name tmp_issuer, tmp_subject;
+    mbedtls_x509_sequence tmp_subject_alt_names, tmp_ext_key_usage;
+
+    memset( &tmp_issuer, 0, sizeof( tmp_issuer ) );
+    memset( &tmp_subject, 0, sizeof( tmp_subject ) );
+    memset( &tmp_subject_alt_names, 0, sizeof( tmp_subject_alt_names ) );
+    memset( &tmp_ext_key_usage, 0, sizeof( tmp_ext_key_usage ) );
+
+    if( crt != NULL &&
+        ( ( ret = x509_crt_peek_name( crt, X509_CRT_PENDING_ISSUER,
+                                      &tmp_issuer, &issuer ) ) != 0 ||
+          ( ret = x509_crt_peek_name( crt, X509_CRT_PENDING_SUBJECT,
+                                      &tmp_subject, &subject ) ) != 0 ||
+          ( ret = x509_crt_peek_sequence( crt, X509_CRT_PENDING_SUBJECT_ALT_NAMES,
+                                          &tmp_subject_alt_names,
+                                          &subject_alt_names ) ) != 0 ||
+          ( ret = x509_crt_peek_sequence( crt, X509_CRT_PENDING_EXT_KEY_USAGE,
+                                          &tmp_ext_key_usage,
+                                          &ext_key_usage ) ) != 0 ) )
+    {
+        goto exit;
+    }
+
+    ret = x509_crt_info( buf, size, prefix, crt, issuer, subject,
+                         subject_alt_names, ext_key_usage );
+
+exit:
+    x509_crt_free_name( &tmp_issuer );
+    x509_crt_free_name( &tmp_subject );
+    x509_crt_free_sequence( &tmp_subject_alt_names );
+    x509_crt_free_sequence( &tmp_ext_key_usage );
+
+    return( ret );
+}
+
 struct x509_crt_verify_string {
     int code;
     const char *string;
@@ -1518,6 +2252,9 @@ static const struct x509_crt_verify_string x509_crt_verify_strings[] = {
     { MBEDTLS_X509_BADCRL_BAD_MD,         "The CRL is signed with an unacceptable hash." },
     { MBEDTLS_X509_BADCRL_BAD_PK,         "The CRL is signed with an unacceptable PK alg (eg RSA vs ECDSA)." },
     { MBEDTLS_X509_BADCRL_BAD_KEY,        "The CRL is signed with an unacceptable key (eg bad curve, RSA too short)." },
+    { MBEDTLS_X509_BADOCSP_NOT_TRUSTED,   "The OCSP response is not correctly signed, or has no status for the certificate." },
+    { MBEDTLS_X509_BADOCSP_EXPIRED,       "The OCSP response is expired." },
+    { MBEDTLS_X509_BADOCSP_FUTURE,        "The OCSP response is from the future." },
     { 0, NULL }
 };
 
@@ -1579,30 +2316,43 @@ int mbedtls_x509_crt_check_extended_key_usage( const mbedtls_x509_crt *crt,
                                        const char *usage_oid,
                                        size_t usage_len )
 {
-    const mbedtls_x509_sequence *cur;
+    int ret = MBEDTLS_ERR_X509_BAD_INPUT_DATA;
+    const mbedtls_x509_sequence *cur, *ext_key_usage;
+    mbedtls_x509_sequence tmp;
 
     /* Extension is not mandatory, absent means no restriction */
     if( ( crt->ext_types & MBEDTLS_X509_EXT_EXTENDED_KEY_USAGE ) == 0 )
         return( 0 );
 
+    if( x509_crt_peek_sequence( crt, X509_CRT_PENDING_EXT_KEY_USAGE,
+                                &tmp, &ext_key_usage ) != 0 )
+        goto exit;
+
     /*
      * Look for the requested usage (or wildcard ANY) in our list
      */
-    for( cur = &crt->ext_key_usage; cur != NULL; cur = cur->next )
+    for( cur = ext_key_usage; cur != NULL; cur = cur->next )
     {
         const mbedtls_x509_buf *cur_oid = &cur->buf;
 
         if( cur_oid->len == usage_len &&
             memcmp( cur_oid->p, usage_oid, usage_len ) == 0 )
         {
-            return( 0 );
+            ret = 0;
+            break;
         }
 
         if( MBEDTLS_OID_CMP( MBEDTLS_OID_ANY_EXTENDED_KEY_USAGE, cur_oid ) == 0 )
-            return( 0 );
+        {
+            ret = 0;
+            break;
+        }
     }
 
-    return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+exit:
+    x509_crt_free_sequence( &tmp );
+
+    return( ret );
 }
 #endif /* MBEDTLS_X509_CHECK_EXTENDED_KEY_USAGE */
 
@@ -1612,6 +2362,9 @@ int mbedtls_x509_crt_check_extended_key_usage( const mbedtls_x509_crt *crt,
  */
 int mbedtls_x509_crt_is_revoked( const mbedtls_x509_crt *crt, const mbedtls_x509_crl *crl )
 {
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    return( mbedtls_x509_crl_is_revoked( crl, &crt->serial ) );
+#else
     const mbedtls_x509_crl_entry *cur = &crl->entry;
 
     while( cur != NULL && cur->serial.len != 0 )
@@ -1627,6 +2380,57 @@ int mbedtls_x509_crt_is_revoked( const mbedtls_x509_crt *crt, const mbedtls_x509
     }
 
     return( 0 );
+#endif /* MBEDTLS_X509_CRL_INDEX */
+}
+
+/*
+ * Check that a CRL is correctly signed by the trusted CA and current.
+ * MBEDTLS_X509_BADCRL_NOT_TRUSTED stops the checks of the CRLs.
+ */
+static int x509_crt_check_crl( mbedtls_x509_crl *crl, mbedtls_x509_crt *ca,
+                               const mbedtls_x509_crt_profile *profile )
+{
+    int flags = 0;
+    unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+    const mbedtls_md_info_t *md_info;
+
+    if( x509_profile_check_md_alg( profile, crl->sig_md ) != 0 )
+        flags |= MBEDTLS_X509_BADCRL_BAD_MD;
+
+    if( x509_profile_check_pk_alg( profile, crl->sig_pk ) != 0 )
+        flags |= MBEDTLS_X509_BADCRL_BAD_PK;
+
+    md_info = mbedtls_md_info_from_type( crl->sig_md );
+    if( md_info == NULL )
+    {
+        /*
+         * Cannot check 'unknown' hash
+         */
+        return( flags | MBEDTLS_X509_BADCRL_NOT_TRUSTED );
+    }
+
+    mbedtls_md( md_info, crl->tbs.p, crl->tbs.len, hash );
+
+    if( x509_profile_check_key( profile, crl->sig_pk, &ca->pk ) != 0 )
+        flags |= MBEDTLS_X509_BADCERT_BAD_KEY;
+
+    if( mbedtls_pk_verify_ext( crl->sig_pk, crl->sig_opts, &ca->pk,
+                       crl->sig_md, hash, mbedtls_md_get_size( md_info ),
+                       crl->sig.p, crl->sig.len ) != 0 )
+    {
+        return( flags | MBEDTLS_X509_BADCRL_NOT_TRUSTED );
+    }
+
+    /*
+     * Check for validity of CRL (Do not drop out)
+     */
+    if( mbedtls_x509_time_is_past( &crl->next_update ) )
+        flags |= MBEDTLS_X509_BADCRL_EXPIRED;
+
+    if( mbedtls_x509_time_is_future( &crl->this_update ) )
+        flags |= MBEDTLS_X509_BADCRL_FUTURE;
+
+    return( flags );
 }
 
 /*
@@ -1638,8 +2442,9 @@ static int x509_crt_verifycrl( mbedtls_x509_crt *crt, mbedtls_x509_crt *ca,
                                const mbedtls_x509_crt_profile *profile )
 {
     int flags = 0;
-    unsigned char hash[MBEDTLS_MD_MAX_SIZE];
-    const mbedtls_md_info_t *md_info;
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    mbedtls_x509_crl *delta;
+#endif
 
     if( ca == NULL )
         return( flags );
@@ -1667,45 +2472,22 @@ static int x509_crt_verifycrl( mbedtls_x509_crt *crt, mbedtls_x509_crt *ca,
 #endif
 
         /*
-         * Check if CRL is correctly signed by the trusted CA
+         * Check if CRL is correctly signed by the trusted CA, and so are
+         * the delta CRLs merged into it
          */
-        if( x509_profile_check_md_alg( profile, crl_list->sig_md ) != 0 )
-            flags |= MBEDTLS_X509_BADCRL_BAD_MD;
+        flags |= x509_crt_check_crl( crl_list, ca, profile );
 
-        if( x509_profile_check_pk_alg( profile, crl_list->sig_pk ) != 0 )
-            flags |= MBEDTLS_X509_BADCRL_BAD_PK;
-
-        md_info = mbedtls_md_info_from_type( crl_list->sig_md );
-        if( md_info == NULL )
+#if defined(MBEDTLS_X509_CRL_INDEX)
+        for( delta = crl_list->deltas;
+             delta != NULL && ( flags & MBEDTLS_X509_BADCRL_NOT_TRUSTED ) == 0;
+             delta = delta->next )
         {
-            /*
-             * Cannot check 'unknown' hash
-             */
-            flags |= MBEDTLS_X509_BADCRL_NOT_TRUSTED;
-            break;
+            flags |= x509_crt_check_crl( delta, ca, profile );
         }
+#endif
 
-        mbedtls_md( md_info, crl_list->tbs.p, crl_list->tbs.len, hash );
-
-        if( x509_profile_check_key( profile, crl_list->sig_pk, &ca->pk ) != 0 )
-            flags |= MBEDTLS_X509_BADCERT_BAD_KEY;
-
-        if( mbedtls_pk_verify_ext( crl_list->sig_pk, crl_list->sig_opts, &ca->pk,
-                           crl_list->sig_md, hash, mbedtls_md_get_size( md_info ),
-                           crl_list->sig.p, crl_list->sig.len ) != 0 )
-        {
-            flags |= MBEDTLS_X509_BADCRL_NOT_TRUSTED;
+        if( ( flags & MBEDTLS_X509_BADCRL_NOT_TRUSTED ) != 0 )
             break;
-        }
-
-        /*
-         * Check for validity of CRL (Do not drop out)
-         */
-        if( mbedtls_x509_time_is_past( &crl_list->next_update ) )
-            flags |= MBEDTLS_X509_BADCRL_EXPIRED;
-
-        if( mbedtls_x509_time_is_future( &crl_list->this_update ) )
-            flags |= MBEDTLS_X509_BADCRL_FUTURE;
 
         /*
          * Check if certificate is revoked
@@ -1755,7 +2537,7 @@ static int x509_memcasecmp( const void *s1, const void *s2, size_t len )
 /*
  * Return 0 if name matches wildcard, -1 otherwise
  */
-static int x509_check_wildcard( const char *cn, mbedtls_x509_buf *name )
+static int x509_check_wildcard( const char *cn, const mbedtls_x509_buf *name )
 {
     size_t i;
     size_t cn_idx = 0, cn_len = strlen( cn );
@@ -1810,6 +2592,34 @@ static int x509_string_cmp( const mbedtls_x509_buf *a, const mbedtls_x509_buf *b
     return( -1 );
 }
 
+/*
+ * Compare one attribute of two X.509 Names, and whether the next one is in
+ * the same set.
+ *
+ * Return 0 if equal, -1 otherwise.
+ */
+static int x509_name_attr_cmp( const mbedtls_x509_name *a,
+                               const mbedtls_x509_name *b )
+{
+    /* type */
+    if( a->oid.tag != b->oid.tag ||
+        a->oid.len != b->oid.len ||
+        memcmp( a->oid.p, b->oid.p, b->oid.len ) != 0 )
+    {
+        return( -1 );
+    }
+
+    /* value */
+    if( x509_string_cmp( &a->val, &b->val ) != 0 )
+        return( -1 );
+
+    /* structure of the list of sets */
+    if( a->next_merged != b->next_merged )
+        return( -1 );
+
+    return( 0 );
+}
+
 /*
  * Compare two X.509 Names (aka rdnSequence).
  *
@@ -1820,7 +2630,7 @@ static int x509_string_cmp( const mbedtls_x509_buf *a, const mbedtls_x509_buf *b
  *
  * Return 0 if equal, -1 otherwise.
  */
-static int x509_name_cmp( const mbedtls_x509_name *a, const mbedtls_x509_name *b )
+int mbedtls_x509_name_cmp( const mbedtls_x509_name *a, const mbedtls_x509_name *b )
 {
     /* Avoid recursion, it might not be optimised by the compiler */
     while( a != NULL || b != NULL )
@@ -1828,27 +2638,59 @@ static int x509_name_cmp( const mbedtls_x509_name *a, const mbedtls_x509_name *b
         if( a == NULL || b == NULL )
             return( -1 );
 
-        /* type */
-        if( a->oid.tag != b->oid.tag ||
-            a->oid.len != b->oid.len ||
-            memcmp( a->oid.p, b->oid.p, b->oid.len ) != 0 )
-        {
+        if( x509_name_attr_cmp( a, b ) != 0 )
             return( -1 );
-        }
 
-        /* value */
-        if( x509_string_cmp( &a->val, &b->val ) != 0 )
+        a = a->next;
+        b = b->next;
+    }
+
+    /* a == NULL == b */
+    return( 0 );
+}
+
+/*
+ * Compare two X.509 Names in DER (including the SEQUENCE tag) like
+ * mbedtls_x509_name_cmp(), without decoding them into lists.
+ *
+ * Return 0 if equal, -1 otherwise (also if one of them doesn't parse).
+ */
+int mbedtls_x509_name_cmp_raw( const mbedtls_x509_buf *a, const mbedtls_x509_buf *b )
+{
+    size_t len;
+    unsigned char *pa = a->p, *pb = b->p;
+    const unsigned char *end_a = pa + a->len, *end_b = pb + b->len;
+    const unsigned char *set_a = NULL, *set_b = NULL;
+    mbedtls_x509_name na, nb;
+
+    if( a->len == b->len && memcmp( a->p, b->p, b->len ) == 0 )
+        return( 0 );
+
+    if( mbedtls_asn1_get_tag( &pa, end_a, &len,
+            MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 ||
+        pa + len != end_a ||
+        mbedtls_asn1_get_tag( &pb, end_b, &len,
+            MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) != 0 ||
+        pb + len != end_b )
+    {
+        return( -1 );
+    }
+
+    while( pa < end_a || pb < end_b )
+    {
+        if( pa == end_a || pb == end_b )
             return( -1 );
 
-        /* structure of the list of sets */
-        if( a->next_merged != b->next_merged )
+        if( mbedtls_x509_get_name_attr( &pa, end_a, &set_a, &na ) != 0 ||
+            mbedtls_x509_get_name_attr( &pb, end_b, &set_b, &nb ) != 0 )
+        {
             return( -1 );
+        }
 
-        a = a->next;
-        b = b->next;
+        if( x509_name_attr_cmp( &na, &nb ) != 0 )
+            return( -1 );
     }
 
-    /* a == NULL == b */
     return( 0 );
 }
 
@@ -1866,7 +2708,7 @@ static int x509_crt_check_parent( const mbedtls_x509_crt *child,
     int need_ca_bit;
 
     /* Parent must be the issuer */
-    if( x509_name_cmp( &child->issuer, &parent->subject ) != 0 )
+    if( mbedtls_x509_name_cmp_raw( &child->issuer_raw, &parent->subject_raw ) != 0 )
         return( -1 );
 
     /* Parent must have the basicConstraints CA bit set as a general rule */
@@ -1898,9 +2740,72 @@ static int x509_crt_check_parent( const mbedtls_x509_crt *child,
     return( 0 );
 }
 
+/*
+ * Walk the trusted CAs that may be the parent of a certificate: the list
+ * from 'start' on, or the candidates the index of the list finds if it has
+ * one that is up to date.
+ */
+typedef struct
+{
+    mbedtls_x509_crt *next;
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+    const mbedtls_x509_ca_index *index;
+    const mbedtls_x509_ca_index_entry *entry;
+#endif
+}
+x509_crt_ca_walk;
+
+static void x509_crt_ca_walk_init( x509_crt_ca_walk *walk,
+                                   mbedtls_x509_crt *trust_ca,
+                                   mbedtls_x509_crt *start )
+{
+    walk->next = start;
+
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+    walk->index = NULL;
+    walk->entry = NULL;
+
+    /* Certificates appended after the index was built aren't in it */
+    if( start != NULL && trust_ca != NULL && trust_ca->ca_index != NULL &&
+        trust_ca->ca_index->chain == trust_ca &&
+        trust_ca->ca_index->last->next == NULL )
+    {
+        walk->index = trust_ca->ca_index;
+    }
+#else
+    ((void) trust_ca);
+#endif
+}
+
+static mbedtls_x509_crt *x509_crt_ca_walk_next( x509_crt_ca_walk *walk,
+                                                const mbedtls_x509_crt *child )
+{
+    mbedtls_x509_crt *ca = walk->next;
+
+#if defined(MBEDTLS_X509_CA_INDEX_C)
+    if( walk->index != NULL )
+    {
+        walk->entry = mbedtls_x509_ca_index_find_issuer( walk->index, child,
+                                                         walk->entry );
+        return( walk->entry != NULL ? walk->entry->crt : NULL );
+    }
+#else
+    ((void) child);
+#endif
+
+    if( ca != NULL )
+        walk->next = ca->next;
+
+    return( ca );
+}
+
+/*
+ * trust_ca is the list of trusted CAs, and first_ca the first one of them
+ * to try as the parent of child
+ */
 static int x509_crt_verify_top(
                 mbedtls_x509_crt *child, mbedtls_x509_crt *trust_ca,
-                mbedtls_x509_crl *ca_crl,
+                mbedtls_x509_crt *first_ca, mbedtls_x509_crl *ca_crl,
                 const mbedtls_x509_crt_profile *profile,
                 int path_cnt, int self_cnt, uint32_t *flags,
                 int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *),
@@ -1912,6 +2817,7 @@ static int x509_crt_verify_top(
     unsigned char hash[MBEDTLS_MD_MAX_SIZE];
     const mbedtls_md_info_t *md_info;
     mbedtls_x509_crt *future_past_ca = NULL;
+    x509_crt_ca_walk walk;
 
     if( mbedtls_x509_time_is_past( &child->valid_to ) )
         *flags |= MBEDTLS_X509_BADCERT_EXPIRED;
@@ -1936,12 +2842,14 @@ static int x509_crt_verify_top(
         /*
          * Cannot check 'unknown', no need to try any CA
          */
-        trust_ca = NULL;
+        first_ca = NULL;
     }
     else
         mbedtls_md( md_info, child->tbs.p, child->tbs.len, hash );
 
-    for( /* trust_ca */ ; trust_ca != NULL; trust_ca = trust_ca->next )
+    x509_crt_ca_walk_init( &walk, trust_ca, first_ca );
+
+    while( ( trust_ca = x509_crt_ca_walk_next( &walk, child ) ) != NULL )
     {
         if( x509_crt_check_parent( child, trust_ca, 1, path_cnt == 0 ) != 0 )
             continue;
@@ -2054,9 +2962,11 @@ static int x509_crt_verify_child(
     unsigned char hash[MBEDTLS_MD_MAX_SIZE];
     mbedtls_x509_crt *grandparent;
     const mbedtls_md_info_t *md_info;
+    x509_crt_ca_walk walk;
 
     /* Counting intermediate self signed certificates */
-    if( ( path_cnt != 0 ) && x509_name_cmp( &child->issuer, &child->subject ) == 0 )
+    if( ( path_cnt != 0 ) &&
+        mbedtls_x509_name_cmp_raw( &child->issuer_raw, &child->subject_raw ) == 0 )
         self_cnt++;
 
     /* path_cnt is 0 for the first intermediate CA */
@@ -2107,9 +3017,9 @@ static int x509_crt_verify_child(
 #endif
 
     /* Look for a grandparent in trusted CAs */
-    for( grandparent = trust_ca;
-         grandparent != NULL;
-         grandparent = grandparent->next )
+    x509_crt_ca_walk_init( &walk, trust_ca, trust_ca );
+
+    while( ( grandparent = x509_crt_ca_walk_next( &walk, parent ) ) != NULL )
     {
         if( x509_crt_check_parent( parent, grandparent,
                                    0, path_cnt == 0 ) == 0 )
@@ -2118,7 +3028,7 @@ static int x509_crt_verify_child(
 
     if( grandparent != NULL )
     {
-        ret = x509_crt_verify_top( parent, grandparent, ca_crl, profile,
+        ret = x509_crt_verify_top( parent, trust_ca, grandparent, ca_crl, profile,
                                 path_cnt + 1, self_cnt, &parent_flags, f_vrfy, p_vrfy );
         if( ret != 0 )
             return( ret );
@@ -2155,7 +3065,7 @@ static int x509_crt_verify_child(
         }
         else
         {
-            ret = x509_crt_verify_top( parent, trust_ca, ca_crl, profile,
+            ret = x509_crt_verify_top( parent, trust_ca, trust_ca, ca_crl, profile,
                                        path_cnt + 1, self_cnt, &parent_flags,
                                        f_vrfy, p_vrfy );
             if( ret != 0 )
@@ -2203,9 +3113,15 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
     int ret;
     int pathlen = 0, selfsigned = 0;
     mbedtls_x509_crt *parent;
-    mbedtls_x509_name *name;
-    mbedtls_x509_sequence *cur = NULL;
+    const mbedtls_x509_name *name;
+    const mbedtls_x509_sequence *cur = NULL;
+    mbedtls_x509_name subject;
+    mbedtls_x509_sequence subject_alt_names;
     mbedtls_pk_type_t pk_type;
+    x509_crt_ca_walk walk;
+
+    memset( &subject, 0, sizeof( subject ) );
+    memset( &subject_alt_names, 0, sizeof( subject_alt_names ) );
 
     *flags = 0;
 
@@ -2217,12 +3133,14 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
 
     if( cn != NULL )
     {
-        name = &crt->subject;
         cn_len = strlen( cn );
 
         if( crt->ext_types & MBEDTLS_X509_EXT_SUBJECT_ALT_NAME )
         {
-            cur = &crt->subject_alt_names;
+            if( ( ret = x509_crt_peek_sequence( crt,
+                                    X509_CRT_PENDING_SUBJECT_ALT_NAMES,
+                                    &subject_alt_names, &cur ) ) != 0 )
+                goto exit;
 
             while( cur != NULL )
             {
@@ -2245,6 +3163,10 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
         }
         else
         {
+            if( ( ret = x509_crt_peek_name( crt, X509_CRT_PENDING_SUBJECT,
+                                            &subject, &name ) ) != 0 )
+                goto exit;
+
             while( name != NULL )
             {
                 if( MBEDTLS_OID_CMP( MBEDTLS_OID_AT_CN, &name->oid ) == 0 )
@@ -2277,7 +3199,9 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
         *flags |= MBEDTLS_X509_BADCERT_BAD_KEY;
 
     /* Look for a parent in trusted CAs */
-    for( parent = trust_ca; parent != NULL; parent = parent->next )
+    x509_crt_ca_walk_init( &walk, trust_ca, trust_ca );
+
+    while( ( parent = x509_crt_ca_walk_next( &walk, crt ) ) != NULL )
     {
         if( x509_crt_check_parent( crt, parent, 0, pathlen == 0 ) == 0 )
             break;
@@ -2285,7 +3209,7 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
 
     if( parent != NULL )
     {
-        ret = x509_crt_verify_top( crt, parent, ca_crl, profile,
+        ret = x509_crt_verify_top( crt, trust_ca, parent, ca_crl, profile,
                                    pathlen, selfsigned, flags, f_vrfy, p_vrfy );
         if( ret != 0 )
             goto exit;
@@ -2307,7 +3231,7 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
         }
         else
         {
-            ret = x509_crt_verify_top( crt, trust_ca, ca_crl, profile,
+            ret = x509_crt_verify_top( crt, trust_ca, trust_ca, ca_crl, profile,
                                        pathlen, selfsigned, flags, f_vrfy, p_vrfy );
             if( ret != 0 )
                 goto exit;
@@ -2315,6 +3239,9 @@ int mbedtls_x509_crt_verify_with_profile( mbedtls_x509_crt *crt,
     }
 
 exit:
+    x509_crt_free_name( &subject );
+    x509_crt_free_sequence( &subject_alt_names );
+
     /* prevent misuse of the vrfy callback - VERIFY_FAILED would be ignored by
      * the SSL module for authmode optional, but non-zero return from the
      * callback means a fatal error so it shouldn't be ignored */
@@ -2348,10 +3275,6 @@ void mbedtls_x509_crt_free( mbedtls_x509_crt *crt )
 {
     mbedtls_x509_crt *cert_cur = crt;
     mbedtls_x509_crt *cert_prv;
-    mbedtls_x509_name *name_cur;
-    mbedtls_x509_name *name_prv;
-    mbedtls_x509_sequence *seq_cur;
-    mbedtls_x509_sequence *seq_prv;
 
     if( crt == NULL )
         return;
@@ -2364,47 +3287,42 @@ void mbedtls_x509_crt_free( mbedtls_x509_crt *crt )
         mbedtls_free( cert_cur->sig_opts );
 #endif
 
-        name_cur = cert_cur->issuer.next;
-        while( name_cur != NULL )
-        {
-            name_prv = name_cur;
-            name_cur = name_cur->next;
-            mbedtls_zeroize( name_prv, sizeof( mbedtls_x509_name ) );
-            mbedtls_free( name_prv );
-        }
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+        /* Lists decoded when parsing are in the block, not on the heap */
+        if( x509_crt_in_block( cert_cur, cert_cur->issuer.next ) )
+            cert_cur->issuer.next = NULL;
+        if( x509_crt_in_block( cert_cur, cert_cur->subject.next ) )
+            cert_cur->subject.next = NULL;
+        if( x509_crt_in_block( cert_cur, cert_cur->ext_key_usage.next ) )
+            cert_cur->ext_key_usage.next = NULL;
+        if( x509_crt_in_block( cert_cur, cert_cur->subject_alt_names.next ) )
+            cert_cur->subject_alt_names.next = NULL;
+#endif
 
-        name_cur = cert_cur->subject.next;
-        while( name_cur != NULL )
-        {
-            name_prv = name_cur;
-            name_cur = name_cur->next;
-            mbedtls_zeroize( name_prv, sizeof( mbedtls_x509_name ) );
-            mbedtls_free( name_prv );
-        }
+        x509_crt_free_name( &cert_cur->issuer );
+        x509_crt_free_name( &cert_cur->subject );
+        x509_crt_free_sequence( &cert_cur->ext_key_usage );
+        x509_crt_free_sequence( &cert_cur->subject_alt_names );
 
-        seq_cur = cert_cur->ext_key_usage.next;
-        while( seq_cur != NULL )
+        if( cert_cur->raw.p != NULL && cert_cur->own_buffer )
         {
-            seq_prv = seq_cur;
-            seq_cur = seq_cur->next;
-            mbedtls_zeroize( seq_prv, sizeof( mbedtls_x509_sequence ) );
-            mbedtls_free( seq_prv );
+            mbedtls_zeroize( cert_cur->raw.p, cert_cur->raw.len );
+            mbedtls_free( cert_cur->raw.p );
         }
 
-        seq_cur = cert_cur->subject_alt_names.next;
-        while( seq_cur != NULL )
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+        if( cert_cur->block == (unsigned char *) cert_cur )
         {
-            seq_prv = seq_cur;
-            seq_cur = seq_cur->next;
-            mbedtls_zeroize( seq_prv, sizeof( mbedtls_x509_sequence ) );
-            mbedtls_free( seq_prv );
+            /* The structure and its block are freed below */
+            mbedtls_zeroize( cert_cur->block + sizeof( mbedtls_x509_crt ),
+                             cert_cur->block_len - sizeof( mbedtls_x509_crt ) );
         }
-
-        if( cert_cur->raw.p != NULL )
+        else if( cert_cur->block != NULL )
         {
-            mbedtls_zeroize( cert_cur->raw.p, cert_cur->raw.len );
-            mbedtls_free( cert_cur->raw.p );
+            mbedtls_zeroize( cert_cur->block, cert_cur->block_len );
+            mbedtls_free( cert_cur->block );
         }
+#endif
 
         cert_cur = cert_cur->next;
     }
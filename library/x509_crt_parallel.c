@@ -0,0 +1,600 @@
+/*
+ *  Parallel loading of certificate directories and bundles
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ * The work is cut into items, one per file or PEM block, each parsed into
+ * a list of its own. Threads take the next item until there are none left,
+ * so a few large files don't hold up the others. Once they are all done,
+ * the calling thread appends the lists to the target in the order of the
+ * items, which makes the result independent of the scheduling.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_X509_CRT_PARALLEL_C)
+
+#include "mbedtls/x509_crt_parallel.h"
+
+#if defined(MBEDTLS_PEM_PARSE_C)
+#include "mbedtls/pem.h"
+#endif
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#define mbedtls_snprintf  snprintf
+#endif
+
+#include "mbedtls/threading.h"
+
+#include <string.h>
+
+#if defined(MBEDTLS_FS_IO)
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(_WIN32) && !defined(EFIX64) && !defined(EFI32)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif /* _WIN32 && !EFIX64 && !EFI32 */
+#endif /* MBEDTLS_FS_IO */
+
+#define PEM_BEGIN_CRT   "-----BEGIN CERTIFICATE-----"
+#define PEM_END_CRT     "-----END CERTIFICATE-----"
+
+/*
+ * A file or a PEM block, and what it parsed into
+ */
+typedef struct
+{
+    const char *path;               /* file to load, or NULL            */
+    const unsigned char *pem;       /* PEM block of a bundle            */
+    mbedtls_x509_crt *chain;        /* certificates parsed from it      */
+    int ret;                        /* outcome, as reported             */
+}
+x509_parallel_item;
+
+typedef struct
+{
+    x509_parallel_item *items;
+    size_t count;
+    size_t next;                    /* next item to take                */
+#if defined(MBEDTLS_THREADING_PTHREAD)
+    mbedtls_threading_mutex_t mutex;
+#endif
+}
+x509_parallel_work;
+
+#if defined(MBEDTLS_PEM_PARSE_C)
+/*
+ * Decode the PEM block at the start of the NULL-terminated pem, and let
+ * the certificate take over the DER, like mbedtls_x509_crt_parse() does
+ */
+static int x509_parallel_parse_pem( mbedtls_x509_crt *chain,
+                                    const unsigned char *pem )
+{
+    int ret;
+    size_t use_len;
+    mbedtls_pem_context ctx;
+
+    mbedtls_pem_init( &ctx );
+
+    ret = mbedtls_pem_read_buffer( &ctx, PEM_BEGIN_CRT, PEM_END_CRT,
+                                   pem, NULL, 0, &use_len );
+
+#if defined(MBEDTLS_X509_CRT_COMPACT)
+    /* The DER is copied into the single allocation of the certificate */
+    if( ret == 0 )
+        ret = mbedtls_x509_crt_parse_der( chain, ctx.buf, ctx.buflen );
+#else
+    if( ret == 0 )
+        ret = mbedtls_x509_crt_parse_der_nocopy( chain, ctx.buf, ctx.buflen );
+
+    if( ret == 0 )
+    {
+        chain->own_buffer = 1;
+        ctx.buf = NULL;
+        ctx.buflen = 0;
+    }
+#endif
+
+    mbedtls_pem_free( &ctx );
+
+    return( ret );
+}
+#endif /* MBEDTLS_PEM_PARSE_C */
+
+#if defined(MBEDTLS_PEM_PARSE_C) || defined(MBEDTLS_FS_IO)
+static void x509_parallel_parse_item( x509_parallel_item *item )
+{
+    item->chain = mbedtls_calloc( 1, sizeof( mbedtls_x509_crt ) );
+    if( item->chain == NULL )
+    {
+        item->ret = MBEDTLS_ERR_X509_ALLOC_FAILED;
+        return;
+    }
+
+    mbedtls_x509_crt_init( item->chain );
+
+#if defined(MBEDTLS_FS_IO)
+    if( item->path != NULL )
+    {
+        item->ret = mbedtls_x509_crt_parse_file( item->chain, item->path );
+        return;
+    }
+#endif
+
+#if defined(MBEDTLS_PEM_PARSE_C)
+    item->ret = x509_parallel_parse_pem( item->chain, item->pem );
+#else
+    item->ret = MBEDTLS_ERR_X509_FEATURE_UNAVAILABLE;
+#endif
+}
+
+/*
+ * Body of each thread, the calling one included
+ */
+static void *x509_parallel_worker( void *arg )
+{
+    x509_parallel_work *work = (x509_parallel_work *) arg;
+    size_t i;
+
+    for( ;; )
+    {
+#if defined(MBEDTLS_THREADING_PTHREAD)
+        if( mbedtls_mutex_lock( &work->mutex ) != 0 )
+            break;
+#endif
+
+        i = work->next;
+        if( i < work->count )
+            work->next++;
+
+#if defined(MBEDTLS_THREADING_PTHREAD)
+        if( mbedtls_mutex_unlock( &work->mutex ) != 0 )
+            break;
+#endif
+
+        if( i >= work->count )
+            break;
+
+        x509_parallel_parse_item( &work->items[i] );
+    }
+
+    return( NULL );
+}
+
+/*
+ * Parse all items, then append their lists to chain in order.
+ * Items that no thread could take keep the mutex error as outcome.
+ */
+static void x509_parallel_run( mbedtls_x509_crt *chain,
+                               x509_parallel_item *items, size_t count,
+                               int threads,
+                               mbedtls_x509_crt_parallel_report_t *f_report,
+                               void *p_report )
+{
+    size_t i;
+    mbedtls_x509_crt *tail;
+    x509_parallel_work work;
+#if defined(MBEDTLS_THREADING_PTHREAD)
+    pthread_t tids[MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS - 1];
+    int started = 0;
+
+    if( threads > MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS )
+        threads = MBEDTLS_X509_CRT_PARALLEL_MAX_THREADS;
+    if( (size_t) threads > count )
+        threads = (int) count;
+#else
+    (void) threads;
+#endif
+
+    for( i = 0; i < count; i++ )
+    {
+        items[i].chain = NULL;
+        items[i].ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+    }
+
+    work.items = items;
+    work.count = count;
+    work.next = 0;
+
+#if defined(MBEDTLS_THREADING_PTHREAD)
+    mbedtls_mutex_init( &work.mutex );
+
+    /* If a thread can't be started, the others do its share */
+    for( ; started < threads - 1; started++ )
+    {
+        if( pthread_create( &tids[started], NULL,
+                            x509_parallel_worker, &work ) != 0 )
+            break;
+    }
+#endif
+
+    x509_parallel_worker( &work );
+
+#if defined(MBEDTLS_THREADING_PTHREAD)
+    while( started > 0 )
+        pthread_join( tids[--started], NULL );
+
+    mbedtls_mutex_free( &work.mutex );
+#endif
+
+    for( tail = chain; tail->next != NULL; tail = tail->next )
+        ;
+
+    for( i = 0; i < count; i++ )
+    {
+        mbedtls_x509_crt *crt = items[i].chain;
+
+        if( crt != NULL && crt->version != 0 )
+        {
+            if( tail->version == 0 )
+            {
+                /* The head of the target is embedded in the caller's
+                 * structure: move the first certificate into it */
+                memcpy( tail, crt, sizeof( mbedtls_x509_crt ) );
+                mbedtls_free( crt );
+            }
+            else
+                tail->next = crt;
+
+            while( tail->next != NULL )
+                tail = tail->next;
+        }
+        else if( crt != NULL )
+        {
+            mbedtls_x509_crt_free( crt );
+            mbedtls_free( crt );
+        }
+
+        items[i].chain = NULL;
+
+        if( f_report != NULL )
+            f_report( p_report, items[i].path, i, items[i].ret );
+    }
+}
+#endif /* MBEDTLS_PEM_PARSE_C || MBEDTLS_FS_IO */
+
+int mbedtls_x509_crt_parse_parallel( mbedtls_x509_crt *chain,
+                                     const unsigned char *buf, size_t buflen,
+                                     int threads,
+                                     mbedtls_x509_crt_parallel_report_t *f_report,
+                                     void *p_report )
+{
+#if defined(MBEDTLS_PEM_PARSE_C)
+    int ret = 0, success = 0, first_error = 0;
+    size_t count, i;
+    const char *p;
+    x509_parallel_item *items;
+#endif
+
+    if( chain == NULL || buf == NULL )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+#if defined(MBEDTLS_PEM_PARSE_C)
+    if( buflen == 0 || buf[buflen - 1] != '\0' ||
+        strstr( (const char *) buf, PEM_BEGIN_CRT ) == NULL )
+    {
+        return( mbedtls_x509_crt_parse_der( chain, buf, buflen ) );
+    }
+
+    /*
+     * Cut the bundle at the PEM headers: each block runs up to the next
+     * footer, like in mbedtls_x509_crt_parse()
+     */
+    count = 0;
+    for( p = strstr( (const char *) buf, PEM_BEGIN_CRT ); p != NULL;
+         p = strstr( p + sizeof( PEM_BEGIN_CRT ) - 1, PEM_BEGIN_CRT ) )
+    {
+        count++;
+    }
+
+    items = mbedtls_calloc( count, sizeof( x509_parallel_item ) );
+    if( items == NULL )
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+    i = 0;
+    for( p = strstr( (const char *) buf, PEM_BEGIN_CRT ); p != NULL;
+         p = strstr( p + sizeof( PEM_BEGIN_CRT ) - 1, PEM_BEGIN_CRT ) )
+    {
+        items[i++].pem = (const unsigned char *) p;
+    }
+
+    x509_parallel_run( chain, items, count, threads, f_report, p_report );
+
+    for( i = 0; i < count; i++ )
+    {
+        if( items[i].ret == 0 )
+        {
+            success = 1;
+            continue;
+        }
+
+        /* Quit parsing on a memory error */
+        if( items[i].ret == MBEDTLS_ERR_X509_ALLOC_FAILED )
+        {
+            ret = MBEDTLS_ERR_X509_ALLOC_FAILED;
+            goto cleanup;
+        }
+
+        if( first_error == 0 )
+            first_error = items[i].ret;
+
+        ret++;
+    }
+
+    if( !success )
+        ret = first_error;
+
+cleanup:
+    mbedtls_free( items );
+
+    return( ret );
+#else
+    (void) threads;
+    (void) f_report;
+    (void) p_report;
+
+    return( mbedtls_x509_crt_parse_der( chain, buf, buflen ) );
+#endif /* MBEDTLS_PEM_PARSE_C */
+}
+
+#if defined(MBEDTLS_FS_IO)
+/*
+ * Growable list of file names
+ */
+typedef struct
+{
+    char **names;
+    size_t count;
+    size_t size;
+}
+x509_parallel_files;
+
+static int x509_parallel_add_file( x509_parallel_files *files,
+                                   const char *name )
+{
+    size_t len = strlen( name );
+
+    if( files->count == files->size )
+    {
+        size_t size = files->size == 0 ? 64 : 2 * files->size;
+        char **names;
+
+        if( size < files->size ||
+            ( names = mbedtls_calloc( size, sizeof( char * ) ) ) == NULL )
+            return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+        if( files->count != 0 )
+            memcpy( names, files->names, files->count * sizeof( char * ) );
+
+        mbedtls_free( files->names );
+        files->names = names;
+        files->size = size;
+    }
+
+    if( ( files->names[files->count] = mbedtls_calloc( 1, len + 1 ) ) == NULL )
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+    memcpy( files->names[files->count++], name, len + 1 );
+
+    return( 0 );
+}
+
+static void x509_parallel_free_files( x509_parallel_files *files )
+{
+    size_t i;
+
+    for( i = 0; i < files->count; i++ )
+        mbedtls_free( files->names[i] );
+
+    mbedtls_free( files->names );
+}
+
+static int x509_parallel_cmp_names( const void *a, const void *b )
+{
+    return( strcmp( *(const char * const *) a, *(const char * const *) b ) );
+}
+
+/*
+ * Collect the paths of the regular files of a directory, like
+ * mbedtls_x509_crt_parse_path() walks it
+ */
+static int x509_parallel_list_dir( x509_parallel_files *files,
+                                   const char *path )
+{
+    int ret = 0;
+#if defined(_WIN32) && !defined(EFIX64) && !defined(EFI32)
+    int w_ret;
+    WCHAR szDir[MAX_PATH];
+    char filename[MAX_PATH];
+    char *p;
+    size_t len = strlen( path );
+
+    WIN32_FIND_DATAW file_data;
+    HANDLE hFind;
+
+    if( len > MAX_PATH - 3 )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    memset( szDir, 0, sizeof(szDir) );
+    memset( filename, 0, MAX_PATH );
+    memcpy( filename, path, len );
+    filename[len++] = '\\';
+    p = filename + len;
+    filename[len++] = '*';
+
+    w_ret = MultiByteToWideChar( CP_ACP, 0, filename, (int)len, szDir,
+                                 MAX_PATH - 3 );
+    if( w_ret == 0 )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    hFind = FindFirstFileW( szDir, &file_data );
+    if( hFind == INVALID_HANDLE_VALUE )
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+
+    len = MAX_PATH - len;
+    do
+    {
+        memset( p, 0, len );
+
+        if( file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+            continue;
+
+        w_ret = WideCharToMultiByte( CP_ACP, 0, file_data.cFileName,
+                                     lstrlenW( file_data.cFileName ),
+                                     p, (int) len - 1,
+                                     NULL, NULL );
+        if( w_ret == 0 )
+        {
+            ret = MBEDTLS_ERR_X509_FILE_IO_ERROR;
+            goto cleanup;
+        }
+
+        if( ( ret = x509_parallel_add_file( files, filename ) ) != 0 )
+            goto cleanup;
+    }
+    while( FindNextFileW( hFind, &file_data ) != 0 );
+
+    if( GetLastError() != ERROR_NO_MORE_FILES )
+        ret = MBEDTLS_ERR_X509_FILE_IO_ERROR;
+
+cleanup:
+    FindClose( hFind );
+#else /* _WIN32 */
+    int snp_ret;
+    struct stat sb;
+    struct dirent *entry;
+    char entry_name[MBEDTLS_X509_MAX_FILE_PATH_LEN];
+    DIR *dir = opendir( path );
+
+    if( dir == NULL )
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+
+#if defined(MBEDTLS_THREADING_C)
+    if( ( ret = mbedtls_mutex_lock( &mbedtls_threading_readdir_mutex ) ) != 0 )
+    {
+        closedir( dir );
+        return( ret );
+    }
+#endif /* MBEDTLS_THREADING_C */
+
+    while( ( entry = readdir( dir ) ) != NULL )
+    {
+        snp_ret = mbedtls_snprintf( entry_name, sizeof entry_name,
+                                    "%s/%s", path, entry->d_name );
+
+        if( snp_ret < 0 || (size_t)snp_ret >= sizeof entry_name )
+        {
+            ret = MBEDTLS_ERR_X509_BUFFER_TOO_SMALL;
+            goto cleanup;
+        }
+        else if( stat( entry_name, &sb ) == -1 )
+        {
+            ret = MBEDTLS_ERR_X509_FILE_IO_ERROR;
+            goto cleanup;
+        }
+
+        if( !S_ISREG( sb.st_mode ) )
+            continue;
+
+        if( ( ret = x509_parallel_add_file( files, entry_name ) ) != 0 )
+            goto cleanup;
+    }
+
+cleanup:
+    closedir( dir );
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &mbedtls_threading_readdir_mutex ) != 0 )
+        ret = MBEDTLS_ERR_THREADING_MUTEX_ERROR;
+#endif /* MBEDTLS_THREADING_C */
+
+#endif /* _WIN32 */
+
+    return( ret );
+}
+
+int mbedtls_x509_crt_parse_path_parallel( mbedtls_x509_crt *chain,
+                                          const char *path, int threads,
+                                          mbedtls_x509_crt_parallel_report_t *f_report,
+                                          void *p_report )
+{
+    int ret;
+    size_t i;
+    x509_parallel_files files;
+    x509_parallel_item *items = NULL;
+
+    if( chain == NULL || path == NULL )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    memset( &files, 0, sizeof( files ) );
+
+    if( ( ret = x509_parallel_list_dir( &files, path ) ) != 0 )
+        goto cleanup;
+
+    if( files.count == 0 )
+        goto cleanup;
+
+    /* Directory order depends on the file system, name order doesn't */
+    qsort( files.names, files.count, sizeof( char * ),
+           x509_parallel_cmp_names );
+
+    items = mbedtls_calloc( files.count, sizeof( x509_parallel_item ) );
+    if( items == NULL )
+    {
+        ret = MBEDTLS_ERR_X509_ALLOC_FAILED;
+        goto cleanup;
+    }
+
+    for( i = 0; i < files.count; i++ )
+        items[i].path = files.names[i];
+
+    x509_parallel_run( chain, items, files.count, threads,
+                       f_report, p_report );
+
+    /* Count the failures like mbedtls_x509_crt_parse_path() */
+    for( i = 0; i < files.count; i++ )
+    {
+        if( items[i].ret < 0 )
+            ret++;
+        else
+            ret += items[i].ret;
+    }
+
+cleanup:
+    mbedtls_free( items );
+    x509_parallel_free_files( &files );
+
+    return( ret );
+}
+#endif /* MBEDTLS_FS_IO */
+
+#endif /* MBEDTLS_X509_CRT_PARALLEL_C */
@@ -0,0 +1,788 @@
+/*
+ *  OCSP response parsing and verification
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ *  The ITU-T X.509 standard defines a certificate format for PKI.
+ *
+ *  http://www.ietf.org/rfc/rfc6960.txt (OCSP)
+ *  http://www.ietf.org/rfc/rfc5280.txt (Certificates and CRLs)
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_X509_OCSP_PARSE_C)
+
+#include "mbedtls/x509_ocsp.h"
+#include "mbedtls/oid.h"
+
+#include <string.h>
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_free       free
+#define mbedtls_calloc    calloc
+#endif
+
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+
+#define X509_OCSP_ASN1_ENUMERATED   0x0A
+
+void mbedtls_x509_ocsp_response_init( mbedtls_x509_ocsp_response *resp )
+{
+    memset( resp, 0, sizeof( mbedtls_x509_ocsp_response ) );
+
+    mbedtls_x509_crt_init( &resp->certs );
+}
+
+/*
+ *  Extensions  ::=  [n] EXPLICIT SEQUENCE SIZE (1..MAX) OF Extension
+ *
+ *  None of the extensions of RFC 6960 changes the meaning of a basic
+ *  response, so they are skipped.
+ */
+static int x509_ocsp_skip_ext( unsigned char **p, const unsigned char *end,
+                               int tag )
+{
+    int ret;
+    size_t len;
+
+    if( *p == end )
+        return( 0 );
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                                      MBEDTLS_ASN1_CONSTRUCTED | tag ) ) != 0 )
+    {
+        if( ret == MBEDTLS_ERR_ASN1_UNEXPECTED_TAG )
+            return( 0 );
+
+        return( MBEDTLS_ERR_X509_INVALID_EXTENSIONS + ret );
+    }
+
+    *p += len;
+
+    return( 0 );
+}
+
+/*
+ *  SingleResponse ::= SEQUENCE {
+ *       certID                       CertID,
+ *       certStatus                   CertStatus,
+ *       thisUpdate                   GeneralizedTime,
+ *       nextUpdate         [0]       EXPLICIT GeneralizedTime OPTIONAL,
+ *       singleExtensions   [1]       EXPLICIT Extensions OPTIONAL }
+ *
+ *  CertID ::= SEQUENCE {
+ *       hashAlgorithm       AlgorithmIdentifier,
+ *       issuerNameHash      OCTET STRING,
+ *       issuerKeyHash       OCTET STRING,
+ *       serialNumber        CertificateSerialNumber }
+ *
+ *  CertStatus ::= CHOICE {
+ *       good        [0]     IMPLICIT NULL,
+ *       revoked     [1]     IMPLICIT RevokedInfo,
+ *       unknown     [2]     IMPLICIT UnknownInfo }
+ *
+ *  RevokedInfo ::= SEQUENCE {
+ *       revocationTime              GeneralizedTime,
+ *       revocationReason    [0]     EXPLICIT CRLReason OPTIONAL }
+ */
+static int x509_ocsp_get_single( unsigned char **p, const unsigned char *end,
+                                 mbedtls_x509_ocsp_single *single )
+{
+    int ret;
+    size_t len;
+    unsigned char *id_end, *status_end;
+    mbedtls_x509_buf alg;
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    end = *p + len;
+
+    /* CertID */
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    id_end = *p + len;
+
+    if( ( ret = mbedtls_x509_get_alg_null( p, id_end, &alg ) ) != 0 )
+        return( ret );
+
+    /* An unknown hash only makes this entry unusable */
+    if( mbedtls_oid_get_md_alg( &alg, &single->md_alg ) != 0 )
+        single->md_alg = MBEDTLS_MD_NONE;
+
+    if( ( ret = mbedtls_asn1_get_tag( p, id_end, &single->issuer_name_hash.len,
+                                      MBEDTLS_ASN1_OCTET_STRING ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    single->issuer_name_hash.tag = MBEDTLS_ASN1_OCTET_STRING;
+    single->issuer_name_hash.p = *p;
+    *p += single->issuer_name_hash.len;
+
+    if( ( ret = mbedtls_asn1_get_tag( p, id_end, &single->issuer_key_hash.len,
+                                      MBEDTLS_ASN1_OCTET_STRING ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    single->issuer_key_hash.tag = MBEDTLS_ASN1_OCTET_STRING;
+    single->issuer_key_hash.p = *p;
+    *p += single->issuer_key_hash.len;
+
+    if( ( ret = mbedtls_x509_get_serial( p, id_end, &single->serial ) ) != 0 )
+        return( ret );
+
+    if( *p != id_end )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+    /* CertStatus */
+    if( *p == end )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + MBEDTLS_ERR_ASN1_OUT_OF_DATA );
+
+    if( **p == ( MBEDTLS_ASN1_CONTEXT_SPECIFIC | 0 ) ||
+        **p == ( MBEDTLS_ASN1_CONTEXT_SPECIFIC | 2 ) )
+    {
+        single->cert_status = ( **p == ( MBEDTLS_ASN1_CONTEXT_SPECIFIC | 0 ) ) ?
+                              MBEDTLS_X509_OCSP_CERT_GOOD :
+                              MBEDTLS_X509_OCSP_CERT_UNKNOWN;
+        (*p)++;
+
+        if( ( ret = mbedtls_asn1_get_len( p, end, &len ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+        *p += len;
+    }
+    else if( **p == ( MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                      MBEDTLS_ASN1_CONSTRUCTED | 1 ) )
+    {
+        single->cert_status = MBEDTLS_X509_OCSP_CERT_REVOKED;
+        (*p)++;
+
+        if( ( ret = mbedtls_asn1_get_len( p, end, &len ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+        status_end = *p + len;
+
+        if( ( ret = mbedtls_x509_get_time( p, status_end,
+                                           &single->revocation_time ) ) != 0 )
+            return( ret );
+
+        /* revocationReason is not used */
+        *p = status_end;
+    }
+    else
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + MBEDTLS_ERR_ASN1_UNEXPECTED_TAG );
+
+    if( ( ret = mbedtls_x509_get_time( p, end, &single->this_update ) ) != 0 )
+        return( ret );
+
+    if( *p < end && **p == ( MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                             MBEDTLS_ASN1_CONSTRUCTED | 0 ) )
+    {
+        (*p)++;
+
+        if( ( ret = mbedtls_asn1_get_len( p, end, &len ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+        if( ( ret = mbedtls_x509_get_time( p, *p + len,
+                                           &single->next_update ) ) != 0 )
+            return( ret );
+    }
+
+    if( ( ret = x509_ocsp_skip_ext( p, end, 1 ) ) != 0 )
+        return( ret );
+
+    if( *p != end )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+    return( 0 );
+}
+
+/*
+ *  ResponseData ::= SEQUENCE {
+ *       version              [0] EXPLICIT Version DEFAULT v1,
+ *       responderID              ResponderID,
+ *       producedAt               GeneralizedTime,
+ *       responses                SEQUENCE OF SingleResponse,
+ *       responseExtensions   [1] EXPLICIT Extensions OPTIONAL }
+ *
+ *  ResponderID ::= CHOICE {
+ *       byName   [1] Name,
+ *       byKey    [2] KeyHash }
+ */
+static int x509_ocsp_get_response_data( unsigned char **p,
+                                        const unsigned char *end,
+                                        mbedtls_x509_ocsp_response *resp )
+{
+    int ret;
+    int ver = 0;
+    size_t len;
+    unsigned char *responses_end;
+    mbedtls_x509_ocsp_single *cur = &resp->single;
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                                      MBEDTLS_ASN1_CONSTRUCTED | 0 ) ) == 0 )
+    {
+        if( ( ret = mbedtls_asn1_get_int( p, *p + len, &ver ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_VERSION + ret );
+    }
+    else if( ret != MBEDTLS_ERR_ASN1_UNEXPECTED_TAG )
+        return( MBEDTLS_ERR_X509_INVALID_VERSION + ret );
+
+    if( ver != 0 )
+        return( MBEDTLS_ERR_X509_UNKNOWN_VERSION );
+
+    /* The signer is found by trying the candidate keys instead */
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                                      MBEDTLS_ASN1_CONSTRUCTED | 1 ) ) != 0 &&
+        ( ret = mbedtls_asn1_get_tag( p, end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                                      MBEDTLS_ASN1_CONSTRUCTED | 2 ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_NAME + ret );
+
+    *p += len;
+
+    if( ( ret = mbedtls_x509_get_time( p, end, &resp->produced_at ) ) != 0 )
+        return( ret );
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    if( len == 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + MBEDTLS_ERR_ASN1_OUT_OF_DATA );
+
+    responses_end = *p + len;
+
+    while( *p < responses_end )
+    {
+        if( ( ret = x509_ocsp_get_single( p, responses_end, cur ) ) != 0 )
+            return( ret );
+
+        if( *p < responses_end )
+        {
+            cur->next = mbedtls_calloc( 1, sizeof( mbedtls_x509_ocsp_single ) );
+            if( cur->next == NULL )
+                return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+            cur = cur->next;
+        }
+    }
+
+    if( ( ret = x509_ocsp_skip_ext( p, end, 1 ) ) != 0 )
+        return( ret );
+
+    if( *p != end )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+    return( 0 );
+}
+
+/*
+ *  BasicOCSPResponse ::= SEQUENCE {
+ *       tbsResponseData      ResponseData,
+ *       signatureAlgorithm   AlgorithmIdentifier,
+ *       signature            BIT STRING,
+ *       certs            [0] EXPLICIT SEQUENCE OF Certificate OPTIONAL }
+ */
+static int x509_ocsp_get_basic( unsigned char **p, const unsigned char *end,
+                                mbedtls_x509_ocsp_response *resp )
+{
+    int ret;
+    size_t len;
+    unsigned char *cert_start, *certs_end;
+    mbedtls_x509_buf sig_params;
+
+    memset( &sig_params, 0, sizeof( mbedtls_x509_buf ) );
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    if( *p + len != end )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+    /* tbsResponseData */
+    resp->tbs.p = *p;
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    resp->tbs.len = *p + len - resp->tbs.p;
+
+    if( ( ret = x509_ocsp_get_response_data( p, *p + len, resp ) ) != 0 )
+        return( ret );
+
+    /* signatureAlgorithm, signature */
+    if( ( ret = mbedtls_x509_get_alg( p, end, &resp->sig_oid,
+                                      &sig_params ) ) != 0 )
+        return( ret );
+
+    if( ( ret = mbedtls_x509_get_sig_alg( &resp->sig_oid, &sig_params,
+                                          &resp->sig_md, &resp->sig_pk,
+                                          &resp->sig_opts ) ) != 0 )
+        return( ret );
+
+    if( ( ret = mbedtls_x509_get_sig( p, end, &resp->sig ) ) != 0 )
+        return( ret );
+
+    /* certs */
+    if( *p == end )
+        return( 0 );
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                                      MBEDTLS_ASN1_CONSTRUCTED | 0 ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    if( ( ret = mbedtls_asn1_get_tag( p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+    certs_end = *p + len;
+
+    while( *p < certs_end )
+    {
+        cert_start = *p;
+
+        if( ( ret = mbedtls_asn1_get_tag( p, certs_end, &len,
+                        MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+            return( MBEDTLS_ERR_X509_INVALID_FORMAT + ret );
+
+        *p += len;
+
+        /* The certificates live in resp->raw as long as resp->certs */
+        if( ( ret = mbedtls_x509_crt_parse_der_nocopy( &resp->certs, cert_start,
+                                                       *p - cert_start ) ) != 0 )
+            return( ret );
+    }
+
+    if( *p != end )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT +
+                MBEDTLS_ERR_ASN1_LENGTH_MISMATCH );
+
+    return( 0 );
+}
+
+/*
+ *  OCSPResponse ::= SEQUENCE {
+ *       responseStatus         OCSPResponseStatus,
+ *       responseBytes          [0] EXPLICIT ResponseBytes OPTIONAL }
+ *
+ *  OCSPResponseStatus ::= ENUMERATED
+ *
+ *  ResponseBytes ::= SEQUENCE {
+ *       responseType   OBJECT IDENTIFIER,
+ *       response       OCTET STRING }
+ */
+int mbedtls_x509_ocsp_response_parse( mbedtls_x509_ocsp_response *resp,
+                                      const unsigned char *buf, size_t buflen )
+{
+    int ret;
+    size_t len;
+    unsigned char *p, *end;
+    mbedtls_x509_buf type;
+
+    if( resp == NULL || buf == NULL )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    if( resp->raw.p != NULL )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    p = mbedtls_calloc( 1, buflen );
+    if( p == NULL )
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+    memcpy( p, buf, buflen );
+
+    resp->raw.p = p;
+    resp->raw.len = buflen;
+    end = p + buflen;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT + ret;
+        goto cleanup;
+    }
+
+    if( p + len != end )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT +
+              MBEDTLS_ERR_ASN1_LENGTH_MISMATCH;
+        goto cleanup;
+    }
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+                                      X509_OCSP_ASN1_ENUMERATED ) ) != 0 )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT + ret;
+        goto cleanup;
+    }
+
+    if( len != 1 )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT + MBEDTLS_ERR_ASN1_INVALID_LENGTH;
+        goto cleanup;
+    }
+
+    resp->status = *p++;
+
+    if( resp->status != MBEDTLS_X509_OCSP_SUCCESSFUL )
+    {
+        ret = ( p == end ) ? 0 : MBEDTLS_ERR_X509_INVALID_FORMAT +
+                                 MBEDTLS_ERR_ASN1_LENGTH_MISMATCH;
+        goto cleanup;
+    }
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len, MBEDTLS_ASN1_CONTEXT_SPECIFIC |
+                                      MBEDTLS_ASN1_CONSTRUCTED | 0 ) ) != 0 ||
+        ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 ||
+        ( ret = mbedtls_asn1_get_tag( &p, end, &type.len,
+                                      MBEDTLS_ASN1_OID ) ) != 0 )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT + ret;
+        goto cleanup;
+    }
+
+    type.tag = MBEDTLS_ASN1_OID;
+    type.p = p;
+    p += type.len;
+
+    if( MBEDTLS_OID_CMP( MBEDTLS_OID_OCSP_BASIC, &type ) != 0 )
+    {
+        ret = MBEDTLS_ERR_X509_FEATURE_UNAVAILABLE;
+        goto cleanup;
+    }
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+                                      MBEDTLS_ASN1_OCTET_STRING ) ) != 0 )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT + ret;
+        goto cleanup;
+    }
+
+    if( p + len != end )
+    {
+        ret = MBEDTLS_ERR_X509_INVALID_FORMAT +
+              MBEDTLS_ERR_ASN1_LENGTH_MISMATCH;
+        goto cleanup;
+    }
+
+    ret = x509_ocsp_get_basic( &p, end, resp );
+
+cleanup:
+    if( ret != 0 )
+    {
+        mbedtls_x509_ocsp_response_free( resp );
+        mbedtls_x509_ocsp_response_init( resp );
+    }
+
+    return( ret );
+}
+
+#if defined(MBEDTLS_FS_IO)
+int mbedtls_x509_ocsp_response_parse_file( mbedtls_x509_ocsp_response *resp,
+                                           const char *path )
+{
+    int ret;
+    size_t n;
+    unsigned char *buf;
+
+    if( ( ret = mbedtls_pk_load_file( path, &buf, &n ) ) != 0 )
+        return( ret );
+
+    ret = mbedtls_x509_ocsp_response_parse( resp, buf, n );
+
+    mbedtls_zeroize( buf, n );
+    mbedtls_free( buf );
+
+    return( ret );
+}
+#endif /* MBEDTLS_FS_IO */
+
+/*
+ * Check the signature of data signed by a key of the given certificate
+ */
+static int x509_ocsp_check_signature( const mbedtls_x509_crt *signer,
+                                      const unsigned char *tbs, size_t tbs_len,
+                                      mbedtls_md_type_t sig_md,
+                                      mbedtls_pk_type_t sig_pk,
+                                      const void *sig_opts,
+                                      const mbedtls_x509_buf *sig )
+{
+    unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+    const mbedtls_md_info_t *md_info;
+
+    if( ( md_info = mbedtls_md_info_from_type( sig_md ) ) == NULL )
+        return( -1 );
+
+    if( ! mbedtls_pk_can_do( &signer->pk, sig_pk ) )
+        return( -1 );
+
+    if( mbedtls_md( md_info, tbs, tbs_len, hash ) != 0 )
+        return( -1 );
+
+    if( mbedtls_pk_verify_ext( sig_pk, sig_opts,
+                               (mbedtls_pk_context *) &signer->pk, sig_md,
+                               hash, mbedtls_md_get_size( md_info ),
+                               sig->p, sig->len ) != 0 )
+        return( -1 );
+
+    return( 0 );
+}
+
+/*
+ * Check that a certificate of the response may sign responses for the
+ * certificates of the given issuer (RFC 6960 4.2.2.2)
+ */
+static int x509_ocsp_check_delegate( const mbedtls_x509_crt *responder,
+                                     const mbedtls_x509_crt *issuer )
+{
+    if( mbedtls_x509_name_cmp_raw( &responder->issuer_raw, &issuer->subject_raw ) != 0 )
+        return( -1 );
+
+#if defined(MBEDTLS_X509_CHECK_EXTENDED_KEY_USAGE)
+    if( ( responder->ext_types & MBEDTLS_X509_EXT_EXTENDED_KEY_USAGE ) == 0 ||
+        mbedtls_x509_crt_check_extended_key_usage( responder,
+                MBEDTLS_OID_OCSP_SIGNING,
+                MBEDTLS_OID_SIZE( MBEDTLS_OID_OCSP_SIGNING ) ) != 0 )
+        return( -1 );
+#else
+    /* Without extended key usage checks, delegation cannot be verified */
+    return( -1 );
+#endif
+
+    if( mbedtls_x509_time_is_past( &responder->valid_to ) ||
+        mbedtls_x509_time_is_future( &responder->valid_from ) )
+        return( -1 );
+
+    return( x509_ocsp_check_signature( issuer, responder->tbs.p,
+                                       responder->tbs.len, responder->sig_md,
+                                       responder->sig_pk, responder->sig_opts,
+                                       &responder->sig ) );
+}
+
+/*
+ * Check that a single response is about crt, issued by issuer
+ */
+static int x509_ocsp_match( const mbedtls_x509_ocsp_single *single,
+                            const mbedtls_x509_crt *crt,
+                            const mbedtls_x509_crt *issuer )
+{
+    int ret;
+    size_t len;
+    unsigned char hash[MBEDTLS_MD_MAX_SIZE];
+    unsigned char *p, *end;
+    const mbedtls_md_info_t *md_info;
+
+    if( single->serial.len != crt->serial.len ||
+        memcmp( single->serial.p, crt->serial.p, crt->serial.len ) != 0 )
+        return( -1 );
+
+    if( ( md_info = mbedtls_md_info_from_type( single->md_alg ) ) == NULL ||
+        single->issuer_name_hash.len != mbedtls_md_get_size( md_info ) ||
+        single->issuer_key_hash.len != mbedtls_md_get_size( md_info ) )
+        return( -1 );
+
+    /* The name hash covers the issuer field of the certificate itself */
+    if( mbedtls_md( md_info, crt->issuer_raw.p, crt->issuer_raw.len,
+                    hash ) != 0 ||
+        memcmp( hash, single->issuer_name_hash.p,
+                single->issuer_name_hash.len ) != 0 )
+        return( -1 );
+
+    /*
+     * The key hash covers the subjectPublicKey BIT STRING value, without
+     * the tag, length and number of unused bits:
+     *
+     *  SubjectPublicKeyInfo  ::=  SEQUENCE  {
+     *       algorithm            AlgorithmIdentifier,
+     *       subjectPublicKey     BIT STRING }
+     *
+     * It immediately follows the subject in the TBSCertificate.
+     */
+    p = issuer->subject_raw.p + issuer->subject_raw.len;
+    end = issuer->tbs.p + issuer->tbs.len;
+
+    if( ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 ||
+        ( ret = mbedtls_asn1_get_tag( &p, end, &len,
+                    MBEDTLS_ASN1_CONSTRUCTED | MBEDTLS_ASN1_SEQUENCE ) ) != 0 )
+        return( -1 );
+
+    p += len;
+
+    if( ( ret = mbedtls_asn1_get_bitstring_null( &p, end, &len ) ) != 0 )
+        return( -1 );
+
+    if( mbedtls_md( md_info, p, len, hash ) != 0 ||
+        memcmp( hash, single->issuer_key_hash.p,
+                single->issuer_key_hash.len ) != 0 )
+        return( -1 );
+
+    return( 0 );
+}
+
+/*
+ * Find the issuer of crt in a list: a certificate with a matching name is
+ * only accepted if its key signed crt, since the list may come from the peer
+ */
+static const mbedtls_x509_crt *x509_ocsp_find_issuer(
+                                        const mbedtls_x509_crt *crt,
+                                        const mbedtls_x509_crt *candidates )
+{
+    const mbedtls_x509_crt *issuer;
+
+    for( issuer = candidates; issuer != NULL; issuer = issuer->next )
+    {
+        if( issuer->raw.len == 0 ||
+            mbedtls_x509_name_cmp_raw( &crt->issuer_raw, &issuer->subject_raw ) != 0 )
+            continue;
+
+        if( x509_ocsp_check_signature( issuer, crt->tbs.p, crt->tbs.len,
+                                       crt->sig_md, crt->sig_pk, crt->sig_opts,
+                                       &crt->sig ) == 0 )
+            return( issuer );
+    }
+
+    return( NULL );
+}
+
+int mbedtls_x509_ocsp_response_verify( const mbedtls_x509_ocsp_response *resp,
+                                       const mbedtls_x509_crt *crt,
+                                       const mbedtls_x509_crt *trust_ca,
+                                       uint32_t *flags )
+{
+    const mbedtls_x509_crt *issuer, *signer;
+    const mbedtls_x509_ocsp_single *single;
+
+    *flags = MBEDTLS_X509_BADOCSP_NOT_TRUSTED;
+
+    if( resp->status != MBEDTLS_X509_OCSP_SUCCESSFUL || resp->raw.p == NULL )
+        return( MBEDTLS_ERR_X509_CERT_VERIFY_FAILED );
+
+    /*
+     * Find the issuer: in the chain of the certificate, then in the
+     * trusted CAs
+     */
+    if( ( issuer = x509_ocsp_find_issuer( crt, crt->next ) ) == NULL &&
+        ( issuer = x509_ocsp_find_issuer( crt, trust_ca ) ) == NULL )
+        return( MBEDTLS_ERR_X509_CERT_VERIFY_FAILED );
+
+    for( single = &resp->single; single != NULL; single = single->next )
+    {
+        if( x509_ocsp_match( single, crt, issuer ) == 0 )
+            break;
+    }
+
+    if( single == NULL )
+        return( MBEDTLS_ERR_X509_CERT_VERIFY_FAILED );
+
+    /*
+     * Signed by the issuer, or by a responder it delegated to
+     */
+    if( x509_ocsp_check_signature( issuer, resp->tbs.p, resp->tbs.len,
+                                   resp->sig_md, resp->sig_pk, resp->sig_opts,
+                                   &resp->sig ) != 0 )
+    {
+        for( signer = &resp->certs; signer != NULL; signer = signer->next )
+        {
+            if( signer->raw.len == 0 )
+                continue;
+
+            if( x509_ocsp_check_delegate( signer, issuer ) == 0 &&
+                x509_ocsp_check_signature( signer, resp->tbs.p, resp->tbs.len,
+                                           resp->sig_md, resp->sig_pk,
+                                           resp->sig_opts, &resp->sig ) == 0 )
+                break;
+        }
+
+        if( signer == NULL )
+            return( MBEDTLS_ERR_X509_CERT_VERIFY_FAILED );
+    }
+
+    *flags = 0;
+
+    /*
+     * Check for validity of the response (do not drop out)
+     */
+    if( single->next_update.year != 0 &&
+        mbedtls_x509_time_is_past( &single->next_update ) )
+        *flags |= MBEDTLS_X509_BADOCSP_EXPIRED;
+
+    if( mbedtls_x509_time_is_future( &single->this_update ) )
+        *flags |= MBEDTLS_X509_BADOCSP_FUTURE;
+
+    if( single->cert_status == MBEDTLS_X509_OCSP_CERT_REVOKED )
+        *flags |= MBEDTLS_X509_BADCERT_REVOKED;
+    else if( single->cert_status != MBEDTLS_X509_OCSP_CERT_GOOD )
+        *flags |= MBEDTLS_X509_BADOCSP_NOT_TRUSTED;
+
+    if( *flags != 0 )
+        return( MBEDTLS_ERR_X509_CERT_VERIFY_FAILED );
+
+    return( 0 );
+}
+
+void mbedtls_x509_ocsp_response_free( mbedtls_x509_ocsp_response *resp )
+{
+    mbedtls_x509_ocsp_single *cur, *next;
+
+    if( resp == NULL )
+        return;
+
+    for( cur = resp->single.next; cur != NULL; cur = next )
+    {
+        next = cur->next;
+        mbedtls_zeroize( cur, sizeof( mbedtls_x509_ocsp_single ) );
+        mbedtls_free( cur );
+    }
+
+#if defined(MBEDTLS_X509_RSASSA_PSS_SUPPORT)
+    mbedtls_free( resp->sig_opts );
+#endif
+
+    mbedtls_x509_crt_free( &resp->certs );
+
+    if( resp->raw.p != NULL )
+    {
+        mbedtls_zeroize( resp->raw.p, resp->raw.len );
+        mbedtls_free( resp->raw.p );
+    }
+
+    mbedtls_zeroize( resp, sizeof( mbedtls_x509_ocsp_response ) );
+}
+
+#endif /* MBEDTLS_X509_OCSP_PARSE_C */
@@ -0,0 +1,341 @@
+/*
+ *  Binary snapshots of lists of trusted CA certificates
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ * The snapshot is the DER of the certificates behind a table of offsets,
+ * see x509_snapshot.h. Loading it parses each certificate in place with
+ * mbedtls_x509_crt_parse_der_nocopy(): the file is mapped rather than read,
+ * and there is nothing to decode or copy.
+ */
+
+/* Enables mmap() with strict C99 compilers, must come before any system header */
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_X509_SNAPSHOT_C)
+
+#include "mbedtls/x509_snapshot.h"
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#endif
+
+#include <string.h>
+
+#if defined(MBEDTLS_FS_IO)
+#include <stdio.h>
+#if ( defined(unix) || defined(__unix__) || defined(__unix) || \
+      defined(__APPLE__) ) && !defined(EFIX64) && !defined(EFI32)
+#define X509_SNAPSHOT_MMAP
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#endif /* MBEDTLS_FS_IO */
+
+#define SNAPSHOT_GET_UINT32( p )                    \
+    ( ( (uint32_t) (p)[0] << 24 ) |                 \
+      ( (uint32_t) (p)[1] << 16 ) |                 \
+      ( (uint32_t) (p)[2] <<  8 ) |                 \
+      ( (uint32_t) (p)[3]       ) )
+
+#define SNAPSHOT_PUT_UINT32( n, p )                 \
+    do {                                            \
+        (p)[0] = (unsigned char)( (n) >> 24 );      \
+        (p)[1] = (unsigned char)( (n) >> 16 );      \
+        (p)[2] = (unsigned char)( (n) >>  8 );      \
+        (p)[3] = (unsigned char)( (n)       );      \
+    } while( 0 )
+
+/* The largest snapshot whose lengths fit in the 32-bit fields */
+#define SNAPSHOT_MAX_LEN    0xFFFFFFFF
+
+int mbedtls_x509_snapshot_write( const mbedtls_x509_crt *chain,
+                                 unsigned char *buf, size_t size,
+                                 size_t *olen )
+{
+    const mbedtls_x509_crt *crt;
+    size_t count = 0, total, offset;
+    unsigned char *p;
+
+    if( chain == NULL || olen == NULL )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    for( crt = chain; crt != NULL && crt->version != 0; crt = crt->next )
+        count++;
+
+    if( count > ( SNAPSHOT_MAX_LEN - MBEDTLS_X509_SNAPSHOT_HEADER_LEN ) /
+                MBEDTLS_X509_SNAPSHOT_RECORD_LEN )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    total = MBEDTLS_X509_SNAPSHOT_HEADER_LEN +
+            count * MBEDTLS_X509_SNAPSHOT_RECORD_LEN;
+
+    for( crt = chain; crt != NULL && crt->version != 0; crt = crt->next )
+    {
+        if( crt->raw.len > SNAPSHOT_MAX_LEN - total )
+            return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+        total += crt->raw.len;
+    }
+
+    *olen = total;
+
+    if( buf == NULL || size < total )
+        return( MBEDTLS_ERR_X509_BUFFER_TOO_SMALL );
+
+    memcpy( buf, MBEDTLS_X509_SNAPSHOT_MAGIC, 8 );
+    SNAPSHOT_PUT_UINT32( MBEDTLS_X509_SNAPSHOT_VERSION, buf + 8 );
+    SNAPSHOT_PUT_UINT32( count, buf + 12 );
+    SNAPSHOT_PUT_UINT32( total, buf + 16 );
+
+    p = buf + MBEDTLS_X509_SNAPSHOT_HEADER_LEN;
+    offset = MBEDTLS_X509_SNAPSHOT_HEADER_LEN +
+             count * MBEDTLS_X509_SNAPSHOT_RECORD_LEN;
+
+    for( crt = chain; crt != NULL && crt->version != 0; crt = crt->next )
+    {
+        SNAPSHOT_PUT_UINT32( offset, p );
+        SNAPSHOT_PUT_UINT32( crt->raw.len, p + 4 );
+        p += MBEDTLS_X509_SNAPSHOT_RECORD_LEN;
+
+        memcpy( buf + offset, crt->raw.p, crt->raw.len );
+        offset += crt->raw.len;
+    }
+
+    return( 0 );
+}
+
+int mbedtls_x509_snapshot_parse( mbedtls_x509_crt *chain,
+                                 const unsigned char *buf, size_t buflen )
+{
+    int ret;
+    size_t count, i, offset, len, data_start;
+    const unsigned char *p;
+    mbedtls_x509_crt *tail;
+
+    if( chain == NULL || buf == NULL )
+        return( MBEDTLS_ERR_X509_BAD_INPUT_DATA );
+
+    if( buflen < MBEDTLS_X509_SNAPSHOT_HEADER_LEN ||
+        memcmp( buf, MBEDTLS_X509_SNAPSHOT_MAGIC, 8 ) != 0 ||
+        SNAPSHOT_GET_UINT32( buf + 8 ) != MBEDTLS_X509_SNAPSHOT_VERSION ||
+        SNAPSHOT_GET_UINT32( buf + 16 ) != buflen )
+    {
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT );
+    }
+
+    count = SNAPSHOT_GET_UINT32( buf + 12 );
+
+    if( count > ( buflen - MBEDTLS_X509_SNAPSHOT_HEADER_LEN ) /
+                MBEDTLS_X509_SNAPSHOT_RECORD_LEN )
+        return( MBEDTLS_ERR_X509_INVALID_FORMAT );
+
+    data_start = MBEDTLS_X509_SNAPSHOT_HEADER_LEN +
+                 count * MBEDTLS_X509_SNAPSHOT_RECORD_LEN;
+
+    /* Append to the end of the list, without walking it for each one */
+    for( tail = chain; tail->version != 0 && tail->next != NULL; )
+        tail = tail->next;
+
+    p = buf + MBEDTLS_X509_SNAPSHOT_HEADER_LEN;
+
+    for( i = 0; i < count; i++, p += MBEDTLS_X509_SNAPSHOT_RECORD_LEN )
+    {
+        offset = SNAPSHOT_GET_UINT32( p );
+        len = SNAPSHOT_GET_UINT32( p + 4 );
+
+        if( offset < data_start || offset > buflen || len > buflen - offset )
+            return( MBEDTLS_ERR_X509_INVALID_FORMAT );
+
+        if( ( ret = mbedtls_x509_crt_parse_der_nocopy( tail, buf + offset,
+                                                       len ) ) != 0 )
+            return( ret );
+
+        if( tail->next != NULL )
+            tail = tail->next;
+    }
+
+    return( 0 );
+}
+
+#if defined(MBEDTLS_FS_IO)
+void mbedtls_x509_snapshot_init( mbedtls_x509_snapshot *snap )
+{
+    memset( snap, 0, sizeof( mbedtls_x509_snapshot ) );
+    mbedtls_x509_crt_init( &snap->chain );
+}
+
+int mbedtls_x509_snapshot_write_file( const mbedtls_x509_crt *chain,
+                                      const char *path )
+{
+    int ret;
+    FILE *f;
+    size_t len;
+    unsigned char *buf;
+
+    ret = mbedtls_x509_snapshot_write( chain, NULL, 0, &len );
+    if( ret != MBEDTLS_ERR_X509_BUFFER_TOO_SMALL )
+        return( ret );
+
+    if( ( buf = mbedtls_calloc( 1, len ) ) == NULL )
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+
+    if( ( ret = mbedtls_x509_snapshot_write( chain, buf, len, &len ) ) != 0 )
+        goto cleanup;
+
+    if( ( f = fopen( path, "wb" ) ) == NULL )
+    {
+        ret = MBEDTLS_ERR_X509_FILE_IO_ERROR;
+        goto cleanup;
+    }
+
+    if( fwrite( buf, 1, len, f ) != len )
+        ret = MBEDTLS_ERR_X509_FILE_IO_ERROR;
+
+    if( fclose( f ) != 0 )
+        ret = MBEDTLS_ERR_X509_FILE_IO_ERROR;
+
+cleanup:
+    mbedtls_free( buf );
+
+    return( ret );
+}
+
+/*
+ * Map or read the file into snap->buf
+ */
+static int x509_snapshot_map( mbedtls_x509_snapshot *snap, const char *path )
+{
+#if defined(X509_SNAPSHOT_MMAP)
+    int fd;
+    struct stat st;
+    void *addr;
+
+    if( ( fd = open( path, O_RDONLY ) ) < 0 )
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+
+    if( fstat( fd, &st ) != 0 || st.st_size <= 0 ||
+        (uint64_t) st.st_size > SNAPSHOT_MAX_LEN )
+    {
+        close( fd );
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+    }
+
+    addr = mmap( NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+
+    if( addr == MAP_FAILED )
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+
+    snap->buf = addr;
+    snap->len = (size_t) st.st_size;
+    snap->mapped = 1;
+
+    return( 0 );
+#else
+    FILE *f;
+    long size;
+
+    if( ( f = fopen( path, "rb" ) ) == NULL )
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+
+    if( fseek( f, 0, SEEK_END ) != 0 || ( size = ftell( f ) ) <= 0 ||
+        fseek( f, 0, SEEK_SET ) != 0 )
+    {
+        fclose( f );
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+    }
+
+    if( ( snap->buf = mbedtls_calloc( 1, (size_t) size ) ) == NULL )
+    {
+        fclose( f );
+        return( MBEDTLS_ERR_X509_ALLOC_FAILED );
+    }
+
+    snap->len = (size_t) size;
+    snap->mapped = 0;
+
+    if( fread( snap->buf, 1, snap->len, f ) != snap->len )
+    {
+        fclose( f );
+        return( MBEDTLS_ERR_X509_FILE_IO_ERROR );
+    }
+
+    fclose( f );
+
+    return( 0 );
+#endif /* X509_SNAPSHOT_MMAP */
+}
+
+int mbedtls_x509_snapshot_load_file( mbedtls_x509_snapshot *snap,
+                                     const char *path )
+{
+    int ret;
+
+    mbedtls_x509_snapshot_free( snap );
+
+    if( ( ret = x509_snapshot_map( snap, path ) ) != 0 ||
+        ( ret = mbedtls_x509_snapshot_parse( &snap->chain, snap->buf,
+                                             snap->len ) ) != 0 )
+    {
+        mbedtls_x509_snapshot_free( snap );
+        return( ret );
+    }
+
+    return( 0 );
+}
+
+void mbedtls_x509_snapshot_free( mbedtls_x509_snapshot *snap )
+{
+    if( snap == NULL )
+        return;
+
+    /* The certificates reference the snapshot, free them first */
+    mbedtls_x509_crt_free( &snap->chain );
+
+    if( snap->buf != NULL )
+    {
+#if defined(X509_SNAPSHOT_MMAP)
+        if( snap->mapped )
+            munmap( snap->buf, snap->len );
+        else
+#endif
+            mbedtls_free( snap->buf );
+    }
+
+    memset( snap, 0, sizeof( mbedtls_x509_snapshot ) );
+}
+#endif /* MBEDTLS_FS_IO */
+
+#endif /* MBEDTLS_X509_SNAPSHOT_C */
@@ -0,0 +1,508 @@
+/*
+ *  Cache of the results of X.509 certificate chain verification
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+/*
+ * Entries are keyed by a SHA-256 digest of everything the result depends
+ * on: the DER of each certificate of the chain, the signatures of the
+ * trusted CAs and of the CRLs (including merged delta CRLs), the profile,
+ * the expected name, the verification callback and the generation of the
+ * cache. They live in one array
+ * allocated on first use; once it is full, entries are replaced in the
+ * order they were stored.
+ *
+ * Verification itself runs without the lock, so two threads may verify
+ * the same chain at the same time; both store the same result.
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+
+#include "mbedtls/x509_verify_cache.h"
+#include "mbedtls/sha256.h"
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdlib.h>
+#define mbedtls_calloc    calloc
+#define mbedtls_free      free
+#endif
+
+#include <string.h>
+
+/* Implementation that should never be optimized out by the compiler */
+static void mbedtls_zeroize( void *v, size_t n ) {
+    volatile unsigned char *p = v; while( n-- ) *p++ = 0;
+}
+
+void mbedtls_x509_verify_cache_init( mbedtls_x509_verify_cache *cache )
+{
+    memset( cache, 0, sizeof( mbedtls_x509_verify_cache ) );
+
+    cache->timeout = MBEDTLS_X509_VERIFY_CACHE_DEFAULT_TIMEOUT;
+    cache->max_entries = MBEDTLS_X509_VERIFY_CACHE_DEFAULT_MAX_ENTRIES;
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_init( &cache->mutex );
+#endif
+}
+
+static void verify_cache_clear( mbedtls_x509_verify_cache *cache )
+{
+    mbedtls_free( cache->entries );
+    mbedtls_free( cache->buckets );
+
+    cache->entries = NULL;
+    cache->buckets = NULL;
+    cache->count = 0;
+    cache->victim = 0;
+}
+
+#if defined(MBEDTLS_HAVE_TIME)
+void mbedtls_x509_verify_cache_set_timeout( mbedtls_x509_verify_cache *cache,
+                                            int timeout )
+{
+    if( timeout < 0 ) timeout = 0;
+
+    cache->timeout = timeout;
+}
+#endif /* MBEDTLS_HAVE_TIME */
+
+void mbedtls_x509_verify_cache_set_max_entries( mbedtls_x509_verify_cache *cache,
+                                                int max )
+{
+    if( max < 0 ) max = 0;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &cache->mutex ) != 0 )
+        return;
+#endif
+
+    verify_cache_clear( cache );
+    cache->max_entries = max;
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_unlock( &cache->mutex );
+#endif
+}
+
+void mbedtls_x509_verify_cache_flush( mbedtls_x509_verify_cache *cache )
+{
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &cache->mutex ) != 0 )
+        return;
+#endif
+
+    /* Old entries can't be found any more and get replaced over time */
+    cache->generation++;
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_unlock( &cache->mutex );
+#endif
+}
+
+void mbedtls_x509_verify_cache_free( mbedtls_x509_verify_cache *cache )
+{
+    if( cache == NULL )
+        return;
+
+    verify_cache_clear( cache );
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_free( &cache->mutex );
+#endif
+
+    mbedtls_zeroize( cache, sizeof( mbedtls_x509_verify_cache ) );
+}
+
+/*
+ * Bucket count: the power of 2 at least max_entries
+ */
+static size_t verify_cache_bucket_count( const mbedtls_x509_verify_cache *cache )
+{
+    size_t n = 1;
+
+    while( n < (size_t) cache->max_entries )
+        n <<= 1;
+
+    return( n );
+}
+
+static mbedtls_x509_verify_cache_entry **verify_cache_bucket(
+                                    const mbedtls_x509_verify_cache *cache,
+                                    const unsigned char key[32] )
+{
+    size_t h = ( (size_t) key[0] << 24 ) | ( (size_t) key[1] << 16 ) |
+               ( (size_t) key[2] <<  8 ) | ( (size_t) key[3]       );
+
+    return( &cache->buckets[h & ( verify_cache_bucket_count( cache ) - 1 )] );
+}
+
+static int verify_cache_time_cmp( const mbedtls_x509_time *a,
+                                  const mbedtls_x509_time *b )
+{
+    if( a->year != b->year ) return( a->year < b->year ? -1 : 1 );
+    if( a->mon  != b->mon  ) return( a->mon  < b->mon  ? -1 : 1 );
+    if( a->day  != b->day  ) return( a->day  < b->day  ? -1 : 1 );
+    if( a->hour != b->hour ) return( a->hour < b->hour ? -1 : 1 );
+    if( a->min  != b->min  ) return( a->min  < b->min  ? -1 : 1 );
+    if( a->sec  != b->sec  ) return( a->sec  < b->sec  ? -1 : 1 );
+
+    return( 0 );
+}
+
+/*
+ * Times already past don't change the result any more
+ */
+static void verify_cache_time_min( mbedtls_x509_time *t,
+                                   const mbedtls_x509_time *other )
+{
+    if( other->year == 0 || mbedtls_x509_time_is_past( other ) )
+        return;
+
+    if( t->year == 0 || verify_cache_time_cmp( other, t ) < 0 )
+        *t = *other;
+}
+
+static void verify_cache_hash_len( mbedtls_sha256_context *sha256, size_t len )
+{
+    unsigned char b[4];
+
+    b[0] = (unsigned char)( len >> 24 );
+    b[1] = (unsigned char)( len >> 16 );
+    b[2] = (unsigned char)( len >>  8 );
+    b[3] = (unsigned char)( len       );
+
+    mbedtls_sha256_update_ret( sha256, b, 4 );
+}
+
+static void verify_cache_hash_buf( mbedtls_sha256_context *sha256,
+                                   const mbedtls_x509_buf *buf )
+{
+    verify_cache_hash_len( sha256, buf->len );
+
+    if( buf->len != 0 )
+        mbedtls_sha256_update_ret( sha256, buf->p, buf->len );
+}
+
+/*
+ * Trusted CAs and CRLs may be changed in place, so they are identified by
+ * their content. Their signature covers it and is much shorter.
+ */
+static void verify_cache_hash_crl( mbedtls_sha256_context *sha256,
+                                   const mbedtls_x509_crl *crl )
+{
+#if defined(MBEDTLS_X509_CRL_INDEX)
+    const mbedtls_x509_crl *delta;
+#endif
+
+    for( ; crl != NULL && crl->version != 0; crl = crl->next )
+    {
+        verify_cache_hash_buf( sha256, &crl->sig );
+
+#if defined(MBEDTLS_X509_CRL_INDEX)
+        for( delta = crl->deltas; delta != NULL; delta = delta->next )
+            verify_cache_hash_buf( sha256, &delta->sig );
+#endif
+        verify_cache_hash_len( sha256, 0 );
+    }
+    verify_cache_hash_len( sha256, 0 );
+}
+
+static int verify_cache_key( const mbedtls_x509_crt *crt,
+                     const mbedtls_x509_crt *trust_ca,
+                     const mbedtls_x509_crl *ca_crl,
+                     const mbedtls_x509_crt_profile *profile,
+                     const char *cn,
+                     int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *),
+                     const void *p_vrfy,
+                     uint32_t generation,
+                     unsigned char key[32] )
+{
+    int ret;
+    mbedtls_sha256_context sha256;
+    const mbedtls_x509_crt *cur;
+
+    mbedtls_sha256_init( &sha256 );
+
+    if( ( ret = mbedtls_sha256_starts_ret( &sha256, 0 ) ) != 0 )
+        goto exit;
+
+    verify_cache_hash_len( &sha256, generation );
+
+    for( cur = crt; cur != NULL && cur->raw.len != 0; cur = cur->next )
+    {
+        verify_cache_hash_len( &sha256, cur->raw.len );
+        mbedtls_sha256_update_ret( &sha256, cur->raw.p, cur->raw.len );
+    }
+    verify_cache_hash_len( &sha256, 0 );
+
+    for( cur = trust_ca; cur != NULL && cur->raw.len != 0; cur = cur->next )
+        verify_cache_hash_buf( &sha256, &cur->sig );
+    verify_cache_hash_len( &sha256, 0 );
+
+    verify_cache_hash_crl( &sha256, ca_crl );
+
+    mbedtls_sha256_update_ret( &sha256, (const unsigned char *) &f_vrfy,
+                               sizeof( f_vrfy ) );
+    mbedtls_sha256_update_ret( &sha256, (const unsigned char *) &p_vrfy,
+                               sizeof( p_vrfy ) );
+
+    verify_cache_hash_len( &sha256, profile->allowed_mds );
+    verify_cache_hash_len( &sha256, profile->allowed_pks );
+    verify_cache_hash_len( &sha256, profile->allowed_curves );
+    verify_cache_hash_len( &sha256, profile->rsa_min_bitlen );
+
+    if( cn != NULL )
+    {
+        verify_cache_hash_len( &sha256, strlen( cn ) );
+        mbedtls_sha256_update_ret( &sha256, (const unsigned char *) cn,
+                                   strlen( cn ) );
+    }
+
+    ret = mbedtls_sha256_finish_ret( &sha256, key );
+
+exit:
+    mbedtls_sha256_free( &sha256 );
+
+    return( ret );
+}
+
+/*
+ * Look up a result. Return 0 and set flags if found, -1 otherwise.
+ */
+static int verify_cache_get( mbedtls_x509_verify_cache *cache,
+                             const unsigned char key[32], uint32_t *flags )
+{
+    int ret = -1;
+    mbedtls_x509_verify_cache_entry *cur;
+#if defined(MBEDTLS_HAVE_TIME)
+    mbedtls_time_t t = mbedtls_time( NULL );
+#endif
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &cache->mutex ) != 0 )
+        return( -1 );
+#endif
+
+    if( cache->buckets == NULL )
+        goto exit;
+
+    for( cur = *verify_cache_bucket( cache, key ); cur != NULL; cur = cur->next )
+    {
+        if( memcmp( cur->key, key, 32 ) != 0 )
+            continue;
+
+#if defined(MBEDTLS_HAVE_TIME)
+        if( cache->timeout != 0 &&
+            (int) ( t - cur->timestamp ) > cache->timeout )
+            break;
+#endif
+
+        if( cur->not_after.year != 0 &&
+            mbedtls_x509_time_is_past( &cur->not_after ) )
+            break;
+
+        *flags = cur->flags;
+        ret = 0;
+        break;
+    }
+
+exit:
+    if( ret == 0 )
+        cache->hits++;
+    else
+        cache->misses++;
+
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_unlock( &cache->mutex );
+#endif
+
+    return( ret );
+}
+
+static void verify_cache_set( mbedtls_x509_verify_cache *cache,
+                              const unsigned char key[32], uint32_t flags,
+                              const mbedtls_x509_time *not_after )
+{
+    mbedtls_x509_verify_cache_entry *cur, **link;
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &cache->mutex ) != 0 )
+        return;
+#endif
+
+    if( cache->max_entries == 0 )
+        goto exit;
+
+    if( cache->entries == NULL )
+    {
+        cache->entries = mbedtls_calloc( cache->max_entries,
+                                sizeof( mbedtls_x509_verify_cache_entry ) );
+        cache->buckets = mbedtls_calloc( verify_cache_bucket_count( cache ),
+                                sizeof( mbedtls_x509_verify_cache_entry * ) );
+
+        if( cache->entries == NULL || cache->buckets == NULL )
+        {
+            verify_cache_clear( cache );
+            goto exit;
+        }
+    }
+
+    /* An expired result for the same key: update it in place */
+    for( cur = *verify_cache_bucket( cache, key ); cur != NULL; cur = cur->next )
+    {
+        if( memcmp( cur->key, key, 32 ) == 0 )
+            break;
+    }
+
+    if( cur == NULL )
+    {
+        if( cache->count < (size_t) cache->max_entries )
+        {
+            cur = &cache->entries[cache->count++];
+        }
+        else
+        {
+            cur = &cache->entries[cache->victim];
+            cache->victim = ( cache->victim + 1 ) % cache->max_entries;
+
+            for( link = verify_cache_bucket( cache, cur->key );
+                 *link != cur; link = &(*link)->next )
+                ;
+            *link = cur->next;
+        }
+
+        memcpy( cur->key, key, 32 );
+        link = verify_cache_bucket( cache, key );
+        cur->next = *link;
+        *link = cur;
+    }
+
+    cur->flags = flags;
+    cur->not_after = *not_after;
+#if defined(MBEDTLS_HAVE_TIME)
+    cur->timestamp = mbedtls_time( NULL );
+#endif
+
+exit:
+#if defined(MBEDTLS_THREADING_C)
+    mbedtls_mutex_unlock( &cache->mutex );
+#endif
+    return;
+}
+
+/*
+ * Wraps the verification callback to find the earliest end of validity
+ * of the certificates of the path
+ */
+typedef struct
+{
+    int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *);
+    void *p_vrfy;
+    mbedtls_x509_time not_after;
+}
+verify_cache_vrfy_ctx;
+
+static int verify_cache_vrfy( void *data, mbedtls_x509_crt *crt,
+                              int depth, uint32_t *flags )
+{
+    verify_cache_vrfy_ctx *ctx = (verify_cache_vrfy_ctx *) data;
+
+    verify_cache_time_min( &ctx->not_after, &crt->valid_to );
+
+    if( ctx->f_vrfy != NULL )
+        return( ctx->f_vrfy( ctx->p_vrfy, crt, depth, flags ) );
+
+    return( 0 );
+}
+
+int mbedtls_x509_crt_verify_with_cache( mbedtls_x509_verify_cache *cache,
+                     mbedtls_x509_crt *crt,
+                     mbedtls_x509_crt *trust_ca,
+                     mbedtls_x509_crl *ca_crl,
+                     const mbedtls_x509_crt_profile *profile,
+                     const char *cn, uint32_t *flags,
+                     int (*f_vrfy)(void *, mbedtls_x509_crt *, int, uint32_t *),
+                     void *p_vrfy )
+{
+    int ret;
+    unsigned char key[32];
+    uint32_t generation;
+    verify_cache_vrfy_ctx ctx;
+    const mbedtls_x509_crl *crl;
+
+    if( cache == NULL || profile == NULL )
+    {
+        return( mbedtls_x509_crt_verify_with_profile( crt, trust_ca, ca_crl,
+                                profile, cn, flags, f_vrfy, p_vrfy ) );
+    }
+
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_lock( &cache->mutex ) != 0 )
+        return( MBEDTLS_ERR_X509_FATAL_ERROR );
+#endif
+    generation = cache->generation;
+#if defined(MBEDTLS_THREADING_C)
+    if( mbedtls_mutex_unlock( &cache->mutex ) != 0 )
+        return( MBEDTLS_ERR_X509_FATAL_ERROR );
+#endif
+
+    if( verify_cache_key( crt, trust_ca, ca_crl, profile, cn,
+                          f_vrfy, p_vrfy, generation, key ) != 0 )
+    {
+        return( MBEDTLS_ERR_X509_FATAL_ERROR );
+    }
+
+    if( verify_cache_get( cache, key, flags ) == 0 )
+        return( *flags != 0 ? MBEDTLS_ERR_X509_CERT_VERIFY_FAILED : 0 );
+
+    memset( &ctx, 0, sizeof( ctx ) );
+    ctx.f_vrfy = f_vrfy;
+    ctx.p_vrfy = p_vrfy;
+
+    ret = mbedtls_x509_crt_verify_with_profile( crt, trust_ca, ca_crl,
+                                profile, cn, flags, verify_cache_vrfy, &ctx );
+
+    /* Fatal errors aren't results, and "not yet valid" ones change soon */
+    if( ( ret != 0 && ret != MBEDTLS_ERR_X509_CERT_VERIFY_FAILED ) ||
+        ( *flags & ( MBEDTLS_X509_BADCERT_FUTURE |
+                     MBEDTLS_X509_BADCRL_FUTURE ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    /* The callback doesn't see certificates that were not checked */
+    verify_cache_time_min( &ctx.not_after, &crt->valid_to );
+
+    for( crl = ca_crl; crl != NULL && crl->version != 0; crl = crl->next )
+        verify_cache_time_min( &ctx.not_after, &crl->next_update );
+
+    verify_cache_set( cache, key, *flags, &ctx.not_after );
+
+    return( ret );
+}
+
+#endif /* MBEDTLS_X509_VERIFY_CACHE_C */
@@ -0,0 +1,633 @@
+/*
+ *  DTLS echo server serving many clients from one socket
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdio.h>
+#include <stdlib.h>
+#define mbedtls_calloc     calloc
+#define mbedtls_free       free
+#define mbedtls_printf     printf
+#define mbedtls_fprintf    fprintf
+#endif
+
+#if !defined(MBEDTLS_SSL_SRV_C) || !defined(MBEDTLS_SSL_PROTO_DTLS) ||    \
+    !defined(MBEDTLS_SSL_COOKIE_C) || !defined(MBEDTLS_NET_MUX_C) ||      \
+    !defined(MBEDTLS_ENTROPY_C) || !defined(MBEDTLS_CTR_DRBG_C) ||        \
+    !defined(MBEDTLS_X509_CRT_PARSE_C) || !defined(MBEDTLS_RSA_C) ||      \
+    !defined(MBEDTLS_CERTS_C) || !defined(MBEDTLS_PEM_PARSE_C) ||         \
+    !defined(MBEDTLS_TIMING_C)
+
+int main( void )
+{
+    mbedtls_printf( "MBEDTLS_SSL_SRV_C and/or MBEDTLS_SSL_PROTO_DTLS and/or "
+            "MBEDTLS_SSL_COOKIE_C and/or MBEDTLS_NET_MUX_C and/or "
+            "MBEDTLS_ENTROPY_C and/or MBEDTLS_CTR_DRBG_C and/or "
+            "MBEDTLS_X509_CRT_PARSE_C and/or MBEDTLS_RSA_C and/or "
+            "MBEDTLS_CERTS_C and/or MBEDTLS_PEM_PARSE_C and/or "
+            "MBEDTLS_TIMING_C not defined.\n" );
+    return( 0 );
+}
+#else
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <signal.h>
+
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/certs.h"
+#include "mbedtls/x509.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_cookie.h"
+#include "mbedtls/net_sockets.h"
+#include "mbedtls/net_mux.h"
+#include "mbedtls/error.h"
+#include "mbedtls/debug.h"
+#include "mbedtls/timing.h"
+
+#define DFL_SERVER_ADDR         NULL
+#define DFL_SERVER_PORT         "4433"
+#define DFL_DEBUG_LEVEL         0
+#define DFL_MAX_CLIENTS         1000
+#define DFL_BATCH               32
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+#define DFL_CID_LEN             8
+#else
+#define DFL_CID_LEN             0
+#endif
+
+#define POLL_INTERVAL_MS        50  /* for the retransmission timers */
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+#define USAGE_CID \
+    "    cid_len=%%d          default: 8 (0 to disable connection IDs)\n"
+#else
+#define USAGE_CID ""
+#endif
+
+#define USAGE \
+    "\n usage: dtls_mux_server param=<>...\n"               \
+    "\n acceptable parameters:\n"                           \
+    "    server_addr=%%s      default: (all interfaces)\n"  \
+    "    server_port=%%d      default: 4433\n"              \
+    "    debug_level=%%d      default: 0 (disabled)\n"      \
+    "    max_clients=%%d      default: 1000\n"              \
+    "    batch=%%d            default: 32 (datagrams per system call)\n" \
+    USAGE_CID                                               \
+    "\n"
+
+/*
+ * global options
+ */
+struct options
+{
+    const char *server_addr;    /* address on which the ssl service runs    */
+    const char *server_port;    /* port on which the ssl service runs       */
+    int debug_level;            /* level of debugging                       */
+    int max_clients;            /* maximum number of simultaneous clients   */
+    int batch;                  /* datagrams read or written at once        */
+    int cid_len;                /* length of our connection IDs, 0 for none */
+} opt;
+
+/*
+ * One client, attached to its multiplexer peer
+ */
+typedef struct client
+{
+    unsigned id;
+    int handshake_done;
+    mbedtls_ssl_context ssl;
+    mbedtls_timing_delay_context timer;
+    mbedtls_net_mux_peer *peer;
+    struct client *prev, *next;
+}
+client;
+
+static client *clients = NULL;
+static unsigned next_id = 1, served = 0;
+
+/* Interruption handler to ensure clean exit (for valgrind testing) */
+static volatile sig_atomic_t received_sigterm = 0;
+static void term_handler( int sig )
+{
+    ((void) sig);
+    received_sigterm = 1;
+}
+
+static void my_debug( void *ctx, int level,
+                      const char *file, int line,
+                      const char *str )
+{
+    ((void) level);
+
+    mbedtls_fprintf( (FILE *) ctx, "%s:%04d: %s", file, line, str );
+    fflush(  (FILE *) ctx  );
+}
+
+static client *client_new( const mbedtls_ssl_config *conf,
+                           mbedtls_net_mux_peer *peer )
+{
+    client *c;
+
+    if( ( c = mbedtls_calloc( 1, sizeof( client ) ) ) == NULL )
+        return( NULL );
+
+    mbedtls_ssl_init( &c->ssl );
+    if( mbedtls_ssl_setup( &c->ssl, conf ) != 0 ||
+        mbedtls_ssl_set_client_transport_id( &c->ssl,
+                                             peer->addr, peer->addr_len ) != 0 )
+    {
+        mbedtls_ssl_free( &c->ssl );
+        mbedtls_free( c );
+        return( NULL );
+    }
+
+    mbedtls_ssl_set_timer_cb( &c->ssl, &c->timer, mbedtls_timing_set_delay,
+                                                  mbedtls_timing_get_delay );
+    mbedtls_ssl_set_bio( &c->ssl, peer,
+                         mbedtls_net_mux_send, mbedtls_net_mux_recv, NULL );
+
+    c->id = next_id++;
+    c->peer = peer;
+    peer->user = c;
+
+    c->next = clients;
+    if( clients != NULL )
+        clients->prev = c;
+    clients = c;
+
+    return( c );
+}
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+/*
+ * Give a client a random connection ID, so that its datagrams still reach
+ * it once its address changed
+ */
+static int client_set_cid( client *c, mbedtls_ctr_drbg_context *ctr_drbg )
+{
+    int ret;
+    unsigned char cid[MBEDTLS_NET_MUX_CID_MAX_LEN];
+
+    if( opt.cid_len == 0 )
+        return( 0 );
+
+    if( ( ret = mbedtls_ctr_drbg_random( ctr_drbg, cid, opt.cid_len ) ) != 0 )
+        return( ret );
+
+    if( ( ret = mbedtls_ssl_set_cid( &c->ssl, MBEDTLS_SSL_CID_ENABLED,
+                                     cid, opt.cid_len ) ) != 0 )
+        return( ret );
+
+    return( mbedtls_net_mux_set_peer_cid( c->peer, cid, opt.cid_len ) );
+}
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
+static void client_free( client *c )
+{
+    mbedtls_net_mux_close_peer( c->peer );
+    mbedtls_ssl_free( &c->ssl );
+
+    if( c->prev != NULL )
+        c->prev->next = c->next;
+    else
+        clients = c->next;
+    if( c->next != NULL )
+        c->next->prev = c->prev;
+
+    mbedtls_free( c );
+}
+
+/*
+ * Make all the progress possible with the datagrams queued for a client,
+ * freeing it once it is done
+ */
+static void client_serve( client *c )
+{
+    int ret, len;
+    unsigned char buf[1024];
+
+    if( c->handshake_done == 0 )
+    {
+        ret = mbedtls_ssl_handshake( &c->ssl );
+
+        if( ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE )
+            return;
+
+        /*
+         * Keep no state for unverified addresses: the client comes back
+         * with a cookie and is set up afresh then.
+         */
+        if( ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED )
+            goto close;
+
+        if( ret != 0 )
+        {
+            mbedtls_printf( "  ! client %u: mbedtls_ssl_handshake returned "
+                            "-0x%x\n", c->id, -ret );
+            goto close;
+        }
+
+        mbedtls_printf( "  . client %u: handshake done\n", c->id );
+        c->handshake_done = 1;
+    }
+
+    for( ;; )
+    {
+        ret = mbedtls_ssl_read( &c->ssl, buf, sizeof( buf ) );
+
+        if( ret == MBEDTLS_ERR_SSL_WANT_READ ||
+            ret == MBEDTLS_ERR_SSL_WANT_WRITE )
+            return;
+
+        if( ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY )
+        {
+            mbedtls_printf( "  . client %u: closed, %u served\n",
+                            c->id, ++served );
+
+            /* No error checking, the connection might be closed already */
+            mbedtls_ssl_close_notify( &c->ssl );
+            goto close;
+        }
+
+        if( ret <= 0 )
+        {
+            mbedtls_printf( "  ! client %u: mbedtls_ssl_read returned "
+                            "-0x%x\n", c->id, -ret );
+            goto close;
+        }
+
+        len = ret;
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        /* The record is authenticated: follow the client if it moved */
+        if( c->peer->src_len != c->peer->addr_len ||
+            memcmp( c->peer->src, c->peer->addr, c->peer->addr_len ) != 0 )
+        {
+            mbedtls_printf( "  . client %u: moved to a new address\n", c->id );
+            mbedtls_net_mux_update_peer_addr( c->peer );
+        }
+#endif
+
+        mbedtls_printf( "  < client %u: %d bytes echoed\n", c->id, len );
+
+        do ret = mbedtls_ssl_write( &c->ssl, buf, len );
+        while( ret == MBEDTLS_ERR_SSL_WANT_WRITE &&
+               mbedtls_net_mux_flush( c->peer->mux ) == 0 );
+
+        if( ret < 0 )
+        {
+            mbedtls_printf( "  ! client %u: mbedtls_ssl_write returned "
+                            "-0x%x\n", c->id, -ret );
+            goto close;
+        }
+    }
+
+close:
+    client_free( c );
+}
+
+int main( int argc, char *argv[] )
+{
+    int ret = 0, i;
+    char *p, *q;
+    const char *pers = "dtls_mux_server";
+    mbedtls_net_context listen_fd;
+    mbedtls_net_mux mux;
+    mbedtls_net_mux_peer *peer;
+    client *c, *next;
+    mbedtls_ssl_cookie_ctx cookie_ctx;
+
+    mbedtls_entropy_context entropy;
+    mbedtls_ctr_drbg_context ctr_drbg;
+    mbedtls_ssl_config conf;
+    mbedtls_x509_crt srvcert;
+    mbedtls_pk_context pkey;
+
+    mbedtls_net_init( &listen_fd );
+    mbedtls_net_mux_init( &mux );
+    mbedtls_ssl_config_init( &conf );
+    mbedtls_ssl_cookie_init( &cookie_ctx );
+    mbedtls_x509_crt_init( &srvcert );
+    mbedtls_pk_init( &pkey );
+    mbedtls_entropy_init( &entropy );
+    mbedtls_ctr_drbg_init( &ctr_drbg );
+
+    /* Abort cleanly on SIGTERM and SIGINT */
+    signal( SIGTERM, term_handler );
+    signal( SIGINT, term_handler );
+
+    opt.server_addr         = DFL_SERVER_ADDR;
+    opt.server_port         = DFL_SERVER_PORT;
+    opt.debug_level         = DFL_DEBUG_LEVEL;
+    opt.max_clients         = DFL_MAX_CLIENTS;
+    opt.batch               = DFL_BATCH;
+    opt.cid_len             = DFL_CID_LEN;
+
+    for( i = 1; i < argc; i++ )
+    {
+        p = argv[i];
+        if( ( q = strchr( p, '=' ) ) == NULL )
+            goto usage;
+        *q++ = '\0';
+
+        if( strcmp( p, "server_addr" ) == 0 )
+            opt.server_addr = q;
+        else if( strcmp( p, "server_port" ) == 0 )
+            opt.server_port = q;
+        else if( strcmp( p, "debug_level" ) == 0 )
+        {
+            opt.debug_level = atoi( q );
+            if( opt.debug_level < 0 || opt.debug_level > 65535 )
+                goto usage;
+        }
+        else if( strcmp( p, "max_clients" ) == 0 )
+        {
+            opt.max_clients = atoi( q );
+            if( opt.max_clients < 1 )
+                goto usage;
+        }
+        else if( strcmp( p, "batch" ) == 0 )
+        {
+            opt.batch = atoi( q );
+            if( opt.batch < 1 || opt.batch > 1024 )
+                goto usage;
+        }
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+        else if( strcmp( p, "cid_len" ) == 0 )
+        {
+            opt.cid_len = atoi( q );
+            if( opt.cid_len < 0 ||
+                opt.cid_len > MBEDTLS_SSL_CID_IN_LEN_MAX ||
+                opt.cid_len > MBEDTLS_NET_MUX_CID_MAX_LEN )
+                goto usage;
+        }
+#endif
+        else
+            goto usage;
+    }
+
+#if defined(MBEDTLS_DEBUG_C)
+    mbedtls_debug_set_threshold( opt.debug_level );
+#endif
+
+    /*
+     * 1. Load the certificates and private RSA key
+     */
+    mbedtls_printf( "\n  . Loading the server cert. and key..." );
+    fflush( stdout );
+
+    /*
+     * This demonstration program uses embedded test certificates.
+     * Instead, you may want to use mbedtls_x509_crt_parse_file() to read the
+     * server and CA certificates, as well as mbedtls_pk_parse_keyfile().
+     */
+    ret = mbedtls_x509_crt_parse( &srvcert, (const unsigned char *) mbedtls_test_srv_crt,
+                          mbedtls_test_srv_crt_len );
+    if( ret != 0 )
+    {
+        mbedtls_printf( " failed\n  !  mbedtls_x509_crt_parse returned %d\n\n", ret );
+        goto exit;
+    }
+
+    ret = mbedtls_x509_crt_parse( &srvcert, (const unsigned char *) mbedtls_test_cas_pem,
+                          mbedtls_test_cas_pem_len );
+    if( ret != 0 )
+    {
+        mbedtls_printf( " failed\n  !  mbedtls_x509_crt_parse returned %d\n\n", ret );
+        goto exit;
+    }
+
+    ret =  mbedtls_pk_parse_key( &pkey, (const unsigned char *) mbedtls_test_srv_key,
+                         mbedtls_test_srv_key_len, NULL, 0 );
+    if( ret != 0 )
+    {
+        mbedtls_printf( " failed\n  !  mbedtls_pk_parse_key returned %d\n\n", ret );
+        goto exit;
+    }
+
+    mbedtls_printf( " ok\n" );
+
+    /*
+     * 2. Setup the UDP socket shared by all the clients
+     */
+    mbedtls_printf( "  . Bind on udp://%s:%s/ ...",
+                    opt.server_addr ? opt.server_addr : "*",
+                    opt.server_port );
+    fflush( stdout );
+
+    if( ( ret = mbedtls_net_bind( &listen_fd, opt.server_addr, opt.server_port,
+                                  MBEDTLS_NET_PROTO_UDP ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_net_bind returned -0x%x\n\n", -ret );
+        goto exit;
+    }
+
+    if( ( ret = mbedtls_net_mux_setup( &mux, &listen_fd, opt.max_clients,
+                                       opt.batch,
+                                       MBEDTLS_SSL_MAX_CONTENT_LEN + 512 ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_net_mux_setup returned -0x%x\n\n", -ret );
+        goto exit;
+    }
+
+    mbedtls_printf( " ok\n" );
+
+    /*
+     * 3. Seed the RNG
+     */
+    mbedtls_printf( "  . Seeding the random number generator..." );
+    fflush( stdout );
+
+    if( ( ret = mbedtls_ctr_drbg_seed( &ctr_drbg, mbedtls_entropy_func, &entropy,
+                               (const unsigned char *) pers,
+                               strlen( pers ) ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_ctr_drbg_seed returned %d\n", ret );
+        goto exit;
+    }
+
+    mbedtls_printf( " ok\n" );
+
+    /*
+     * 4. Setup stuff
+     */
+    mbedtls_printf( "  . Setting up the DTLS data..." );
+    fflush( stdout );
+
+    if( ( ret = mbedtls_ssl_config_defaults( &conf,
+                    MBEDTLS_SSL_IS_SERVER,
+                    MBEDTLS_SSL_TRANSPORT_DATAGRAM,
+                    MBEDTLS_SSL_PRESET_DEFAULT ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_ssl_config_defaults returned %d\n\n", ret );
+        goto exit;
+    }
+
+    mbedtls_ssl_conf_rng( &conf, mbedtls_ctr_drbg_random, &ctr_drbg );
+    mbedtls_ssl_conf_dbg( &conf, my_debug, stdout );
+
+    mbedtls_ssl_conf_ca_chain( &conf, srvcert.next, NULL );
+    if( ( ret = mbedtls_ssl_conf_own_cert( &conf, &srvcert, &pkey ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_ssl_conf_own_cert returned %d\n\n", ret );
+        goto exit;
+    }
+
+    if( ( ret = mbedtls_ssl_cookie_setup( &cookie_ctx,
+                                  mbedtls_ctr_drbg_random, &ctr_drbg ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_ssl_cookie_setup returned %d\n\n", ret );
+        goto exit;
+    }
+
+    mbedtls_ssl_conf_dtls_cookies( &conf, mbedtls_ssl_cookie_write, mbedtls_ssl_cookie_check,
+                               &cookie_ctx );
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    /* Route the datagrams by connection ID, whatever their sender */
+    if( opt.cid_len != 0 )
+    {
+        if( ( ret = mbedtls_ssl_conf_cid( &conf, opt.cid_len ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_conf_cid returned -0x%x\n\n", -ret );
+            goto exit;
+        }
+
+        mbedtls_net_mux_set_cid_cb( &mux, mbedtls_ssl_get_datagram_cid, &conf );
+    }
+#endif
+
+    mbedtls_printf( " ok\n" );
+
+    /*
+     * 5. Serve the clients as their datagrams come in
+     */
+    mbedtls_printf( "  . Waiting for clients...\n" );
+    fflush( stdout );
+
+    while( received_sigterm == 0 )
+    {
+        ret = mbedtls_net_mux_recv_batch( &mux, POLL_INTERVAL_MS );
+        if( ret < 0 && ret != MBEDTLS_ERR_SSL_TIMEOUT &&
+            ret != MBEDTLS_ERR_SSL_WANT_READ )
+        {
+            mbedtls_printf( "  ! mbedtls_net_mux_recv_batch returned -0x%x\n\n", -ret );
+            goto exit;
+        }
+
+        while( ( peer = mbedtls_net_mux_next_ready( &mux ) ) != NULL )
+        {
+            if( ( c = peer->user ) == NULL )
+            {
+                if( ( c = client_new( &conf, peer ) ) == NULL )
+                {
+                    mbedtls_net_mux_close_peer( peer );
+                    continue;
+                }
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+                if( ( ret = client_set_cid( c, &ctr_drbg ) ) != 0 )
+                {
+                    mbedtls_printf( "  ! client %u: connection ID setup "
+                                    "returned -0x%x\n", c->id, -ret );
+                    client_free( c );
+                    continue;
+                }
+#endif
+            }
+
+            client_serve( c );
+        }
+
+        /* Retransmit the flights of the handshakes that timed out */
+        for( c = clients; c != NULL; c = next )
+        {
+            next = c->next;
+
+            if( c->handshake_done == 0 &&
+                mbedtls_timing_get_delay( &c->timer ) == 2 )
+                client_serve( c );
+        }
+
+        ret = mbedtls_net_mux_flush( &mux );
+        if( ret != 0 && ret != MBEDTLS_ERR_SSL_WANT_WRITE )
+            mbedtls_printf( "  ! mbedtls_net_mux_flush returned -0x%x\n", -ret );
+
+        fflush( stdout );
+    }
+
+    mbedtls_printf( "  . Interrupted by SIGTERM, %u clients served\n", served );
+    ret = 0;
+    goto exit;
+
+usage:
+    ret = 1;
+    mbedtls_printf( USAGE );
+
+    /*
+     * Final clean-ups and exit
+     */
+exit:
+
+#ifdef MBEDTLS_ERROR_C
+    if( ret != 0 && ret != 1 )
+    {
+        char error_buf[100];
+        mbedtls_strerror( ret, error_buf, 100 );
+        mbedtls_printf( "Last error was: %d - %s\n\n", ret, error_buf );
+    }
+#endif
+
+    while( clients != NULL )
+        client_free( clients );
+
+    mbedtls_net_mux_free( &mux );
+    mbedtls_net_free( &listen_fd );
+
+    mbedtls_x509_crt_free( &srvcert );
+    mbedtls_pk_free( &pkey );
+    mbedtls_ssl_config_free( &conf );
+    mbedtls_ssl_cookie_free( &cookie_ctx );
+    mbedtls_ctr_drbg_free( &ctr_drbg );
+    mbedtls_entropy_free( &entropy );
+
+#if defined(_WIN32)
+    mbedtls_printf( "  Press Enter to exit this program.\n" );
+    fflush( stdout ); getchar();
+#endif
+
+    return( ret != 0 );
+}
+#endif /* MBEDTLS_SSL_SRV_C && MBEDTLS_SSL_PROTO_DTLS &&
+          MBEDTLS_SSL_COOKIE_C && MBEDTLS_NET_MUX_C && MBEDTLS_ENTROPY_C &&
+          MBEDTLS_CTR_DRBG_C && MBEDTLS_X509_CRT_PARSE_C && MBEDTLS_RSA_C &&
+          MBEDTLS_CERTS_C && MBEDTLS_PEM_PARSE_C && MBEDTLS_TIMING_C */
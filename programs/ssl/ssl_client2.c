@@ -74,6 +74,11 @@ int main( void )
 #define DFL_DEBUG_LEVEL         0
 #define DFL_NBIO                0
 #define DFL_READ_TIMEOUT        0
+#define DFL_READ_AHEAD          MBEDTLS_SSL_READ_AHEAD_DISABLED
+#define DFL_DYN_REC_LEN         0
+#define DFL_DYN_REC_RAMP        1048576
+#define DFL_DYN_REC_IDLE        1
+#define DFL_HS_ARENA            0
 #define DFL_MAX_RESEND          0
 #define DFL_CA_FILE             ""
 #define DFL_CA_PATH             ""
@@ -100,11 +105,16 @@ int main( void )
 #define DFL_RECO_DELAY          0
 #define DFL_RECONNECT_HARD      0
 #define DFL_TICKETS             MBEDTLS_SSL_SESSION_TICKETS_ENABLED
+#define DFL_OCSP_STAPLING       MBEDTLS_SSL_OCSP_STAPLING_DISABLED
 #define DFL_ALPN_STRING         NULL
 #define DFL_CURVES              NULL
 #define DFL_TRANSPORT           MBEDTLS_SSL_TRANSPORT_STREAM
 #define DFL_HS_TO_MIN           0
 #define DFL_HS_TO_MAX           0
+#define DFL_DTLS_MTU            0
+#define DFL_DGRAM_PACKING       1
+#define DFL_CID_ENABLED         0
+#define DFL_CID_VALUE           ""
 #define DFL_FALLBACK            -1
 #define DFL_EXTENDED_MS         -1
 #define DFL_ETM                 -1
@@ -145,6 +155,13 @@ int main( void )
 #define USAGE_TICKETS ""
 #endif /* MBEDTLS_SSL_SESSION_TICKETS */
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+#define USAGE_OCSP_STAPLING                                 \
+    "    ocsp_stapling=%%d    default: 0 (disabled)\n"
+#else
+#define USAGE_OCSP_STAPLING ""
+#endif /* MBEDTLS_SSL_OCSP_STAPLING */
+
 #if defined(MBEDTLS_SSL_TRUNCATED_HMAC)
 #define USAGE_TRUNC_HMAC                                    \
     "    trunc_hmac=%%d       default: library default\n"
@@ -167,6 +184,22 @@ int main( void )
 #define USAGE_RECSPLIT
 #endif
 
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+#define USAGE_DRS \
+    "    dyn_rec_len=%%d      default: 0 (dynamic record sizing disabled)\n" \
+    "    dyn_rec_ramp=%%d     default: 1048576 (bytes before full records)\n" \
+    "    dyn_rec_idle=%%d     default: 1 (seconds before small records again)\n"
+#else
+#define USAGE_DRS ""
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+#define USAGE_HS_ARENA \
+    "    hs_arena=%%d         default: 0 (no handshake arena)\n"
+#else
+#define USAGE_HS_ARENA ""
+#endif
+
 #if defined(MBEDTLS_DHM_C)
 #define USAGE_DHMLEN \
     "    dhmlen=%%d           default: (library default: 1024 bits)\n"
@@ -197,11 +230,25 @@ int main( void )
 #define USAGE_DTLS \
     "    dtls=%%d             default: 0 (TLS)\n"                           \
     "    hs_timeout=%%d-%%d    default: (library default: 1000-60000)\n"    \
-    "                        range of DTLS handshake timeouts in millisecs\n"
+    "                        range of DTLS handshake timeouts in millisecs\n" \
+    "    mtu=%%d              default: (library default: unlimited)\n"      \
+    "    dgram_packing=%%d    default: 1 (allowed)\n"                       \
+    "                        allow or forbid packing of records within\n"   \
+    "                        a single datagram\n"
 #else
 #define USAGE_DTLS ""
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+#define USAGE_CID \
+    "    cid=%%d              Disable (0) or enable (1) the use of the DTLS\n" \
+    "                        Connection ID extension. default: 0\n"          \
+    "    cid_val=%%s          The connection ID we ask the peer to use, in\n"  \
+    "                        hex, without 0x. default: \"\" (empty)\n"
+#else
+#define USAGE_CID ""
+#endif
+
 #if defined(MBEDTLS_SSL_FALLBACK_SCSV)
 #define USAGE_FALLBACK \
     "    fallback=0/1        default: (library default: off)\n"
@@ -251,9 +298,13 @@ int main( void )
     "    nbio=%%d             default: 0 (blocking I/O)\n"  \
     "                        options: 1 (non-blocking), 2 (added delays)\n" \
     "    read_timeout=%%d     default: 0 ms (no timeout)\n"    \
+    "    read_ahead=%%d       default: 0 (read records one by one)\n" \
+    USAGE_DRS                                               \
+    USAGE_HS_ARENA                                          \
     "    max_resend=%%d       default: 0 (no resend on timeout)\n" \
     "\n"                                                    \
     USAGE_DTLS                                              \
+    USAGE_CID                                               \
     "\n"                                                    \
     "    auth_mode=%%s        default: (library default: none)\n"      \
     "                        options: none, optional, required\n" \
@@ -269,6 +320,7 @@ int main( void )
     "    reco_delay=%%d       default: 0 seconds\n"         \
     "    reconnect_hard=%%d   default: 0 (disabled)\n"      \
     USAGE_TICKETS                                           \
+    USAGE_OCSP_STAPLING                                     \
     USAGE_MAX_FRAG_LEN                                      \
     USAGE_TRUNC_HMAC                                        \
     USAGE_ALPN                                              \
@@ -284,7 +336,8 @@ int main( void )
     "    min_version=%%s      default: (library default: tls1)\n"       \
     "    max_version=%%s      default: (library default: tls1_2)\n"     \
     "    force_version=%%s    default: \"\" (none)\n"       \
-    "                        options: ssl3, tls1, tls1_1, tls1_2, dtls1, dtls1_2\n" \
+    "                        options: ssl3, tls1, tls1_1, tls1_2, tls1_3,\n" \
+    "                                 dtls1, dtls1_2\n"                 \
     "\n"                                                    \
     "    force_ciphersuite=<name>    default: all enabled\n"\
     " acceptable ciphersuite names:\n"
@@ -303,6 +356,11 @@ struct options
     int debug_level;            /* level of debugging                       */
     int nbio;                   /* should I/O be blocking?                  */
     uint32_t read_timeout;      /* timeout on mbedtls_ssl_read() in milliseconds    */
+    int read_ahead;             /* read more than one record at a time?     */
+    int dyn_rec_len;            /* payload of small records (0: disabled)   */
+    int dyn_rec_ramp;           /* bytes written before full-size records   */
+    int dyn_rec_idle;           /* seconds idle before small records again  */
+    int hs_arena;               /* size of the handshake arena (0: none)    */
     int max_resend;             /* DTLS times to resend on read timeout     */
     const char *request_page;   /* page on server to request                */
     int request_size;           /* pad request with header to requested size */
@@ -332,11 +390,16 @@ struct options
     int reco_delay;             /* delay in seconds before resuming session */
     int reconnect_hard;         /* unexpectedly reconnect from the same port */
     int tickets;                /* enable / disable session tickets         */
+    int ocsp_stapling;          /* request the server's OCSP response       */
     const char *curves;         /* list of supported elliptic curves        */
     const char *alpn_string;    /* ALPN supported protocols                 */
     int transport;              /* TLS or DTLS?                             */
     uint32_t hs_to_min;         /* Initial value of DTLS handshake timer    */
     uint32_t hs_to_max;         /* Max value of DTLS handshake timer        */
+    int dtls_mtu;               /* UDP Maximum tranport unit for DTLS       */
+    int dgram_packing;          /* allow/forbid datagram packing            */
+    int cid_enabled;            /* offer/accept DTLS connection IDs?        */
+    const char *cid_val;        /* our connection ID, in hex                */
     int fallback;               /* is this a fallback connection?           */
     int extended_ms;            /* negotiate extended master secret?        */
     int etm;                    /* negotiate encrypt then mac?              */
@@ -447,6 +510,13 @@ int main( int argc, char *argv[] )
     unsigned char psk[MBEDTLS_PSK_MAX_LEN];
     size_t psk_len = 0;
 #endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    unsigned char cid[MBEDTLS_SSL_CID_IN_LEN_MAX];
+    unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX];
+    size_t cid_len = 0;
+    size_t peer_cid_len = 0;
+    int cid_negotiated;
+#endif
 #if defined(MBEDTLS_SSL_ALPN)
     const char *alpn_list[ALPN_LIST_SIZE];
 #endif
@@ -522,6 +592,11 @@ int main( int argc, char *argv[] )
     opt.debug_level         = DFL_DEBUG_LEVEL;
     opt.nbio                = DFL_NBIO;
     opt.read_timeout        = DFL_READ_TIMEOUT;
+    opt.read_ahead          = DFL_READ_AHEAD;
+    opt.dyn_rec_len         = DFL_DYN_REC_LEN;
+    opt.dyn_rec_ramp        = DFL_DYN_REC_RAMP;
+    opt.dyn_rec_idle        = DFL_DYN_REC_IDLE;
+    opt.hs_arena            = DFL_HS_ARENA;
     opt.max_resend          = DFL_MAX_RESEND;
     opt.request_page        = DFL_REQUEST_PAGE;
     opt.request_size        = DFL_REQUEST_SIZE;
@@ -550,11 +625,16 @@ int main( int argc, char *argv[] )
     opt.reco_delay          = DFL_RECO_DELAY;
     opt.reconnect_hard      = DFL_RECONNECT_HARD;
     opt.tickets             = DFL_TICKETS;
+    opt.ocsp_stapling       = DFL_OCSP_STAPLING;
     opt.alpn_string         = DFL_ALPN_STRING;
     opt.curves              = DFL_CURVES;
     opt.transport           = DFL_TRANSPORT;
     opt.hs_to_min           = DFL_HS_TO_MIN;
     opt.hs_to_max           = DFL_HS_TO_MAX;
+    opt.dtls_mtu            = DFL_DTLS_MTU;
+    opt.dgram_packing       = DFL_DGRAM_PACKING;
+    opt.cid_enabled         = DFL_CID_ENABLED;
+    opt.cid_val             = DFL_CID_VALUE;
     opt.fallback            = DFL_FALLBACK;
     opt.extended_ms         = DFL_EXTENDED_MS;
     opt.etm                 = DFL_ETM;
@@ -596,6 +676,40 @@ int main( int argc, char *argv[] )
         }
         else if( strcmp( p, "read_timeout" ) == 0 )
             opt.read_timeout = atoi( q );
+        else if( strcmp( p, "read_ahead" ) == 0 )
+        {
+            opt.read_ahead = atoi( q );
+            if( opt.read_ahead < 0 || opt.read_ahead > 1 )
+                goto usage;
+        }
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+        else if( strcmp( p, "dyn_rec_len" ) == 0 )
+        {
+            opt.dyn_rec_len = atoi( q );
+            if( opt.dyn_rec_len < 0 )
+                goto usage;
+        }
+        else if( strcmp( p, "dyn_rec_ramp" ) == 0 )
+        {
+            opt.dyn_rec_ramp = atoi( q );
+            if( opt.dyn_rec_ramp < 0 )
+                goto usage;
+        }
+        else if( strcmp( p, "dyn_rec_idle" ) == 0 )
+        {
+            opt.dyn_rec_idle = atoi( q );
+            if( opt.dyn_rec_idle < 0 )
+                goto usage;
+        }
+#endif
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+        else if( strcmp( p, "hs_arena" ) == 0 )
+        {
+            opt.hs_arena = atoi( q );
+            if( opt.hs_arena < 0 )
+                goto usage;
+        }
+#endif
         else if( strcmp( p, "max_resend" ) == 0 )
         {
             opt.max_resend = atoi( q );
@@ -687,6 +801,12 @@ int main( int argc, char *argv[] )
             if( opt.tickets < 0 || opt.tickets > 2 )
                 goto usage;
         }
+        else if( strcmp( p, "ocsp_stapling" ) == 0 )
+        {
+            opt.ocsp_stapling = atoi( q );
+            if( opt.ocsp_stapling < 0 || opt.ocsp_stapling > 1 )
+                goto usage;
+        }
         else if( strcmp( p, "alpn" ) == 0 )
         {
             opt.alpn_string = q;
@@ -732,6 +852,10 @@ int main( int argc, char *argv[] )
             else if( strcmp( q, "tls1_2" ) == 0 ||
                      strcmp( q, "dtls1_2" ) == 0 )
                 opt.min_version = MBEDTLS_SSL_MINOR_VERSION_3;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            else if( strcmp( q, "tls1_3" ) == 0 )
+                opt.min_version = MBEDTLS_SSL_MINOR_VERSION_4;
+#endif
             else
                 goto usage;
         }
@@ -747,6 +871,10 @@ int main( int argc, char *argv[] )
             else if( strcmp( q, "tls1_2" ) == 0 ||
                      strcmp( q, "dtls1_2" ) == 0 )
                 opt.max_version = MBEDTLS_SSL_MINOR_VERSION_3;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            else if( strcmp( q, "tls1_3" ) == 0 )
+                opt.max_version = MBEDTLS_SSL_MINOR_VERSION_4;
+#endif
             else
                 goto usage;
         }
@@ -790,6 +918,13 @@ int main( int argc, char *argv[] )
                 opt.min_version = MBEDTLS_SSL_MINOR_VERSION_3;
                 opt.max_version = MBEDTLS_SSL_MINOR_VERSION_3;
             }
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            else if( strcmp( q, "tls1_3" ) == 0 )
+            {
+                opt.min_version = MBEDTLS_SSL_MINOR_VERSION_4;
+                opt.max_version = MBEDTLS_SSL_MINOR_VERSION_4;
+            }
+#endif
             else if( strcmp( q, "dtls1" ) == 0 )
             {
                 opt.min_version = MBEDTLS_SSL_MINOR_VERSION_2;
@@ -838,6 +973,26 @@ int main( int argc, char *argv[] )
                 default: goto usage;
             }
         }
+        else if( strcmp( p, "mtu" ) == 0 )
+        {
+            opt.dtls_mtu = atoi( q );
+            if( opt.dtls_mtu < 0 || opt.dtls_mtu > 65535 )
+                goto usage;
+        }
+        else if( strcmp( p, "cid" ) == 0 )
+        {
+            opt.cid_enabled = atoi( q );
+            if( opt.cid_enabled != 0 && opt.cid_enabled != 1 )
+                goto usage;
+        }
+        else if( strcmp( p, "cid_val" ) == 0 )
+            opt.cid_val = q;
+        else if( strcmp( p, "dgram_packing" ) == 0 )
+        {
+            opt.dgram_packing = atoi( q );
+            if( opt.dgram_packing != 0 && opt.dgram_packing != 1 )
+                goto usage;
+        }
         else if( strcmp( p, "hs_timeout" ) == 0 )
         {
             if( ( p = strchr( q, '-' ) ) == NULL )
@@ -1229,6 +1384,39 @@ int main( int argc, char *argv[] )
         mbedtls_ssl_conf_handshake_timeout( &conf, opt.hs_to_min, opt.hs_to_max );
 #endif /* MBEDTLS_SSL_PROTO_DTLS */
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+    {
+        size_t n;
+        unsigned int byte;
+
+        cid_len = strlen( opt.cid_val ) / 2;
+
+        if( strlen( opt.cid_val ) % 2 != 0 || cid_len > sizeof( cid ) )
+        {
+            mbedtls_printf( " failed\n  ! Invalid connection ID\n\n" );
+            goto exit;
+        }
+
+        for( n = 0; n < cid_len; n++ )
+        {
+            if( sscanf( opt.cid_val + 2 * n, "%2x", &byte ) != 1 )
+            {
+                mbedtls_printf( " failed\n  ! Invalid connection ID\n\n" );
+                goto exit;
+            }
+            cid[n] = (unsigned char) byte;
+        }
+
+        if( ( ret = mbedtls_ssl_conf_cid( &conf, cid_len ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_conf_cid returned -0x%x\n\n",
+                            -ret );
+            goto exit;
+        }
+    }
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
     if( ( ret = mbedtls_ssl_conf_max_frag_len( &conf, opt.mfl_code ) ) != 0 )
     {
@@ -1252,6 +1440,21 @@ int main( int argc, char *argv[] )
         mbedtls_ssl_conf_encrypt_then_mac( &conf, opt.etm );
 #endif
 
+    if( opt.read_ahead != DFL_READ_AHEAD )
+        mbedtls_ssl_conf_read_ahead( &conf, opt.read_ahead );
+
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    if( opt.dyn_rec_len != DFL_DYN_REC_LEN )
+        mbedtls_ssl_conf_dynamic_record_sizing( &conf, opt.dyn_rec_len,
+                                                opt.dyn_rec_ramp,
+                                                opt.dyn_rec_idle );
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    if( opt.hs_arena != DFL_HS_ARENA )
+        mbedtls_ssl_conf_handshake_arena( &conf, opt.hs_arena );
+#endif
+
 #if defined(MBEDTLS_SSL_CBC_RECORD_SPLITTING)
     if( opt.recsplit != DFL_RECSPLIT )
         mbedtls_ssl_conf_cbc_record_splitting( &conf, opt.recsplit
@@ -1282,6 +1485,10 @@ int main( int argc, char *argv[] )
     mbedtls_ssl_conf_session_tickets( &conf, opt.tickets );
 #endif
 
+#if defined(MBEDTLS_SSL_OCSP_STAPLING)
+    mbedtls_ssl_conf_ocsp_stapling( &conf, opt.ocsp_stapling );
+#endif
+
     if( opt.force_ciphersuite[0] != DFL_FORCE_CIPHER )
         mbedtls_ssl_conf_ciphersuites( &conf, opt.force_ciphersuite );
 
@@ -1380,6 +1587,25 @@ int main( int argc, char *argv[] )
                                             mbedtls_timing_get_delay );
 #endif
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( opt.dtls_mtu != DFL_DTLS_MTU )
+        mbedtls_ssl_set_mtu( &ssl, opt.dtls_mtu );
+
+    if( opt.dgram_packing != DFL_DGRAM_PACKING )
+        mbedtls_ssl_set_datagram_packing( &ssl, opt.dgram_packing );
+#endif
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        ( ret = mbedtls_ssl_set_cid( &ssl, opt.cid_enabled, cid,
+                                     cid_len ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_ssl_set_cid returned -0x%x\n\n",
+                        -ret );
+        goto exit;
+    }
+#endif
+
     mbedtls_printf( " ok\n" );
 
     /*
@@ -1419,6 +1645,38 @@ int main( int argc, char *argv[] )
                     (unsigned int) mbedtls_ssl_get_max_frag_len( &ssl ) );
 #endif
 
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    mbedtls_printf( "    [ Handshake arena peak is %u bytes ]\n",
+                    (unsigned int) mbedtls_ssl_get_handshake_arena_peak( &ssl ) );
+#endif
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        opt.cid_enabled == 1 )
+    {
+        if( ( ret = mbedtls_ssl_get_peer_cid( &ssl, &cid_negotiated,
+                                              peer_cid, &peer_cid_len ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_get_peer_cid returned -0x%x\n\n",
+                            -ret );
+            goto exit;
+        }
+
+        if( cid_negotiated == MBEDTLS_SSL_CID_DISABLED )
+            mbedtls_printf( "    [ Connection ID not in use ]\n" );
+        else
+        {
+            size_t n;
+
+            mbedtls_printf( "    [ Connection ID in use, server CID (%u bytes):",
+                            (unsigned int) peer_cid_len );
+            for( n = 0; n < peer_cid_len; n++ )
+                mbedtls_printf( " %02x", peer_cid[n] );
+            mbedtls_printf( " ]\n" );
+        }
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_ALPN)
     if( opt.alpn_string != NULL )
     {
@@ -1659,6 +1917,26 @@ send_request:
         ret = 0;
     }
 
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+    /*
+     * With TLS 1.3 the ticket comes after the handshake, with the response
+     */
+    if( opt.reconnect != 0 &&
+        strcmp( mbedtls_ssl_get_version( &ssl ), "TLSv1.3" ) == 0 )
+    {
+        mbedtls_printf( "  . Saving session for reuse..." );
+        fflush( stdout );
+
+        if( ( ret = mbedtls_ssl_get_session( &ssl, &saved_session ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_get_session returned -0x%x\n\n", -ret );
+            goto exit;
+        }
+
+        mbedtls_printf( " ok\n" );
+    }
+#endif /* MBEDTLS_SSL_PROTO_TLS1_3 */
+
     /*
      * 7b. Simulate hard reset and reconnect from same port?
      */
@@ -73,6 +73,12 @@ int main( void )
 #include <signal.h>
 #endif
 
+#if defined(MBEDTLS_SSL_SEND_FILE)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(MBEDTLS_SSL_CACHE_C)
 #include "mbedtls/ssl_cache.h"
 #endif
@@ -81,10 +87,22 @@ int main( void )
 #include "mbedtls/ssl_ticket.h"
 #endif
 
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+#include "mbedtls/x509_verify_cache.h"
+#endif
+
 #if defined(MBEDTLS_SSL_COOKIE_C)
 #include "mbedtls/ssl_cookie.h"
 #endif
 
+#if defined(MBEDTLS_SSL_SNI_C)
+#include "mbedtls/ssl_sni.h"
+#endif
+
+#if defined(MBEDTLS_SSL_OCSP_C)
+#include "mbedtls/ssl_ocsp.h"
+#endif
+
 #if defined(MBEDTLS_MEMORY_BUFFER_ALLOC_C)
 #include "mbedtls/memory_buffer_alloc.h"
 #endif
@@ -93,6 +111,14 @@ int main( void )
 #define SNI_OPTION
 #endif
 
+#if defined(MBEDTLS_SSL_SNI_C) && defined(MBEDTLS_FS_IO)
+#define SNI_STORE_OPTION
+#endif
+
+#if defined(MBEDTLS_SSL_OCSP_C) && defined(MBEDTLS_FS_IO)
+#define OCSP_OPTION
+#endif
+
 #if defined(_WIN32)
 #include <windows.h>
 #endif
@@ -102,6 +128,13 @@ int main( void )
 #define DFL_DEBUG_LEVEL         0
 #define DFL_NBIO                0
 #define DFL_READ_TIMEOUT        0
+#define DFL_READ_AHEAD          MBEDTLS_SSL_READ_AHEAD_DISABLED
+#define DFL_DYN_REC_LEN         0
+#define DFL_DYN_REC_RAMP        1048576
+#define DFL_DYN_REC_IDLE        1
+#define DFL_HS_ARENA            0
+#define DFL_KTLS                0
+#define DFL_RESPONSE_FILE       ""
 #define DFL_CA_FILE             ""
 #define DFL_CA_PATH             ""
 #define DFL_CRT_FILE            ""
@@ -132,7 +165,10 @@ int main( void )
 #define DFL_TICKET_TIMEOUT      86400
 #define DFL_CACHE_MAX           -1
 #define DFL_CACHE_TIMEOUT       -1
+#define DFL_VERIFY_CACHE        0
 #define DFL_SNI                 NULL
+#define DFL_SNI_STORE           NULL
+#define DFL_OCSP_FILE           NULL
 #define DFL_ALPN_STRING         NULL
 #define DFL_CURVES              NULL
 #define DFL_DHM_FILE            NULL
@@ -141,6 +177,10 @@ int main( void )
 #define DFL_ANTI_REPLAY         -1
 #define DFL_HS_TO_MIN           0
 #define DFL_HS_TO_MAX           0
+#define DFL_DTLS_MTU            0
+#define DFL_DGRAM_PACKING       1
+#define DFL_CID_ENABLED         0
+#define DFL_CID_VALUE           ""
 #define DFL_BADMAC_LIMIT        -1
 #define DFL_EXTENDED_MS         -1
 #define DFL_ETM                 -1
@@ -219,6 +259,14 @@ int main( void )
 #define USAGE_CACHE ""
 #endif /* MBEDTLS_SSL_CACHE_C */
 
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+#define USAGE_VERIFY_CACHE                                      \
+    "    verify_cache=%%d     default: 0 (disabled)\n"          \
+    "                        max number of cached peer chain results\n"
+#else
+#define USAGE_VERIFY_CACHE ""
+#endif /* MBEDTLS_X509_VERIFY_CACHE_C */
+
 #if defined(SNI_OPTION)
 #define USAGE_SNI                                                           \
     "    sni=%%s              name1,cert1,key1,ca1,crl1,auth1[,...]\n"  \
@@ -227,6 +275,22 @@ int main( void )
 #define USAGE_SNI ""
 #endif /* SNI_OPTION */
 
+#if defined(SNI_STORE_OPTION)
+#define USAGE_SNI_STORE                                                     \
+    "    sni_store=%%s        cert1,key1[,...] indexed by SAN/CN names\n"   \
+    "                        default: disabled (overrides sni)\n"
+#else
+#define USAGE_SNI_STORE ""
+#endif /* SNI_STORE_OPTION */
+
+#if defined(OCSP_OPTION)
+#define USAGE_OCSP                                                  \
+    "    ocsp_file=%%s        OCSP response (DER) to staple for crt_file\n" \
+    "                        default: none (no OCSP stapling)\n"
+#else
+#define USAGE_OCSP ""
+#endif /* OCSP_OPTION */
+
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
 #define USAGE_MAX_FRAG_LEN                                      \
     "    max_frag_len=%%d     default: 16384 (tls default)\n"   \
@@ -272,15 +336,61 @@ int main( void )
 #define USAGE_BADMAC_LIMIT ""
 #endif
 
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+#define USAGE_DRS \
+    "    dyn_rec_len=%%d      default: 0 (dynamic record sizing disabled)\n" \
+    "    dyn_rec_ramp=%%d     default: 1048576 (bytes before full records)\n" \
+    "    dyn_rec_idle=%%d     default: 1 (seconds before small records again)\n"
+#else
+#define USAGE_DRS ""
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+#define USAGE_HS_ARENA \
+    "    hs_arena=%%d         default: 0 (no handshake arena)\n"
+#else
+#define USAGE_HS_ARENA ""
+#endif
+
+#if defined(MBEDTLS_SSL_KTLS)
+#define USAGE_KTLS \
+    "    ktls=%%d             default: 0 (disabled)\n"      \
+    "                        options: 1 (offload records to the kernel)\n"
+#else
+#define USAGE_KTLS ""
+#endif
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+#define USAGE_SEND_FILE \
+    "    response_file=%%s    default: \"\" (send the built-in response)\n" \
+    "                        file to send with mbedtls_ssl_send_file()\n"
+#else
+#define USAGE_SEND_FILE ""
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
 #define USAGE_DTLS \
     "    dtls=%%d             default: 0 (TLS)\n"                           \
     "    hs_timeout=%%d-%%d    default: (library default: 1000-60000)\n"    \
-    "                        range of DTLS handshake timeouts in millisecs\n"
+    "                        range of DTLS handshake timeouts in millisecs\n" \
+    "    mtu=%%d              default: (library default: unlimited)\n"      \
+    "    dgram_packing=%%d    default: 1 (allowed)\n"                       \
+    "                        allow or forbid packing of records within\n"   \
+    "                        a single datagram\n"
 #else
 #define USAGE_DTLS ""
 #endif
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+#define USAGE_CID \
+    "    cid=%%d              Disable (0) or enable (1) the use of the DTLS\n" \
+    "                        Connection ID extension. default: 0\n"          \
+    "    cid_val=%%s          The connection ID we ask the peer to use, in\n"  \
+    "                        hex, without 0x. default: \"\" (empty)\n"
+#else
+#define USAGE_CID ""
+#endif
+
 #if defined(MBEDTLS_SSL_EXTENDED_MASTER_SECRET)
 #define USAGE_EMS \
     "    extended_ms=0/1     default: (library default: on)\n"
@@ -332,8 +442,14 @@ int main( void )
     "    nbio=%%d             default: 0 (blocking I/O)\n"  \
     "                        options: 1 (non-blocking), 2 (added delays)\n" \
     "    read_timeout=%%d     default: 0 ms (no timeout)\n"    \
+    "    read_ahead=%%d       default: 0 (read records one by one)\n" \
+    USAGE_DRS                                               \
+    USAGE_HS_ARENA                                          \
+    USAGE_KTLS                                              \
+    USAGE_SEND_FILE                                         \
     "\n"                                                    \
     USAGE_DTLS                                              \
+    USAGE_CID                                               \
     USAGE_COOKIES                                           \
     USAGE_ANTI_REPLAY                                       \
     USAGE_BADMAC_LIMIT                                      \
@@ -344,6 +460,8 @@ int main( void )
     "                        options: 1 (send ca list), 0 (don't send)\n" \
     USAGE_IO                                                \
     USAGE_SNI                                               \
+    USAGE_SNI_STORE                                         \
+    USAGE_OCSP                                              \
     "\n"                                                    \
     USAGE_PSK                                               \
     USAGE_ECJPAKE                                           \
@@ -354,6 +472,7 @@ int main( void )
     "\n"                                                    \
     USAGE_TICKETS                                           \
     USAGE_CACHE                                             \
+    USAGE_VERIFY_CACHE                                      \
     USAGE_MAX_FRAG_LEN                                      \
     USAGE_TRUNC_HMAC                                        \
     USAGE_ALPN                                              \
@@ -366,7 +485,8 @@ int main( void )
     "    min_version=%%s      default: (library default: tls1)\n"       \
     "    max_version=%%s      default: (library default: tls1_2)\n"     \
     "    force_version=%%s    default: \"\" (none)\n"       \
-    "                        options: ssl3, tls1, tls1_1, tls1_2, dtls1, dtls1_2\n" \
+    "                        options: ssl3, tls1, tls1_1, tls1_2, tls1_3,\n" \
+    "                                 dtls1, dtls1_2\n"                 \
     "\n"                                                                \
     "    version_suites=a,b,c,d      per-version ciphersuites\n"        \
     "                                in order from ssl3 to tls1_2\n"    \
@@ -400,6 +520,13 @@ struct options
     int debug_level;            /* level of debugging                       */
     int nbio;                   /* should I/O be blocking?                  */
     uint32_t read_timeout;      /* timeout on mbedtls_ssl_read() in milliseconds    */
+    int read_ahead;             /* read more than one record at a time?     */
+    int dyn_rec_len;            /* payload of small records (0: disabled)   */
+    int dyn_rec_ramp;           /* bytes written before full-size records   */
+    int dyn_rec_idle;           /* seconds idle before small records again  */
+    int hs_arena;               /* size of the handshake arena (0: none)    */
+    int ktls;                   /* offload the record layer to the kernel?  */
+    const char *response_file;  /* file to send instead of the response    */
     const char *ca_file;        /* the file with the CA certificate(s)      */
     const char *ca_path;        /* the path with the CA certificate(s) reside */
     const char *crt_file;       /* the file with the server certificate     */
@@ -430,7 +557,10 @@ struct options
     int ticket_timeout;         /* session ticket lifetime                  */
     int cache_max;              /* max number of session cache entries      */
     int cache_timeout;          /* expiration delay of session cache entries */
+    int verify_cache;           /* max number of verification cache entries */
     char *sni;                  /* string describing sni information        */
+    char *sni_store;            /* certificates for the SNI store           */
+    const char *ocsp_file;      /* OCSP response to staple                  */
     const char *curves;         /* list of supported elliptic curves        */
     const char *alpn_string;    /* ALPN supported protocols                 */
     const char *dhm_file;       /* the file with the DH parameters          */
@@ -441,6 +571,10 @@ struct options
     int anti_replay;            /* Use anti-replay for DTLS? -1 for default */
     uint32_t hs_to_min;         /* Initial value of DTLS handshake timer    */
     uint32_t hs_to_max;         /* Max value of DTLS handshake timer        */
+    int dtls_mtu;               /* UDP Maximum tranport unit for DTLS       */
+    int dgram_packing;          /* allow/forbid datagram packing            */
+    int cid_enabled;            /* offer/accept DTLS connection IDs?        */
+    const char *cid_val;        /* our connection ID, in hex                */
     int badmac_limit;           /* Limit of records with bad MAC            */
 } opt;
 
@@ -459,6 +593,28 @@ static void my_debug( void *ctx, int level,
     fflush(  (FILE *) ctx  );
 }
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+/*
+ * Report the memory held by a connection between handshakes
+ * (not counting the cipher and MAC contexts)
+ */
+static void print_connection_memory( const mbedtls_ssl_context *ssl )
+{
+    size_t session_len = ssl->session == NULL ? 0 :
+                         sizeof( mbedtls_ssl_session );
+
+    mbedtls_printf( "    [ Memory per connection: %u bytes "
+                    "(context %u, session %u, input buffer %u, "
+                    "output buffer %u) ]\n",
+                    (unsigned) ( sizeof( mbedtls_ssl_context ) + session_len +
+                                 ssl->in_buf_len + ssl->out_buf_len ),
+                    (unsigned) sizeof( mbedtls_ssl_context ),
+                    (unsigned) session_len,
+                    (unsigned) ssl->in_buf_len,
+                    (unsigned) ssl->out_buf_len );
+}
+#endif /* MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH */
+
 /*
  * Test recv/send functions that make sure each try returns
  * WANT_READ/WANT_WRITE at least once before sucesseding
@@ -675,6 +831,48 @@ int sni_callback( void *p_info, mbedtls_ssl_context *ssl,
 
 #endif /* SNI_OPTION */
 
+#if defined(SNI_STORE_OPTION)
+/*
+ * Parse a string of pairs crt1,key1[,...] into a new table of the store
+ *
+ * Modifies the input string! This is not production quality!
+ */
+int sni_store_load( mbedtls_ssl_sni_store *store, char *sni_string )
+{
+    int ret;
+    mbedtls_ssl_sni_table *table;
+    char *p = sni_string;
+    char *end = p;
+    char *crt_file, *key_file;
+
+    if( ( ret = mbedtls_ssl_sni_table_new( &table ) ) != 0 )
+        return( ret );
+
+    while( *end != '\0' )
+        ++end;
+    *end = ',';
+
+    while( p <= end )
+    {
+        GET_ITEM( crt_file );
+        GET_ITEM( key_file );
+
+        if( ( ret = mbedtls_ssl_sni_table_add_file( table, crt_file,
+                                                    key_file, "" ) ) != 0 )
+        {
+            mbedtls_ssl_sni_table_free( table );
+            return( ret );
+        }
+    }
+
+    return( mbedtls_ssl_sni_publish( store, table ) );
+
+error:
+    mbedtls_ssl_sni_table_free( table );
+    return( -1 );
+}
+#endif /* SNI_STORE_OPTION */
+
 #if defined(MBEDTLS_KEY_EXCHANGE__SOME__PSK_ENABLED)
 
 #define HEX2NUM( c )                    \
@@ -846,6 +1044,13 @@ int main( int argc, char *argv[] )
     unsigned char psk[MBEDTLS_PSK_MAX_LEN];
     size_t psk_len = 0;
     psk_entry *psk_info = NULL;
+#endif
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    unsigned char cid[MBEDTLS_SSL_CID_IN_LEN_MAX];
+    unsigned char peer_cid[MBEDTLS_SSL_CID_OUT_LEN_MAX];
+    size_t cid_len = 0;
+    size_t peer_cid_len = 0;
+    int cid_negotiated;
 #endif
     const char *pers = "ssl_server2";
     unsigned char client_ip[16] = { 0 };
@@ -882,12 +1087,21 @@ int main( int argc, char *argv[] )
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_context cache;
 #endif
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    mbedtls_x509_verify_cache verify_cache;
+#endif
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
     mbedtls_ssl_ticket_context ticket_ctx;
 #endif
 #if defined(SNI_OPTION)
     sni_entry *sni_info = NULL;
 #endif
+#if defined(SNI_STORE_OPTION)
+    mbedtls_ssl_sni_store sni_store;
+#endif
+#if defined(OCSP_OPTION)
+    mbedtls_ssl_ocsp_store ocsp_store;
+#endif
 #if defined(MBEDTLS_ECP_C)
     mbedtls_ecp_group_id curve_list[CURVE_LIST_SIZE];
     const mbedtls_ecp_curve_info * curve_cur;
@@ -928,6 +1142,15 @@ int main( int argc, char *argv[] )
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_init( &cache );
 #endif
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    mbedtls_x509_verify_cache_init( &verify_cache );
+#endif
+#if defined(SNI_STORE_OPTION)
+    mbedtls_ssl_sni_init( &sni_store );
+#endif
+#if defined(OCSP_OPTION)
+    mbedtls_ssl_ocsp_init( &ocsp_store );
+#endif
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
     mbedtls_ssl_ticket_init( &ticket_ctx );
 #endif
@@ -971,6 +1194,13 @@ int main( int argc, char *argv[] )
     opt.debug_level         = DFL_DEBUG_LEVEL;
     opt.nbio                = DFL_NBIO;
     opt.read_timeout        = DFL_READ_TIMEOUT;
+    opt.read_ahead          = DFL_READ_AHEAD;
+    opt.dyn_rec_len         = DFL_DYN_REC_LEN;
+    opt.dyn_rec_ramp        = DFL_DYN_REC_RAMP;
+    opt.dyn_rec_idle        = DFL_DYN_REC_IDLE;
+    opt.hs_arena            = DFL_HS_ARENA;
+    opt.ktls                = DFL_KTLS;
+    opt.response_file       = DFL_RESPONSE_FILE;
     opt.ca_file             = DFL_CA_FILE;
     opt.ca_path             = DFL_CA_PATH;
     opt.crt_file            = DFL_CRT_FILE;
@@ -1001,7 +1231,10 @@ int main( int argc, char *argv[] )
     opt.ticket_timeout      = DFL_TICKET_TIMEOUT;
     opt.cache_max           = DFL_CACHE_MAX;
     opt.cache_timeout       = DFL_CACHE_TIMEOUT;
+    opt.verify_cache        = DFL_VERIFY_CACHE;
     opt.sni                 = DFL_SNI;
+    opt.sni_store           = DFL_SNI_STORE;
+    opt.ocsp_file           = DFL_OCSP_FILE;
     opt.alpn_string         = DFL_ALPN_STRING;
     opt.curves              = DFL_CURVES;
     opt.dhm_file            = DFL_DHM_FILE;
@@ -1010,6 +1243,10 @@ int main( int argc, char *argv[] )
     opt.anti_replay         = DFL_ANTI_REPLAY;
     opt.hs_to_min           = DFL_HS_TO_MIN;
     opt.hs_to_max           = DFL_HS_TO_MAX;
+    opt.dtls_mtu            = DFL_DTLS_MTU;
+    opt.dgram_packing       = DFL_DGRAM_PACKING;
+    opt.cid_enabled         = DFL_CID_ENABLED;
+    opt.cid_val             = DFL_CID_VALUE;
     opt.badmac_limit        = DFL_BADMAC_LIMIT;
     opt.extended_ms         = DFL_EXTENDED_MS;
     opt.etm                 = DFL_ETM;
@@ -1049,6 +1286,52 @@ int main( int argc, char *argv[] )
         }
         else if( strcmp( p, "read_timeout" ) == 0 )
             opt.read_timeout = atoi( q );
+        else if( strcmp( p, "read_ahead" ) == 0 )
+        {
+            opt.read_ahead = atoi( q );
+            if( opt.read_ahead < 0 || opt.read_ahead > 1 )
+                goto usage;
+        }
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+        else if( strcmp( p, "dyn_rec_len" ) == 0 )
+        {
+            opt.dyn_rec_len = atoi( q );
+            if( opt.dyn_rec_len < 0 )
+                goto usage;
+        }
+        else if( strcmp( p, "dyn_rec_ramp" ) == 0 )
+        {
+            opt.dyn_rec_ramp = atoi( q );
+            if( opt.dyn_rec_ramp < 0 )
+                goto usage;
+        }
+        else if( strcmp( p, "dyn_rec_idle" ) == 0 )
+        {
+            opt.dyn_rec_idle = atoi( q );
+            if( opt.dyn_rec_idle < 0 )
+                goto usage;
+        }
+#endif
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+        else if( strcmp( p, "hs_arena" ) == 0 )
+        {
+            opt.hs_arena = atoi( q );
+            if( opt.hs_arena < 0 )
+                goto usage;
+        }
+#endif
+#if defined(MBEDTLS_SSL_SEND_FILE)
+        else if( strcmp( p, "response_file" ) == 0 )
+            opt.response_file = q;
+#endif
+#if defined(MBEDTLS_SSL_KTLS)
+        else if( strcmp( p, "ktls" ) == 0 )
+        {
+            opt.ktls = atoi( q );
+            if( opt.ktls < 0 || opt.ktls > 1 )
+                goto usage;
+        }
+#endif
         else if( strcmp( p, "ca_file" ) == 0 )
             opt.ca_file = q;
         else if( strcmp( p, "ca_path" ) == 0 )
@@ -1140,6 +1423,10 @@ int main( int argc, char *argv[] )
             else if( strcmp( q, "tls1_2" ) == 0 ||
                      strcmp( q, "dtls1_2" ) == 0 )
                 opt.min_version = MBEDTLS_SSL_MINOR_VERSION_3;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            else if( strcmp( q, "tls1_3" ) == 0 )
+                opt.min_version = MBEDTLS_SSL_MINOR_VERSION_4;
+#endif
             else
                 goto usage;
         }
@@ -1155,6 +1442,10 @@ int main( int argc, char *argv[] )
             else if( strcmp( q, "tls1_2" ) == 0 ||
                      strcmp( q, "dtls1_2" ) == 0 )
                 opt.max_version = MBEDTLS_SSL_MINOR_VERSION_3;
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            else if( strcmp( q, "tls1_3" ) == 0 )
+                opt.max_version = MBEDTLS_SSL_MINOR_VERSION_4;
+#endif
             else
                 goto usage;
         }
@@ -1198,6 +1489,13 @@ int main( int argc, char *argv[] )
                 opt.min_version = MBEDTLS_SSL_MINOR_VERSION_3;
                 opt.max_version = MBEDTLS_SSL_MINOR_VERSION_3;
             }
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            else if( strcmp( q, "tls1_3" ) == 0 )
+            {
+                opt.min_version = MBEDTLS_SSL_MINOR_VERSION_4;
+                opt.max_version = MBEDTLS_SSL_MINOR_VERSION_4;
+            }
+#endif
             else if( strcmp( q, "dtls1" ) == 0 )
             {
                 opt.min_version = MBEDTLS_SSL_MINOR_VERSION_2;
@@ -1292,6 +1590,12 @@ int main( int argc, char *argv[] )
             if( opt.cache_timeout < 0 )
                 goto usage;
         }
+        else if( strcmp( p, "verify_cache" ) == 0 )
+        {
+            opt.verify_cache = atoi( q );
+            if( opt.verify_cache < 0 )
+                goto usage;
+        }
         else if( strcmp( p, "cookies" ) == 0 )
         {
             opt.cookies = atoi( q );
@@ -1310,6 +1614,26 @@ int main( int argc, char *argv[] )
             if( opt.badmac_limit < 0 )
                 goto usage;
         }
+        else if( strcmp( p, "mtu" ) == 0 )
+        {
+            opt.dtls_mtu = atoi( q );
+            if( opt.dtls_mtu < 0 || opt.dtls_mtu > 65535 )
+                goto usage;
+        }
+        else if( strcmp( p, "cid" ) == 0 )
+        {
+            opt.cid_enabled = atoi( q );
+            if( opt.cid_enabled != 0 && opt.cid_enabled != 1 )
+                goto usage;
+        }
+        else if( strcmp( p, "cid_val" ) == 0 )
+            opt.cid_val = q;
+        else if( strcmp( p, "dgram_packing" ) == 0 )
+        {
+            opt.dgram_packing = atoi( q );
+            if( opt.dgram_packing != 0 && opt.dgram_packing != 1 )
+                goto usage;
+        }
         else if( strcmp( p, "hs_timeout" ) == 0 )
         {
             if( ( p = strchr( q, '-' ) ) == NULL )
@@ -1324,6 +1648,14 @@ int main( int argc, char *argv[] )
         {
             opt.sni = q;
         }
+        else if( strcmp( p, "sni_store" ) == 0 )
+        {
+            opt.sni_store = q;
+        }
+        else if( strcmp( p, "ocsp_file" ) == 0 )
+        {
+            opt.ocsp_file = q;
+        }
         else
             goto usage;
     }
@@ -1722,6 +2054,22 @@ int main( int argc, char *argv[] )
     }
 #endif /* SNI_OPTION */
 
+#if defined(SNI_STORE_OPTION)
+    if( opt.sni_store != NULL )
+    {
+        mbedtls_printf( "  . Setting up SNI store..." );
+        fflush( stdout );
+
+        if( ( ret = sni_store_load( &sni_store, opt.sni_store ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  !  sni_store_load returned -0x%x\n\n", -ret );
+            goto exit;
+        }
+
+        mbedtls_printf( " ok\n" );
+    }
+#endif /* SNI_STORE_OPTION */
+
     /*
      * 2. Setup the listening TCP socket
      */
@@ -1771,6 +2119,21 @@ int main( int argc, char *argv[] )
     if( opt.auth_mode != DFL_AUTH_MODE )
         mbedtls_ssl_conf_authmode( &conf, opt.auth_mode );
 
+    if( opt.read_ahead != DFL_READ_AHEAD )
+        mbedtls_ssl_conf_read_ahead( &conf, opt.read_ahead );
+
+#if defined(MBEDTLS_SSL_DYNAMIC_RECORD_SIZING)
+    if( opt.dyn_rec_len != DFL_DYN_REC_LEN )
+        mbedtls_ssl_conf_dynamic_record_sizing( &conf, opt.dyn_rec_len,
+                                                opt.dyn_rec_ramp,
+                                                opt.dyn_rec_idle );
+#endif
+
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    if( opt.hs_arena != DFL_HS_ARENA )
+        mbedtls_ssl_conf_handshake_arena( &conf, opt.hs_arena );
+#endif
+
     if( opt.cert_req_ca_list != DFL_CERT_REQ_CA_LIST )
         mbedtls_ssl_conf_cert_req_ca_list( &conf, opt.cert_req_ca_list );
 
@@ -1779,6 +2142,39 @@ int main( int argc, char *argv[] )
         mbedtls_ssl_conf_handshake_timeout( &conf, opt.hs_to_min, opt.hs_to_max );
 #endif /* MBEDTLS_SSL_PROTO_DTLS */
 
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
+    {
+        size_t n;
+        unsigned int byte;
+
+        cid_len = strlen( opt.cid_val ) / 2;
+
+        if( strlen( opt.cid_val ) % 2 != 0 || cid_len > sizeof( cid ) )
+        {
+            mbedtls_printf( " failed\n  ! Invalid connection ID\n\n" );
+            goto exit;
+        }
+
+        for( n = 0; n < cid_len; n++ )
+        {
+            if( sscanf( opt.cid_val + 2 * n, "%2x", &byte ) != 1 )
+            {
+                mbedtls_printf( " failed\n  ! Invalid connection ID\n\n" );
+                goto exit;
+            }
+            cid[n] = (unsigned char) byte;
+        }
+
+        if( ( ret = mbedtls_ssl_conf_cid( &conf, cid_len ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_conf_cid returned -0x%x\n\n",
+                            -ret );
+            goto exit;
+        }
+    }
+#endif /* MBEDTLS_SSL_DTLS_CONNECTION_ID */
+
 #if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
     if( ( ret = mbedtls_ssl_conf_max_frag_len( &conf, opt.mfl_code ) ) != 0 )
     {
@@ -1826,6 +2222,15 @@ int main( int argc, char *argv[] )
                                    mbedtls_ssl_cache_set );
 #endif
 
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    if( opt.verify_cache != 0 )
+    {
+        mbedtls_x509_verify_cache_set_max_entries( &verify_cache,
+                                                   opt.verify_cache );
+        mbedtls_ssl_conf_verify_cache( &conf, &verify_cache );
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
     if( opt.tickets == MBEDTLS_SSL_SESSION_TICKETS_ENABLED )
     {
@@ -1845,6 +2250,21 @@ int main( int argc, char *argv[] )
     }
 #endif
 
+#if defined(OCSP_OPTION)
+    if( opt.ocsp_file != NULL )
+    {
+        if( ( ret = mbedtls_ssl_ocsp_load_file( &ocsp_store, &srvcert,
+                                                &cacert, opt.ocsp_file ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_ocsp_load_file returned -0x%x\n\n", -ret );
+            goto exit;
+        }
+
+        mbedtls_ssl_conf_ocsp_stapling_cb( &conf, mbedtls_ssl_ocsp_get,
+                                           &ocsp_store );
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_PROTO_DTLS)
     if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM )
     {
@@ -1950,6 +2370,11 @@ int main( int argc, char *argv[] )
         mbedtls_ssl_conf_sni( &conf, sni_callback, sni_info );
 #endif
 
+#if defined(SNI_STORE_OPTION)
+    if( opt.sni_store != NULL )
+        mbedtls_ssl_conf_sni( &conf, mbedtls_ssl_sni_get, &sni_store );
+#endif
+
 #if defined(MBEDTLS_ECP_C)
     if( opt.curves != NULL &&
         strcmp( opt.curves, "default" ) != 0 )
@@ -2013,6 +2438,25 @@ int main( int argc, char *argv[] )
                                             mbedtls_timing_get_delay );
 #endif
 
+#if defined(MBEDTLS_SSL_PROTO_DTLS)
+    if( opt.dtls_mtu != DFL_DTLS_MTU )
+        mbedtls_ssl_set_mtu( &ssl, opt.dtls_mtu );
+
+    if( opt.dgram_packing != DFL_DGRAM_PACKING )
+        mbedtls_ssl_set_datagram_packing( &ssl, opt.dgram_packing );
+#endif
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        ( ret = mbedtls_ssl_set_cid( &ssl, opt.cid_enabled, cid,
+                                     cid_len ) ) != 0 )
+    {
+        mbedtls_printf( " failed\n  ! mbedtls_ssl_set_cid returned -0x%x\n\n",
+                        -ret );
+        goto exit;
+    }
+#endif
+
     mbedtls_printf( " ok\n" );
 
 reset:
@@ -2161,6 +2605,61 @@ handshake:
                     (unsigned int) mbedtls_ssl_get_max_frag_len( &ssl ) );
 #endif
 
+#if defined(MBEDTLS_SSL_HANDSHAKE_ARENA)
+    mbedtls_printf( "    [ Handshake arena peak is %u bytes ]\n",
+                    (unsigned int) mbedtls_ssl_get_handshake_arena_peak( &ssl ) );
+#endif
+
+#if defined(MBEDTLS_SSL_DTLS_CONNECTION_ID)
+    if( opt.transport == MBEDTLS_SSL_TRANSPORT_DATAGRAM &&
+        opt.cid_enabled == 1 )
+    {
+        if( ( ret = mbedtls_ssl_get_peer_cid( &ssl, &cid_negotiated,
+                                              peer_cid, &peer_cid_len ) ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! mbedtls_ssl_get_peer_cid returned -0x%x\n\n",
+                            -ret );
+            goto exit;
+        }
+
+        if( cid_negotiated == MBEDTLS_SSL_CID_DISABLED )
+            mbedtls_printf( "    [ Connection ID not in use ]\n" );
+        else
+        {
+            size_t n;
+
+            mbedtls_printf( "    [ Connection ID in use, client CID (%u bytes):",
+                            (unsigned int) peer_cid_len );
+            for( n = 0; n < peer_cid_len; n++ )
+                mbedtls_printf( " %02x", peer_cid[n] );
+            mbedtls_printf( " ]\n" );
+        }
+    }
+#endif
+
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    print_connection_memory( &ssl );
+#endif
+
+#if defined(MBEDTLS_SSL_KTLS)
+    if( opt.ktls != 0 )
+    {
+        mbedtls_printf( "  . Offloading the record layer to the kernel..." );
+        fflush( stdout );
+
+        ret = mbedtls_net_ktls_offload( &client_fd, &ssl );
+        if( ret == MBEDTLS_ERR_NET_KTLS_UNAVAILABLE )
+            mbedtls_printf( " unavailable, using the user-space record layer\n" );
+        else if( ret < 0 )
+            mbedtls_printf( " failed\n  ! mbedtls_net_ktls_offload returned -0x%x\n", -ret );
+        else
+            mbedtls_printf( " ok\n    [ kTLS offload: %s ]\n",
+                            ( ret & MBEDTLS_SSL_KTLS_RX ) ? "tx, rx" : "tx" );
+
+        ret = 0;
+    }
+#endif
+
 #if defined(MBEDTLS_SSL_ALPN)
     if( opt.alpn_string != NULL )
     {
@@ -2189,6 +2688,12 @@ handshake:
     else
         mbedtls_printf( " ok\n" );
 
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    if( opt.verify_cache != 0 )
+        mbedtls_printf( "  . Verification cache: %lu hits, %lu misses\n",
+                        verify_cache.hits, verify_cache.misses );
+#endif
+
     if( mbedtls_ssl_get_peer_cert( &ssl ) != NULL )
     {
         char crt_buf[512];
@@ -2368,6 +2873,41 @@ data_exchange:
     mbedtls_printf( "  > Write to client:" );
     fflush( stdout );
 
+#if defined(MBEDTLS_SSL_SEND_FILE)
+    if( opt.response_file[0] != '\0' )
+    {
+        int file_fd;
+        struct stat st;
+
+        if( ( file_fd = open( opt.response_file, O_RDONLY ) ) < 0 ||
+            fstat( file_fd, &st ) != 0 )
+        {
+            mbedtls_printf( " failed\n  ! cannot open %s\n\n", opt.response_file );
+            if( file_fd >= 0 )
+                close( file_fd );
+            goto reset;
+        }
+
+        while( ( ret = mbedtls_ssl_send_file( &ssl, file_fd, 0,
+                                              (size_t) st.st_size ) ) != 0 )
+        {
+            if( ret != MBEDTLS_ERR_SSL_WANT_READ &&
+                ret != MBEDTLS_ERR_SSL_WANT_WRITE )
+            {
+                mbedtls_printf( " failed\n  ! mbedtls_ssl_send_file returned -0x%x\n\n", -ret );
+                close( file_fd );
+                goto reset;
+            }
+        }
+
+        close( file_fd );
+
+        mbedtls_printf( " %u bytes written from %s\n\n",
+                        (unsigned int) st.st_size, opt.response_file );
+        goto data_sent;
+    }
+#endif /* MBEDTLS_SSL_SEND_FILE */
+
     len = sprintf( (char *) buf, HTTP_RESPONSE,
                    mbedtls_ssl_get_ciphersuite( &ssl ) );
 
@@ -2411,8 +2951,18 @@ data_exchange:
 
     buf[written] = '\0';
     mbedtls_printf( " %d bytes written in %d fragments\n\n%s\n", written, frags, (char *) buf );
+
+#if defined(MBEDTLS_SSL_SEND_FILE)
+data_sent:
+#endif
     ret = 0;
 
+#if defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH)
+    /* Waiting for the next request: release large buffers */
+    if( mbedtls_ssl_shrink_buffers( &ssl ) == 0 )
+        print_connection_memory( &ssl );
+#endif
+
     /*
      * 7b. Continue doing data exchanges?
      */
@@ -2466,6 +3016,12 @@ exit:
 #if defined(SNI_OPTION)
     sni_free( sni_info );
 #endif
+#if defined(SNI_STORE_OPTION)
+    mbedtls_ssl_sni_free( &sni_store );
+#endif
+#if defined(OCSP_OPTION)
+    mbedtls_ssl_ocsp_free( &ocsp_store );
+#endif
 #if defined(MBEDTLS_KEY_EXCHANGE__SOME__PSK_ENABLED)
     psk_free( psk_info );
 #endif
@@ -2481,6 +3037,9 @@ exit:
 #if defined(MBEDTLS_SSL_CACHE_C)
     mbedtls_ssl_cache_free( &cache );
 #endif
+#if defined(MBEDTLS_X509_VERIFY_CACHE_C)
+    mbedtls_x509_verify_cache_free( &verify_cache );
+#endif
 #if defined(MBEDTLS_SSL_SESSION_TICKETS)
     mbedtls_ssl_ticket_free( &ticket_ctx );
 #endif
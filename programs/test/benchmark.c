@@ -55,6 +55,8 @@ int main( void )
 #include "mbedtls/sha256.h"
 #include "mbedtls/sha512.h"
 #include "mbedtls/arc4.h"
+#include "mbedtls/base64.h"
+#include "mbedtls/pem.h"
 #include "mbedtls/des.h"
 #include "mbedtls/aes.h"
 #include "mbedtls/blowfish.h"
@@ -69,6 +71,9 @@ int main( void )
 #include "mbedtls/dhm.h"
 #include "mbedtls/ecdsa.h"
 #include "mbedtls/ecdh.h"
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_ticket.h"
+#include "mbedtls/certs.h"
 #include "mbedtls/error.h"
 
 #if defined(MBEDTLS_MEMORY_BUFFER_ALLOC_C)
@@ -95,8 +100,8 @@ int main( void )
     "md4, md5, ripemd160, sha1, sha256, sha512,\n"                      \
     "arc4, des3, des, camellia, blowfish,\n"                            \
     "aes_cbc, aes_gcm, aes_ccm, aes_cmac, des3_cmac,\n"                 \
-    "havege, ctr_drbg, hmac_drbg\n"                                     \
-    "rsa, dhm, ecdsa, ecdh.\n"
+    "havege, ctr_drbg, hmac_drbg, base64, pem,\n"                       \
+    "rsa, dhm, ecdsa, ecdh, tls_aead, tls_handshake.\n"
 
 #if defined(MBEDTLS_ERROR_C)
 #define PRINT_ERROR                                                     \
@@ -225,13 +230,324 @@ void ecp_clear_precomputed( mbedtls_ecp_group *grp )
 
 unsigned char buf[BUFSIZE];
 
+/*
+ * TLS: a client and a server talk to each other over memory, so that the time
+ * measured is the one of the library
+ */
+#if defined(MBEDTLS_SSL_CLI_C) && defined(MBEDTLS_SSL_SRV_C) &&               \
+    !defined(MBEDTLS_MEMORY_BUFFER_ALLOC_C)
+#define BENCH_TLS
+
+typedef struct
+{
+    unsigned char data[4096];
+    size_t len;
+} bench_pipe;
+
+typedef struct
+{
+    bench_pipe *in;
+    bench_pipe *out;
+} bench_end;
+
+static int bench_send( void *ctx, const unsigned char *data, size_t len )
+{
+    bench_pipe *pipe = ( (bench_end *) ctx )->out;
+
+    if( len > sizeof( pipe->data ) - pipe->len )
+        len = sizeof( pipe->data ) - pipe->len;
+
+    if( len == 0 )
+        return( MBEDTLS_ERR_SSL_WANT_WRITE );
+
+    memcpy( pipe->data + pipe->len, data, len );
+    pipe->len += len;
+
+    return( (int) len );
+}
+
+static int bench_recv( void *ctx, unsigned char *data, size_t len )
+{
+    bench_pipe *pipe = ( (bench_end *) ctx )->in;
+
+    if( pipe->len == 0 )
+        return( MBEDTLS_ERR_SSL_WANT_READ );
+
+    if( len > pipe->len )
+        len = pipe->len;
+
+    memcpy( data, pipe->data, len );
+    memmove( pipe->data, pipe->data + len, pipe->len - len );
+    pipe->len -= len;
+
+    return( (int) len );
+}
+
+/*
+ * Run both ends of a handshake in turns. Each flight of the server that the
+ * client has to wait for before it's done is one round trip.
+ */
+static int bench_tls_handshake( mbedtls_ssl_context *cli, mbedtls_ssl_context *srv,
+                                const bench_pipe *s2c, int *rtts )
+{
+    int ret, i;
+
+    if( rtts != NULL )
+        *rtts = 0;
+
+    for( i = 0; i < 100; i++ )
+    {
+        if( cli->state != MBEDTLS_SSL_HANDSHAKE_OVER )
+        {
+            if( rtts != NULL && s2c->len != 0 )
+                (*rtts)++;
+
+            if( ( ret = mbedtls_ssl_handshake( cli ) ) != 0 &&
+                ret != MBEDTLS_ERR_SSL_WANT_READ &&
+                ret != MBEDTLS_ERR_SSL_WANT_WRITE )
+            {
+                return( ret );
+            }
+        }
+
+        if( srv->state != MBEDTLS_SSL_HANDSHAKE_OVER &&
+            ( ret = mbedtls_ssl_handshake( srv ) ) != 0 &&
+            ret != MBEDTLS_ERR_SSL_WANT_READ &&
+            ret != MBEDTLS_ERR_SSL_WANT_WRITE )
+        {
+            return( ret );
+        }
+
+        if( cli->state == MBEDTLS_SSL_HANDSHAKE_OVER &&
+            srv->state == MBEDTLS_SSL_HANDSHAKE_OVER )
+        {
+            return( 0 );
+        }
+    }
+
+    return( MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+}
+#endif /* MBEDTLS_SSL_CLI_C && MBEDTLS_SSL_SRV_C */
+
+/*
+ * TLS records: the record layer of an established connection
+ */
+#if defined(BENCH_TLS) && defined(MBEDTLS_KEY_EXCHANGE_PSK_ENABLED) &&        \
+    ( defined(MBEDTLS_GCM_C) || defined(MBEDTLS_CCM_C) )
+#define BENCH_TLS_AEAD
+
+static int bench_tls_setup( mbedtls_ssl_context *cli, mbedtls_ssl_config *cli_conf,
+                            mbedtls_ssl_context *srv, mbedtls_ssl_config *srv_conf,
+                            bench_end *cli_end, bench_end *srv_end,
+                            const int *ciphersuites )
+{
+    int ret;
+    const unsigned char psk[16] = { 0 };
+
+    if( ( ret = mbedtls_ssl_config_defaults( cli_conf, MBEDTLS_SSL_IS_CLIENT,
+                                     MBEDTLS_SSL_TRANSPORT_STREAM,
+                                     MBEDTLS_SSL_PRESET_DEFAULT ) ) != 0 ||
+        ( ret = mbedtls_ssl_config_defaults( srv_conf, MBEDTLS_SSL_IS_SERVER,
+                                     MBEDTLS_SSL_TRANSPORT_STREAM,
+                                     MBEDTLS_SSL_PRESET_DEFAULT ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    mbedtls_ssl_conf_rng( cli_conf, myrand, NULL );
+    mbedtls_ssl_conf_rng( srv_conf, myrand, NULL );
+    mbedtls_ssl_conf_ciphersuites( cli_conf, ciphersuites );
+    mbedtls_ssl_conf_ciphersuites( srv_conf, ciphersuites );
+
+    if( ( ret = mbedtls_ssl_conf_psk( cli_conf, psk, sizeof( psk ),
+                              (const unsigned char *) "bench", 5 ) ) != 0 ||
+        ( ret = mbedtls_ssl_conf_psk( srv_conf, psk, sizeof( psk ),
+                              (const unsigned char *) "bench", 5 ) ) != 0 ||
+        ( ret = mbedtls_ssl_setup( cli, cli_conf ) ) != 0 ||
+        ( ret = mbedtls_ssl_setup( srv, srv_conf ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    mbedtls_ssl_set_bio( cli, cli_end, bench_send, bench_recv, NULL );
+    mbedtls_ssl_set_bio( srv, srv_end, bench_send, bench_recv, NULL );
+
+    return( bench_tls_handshake( cli, srv, cli_end->in, NULL ) );
+}
+
+/*
+ * One record from the client to the server
+ */
+static int bench_tls_record( mbedtls_ssl_context *cli, mbedtls_ssl_context *srv,
+                             size_t len )
+{
+    int ret;
+
+    if( ( ret = mbedtls_ssl_write( cli, buf, len ) ) < 0 )
+        return( ret );
+
+    if( ( ret = mbedtls_ssl_read( srv, buf, len ) ) < 0 )
+        return( ret );
+
+    return( 0 );
+}
+#endif /* BENCH_TLS && PSK && AEAD */
+
+/*
+ * TLS handshakes: full ECDHE-ECDSA ones, and resumed ones with a ticket
+ */
+#if defined(BENCH_TLS) && defined(MBEDTLS_KEY_EXCHANGE_ECDHE_ECDSA_ENABLED) && \
+    defined(MBEDTLS_CERTS_C) && defined(MBEDTLS_SSL_TICKET_C) &&              \
+    defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SHA256_C) &&      \
+    defined(MBEDTLS_GCM_C)
+#define BENCH_TLS_HANDSHAKE
+
+typedef struct
+{
+    mbedtls_ssl_config cli_conf, srv_conf;
+    mbedtls_ssl_context cli, srv;
+    mbedtls_x509_crt ca, crt;
+    mbedtls_pk_context key;
+    mbedtls_ssl_ticket_context ticket;
+    mbedtls_ssl_session session;
+    bench_pipe c2s, s2c;
+    bench_end cli_end, srv_end;
+    int resume;
+    int rtts;
+}
+bench_hs;
+
+static void bench_hs_init( bench_hs *hs )
+{
+    memset( hs, 0, sizeof( bench_hs ) );
+    mbedtls_ssl_config_init( &hs->cli_conf );
+    mbedtls_ssl_config_init( &hs->srv_conf );
+    mbedtls_ssl_init( &hs->cli );
+    mbedtls_ssl_init( &hs->srv );
+    mbedtls_x509_crt_init( &hs->ca );
+    mbedtls_x509_crt_init( &hs->crt );
+    mbedtls_pk_init( &hs->key );
+    mbedtls_ssl_ticket_init( &hs->ticket );
+    mbedtls_ssl_session_init( &hs->session );
+    hs->cli_end.in = &hs->s2c;
+    hs->cli_end.out = &hs->c2s;
+    hs->srv_end.in = &hs->c2s;
+    hs->srv_end.out = &hs->s2c;
+}
+
+static void bench_hs_free( bench_hs *hs )
+{
+    mbedtls_ssl_free( &hs->cli );
+    mbedtls_ssl_free( &hs->srv );
+    mbedtls_ssl_config_free( &hs->cli_conf );
+    mbedtls_ssl_config_free( &hs->srv_conf );
+    mbedtls_x509_crt_free( &hs->ca );
+    mbedtls_x509_crt_free( &hs->crt );
+    mbedtls_pk_free( &hs->key );
+    mbedtls_ssl_ticket_free( &hs->ticket );
+    mbedtls_ssl_session_free( &hs->session );
+}
+
+/*
+ * One handshake on fresh connections, possibly resuming the saved session
+ */
+static int bench_hs_run( bench_hs *hs )
+{
+    int ret;
+
+    hs->c2s.len = hs->s2c.len = 0;
+
+    if( ( ret = mbedtls_ssl_session_reset( &hs->cli ) ) != 0 ||
+        ( ret = mbedtls_ssl_session_reset( &hs->srv ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    if( hs->resume &&
+        ( ret = mbedtls_ssl_set_session( &hs->cli, &hs->session ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    return( bench_tls_handshake( &hs->cli, &hs->srv, &hs->s2c, &hs->rtts ) );
+}
+
+static int bench_hs_setup( bench_hs *hs, int minor, int resume )
+{
+    int ret;
+
+    if( ( ret = mbedtls_ssl_config_defaults( &hs->cli_conf, MBEDTLS_SSL_IS_CLIENT,
+                                     MBEDTLS_SSL_TRANSPORT_STREAM,
+                                     MBEDTLS_SSL_PRESET_DEFAULT ) ) != 0 ||
+        ( ret = mbedtls_ssl_config_defaults( &hs->srv_conf, MBEDTLS_SSL_IS_SERVER,
+                                     MBEDTLS_SSL_TRANSPORT_STREAM,
+                                     MBEDTLS_SSL_PRESET_DEFAULT ) ) != 0 ||
+        ( ret = mbedtls_x509_crt_parse( &hs->ca,
+                    (const unsigned char *) mbedtls_test_ca_crt_ec,
+                    mbedtls_test_ca_crt_ec_len ) ) != 0 ||
+        ( ret = mbedtls_x509_crt_parse( &hs->crt,
+                    (const unsigned char *) mbedtls_test_srv_crt_ec,
+                    mbedtls_test_srv_crt_ec_len ) ) != 0 ||
+        ( ret = mbedtls_pk_parse_key( &hs->key,
+                    (const unsigned char *) mbedtls_test_srv_key_ec,
+                    mbedtls_test_srv_key_ec_len, NULL, 0 ) ) != 0 ||
+        ( ret = mbedtls_ssl_ticket_setup( &hs->ticket, myrand, NULL,
+                    MBEDTLS_CIPHER_AES_256_GCM, 86400 ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    mbedtls_ssl_conf_rng( &hs->cli_conf, myrand, NULL );
+    mbedtls_ssl_conf_rng( &hs->srv_conf, myrand, NULL );
+
+    /* Verify the chain as a real client would; the test certificates'
+     * validity period doesn't matter here */
+    mbedtls_ssl_conf_authmode( &hs->cli_conf, MBEDTLS_SSL_VERIFY_OPTIONAL );
+    mbedtls_ssl_conf_ca_chain( &hs->cli_conf, &hs->ca, NULL );
+
+    mbedtls_ssl_conf_max_version( &hs->cli_conf, MBEDTLS_SSL_MAJOR_VERSION_3, minor );
+    mbedtls_ssl_conf_max_version( &hs->srv_conf, MBEDTLS_SSL_MAJOR_VERSION_3, minor );
+    mbedtls_ssl_conf_min_version( &hs->cli_conf, MBEDTLS_SSL_MAJOR_VERSION_3, minor );
+
+    mbedtls_ssl_conf_session_tickets( &hs->cli_conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED );
+    mbedtls_ssl_conf_session_tickets_cb( &hs->srv_conf, mbedtls_ssl_ticket_write,
+                                         mbedtls_ssl_ticket_parse, &hs->ticket );
+
+    if( ( ret = mbedtls_ssl_conf_own_cert( &hs->srv_conf, &hs->crt, &hs->key ) ) != 0 ||
+        ( ret = mbedtls_ssl_setup( &hs->cli, &hs->cli_conf ) ) != 0 ||
+        ( ret = mbedtls_ssl_setup( &hs->srv, &hs->srv_conf ) ) != 0 )
+    {
+        return( ret );
+    }
+
+    mbedtls_ssl_set_bio( &hs->cli, &hs->cli_end, bench_send, bench_recv, NULL );
+    mbedtls_ssl_set_bio( &hs->srv, &hs->srv_end, bench_send, bench_recv, NULL );
+
+    /* A first full handshake, for its ticket */
+    if( ( ret = bench_hs_run( hs ) ) != 0 )
+        return( ret );
+
+    /* With TLS 1.3, the ticket follows the handshake */
+    ret = mbedtls_ssl_read( &hs->cli, buf, 1 );
+    if( ret != MBEDTLS_ERR_SSL_WANT_READ )
+        return( ret < 0 ? ret : MBEDTLS_ERR_SSL_INTERNAL_ERROR );
+
+    if( ( ret = mbedtls_ssl_get_session( &hs->cli, &hs->session ) ) != 0 )
+        return( ret );
+
+    hs->resume = resume;
+
+    return( bench_hs_run( hs ) );
+}
+#endif /* BENCH_TLS && ECDHE_ECDSA && CERTS_C && TICKETS */
+
 typedef struct {
     char md4, md5, ripemd160, sha1, sha256, sha512,
          arc4, des3, des,
          aes_cbc, aes_gcm, aes_ccm, aes_cmac, des3_cmac,
          camellia, blowfish,
-         havege, ctr_drbg, hmac_drbg,
-         rsa, dhm, ecdsa, ecdh;
+         havege, ctr_drbg, hmac_drbg, base64, pem,
+         rsa, dhm, ecdsa, ecdh, tls_aead, tls_handshake;
 } todo_list;
 
 int main( int argc, char *argv[] )
@@ -292,6 +608,10 @@ int main( int argc, char *argv[] )
                 todo.ctr_drbg = 1;
             else if( strcmp( argv[i], "hmac_drbg" ) == 0 )
                 todo.hmac_drbg = 1;
+            else if( strcmp( argv[i], "base64" ) == 0 )
+                todo.base64 = 1;
+            else if( strcmp( argv[i], "pem" ) == 0 )
+                todo.pem = 1;
             else if( strcmp( argv[i], "rsa" ) == 0 )
                 todo.rsa = 1;
             else if( strcmp( argv[i], "dhm" ) == 0 )
@@ -300,6 +620,10 @@ int main( int argc, char *argv[] )
                 todo.ecdsa = 1;
             else if( strcmp( argv[i], "ecdh" ) == 0 )
                 todo.ecdh = 1;
+            else if( strcmp( argv[i], "tls_aead" ) == 0 )
+                todo.tls_aead = 1;
+            else if( strcmp( argv[i], "tls_handshake" ) == 0 )
+                todo.tls_handshake = 1;
             else
             {
                 mbedtls_printf( "Unrecognized option: %s\n", argv[i] );
@@ -629,6 +953,54 @@ int main( int argc, char *argv[] )
     }
 #endif
 
+#if defined(MBEDTLS_BASE64_C)
+    if( todo.base64 )
+    {
+        unsigned char b64[BUFSIZE * 2], lines[BUFSIZE * 2], dec[BUFSIZE * 2];
+        size_t olen, lines_len, j;
+
+        TIME_AND_TSC( "Base64 encode",
+                mbedtls_base64_encode( b64, sizeof( b64 ), &olen, buf, BUFSIZE ) );
+
+        /* Decode it back in 64-character lines, as found in PEM files */
+        for( j = lines_len = 0; j < olen; j++ )
+        {
+            lines[lines_len++] = b64[j];
+            if( j % 64 == 63 )
+                lines[lines_len++] = '\n';
+        }
+
+        TIME_AND_TSC( "Base64 decode (2 passes)",
+                mbedtls_base64_decode( dec, BUFSIZE, &olen, lines, lines_len ) );
+        TIME_AND_TSC( "Base64 decode (1 pass)",
+                mbedtls_base64_decode( dec, sizeof( dec ), &olen, lines, lines_len ) );
+    }
+#endif
+
+#if defined(MBEDTLS_PEM_PARSE_C) && defined(MBEDTLS_CERTS_C)
+    if( todo.pem )
+    {
+        mbedtls_pem_context pem;
+        const unsigned char *p;
+        size_t use_len;
+
+        TIME_PUBLIC( "PEM read CA bundle", "bundle",
+            p = (const unsigned char *) mbedtls_test_cas_pem;
+            do
+            {
+                mbedtls_pem_init( &pem );
+                ret = mbedtls_pem_read_buffer( &pem, "-----BEGIN CERTIFICATE-----",
+                                               "-----END CERTIFICATE-----",
+                                               p, NULL, 0, &use_len );
+                mbedtls_pem_free( &pem );
+                p += use_len;
+            }
+            while( ret == 0 );
+            if( ret == MBEDTLS_ERR_PEM_NO_HEADER_FOOTER_PRESENT )
+                ret = 0 );
+    }
+#endif
+
 #if defined(MBEDTLS_RSA_C) && defined(MBEDTLS_GENPRIME)
     if( todo.rsa )
     {
@@ -866,6 +1238,112 @@ int main( int argc, char *argv[] )
     }
 #endif
 
+#if defined(BENCH_TLS_AEAD)
+    if( todo.tls_aead )
+    {
+        static const struct
+        {
+            const char *name;
+            const char *ciphersuite;
+        } suites[] =
+        {
+            { "AES-128-GCM",    "TLS-PSK-WITH-AES-128-GCM-SHA256" },
+            { "AES-128-CCM",    "TLS-PSK-WITH-AES-128-CCM"        },
+            { "AES-128-CCM-8",  "TLS-PSK-WITH-AES-128-CCM-8"      },
+        };
+        static const size_t lens[] = { 64, BUFSIZE };
+        static bench_pipe c2s, s2c;
+        bench_end cli_end = { &s2c, &c2s }, srv_end = { &c2s, &s2c };
+        mbedtls_ssl_context cli, srv;
+        mbedtls_ssl_config cli_conf, srv_conf;
+        int ciphersuites[2] = { 0, 0 };
+        size_t j, k;
+        int err;
+
+        for( j = 0; j < sizeof( suites ) / sizeof( suites[0] ); j++ )
+        {
+            ciphersuites[0] = mbedtls_ssl_get_ciphersuite_id( suites[j].ciphersuite );
+            if( ciphersuites[0] == 0 )
+                continue;
+
+            mbedtls_ssl_init( &cli );
+            mbedtls_ssl_init( &srv );
+            mbedtls_ssl_config_init( &cli_conf );
+            mbedtls_ssl_config_init( &srv_conf );
+            c2s.len = s2c.len = 0;
+
+            err = bench_tls_setup( &cli, &cli_conf, &srv, &srv_conf,
+                                   &cli_end, &srv_end, ciphersuites );
+
+            for( k = 0; k < sizeof( lens ) / sizeof( lens[0] ); k++ )
+            {
+                mbedtls_snprintf( title, sizeof( title ), "TLS-%s-%u",
+                                  suites[j].name, (unsigned) lens[k] );
+
+                if( err != 0 )
+                {
+                    mbedtls_printf( HEADER_FORMAT "FAILED: -0x%04x\n", title, -err );
+                    continue;
+                }
+
+                TIME_PUBLIC( title, "record",
+                        ret = bench_tls_record( &cli, &srv, lens[k] ) );
+            }
+
+            mbedtls_ssl_free( &cli );
+            mbedtls_ssl_free( &srv );
+            mbedtls_ssl_config_free( &cli_conf );
+            mbedtls_ssl_config_free( &srv_conf );
+        }
+    }
+#endif /* BENCH_TLS_AEAD */
+
+#if defined(BENCH_TLS_HANDSHAKE)
+    if( todo.tls_handshake )
+    {
+        static const struct
+        {
+            const char *name;
+            int minor;
+            int resume;
+        } flows[] =
+        {
+            { "TLS 1.2 full",           MBEDTLS_SSL_MINOR_VERSION_3, 0 },
+            { "TLS 1.2 resumed",        MBEDTLS_SSL_MINOR_VERSION_3, 1 },
+#if defined(MBEDTLS_SSL_PROTO_TLS1_3)
+            { "TLS 1.3 full",           MBEDTLS_SSL_MINOR_VERSION_4, 0 },
+            { "TLS 1.3 resumed",        MBEDTLS_SSL_MINOR_VERSION_4, 1 },
+#endif
+        };
+        static bench_hs hs;
+        size_t j;
+        int err;
+
+        for( j = 0; j < sizeof( flows ) / sizeof( flows[0] ); j++ )
+        {
+            bench_hs_init( &hs );
+
+            err = bench_hs_setup( &hs, flows[j].minor, flows[j].resume );
+
+            if( err != 0 )
+            {
+                mbedtls_printf( HEADER_FORMAT "FAILED: -0x%04x\n",
+                                flows[j].name, -err );
+                bench_hs_free( &hs );
+                continue;
+            }
+
+            mbedtls_snprintf( title, sizeof( title ), "%s, %d-RTT",
+                              flows[j].name, hs.rtts );
+
+            TIME_PUBLIC( title, "handshake",
+                    ret = bench_hs_run( &hs ) );
+
+            bench_hs_free( &hs );
+        }
+    }
+#endif /* BENCH_TLS_HANDSHAKE */
+
     mbedtls_printf( "\n" );
 
 #if defined(MBEDTLS_MEMORY_BUFFER_ALLOC_C)
@@ -103,7 +103,8 @@ int main( void )
     "                        drop about 1:N packets randomly\n"             \
     "    mtu=%%d              default: 0 (unlimited)\n"                     \
     "                        drop packets larger than N bytes\n"            \
-    "    bad_ad=0/1          default: 0 (don't add bad ApplicationData)\n"  \
+    "    bad_ad=0/1/2        default: 0 (don't add bad ApplicationData)\n"  \
+    "                        1: corrupted, 2: truncated by one byte\n"     \
     "    protect_hvr=0/1     default: 0 (don't protect HelloVerifyRequest)\n" \
     "    protect_len=%%d     default: (don't protect packets of this size)\n" \
     "\n"                                                                    \
@@ -125,7 +126,8 @@ static struct options
     int delay_ccs;              /* delay ChangeCipherSpec                   */
     int drop;                   /* drop 1 packet in N (none if 0)           */
     int mtu;                    /* drop packets larger than this            */
-    int bad_ad;                 /* inject corrupted ApplicationData record  */
+    int bad_ad;                 /* inject corrupted (1) or truncated (2)
+                                 * ApplicationData record                   */
     int protect_hvr;            /* never drop or delay HelloVerifyRequest   */
     int protect_len;            /* never drop/delay packet of the given size*/
 
@@ -202,7 +204,7 @@ static void get_options( int argc, char *argv[] )
         else if( strcmp( p, "bad_ad" ) == 0 )
         {
             opt.bad_ad = atoi( q );
-            if( opt.bad_ad < 0 || opt.bad_ad > 1 )
+            if( opt.bad_ad < 0 || opt.bad_ad > 2 )
                 exit_usage( p, q );
         }
         else if( strcmp( p, "protect_hvr" ) == 0 )
@@ -314,16 +316,34 @@ int send_packet( const packet *p, const char *why )
     int ret;
     mbedtls_net_context *dst = p->dst;
 
-    /* insert corrupted ApplicationData record? */
+    /* insert corrupted or truncated ApplicationData record? */
     if( opt.bad_ad &&
         strcmp( p->type, "ApplicationData" ) == 0 )
     {
         unsigned char buf[MAX_MSG_SIZE];
+        unsigned len = p->len;
         memcpy( buf, p->buf, p->len );
-        ++buf[p->len - 1];
 
-        print_packet( p, "corrupted" );
-        if( ( ret = mbedtls_net_send( dst, buf, p->len ) ) <= 0 )
+        if( opt.bad_ad == 2 && len > 14 )
+        {
+            /* Drop the last byte of the (single) record in the datagram */
+            unsigned rec_len = ( buf[11] << 8 ) | buf[12];
+
+            --len;
+            --rec_len;
+            buf[11] = (unsigned char)( rec_len >> 8 );
+            buf[12] = (unsigned char)( rec_len      );
+
+            print_packet( p, "truncated" );
+        }
+        else
+        {
+            ++buf[len - 1];
+
+            print_packet( p, "corrupted" );
+        }
+
+        if( ( ret = mbedtls_net_send( dst, buf, len ) ) <= 0 )
         {
             mbedtls_printf( "  ! mbedtls_net_send returned %d\n", ret );
             return( ret );
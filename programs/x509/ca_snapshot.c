@@ -0,0 +1,263 @@
+/*
+ *  Trusted CA snapshot writing and listing application
+ *
+ *  Copyright (C) 2006-2018, ARM Limited, All Rights Reserved
+ *  SPDX-License-Identifier: Apache-2.0
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License"); you may
+ *  not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS, WITHOUT
+ *  WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *  This file is part of mbed TLS (https://tls.mbed.org)
+ */
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_PLATFORM_C)
+#include "mbedtls/platform.h"
+#else
+#include <stdio.h>
+#define mbedtls_printf     printf
+#endif
+
+#if !defined(MBEDTLS_X509_SNAPSHOT_C) || !defined(MBEDTLS_FS_IO)
+int main( void )
+{
+    mbedtls_printf("MBEDTLS_X509_SNAPSHOT_C and/or MBEDTLS_FS_IO not defined.\n");
+    return( 0 );
+}
+#else
+
+#include "mbedtls/x509_snapshot.h"
+#include "mbedtls/error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DFL_CA_FILE             ""
+#define DFL_CA_PATH             ""
+#define DFL_OUTPUT_FILENAME     "ca.snapshot"
+#define DFL_INPUT_FILENAME      ""
+
+#define USAGE \
+    "\n usage: ca_snapshot param=<>...\n"                                   \
+    "\n acceptable parameters:\n"                                           \
+    "    ca_file=%%s          The single file containing the CA(s) to write\n" \
+    "                        default: \"\" (none)\n"                        \
+    "    ca_path=%%s          The path containing the CA(s) to write\n"     \
+    "                        default: \"\" (none) (overrides ca_file)\n"    \
+    "    output_file=%%s      default: ca.snapshot\n"                       \
+    "    input_file=%%s       Snapshot to list instead of writing one\n"    \
+    "                        default: \"\" (none)\n"                        \
+    "\n"
+
+/*
+ * global options
+ */
+struct options
+{
+    const char *ca_file;        /* the file with the CA certificate(s)  */
+    const char *ca_path;        /* the path with the CA certificate(s) reside */
+    const char *output_file;    /* where to write the snapshot          */
+    const char *input_file;     /* snapshot to list                     */
+} opt;
+
+static size_t count_crt( const mbedtls_x509_crt *crt )
+{
+    size_t n = 0;
+
+    for( ; crt != NULL && crt->version != 0; crt = crt->next )
+        n++;
+
+    return( n );
+}
+
+int main( int argc, char *argv[] )
+{
+    int ret = 0;
+    mbedtls_x509_crt cacert;
+    mbedtls_x509_snapshot snap;
+    const mbedtls_x509_crt *cur;
+    char buf[1024];
+    int i, j;
+    char *p, *q;
+
+    /*
+     * Set to sane values
+     */
+    mbedtls_x509_crt_init( &cacert );
+    mbedtls_x509_snapshot_init( &snap );
+
+    if( argc == 0 )
+    {
+    usage:
+        mbedtls_printf( USAGE );
+        ret = 2;
+        goto exit;
+    }
+
+    opt.ca_file             = DFL_CA_FILE;
+    opt.ca_path             = DFL_CA_PATH;
+    opt.output_file         = DFL_OUTPUT_FILENAME;
+    opt.input_file          = DFL_INPUT_FILENAME;
+
+    for( i = 1; i < argc; i++ )
+    {
+        p = argv[i];
+        if( ( q = strchr( p, '=' ) ) == NULL )
+            goto usage;
+        *q++ = '\0';
+
+        for( j = 0; p + j < q; j++ )
+        {
+            if( argv[i][j] >= 'A' && argv[i][j] <= 'Z' )
+                argv[i][j] |= 0x20;
+        }
+
+        if( strcmp( p, "ca_file" ) == 0 )
+            opt.ca_file = q;
+        else if( strcmp( p, "ca_path" ) == 0 )
+            opt.ca_path = q;
+        else if( strcmp( p, "output_file" ) == 0 )
+            opt.output_file = q;
+        else if( strcmp( p, "input_file" ) == 0 )
+            opt.input_file = q;
+        else
+            goto usage;
+    }
+
+    if( strlen( opt.input_file ) )
+    {
+        /*
+         * List the certificates of a snapshot
+         */
+        mbedtls_printf( "  . Loading the snapshot ..." );
+        fflush( stdout );
+
+        if( ( ret = mbedtls_x509_snapshot_load_file( &snap,
+                                                     opt.input_file ) ) != 0 )
+        {
+            mbedtls_strerror( ret, buf, sizeof( buf ) );
+            mbedtls_printf( " failed\n  !  mbedtls_x509_snapshot_load_file "
+                            "returned -0x%04x - %s\n\n", -ret, buf );
+            goto exit;
+        }
+
+        mbedtls_printf( " ok (%u certificates, %u bytes%s)\n",
+                        (unsigned) count_crt( &snap.chain ),
+                        (unsigned) snap.len,
+                        snap.mapped ? ", mapped" : "" );
+
+        for( cur = &snap.chain; cur != NULL && cur->version != 0;
+             cur = cur->next )
+        {
+            ret = mbedtls_x509_crt_info( buf, sizeof( buf ) - 1, "      ", cur );
+            if( ret < 0 )
+            {
+                mbedtls_printf( "  !  mbedtls_x509_crt_info returned %d\n\n",
+                                ret );
+                goto exit;
+            }
+
+            mbedtls_printf( "\n%s", buf );
+        }
+
+        ret = 0;
+        goto exit;
+    }
+
+    /*
+     * 1. Load the certificates
+     */
+    mbedtls_printf( "  . Loading the CA certificates ..." );
+    fflush( stdout );
+
+    if( strlen( opt.ca_path ) )
+        ret = mbedtls_x509_crt_parse_path( &cacert, opt.ca_path );
+    else if( strlen( opt.ca_file ) )
+        ret = mbedtls_x509_crt_parse_file( &cacert, opt.ca_file );
+    else
+        goto usage;
+
+    if( ret < 0 )
+    {
+        mbedtls_strerror( ret, buf, sizeof( buf ) );
+        mbedtls_printf( " failed\n  !  mbedtls_x509_crt_parse returned "
+                        "-0x%04x - %s\n\n", -ret, buf );
+        goto exit;
+    }
+
+    mbedtls_printf( " ok (%u certificates, %d skipped)\n",
+                    (unsigned) count_crt( &cacert ), ret );
+
+    /*
+     * 2. Write the snapshot
+     */
+    mbedtls_printf( "  . Writing the snapshot to %s ...", opt.output_file );
+    fflush( stdout );
+
+    if( ( ret = mbedtls_x509_snapshot_write_file( &cacert,
+                                                  opt.output_file ) ) != 0 )
+    {
+        mbedtls_strerror( ret, buf, sizeof( buf ) );
+        mbedtls_printf( " failed\n  !  mbedtls_x509_snapshot_write_file "
+                        "returned -0x%04x - %s\n\n", -ret, buf );
+        goto exit;
+    }
+
+    mbedtls_printf( " ok\n" );
+
+    /*
+     * 3. Check that it loads back
+     */
+    mbedtls_printf( "  . Loading the snapshot back ..." );
+    fflush( stdout );
+
+    if( ( ret = mbedtls_x509_snapshot_load_file( &snap,
+                                                 opt.output_file ) ) != 0 )
+    {
+        mbedtls_strerror( ret, buf, sizeof( buf ) );
+        mbedtls_printf( " failed\n  !  mbedtls_x509_snapshot_load_file "
+                        "returned -0x%04x - %s\n\n", -ret, buf );
+        goto exit;
+    }
+
+    if( count_crt( &snap.chain ) != count_crt( &cacert ) )
+    {
+        mbedtls_printf( " failed\n  !  %u certificates instead of %u\n\n",
+                        (unsigned) count_crt( &snap.chain ),
+                        (unsigned) count_crt( &cacert ) );
+        ret = 1;
+        goto exit;
+    }
+
+    mbedtls_printf( " ok (%u bytes)\n", (unsigned) snap.len );
+
+exit:
+    mbedtls_x509_snapshot_free( &snap );
+    mbedtls_x509_crt_free( &cacert );
+
+#if defined(_WIN32)
+    mbedtls_printf( "  + Press Enter to exit this program.\n" );
+    fflush( stdout ); getchar();
+#endif
+
+    if( ret < 0 )
+        ret = 1;
+
+    return( ret );
+}
+#endif /* MBEDTLS_X509_SNAPSHOT_C && MBEDTLS_FS_IO */
@@ -213,6 +213,7 @@ int main( int argc, char *argv[] )
 {
     int ret = 0;
     mbedtls_x509_crt issuer_crt;
+    const mbedtls_x509_name *issuer_subject;
     mbedtls_pk_context loaded_issuer_key, loaded_subject_key;
     mbedtls_pk_context *issuer_key = &loaded_issuer_key,
                 *subject_key = &loaded_subject_key;
@@ -518,8 +519,10 @@ int main( int argc, char *argv[] )
             goto exit;
         }
 
-        ret = mbedtls_x509_dn_gets( issuer_name, sizeof(issuer_name),
-                                 &issuer_crt.subject );
+        ret = mbedtls_x509_crt_get_subject( &issuer_crt, &issuer_subject );
+        if( ret == 0 )
+            ret = mbedtls_x509_dn_gets( issuer_name, sizeof(issuer_name),
+                                        issuer_subject );
         if( ret < 0 )
         {
             mbedtls_strerror( ret, buf, 1024 );
@@ -627,6 +627,26 @@ make
 msg "test: ssl-opt.sh, MFL-related tests"
 if_build_succeeded tests/ssl-opt.sh -f "Max fragment length"
 
+msg "build: default config + MBEDTLS_SSL_PEER_CHAIN_IN_PLACE (ASan build)" # ~ 30s
+cleanup
+cp "$CONFIG_H" "$CONFIG_BAK"
+scripts/config.pl set MBEDTLS_SSL_PEER_CHAIN_IN_PLACE
+CC=gcc cmake -D CMAKE_BUILD_TYPE:String=Asan .
+make
+
+msg "test: ssl-opt.sh, certificate and OCSP stapling tests (peer chain in place)"
+if_build_succeeded tests/ssl-opt.sh -f "Authentication\|OCSP stapling"
+
+msg "build: default config + MBEDTLS_NET_MUX_C (ASan build)" # ~ 30s
+cleanup
+cp "$CONFIG_H" "$CONFIG_BAK"
+scripts/config.pl set MBEDTLS_NET_MUX_C
+CC=gcc cmake -D CMAKE_BUILD_TYPE:String=Asan .
+make
+
+msg "test: ssl-opt.sh, DTLS mux server tests"
+if_build_succeeded tests/ssl-opt.sh -f "DTLS mux server"
+
 msg "build: default config with  MBEDTLS_TEST_NULL_ENTROPY (ASan build)"
 cleanup
 cp "$CONFIG_H" "$CONFIG_BAK"
@@ -25,6 +25,7 @@ set -u
 : ${P_SRV:=../programs/ssl/ssl_server2}
 : ${P_CLI:=../programs/ssl/ssl_client2}
 : ${P_PXY:=../programs/test/udp_proxy}
+: ${P_MUX_SRV:=../programs/ssl/dtls_mux_server}
 : ${OPENSSL_CMD:=openssl} # OPENSSL would conflict with the build system
 : ${GNUTLS_CLI:=gnutls-cli}
 : ${GNUTLS_SERV:=gnutls-serv}
@@ -144,6 +145,21 @@ requires_openssl_with_fallback_scsv() {
     fi
 }
 
+# skip next test if OpenSSL doesn't support TLS 1.3
+requires_openssl_with_tls1_3() {
+    if [ -z "${OPENSSL_HAS_TLS1_3:-}" ]; then
+        if $OPENSSL_CMD s_client -help 2>&1 | grep tls1_3 >/dev/null
+        then
+            OPENSSL_HAS_TLS1_3="YES"
+        else
+            OPENSSL_HAS_TLS1_3="NO"
+        fi
+    fi
+    if [ "$OPENSSL_HAS_TLS1_3" = "NO" ]; then
+        SKIP_NEXT="YES"
+    fi
+}
+
 # skip next test if GnuTLS isn't available
 requires_gnutls() {
     if [ -z "${GNUTLS_AVAILABLE:-}" ]; then
@@ -202,6 +218,36 @@ server_needs_more_time() {
     SRV_DELAY_SECONDS=$1
 }
 
+# run_concurrently <count> <cmd>...: run <count> copies of a client command
+# at the same time, succeeding only if all of them do
+run_concurrently() {
+    RC_COUNT=$1
+    shift 1
+    RC_PIDS=""
+    for i in `seq 1 $RC_COUNT`; do
+        "$@" &
+        RC_PIDS="$RC_PIDS $!"
+    done
+    RC_RET=0
+    for i in $RC_PIDS; do
+        wait $i || RC_RET=1
+    done
+    return $RC_RET
+}
+
+# wait_server_output <pattern>: wait until the server output of the current
+# test matches <pattern> (at most DOG_DELAY seconds), so that client input
+# can be fed at a given point of the server's progress
+wait_server_output() {
+    WSO_START=$(date +%s)
+    until grep "$1" $SRV_OUT >/dev/null; do
+        if [ $(( $(date +%s) - $WSO_START )) -gt $DOG_DELAY ]; then
+            return 1
+        fi
+        sleep 0.1 2>/dev/null || true
+    done
+}
+
 # print_name <name>
 print_name() {
     TESTS=$(( $TESTS + 1 ))
@@ -366,7 +412,7 @@ wait_client_done() {
 
 # check if the given command uses dtls and sets global variable DTLS
 detect_dtls() {
-    if echo "$1" | grep 'dtls=1\|-dtls1\|-u' >/dev/null; then
+    if echo "$1" | grep 'dtls=1\|-dtls1\|-u\|dtls_mux_server' >/dev/null; then
         DTLS=1
     else
         DTLS=0
@@ -686,6 +732,7 @@ SRV_DELAY_SECONDS=0
 # +SRV_PORT will be replaced by either $SRV_PORT or $PXY_PORT later
 P_SRV="$P_SRV server_addr=127.0.0.1 server_port=$SRV_PORT"
 P_CLI="$P_CLI server_addr=127.0.0.1 server_port=+SRV_PORT"
+P_MUX_SRV="$P_MUX_SRV server_addr=127.0.0.1 server_port=$SRV_PORT"
 P_PXY="$P_PXY server_addr=127.0.0.1 server_port=$SRV_PORT listen_addr=127.0.0.1 listen_port=$PXY_PORT ${SEED:+"seed=$SEED"}"
 O_SRV="$O_SRV -accept $SRV_PORT -dhparam data_files/dhparams.pem"
 O_CLI="$O_CLI -connect localhost:+SRV_PORT"
@@ -753,6 +800,77 @@ run_test    "Unique IV in GCM" \
             -u "IV used" \
             -U "IV used"
 
+# Tests for AEAD record protection, checked against OpenSSL so that both
+# directions of each record format (both tag lengths) meet another stack
+
+requires_config_enabled MBEDTLS_GCM_C
+run_test    "AEAD records: GCM, openssl server" \
+            "$O_SRV -cipher ECDHE-ECDSA-AES128-GCM-SHA256" \
+            "$P_CLI exchanges=2 force_ciphersuite=TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256" \
+            0 \
+            -c "Ciphersuite is TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256" \
+            -c "HTTP/1.0 200 ok"
+
+requires_config_enabled MBEDTLS_GCM_C
+run_test    "AEAD records: GCM, openssl client" \
+            "$P_SRV force_ciphersuite=TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256" \
+            "$O_CLI -ign_eof -cipher ECDHE-ECDSA-AES128-GCM-SHA256" \
+            0 \
+            -s "Ciphersuite is TLS-ECDHE-ECDSA-WITH-AES-128-GCM-SHA256" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_CCM_C
+run_test    "AEAD records: CCM, openssl server" \
+            "$O_SRV -cipher ECDHE-ECDSA-AES128-CCM" \
+            "$P_CLI exchanges=2 force_ciphersuite=TLS-ECDHE-ECDSA-WITH-AES-128-CCM" \
+            0 \
+            -c "Ciphersuite is TLS-ECDHE-ECDSA-WITH-AES-128-CCM" \
+            -c "HTTP/1.0 200 ok"
+
+requires_config_enabled MBEDTLS_CCM_C
+run_test    "AEAD records: CCM, openssl client" \
+            "$P_SRV force_ciphersuite=TLS-ECDHE-ECDSA-WITH-AES-128-CCM" \
+            "$O_CLI -ign_eof -cipher ECDHE-ECDSA-AES128-CCM" \
+            0 \
+            -s "Ciphersuite is TLS-ECDHE-ECDSA-WITH-AES-128-CCM" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_CCM_C
+run_test    "AEAD records: CCM-8, openssl server" \
+            "$O_SRV -cipher ECDHE-ECDSA-AES128-CCM8" \
+            "$P_CLI exchanges=2 force_ciphersuite=TLS-ECDHE-ECDSA-WITH-AES-128-CCM-8" \
+            0 \
+            -c "Ciphersuite is TLS-ECDHE-ECDSA-WITH-AES-128-CCM-8" \
+            -c "HTTP/1.0 200 ok"
+
+requires_config_enabled MBEDTLS_CCM_C
+run_test    "AEAD records: CCM-8, openssl client" \
+            "$P_SRV force_ciphersuite=TLS-ECDHE-ECDSA-WITH-AES-128-CCM-8" \
+            "$O_CLI -ign_eof -cipher ECDHE-ECDSA-AES128-CCM8" \
+            0 \
+            -s "Ciphersuite is TLS-ECDHE-ECDSA-WITH-AES-128-CCM-8" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_config_enabled MBEDTLS_CCM_C
+requires_openssl_with_tls1_3
+run_test    "AEAD records: TLS 1.3 CCM, openssl server" \
+            "$O_SRV -tls1_3 -ciphersuites TLS_AES_128_CCM_SHA256" \
+            "$P_CLI max_version=tls1_3 exchanges=2 force_ciphersuite=TLS1-3-AES-128-CCM-SHA256" \
+            0 \
+            -c "Ciphersuite is TLS1-3-AES-128-CCM-SHA256" \
+            -c "HTTP/1.0 200 ok"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_config_enabled MBEDTLS_CCM_C
+requires_openssl_with_tls1_3
+run_test    "AEAD records: TLS 1.3 CCM-8, openssl server" \
+            "$O_SRV -tls1_3 -ciphersuites TLS_AES_128_CCM_8_SHA256" \
+            "$P_CLI max_version=tls1_3 exchanges=2 force_ciphersuite=TLS1-3-AES-128-CCM-8-SHA256" \
+            0 \
+            -c "Ciphersuite is TLS1-3-AES-128-CCM-8-SHA256" \
+            -c "HTTP/1.0 200 ok"
+
 # Tests for rc4 option
 
 requires_config_enabled MBEDTLS_REMOVE_ARC4_CIPHERSUITES
@@ -1408,6 +1526,24 @@ run_test    "Session resume using cache: openssl server" \
             -C "parse new session ticket" \
             -c "a session has been resumed"
 
+# Tests for the cache of client certificate verification results
+
+requires_config_enabled MBEDTLS_X509_VERIFY_CACHE_C
+run_test    "Verification cache: same client certificate" \
+            "$P_SRV tickets=0 cache_max=0 auth_mode=optional verify_cache=8" \
+            "$P_CLI tickets=0 reconnect=1" \
+            0 \
+            -s "Verification cache: 0 hits, 1 misses" \
+            -s "Verification cache: 1 hits, 1 misses" \
+            -C "a session has been resumed"
+
+requires_config_enabled MBEDTLS_X509_VERIFY_CACHE_C
+run_test    "Verification cache: disabled" \
+            "$P_SRV tickets=0 cache_max=0 auth_mode=optional" \
+            "$P_CLI tickets=0 reconnect=1" \
+            0 \
+            -S "Verification cache:"
+
 # Tests for Max Fragment Length extension
 
 MAX_CONTENT_LEN_EXPECT='16384'
@@ -2646,6 +2782,170 @@ run_test    "SNI: CA override with CRL" \
             -S "! The certificate is not correctly signed by the trusted CA" \
             -s "The certificate has been revoked (is on a CRL)"
 
+# Tests for the SNI certificate store
+
+requires_config_enabled MBEDTLS_SSL_SNI_C
+run_test    "SNI store: matching cert 1" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server5.crt key_file=data_files/server5.key \
+             sni_store=data_files/server2.crt,data_files/server2.key,data_files/server1-nospace.crt,data_files/server1.key" \
+            "$P_CLI server_name=localhost" \
+            0 \
+            -s "parse ServerName extension" \
+            -c "issuer name *: C=NL, O=PolarSSL, CN=PolarSSL Test CA" \
+            -c "subject name *: C=NL, O=PolarSSL, CN=localhost"
+
+requires_config_enabled MBEDTLS_SSL_SNI_C
+run_test    "SNI store: matching cert 2, case-insensitive" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server5.crt key_file=data_files/server5.key \
+             sni_store=data_files/server2.crt,data_files/server2.key,data_files/server1-nospace.crt,data_files/server1.key" \
+            "$P_CLI server_name=PolarSSL.Example" \
+            0 \
+            -s "parse ServerName extension" \
+            -c "issuer name *: C=NL, O=PolarSSL, CN=PolarSSL Test CA" \
+            -c "subject name *: C=NL, O=PolarSSL, CN=polarssl.example"
+
+requires_config_enabled MBEDTLS_SSL_SNI_C
+run_test    "SNI store: no matching cert, default cert used" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server5.crt key_file=data_files/server5.key \
+             sni_store=data_files/server2.crt,data_files/server2.key,data_files/server1-nospace.crt,data_files/server1.key" \
+            "$P_CLI server_name=nonesuch.example auth_mode=optional" \
+            0 \
+            -s "parse ServerName extension" \
+            -S "ssl_sni_wrapper() returned" \
+            -c "issuer name *: C=NL, O=PolarSSL, CN=Polarssl Test EC CA" \
+            -c "subject name *: C=NL, O=PolarSSL, CN=localhost"
+
+# Tests for OCSP stapling
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: good response" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-good.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1" \
+            0 \
+            -s "found status_request extension" \
+            -s "=> write certificate status" \
+            -c "found status_request extension" \
+            -c "=> parse certificate status" \
+            -C "no certificate status message" \
+            -C "mbedtls_x509_ocsp_response_verify() returned"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: good response, DTLS" \
+            "$P_SRV debug_level=3 dtls=1 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-good.der" \
+            "$P_CLI debug_level=3 dtls=1 ocsp_stapling=1" \
+            0 \
+            -s "=> write certificate status" \
+            -c "=> parse certificate status" \
+            -C "no certificate status message" \
+            -C "mbedtls_x509_ocsp_response_verify() returned"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: delegated responder" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-delegated.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1" \
+            0 \
+            -s "=> write certificate status" \
+            -c "=> parse certificate status" \
+            -C "mbedtls_x509_ocsp_response_verify() returned"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: server certificate from an intermediate CA" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server7_int-ca.crt key_file=data_files/server7.key \
+             ocsp_file=data_files/server7-ocsp-good.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1" \
+            0 \
+            -s "=> write certificate status" \
+            -c "=> parse certificate status" \
+            -C "no certificate status message" \
+            -C "mbedtls_x509_ocsp_response_verify() returned"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: revoked, auth_mode=required" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-revoked.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1 auth_mode=required" \
+            1 \
+            -s "=> write certificate status" \
+            -c "mbedtls_x509_ocsp_response_verify() returned" \
+            -c "X509 - Certificate verification failed"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: revoked, auth_mode=optional" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-revoked.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1 auth_mode=optional" \
+            0 \
+            -c "mbedtls_x509_ocsp_response_verify() returned" \
+            -c "! The certificate has been revoked"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: not requested by client" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-good.der" \
+            "$P_CLI debug_level=3" \
+            0 \
+            -S "found status_request extension" \
+            -S "=> write certificate status" \
+            -C "=> parse certificate status"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_STAPLING
+run_test    "OCSP stapling: not configured on server" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key" \
+            "$P_CLI debug_level=3 ocsp_stapling=1" \
+            0 \
+            -s "found status_request extension" \
+            -S "=> write certificate status" \
+            -C "found status_request extension" \
+            -C "=> parse certificate status"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: not sent on resumption" \
+            "$P_SRV debug_level=3 tickets=0 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-good.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1 tickets=0 reconnect=1" \
+            0 \
+            -s "a session has been resumed" \
+            -c "a session has been resumed" \
+            -s "=> write certificate status"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_C
+run_test    "OCSP stapling: OpenSSL client" \
+            "$P_SRV debug_level=3 \
+             crt_file=data_files/server2.crt key_file=data_files/server2.key \
+             ocsp_file=data_files/server2-ocsp-good.der" \
+            "$O_CLI -status" \
+            0 \
+            -s "found status_request extension" \
+            -s "=> write certificate status" \
+            -c "OCSP Response Status: successful" \
+            -c "Cert Status: good"
+
+requires_config_enabled MBEDTLS_SSL_OCSP_STAPLING
+run_test    "OCSP stapling: OpenSSL server" \
+            "$O_SRV -cert data_files/server2-sha256.crt -key data_files/server2.key \
+             -status_file data_files/server2-sha256-ocsp-good.der" \
+            "$P_CLI debug_level=3 ocsp_stapling=1" \
+            0 \
+            -c "found status_request extension" \
+            -c "=> parse certificate status" \
+            -C "no certificate status message" \
+            -C "mbedtls_x509_ocsp_response_verify() returned"
+
 # Tests for non-blocking I/O: exercise a variety of handshake flows
 
 run_test    "Non-blocking I/O: basic handshake" \
@@ -2776,6 +3076,218 @@ run_test    "Version check: srv min 1.2, cli max 1.1 -> fail" \
             -c "mbedtls_ssl_handshake returned" \
             -s "SSL - Handshake protocol not within min/max boundaries"
 
+# Tests for TLS 1.3
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: cli+srv max 1.3 -> 1.3" \
+            "$P_SRV debug_level=3 max_version=tls1_3" \
+            "$P_CLI debug_level=3 max_version=tls1_3" \
+            0 \
+            -c "client hello, adding supported_versions extension" \
+            -c "client hello, adding key_share extension" \
+            -s "selected key share group" \
+            -S "write hello retry request" \
+            -c "=> parse encrypted extensions" \
+            -c "<= parse certificate verify" \
+            -s "switching to application traffic keys for inbound data" \
+            -s "Protocol is TLSv1.3" \
+            -c "Protocol is TLSv1.3"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: cli max 1.3, srv max 1.2 -> 1.2" \
+            "$P_SRV" \
+            "$P_CLI debug_level=3 max_version=tls1_3" \
+            0 \
+            -c "client hello, adding supported_versions extension" \
+            -C "downgrade to TLS 1.2 or below detected" \
+            -s "Protocol is TLSv1.2" \
+            -c "Protocol is TLSv1.2"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: cli max 1.2, srv max 1.3 -> 1.2" \
+            "$P_SRV max_version=tls1_3" \
+            "$P_CLI" \
+            0 \
+            -S "mbedtls_ssl_handshake returned" \
+            -s "Protocol is TLSv1.2" \
+            -c "Protocol is TLSv1.2"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: cli min 1.3, srv max 1.2 -> fail" \
+            "$P_SRV" \
+            "$P_CLI force_version=tls1_3" \
+            1 \
+            -s "mbedtls_ssl_handshake returned" \
+            -c "mbedtls_ssl_handshake returned"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: forced ciphersuite" \
+            "$P_SRV max_version=tls1_3" \
+            "$P_CLI max_version=tls1_3 \
+             force_ciphersuite=TLS1-3-AES-128-CCM-SHA256" \
+            0 \
+            -s "Ciphersuite is TLS1-3-AES-128-CCM-SHA256" \
+            -c "Ciphersuite is TLS1-3-AES-128-CCM-SHA256"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: HelloRetryRequest" \
+            "$P_SRV debug_level=3 max_version=tls1_3 curves=secp384r1" \
+            "$P_CLI debug_level=3 max_version=tls1_3 curves=secp256r1,secp384r1" \
+            0 \
+            -s "asking for a key share in another group" \
+            -s "write hello retry request" \
+            -c "parse tls13 hello retry request" \
+            -s "selected key share group: secp384r1" \
+            -s "Protocol is TLSv1.3" \
+            -c "Protocol is TLSv1.3"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: HelloRetryRequest, non-blocking" \
+            "$P_SRV debug_level=3 max_version=tls1_3 nbio=2 curves=secp384r1" \
+            "$P_CLI debug_level=3 max_version=tls1_3 nbio=2 \
+             curves=secp256r1,secp384r1" \
+            0 \
+            -s "write hello retry request" \
+            -s "Protocol is TLSv1.3" \
+            -c "Protocol is TLSv1.3"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: no common group -> fail" \
+            "$P_SRV debug_level=1 max_version=tls1_3 curves=secp384r1" \
+            "$P_CLI max_version=tls1_3 curves=secp256r1" \
+            1 \
+            -s "no usable key share" \
+            -c "mbedtls_ssl_handshake returned"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_config_enabled MBEDTLS_SSL_SESSION_TICKETS
+run_test    "TLS 1.3: session resume using tickets" \
+            "$P_SRV debug_level=3 max_version=tls1_3 tickets=1" \
+            "$P_CLI debug_level=3 max_version=tls1_3 tickets=1 reconnect=1" \
+            0 \
+            -s "write new session ticket" \
+            -c "parse new session ticket" \
+            -c "client hello, adding pre_shared_key extension" \
+            -s "found pre_shared_key extension" \
+            -s "session successfully restored from ticket" \
+            -S "bad psk binder" \
+            -s "a session has been resumed" \
+            -c "a session has been resumed"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_config_enabled MBEDTLS_SSL_SESSION_TICKETS
+run_test    "TLS 1.3: session resume using tickets, HelloRetryRequest" \
+            "$P_SRV debug_level=3 max_version=tls1_3 tickets=1 curves=secp384r1" \
+            "$P_CLI debug_level=3 max_version=tls1_3 tickets=1 reconnect=1 \
+             curves=secp256r1,secp384r1" \
+            0 \
+            -s "write hello retry request" \
+            -s "session successfully restored from ticket" \
+            -S "bad psk binder" \
+            -s "a session has been resumed" \
+            -c "a session has been resumed"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_config_enabled MBEDTLS_SSL_SESSION_TICKETS
+run_test    "TLS 1.3: session resume using tickets, server disabled" \
+            "$P_SRV debug_level=3 max_version=tls1_3 tickets=0" \
+            "$P_CLI debug_level=3 max_version=tls1_3 tickets=1 reconnect=1" \
+            0 \
+            -S "write new session ticket" \
+            -C "parse new session ticket" \
+            -C "client hello, adding pre_shared_key extension" \
+            -S "a session has been resumed" \
+            -C "a session has been resumed"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: client auth" \
+            "$P_SRV debug_level=3 max_version=tls1_3 auth_mode=required" \
+            "$P_CLI debug_level=3 max_version=tls1_3" \
+            0 \
+            -s "=> write certificate request" \
+            -c "<= parse certificate request" \
+            -c "=> write certificate verify" \
+            -s "<= parse certificate verify" \
+            -S "mbedtls_ssl_handshake returned" \
+            -s "Protocol is TLSv1.3"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: client auth, no client certificate" \
+            "$P_SRV debug_level=3 max_version=tls1_3 auth_mode=optional" \
+            "$P_CLI debug_level=3 max_version=tls1_3 crt_file=none key_file=none" \
+            0 \
+            -c "<= parse certificate request" \
+            -C "=> write certificate verify" \
+            -s "skip parse certificate verify" \
+            -s "Protocol is TLSv1.3"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+run_test    "TLS 1.3: server RSA certificate" \
+            "$P_SRV max_version=tls1_3 crt_file=data_files/server2.crt \
+             key_file=data_files/server2.key" \
+            "$P_CLI debug_level=3 max_version=tls1_3" \
+            0 \
+            -c "<= parse certificate verify" \
+            -c "Protocol is TLSv1.3"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_config_enabled MBEDTLS_SSL_ALPN
+run_test    "TLS 1.3: ALPN in EncryptedExtensions" \
+            "$P_SRV debug_level=3 max_version=tls1_3 alpn=abc,1234" \
+            "$P_CLI debug_level=3 max_version=tls1_3 alpn=1234" \
+            0 \
+            -c "found alpn extension" \
+            -s "Application Layer Protocol is 1234" \
+            -c "Application Layer Protocol is 1234"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_openssl_with_tls1_3
+run_test    "TLS 1.3: openssl server" \
+            "$O_SRV -tls1_3" \
+            "$P_CLI max_version=tls1_3 tickets=1 reconnect=1 debug_level=3" \
+            0 \
+            -c "Protocol is TLSv1.3" \
+            -c "parse new session ticket" \
+            -c "a session has been resumed"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_openssl_with_tls1_3
+run_test    "TLS 1.3: openssl client" \
+            "$P_SRV max_version=tls1_3 debug_level=3" \
+            "$O_CLI -tls1_3" \
+            0 \
+            -s "Protocol is TLSv1.3" \
+            -s "write new session ticket" \
+            -c "TLSv1.3, Cipher is"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_openssl_with_tls1_3
+run_test    "TLS 1.3: openssl client, key update" \
+            "$P_SRV max_version=tls1_3 debug_level=2" \
+            "( wait_server_output '<= handshake'; echo K;
+               wait_server_output '<= write key update';
+               echo 'GET / HTTP/1.0'; sleep 1 ) | \
+             $OPENSSL_CMD s_client -tls1_3 -connect localhost:+SRV_PORT" \
+            0 \
+            -s "<= parse key update" \
+            -s "<= write key update" \
+            -c "KEYUPDATE" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_3
+requires_openssl_with_tls1_3
+run_test    "TLS 1.3: openssl client, key update, non-blocking" \
+            "$P_SRV max_version=tls1_3 nbio=2 debug_level=2" \
+            "( wait_server_output '<= handshake'; echo K;
+               wait_server_output '<= write key update';
+               echo 'GET / HTTP/1.0'; sleep 1 ) | \
+             $OPENSSL_CMD s_client -tls1_3 -connect localhost:+SRV_PORT" \
+            0 \
+            -s "<= parse key update" \
+            -s "<= write key update" \
+            -c "KEYUPDATE" \
+            -c "HTTP/1.0 200 OK"
+
 # Tests for ALPN extension
 
 run_test    "ALPN: none" \
@@ -3415,6 +3927,396 @@ run_test    "mbedtls_ssl_get_bytes_avail: extra data" \
             0 \
             -s "Read from client: 500 bytes read (.*+.*)"
 
+# Tests for read-ahead
+
+run_test    "Read-ahead: basic handshake" \
+            "$P_SRV read_ahead=1 debug_level=2" \
+            "$P_CLI read_ahead=1 debug_level=2" \
+            0 \
+            -s "next record already read" \
+            -c "next record already read" \
+            -s "[0-9]* bytes read" \
+            -c "[0-9]* bytes read"
+
+run_test    "Read-ahead: 1/n-1 record splitting" \
+            "$P_SRV read_ahead=1 debug_level=2" \
+            "$P_CLI request_size=123 force_version=tls1 recsplit=1 \
+             force_ciphersuite=TLS-RSA-WITH-AES-128-CBC-SHA" \
+            0 \
+            -s "next record already read" \
+            -S "123 bytes read" \
+            -s "122 bytes read"
+
+run_test    "Read-ahead: non-blocking, large packet" \
+            "$P_SRV read_ahead=1 nbio=2" \
+            "$P_CLI read_ahead=1 nbio=2 request_size=16384" \
+            0 \
+            -s "Read from client: 16384 bytes read" \
+            -c "Read from server: .* bytes read"
+
+run_test    "Read-ahead: ticket + client auth + resume" \
+            "$P_SRV read_ahead=1 tickets=1 auth_mode=required" \
+            "$P_CLI read_ahead=1 tickets=1 reconnect=1" \
+            0 \
+            -S "mbedtls_ssl_handshake returned" \
+            -C "mbedtls_ssl_handshake returned" \
+            -c "Read from server: .* bytes read"
+
+# Tests for variable buffer length
+
+requires_config_enabled MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+run_test    "Variable buffer length: shrink after handshake" \
+            "$P_SRV debug_level=3" \
+            "$P_CLI debug_level=3" \
+            0 \
+            -s "resizing input buffer" \
+            -s "resizing output buffer" \
+            -c "resizing input buffer" \
+            -c "resizing output buffer" \
+            -s "Memory per connection"
+
+requires_config_enabled MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+run_test    "Variable buffer length: grow for large records" \
+            "$P_SRV exchanges=2" \
+            "$P_CLI request_size=16384 exchanges=2" \
+            0 \
+            -c "16384 bytes written in 1 fragments" \
+            -s "Read from client: 16384 bytes read" \
+            -s "Memory per connection"
+
+requires_config_enabled MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+run_test    "Variable buffer length: large records with read-ahead" \
+            "$P_SRV read_ahead=1 exchanges=2" \
+            "$P_CLI read_ahead=1 request_size=16384 exchanges=2" \
+            0 \
+            -c "16384 bytes written in 1 fragments" \
+            -s "Read from client: 16384 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+requires_config_enabled MBEDTLS_SSL_RENEGOTIATION
+run_test    "Variable buffer length: renegotiation" \
+            "$P_SRV exchanges=2 renegotiation=1 renegotiate=1" \
+            "$P_CLI exchanges=2 renegotiation=1 request_size=2000" \
+            0 \
+            -S "mbedtls_ssl_handshake returned" \
+            -C "mbedtls_ssl_handshake returned" \
+            -s "Read from client: 2000 bytes read" \
+            -c "Read from server: .* bytes read"
+
+requires_config_enabled MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+requires_config_enabled MBEDTLS_SSL_RENEGOTIATION
+run_test    "Variable buffer length: repeated renegotiation" \
+            "$P_SRV debug_level=3 exchanges=9 renegotiation=1 renego_period=3" \
+            "$P_CLI debug_level=3 exchanges=7 renegotiation=1" \
+            0 \
+            -s "record counter limit reached: renegotiate" \
+            -c "=> renegotiate" \
+            -s "=> renegotiate" \
+            -S "resizing input buffer" \
+            -S "resizing output buffer" \
+            -S "alloc(" \
+            -S "mbedtls_ssl_read returned" \
+            -C "mbedtls_ssl_write returned"
+
+# Tests for the handshake arena
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+run_test    "Handshake arena: default (disabled), peak still tracked" \
+            "$P_SRV debug_level=3" \
+            "$P_CLI debug_level=3" \
+            0 \
+            -S "handshake arena of" \
+            -C "handshake arena of" \
+            -s "Handshake arena peak is [1-9][0-9]* bytes" \
+            -c "Handshake arena peak is [1-9][0-9]* bytes"
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+run_test    "Handshake arena: TLS" \
+            "$P_SRV debug_level=3 hs_arena=16384" \
+            "$P_CLI debug_level=3 hs_arena=16384" \
+            0 \
+            -s "handshake arena of 16384 bytes" \
+            -c "handshake arena of 16384 bytes" \
+            -s "releasing handshake arena of 16384 bytes" \
+            -c "releasing handshake arena of 16384 bytes" \
+            -s "Handshake arena peak is" \
+            -S "mbedtls_ssl_handshake returned"
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+run_test    "Handshake arena: smaller than the handshake parameters" \
+            "$P_SRV debug_level=3 hs_arena=64" \
+            "$P_CLI debug_level=3 hs_arena=64" \
+            0 \
+            -S "handshake arena of" \
+            -C "handshake arena of" \
+            -S "mbedtls_ssl_handshake returned" \
+            -C "mbedtls_ssl_handshake returned"
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+run_test    "Handshake arena: PSK callback" \
+            "$P_SRV debug_level=3 hs_arena=16384 psk_list=abc,dead,def,beef" \
+            "$P_CLI force_ciphersuite=TLS-PSK-WITH-AES-128-CBC-SHA \
+            psk_identity=def psk=beef" \
+            0 \
+            -s "handshake arena of 16384 bytes" \
+            -S "SSL - Unknown identity received" \
+            -S "SSL - Verification of the message MAC failed"
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+requires_config_enabled MBEDTLS_SSL_PROTO_DTLS
+run_test    "Handshake arena: DTLS with cookie" \
+            "$P_SRV debug_level=3 dtls=1 hs_arena=16384" \
+            "$P_CLI debug_level=3 dtls=1 hs_arena=16384" \
+            0 \
+            -s "handshake arena of 16384 bytes" \
+            -c "handshake arena of 16384 bytes" \
+            -c "received hello verify request" \
+            -s "Read from client" \
+            -C "mbedtls_ssl_handshake returned"
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+requires_config_enabled MBEDTLS_SSL_PROTO_DTLS
+run_test    "Handshake arena: DTLS, arena too small for the flights" \
+            "$P_SRV debug_level=3 dtls=1 hs_arena=4096" \
+            "$P_CLI debug_level=3 dtls=1 hs_arena=4096" \
+            0 \
+            -s "handshake arena of 4096 bytes" \
+            -c "handshake arena of 4096 bytes" \
+            -s "Read from client" \
+            -C "mbedtls_ssl_handshake returned"
+
+requires_config_enabled MBEDTLS_SSL_HANDSHAKE_ARENA
+requires_config_enabled MBEDTLS_SSL_RENEGOTIATION
+run_test    "Handshake arena: renegotiation" \
+            "$P_SRV debug_level=3 exchanges=2 renegotiation=1 renegotiate=1 hs_arena=16384" \
+            "$P_CLI debug_level=3 exchanges=2 renegotiation=1 hs_arena=16384" \
+            0 \
+            -s "=> renegotiate" \
+            -c "=> renegotiate" \
+            -s "releasing handshake arena of 16384 bytes" \
+            -c "releasing handshake arena of 16384 bytes" \
+            -S "mbedtls_ssl_handshake returned" \
+            -C "mbedtls_ssl_handshake returned"
+
+# Tests for handshake transcript digests
+
+run_test    "Handshake checksums: PRF hash only after ServerHello" \
+            "$P_SRV debug_level=3" \
+            "$P_CLI debug_level=3 force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384" \
+            0 \
+            -c "handshake checksums: 0x04" \
+            -s "handshake checksums: 0x04" \
+            -c "calc verify sha384" \
+            -C "calc verify sha256"
+
+run_test    "Handshake checksums: SHA-256 PRF" \
+            "$P_SRV debug_level=3" \
+            "$P_CLI debug_level=3 force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256" \
+            0 \
+            -c "handshake checksums: 0x02" \
+            -s "handshake checksums: 0x02" \
+            -c "calc verify sha256" \
+            -C "calc verify sha384"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_1
+run_test    "Handshake checksums: MD5 and SHA-1 for TLS 1.1" \
+            "$P_SRV debug_level=3" \
+            "$P_CLI debug_level=3 force_version=tls1_1" \
+            0 \
+            -c "handshake checksums: 0x01" \
+            -s "handshake checksums: 0x01"
+
+requires_config_enabled MBEDTLS_SSL_PROTO_TLS1_1
+run_test    "Handshake checksums: server keeps verify hashes for client auth" \
+            "$P_SRV debug_level=3 auth_mode=required" \
+            "$P_CLI debug_level=3 force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384" \
+            0 \
+            -s "handshake checksums: 0x07" \
+            -s "handshake checksums: 0x04" \
+            -c "handshake checksums: 0x04" \
+            -s "Verifying peer X.509 certificate... ok"
+
+# Tests for dynamic record sizing
+
+run_test    "Dynamic record sizing: disabled by default" \
+            "$P_SRV" \
+            "$P_CLI request_size=20000" \
+            0 \
+            -c "20000 bytes written in 2 fragments" \
+            -s "Read from client: 16384 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+run_test    "Dynamic record sizing: small records first" \
+            "$P_SRV" \
+            "$P_CLI request_size=20000 dyn_rec_len=1000 dyn_rec_ramp=3000" \
+            0 \
+            -c "20000 bytes written in 5 fragments" \
+            -s "Read from client: 1000 bytes read" \
+            -s "16384 bytes read" \
+            -s "616 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+run_test    "Dynamic record sizing: no ramp" \
+            "$P_SRV" \
+            "$P_CLI request_size=20000 dyn_rec_len=1000 dyn_rec_ramp=0" \
+            0 \
+            -c "20000 bytes written in 2 fragments"
+
+requires_config_enabled MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+run_test    "Dynamic record sizing: non-blocking" \
+            "$P_SRV nbio=2" \
+            "$P_CLI nbio=2 request_size=20000 dyn_rec_len=1000 dyn_rec_ramp=3000" \
+            0 \
+            -c "20000 bytes written in 5 fragments" \
+            -s "616 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+run_test    "Dynamic record sizing: full records after ramp" \
+            "$P_SRV exchanges=2" \
+            "$P_CLI exchanges=2 request_size=2000 dyn_rec_len=1000 \
+             dyn_rec_ramp=1500 dyn_rec_idle=0" \
+            0 \
+            -c "2000 bytes written in 2 fragments" \
+            -c "2000 bytes written in 1 fragments"
+
+requires_config_enabled MBEDTLS_SSL_DYNAMIC_RECORD_SIZING
+run_test    "Dynamic record sizing: DTLS unaffected" \
+            "$P_SRV dtls=1" \
+            "$P_CLI dtls=1 request_size=2000 dyn_rec_len=1000" \
+            0 \
+            -c "2000 bytes written in 1 fragments"
+
+# Tests for mbedtls_ssl_send_file()
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+run_test    "Send file: single record" \
+            "$P_SRV response_file=data_files/server5.crt" \
+            "$P_CLI" \
+            0 \
+            -s "798 bytes written from data_files/server5.crt" \
+            -c "Read from server: 798 bytes read" \
+            -c "END CERTIFICATE"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+run_test    "Send file: several records" \
+            "$P_SRV response_file=data_files/send_file.txt" \
+            "$P_CLI" \
+            0 \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "Read from server: 16384 bytes read" \
+            -c "10044 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+run_test    "Send file: non-blocking, several records" \
+            "$P_SRV nbio=2 response_file=data_files/send_file.txt" \
+            "$P_CLI nbio=2" \
+            0 \
+            -S "mbedtls_ssl_send_file returned" \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "Read from server: 16384 bytes read" \
+            -c "10044 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+requires_config_enabled MBEDTLS_SSL_MAX_FRAGMENT_LENGTH
+run_test    "Send file: max_frag_len 2048" \
+            "$P_SRV response_file=data_files/send_file.txt" \
+            "$P_CLI max_frag_len=2048" \
+            0 \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "Read from server: 2048 bytes read" \
+            -c "1852 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+run_test    "Send file: CBC record splitting" \
+            "$P_SRV response_file=data_files/send_file.txt" \
+            "$P_CLI force_version=tls1 \
+             force_ciphersuite=TLS-RSA-WITH-AES-128-CBC-SHA" \
+            0 \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "Read from server: 1 bytes read" \
+            -c "16383 bytes read" \
+            -c "10043 bytes read"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+requires_config_enabled MBEDTLS_GCM_C
+run_test    "Send file: GCM, encrypted from the mapping" \
+            "$P_SRV debug_level=3 response_file=data_files/send_file.txt" \
+            "$P_CLI force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256" \
+            0 \
+            -s "encrypt record from caller buffer" \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "10044 bytes read" \
+            -c "line 00508: 0123456789"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+requires_config_enabled MBEDTLS_CCM_C
+run_test    "Send file: CCM, non-blocking, encrypted from the mapping" \
+            "$P_SRV debug_level=3 nbio=2 response_file=data_files/send_file.txt" \
+            "$P_CLI nbio=2 force_ciphersuite=TLS-RSA-WITH-AES-128-CCM" \
+            0 \
+            -s "encrypt record from caller buffer" \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "10044 bytes read" \
+            -c "line 00508: 0123456789"
+
+requires_config_enabled MBEDTLS_SSL_SEND_FILE
+run_test    "Send file: CBC, copied to the output buffer" \
+            "$P_SRV debug_level=3 response_file=data_files/send_file.txt" \
+            "$P_CLI force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256" \
+            0 \
+            -S "encrypt record from caller buffer" \
+            -s "42812 bytes written from data_files/send_file.txt" \
+            -c "10044 bytes read" \
+            -c "line 00508: 0123456789"
+
+# Tests for kernel TLS offload
+# (the kernel may lack the tls module: both outcomes must work)
+
+requires_config_enabled MBEDTLS_SSL_KTLS
+run_test    "kTLS: AES-128-GCM" \
+            "$P_SRV ktls=1 exchanges=2" \
+            "$P_CLI exchanges=2 force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256" \
+            0 \
+            -s "Offloading the record layer to the kernel" \
+            -S "mbedtls_net_ktls_offload returned" \
+            -s "Read from client: .* bytes read" \
+            -c "Read from server: .* bytes read"
+
+requires_config_enabled MBEDTLS_SSL_KTLS
+run_test    "kTLS: AES-256-GCM" \
+            "$P_SRV ktls=1" \
+            "$P_CLI force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-256-GCM-SHA384" \
+            0 \
+            -s "Offloading the record layer to the kernel" \
+            -S "mbedtls_net_ktls_offload returned" \
+            -c "Read from server: .* bytes read"
+
+requires_config_enabled MBEDTLS_SSL_KTLS
+run_test    "kTLS: large record, read-ahead" \
+            "$P_SRV ktls=1 read_ahead=1" \
+            "$P_CLI request_size=16384 force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256" \
+            0 \
+            -S "mbedtls_net_ktls_offload returned" \
+            -s "Read from client: 16384 bytes read" \
+            -c "Read from server: .* bytes read"
+
+requires_config_enabled MBEDTLS_SSL_KTLS
+run_test    "kTLS: CBC ciphersuite stays in user space" \
+            "$P_SRV ktls=1" \
+            "$P_CLI force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256" \
+            0 \
+            -s "mbedtls_net_ktls_offload returned -0x7080" \
+            -s "Read from client: .* bytes read" \
+            -c "Read from server: .* bytes read"
+
+requires_config_enabled MBEDTLS_SSL_KTLS
+run_test    "kTLS: TLS 1.1 stays in user space" \
+            "$P_SRV ktls=1" \
+            "$P_CLI force_version=tls1_1" \
+            0 \
+            -s "mbedtls_net_ktls_offload returned -0x7080" \
+            -c "Read from server: .* bytes read"
+
 # Tests for small packets
 
 requires_config_enabled MBEDTLS_SSL_PROTO_SSL3
@@ -4050,6 +4952,54 @@ run_test    "DTLS client reconnect from same port: no cookies" \
             -s "The operation timed out" \
             -S "Client initiated reconnection from same port"
 
+# Tests for serving many DTLS clients from one socket
+
+requires_config_enabled MBEDTLS_NET_MUX_C
+server_needs_more_time 1
+run_test    "DTLS mux server: one client" \
+            "$P_MUX_SRV" \
+            "$P_CLI dtls=1" \
+            0 \
+            -s "handshake done" \
+            -s "34 bytes echoed" \
+            -s "1 served" \
+            -c "34 bytes read"
+
+requires_config_enabled MBEDTLS_NET_MUX_C
+# concurrent clients would race on the shared NV seed file
+requires_config_disabled MBEDTLS_ENTROPY_NV_SEED
+not_with_valgrind # run_concurrently is not a program valgrind can run
+server_needs_more_time 1
+run_test    "DTLS mux server: 8 concurrent clients, small batches" \
+            "$P_MUX_SRV batch=2" \
+            "run_concurrently 8 $P_CLI dtls=1" \
+            0 \
+            -s "8 served" \
+            -S "returned"
+
+requires_config_enabled MBEDTLS_NET_MUX_C
+# concurrent clients would race on the shared NV seed file
+requires_config_disabled MBEDTLS_ENTROPY_NV_SEED
+not_with_valgrind # run_concurrently is not a program valgrind can run
+server_needs_more_time 1
+run_test    "DTLS mux server: client limit" \
+            "$P_MUX_SRV max_clients=1" \
+            "run_concurrently 4 $P_CLI dtls=1 hs_timeout=250-10000" \
+            0 \
+            -s "4 served"
+
+requires_config_enabled MBEDTLS_NET_MUX_C
+client_needs_more_time 2
+server_needs_more_time 1
+run_test    "DTLS mux server: proxy drops packets" \
+            -p "$P_PXY drop=5" \
+            "$P_MUX_SRV" \
+            "$P_CLI dtls=1 hs_timeout=250-10000" \
+            0 \
+            -s "handshake done" \
+            -s "34 bytes echoed" \
+            -c "34 bytes read"
+
 # Tests for various cases of client authentication with DTLS
 # (focused on handshake flows and message parsing)
 
@@ -4169,6 +5119,205 @@ run_test    "DTLS reassembly: fragmentation, nbio (openssl server)" \
             -c "found fragmented DTLS handshake message" \
             -C "error"
 
+# Tests for sending fragmented and packed handshake messages with DTLS
+
+run_test    "DTLS fragmenting: none (for reference)" \
+            "$P_SRV dtls=1 debug_level=2 auth_mode=required" \
+            "$P_CLI dtls=1 debug_level=2" \
+            0 \
+            -S "fragmenting handshake message" \
+            -C "fragmenting handshake message" \
+            -S "found fragmented DTLS handshake message" \
+            -C "found fragmented DTLS handshake message" \
+            -C "error"
+
+run_test    "DTLS fragmenting: server only" \
+            "$P_SRV dtls=1 debug_level=2 auth_mode=required mtu=512" \
+            "$P_CLI dtls=1 debug_level=2" \
+            0 \
+            -s "fragmenting handshake message" \
+            -C "fragmenting handshake message" \
+            -S "found fragmented DTLS handshake message" \
+            -c "found fragmented DTLS handshake message" \
+            -C "error"
+
+run_test    "DTLS fragmenting: both, proxy MTU" \
+            -p "$P_PXY mtu=512" \
+            "$P_SRV dtls=1 debug_level=2 auth_mode=required mtu=512" \
+            "$P_CLI dtls=1 debug_level=2 mtu=512" \
+            0 \
+            -s "fragmenting handshake message" \
+            -c "fragmenting handshake message" \
+            -s "found fragmented DTLS handshake message" \
+            -c "found fragmented DTLS handshake message" \
+            -C "error" \
+            -s "Extra-header:" \
+            -c "HTTP/1.0 200 OK"
+
+run_test    "DTLS fragmenting: both, proxy MTU, nbio" \
+            -p "$P_PXY mtu=512" \
+            "$P_SRV dtls=1 debug_level=2 auth_mode=required mtu=512 nbio=2" \
+            "$P_CLI dtls=1 debug_level=2 mtu=512 nbio=2" \
+            0 \
+            -s "fragmenting handshake message" \
+            -c "fragmenting handshake message" \
+            -C "error" \
+            -s "Extra-header:" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_RENEGOTIATION
+run_test    "DTLS fragmenting: both, proxy MTU, CBC renego" \
+            -p "$P_PXY mtu=384" \
+            "$P_SRV dtls=1 debug_level=2 auth_mode=required mtu=384 \
+             renegotiation=1 exchanges=2" \
+            "$P_CLI dtls=1 debug_level=2 mtu=384 renegotiation=1 renegotiate=1 \
+             force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256" \
+            0 \
+            -s "fragmenting handshake message" \
+            -c "fragmenting handshake message" \
+            -c "=> renegotiate" \
+            -s "=> renegotiate" \
+            -C "error" \
+            -s "Extra-header:" \
+            -c "HTTP/1.0 200 OK"
+
+client_needs_more_time 2
+run_test    "DTLS fragmenting: proxy MTU, 3d" \
+            -p "$P_PXY mtu=512 drop=8 delay=8 duplicate=8" \
+            "$P_SRV dtls=1 hs_timeout=250-10000 auth_mode=required mtu=512" \
+            "$P_CLI dtls=1 hs_timeout=250-10000 mtu=512" \
+            0 \
+            -s "Extra-header:" \
+            -c "HTTP/1.0 200 OK"
+
+run_test    "DTLS packing: flights packed by default" \
+            "$P_SRV dtls=1 debug_level=2" \
+            "$P_CLI dtls=1 debug_level=2" \
+            0 \
+            -s "next record already read" \
+            -c "next record already read" \
+            -c "HTTP/1.0 200 OK"
+
+run_test    "DTLS packing: disabled" \
+            "$P_SRV dtls=1 debug_level=2 dgram_packing=0" \
+            "$P_CLI dtls=1 debug_level=2 dgram_packing=0" \
+            0 \
+            -S "next record already read" \
+            -C "next record already read" \
+            -c "HTTP/1.0 200 OK"
+
+# Tests for the DTLS Connection ID extension
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+run_test    "Connection ID: not offered" \
+            "$P_SRV dtls=1 debug_level=3 cid=1 cid_val=dead" \
+            "$P_CLI dtls=1 debug_level=3" \
+            0 \
+            -C "adding connection_id extension" \
+            -S "found connection_id extension" \
+            -S "adding connection_id extension" \
+            -s "Connection ID not in use" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+run_test    "Connection ID: not accepted" \
+            "$P_SRV dtls=1 debug_level=3" \
+            "$P_CLI dtls=1 debug_level=3 cid=1 cid_val=beef" \
+            0 \
+            -c "client hello, adding connection_id extension" \
+            -s "found connection_id extension" \
+            -S "server hello, adding connection_id extension" \
+            -C "found connection_id extension" \
+            -c "Connection ID not in use" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+run_test    "Connection ID: both, AEAD" \
+            "$P_SRV dtls=1 debug_level=3 cid=1 cid_val=dead" \
+            "$P_CLI dtls=1 debug_level=3 cid=1 cid_val=beef \
+             force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-GCM-SHA256" \
+            0 \
+            -c "client hello, adding connection_id extension" \
+            -s "found connection_id extension" \
+            -s "server hello, adding connection_id extension" \
+            -c "found connection_id extension" \
+            -c "Connection ID in use, server CID (2 bytes): de ad" \
+            -s "Connection ID in use, client CID (2 bytes): be ef" \
+            -C "unexpected connection ID" \
+            -S "unexpected connection ID" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+run_test    "Connection ID: both, CBC, encrypt-then-MAC" \
+            "$P_SRV dtls=1 debug_level=3 cid=1 cid_val=dead" \
+            "$P_CLI dtls=1 debug_level=3 cid=1 cid_val=beef \
+             force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256" \
+            0 \
+            -c "Connection ID in use, server CID (2 bytes): de ad" \
+            -s "Connection ID in use, client CID (2 bytes): be ef" \
+            -s "using encrypt then mac" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+run_test    "Connection ID: both, CBC, MAC-then-encrypt" \
+            "$P_SRV dtls=1 debug_level=3 cid=1 cid_val=dead etm=0" \
+            "$P_CLI dtls=1 debug_level=3 cid=1 cid_val=beef \
+             force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256" \
+            0 \
+            -c "Connection ID in use, server CID (2 bytes): de ad" \
+            -s "Connection ID in use, client CID (2 bytes): be ef" \
+            -S "using encrypt then mac" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+run_test    "Connection ID: server only, empty client CID" \
+            "$P_SRV dtls=1 debug_level=3 cid=1 cid_val=dead" \
+            "$P_CLI dtls=1 debug_level=3 cid=1" \
+            0 \
+            -c "Connection ID in use, server CID (2 bytes): de ad" \
+            -s "Connection ID in use, client CID (0 bytes): ]" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+requires_config_enabled MBEDTLS_SSL_RENEGOTIATION
+run_test    "Connection ID: both, renegotiation" \
+            "$P_SRV dtls=1 debug_level=3 cid=1 cid_val=dead \
+             renegotiation=1 exchanges=2" \
+            "$P_CLI dtls=1 debug_level=3 cid=1 cid_val=beef \
+             renegotiation=1 renegotiate=1" \
+            0 \
+            -c "=> renegotiate" \
+            -s "=> renegotiate" \
+            -c "Connection ID in use, server CID (2 bytes): de ad" \
+            -s "Connection ID in use, client CID (2 bytes): be ef" \
+            -C "unexpected connection ID" \
+            -S "unexpected connection ID" \
+            -s "Extra-header:" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+client_needs_more_time 2
+run_test    "Connection ID: both, proxy 3d" \
+            -p "$P_PXY drop=5 delay=5 duplicate=5" \
+            "$P_SRV dtls=1 hs_timeout=250-10000 cid=1 cid_val=dead" \
+            "$P_CLI dtls=1 hs_timeout=250-10000 cid=1 cid_val=beef" \
+            0 \
+            -c "Connection ID in use, server CID (2 bytes): de ad" \
+            -s "Connection ID in use, client CID (2 bytes): be ef" \
+            -c "HTTP/1.0 200 OK"
+
+requires_config_enabled MBEDTLS_SSL_DTLS_CONNECTION_ID
+requires_config_enabled MBEDTLS_NET_MUX_C
+server_needs_more_time 1
+run_test    "Connection ID: mux server" \
+            "$P_MUX_SRV" \
+            "$P_CLI dtls=1 cid=1" \
+            0 \
+            -s "handshake done" \
+            -s "34 bytes echoed" \
+            -c "Connection ID in use, server CID (8 bytes)" \
+            -c "34 bytes read"
+
 # Tests for specific things with "unreliable" UDP connection
 
 not_with_valgrind # spurious resend due to timeout
@@ -4190,26 +5339,24 @@ run_test    "DTLS proxy: reference" \
 not_with_valgrind # spurious resend due to timeout
 run_test    "DTLS proxy: duplicate every packet" \
             -p "$P_PXY duplicate=1" \
-            "$P_SRV dtls=1 debug_level=2" \
-            "$P_CLI dtls=1 debug_level=2" \
+            "$P_SRV dtls=1 dgram_packing=0 debug_level=2" \
+            "$P_CLI dtls=1 dgram_packing=0 debug_level=2" \
             0 \
             -c "replayed record" \
             -s "replayed record" \
-            -c "discarding invalid record" \
-            -s "discarding invalid record" \
             -S "resend" \
             -s "Extra-header:" \
             -c "HTTP/1.0 200 OK"
 
 run_test    "DTLS proxy: duplicate every packet, server anti-replay off" \
             -p "$P_PXY duplicate=1" \
-            "$P_SRV dtls=1 debug_level=2 anti_replay=0" \
-            "$P_CLI dtls=1 debug_level=2" \
+            "$P_SRV dtls=1 dgram_packing=0 debug_level=2 anti_replay=0" \
+            "$P_CLI dtls=1 dgram_packing=0 debug_level=2" \
             0 \
             -c "replayed record" \
             -S "replayed record" \
-            -c "discarding invalid record" \
-            -s "discarding invalid record" \
+            -c "record from another epoch" \
+            -s "record from another epoch" \
             -c "resend" \
             -s "resend" \
             -s "Extra-header:" \
@@ -4263,15 +5410,28 @@ run_test    "DTLS proxy: inject invalid AD record, badmac_limit 2, exchanges 2"\
             -s "too many records with bad MAC" \
             -s "Verification of the message MAC failed"
 
+requires_config_enabled MBEDTLS_SSL_ENCRYPT_THEN_MAC
+requires_config_enabled MBEDTLS_CIPHER_MODE_CBC
+run_test    "DTLS proxy: inject truncated AD record, CBC with encrypt-then-MAC" \
+            -p "$P_PXY bad_ad=2" \
+            "$P_SRV dtls=1 debug_level=1 exchanges=2" \
+            "$P_CLI dtls=1 debug_level=1 read_timeout=100 exchanges=2 \
+             force_ciphersuite=TLS-ECDHE-RSA-WITH-AES-128-CBC-SHA256" \
+            0 \
+            -c "discarding invalid record (mac)" \
+            -s "discarding invalid record (mac)" \
+            -s "Extra-header:" \
+            -c "HTTP/1.0 200 OK" \
+            -S "too many records with bad MAC" \
+            -C "mbedtls_ssl_read returned"
+
 run_test    "DTLS proxy: delay ChangeCipherSpec" \
             -p "$P_PXY delay_ccs=1" \
-            "$P_SRV dtls=1 debug_level=1" \
-            "$P_CLI dtls=1 debug_level=1" \
+            "$P_SRV dtls=1 debug_level=1 dgram_packing=0" \
+            "$P_CLI dtls=1 debug_level=1 dgram_packing=0" \
             0 \
             -c "record from another epoch" \
             -s "record from another epoch" \
-            -c "discarding invalid record" \
-            -s "discarding invalid record" \
             -s "Extra-header:" \
             -c "HTTP/1.0 200 OK"
 